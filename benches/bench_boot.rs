@@ -0,0 +1,73 @@
+use criterion::{BatchSize, Criterion, Throughput, criterion_group, criterion_main};
+
+use riscv_emulator::{
+    Emulator,
+    board::{Board, BoardStatus, virt::RVBoardBuilder},
+};
+
+mod common;
+
+/// Firmware payload to boot, e.g. the `fw_payload.bin` built by `make build-opensbi`.
+const FIRMWARE_VAR: &str = "RVEMU_BENCH_FIRMWARE";
+/// What the UART prints once the shell is up.
+const PROMPT_VAR: &str = "RVEMU_BENCH_PROMPT";
+const DEFAULT_PROMPT: &str = "# ";
+
+/// Instructions run between two looks at the UART output.
+const SLICE_STEPS: u64 = 1 << 22;
+
+/// Run `emu` until the UART prints `prompt`, returns the instructions it took.
+fn boot_to_prompt(emu: &mut Emulator, prompt: &[u8]) -> u64 {
+    let mut output = Vec::new();
+    let mut steps = 0;
+    loop {
+        let searched = output.len().saturating_sub(prompt.len() - 1);
+        steps += emu.run_steps(SLICE_STEPS).unwrap();
+        output.extend(emu.take_uart_output_bytes());
+        if output[searched..]
+            .windows(prompt.len())
+            .any(|w| w == prompt)
+        {
+            return steps;
+        }
+        assert!(
+            emu.board().status() != BoardStatus::Halt,
+            "The board halted before printing {:?}.",
+            String::from_utf8_lossy(prompt)
+        );
+    }
+}
+
+/// From reset to the shell prompt, only run with [`FIRMWARE_VAR`] set.
+///
+/// The throughput is the instructions of a first, untimed, boot: the later boots run about as many.
+fn bench_boot(c: &mut Criterion) {
+    let Some(path) = std::env::var_os(FIRMWARE_VAR) else {
+        eprintln!("{} is not set, skipping the boot benchmark.", FIRMWARE_VAR);
+        return;
+    };
+    let firmware = std::fs::read(&path).expect("Failed to read the firmware.");
+    let prompt = std::env::var(PROMPT_VAR).unwrap_or_else(|_| DEFAULT_PROMPT.to_string());
+    assert!(!prompt.is_empty(), "{} must not be empty", PROMPT_VAR);
+    let boot = || Emulator::from_board(common::board_from_image(&firmware, RVBoardBuilder::new()));
+
+    let steps = boot_to_prompt(&mut boot(), prompt.as_bytes());
+
+    let mut group = c.benchmark_group("boot");
+    group.sample_size(10);
+    group.throughput(Throughput::Elements(steps));
+    group.bench_function("to_shell", |b| {
+        b.iter_batched(
+            boot,
+            |mut emu| {
+                boot_to_prompt(&mut emu, prompt.as_bytes());
+                emu
+            },
+            BatchSize::PerIteration,
+        )
+    });
+    group.finish();
+}
+
+criterion_group!(benches, bench_boot);
+criterion_main!(benches);
@@ -0,0 +1,132 @@
+use criterion::{Criterion, criterion_group, criterion_main};
+
+use riscv_emulator::board::virt::RVBoardBuilder;
+
+mod common;
+
+use common::{VectorKernel, bench_kernel};
+
+/// Fetch and dispatch, through the block cache and the instruction cache.
+fn bench_icache(c: &mut Criterion) {
+    let mut group = c.benchmark_group("icache");
+
+    bench_kernel(
+        &mut group,
+        "straight_resident",
+        common::straight_line(256).board(),
+    );
+    bench_kernel(
+        &mut group,
+        "straight_thrashing",
+        common::straight_line(16384).board(),
+    );
+    bench_kernel(
+        &mut group,
+        "blocks_resident",
+        common::tiny_blocks(256).board(),
+    );
+    bench_kernel(
+        &mut group,
+        "blocks_thrashing",
+        common::tiny_blocks(8192).board(),
+    );
+
+    group.finish();
+}
+
+/// The interpreter next to the pre-decoded dispatch tier, and the compiled one with the `jit`
+/// feature, on integer kernels whose blocks are all hot.
+fn bench_dispatch(c: &mut Criterion) {
+    let mut group = c.benchmark_group("dispatch");
+
+    let tiers: [(&str, fn() -> RVBoardBuilder); _] = [
+        ("interpreted", RVBoardBuilder::new),
+        ("predecoded", || {
+            RVBoardBuilder::new().predecode_hot_blocks(true)
+        }),
+        #[cfg(feature = "jit")]
+        ("compiled", || RVBoardBuilder::new().jit_hot_blocks(true)),
+    ];
+    for (tier, builder) in tiers {
+        bench_kernel(
+            &mut group,
+            &format!("straight_{}", tier),
+            common::straight_line(256).board_with(builder()),
+        );
+        bench_kernel(
+            &mut group,
+            &format!("loads_{}", tier),
+            common::loads_from(None).board_with(builder()),
+        );
+    }
+
+    group.finish();
+}
+
+/// Data translation under Sv39, from host TLB hits to a page walk on every load.
+fn bench_tlb(c: &mut Criterion) {
+    let mut group = c.benchmark_group("tlb");
+
+    bench_kernel(&mut group, "hit", common::page_walks(16).board());
+    bench_kernel(&mut group, "host_tlb_miss", common::page_walks(384).board());
+    bench_kernel(&mut group, "page_walk", common::page_walks(1024).board());
+
+    group.finish();
+}
+
+/// F/D arithmetic, rounded on the host and in software.
+fn bench_soft_float(c: &mut Criterion) {
+    let mut group = c.benchmark_group("soft_float");
+
+    for (name, strict) in [("host_rounding", false), ("strict", true)] {
+        let board = common::float_ops().board_with(RVBoardBuilder::new().strict_float(strict));
+        bench_kernel(&mut group, name, board);
+    }
+
+    group.finish();
+}
+
+fn bench_rvv(c: &mut Criterion) {
+    let mut group = c.benchmark_group("rvv");
+
+    for (name, kernel) in [
+        ("add_i64", VectorKernel::Add),
+        ("macc_i64", VectorKernel::MulAdd),
+    ] {
+        bench_kernel(&mut group, name, common::vector_loop(kernel).board());
+    }
+
+    group.finish();
+}
+
+/// Loads dispatched to the devices, next to the same loads from RAM.
+fn bench_mmio(c: &mut Criterion) {
+    const CLINT_MTIME: i32 = 0x200_bff8;
+    const PLIC_PRIORITY1: i32 = 0xc00_0004;
+    let mut group = c.benchmark_group("mmio");
+
+    bench_kernel(&mut group, "ram", common::loads_from(None).board());
+    bench_kernel(
+        &mut group,
+        "clint_mtime",
+        common::loads_from(Some(CLINT_MTIME)).board(),
+    );
+    bench_kernel(
+        &mut group,
+        "plic_priority",
+        common::loads_from(Some(PLIC_PRIORITY1)).board(),
+    );
+
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_icache,
+    bench_dispatch,
+    bench_tlb,
+    bench_soft_float,
+    bench_rvv,
+    bench_mmio
+);
+criterion_main!(benches);
@@ -0,0 +1,90 @@
+use std::{fs, path::PathBuf};
+
+use criterion::{Criterion, Throughput, black_box, criterion_group, criterion_main};
+use xmas_elf::ElfFile;
+
+use riscv_emulator::isa::{
+    InstrLen,
+    riscv::{RawInstr, decoder::Decoder},
+};
+
+mod common;
+
+/// The instructions of `code` one after the other, each 2 or 4 bytes long as its low bits say.
+fn instr_stream(code: &[u8]) -> Vec<RawInstr> {
+    let half = |offset: usize| {
+        code.get(offset..offset + 2)
+            .map_or(0, |bytes| u16::from_le_bytes([bytes[0], bytes[1]]) as u32)
+    };
+
+    let mut instrs = Vec::new();
+    let mut offset = 0;
+    while offset + 2 <= code.len() {
+        let instr = RawInstr::from(half(offset) | (half(offset + 2) << 16));
+        offset += instr.len() as usize;
+        instrs.push(instr);
+    }
+    instrs
+}
+
+/// The `.text` of the ELFs built in `test_resources`, if any.
+fn elf_texts() -> Vec<(String, Vec<u8>)> {
+    let bin_dir = PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("test_resources/bin");
+    let Ok(entries) = fs::read_dir(&bin_dir) else {
+        return Vec::new();
+    };
+
+    let mut texts = Vec::new();
+    for path in entries
+        .filter_map(|entry| entry.ok())
+        .map(|entry| entry.path())
+    {
+        if path.extension().and_then(|s| s.to_str()) != Some("elf") {
+            continue;
+        }
+        let Some(name) = path.file_stem().and_then(|s| s.to_str()) else {
+            continue;
+        };
+        let bytes = fs::read(&path).unwrap();
+        let elf = ElfFile::new(&bytes).unwrap();
+        if let Some(text) = elf.find_section_by_name(".text") {
+            texts.push((name.to_string(), text.raw_data(&elf).to_vec()));
+        }
+    }
+    texts.sort();
+    texts
+}
+
+fn bench_decode(c: &mut Criterion) {
+    let mut group = c.benchmark_group("decoder");
+    let decoder = Decoder::new();
+
+    let kernels: Vec<u8> = [
+        common::page_walks(1),
+        common::float_ops(),
+        common::vector_loop(common::VectorKernel::MulAdd),
+        common::loads_from(None),
+        common::virtio_blk_requests(1, false),
+    ]
+    .into_iter()
+    .flat_map(|program| program.code)
+    .collect();
+
+    let streams = std::iter::once(("kernels".to_string(), kernels)).chain(elf_texts());
+    for (name, code) in streams {
+        let instrs = instr_stream(&code);
+        group.throughput(Throughput::Elements(instrs.len() as u64));
+        group.bench_function(&name, |b| {
+            b.iter(|| {
+                for &instr in instrs.iter() {
+                    black_box(decoder.decode(black_box(instr)));
+                }
+            })
+        });
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_decode);
+criterion_main!(benches);
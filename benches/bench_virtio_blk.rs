@@ -0,0 +1,51 @@
+use std::{fs::File, str::FromStr};
+
+use criterion::{BatchSize, Criterion, Throughput, criterion_group, criterion_main};
+
+use riscv_emulator::{DeviceConfig, Emulator, board::virt::RVBoardBuilder};
+
+mod common;
+
+/// Requests the guest makes in an iteration.
+const REQUESTS: u16 = 256;
+const DISK_SIZE: u64 = 1 << 20;
+
+/// Requests from submission to the used ring, through the background I/O of the device.
+///
+/// Each iteration boots a fresh board, built outside of the timing, whose guest sets up the queue
+/// and then makes its requests one at a time.
+fn bench_virtio_blk(c: &mut Criterion) {
+    let disk = std::env::temp_dir().join("rvemu-bench-blk.img");
+    File::create(&disk)
+        .and_then(|file| file.set_len(DISK_SIZE))
+        .expect("Failed to create the bench disk.");
+    let device = DeviceConfig::from_str(&format!("virtio-block:{}", disk.display())).unwrap();
+
+    let mut group = c.benchmark_group("virtio_blk");
+    group.throughput(Throughput::Bytes(
+        REQUESTS as u64 * common::BLK_REQUEST_LEN as u64,
+    ));
+
+    for (name, write) in [("read_4k", false), ("write_4k", true)] {
+        let program = common::virtio_blk_requests(REQUESTS, write);
+        group.bench_function(name, |b| {
+            b.iter_batched(
+                || {
+                    let builder =
+                        RVBoardBuilder::new().add_virtio_devices(&mut vec![device.clone()]);
+                    Emulator::from_board(program.board_with(builder))
+                },
+                |mut emu| {
+                    emu.run().unwrap();
+                    emu
+                },
+                BatchSize::PerIteration,
+            )
+        });
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_virtio_blk);
+criterion_main!(benches);
@@ -0,0 +1,620 @@
+//! Guest programs of the benchmarks, assembled here so that they need no RISC-V toolchain.
+//!
+//! Every kernel isolates one part of the emulator in an endless loop, [`bench_kernel`] times it
+//! running a fixed number of instructions at a time, so criterion's `Melem/s` are MIPS.
+
+#![allow(dead_code)]
+
+use criterion::{BenchmarkGroup, Throughput, measurement::WallTime};
+use riscv_emulator::{
+    Emulator,
+    board::virt::{RVBoardBuilder, VirtBoard},
+    load::load_bin,
+    ram::Ram,
+};
+
+/// Where the image of a [`Program`] is loaded, and where the hart starts.
+pub const RAM_BASE: u64 = 0x8000_0000;
+const PAGE_SIZE: usize = 0x1000;
+
+/// Instructions a kernel runs per iteration of the benchmark, and per warm-up.
+pub const KERNEL_STEPS: u64 = 1 << 20;
+
+pub const ZERO: u32 = 0;
+pub const T0: u32 = 5;
+pub const T1: u32 = 6;
+pub const T2: u32 = 7;
+pub const S0: u32 = 8;
+pub const S1: u32 = 9;
+pub const A0: u32 = 10;
+pub const A1: u32 = 11;
+pub const A2: u32 = 12;
+pub const A3: u32 = 13;
+pub const S2: u32 = 18;
+pub const S3: u32 = 19;
+pub const S4: u32 = 20;
+pub const S5: u32 = 21;
+pub const S6: u32 = 22;
+
+const CSR_MSTATUS: u32 = 0x300;
+const CSR_MEPC: u32 = 0x341;
+const CSR_SATP: u32 = 0x180;
+
+/// Dynamic rounding mode, `frm` is round to nearest even out of reset.
+const RM_DYN: u32 = 0b111;
+/// `e64`, `m1`, tail and mask agnostic.
+const VTYPE_E64_M1: u32 = 0b1101_1000;
+
+/// An assembler of the few RV64 instructions the kernels use.
+///
+/// Branch and jump targets are offsets from the start of the program, as given by [`Asm::here`].
+pub struct Asm {
+    words: Vec<u32>,
+}
+
+impl Asm {
+    pub fn new() -> Self {
+        Self { words: Vec::new() }
+    }
+
+    /// Offset of the next instruction.
+    pub fn here(&self) -> usize {
+        self.words.len() * 4
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        self.words
+            .iter()
+            .flat_map(|word| word.to_le_bytes())
+            .collect()
+    }
+
+    fn emit(&mut self, word: u32) -> &mut Self {
+        self.words.push(word);
+        self
+    }
+
+    fn offset_to(&self, target: usize) -> u32 {
+        (target as i64 - self.here() as i64) as u32
+    }
+
+    fn r_type(
+        &mut self,
+        funct7: u32,
+        rs2: u32,
+        rs1: u32,
+        funct3: u32,
+        rd: u32,
+        op: u32,
+    ) -> &mut Self {
+        self.emit((funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | op)
+    }
+
+    fn i_type(&mut self, imm: i32, rs1: u32, funct3: u32, rd: u32, op: u32) -> &mut Self {
+        assert!(
+            (-2048..2048).contains(&imm),
+            "immediate {} out of range",
+            imm
+        );
+        let imm = imm as u32 & 0xfff;
+        self.emit((imm << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | op)
+    }
+
+    fn s_type(&mut self, imm: i32, rs2: u32, rs1: u32, funct3: u32) -> &mut Self {
+        assert!(
+            (-2048..2048).contains(&imm),
+            "immediate {} out of range",
+            imm
+        );
+        let imm = imm as u32;
+        self.emit(
+            (((imm >> 5) & 0x7f) << 25)
+                | (rs2 << 20)
+                | (rs1 << 15)
+                | (funct3 << 12)
+                | ((imm & 0x1f) << 7)
+                | 0x23,
+        )
+    }
+
+    fn b_type(&mut self, target: usize, rs2: u32, rs1: u32, funct3: u32) -> &mut Self {
+        let offset = self.offset_to(target);
+        self.emit(
+            (((offset >> 12) & 1) << 31)
+                | (((offset >> 5) & 0x3f) << 25)
+                | (rs2 << 20)
+                | (rs1 << 15)
+                | (funct3 << 12)
+                | (((offset >> 1) & 0xf) << 8)
+                | (((offset >> 11) & 1) << 7)
+                | 0x63,
+        )
+    }
+
+    pub fn lui(&mut self, rd: u32, imm20: i32) -> &mut Self {
+        self.emit(((imm20 as u32 & 0xfffff) << 12) | (rd << 7) | 0x37)
+    }
+
+    pub fn auipc(&mut self, rd: u32, imm20: i32) -> &mut Self {
+        self.emit(((imm20 as u32 & 0xfffff) << 12) | (rd << 7) | 0x17)
+    }
+
+    pub fn addi(&mut self, rd: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.i_type(imm, rs1, 0b000, rd, 0x13)
+    }
+
+    pub fn addiw(&mut self, rd: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.i_type(imm, rs1, 0b000, rd, 0x1b)
+    }
+
+    pub fn slli(&mut self, rd: u32, rs1: u32, shamt: u32) -> &mut Self {
+        self.i_type((shamt & 0x3f) as i32, rs1, 0b001, rd, 0x13)
+    }
+
+    pub fn srli(&mut self, rd: u32, rs1: u32, shamt: u32) -> &mut Self {
+        self.i_type((shamt & 0x3f) as i32, rs1, 0b101, rd, 0x13)
+    }
+
+    pub fn add(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0, rs2, rs1, 0b000, rd, 0x33)
+    }
+
+    pub fn sub(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0b010_0000, rs2, rs1, 0b000, rd, 0x33)
+    }
+
+    pub fn or(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0, rs2, rs1, 0b110, rd, 0x33)
+    }
+
+    /// Any 32-bit value, sign extended, in at most two instructions.
+    pub fn li(&mut self, rd: u32, value: i32) -> &mut Self {
+        let hi = value.wrapping_add(0x800) >> 12;
+        let lo = value.wrapping_sub(hi.wrapping_shl(12));
+        if hi == 0 {
+            return self.addi(rd, ZERO, lo);
+        }
+        self.lui(rd, hi);
+        if lo != 0 {
+            self.addiw(rd, rd, lo);
+        }
+        self
+    }
+
+    pub fn lhu(&mut self, rd: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.i_type(imm, rs1, 0b101, rd, 0x03)
+    }
+
+    pub fn lw(&mut self, rd: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.i_type(imm, rs1, 0b010, rd, 0x03)
+    }
+
+    pub fn ld(&mut self, rd: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.i_type(imm, rs1, 0b011, rd, 0x03)
+    }
+
+    pub fn sh(&mut self, rs2: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.s_type(imm, rs2, rs1, 0b001)
+    }
+
+    pub fn sw(&mut self, rs2: u32, rs1: u32, imm: i32) -> &mut Self {
+        self.s_type(imm, rs2, rs1, 0b010)
+    }
+
+    pub fn bne(&mut self, rs1: u32, rs2: u32, target: usize) -> &mut Self {
+        self.b_type(target, rs2, rs1, 0b001)
+    }
+
+    pub fn jal(&mut self, rd: u32, target: usize) -> &mut Self {
+        let offset = self.offset_to(target);
+        self.emit(
+            (((offset >> 20) & 1) << 31)
+                | (((offset >> 1) & 0x3ff) << 21)
+                | (((offset >> 11) & 1) << 20)
+                | (((offset >> 12) & 0xff) << 12)
+                | (rd << 7)
+                | 0x6f,
+        )
+    }
+
+    pub fn j(&mut self, target: usize) -> &mut Self {
+        self.jal(ZERO, target)
+    }
+
+    fn csr(&mut self, funct3: u32, csr: u32, rs1: u32) -> &mut Self {
+        self.emit((csr << 20) | (rs1 << 15) | (funct3 << 12) | 0x73)
+    }
+
+    pub fn csrw(&mut self, csr: u32, rs1: u32) -> &mut Self {
+        self.csr(0b001, csr, rs1)
+    }
+
+    pub fn csrs(&mut self, csr: u32, rs1: u32) -> &mut Self {
+        self.csr(0b010, csr, rs1)
+    }
+
+    pub fn csrc(&mut self, csr: u32, rs1: u32) -> &mut Self {
+        self.csr(0b011, csr, rs1)
+    }
+
+    pub fn mret(&mut self) -> &mut Self {
+        self.emit(0x3020_0073)
+    }
+
+    pub fn sfence_vma(&mut self) -> &mut Self {
+        self.emit(0x1200_0073)
+    }
+
+    pub fn fcvt_d_l(&mut self, rd: u32, rs1: u32) -> &mut Self {
+        self.r_type(0b110_1001, 0b00010, rs1, RM_DYN, rd, 0x53)
+    }
+
+    pub fn fadd_d(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0b000_0001, rs2, rs1, RM_DYN, rd, 0x53)
+    }
+
+    pub fn fmul_d(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0b000_1001, rs2, rs1, RM_DYN, rd, 0x53)
+    }
+
+    pub fn fdiv_d(&mut self, rd: u32, rs1: u32, rs2: u32) -> &mut Self {
+        self.r_type(0b000_1101, rs2, rs1, RM_DYN, rd, 0x53)
+    }
+
+    pub fn fsqrt_d(&mut self, rd: u32, rs1: u32) -> &mut Self {
+        self.r_type(0b010_1101, 0, rs1, RM_DYN, rd, 0x53)
+    }
+
+    pub fn fmadd_d(&mut self, rd: u32, rs1: u32, rs2: u32, rs3: u32) -> &mut Self {
+        self.r_type((rs3 << 2) | 0b01, rs2, rs1, RM_DYN, rd, 0x43)
+    }
+
+    pub fn vsetvli(&mut self, rd: u32, rs1: u32, vtype: u32) -> &mut Self {
+        self.emit(((vtype & 0x7ff) << 20) | (rs1 << 15) | (0b111 << 12) | (rd << 7) | 0x57)
+    }
+
+    pub fn vle64_v(&mut self, vd: u32, rs1: u32) -> &mut Self {
+        self.emit((1 << 25) | (rs1 << 15) | (0b111 << 12) | (vd << 7) | 0x07)
+    }
+
+    pub fn vse64_v(&mut self, vs3: u32, rs1: u32) -> &mut Self {
+        self.emit((1 << 25) | (rs1 << 15) | (0b111 << 12) | (vs3 << 7) | 0x27)
+    }
+
+    /// An unmasked vector-vector instruction of OP-V.
+    fn op_v(&mut self, funct6: u32, funct3: u32, vd: u32, vs2: u32, vs1: u32) -> &mut Self {
+        self.emit(
+            (funct6 << 26)
+                | (1 << 25)
+                | (vs2 << 20)
+                | (vs1 << 15)
+                | (funct3 << 12)
+                | (vd << 7)
+                | 0x57,
+        )
+    }
+
+    pub fn vadd_vv(&mut self, vd: u32, vs2: u32, vs1: u32) -> &mut Self {
+        self.op_v(0b00_0000, 0b000, vd, vs2, vs1)
+    }
+
+    pub fn vmul_vv(&mut self, vd: u32, vs2: u32, vs1: u32) -> &mut Self {
+        self.op_v(0b10_0101, 0b010, vd, vs2, vs1)
+    }
+
+    pub fn vmacc_vv(&mut self, vd: u32, vs1: u32, vs2: u32) -> &mut Self {
+        self.op_v(0b10_1101, 0b010, vd, vs2, vs1)
+    }
+}
+
+/// A guest program, its code followed by the data it works on.
+pub struct Program {
+    pub code: Vec<u8>,
+    /// Loaded at [`RAM_BASE`], starts with `code`.
+    pub image: Vec<u8>,
+}
+
+impl Program {
+    /// The code of `asm`, in an image of at least `len` bytes.
+    fn new(asm: &Asm, len: usize) -> Self {
+        let code = asm.to_bytes();
+        let mut image = code.clone();
+        image.resize(len.max(code.len()), 0);
+        Self { code, image }
+    }
+
+    fn write(&mut self, offset: usize, bytes: &[u8]) {
+        self.image[offset..offset + bytes.len()].copy_from_slice(bytes);
+    }
+
+    /// A board of one hart running this program, its UART off the terminal.
+    pub fn board(&self) -> VirtBoard {
+        self.board_with(RVBoardBuilder::new())
+    }
+
+    pub fn board_with(&self, builder: RVBoardBuilder) -> VirtBoard {
+        board_from_image(&self.image, builder)
+    }
+}
+
+/// A board built by `builder` running `image` from [`RAM_BASE`], its UART off the terminal.
+pub fn board_from_image(image: &[u8], builder: RVBoardBuilder) -> VirtBoard {
+    let mut ram = Ram::new();
+    load_bin(&mut ram, image);
+    builder.detach_stdio().build(ram)
+}
+
+/// Time [`KERNEL_STEPS`] instructions at a time of `board`, which runs an endless loop.
+///
+/// The board is built and warmed up before, so neither the allocation of the RAM nor the first
+/// translation of the blocks is timed.
+pub fn bench_kernel(group: &mut BenchmarkGroup<WallTime>, name: &str, board: VirtBoard) {
+    let mut emu = Emulator::from_board(board);
+    emu.run_steps(KERNEL_STEPS).unwrap();
+
+    group.throughput(Throughput::Elements(KERNEL_STEPS));
+    group.bench_function(name, |b| b.iter(|| emu.run_steps(KERNEL_STEPS).unwrap()));
+}
+
+/// `mstatus.FS` and `mstatus.VS` to Initial, the F/D and V instructions are illegal while Off.
+fn enable_fp_and_vector(asm: &mut Asm) {
+    asm.li(T0, (1 << 13) | (1 << 9)).csrs(CSR_MSTATUS, T0);
+}
+
+/// `len` ADDIs in a loop. The loop is a single block, longer than the instruction cache once `len`
+/// is over its 2048 entries.
+pub fn straight_line(len: usize) -> Program {
+    let mut asm = Asm::new();
+    for _ in 0..len {
+        asm.addi(T0, T0, 1);
+    }
+    asm.j(0);
+    Program::new(&asm, 0)
+}
+
+/// `count` blocks of two instructions, each jumping to the next one, in a loop.
+pub fn tiny_blocks(count: usize) -> Program {
+    let mut asm = Asm::new();
+    for _ in 0..count {
+        asm.addi(T0, T0, 1);
+        let next = asm.here() + 4;
+        asm.j(next);
+    }
+    asm.j(0);
+    Program::new(&asm, 0)
+}
+
+/// Pages mapped by [`page_walks`], through two leaf page tables.
+const MAPPED_PAGES: usize = 1024;
+
+/// Loads from the first `pages` pages of RAM, one per page in turn, in S-mode under Sv39.
+///
+/// RAM is identity mapped with 4 KiB pages. Past 512 pages the accesses miss the dTLB, and past
+/// 256 the host TLB in front of it, so that every load walks the page table.
+pub fn page_walks(pages: usize) -> Program {
+    assert!(pages <= MAPPED_PAGES);
+    const ROOT: usize = PAGE_SIZE;
+    const LEVEL1: usize = 2 * PAGE_SIZE;
+    const LEVEL0: usize = 3 * PAGE_SIZE;
+
+    let mut asm = Asm::new();
+    asm.auipc(S0, 0);
+    // satp = Sv39 | PPN of the root table.
+    asm.lui(T1, (ROOT / PAGE_SIZE) as i32)
+        .add(T0, S0, T1)
+        .srli(T0, T0, 12)
+        .li(T1, 8)
+        .slli(T1, T1, 60)
+        .or(T0, T0, T1)
+        .csrw(CSR_SATP, T0)
+        .sfence_vma();
+    // mret to S-mode, right after the `mret`.
+    asm.li(T0, 0b11 << 11)
+        .csrc(CSR_MSTATUS, T0)
+        .li(T0, 0b01 << 11)
+        .csrs(CSR_MSTATUS, T0);
+    asm.auipc(T0, 0).addi(T0, T0, 16).csrw(CSR_MEPC, T0).mret();
+
+    asm.lui(T2, 1);
+    let top = asm.here();
+    asm.addi(A0, S0, 0).li(A1, pages as i32);
+    let inner = asm.here();
+    asm.ld(T0, A0, 0)
+        .add(A0, A0, T2)
+        .addi(A1, A1, -1)
+        .bne(A1, ZERO, inner)
+        .j(top);
+    assert!(asm.here() <= ROOT);
+
+    let level0_cnt = MAPPED_PAGES.div_ceil(512);
+    let mut program = Program::new(&asm, LEVEL0 + level0_cnt * PAGE_SIZE);
+    let table_pte = |offset: usize| ((((RAM_BASE as usize + offset) >> 12) << 10) | 0x1) as u64;
+    // V, R, W, X, A and D, so that the walks never write back.
+    let leaf_pte = |page: usize| ((((RAM_BASE as usize >> 12) + page) << 10) | 0xcf) as u64;
+
+    let vpn2 = (RAM_BASE >> 30) as usize & 0x1ff;
+    program.write(ROOT + vpn2 * 8, &table_pte(LEVEL1).to_le_bytes());
+    for table in 0..level0_cnt {
+        let level0 = LEVEL0 + table * PAGE_SIZE;
+        program.write(LEVEL1 + table * 8, &table_pte(level0).to_le_bytes());
+    }
+    for page in 0..MAPPED_PAGES {
+        program.write(LEVEL0 + page * 8, &leaf_pte(page).to_le_bytes());
+    }
+    program
+}
+
+/// A loop of dependent F/D operations, on values that stay finite.
+pub fn float_ops() -> Program {
+    let mut asm = Asm::new();
+    enable_fp_and_vector(&mut asm);
+    asm.li(T0, 3).fcvt_d_l(0, T0).li(T0, 7).fcvt_d_l(1, T0);
+    let top = asm.here();
+    asm.fadd_d(2, 0, 1)
+        .fmul_d(3, 2, 0)
+        .fdiv_d(4, 3, 1)
+        .fsqrt_d(5, 4)
+        .fmadd_d(6, 0, 1, 5)
+        .j(top);
+    Program::new(&asm, 0)
+}
+
+pub enum VectorKernel {
+    /// `c[i] = a[i] + b[i]`
+    Add,
+    /// `c[i] += a[i] * b[i]`
+    MulAdd,
+}
+
+/// Elements of each of the three arrays of [`vector_loop`].
+const VECTOR_LEN: i32 = 256;
+
+/// A strip-mined loop over arrays of 64-bit integers, in a loop.
+pub fn vector_loop(kernel: VectorKernel) -> Program {
+    let mut asm = Asm::new();
+    asm.auipc(S0, 0);
+    enable_fp_and_vector(&mut asm);
+    // The arrays are in the three pages after the code.
+    asm.lui(T1, 1)
+        .add(S1, S0, T1)
+        .add(S2, S1, T1)
+        .add(S3, S2, T1);
+
+    let top = asm.here();
+    asm.li(A0, VECTOR_LEN)
+        .addi(A1, S1, 0)
+        .addi(A2, S2, 0)
+        .addi(A3, S3, 0);
+    let inner = asm.here();
+    asm.vsetvli(T0, A0, VTYPE_E64_M1)
+        .vle64_v(1, A1)
+        .vle64_v(2, A2);
+    match kernel {
+        VectorKernel::Add => asm.vadd_vv(3, 1, 2),
+        VectorKernel::MulAdd => asm.vle64_v(3, A3).vmacc_vv(3, 1, 2),
+    };
+    asm.vse64_v(3, A3)
+        .slli(T1, T0, 3)
+        .add(A1, A1, T1)
+        .add(A2, A2, T1)
+        .add(A3, A3, T1)
+        .sub(A0, A0, T0)
+        .bne(A0, ZERO, inner)
+        .j(top);
+    Program::new(&asm, 4 * PAGE_SIZE)
+}
+
+/// Eight 32-bit loads from `addr` in a loop, or from the code itself if `addr` is `None`.
+pub fn loads_from(addr: Option<i32>) -> Program {
+    let mut asm = Asm::new();
+    match addr {
+        Some(addr) => asm.li(S1, addr),
+        None => asm.auipc(S1, 0),
+    };
+    let top = asm.here();
+    for _ in 0..8 {
+        asm.lw(T0, S1, 0);
+    }
+    asm.j(top);
+    Program::new(&asm, 0)
+}
+
+/// Bytes moved by each request of [`virtio_blk_requests`].
+pub const BLK_REQUEST_LEN: usize = PAGE_SIZE;
+
+/// Drive the first virtio-blk device through `requests` requests of [`BLK_REQUEST_LEN`] bytes at
+/// sector 0, one at a time, polling the used ring, then power off.
+///
+/// The queue, set up here, always hands the same descriptor chain to the device.
+pub fn virtio_blk_requests(requests: u16, write: bool) -> Program {
+    const VIRTIO_MMIO_BASE: i32 = 0x1000_1000;
+    const POWER_MANAGER_BASE: i32 = 0x10_0000;
+    const POWER_OFF_CODE: i32 = 0x5555;
+    // In the page after the code.
+    const RINGS: usize = PAGE_SIZE;
+    const DESC: usize = 0x000;
+    const AVAIL: usize = 0x100;
+    const USED: usize = 0x200;
+    const HEADER: usize = 0x300;
+    const STATUS: usize = 0x310;
+    const DATA: usize = 2 * PAGE_SIZE;
+    const QUEUE_SIZE: i32 = 8;
+
+    const ACKNOWLEDGE: i32 = 1;
+    const DRIVER: i32 = 2;
+    const DRIVER_OK: i32 = 4;
+    const FEATURES_OK: i32 = 8;
+
+    let mut asm = Asm::new();
+    asm.auipc(S0, 0)
+        .lui(T1, (RINGS / PAGE_SIZE) as i32)
+        .add(S6, S0, T1)
+        .li(S1, VIRTIO_MMIO_BASE);
+    asm.li(T0, ACKNOWLEDGE)
+        .sw(T0, S1, 0x70)
+        .li(T0, ACKNOWLEDGE | DRIVER)
+        .sw(T0, S1, 0x70);
+    // Take every feature offered, both halves.
+    for half in 0..2 {
+        asm.li(T1, half)
+            .sw(T1, S1, 0x14)
+            .lw(T0, S1, 0x10)
+            .sw(T1, S1, 0x24)
+            .sw(T0, S1, 0x20);
+    }
+    asm.li(T0, ACKNOWLEDGE | DRIVER | FEATURES_OK)
+        .sw(T0, S1, 0x70);
+    // Queue 0, the high halves of its addresses are left to 0 as RAM is below 4 GiB.
+    asm.sw(ZERO, S1, 0x30)
+        .li(T0, QUEUE_SIZE)
+        .sw(T0, S1, 0x38)
+        .addi(T0, S6, DESC as i32)
+        .sw(T0, S1, 0x80)
+        .addi(T0, S6, AVAIL as i32)
+        .sw(T0, S1, 0x90)
+        .addi(T0, S6, USED as i32)
+        .sw(T0, S1, 0xa0)
+        .li(T0, 1)
+        .sw(T0, S1, 0x44);
+    asm.li(T0, ACKNOWLEDGE | DRIVER | FEATURES_OK | DRIVER_OK)
+        .sw(T0, S1, 0x70);
+
+    asm.addi(S2, S6, AVAIL as i32)
+        .addi(S3, S6, USED as i32)
+        .li(S4, 0)
+        .li(S5, requests as i32);
+    // Every slot of the available ring is the chain at descriptor 0, a request only bumps the index.
+    let next = asm.here();
+    asm.addi(S4, S4, 1).sh(S4, S2, 2).sw(ZERO, S1, 0x50);
+    let wait = asm.here();
+    asm.lhu(T0, S3, 2).bne(T0, S4, wait).bne(S4, S5, next);
+    asm.li(T0, POWER_MANAGER_BASE)
+        .li(T1, POWER_OFF_CODE)
+        .sw(T1, T0, 0);
+    let halt = asm.here();
+    asm.j(halt);
+    assert!(asm.here() <= RINGS);
+
+    let mut program = Program::new(&asm, DATA + BLK_REQUEST_LEN);
+    let base = RAM_BASE as usize;
+    const NEXT: u16 = 1;
+    const WRITE: u16 = 2;
+    let data_flags = if write { NEXT } else { NEXT | WRITE };
+    let descs: [(usize, u32, u16, u16); 3] = [
+        (RINGS + HEADER, 16, NEXT, 1),
+        (DATA, BLK_REQUEST_LEN as u32, data_flags, 2),
+        (RINGS + STATUS, 1, WRITE, 0),
+    ];
+    for (index, (offset, len, flags, next)) in descs.into_iter().enumerate() {
+        let mut desc = Vec::with_capacity(16);
+        desc.extend_from_slice(&((base + offset) as u64).to_le_bytes());
+        desc.extend_from_slice(&len.to_le_bytes());
+        desc.extend_from_slice(&flags.to_le_bytes());
+        desc.extend_from_slice(&next.to_le_bytes());
+        program.write(RINGS + DESC + index * 16, &desc);
+    }
+    // VIRTIO_BLK_T_IN or VIRTIO_BLK_T_OUT, then the reserved word and sector 0.
+    let request_type: u32 = if write { 1 } else { 0 };
+    program.write(RINGS + HEADER, &request_type.to_le_bytes());
+    program
+}
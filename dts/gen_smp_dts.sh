@@ -0,0 +1,77 @@
+#!/bin/sh
+# Print a device tree for the virt board with <HART_CNT> harts, that the emulator runs with
+# `--smp <HART_CNT>`. It includes <BASE_DTS> (virt.dts by default), which describes the hart 0 as
+# cpu0, and adds the other harts and their interrupt lines into the PLIC (one M-mode and one S-mode
+# context per hart) and the CLINT, in the order the board wires them.
+#
+# usage: gen_smp_dts.sh <HART_CNT> [BASE_DTS] > virt-smp.dts
+
+set -e
+
+HART_CNT=${1:-1}
+BASE_DTS=${2:-virt.dts}
+case "$HART_CNT" in
+	[1-8]) ;;
+	*) echo "error: the number of harts must be in 1..=8, got '$HART_CNT'" >&2; exit 1 ;;
+esac
+
+echo "/include/ \"$BASE_DTS\""
+echo
+echo '/ {'
+echo '	cpus {'
+
+hart=1
+while [ "$hart" -lt "$HART_CNT" ]; do
+	cat <<EOF
+		cpu$hart: cpu@$hart {
+			device_type = "cpu";
+			reg = <$hart>;
+			status = "okay";
+			compatible = "riscv";
+			riscv,isa = "rv64imafd";
+			mmu-type = "riscv,sv39";
+
+			cpu${hart}_intc: interrupt-controller {
+				#interrupt-cells = <0x1>;
+				interrupt-controller;
+				compatible = "riscv,cpu-intc";
+			};
+		};
+
+EOF
+	hart=$((hart + 1))
+done
+
+echo '		cpu-map {'
+echo '			cluster0 {'
+hart=1
+while [ "$hart" -lt "$HART_CNT" ]; do
+	echo "				core$hart {"
+	echo "					cpu = <&cpu$hart>;"
+	echo '				};'
+	hart=$((hart + 1))
+done
+echo '			};'
+echo '		};'
+echo '	};'
+
+plic=''
+clint=''
+hart=0
+while [ "$hart" -lt "$HART_CNT" ]; do
+	plic="$plic &cpu${hart}_intc 0xb &cpu${hart}_intc 0x9"
+	clint="$clint &cpu${hart}_intc 0x3 &cpu${hart}_intc 0x7"
+	hart=$((hart + 1))
+done
+
+echo
+echo '	soc {'
+echo '		plic@c000000 {'
+echo "			interrupts-extended = <${plic# }>;"
+echo '		};'
+echo
+echo '		clint@2000000 {'
+echo "			interrupts-extended = <${clint# }>;"
+echo '		};'
+echo '	};'
+echo '};'
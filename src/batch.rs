@@ -0,0 +1,531 @@
+//! Run many test ELFs in one process, for riscv-tests and riscv-arch-test.
+//!
+//! An emulator process per test pays every time for the process, the RAM mapping and the devices.
+//! A batch runs its tests on a pool of threads instead, which take the tests from a shared queue
+//! and steal from each other through [`crossbeam::deque`] once it's empty, so that a long test
+//! doesn't hold up the ones queued behind it. The board is built and reset once, into a
+//! [`BoardTemplate`], and every test runs on a fork of it with its ELF loaded over, on the RAM of
+//! a finished test, see [`BoardTemplate::fork`].
+
+use std::{
+    fs, iter,
+    panic::{self, AssertUnwindSafe},
+    path::{Path, PathBuf},
+    sync::Mutex,
+    thread,
+    time::{Duration, Instant},
+};
+
+use crossbeam::deque::{Injector, Stealer, Worker};
+
+use crate::{
+    board::{
+        Board, BoardStatus,
+        virt::{BoardTemplate, VirtBoard},
+    },
+    config::arch_config::WordType,
+    isa::{DebugTarget, riscv::debugger::Address},
+    ram::Ram,
+};
+
+/// Cycles between two looks at `.tohost`.
+const TOHOST_POLL: u64 = 4096;
+
+/// A test to run.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct BatchJob {
+    pub elf: PathBuf,
+    /// Dump the riscv-arch-test signature into this file when the test ends.
+    pub signature: Option<PathBuf>,
+    /// Cycles before the test is stopped, 0 means no limit.
+    pub max_cycles: u64,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct BatchConfig {
+    /// Threads running the tests, 0 for one per host CPU.
+    pub threads: usize,
+    /// Bytes per line of the signatures, 4 or 8.
+    pub signature_granularity: u32,
+    /// See [`crate::EmulatorConfigurator::strict_float`].
+    pub strict_float: bool,
+}
+
+impl Default for BatchConfig {
+    fn default() -> Self {
+        Self {
+            threads: 0,
+            signature_granularity: 4,
+            strict_float: false,
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum BatchOutcome {
+    /// The board halted, e.g. the test powered it off.
+    Halted,
+    /// The test wrote this into `.tohost`, riscv-tests write `1` when they pass.
+    ToHost(u64),
+    /// `max_cycles` were reached.
+    MaxCycles,
+    /// The test could not be loaded or run, or its signature could not be written.
+    Error(String),
+}
+
+#[derive(Debug, Clone)]
+pub struct BatchResult {
+    pub elf: PathBuf,
+    pub outcome: BatchOutcome,
+    pub cycles: u64,
+    pub host_time: Duration,
+    /// The test dumped a signature, see [`BatchJob::signature`].
+    pub signature: bool,
+}
+
+impl BatchResult {
+    /// Whether the test passed, it wrote `1` into `.tohost`, or it halted and dumped a signature.
+    ///
+    /// A test halting without a signature failed, riscv-tests only pass through `.tohost`. An
+    /// arch-test also needs its signature checked against the reference one.
+    pub fn passed(&self) -> bool {
+        match self.outcome {
+            BatchOutcome::ToHost(code) => code == 1,
+            BatchOutcome::Halted => self.signature,
+            BatchOutcome::MaxCycles | BatchOutcome::Error(_) => false,
+        }
+    }
+}
+
+/// Parse a list of tests, one `<ELF> [<SIGNATURE>]` per line, each of them with `max_cycles`.
+///
+/// Empty lines and the lines starting with `#` are skipped.
+pub fn parse_job_list(list: &str, max_cycles: u64) -> Result<Vec<BatchJob>, String> {
+    list.lines()
+        .enumerate()
+        .map(|(index, line)| (index + 1, line.trim()))
+        .filter(|(_, line)| !line.is_empty() && !line.starts_with('#'))
+        .map(|(line_nr, line)| {
+            let mut fields = line.split_whitespace();
+            let elf = PathBuf::from(fields.next().unwrap());
+            let signature = fields.next().map(PathBuf::from);
+            if fields.next().is_some() {
+                return Err(format!(
+                    "Line {}: expected `<ELF> [<SIGNATURE>]`, got `{}`",
+                    line_nr, line
+                ));
+            }
+            Ok(BatchJob {
+                elf,
+                signature,
+                max_cycles,
+            })
+        })
+        .collect()
+}
+
+/// RAM handed from a finished test to the next one instead of mapping a new one, the fork restores
+/// the template over it.
+struct RamPool {
+    free: Mutex<Vec<Ram>>,
+}
+
+impl RamPool {
+    fn new() -> Self {
+        Self {
+            free: Mutex::new(Vec::new()),
+        }
+    }
+
+    fn take(&self) -> Ram {
+        let ram = self.free.lock().unwrap().pop();
+        ram.unwrap_or_else(VirtBoard::new_ram)
+    }
+
+    fn give(&self, ram: Ram) {
+        self.free.lock().unwrap().push(ram);
+    }
+}
+
+/// Run `jobs`, returns their results in the same order.
+///
+/// `on_result` is called on the thread of each test when it ends, e.g. to show the progress.
+pub fn run_batch(
+    jobs: Vec<BatchJob>,
+    config: &BatchConfig,
+    on_result: impl Fn(&BatchResult) + Sync,
+) -> Vec<BatchResult> {
+    let job_cnt = jobs.len();
+    let threads = match config.threads {
+        0 => thread::available_parallelism().map_or(1, |n| n.get()),
+        n => n,
+    }
+    .clamp(1, job_cnt.max(1));
+
+    let queue = Injector::new();
+    for job in jobs.into_iter().enumerate() {
+        queue.push(job);
+    }
+    let workers: Vec<Worker<(usize, BatchJob)>> =
+        (0..threads).map(|_| Worker::new_fifo()).collect();
+    let stealers: Vec<Stealer<_>> = workers.iter().map(Worker::stealer).collect();
+    let pool = RamPool::new();
+    let template = VirtBoard::test_template(config.strict_float)
+        .map_err(|e| format!("Failed to build the board template: {}", e));
+
+    let mut results: Vec<Option<BatchResult>> = vec![None; job_cnt];
+    thread::scope(|scope| {
+        let handles: Vec<_> = workers
+            .into_iter()
+            .map(|local| {
+                let (queue, stealers, pool, template, on_result) =
+                    (&queue, &stealers, &pool, &template, &on_result);
+                scope.spawn(move || {
+                    let mut done = Vec::new();
+                    while let Some((index, job)) = next_job(&local, queue, stealers) {
+                        let result = run_job(&job, config, template, pool);
+                        on_result(&result);
+                        done.push((index, result));
+                    }
+                    done
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            for (index, result) in handle.join().unwrap() {
+                results[index] = Some(result);
+            }
+        }
+    });
+
+    results.into_iter().map(Option::unwrap).collect()
+}
+
+/// The next job of a worker: its own first, then from the queue, then from the other workers.
+fn next_job<T>(local: &Worker<T>, queue: &Injector<T>, stealers: &[Stealer<T>]) -> Option<T> {
+    local.pop().or_else(|| {
+        iter::repeat_with(|| {
+            queue
+                .steal_batch_and_pop(local)
+                .or_else(|| stealers.iter().map(Stealer::steal).collect())
+        })
+        .find(|steal| !steal.is_retry())
+        .and_then(|steal| steal.success())
+    })
+}
+
+fn run_job(
+    job: &BatchJob,
+    config: &BatchConfig,
+    template: &Result<BoardTemplate, String>,
+    pool: &RamPool,
+) -> BatchResult {
+    let start = Instant::now();
+    let rst = panic::catch_unwind(AssertUnwindSafe(|| {
+        run_test(job, config, template.as_ref().map_err(Clone::clone)?, pool)
+    }));
+    let (outcome, cycles) = match rst {
+        Ok(Ok((outcome, cycles))) => (outcome, cycles),
+        Ok(Err(msg)) => (BatchOutcome::Error(msg), 0),
+        Err(payload) => {
+            let msg = payload
+                .downcast_ref::<&str>()
+                .map(|msg| msg.to_string())
+                .or_else(|| payload.downcast_ref::<String>().cloned())
+                .unwrap_or_default();
+            (BatchOutcome::Error(format!("panicked: {}", msg)), 0)
+        }
+    };
+
+    BatchResult {
+        elf: job.elf.clone(),
+        outcome,
+        cycles,
+        host_time: start.elapsed(),
+        signature: job.signature.is_some(),
+    }
+}
+
+fn run_test(
+    job: &BatchJob,
+    config: &BatchConfig,
+    template: &BoardTemplate,
+    pool: &RamPool,
+) -> Result<(BatchOutcome, u64), String> {
+    if let Some(path) = &job.signature {
+        // Like a single run, the file exists even if the test can't run.
+        fs::File::create(path)
+            .map_err(|e| format!("Failed to create signature file {}: {}", path.display(), e))?;
+    }
+
+    let bytes =
+        fs::read(&job.elf).map_err(|e| format!("Failed to read {}: {}", job.elf.display(), e))?;
+    let mut board = template
+        .fork_on(pool.take())
+        .map_err(|e| format!("Failed to fork the board: {}", e))?;
+    board.load_elf(bytes)?;
+
+    let rst = run_board(&mut board, job, config);
+    let cycles = board.clock.now();
+    if let Some(ram) = board.into_ram() {
+        pool.give(ram);
+    }
+
+    rst.map(|outcome| (outcome, cycles))
+}
+
+fn run_board(
+    board: &mut VirtBoard,
+    job: &BatchJob,
+    config: &BatchConfig,
+) -> Result<BatchOutcome, String> {
+    let tohost: Option<WordType> = board
+        .loader()
+        .and_then(|loader| loader.get_section_addr(".tohost"));
+
+    let outcome = loop {
+        if board.status() == BoardStatus::Halt {
+            break BatchOutcome::Halted;
+        }
+
+        let now = board.clock.now();
+        let budget = match job.max_cycles {
+            0 => TOHOST_POLL,
+            max_cycles if now >= max_cycles => break BatchOutcome::MaxCycles,
+            max_cycles => TOHOST_POLL.min(max_cycles - now),
+        };
+        board
+            .run_slice(budget)
+            .map_err(|e| format!("Exception: {:?}", e))?;
+
+        if let Some(tohost) = tohost {
+            let msg = board
+                .cpu
+                .read_memory::<u64>(Address::Phys(tohost))
+                .map_err(|e| format!("Failed to read .tohost: {:?}", e))?;
+            if msg != 0 {
+                break BatchOutcome::ToHost(msg);
+            }
+        }
+    };
+
+    if let Some(path) = &job.signature {
+        write_signature(board, path, config.signature_granularity)?;
+    }
+
+    Ok(outcome)
+}
+
+/// Write the riscv-arch-test signature, the memory from `begin_signature` to `end_signature`,
+/// into `out_path` with `granularity` bytes per line.
+pub fn write_signature(
+    board: &mut VirtBoard,
+    out_path: &Path,
+    granularity: u32,
+) -> Result<(), String> {
+    let loader = board
+        .loader()
+        .ok_or_else(|| "ELF loader not available; cannot resolve signature symbols".to_string())?;
+
+    let symtab = loader.get_symbol_table().ok_or_else(|| {
+        "No .symtab found in ELF; cannot resolve begin_signature/end_signature".to_string()
+    })?;
+
+    let begin = symtab
+        .func_addr_by_name("begin_signature")
+        .ok_or_else(|| "Symbol begin_signature not found".to_string())?;
+    let end = symtab
+        .func_addr_by_name("end_signature")
+        .ok_or_else(|| "Symbol end_signature not found".to_string())?;
+
+    if end <= begin {
+        return Err(format!(
+            "Invalid signature range: begin=0x{:x}, end=0x{:x}",
+            begin, end
+        ));
+    }
+
+    let size = end - begin;
+    let step = match granularity {
+        4 => 4u64,
+        8 => 8u64,
+        other => return Err(format!("Unsupported signature granularity: {}", other)),
+    };
+
+    if size % step != 0 {
+        return Err(format!(
+            "Signature size 0x{:x} not aligned to granularity {}",
+            size, step
+        ));
+    }
+
+    let file = std::fs::File::create(out_path).map_err(|e| {
+        format!(
+            "Failed to create signature file {}: {}",
+            out_path.display(),
+            e
+        )
+    })?;
+    let mut w = std::io::BufWriter::new(file);
+
+    let mut addr = begin;
+    while addr < end {
+        match step {
+            4 => {
+                let v = board
+                    .cpu
+                    .read_memory::<u32>(Address::Phys(addr))
+                    .map_err(|e| format!("Failed to read signature @0x{:x}: {:?}", addr, e))?;
+                use std::io::Write;
+                writeln!(w, "{:08x}", v)
+                    .map_err(|e| format!("Failed to write signature: {}", e))?;
+            }
+            8 => {
+                let v = board
+                    .cpu
+                    .read_memory::<u64>(Address::Phys(addr))
+                    .map_err(|e| format!("Failed to read signature @0x{:x}: {:?}", addr, e))?;
+                use std::io::Write;
+                writeln!(w, "{:016x}", v)
+                    .map_err(|e| format!("Failed to write signature: {}", e))?;
+            }
+            _ => unreachable!(),
+        }
+        addr += step;
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ram_config;
+
+    /// A RISC-V ELF with `code` as its only segment, at the start of RAM.
+    fn tiny_elf(code: &[u32]) -> Vec<u8> {
+        const EHDR_LEN: u64 = 64;
+        const PHDR_LEN: u64 = 56;
+        let base = ram_config::BASE_ADDR as u64;
+        let code_len = 4 * code.len() as u64;
+
+        let mut elf = Vec::new();
+        elf.extend_from_slice(b"\x7fELF\x02\x01\x01\0\0\0\0\0\0\0\0\0");
+        elf.extend_from_slice(&2u16.to_le_bytes()); // ET_EXEC
+        elf.extend_from_slice(&0xf3u16.to_le_bytes()); // EM_RISCV
+        elf.extend_from_slice(&1u32.to_le_bytes());
+        elf.extend_from_slice(&base.to_le_bytes()); // entry
+        elf.extend_from_slice(&EHDR_LEN.to_le_bytes()); // phoff
+        elf.extend_from_slice(&0u64.to_le_bytes()); // shoff
+        elf.extend_from_slice(&0u32.to_le_bytes());
+        for half in [EHDR_LEN, PHDR_LEN, 1, 64, 0, 0] {
+            elf.extend_from_slice(&(half as u16).to_le_bytes());
+        }
+
+        elf.extend_from_slice(&1u32.to_le_bytes()); // PT_LOAD
+        elf.extend_from_slice(&5u32.to_le_bytes()); // R + X
+        for word in [EHDR_LEN + PHDR_LEN, base, base, code_len, code_len, 4] {
+            elf.extend_from_slice(&word.to_le_bytes());
+        }
+
+        for instr in code {
+            elf.extend_from_slice(&instr.to_le_bytes());
+        }
+        elf
+    }
+
+    #[test]
+    fn test_parse_job_list() {
+        let list = "# riscv-arch-test\n\na.elf a.signature\n  b.elf  \n";
+        assert_eq!(
+            parse_job_list(list, 100).unwrap(),
+            vec![
+                BatchJob {
+                    elf: "a.elf".into(),
+                    signature: Some("a.signature".into()),
+                    max_cycles: 100,
+                },
+                BatchJob {
+                    elf: "b.elf".into(),
+                    signature: None,
+                    max_cycles: 100,
+                },
+            ]
+        );
+        assert!(parse_job_list("a.elf a.signature extra", 0).is_err());
+    }
+
+    #[test]
+    fn test_passed() {
+        let result = |outcome, signature| BatchResult {
+            elf: "a.elf".into(),
+            outcome,
+            cycles: 0,
+            host_time: Duration::ZERO,
+            signature,
+        };
+        assert!(result(BatchOutcome::ToHost(1), false).passed());
+        assert!(!result(BatchOutcome::ToHost(3), true).passed());
+        assert!(!result(BatchOutcome::Halted, false).passed());
+        assert!(result(BatchOutcome::Halted, true).passed());
+        assert!(!result(BatchOutcome::MaxCycles, true).passed());
+    }
+
+    #[test]
+    fn test_run_batch() {
+        let dir = std::env::temp_dir().join(format!("rvemu-batch-{}", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let power_off = dir.join("power_off.elf");
+        let spin = dir.join("spin.elf");
+        fs::write(
+            &power_off,
+            tiny_elf(&[
+                0x001000b7, // lui x1, 0x100
+                0x00005137, // lui x2, 0x5
+                0x55510113, // addi x2, x2, 0x555
+                0x0020a023, // sw x2, 0(x1)
+                0x0000006f, // j .
+            ]),
+        )
+        .unwrap();
+        fs::write(&spin, tiny_elf(&[0x0000006f])).unwrap(); // j .
+
+        // More tests than threads, so that the RAM is reused, the spinning ones run beside the
+        // others powering off.
+        let mut jobs = Vec::new();
+        for i in 0..8 {
+            let elf = if i % 2 == 0 { &power_off } else { &spin };
+            jobs.push(BatchJob {
+                elf: elf.clone(),
+                signature: None,
+                max_cycles: 10_000,
+            });
+        }
+        jobs.push(BatchJob {
+            elf: dir.join("missing.elf"),
+            signature: None,
+            max_cycles: 0,
+        });
+
+        let config = BatchConfig {
+            threads: 3,
+            ..BatchConfig::default()
+        };
+        let results = run_batch(jobs, &config, |_| {});
+        fs::remove_dir_all(&dir).unwrap();
+
+        assert_eq!(results.len(), 9);
+        for (i, result) in results[..8].iter().enumerate() {
+            if i % 2 == 0 {
+                // Without `.tohost` or a signature, nothing says the test passed.
+                assert_eq!(result.outcome, BatchOutcome::Halted);
+                assert!(!result.passed());
+            } else {
+                assert_eq!(result.outcome, BatchOutcome::MaxCycles);
+                assert_eq!(result.cycles, 10_000);
+            }
+        }
+        assert!(matches!(results[8].outcome, BatchOutcome::Error(_)));
+    }
+}
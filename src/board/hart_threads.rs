@@ -0,0 +1,201 @@
+//! The harts of a board on host threads, one each.
+//!
+//! The board runs its harts in quanta: hart 0 on the board thread, every other hart on its own
+//! worker thread, all at once for up to [`HART_QUANTUM`] cycles. Then the board waits for all of
+//! them, advances the clock by the longest run and services the timer and the devices, like it
+//! does between two blocks of a single hart, see [`VirtBoard::run_slice`].
+//!
+//! A hart is sent to its worker for the quantum only, and sent back with the result of it, so
+//! [`RVCPU`] is `Send`, and what the harts share is `Sync`:
+//! - the guest RAM, every access to [`Ram`](crate::ram::Ram) being atomic,
+//! - the devices, each behind its own lock, see [`MemoryMapIO`],
+//! - the interrupt lines into the harts, see [`InterruptPins`],
+//! - the clock and the timer, that the board only changes between two quanta.
+//!
+//! A quantum ends early on every hart once the doorbell is rung, a hart stops at a breakpoint or a
+//! watchpoint, or the guest powers off, so that the board sees to it right away.
+//!
+//! [`VirtBoard::run_slice`]: super::virt::VirtBoard::run_slice
+//! [`MemoryMapIO`]: crate::device::mmio::MemoryMapIO
+//! [`InterruptPins`]: crate::isa::riscv::executor::InterruptPins
+
+use std::{
+    panic::{self, AssertUnwindSafe},
+    pin::Pin,
+    sync::{
+        Arc,
+        atomic::{AtomicBool, Ordering},
+    },
+    thread::{self, JoinHandle},
+};
+
+use crossbeam::channel;
+
+use crate::{
+    device::power_manager::{POWER_OFF_CODE, POWER_STATUS},
+    device_poller::Doorbell,
+    isa::riscv::{executor::RVCPU, trap::Exception},
+};
+
+/// Longest run of a hart between two synchronizations of the board, in cycles.
+///
+/// The time CSR moves and a hart parked at a `WFI` wakes up at this granularity.
+pub(super) const HART_QUANTUM: u64 = 4096;
+
+/// What ends a quantum on every hart before its cycles are run.
+struct QuantumEnd {
+    /// Set by a hart stopped at a breakpoint or a watchpoint.
+    stopped: AtomicBool,
+    doorbell: Doorbell,
+    powered_off: Arc<AtomicBool>,
+}
+
+impl QuantumEnd {
+    #[inline]
+    fn reached(&self) -> bool {
+        self.stopped.load(Ordering::Relaxed)
+            || self.doorbell.is_rung()
+            || self.powered_off.load(Ordering::Relaxed)
+            || POWER_STATUS.load(Ordering::Relaxed) == POWER_OFF_CODE
+    }
+}
+
+/// A hart sent to a worker for one quantum.
+struct Quantum {
+    hart: Pin<Box<RVCPU>>,
+    cycles: u64,
+}
+
+/// A hart sent back by the worker of the `index`th secondary hart, with the result of its quantum.
+struct QuantumEnded {
+    index: usize,
+    hart: Pin<Box<RVCPU>>,
+    rst: thread::Result<Result<u64, Exception>>,
+}
+
+/// The worker threads of the harts 1 and up of a board.
+pub(super) struct HartThreads {
+    quanta: Vec<channel::Sender<Quantum>>,
+    results: channel::Receiver<QuantumEnded>,
+    end: Arc<QuantumEnd>,
+    threads: Vec<JoinHandle<()>>,
+}
+
+impl HartThreads {
+    /// Start a worker for each of `secondary_cnt` harts.
+    pub(super) fn new(
+        secondary_cnt: usize,
+        doorbell: Doorbell,
+        powered_off: Arc<AtomicBool>,
+    ) -> Self {
+        let end = Arc::new(QuantumEnd {
+            stopped: AtomicBool::new(false),
+            doorbell,
+            powered_off,
+        });
+        let (result_tx, results) = channel::unbounded();
+
+        let mut quanta = Vec::with_capacity(secondary_cnt);
+        let mut threads = Vec::with_capacity(secondary_cnt);
+        for index in 0..secondary_cnt {
+            let (quantum_tx, quantum_rx) = channel::bounded::<Quantum>(1);
+            let result_tx = result_tx.clone();
+            let end = end.clone();
+
+            let thread = thread::Builder::new()
+                .name(format!("hart{}", index + 1))
+                .spawn(move || {
+                    for Quantum { mut hart, cycles } in quantum_rx.iter() {
+                        let rst = panic::catch_unwind(AssertUnwindSafe(|| {
+                            run_hart(&mut hart, cycles, &end)
+                        }));
+                        if result_tx.send(QuantumEnded { index, hart, rst }).is_err() {
+                            break;
+                        }
+                    }
+                })
+                .expect("Failed to start a hart thread");
+
+            quanta.push(quantum_tx);
+            threads.push(thread);
+        }
+
+        Self {
+            quanta,
+            results,
+            end,
+            threads,
+        }
+    }
+
+    /// Run every hart for up to `cycles` cycles at once, `first` on this thread, and return the
+    /// cycles of the longest run.
+    ///
+    /// It returns once every hart is done and back in `others`, the first exception raised if any.
+    /// A panic on a hart thread is resumed here.
+    pub(super) fn run_quantum(
+        &mut self,
+        first: &mut Pin<Box<RVCPU>>,
+        others: &mut Vec<Pin<Box<RVCPU>>>,
+        cycles: u64,
+    ) -> Result<u64, Exception> {
+        debug_assert_eq!(others.len(), self.quanta.len());
+        self.end.stopped.store(false, Ordering::Relaxed);
+
+        for (quanta, hart) in self.quanta.iter().zip(others.drain(..)) {
+            quanta
+                .send(Quantum { hart, cycles })
+                .expect("A hart thread exited");
+        }
+
+        let mut results = vec![panic::catch_unwind(AssertUnwindSafe(|| {
+            run_hart(first, cycles, &self.end)
+        }))];
+        let mut returned: Vec<Option<Pin<Box<RVCPU>>>> =
+            (0..self.quanta.len()).map(|_| None).collect();
+        for _ in 0..self.quanta.len() {
+            let QuantumEnded { index, hart, rst } =
+                self.results.recv().expect("A hart thread exited");
+            returned[index] = Some(hart);
+            results.push(rst);
+        }
+        others.extend(returned.into_iter().flatten());
+
+        let mut longest = Ok(0);
+        for rst in results {
+            match rst {
+                Ok(Ok(steps)) => longest = longest.map(|longest: u64| longest.max(steps)),
+                Ok(Err(ex)) => longest = longest.and(Err(ex)),
+                Err(payload) => panic::resume_unwind(payload),
+            }
+        }
+        longest
+    }
+}
+
+impl Drop for HartThreads {
+    fn drop(&mut self) {
+        // The workers exit once their channel is closed.
+        self.quanta.clear();
+        for thread in self.threads.drain(..) {
+            let _ = thread.join();
+        }
+    }
+}
+
+/// Run `hart` block by block for `cycles` cycles, or until it waits at a `WFI` or the quantum ends.
+fn run_hart(hart: &mut RVCPU, cycles: u64, end: &QuantumEnd) -> Result<u64, Exception> {
+    let mut steps = 0;
+    while steps < cycles {
+        steps += hart.step_block()?;
+
+        if hart.debug_stopped() {
+            end.stopped.store(true, Ordering::Relaxed);
+            break;
+        }
+        if hart.is_waiting() || end.reached() {
+            break;
+        }
+    }
+    Ok(steps)
+}
@@ -1,5 +1,14 @@
-use crate::isa::riscv::{executor::RVCPU, trap::Exception};
+use std::path::Path;
 
+use crate::{
+    isa::riscv::{executor::RVCPU, trap::Exception},
+    snapshot::SnapshotError,
+    stats::StatsReport,
+};
+
+#[cfg(feature = "multithreading")]
+mod hart_threads;
+pub mod profiler;
 pub mod virt;
 
 #[derive(Clone, Copy, PartialEq, Eq, Debug)]
@@ -17,6 +26,37 @@ pub trait Board {
 
     fn loader(&self) -> Option<&crate::load::ELFLoader>;
 
+    /// Save the whole machine into `path`, see [`crate::snapshot`].
+    fn save_snapshot_file(&mut self, _path: &Path) -> Result<(), SnapshotError> {
+        Err(SnapshotError::Unsupported)
+    }
+
+    fn restore_snapshot_file(&mut self, _path: &Path) -> Result<(), SnapshotError> {
+        Err(SnapshotError::Unsupported)
+    }
+
+    /// The statistics counters, see [`crate::stats`].
+    fn stats(&self) -> Option<StatsReport> {
+        None
+    }
+
+    /// Run about `budget` cycles at full speed, stopping early when the board halts or a
+    /// breakpoint or a watchpoint stops the hart 0, see [`RVCPU::take_debug_stop`].
+    ///
+    /// By default this steps the board, checking the breakpoints before every step.
+    fn run_until_stop(&mut self, budget: u64) -> Result<(), Exception> {
+        for _ in 0..budget {
+            if self.status() == BoardStatus::Halt
+                || self.cpu().debug_stopped()
+                || self.cpu_mut().at_breakpoint()
+            {
+                break;
+            }
+            self.step()?;
+        }
+        Ok(())
+    }
+
     fn run(&mut self) {
         while self.status() == BoardStatus::Running {
             if let Err(e) = self.step() {
@@ -0,0 +1,247 @@
+//! Sampling profiler of the guest.
+//!
+//! The board records the pc of every hart each `interval` cycles, into a buffer allocated once.
+//! The samples are only resolved to symbols when the report is made, so that a sample costs a
+//! compare and a store. When the buffer is full, every other sample is dropped and the interval
+//! doubles, so the samples stay evenly spread over the whole run.
+//!
+//! The pc is sampled between two blocks, see [`VirtBoard::run_slice`](super::virt::VirtBoard::run_slice),
+//! so a sample lands on the first instruction of a block, up to a block late.
+
+use std::{
+    collections::HashMap,
+    io::{self, Write},
+};
+
+use crate::{config::arch_config::WordType, load::SymTab};
+
+/// Samples kept before the interval doubles, over all harts.
+const MAX_SAMPLES: usize = 1 << 20;
+
+pub struct Profiler {
+    interval: u64,
+    next_sample: u64,
+    hart_cnt: usize,
+    /// The pc of each hart, `hart_cnt` per sample, up to `max_len`.
+    samples: Vec<WordType>,
+    max_len: usize,
+}
+
+impl Profiler {
+    /// A profiler taking its first sample `interval` cycles after `now`.
+    pub fn new(interval: u64, hart_cnt: usize, now: u64) -> Self {
+        assert!(
+            interval > 0,
+            "the profile interval must be at least one cycle"
+        );
+        let max_len = MAX_SAMPLES / hart_cnt * hart_cnt;
+        Self {
+            interval,
+            next_sample: now + interval,
+            hart_cnt,
+            samples: Vec::with_capacity(max_len),
+            max_len,
+        }
+    }
+
+    /// Cycle at which the next sample is due.
+    #[inline]
+    pub fn next_sample(&self) -> u64 {
+        self.next_sample
+    }
+
+    /// Record the pc of every hart at cycle `now`.
+    pub fn sample(&mut self, now: u64, pcs: impl Iterator<Item = WordType>) {
+        if self.samples.len() == self.max_len {
+            self.decimate();
+        }
+        self.samples.extend(pcs);
+        debug_assert!(self.samples.len() % self.hart_cnt == 0);
+        // On the grid of the interval, so that a sample stands for `interval` cycles however late
+        // it was taken.
+        let missed = now.saturating_sub(self.next_sample) / self.interval;
+        self.next_sample += (missed + 1) * self.interval;
+    }
+
+    fn decimate(&mut self) {
+        let hart_cnt = self.hart_cnt;
+        let kept = self.samples.len() / hart_cnt / 2;
+        for index in 0..kept {
+            let (from, to) = ((2 * index + 1) * hart_cnt, index * hart_cnt);
+            self.samples.copy_within(from..from + hart_cnt, to);
+        }
+        self.samples.truncate(kept * hart_cnt);
+        self.interval *= 2;
+    }
+
+    /// Attribute the samples to the symbol each pc is in.
+    pub fn report(&self, symtab: Option<&SymTab>) -> ProfileReport {
+        let symbols = SymbolIndex::new(symtab);
+        let mut counts: HashMap<(usize, &str), u64> = HashMap::new();
+        for (index, &pc) in self.samples.iter().enumerate() {
+            let hart = if self.hart_cnt > 1 {
+                index % self.hart_cnt
+            } else {
+                0
+            };
+            *counts.entry((hart, symbols.name_of(pc))).or_default() += 1;
+        }
+
+        let mut entries: Vec<ProfileEntry> = counts
+            .into_iter()
+            .map(|((hart, symbol), samples)| ProfileEntry {
+                hart: (self.hart_cnt > 1).then_some(hart),
+                symbol: symbol.to_string(),
+                samples,
+            })
+            .collect();
+        entries.sort_by(|a, b| {
+            b.samples
+                .cmp(&a.samples)
+                .then_with(|| (a.hart, &a.symbol).cmp(&(b.hart, &b.symbol)))
+        });
+
+        ProfileReport {
+            interval: self.interval,
+            total_samples: self.samples.len() as u64,
+            entries,
+        }
+    }
+}
+
+/// The symbols sorted by address, without the ELF mapping symbols (`$x`, `$d`) and unnamed ones.
+struct SymbolIndex<'a> {
+    symbols: Vec<(u64, &'a str)>,
+}
+
+impl<'a> SymbolIndex<'a> {
+    const UNKNOWN: &'static str = "[unknown]";
+
+    fn new(symtab: Option<&'a SymTab>) -> Self {
+        let mut symbols: Vec<(u64, &str)> = symtab
+            .into_iter()
+            .flat_map(|symtab| symtab.iter())
+            .filter(|(name, _)| !name.is_empty() && !name.starts_with('$'))
+            .map(|(name, &addr)| (addr, name.as_str()))
+            .collect();
+        symbols.sort_unstable();
+        symbols.dedup_by_key(|(addr, _)| *addr);
+        Self { symbols }
+    }
+
+    fn name_of(&self, pc: WordType) -> &'a str {
+        let index = self.symbols.partition_point(|&(addr, _)| addr <= pc as u64);
+        match index {
+            0 => Self::UNKNOWN,
+            index => self.symbols[index - 1].1,
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ProfileEntry {
+    /// Only told apart on boards of several harts.
+    pub hart: Option<usize>,
+    pub symbol: String,
+    pub samples: u64,
+}
+
+/// The samples of a run by symbol, the most sampled first.
+pub struct ProfileReport {
+    /// Cycles between two samples, at the end of the run.
+    pub interval: u64,
+    pub total_samples: u64,
+    pub entries: Vec<ProfileEntry>,
+}
+
+impl ProfileReport {
+    /// Estimated instructions run in an entry, a board cycle being one instruction per hart.
+    pub fn instructions(&self, entry: &ProfileEntry) -> u64 {
+        entry.samples * self.interval
+    }
+
+    /// The folded stacks read by `flamegraph.pl` and `inferno-flamegraph`, one line per symbol.
+    ///
+    /// The stacks are a single frame, under one frame per hart on boards of several harts.
+    pub fn write_folded(&self, out: &mut dyn Write) -> io::Result<()> {
+        for entry in self.entries.iter() {
+            match entry.hart {
+                Some(hart) => writeln!(out, "hart{};{} {}", hart, entry.symbol, entry.samples)?,
+                None => writeln!(out, "{} {}", entry.symbol, entry.samples)?,
+            }
+        }
+        Ok(())
+    }
+
+    /// The `count` most sampled symbols as a table.
+    pub fn write_table(&self, out: &mut dyn Write, count: usize) -> io::Result<()> {
+        writeln!(
+            out,
+            "{} samples, one every {} cycles:",
+            self.total_samples, self.interval
+        )?;
+        writeln!(out, "{:>8} {:>14}  symbol", "share", "instructions")?;
+        for entry in self.entries.iter().take(count) {
+            let share = 100.0 * entry.samples as f64 / self.total_samples.max(1) as f64;
+            let symbol = match entry.hart {
+                Some(hart) => format!("hart{}: {}", hart, entry.symbol),
+                None => entry.symbol.clone(),
+            };
+            writeln!(
+                out,
+                "{:>7.2}% {:>14}  {}",
+                share,
+                self.instructions(entry),
+                symbol
+            )?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_samples_fold_by_symbol() {
+        let symtab = SymTab::from(&[
+            ("_start".to_string(), 0x8000_0000),
+            ("$x".to_string(), 0x8000_0010),
+            ("main".to_string(), 0x8000_0100),
+        ]);
+
+        let mut profiler = Profiler::new(10, 1, 0);
+        for (cycle, pc) in [0x8000_0104, 0x8000_0010, 0x8000_0200, 0x1000]
+            .into_iter()
+            .enumerate()
+        {
+            profiler.sample(10 * cycle as u64, std::iter::once(pc));
+        }
+        let report = profiler.report(Some(&symtab));
+
+        let mut folded = Vec::new();
+        report.write_folded(&mut folded).unwrap();
+        assert_eq!(
+            String::from_utf8(folded).unwrap(),
+            "main 2\n[unknown] 1\n_start 1\n"
+        );
+        assert_eq!(report.instructions(&report.entries[0]), 20);
+    }
+
+    #[test]
+    fn test_full_buffer_doubles_interval() {
+        let mut profiler = Profiler::new(1, 2, 0);
+        let capacity = profiler.max_len;
+        for cycle in 0..(capacity / 2) as u64 {
+            profiler.sample(cycle, [cycle as WordType, 0].into_iter());
+        }
+        assert_eq!(profiler.samples.len(), capacity);
+
+        profiler.sample(capacity as u64, [1, 0].into_iter());
+        assert_eq!(profiler.interval, 2);
+        assert_eq!(profiler.samples.len(), capacity / 2 + 2);
+        // The odd samples are kept.
+        assert_eq!(profiler.samples[..4], [1, 0, 3, 0]);
+    }
+}
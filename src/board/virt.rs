@@ -1,11 +1,16 @@
 use std::{
     any::TypeId,
-    cell::{RefCell, UnsafeCell},
     collections::HashMap,
+    fs::{self, File},
     hint::cold_path,
+    io::{self, BufWriter, Write},
+    path::Path,
     pin::Pin,
-    rc::Rc,
-    sync::atomic::Ordering,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicBool, Ordering},
+    },
+    time::Duration,
 };
 
 use crossbeam::channel;
@@ -13,13 +18,17 @@ use crossbeam::channel;
 use crate::{
     DeviceConfig, EMULATOR_CONFIG,
     background::BackgroundExecutor,
-    board::{Board, BoardStatus},
-    byte_io::{ByteSinkExt, ByteSource},
+    board::{
+        Board, BoardStatus,
+        profiler::{ProfileReport, Profiler},
+    },
+    byte_io::{ByteSinkExt, ByteSource, UartOutput},
     device::{
         self, DeviceTrait, IdAllocator,
         aclint::Clint,
         config::{
-            CLINT_BASE, CLINT_SIZE, PLIC_BASE, PLIC_SIZE, POWER_MANAGER_BASE, POWER_MANAGER_SIZE,
+            CLINT_BASE, CLINT_SIZE, MAX_HART_CNT, PLIC_BASE, PLIC_SIZE, POWER_MANAGER_BASE,
+            POWER_MANAGER_SIZE, VIRTIO_IRQ_BASE,
         },
         fast_uart::{FastUart16550, UartBytePort},
         mmio::{MemoryMapIO, MemoryMapItem},
@@ -34,35 +43,48 @@ use crate::{
         },
     },
     device_poller::DevicePoller,
-    isa::riscv::{
-        executor::RVCPU,
-        mmu::VirtAddrManager,
-        trap::{Exception, Interrupt},
+    isa::{
+        DebugTarget,
+        riscv::{
+            executor::RVCPU,
+            mmu::VirtAddrManager,
+            trap::{Exception, Interrupt},
+        },
     },
     load::{ELFLoader, load_bin},
     ram::Ram,
+    snapshot::{
+        SharedSnapshot, Snapshot, SnapshotError, SnapshotImage, StateWriter, write_snapshot,
+    },
+    stats::{self, BlkStats, StatsReport},
+    trace::{self, HartTracer, TraceFilter},
     vclock::{Timer, VirtualClockRef},
 };
 
+#[cfg(feature = "multithreading")]
+use crate::board::hart_threads::{HART_QUANTUM, HartThreads};
 #[cfg(feature = "test-device")]
 use crate::device::test_device::TestDevice;
 
+/// Takes `&self`: a line into a hart is driven from the threads of the other harts, see
+/// [`InterruptPins`](crate::isa::riscv::executor::InterruptPins).
 pub trait RiscvIRQHandler {
-    fn handle_irq(&mut self, interrupt: Interrupt, level: bool);
+    fn handle_irq(&self, interrupt: Interrupt, level: bool);
 }
 
 pub trait RiscvIRQSource {
     fn set_irq_line(&mut self, line: IRQLine, id: usize);
 }
 
-/// NOTE: Only used in single-threaded contexts.
+/// Clones drive the same interrupt of the same hart, e.g. from a timer callback.
+#[derive(Clone)]
 pub struct IRQLine {
-    target: *mut dyn RiscvIRQHandler,
+    target: Arc<dyn RiscvIRQHandler + Send + Sync>,
     interrupt_nr: Interrupt,
 }
 
 impl IRQLine {
-    pub fn new(target: *mut dyn RiscvIRQHandler, interrupt_nr: Interrupt) -> Self {
+    pub fn new(target: Arc<dyn RiscvIRQHandler + Send + Sync>, interrupt_nr: Interrupt) -> Self {
         Self {
             target,
             interrupt_nr,
@@ -70,19 +92,32 @@ impl IRQLine {
     }
 
     pub fn set_irq(&mut self, level: bool) {
-        unsafe { &mut *self.target }.handle_irq(self.interrupt_nr, level);
+        self.target.handle_irq(self.interrupt_nr, level);
     }
 }
 
-const PLIC_FREQUENCY_DIVISION: usize = 128;
+/// Without a worker thread, the device poll tasks only run when the board runs them,
+/// so the board does it at least this often, in cycles.
+#[cfg(not(feature = "multithreading"))]
+const DEVICE_POLL_INTERVAL: u64 = 128;
+
+/// Longest host time an idle board sleeps in [`VirtBoard::run_slice`] without a device ringing.
+const IDLE_WAIT: Duration = Duration::from_millis(10);
 
 pub struct RVBoardBuilder {
-    extra_plic_devices: Vec<Rc<RefCell<dyn DeviceTrait>>>,
+    extra_plic_devices: Vec<Arc<Mutex<dyn DeviceTrait>>>,
     virtio_devices: Vec<DeviceConfig>,
     mmio_items: Vec<MemoryMapItem>,
     id_allocators: HashMap<TypeId, IdAllocator>,
     device_poller: DevicePoller,
     background: BackgroundExecutor,
+    hart_cnt: usize,
+    stdio: bool,
+    uart_output: UartOutput,
+    strict_float: bool,
+    predecode_hot_blocks: bool,
+    #[cfg(feature = "jit")]
+    jit_hot_blocks: bool,
 }
 
 impl RVBoardBuilder {
@@ -96,12 +131,57 @@ impl RVBoardBuilder {
             id_allocators: HashMap::new(),
             device_poller: DevicePoller::new(plic_irq_tx, plic_irq_rx),
             background: BackgroundExecutor::new(),
+            hart_cnt: 1,
+            stdio: true,
+            uart_output: UartOutput::default(),
+            strict_float: false,
+            predecode_hot_blocks: false,
+            #[cfg(feature = "jit")]
+            jit_hot_blocks: false,
         }
     }
 
+    /// Number of harts, at most [`MAX_HART_CNT`].
+    pub fn hart_cnt(mut self, hart_cnt: usize) -> Self {
+        self.hart_cnt = hart_cnt;
+        self
+    }
+
+    /// Leave the UART off the standard I/O of the process, it is then only reached through
+    /// [`VirtBoard::uart_port`].
+    pub fn detach_stdio(mut self) -> Self {
+        self.stdio = false;
+        self
+    }
+
+    /// Where the UART output goes while the board is on the standard I/O of the process.
+    pub fn uart_output(mut self, output: UartOutput) -> Self {
+        self.uart_output = output;
+        self
+    }
+
+    /// Round every F/D result in software, see [`SoftFPU::strict`](crate::fpu::soft_float::SoftFPU::strict).
+    pub fn strict_float(mut self, strict: bool) -> Self {
+        self.strict_float = strict;
+        self
+    }
+
+    /// Run the hot blocks as pre-decoded ops, see [`RVCPU::set_predecode_hot_blocks`].
+    pub fn predecode_hot_blocks(mut self, enable: bool) -> Self {
+        self.predecode_hot_blocks = enable;
+        self
+    }
+
+    /// Run the hot blocks compiled to host code, see [`RVCPU::set_jit_hot_blocks`].
+    #[cfg(feature = "jit")]
+    pub fn jit_hot_blocks(mut self, enable: bool) -> Self {
+        self.jit_hot_blocks = enable;
+        self
+    }
+
     pub fn add_plic_device<D: device::MemMappedDeviceTrait + 'static>(
         mut self,
-        device: Rc<RefCell<D>>,
+        device: Arc<Mutex<D>>,
     ) -> Self {
         let type_id = TypeId::of::<D>();
         let allocator = self
@@ -110,10 +190,11 @@ impl RVBoardBuilder {
             .or_insert_with(|| device::IdAllocator::new::<D>(0, stringify!(D).to_string()));
 
         let info = allocator.get();
+        let name = std::any::type_name::<D>().rsplit("::").next().unwrap();
         self.mmio_items
-            .push(MemoryMapItem::new(info.base, info.size, device.clone()));
+            .push(MemoryMapItem::new(info.base, info.size, device.clone()).named(name));
 
-        if let Some(event) = device.borrow_mut().get_poll_event() {
+        if let Some(event) = device.lock().unwrap().get_poll_event() {
             self.device_poller.add_event(event);
         }
 
@@ -127,40 +208,46 @@ impl RVBoardBuilder {
         self
     }
 
-    pub fn build(mut self, ram: Ram) -> VirtBoard {
+    pub fn build(mut self, mut ram: Ram) -> VirtBoard {
+        assert!(
+            (1..=MAX_HART_CNT).contains(&self.hart_cnt),
+            "The number of harts must be in 1..={}",
+            MAX_HART_CNT
+        );
+        ram.set_hart_cnt(self.hart_cnt);
+
         let clock = VirtualClockRef::new();
-        let timer = Rc::new(UnsafeCell::new(Timer::new(clock.clone())));
-        let ram_ref = Rc::new(UnsafeCell::new(ram));
+        let timer = Arc::new(Mutex::new(Timer::new(clock.clone())));
+        let ram_ref = Arc::new(ram);
 
         // Construct devices
         let (uart1, uart_port1) = FastUart16550::new();
-        let uart1 = Rc::new(RefCell::new(uart1));
+        let uart1 = Arc::new(Mutex::new(uart1));
         self = self.add_plic_device(uart1);
 
         #[cfg(feature = "native-cli")]
-        {
-            use crate::byte_io::ByteSource;
-            use std::io::IsTerminal;
-
-            // TODO: make this configurable
+        if self.stdio {
             // uart <-> std I/O
-            use crate::{byte_io::TerminalIOContext, device_poller::PollingFnWrapper};
-
-            let mut ctx = TerminalIOContext::new();
-            let mut uart_port1 = uart_port1.clone();
+            use crate::{
+                byte_io::{HostOutput, StdioBridge, TerminalIOContext},
+                device_poller::PollingFnWrapper,
+            };
 
-            let input_term = std::io::stdin().is_terminal();
+            let output = match &self.uart_output {
+                UartOutput::Stdout { flush_interval } => HostOutput::stdout(*flush_interval),
+                UartOutput::File(path) => HostOutput::file(path).unwrap_or_else(|err| {
+                    panic!(
+                        "Failed to create UART output file {}: {}",
+                        path.display(),
+                        err
+                    )
+                }),
+            };
+            let mut bridge = StdioBridge::new(TerminalIOContext::new(output), uart_port1.clone());
 
             self.device_poller
                 .add_event(Box::new(PollingFnWrapper::new(move || {
-                    // stdin -> uart
-                    if input_term {
-                        ctx.drain_to(&mut uart_port1);
-                    }
-
-                    // uart -> stdout
-                    uart_port1.drain_to(&mut ctx);
-
+                    bridge.poll();
                     None
                 })));
         }
@@ -168,9 +255,10 @@ impl RVBoardBuilder {
         const MTIME_OFFSET: u64 = 0xbff8;
         const MTIMECMP_OFFSET: u64 = 0x4000;
 
-        let power_manager = Rc::new(RefCell::new(PowerManager::new()));
-        let clint = Rc::new(RefCell::new(Clint::new(
-            1,
+        let power_manager = Arc::new(Mutex::new(PowerManager::new()));
+        let powered_off = power_manager.lock().unwrap().powered_off();
+        let clint = Arc::new(Mutex::new(Clint::new(
+            self.hart_cnt as u32,
             0,
             MTIME_OFFSET,
             MTIMECMP_OFFSET,
@@ -179,99 +267,149 @@ impl RVBoardBuilder {
         )));
 
         // PLIC init.
-        let plic = Rc::new(RefCell::new(PLIC::new()));
-        let poller_plic_irq_line = PlicIRQLine::new(&mut *plic.borrow_mut());
+        let plic = Arc::new(Mutex::new(PLIC::new()));
+        plic.lock()
+            .unwrap()
+            .set_doorbell(self.device_poller.doorbell().clone());
+        let poller_plic_irq_line = PlicIRQLine::new(plic.clone());
         self.device_poller.set_irq_line(poller_plic_irq_line, 0);
 
         self.mmio_items.append(&mut vec![
-            MemoryMapItem::new(POWER_MANAGER_BASE, POWER_MANAGER_SIZE, power_manager),
-            MemoryMapItem::new(CLINT_BASE, CLINT_SIZE, clint.clone()),
-            MemoryMapItem::new(PLIC_BASE, PLIC_SIZE, plic.clone()),
+            MemoryMapItem::new(POWER_MANAGER_BASE, POWER_MANAGER_SIZE, power_manager)
+                .named("PowerManager"),
+            MemoryMapItem::new(CLINT_BASE, CLINT_SIZE, clint.clone()).named("CLINT"),
+            MemoryMapItem::new(PLIC_BASE, PLIC_SIZE, plic.clone()).named("PLIC"),
         ]);
 
         // Add VirtIO device.
         let mut virtio_allocator =
             device::IdAllocator::new::<VirtIOMMIO>(0, String::from("virtio"));
-        for virtio_device_cfg in self.virtio_devices.iter() {
+        let mut disk_stats = Vec::new();
+        for (virtio_idx, virtio_device_cfg) in self.virtio_devices.iter().enumerate() {
             let virtio_device = match virtio_device_cfg.dev_type {
                 VirtIODeviceID::Block => {
-                    // TODO: Use raw pointer instead of Ram::write will break atomicity of `RVCPU`.
-                    let ram_raw_base = unsafe { &mut ram_ref.as_mut_unchecked()[0] as *mut u8 };
-                    VirtIOBlkDeviceBuilder::new(
-                        ram_raw_base,
-                        String::from(virtio_device_cfg.path.to_str().unwrap()),
-                    )
-                    .host_feature(crate::device::virtio::virtio_blk::VirtIOBlockFeature::BlockSize)
-                    .get()
+                    // DMA writes RAM through the raw pointer, and reports the written range to `Ram`
+                    // so that LR/SC reservations and decoded code on it are dropped.
+                    let ram_raw_base = ram_ref.host_ptr(0);
+                    let builder = match &virtio_device_cfg.overlay {
+                        Some(overlay) => VirtIOBlkDeviceBuilder::with_overlay(
+                            ram_raw_base,
+                            &virtio_device_cfg.path,
+                            overlay,
+                        ),
+                        None => VirtIOBlkDeviceBuilder::new(
+                            ram_raw_base,
+                            String::from(virtio_device_cfg.path.to_str().unwrap()),
+                        ),
+                    };
+                    let blk = builder
+                        .host_feature(
+                            crate::device::virtio::virtio_blk::VirtIOBlockFeature::BlockSize,
+                        )
+                        .queues(self.hart_cnt)
+                        .irq(VIRTIO_IRQ_BASE + virtio_idx as u32)
+                        .ram(ram_ref.clone())
+                        .get();
+                    disk_stats.push(blk.stats());
+                    blk
                 }
                 dev_type => {
                     panic!("unsupport device: {:#?}", dev_type);
                 }
             };
-            let virtio_mmio_device = VirtIOMMIO::new(Box::new(UnsafeCell::new(virtio_device)));
+            let mut virtio_mmio_device = VirtIOMMIO::new(Box::new(virtio_device));
+            // Completes the requests and raises the interrupt, see `virtio_blk_io`.
+            if let Some(event) = virtio_mmio_device.get_poll_event() {
+                self.device_poller.add_event(event);
+            }
             let virtio_info = virtio_allocator.get();
-            self.mmio_items.push(MemoryMapItem::new(
-                virtio_info.base,
-                virtio_info.size,
-                Rc::new(RefCell::new(virtio_mmio_device)),
-            ));
+            self.mmio_items.push(
+                MemoryMapItem::new(
+                    virtio_info.base,
+                    virtio_info.size,
+                    Arc::new(Mutex::new(virtio_mmio_device)),
+                )
+                .named("VirtIOMMIO"),
+            );
         }
 
-        let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), self.mmio_items);
-        let vaddr_manager = VirtAddrManager::from_ram_and_mmio(ram_ref.clone(), mmio);
-
-        let mut cpu = Box::pin(RVCPU::from_vaddr_manager(vaddr_manager));
-
-        // register irq line for timer.
-        clint.borrow_mut().set_irq_line(
-            IRQLine::new(
-                &mut *cpu as *mut dyn RiscvIRQHandler,
-                Interrupt::MachineTimer,
-            ),
-            0,
-        );
-        clint.borrow_mut().set_irq_line(
-            IRQLine::new(
-                &mut *cpu as *mut dyn RiscvIRQHandler,
-                Interrupt::MachineSoft,
-            ),
-            1,
-        );
-
-        cpu.time_addr = Some(CLINT_BASE + MTIME_OFFSET);
-
-        // register irq line for plic.
-        let plic_mathine_irq_line = IRQLine::new(
-            &mut *cpu as *mut dyn RiscvIRQHandler,
-            Interrupt::MachineExternal,
-        );
-        let plic_supervisor_irq_line = IRQLine::new(
-            &mut *cpu as *mut dyn RiscvIRQHandler,
-            Interrupt::SupervisorExternal,
-        );
+        // Every hart gets its own view of the address space, the devices behind it are shared,
+        // each behind its own lock.
+        let mut harts: Vec<Pin<Box<RVCPU>>> = (0..self.hart_cnt)
+            .map(|hart_id| {
+                let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), self.mmio_items.clone());
+                let vaddr_manager = VirtAddrManager::from_ram_and_mmio(ram_ref.clone(), mmio);
+
+                let mut cpu = Box::pin(RVCPU::from_vaddr_manager(vaddr_manager));
+                cpu.set_hart_id(hart_id);
+                cpu.set_strict_float(self.strict_float);
+                cpu.set_predecode_hot_blocks(self.predecode_hot_blocks);
+                #[cfg(feature = "jit")]
+                cpu.set_jit_hot_blocks(self.jit_hot_blocks);
+                cpu.time = Some(clint.lock().unwrap().mtime());
+                cpu
+            })
+            .collect();
+
+        for (hart_id, cpu) in harts.iter().enumerate() {
+            let line = |interrupt| IRQLine::new(cpu.irq_pins.clone(), interrupt);
+
+            // register irq line for timer.
+            let mut clint = clint.lock().unwrap();
+            clint.set_irq_line(line(Interrupt::MachineTimer), 2 * hart_id);
+            clint.set_irq_line(line(Interrupt::MachineSoft), 2 * hart_id + 1);
+
+            // register irq line for plic, one context for M-mode and one for S-mode.
+            let mut plic = plic.lock().unwrap();
+            plic.set_irq_line(line(Interrupt::MachineExternal), 2 * hart_id);
+            plic.set_irq_line(line(Interrupt::SupervisorExternal), 2 * hart_id + 1);
+        }
 
-        plic.borrow_mut().set_irq_line(plic_mathine_irq_line, 0);
-        plic.borrow_mut().set_irq_line(plic_supervisor_irq_line, 1);
+        let secondary_harts = harts.split_off(1);
+        let cpu = harts.pop().unwrap();
 
         // Hand the device poller's tick to the background executor and start the worker thread.
         let mut background = self.background;
         background.add_polling_task(self.device_poller.poll_task());
         background.start();
 
+        #[cfg(feature = "multithreading")]
+        let hart_threads = (!secondary_harts.is_empty()).then(|| {
+            HartThreads::new(
+                secondary_harts.len(),
+                self.device_poller.doorbell().clone(),
+                powered_off.clone(),
+            )
+        });
+
+        let mut devices = self.mmio_items.clone();
+        devices.sort();
+        let has_disks = !self.virtio_devices.is_empty();
+
         VirtBoard {
             background,
+            #[cfg(feature = "multithreading")]
+            hart_threads,
             loader: None,
             cpu,
+            secondary_harts,
+            ram: ram_ref,
+            devices,
+            has_disks,
+            disk_stats,
             clock,
             timer,
 
             device_poller: self.device_poller,
             clint,
             plic,
-            plic_freq_counter: 0,
+            #[cfg(not(feature = "multithreading"))]
+            next_device_poll: 0,
             uart_port: uart_port1,
 
             status: BoardStatus::Running,
+            powered_off,
+            profiler: None,
         }
     }
 }
@@ -280,28 +418,51 @@ pub struct VirtBoard {
     // Background threads must stop before the poller / devices they touch are dropped, so this is
     // the first field (in rust, "fields of a struct are dropped in declaration order").
     pub background: BackgroundExecutor,
+    /// The threads the secondary harts run on, they must stop before the harts are dropped too.
+    #[cfg(feature = "multithreading")]
+    hart_threads: Option<HartThreads>,
 
     pub device_poller: DevicePoller,
 
     loader: Option<ELFLoader>,
 
+    /// Hart 0, the one debuggers attach to.
     pub cpu: Pin<Box<RVCPU>>,
+    /// Harts 1 and up. With the `multithreading` feature they run on their own threads at the same
+    /// time as [`Self::cpu`], see [`hart_threads`](super::hart_threads), otherwise interleaved
+    /// with it on the board thread.
+    pub secondary_harts: Vec<Pin<Box<RVCPU>>>,
+    ram: Arc<Ram>,
+    /// Every memory mapped device, in address order.
+    devices: Vec<MemoryMapItem>,
+    has_disks: bool,
+    disk_stats: Vec<Arc<BlkStats>>,
     pub clock: VirtualClockRef,
-    pub timer: Rc<UnsafeCell<Timer>>,
+    pub timer: Arc<Mutex<Timer>>,
 
     // interrupt manager.
-    pub clint: Rc<RefCell<Clint>>,
-    pub plic: Rc<RefCell<PLIC>>,
-    pub plic_freq_counter: usize,
+    pub clint: Arc<Mutex<Clint>>,
+    pub plic: Arc<Mutex<PLIC>>,
+    /// Cycle at which the inline device poll tasks are due.
+    #[cfg(not(feature = "multithreading"))]
+    next_device_poll: u64,
 
     pub uart_port: UartBytePort,
 
     status: BoardStatus,
+    /// Set by the power manager, see [`PowerManager::powered_off`].
+    powered_off: Arc<AtomicBool>,
+    profiler: Option<Profiler>,
 }
 
 impl VirtBoard {
+    /// RAM backed as configured in [`EMULATOR_CONFIG`].
+    pub(crate) fn new_ram() -> Ram {
+        Ram::with_huge_pages(EMULATOR_CONFIG.lock().unwrap().huge_pages)
+    }
+
     pub fn from_binary(bytes: &[u8]) -> Self {
-        let mut ram = Ram::new();
+        let mut ram = Self::new_ram();
         load_bin(&mut ram, bytes);
         Self::from_ram(ram)
     }
@@ -311,7 +472,7 @@ impl VirtBoard {
     }
 
     pub fn try_from_elf(bytes: Vec<u8>) -> Result<Self, String> {
-        let mut ram = Ram::new();
+        let mut ram = Self::new_ram();
         let loader = ELFLoader::try_new(bytes).ok_or_else(|| "Invalid ELF file".to_string())?;
         loader.load_to_ram(&mut ram);
         let mut board = Self::from_ram(ram);
@@ -320,13 +481,32 @@ impl VirtBoard {
     }
 
     pub fn from_ram(ram: Ram) -> Self {
-        let builder =
-            RVBoardBuilder::new().add_virtio_devices(&mut EMULATOR_CONFIG.lock().unwrap().devices);
+        let mut config = EMULATOR_CONFIG.lock().unwrap();
+        let builder = Self::builder(config.hart_cnt, config.strict_float)
+            .predecode_hot_blocks(config.predecode_hot_blocks)
+            .uart_output(config.uart_output.clone())
+            .add_virtio_devices(&mut config.devices);
+        #[cfg(feature = "jit")]
+        let builder = builder.jit_hot_blocks(config.jit_hot_blocks);
+        drop(config);
+
+        builder.build(ram)
+    }
+
+    /// The devices every board built by [`Self::from_ram`] has, before the disks.
+    fn builder(hart_cnt: usize, strict_float: bool) -> RVBoardBuilder {
+        let builder = RVBoardBuilder::new()
+            .hart_cnt(hart_cnt)
+            .strict_float(strict_float);
 
         #[cfg(feature = "test-device")]
-        let builder = builder.add_plic_device(Rc::new(RefCell::new(TestDevice::new())));
+        let builder = builder.add_plic_device(Arc::new(Mutex::new(TestDevice::new())));
 
-        builder.build(ram)
+        builder
+    }
+
+    pub fn hart_cnt(&self) -> usize {
+        1 + self.secondary_harts.len()
     }
 
     pub fn push_uart_input(&mut self, bytes: &[u8]) {
@@ -340,40 +520,456 @@ impl VirtBoard {
     }
 }
 
-impl Board for VirtBoard {
-    fn step(&mut self) -> Result<(), Exception> {
-        self.plic_freq_counter += 1;
-        if self.plic_freq_counter >= PLIC_FREQUENCY_DIVISION {
-            self.plic_freq_counter = 0;
+impl VirtBoard {
+    /// Run the harts until the next scheduled event, returns the number of cycles run.
+    ///
+    /// The harts run block by block without looking at the devices until one of these:
+    /// - the next timer deadline ([`Timer::next_due`]) is reached,
+    /// - the interrupt doorbell is rung by a device or the PLIC,
+    /// - `budget` cycles have run,
+    /// - the board halts, or a breakpoint or a watchpoint stops the hart 0.
+    ///
+    /// Once every hart waits at a `WFI`, nothing but a timer or a device can wake them, so the clock
+    /// jumps right to the deadline. Without one, the board sleeps until the doorbell rings, for at
+    /// most [`IDLE_WAIT`] of host time, and the clock stays where it is.
+    ///
+    /// Pending device interrupts are delivered before the first block, and the timer callbacks are
+    /// run after the last one, so a slice of 1 cycle is exactly one [`Board::step`].
+    pub fn run_slice(&mut self, budget: u64) -> Result<u64, Exception> {
+        let start = self.clock.now();
+        let budget_end = start.saturating_add(budget);
+
+        self.service_devices();
+
+        loop {
+            self.step_harts(self.next_deadline().min(budget_end))?;
+
+            if let Some(profiler) = self.profiler.as_mut()
+                && self.clock.now() >= profiler.next_sample()
+            {
+                let pcs = std::iter::once(&self.cpu)
+                    .chain(self.secondary_harts.iter())
+                    .map(|hart| hart.read_pc());
+                profiler.sample(self.clock.now(), pcs);
+            }
+
+            if self.status == BoardStatus::Halt || self.cpu.debug_stopped() {
+                break;
+            }
+
+            let now = self.clock.now();
+            let deadline = self.next_deadline().min(budget_end);
+            if now >= deadline || self.device_poller.doorbell().is_rung() {
+                break;
+            }
 
-            // TODO: use external irq lines to trigger plic interrupts.
+            if self.harts_waiting() {
+                self.skip_idle(deadline);
+                break;
+            }
+        }
+
+        let mut timer = self.timer.lock().unwrap();
+        if timer.next_due().is_some_and(|due| self.clock.now() >= due) {
+            timer.tick();
+        }
+
+        Ok(self.clock.now() - start)
+    }
+
+    fn harts_waiting(&mut self) -> bool {
+        self.cpu.is_waiting()
+            && self
+                .secondary_harts
+                .iter_mut()
+                .all(|hart| hart.is_waiting())
+    }
+
+    /// Let the time pass until `deadline` with every hart waiting for an interrupt.
+    fn skip_idle(&mut self, deadline: u64) {
+        if deadline == u64::MAX {
+            self.device_poller.doorbell().wait(IDLE_WAIT);
+            return;
+        }
+
+        let cycles = deadline - self.clock.now();
+        self.clock.advance(cycles);
+        self.cpu.skip_waiting_cycles(cycles);
+        for hart in self.secondary_harts.iter_mut() {
+            hart.skip_waiting_cycles(cycles);
+        }
+    }
+
+    /// Sample the pc of the harts every `interval` cycles from now on, see [`Profiler`].
+    pub fn start_profiler(&mut self, interval: u64) {
+        self.profiler = Some(Profiler::new(interval, self.hart_cnt(), self.clock.now()));
+    }
+
+    /// The samples taken since [`Self::start_profiler`], by symbol of the loaded ELF.
+    pub fn profile_report(&self) -> Option<ProfileReport> {
+        let symtab = self
+            .loader
+            .as_ref()
+            .and_then(|loader| loader.get_symbol_table());
+        Some(self.profiler.as_ref()?.report(symtab.as_ref()))
+    }
+
+    /// Trace the instructions the harts retire from now on, into `path` for each hart as given
+    /// by [`trace::hart_trace_path`].
+    pub fn start_trace(&mut self, path: &Path, filter: TraceFilter) -> io::Result<()> {
+        if !trace::ENABLED {
+            return Err(io::Error::new(
+                io::ErrorKind::Unsupported,
+                "tracing needs the emulator built with `--features trace`",
+            ));
+        }
+
+        let hart_cnt = self.hart_cnt();
+        let harts = std::iter::once(&mut self.cpu).chain(self.secondary_harts.iter_mut());
+        for hart in harts {
+            let hart_id = hart.hart_id();
+            let path = trace::hart_trace_path(path, hart_id, hart_cnt);
+            hart.tracer = Some(Box::new(HartTracer::create(
+                &path,
+                hart_id,
+                filter.clone(),
+            )?));
+        }
+        Ok(())
+    }
+
+    /// Write out the traces started by [`Self::start_trace`], they are also written out when the
+    /// board is dropped.
+    pub fn finish_trace(&mut self) -> io::Result<()> {
+        let harts = std::iter::once(&mut self.cpu).chain(self.secondary_harts.iter_mut());
+        for hart in harts {
+            if let Some(mut tracer) = hart.tracer.take() {
+                tracer.finish()?;
+            }
+        }
+        Ok(())
+    }
+
+    /// The counters of the board so far, `None` without the `stats` feature.
+    pub fn stats(&self) -> Option<StatsReport> {
+        if !stats::ENABLED {
+            return None;
+        }
+
+        let harts = std::iter::once(&self.cpu).chain(self.secondary_harts.iter());
+        let mut report = StatsReport::from_harts(self.clock.now(), harts.map(|hart| &**hart));
+        report.disks = self
+            .disk_stats
+            .iter()
+            .map(|disk| (&**disk).into())
+            .collect();
+        let poll = self.device_poller.stats();
+        report.poll_rounds = poll.rounds.get();
+        report.poll_busy_rounds = poll.busy_rounds.get();
+        report.poll_interrupts = poll.interrupts.get();
+        Some(report)
+    }
+
+    /// The earliest cycle at which something outside the harts has to run.
+    #[inline]
+    fn next_deadline(&self) -> u64 {
+        let due = self.timer.lock().unwrap().next_due().unwrap_or(u64::MAX);
+
+        #[cfg(not(feature = "multithreading"))]
+        let due = due.min(self.next_device_poll);
+
+        due
+    }
+
+    /// Forward the device interrupts to the PLIC and re-run its arbitration,
+    /// only when the doorbell says that something changed.
+    fn service_devices(&mut self) {
+        // The poll tasks run inline, and ring the doorbell themselves if they produced interrupts.
+        #[cfg(not(feature = "multithreading"))]
+        if self.clock.now() >= self.next_device_poll {
+            self.next_device_poll = self.clock.now() + DEVICE_POLL_INTERVAL;
             self.background.poll_once();
-            self.device_poller.trigger_external_interrupt();
+        }
 
-            self.plic.borrow_mut().try_get_interrupt(0);
-            self.plic.borrow_mut().try_get_interrupt(1);
+        if !self.device_poller.doorbell().take() {
+            return;
         }
-        self.cpu.step()?;
-        self.clock.advance(1);
 
-        // TODO: We can simply read from `PowerManager` if VirtBoard owns `PowerManager`.
-        if self.clock.now() % 32 == 0 && POWER_STATUS.load(Ordering::Acquire).eq(&POWER_OFF_CODE) {
+        self.device_poller.trigger_external_interrupt();
+
+        let mut plic = self.plic.lock().unwrap();
+        for context in 0..2 * self.hart_cnt() {
+            plic.try_get_interrupt(context);
+        }
+    }
+
+    /// Run the harts a while towards `deadline` and advance the clock, halting the board on power
+    /// off.
+    ///
+    /// The harts run one block each, or with their own threads a quantum of up to
+    /// [`HART_QUANTUM`] cycles all at once. The clock advances by the longest run so that all harts
+    /// share one timeline.
+    #[inline]
+    fn step_harts(&mut self, deadline: u64) -> Result<(), Exception> {
+        #[cfg(feature = "multithreading")]
+        let steps = match self.hart_threads.as_mut() {
+            Some(hart_threads) => {
+                let cycles = deadline
+                    .saturating_sub(self.clock.now())
+                    .clamp(1, HART_QUANTUM);
+                hart_threads.run_quantum(&mut self.cpu, &mut self.secondary_harts, cycles)?
+            }
+            None => self.cpu.step_block()?,
+        };
+
+        #[cfg(not(feature = "multithreading"))]
+        let steps = {
+            let _ = deadline;
+            let mut steps = self.cpu.step_block()?;
+            for hart in self.secondary_harts.iter_mut() {
+                steps = steps.max(hart.step_block()?);
+            }
+            steps
+        };
+        self.clock.advance(steps);
+
+        if self.powered_off.load(Ordering::Acquire)
+            || POWER_STATUS.load(Ordering::Acquire).eq(&POWER_OFF_CODE)
+        {
             cold_path();
-            self.cpu.power_off()?;
+            self.power_off()?;
+        }
+
+        Ok(())
+    }
+
+    fn power_off(&mut self) -> Result<(), Exception> {
+        self.cpu.power_off()?;
+        for hart in self.secondary_harts.iter_mut() {
+            hart.power_off()?;
+        }
+
+        // Summed over the harts, which all run for the cycles of the board.
+        let harts = std::iter::once(&self.cpu).chain(self.secondary_harts.iter());
+        let icache_cnt: usize = harts.map(|hart| hart.icache_cnt).sum();
+        log::info!("iCache hit for {} times.", icache_cnt);
+        let rate = icache_cnt as f64 / (self.clock.now() * self.hart_cnt() as u64) as f64;
+        log::info!("iCache hit rate {}", rate);
+
+        let mut caches = self.cpu.cache_stats();
+        for hart in self.secondary_harts.iter() {
+            for ((_, total), (_, stats)) in caches.iter_mut().zip(hart.cache_stats()) {
+                total.hits += stats.hits;
+                total.misses += stats.misses;
+                total.evictions += stats.evictions;
+            }
+        }
+        for (name, stats) in caches {
+            log::info!(
+                "{}: {} hits, {} misses, {} evictions, hit rate {:.4}",
+                name,
+                stats.hits,
+                stats.misses,
+                stats.evictions,
+                stats.hit_rate()
+            );
+        }
+
+        self.status = BoardStatus::Halt;
+
+        log::info!("Total cycles: {}", self.clock.now());
+        Ok(())
+    }
+}
+
+/// Snapshots, see [`snapshot`](crate::snapshot).
+///
+/// The state follows the RAM size, the hart count and the devices of the board: a snapshot only
+/// restores on a board built with the same configuration.
+impl VirtBoard {
+    /// Save the whole machine, it must be between two board steps.
+    pub fn save_snapshot(&mut self, out: &mut dyn Write) -> Result<(), SnapshotError> {
+        let harts = std::iter::once(&mut self.cpu).chain(self.secondary_harts.iter_mut());
+        for hart in harts {
+            hart.sync_counters();
+            hart.sync_irq_pins();
+        }
+
+        let mut state = StateWriter::new();
+        state.write_u64(self.hart_cnt() as u64);
+        state.write_u64(self.clock.now());
+        state.write_section(|out| self.cpu.save(out));
+        for hart in self.secondary_harts.iter() {
+            state.write_section(|out| hart.save(out));
+        }
+
+        state.write_u64(self.devices.len() as u64);
+        for item in self.devices.iter() {
+            state.write_u64(item.start as u64);
+            state.write_section(|out| item.device.lock().unwrap().save_state(out));
+        }
+
+        write_snapshot(out, &state.into_bytes(), &self.ram)
+    }
 
-            log::info!("iCache hit for {} times.", self.cpu.icache_cnt);
-            let rate = self.cpu.icache_cnt as f64 / self.clock.now() as f64;
-            log::info!("iCache hit rate {}", rate);
+    /// Save to `path`, through a temporary file renamed over it.
+    ///
+    /// RAM restored from a snapshot maps its pages, so the file must never be written in place.
+    pub fn save_snapshot_file(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        let mut tmp_path = path.as_os_str().to_owned();
+        tmp_path.push(".tmp");
+
+        let mut out = BufWriter::new(File::create(&tmp_path)?);
+        self.save_snapshot(&mut out)?;
+        out.into_inner()
+            .map_err(|err| err.into_error())?
+            .sync_all()?;
+        fs::rename(&tmp_path, path)?;
+        Ok(())
+    }
 
-            self.status = BoardStatus::Halt;
+    /// Restore a snapshot made by [`Self::save_snapshot`].
+    ///
+    /// On error the board is left half restored and must not run.
+    pub fn restore_snapshot(&mut self, bytes: &[u8]) -> Result<(), SnapshotError> {
+        self.restore_image(&SnapshotImage::from_bytes(bytes)?)
+    }
+
+    /// Restore a snapshot file, its RAM pages are mapped copy-on-write and read on first touch.
+    pub fn restore_snapshot_file(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        let file = File::open(path)?;
+        self.restore_image(&SnapshotImage::from_file(&file)?)
+    }
 
-            log::info!("Total cycles: {}", self.clock.now());
+    fn restore_image(&mut self, image: &SnapshotImage) -> Result<(), SnapshotError> {
+        let mut state = image.state();
+        state.expect_u64(self.hart_cnt() as u64, "hart count")?;
+        // The devices re-arm their timers against the restored clock.
+        self.clock.set(state.read_u64()?);
+        state.read_section(|state| self.cpu.restore(state))?;
+        for hart in self.secondary_harts.iter_mut() {
+            state.read_section(|state| hart.restore(state))?;
         }
 
-        unsafe { self.timer.as_mut_unchecked() }.tick();
+        state.expect_u64(self.devices.len() as u64, "device count")?;
+        for item in self.devices.iter() {
+            state.expect_u64(item.start as u64, "device address")?;
+            state.read_section(|state| item.device.lock().unwrap().restore_state(state))?;
+        }
+
+        image.restore_ram(&self.ram)?;
 
+        #[cfg(not(feature = "multithreading"))]
+        {
+            self.next_device_poll = 0;
+        }
+        self.status = BoardStatus::Running;
         Ok(())
     }
+}
+
+/// A booted board frozen into a snapshot, that any number of boards fork from on any thread.
+///
+/// Forks are built like [`VirtBoard::from_ram`] without disks, and with their UART off the
+/// standard I/O. Where the host has memory files, see [`SharedSnapshot`], the forks share the RAM
+/// pages of the template until they write them, so a fork costs the machine state and the page
+/// tables of its RAM, however much the template booted.
+pub struct BoardTemplate {
+    snapshot: SharedSnapshot,
+    hart_cnt: usize,
+    strict_float: bool,
+    loader: Option<ELFLoader>,
+}
+
+impl BoardTemplate {
+    /// A new board in the state of the template, it runs on the calling thread.
+    pub fn fork(&self) -> Result<VirtBoard, SnapshotError> {
+        self.fork_on(VirtBoard::new_ram())
+    }
+
+    /// Like [`BoardTemplate::fork`], over `ram` taken back from a finished board, see
+    /// [`VirtBoard::into_ram`].
+    pub(crate) fn fork_on(&self, ram: Ram) -> Result<VirtBoard, SnapshotError> {
+        let mut board = VirtBoard::builder(self.hart_cnt, self.strict_float)
+            .detach_stdio()
+            .build(ram);
+        board.restore_image(&self.snapshot.image())?;
+        board.loader = self.loader.clone();
+        Ok(board)
+    }
+
+    pub fn hart_cnt(&self) -> usize {
+        self.hart_cnt
+    }
+}
+
+impl VirtBoard {
+    /// Freeze the board into a template to fork from, it must be between two board steps.
+    ///
+    /// Boards with disks can not be forked, as the forks would all write the same image.
+    pub fn to_template(&mut self) -> Result<BoardTemplate, SnapshotError> {
+        if self.has_disks {
+            return Err(SnapshotError::Unsupported);
+        }
+
+        let mut bytes = Vec::new();
+        self.save_snapshot(&mut bytes)?;
+        Ok(BoardTemplate {
+            snapshot: SharedSnapshot::new(bytes)?,
+            hart_cnt: self.hart_cnt(),
+            strict_float: self.cpu.strict_float(),
+            loader: self.loader.clone(),
+        })
+    }
+
+    /// Load an ELF over the RAM, typically into a fresh fork before running a test on it.
+    ///
+    /// The harts are untouched: the ELF must be linked to start at the pc they are at.
+    pub fn load_elf(&mut self, bytes: Vec<u8>) -> Result<(), String> {
+        let loader = ELFLoader::try_new(bytes).ok_or_else(|| "Invalid ELF file".to_string())?;
+        loader.load_to_ram(&self.ram);
+        // The code may be loaded over code the harts already decoded.
+        self.cpu.flush_icache();
+        for hart in self.secondary_harts.iter_mut() {
+            hart.flush_icache();
+        }
+        self.loader = Some(loader);
+        Ok(())
+    }
+
+    /// The template the tests of [`crate::batch`] fork from, a single hart out of reset.
+    pub(crate) fn test_template(strict_float: bool) -> Result<BoardTemplate, SnapshotError> {
+        Self::builder(1, strict_float)
+            .detach_stdio()
+            .build(Self::new_ram())
+            .to_template()
+    }
+
+    /// Drop the board and take its RAM back for another one, `None` if something still holds it.
+    pub(crate) fn into_ram(self) -> Option<Ram> {
+        let ram = self.ram.clone();
+        drop(self);
+        Arc::try_unwrap(ram).ok()
+    }
+}
+
+impl Board for VirtBoard {
+    fn step(&mut self) -> Result<(), Exception> {
+        self.run_slice(1).map(|_| ())
+    }
+
+    fn run_until_stop(&mut self, budget: u64) -> Result<(), Exception> {
+        self.run_slice(budget).map(|_| ())
+    }
+
+    fn run(&mut self) {
+        while self.status == BoardStatus::Running {
+            if let Err(e) = self.run_slice(u64::MAX) {
+                eprintln!("Board encountered an exception: {:?}", e);
+                break;
+            }
+        }
+    }
 
     fn status(&self) -> BoardStatus {
         self.status
@@ -390,19 +986,33 @@ impl Board for VirtBoard {
     fn loader(&self) -> Option<&crate::load::ELFLoader> {
         self.loader.as_ref()
     }
+
+    fn save_snapshot_file(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        VirtBoard::save_snapshot_file(self, path)
+    }
+
+    fn restore_snapshot_file(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        VirtBoard::restore_snapshot_file(self, path)
+    }
+
+    fn stats(&self) -> Option<StatsReport> {
+        VirtBoard::stats(self)
+    }
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
-    use crate::config::arch_config::XLEN;
+    use crate::config::arch_config::{WordType, XLEN};
     use crate::isa::DebugTarget;
-    use crate::isa::riscv::csr_reg::csr_macro::Mcause;
+    use crate::isa::riscv::csr_reg::csr_macro::{Mcause, Mcycle};
     use crate::isa::riscv::csr_reg::{NamedCsrReg, csr_index};
+    use crate::isa::riscv::debugger::Address;
+    use crate::isa::riscv::{instruction::instr_table::RiscvInstr, trap::Trap};
     use crate::ram_config;
 
     fn create_test_board() -> VirtBoard {
-        let mut ram = Ram::new();
+        let ram = Ram::new();
         for i in 0..=0x100000 {
             ram.write::<u32>(4 * i, 0x13).unwrap(); // NOP
         }
@@ -412,12 +1022,445 @@ mod tests {
         board
     }
 
+    #[test]
+    fn test_snapshot_round_trip() {
+        let loop_ram = || {
+            let ram = Ram::new();
+            ram.write::<u32>(0, 0x00150513).unwrap(); // addi a0, a0, 1
+            ram.write::<u32>(4, 0xffdff06f).unwrap(); // j -4
+            ram
+        };
+
+        let mut board = RVBoardBuilder::new().build(loop_ram());
+        board.run_slice(1000).unwrap();
+        let mut bytes = Vec::new();
+        board.save_snapshot(&mut bytes).unwrap();
+
+        // A board with other code and data takes the state of the first one.
+        let ram = Ram::new();
+        ram.write::<u32>(0x10000, 0xdead_beef).unwrap();
+        let mut restored = RVBoardBuilder::new().build(ram);
+        restored.restore_snapshot(&bytes).unwrap();
+        assert_eq!(restored.clock.now(), board.clock.now());
+        assert_eq!(restored.cpu.read_pc(), board.cpu.read_pc());
+        assert_eq!(
+            restored
+                .cpu
+                .read_memory::<u32>(Address::Phys(ram_config::BASE_ADDR + 0x10000))
+                .unwrap(),
+            0
+        );
+
+        for _ in 0..100 {
+            board.step().unwrap();
+            restored.step().unwrap();
+        }
+        assert_eq!(restored.clock.now(), board.clock.now());
+        assert_eq!(restored.cpu.read_pc(), board.cpu.read_pc());
+        assert_eq!(restored.cpu.read_reg(10), board.cpu.read_reg(10));
+        assert!(board.cpu.read_reg(10) > 100);
+    }
+
+    #[test]
+    fn test_fork_template() {
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0x00150513).unwrap(); // addi a0, a0, 1
+        ram.write::<u32>(4, 0xffdff06f).unwrap(); // j -4
+        let mut board = VirtBoard::from_ram(ram);
+        board.run_slice(1000).unwrap();
+        let template = board.to_template().unwrap();
+        for _ in 0..100 {
+            board.step().unwrap();
+        }
+
+        // Next to the code, on a page every fork maps from the template.
+        let data_addr = Address::Phys(ram_config::BASE_ADDR + 0x100);
+        let results: Vec<(WordType, u32)> = std::thread::scope(|scope| {
+            let forks: Vec<_> = (1..=4u32)
+                .map(|value| {
+                    let template = &template;
+                    scope.spawn(move || {
+                        let mut fork = template.fork().unwrap();
+                        fork.cpu.write_memory(data_addr, value).unwrap();
+                        for _ in 0..100 {
+                            fork.step().unwrap();
+                        }
+                        (
+                            fork.cpu.read_reg(10),
+                            fork.cpu.read_memory(data_addr).unwrap(),
+                        )
+                    })
+                })
+                .collect();
+            forks.into_iter().map(|fork| fork.join().unwrap()).collect()
+        });
+
+        for (value, (a0, data)) in (1..=4u32).zip(results) {
+            assert_eq!(a0, board.cpu.read_reg(10));
+            assert_eq!(data, value);
+        }
+        let mut fork = template.fork().unwrap();
+        assert_eq!(fork.cpu.read_memory::<u32>(data_addr).unwrap(), 0);
+    }
+
+    #[test]
+    fn test_continue_fast_stops_at_breakpoint_and_watchpoint() {
+        use crate::isa::riscv::debug_points::WatchKind;
+        use crate::isa::riscv::debugger::{DebugEvent, Debugger};
+
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0x00000297).unwrap(); // auipc t0, 0
+        ram.write::<u32>(4, 0x00150513).unwrap(); // addi a0, a0, 1
+        ram.write::<u32>(8, 0x10a2a023).unwrap(); // sw a0, 0x100(t0)
+        ram.write::<u32>(12, 0xff9ff06f).unwrap(); // j -8
+        let mut board = VirtBoard::from_ram(ram);
+        let base = ram_config::BASE_ADDR;
+        let mut dbg = Debugger::new(&mut board);
+
+        dbg.set_breakpoint(Address::Virt(base + 8)).unwrap();
+        for count in 1..=2 {
+            let event = dbg.continue_fast(1000, |_| false).unwrap();
+            assert_eq!(event, Some(DebugEvent::BreakpointHit));
+            assert_eq!(dbg.read_pc(), base + 8);
+            assert_eq!(dbg.read_reg(10), count);
+        }
+        dbg.clear_breakpoint(Address::Virt(base + 8)).unwrap();
+
+        // Not hit by the stores.
+        dbg.set_watchpoint(base + 0x100, 4, WatchKind::Read);
+        dbg.set_watchpoint(base + 0x100, 4, WatchKind::Write);
+        for count in 2..=3 {
+            let event = dbg.continue_fast(1000, |_| false).unwrap();
+            assert_eq!(
+                event,
+                Some(DebugEvent::WatchpointHit {
+                    kind: WatchKind::Write,
+                    addr: base + 0x100
+                })
+            );
+            assert_eq!(dbg.read_pc(), base + 12);
+            let data = dbg.read_memory::<u32>(Address::Phys(base + 0x100));
+            assert_eq!(data.unwrap(), count);
+        }
+
+        dbg.clear_watchpoint(base + 0x100, 4, WatchKind::Write);
+        assert_eq!(dbg.continue_fast(1000, |_| true).unwrap(), None);
+    }
+
+    #[test]
+    fn test_watchpoint_hit_by_vector_store() {
+        use crate::isa::riscv::debug_points::WatchKind;
+        use crate::isa::riscv::debugger::{DebugEvent, Debugger};
+
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0x00001597).unwrap(); // auipc a1, 1
+        ram.write::<u32>(4, 0xc1027057).unwrap(); // vsetivli zero, 4, e32, m1, tu, mu
+        ram.write::<u32>(8, 0x0205e027).unwrap(); // vse32.v v0, (a1)
+        ram.write::<u32>(12, 0x0000006f).unwrap(); // j .
+        let mut board = VirtBoard::from_ram(ram);
+        board.cpu.debug_csr(csr_index::mstatus, Some(1 << 9)); // VS initial
+        let base = ram_config::BASE_ADDR;
+        let mut dbg = Debugger::new(&mut board);
+
+        // The third element.
+        dbg.set_watchpoint(base + 0x1008, 4, WatchKind::Write);
+        let event = dbg.continue_fast(1000, |_| false).unwrap();
+        assert_eq!(
+            event,
+            Some(DebugEvent::WatchpointHit {
+                kind: WatchKind::Write,
+                addr: base + 0x1008
+            })
+        );
+        assert_eq!(dbg.read_pc(), base + 12);
+    }
+
+    #[test]
+    fn test_smp_hart_ids() {
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0xf1402573).unwrap(); // csrr a0, mhartid
+        for i in 1..64 {
+            ram.write::<u32>(4 * i, 0x13).unwrap(); // NOP
+        }
+
+        let mut board = RVBoardBuilder::new().hart_cnt(2).build(ram);
+        board.cpu.write_reg(10, 0xff);
+        board.secondary_harts[0].write_reg(10, 0xff);
+
+        for _ in 0..4 {
+            board.step().unwrap();
+        }
+
+        assert_eq!(board.hart_cnt(), 2);
+        assert_eq!(board.cpu.read_reg(10), 0);
+        assert_eq!(board.secondary_harts[0].read_reg(10), 1);
+    }
+
+    #[test]
+    fn test_smp_harts_share_lr_sc_counter() {
+        let ram = Ram::new();
+        let program = [
+            0x00001597, // auipc a1, 1
+            0x3e800613, // li a2, 1000
+            0x1005a52f, // lr.w a0, (a1)
+            0x00150513, // addi a0, a0, 1
+            0x18a5a6af, // sc.w a3, a0, (a1)
+            0xfe069ae3, // bnez a3, -12
+            0xfff60613, // addi a2, a2, -1
+            0xfe0616e3, // bnez a2, -20
+            0x0000006f, // j .
+        ];
+        for (i, instr) in program.into_iter().enumerate() {
+            ram.write::<u32>(4 * i as WordType, instr).unwrap();
+        }
+
+        let mut board = RVBoardBuilder::new().hart_cnt(2).build(ram);
+        #[cfg(feature = "multithreading")]
+        assert!(board.hart_threads.is_some());
+        board.cpu.write_reg(12, 0xff);
+        board.secondary_harts[0].write_reg(12, 0xff);
+
+        for _ in 0..1000 {
+            if board.cpu.read_reg(12) == 0 && board.secondary_harts[0].read_reg(12) == 0 {
+                break;
+            }
+            board.run_slice(10_000).unwrap();
+        }
+
+        assert_eq!(board.cpu.read_reg(12), 0);
+        assert_eq!(board.secondary_harts[0].read_reg(12), 0);
+        assert_eq!(board.ram.read::<u32>(0x1000).unwrap(), 2000);
+    }
+
+    #[test]
+    fn test_wfi_skips_to_timer_deadline() {
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0x10500073).unwrap(); // wfi
+        ram.write::<u32>(4, 0x00150513).unwrap(); // addi a0, a0, 1
+        ram.write::<u32>(8, 0xffdff06f).unwrap(); // j -4
+
+        // MTIE wakes the hart, while mstatus.MIE keeps the interrupt from being taken.
+        let mut board = RVBoardBuilder::new().build(ram);
+        board.cpu.debug_csr(csr_index::mie, Some(1 << 7));
+        let target_time = 1_000_000;
+        board
+            .clint
+            .lock()
+            .unwrap()
+            .write_u64(0x4000, target_time)
+            .unwrap();
+
+        board.run_slice(u64::MAX).unwrap();
+        assert_eq!(board.clock.now(), target_time);
+        assert!(board.cpu.debug_csr(Mcycle::get_index(), None).unwrap() >= target_time as WordType);
+
+        for _ in 0..10 {
+            board.step().unwrap();
+        }
+        assert!(board.cpu.read_reg(10) > 0);
+    }
+
+    #[cfg(feature = "multithreading")]
+    #[test]
+    fn test_idle_board_waits_without_deadline() {
+        let ram = Ram::new();
+        ram.write::<u32>(0, 0x10500073).unwrap(); // wfi
+
+        let mut board = RVBoardBuilder::new().detach_stdio().build(ram);
+        board.run_slice(u64::MAX).unwrap();
+        let now = board.clock.now();
+        board.run_slice(u64::MAX).unwrap();
+        assert_eq!(board.clock.now(), now);
+        assert!(board.cpu.is_waiting());
+    }
+
+    #[test]
+    fn test_profiler_samples_every_interval() {
+        let mut board = create_test_board();
+        board.start_profiler(100);
+        while board.clock.now() < 10_000 {
+            board.run_slice(10_000 - board.clock.now()).unwrap();
+        }
+
+        // Without an ELF, the pcs have no symbol.
+        let report = board.profile_report().unwrap();
+        assert!((90..=100).contains(&report.total_samples));
+        assert_eq!(report.entries.len(), 1);
+        assert_eq!(report.entries[0].symbol, "[unknown]");
+    }
+
+    #[test]
+    fn test_trace_records_window() {
+        let mut board = create_test_board();
+        let path = std::env::temp_dir().join(format!("rvemu-trace-{}", std::process::id()));
+        let filter = TraceFilter {
+            pc: None,
+            window: Some(5..15),
+        };
+        if !trace::ENABLED {
+            assert!(board.start_trace(&path, filter).is_err());
+            return;
+        }
+
+        board.start_trace(&path, filter).unwrap();
+        while board.clock.now() < 100 {
+            board.run_slice(100 - board.clock.now()).unwrap();
+        }
+        board.finish_trace().unwrap();
+
+        let records = trace::TraceReader::open(&path)
+            .unwrap()
+            .map(Result::unwrap)
+            .collect::<Vec<_>>();
+        fs::remove_file(&path).unwrap();
+
+        assert_eq!(records.len(), 10);
+        for (record, index) in records.iter().zip(5..) {
+            assert_eq!(record.index, index);
+            assert_eq!(record.pc, ram_config::BASE_ADDR as u64 + 4 * index);
+            assert_eq!(record.raw, 0x13);
+            // `nop` writes `x0`, which isn't a write.
+            assert_eq!(record.int_rd, None);
+        }
+    }
+
+    #[test]
+    fn test_trace_records_registers_and_memory() {
+        let code = [
+            0x00001597, // auipc a1, 1
+            0x00500513, // li a0, 5
+            0x00a5a023, // sw a0, 0(a1)
+            0xf20500d3, // fmv.d.x f1, a0
+            0x00a5a62f, // amoadd.w a2, a0, (a1)
+            0xc1027057, // vsetivli zero, 4, e32, m1, tu, mu
+            0x0205e027, // vse32.v v0, (a1)
+            0x0000006f, // j .
+        ];
+        let ram = Ram::new();
+        for (i, instr) in code.iter().enumerate() {
+            ram.write::<u32>(4 * i as WordType, *instr).unwrap();
+        }
+        let mut board = VirtBoard::from_ram(ram);
+        // FS and VS initial.
+        board
+            .cpu
+            .debug_csr(csr_index::mstatus, Some(1 << 13 | 1 << 9));
+
+        let path = std::env::temp_dir().join(format!("rvemu-trace-mem-{}", std::process::id()));
+        let filter = TraceFilter {
+            pc: None,
+            window: Some(0..7),
+        };
+        if !trace::ENABLED {
+            return;
+        }
+        board.start_trace(&path, filter).unwrap();
+        while board.clock.now() < 10 {
+            board.run_slice(10 - board.clock.now()).unwrap();
+        }
+        board.finish_trace().unwrap();
+
+        let records = trace::TraceReader::open(&path)
+            .unwrap()
+            .map(Result::unwrap)
+            .collect::<Vec<_>>();
+        fs::remove_file(&path).unwrap();
+
+        let base = ram_config::BASE_ADDR as u64;
+        let data = base + 0x1000;
+        let access = |kind, addr, data| trace::MemAccess {
+            kind,
+            addr,
+            size: 4,
+            data,
+        };
+        assert_eq!(records.len(), 7);
+        assert_eq!(records.iter().map(|r| r.raw).collect::<Vec<_>>(), code[..7]);
+        assert_eq!(records[0].int_rd, Some((11, data)));
+        assert_eq!(records[1].int_rd, Some((10, 5)));
+        assert_eq!(
+            (records[2].int_rd, &records[2].accesses[..]),
+            (None, &[access(trace::MemAccessKind::Write, data, 5)][..])
+        );
+        assert_eq!(
+            (records[3].int_rd, records[3].float_rd),
+            (None, Some((1, 5)))
+        );
+        // The AMO has the value read, and writes it into `rd`.
+        assert_eq!(
+            (records[4].int_rd, &records[4].accesses[..]),
+            (
+                Some((12, 5)),
+                &[access(trace::MemAccessKind::Amo, data, 5)][..]
+            )
+        );
+        assert_eq!(records[5].accesses, []);
+        // Each element of the vector store, though the store copies whole ranges when untraced.
+        assert_eq!(
+            records[6].accesses,
+            (0..4)
+                .map(|i| access(trace::MemAccessKind::Write, data + 4 * i, 0))
+                .collect::<Vec<_>>()
+        );
+    }
+
+    #[test]
+    fn test_stats_count_instructions_and_traps() {
+        let mut board = create_test_board();
+        if !stats::ENABLED {
+            assert!(board.stats().is_none());
+            return;
+        }
+
+        board.cpu.debug_csr(csr_index::mstatus, Some(1 << 3));
+        board.cpu.debug_csr(csr_index::mie, Some(1 << 7));
+        board.clint.lock().unwrap().write_u64(0x4000, 500).unwrap();
+        while board.clock.now() < 1000 {
+            board.run_slice(1000 - board.clock.now()).unwrap();
+        }
+
+        let report = board.stats().unwrap();
+        // Every cycle runs a `nop`, but the one taking the interrupt.
+        assert_eq!(report.instructions, report.cycles - 1);
+        assert_eq!(report.instrs, [(RiscvInstr::ADDI, report.instructions)]);
+        assert_eq!(
+            report.traps,
+            [(Trap::Interrupt(Interrupt::MachineTimer), 1)]
+        );
+        assert!(report.caches.iter().any(|(_, stats)| stats.hits > 0));
+    }
+
+    #[test]
+    fn test_run_slice_stops_at_deadline() {
+        let mut board = create_test_board();
+
+        // A budget stops the slice at the first block boundary after it.
+        let cycles = board.run_slice(10).unwrap();
+        assert!(cycles >= 10);
+
+        let target_time = 1000;
+        board
+            .clint
+            .lock()
+            .unwrap()
+            .write_u64(0x4000, target_time)
+            .unwrap();
+
+        // The slices run in bulk up to the timer deadline, which is served right after it.
+        let mtip = 1 << 7;
+        while board.cpu.debug_csr(csr_index::mip, None).unwrap() & mtip == 0 {
+            assert!(board.clock.now() < target_time + 64);
+            board.run_slice(u64::MAX).unwrap();
+        }
+        assert!(board.clock.now() >= target_time);
+    }
+
     #[test]
     fn test_clint_mmio_access() {
         let board = create_test_board();
 
         // 直接测试 CLINT 设备
-        let mut clint = board.clint.borrow_mut();
+        let mut clint = board.clint.lock().unwrap();
         // 测试 mtime 读取
         let _ = clint.read_u64(0xbff8).unwrap();
 
@@ -464,7 +1507,7 @@ mod tests {
 
         let target_time = 5;
         {
-            let mut clint = board.clint.borrow_mut();
+            let mut clint = board.clint.lock().unwrap();
             clint.write_u64(0x4000, target_time).unwrap();
         }
 
@@ -500,7 +1543,7 @@ mod tests {
         board.cpu_mut().debug_csr(csr_index::mie, Some(1 << 3));
 
         {
-            let mut clint = board.clint.borrow_mut();
+            let mut clint = board.clint.lock().unwrap();
             clint.write_u64(0x0, 1).unwrap();
         }
 
@@ -536,7 +1579,7 @@ mod tests {
         board.cpu.debug_csr(csr_index::mie, Some(1 << 11)); // enable MEIE
 
         {
-            let mut plic = board.plic.borrow_mut();
+            let mut plic = board.plic.lock().unwrap();
             // priority_threshold
             let addr = CONTEXT_CONFIG_OFFSET + (0 * CONTEXT_CONFIG_SIZE);
             plic.write_u32(addr, 1).unwrap();
@@ -589,7 +1632,7 @@ mod tests {
         // );
 
         let addr = CONTEXT_CONFIG_OFFSET + (0 * CONTEXT_CONFIG_SIZE) + 4;
-        let mut plic = board.plic.borrow_mut();
+        let mut plic = board.plic.lock().unwrap();
         let claimed_id = plic.read_u32(addr).unwrap();
         assert_eq!(claimed_id as u32, TEST_DEVICE_INTERRUPT_ID);
 
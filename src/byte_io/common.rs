@@ -9,6 +9,10 @@ impl ByteSink for VecDeque<u8> {
         self.push_back(byte);
     }
 
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        self.extend(bytes);
+    }
+
     fn before_receive(&mut self) {}
     fn after_receive(&mut self, _received: bool) {}
 }
@@ -19,6 +23,10 @@ impl ByteSink for Vec<u8> {
         self.push(byte);
     }
 
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        self.extend_from_slice(bytes);
+    }
+
     fn before_receive(&mut self) {}
     fn after_receive(&mut self, _received: bool) {}
 }
@@ -0,0 +1,141 @@
+use super::*;
+
+use std::{
+    fs::File,
+    io::{self, Write},
+    path::Path,
+    time::Instant,
+};
+
+/// Bytes buffered before they are written out, whatever the flush interval.
+const BUFFER_CAPACITY: usize = 64 * 1024;
+/// A file has no one waiting to see the bytes, only the full buffer or this interval write them.
+const FILE_FLUSH_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Host side of the UART output: buffers the bytes and writes them out in one call per flush,
+/// rather than one write and one flush per byte.
+///
+/// [`Self::flush_if_due`] writes the buffer once `flush_interval` elapsed since the last flush, so
+/// a burst after a quiet period is shown at once, and a stream of bytes at most every interval.
+/// The buffer is written out when dropped.
+pub struct HostOutput {
+    writer: Box<dyn Write + Send>,
+    buffer: Vec<u8>,
+    flush_interval: Duration,
+    last_flush: Instant,
+}
+
+impl HostOutput {
+    pub fn stdout(flush_interval: Duration) -> Self {
+        Self::new(Box::new(io::stdout()), flush_interval)
+    }
+
+    pub fn file(path: &Path) -> io::Result<Self> {
+        Ok(Self::new(
+            Box::new(File::create(path)?),
+            FILE_FLUSH_INTERVAL,
+        ))
+    }
+
+    fn new(writer: Box<dyn Write + Send>, flush_interval: Duration) -> Self {
+        Self {
+            writer,
+            buffer: Vec::with_capacity(BUFFER_CAPACITY),
+            flush_interval,
+            last_flush: Instant::now(),
+        }
+    }
+
+    #[inline]
+    pub fn write(&mut self, bytes: &[u8]) {
+        self.buffer.extend_from_slice(bytes);
+        if self.buffer.len() >= BUFFER_CAPACITY {
+            self.flush();
+        }
+    }
+
+    pub fn flush_if_due(&mut self) {
+        if !self.buffer.is_empty() && self.last_flush.elapsed() >= self.flush_interval {
+            self.flush();
+        }
+    }
+
+    pub fn flush(&mut self) {
+        self.last_flush = Instant::now();
+        if self.buffer.is_empty() {
+            return;
+        }
+
+        // do not use `print!` because we need to output the raw byte sequence.
+        let result = self
+            .writer
+            .write_all(&self.buffer)
+            .and_then(|_| self.writer.flush());
+        if let Err(e) = result {
+            log::error!(
+                "Failed to write {} bytes of UART output: {}",
+                self.buffer.len(),
+                e
+            );
+        }
+        self.buffer.clear();
+    }
+}
+
+impl Drop for HostOutput {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+impl ByteSink for HostOutput {
+    #[inline]
+    fn do_receive(&mut self, byte: u8) {
+        self.write(&[byte]);
+    }
+
+    #[inline]
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        self.write(bytes);
+    }
+
+    fn before_receive(&mut self) {}
+    fn after_receive(&mut self, _received: bool) {}
+}
+
+#[cfg(test)]
+mod test {
+    use std::sync::{Arc, Mutex};
+
+    use super::*;
+
+    #[derive(Clone, Default)]
+    struct SharedWriter {
+        written: Arc<Mutex<Vec<Vec<u8>>>>,
+    }
+
+    impl Write for SharedWriter {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.written.lock().unwrap().push(buf.to_vec());
+            Ok(buf.len())
+        }
+
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_bytes_are_written_once_per_interval() {
+        let writer = SharedWriter::default();
+        let mut output = HostOutput::new(Box::new(writer.clone()), Duration::from_secs(3600));
+
+        output.receive_bytes(*b"hello, ");
+        output.receive_guard().receives(b"world");
+        output.flush_if_due();
+        assert!(writer.written.lock().unwrap().is_empty());
+
+        drop(output);
+        assert_eq!(*writer.written.lock().unwrap(), [b"hello, world".to_vec()]);
+    }
+}
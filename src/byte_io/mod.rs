@@ -1,12 +1,38 @@
 mod common;
 pub use common::*;
 
+mod ring;
+pub use ring::*;
+
+#[cfg(feature = "native-cli")]
+mod host_output;
 #[cfg(feature = "native-cli")]
 mod terminal_io;
 
+#[cfg(feature = "native-cli")]
+pub use host_output::*;
 #[cfg(feature = "native-cli")]
 pub use terminal_io::*;
 
+use std::{path::PathBuf, time::Duration};
+
+/// Where the UART output goes when the board is on the standard I/O of the process.
+#[derive(Debug, Clone)]
+pub enum UartOutput {
+    /// The terminal, flushed at most every `flush_interval`.
+    Stdout { flush_interval: Duration },
+    /// A file, without any terminal in the way. The input still comes from the terminal.
+    File(PathBuf),
+}
+
+impl Default for UartOutput {
+    fn default() -> Self {
+        UartOutput::Stdout {
+            flush_interval: Duration::from_millis(10),
+        }
+    }
+}
+
 pub struct ReceiveGuard<'a, S: ByteSink + ?Sized> {
     sink: &'a mut S,
     has_received: bool,
@@ -29,8 +55,9 @@ impl<'a, S: ByteSink + ?Sized> ReceiveGuard<'a, S> {
 
     #[inline]
     pub fn receives(&mut self, bytes: &[u8]) {
-        for &byte in bytes {
-            self.receive(byte);
+        if !bytes.is_empty() {
+            self.sink.do_receive_slice(bytes);
+            self.has_received = true;
         }
     }
 }
@@ -47,6 +74,14 @@ impl<'a, S: ByteSink + ?Sized> Drop for ReceiveGuard<'a, S> {
 pub trait ByteSink {
     /// DO NOT USE this method directly, prefer [`ByteSinkExt::receive_guard`].
     fn do_receive(&mut self, byte: u8);
+    /// DO NOT USE this method directly, prefer [`ByteSinkExt::receive_guard`].
+    ///
+    /// Sinks that can take a run of bytes at once, such as buffers, should override it.
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        for &byte in bytes {
+            self.do_receive(byte);
+        }
+    }
     fn before_receive(&mut self);
     fn after_receive(&mut self, has_received: bool);
 }
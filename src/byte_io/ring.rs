@@ -0,0 +1,274 @@
+//! Lock-free byte ring with one producer and one consumer, each on its own thread.
+//!
+//! Both indices only grow, wrapping around `usize`, and are masked into the buffer on access: the
+//! ring holds `tail - head` bytes. The producer is the only one to store `tail`, and the consumer
+//! `head`, so each side only has to load the index of the other to know how far it can go. Each
+//! side also caches the last index it loaded from the other one, and only loads it again once the
+//! cached one leaves less room (or fewer bytes) than it asks for.
+
+use std::{
+    cell::UnsafeCell,
+    sync::{
+        Arc,
+        atomic::{AtomicUsize, Ordering},
+    },
+};
+
+use super::{ByteSink, ByteSinkExt, ByteSource};
+
+struct RingShared {
+    buf: Box<[UnsafeCell<u8>]>,
+    /// Next byte to read, stored by the consumer.
+    head: AtomicUsize,
+    /// Next byte to write, stored by the producer.
+    tail: AtomicUsize,
+}
+
+// SAFETY: the bytes `head..tail` are only read by the consumer and the others only written by the
+// producer, the index stores publish them to the other side.
+unsafe impl Sync for RingShared {}
+
+impl RingShared {
+    #[inline]
+    fn capacity(&self) -> usize {
+        self.buf.len()
+    }
+
+    /// The slot of `index`, the pointer reaches the following slots up to the end of the buffer.
+    #[inline]
+    fn ptr(&self, index: usize) -> *mut u8 {
+        let offset = index & (self.capacity() - 1);
+        // SAFETY: `offset` is in the buffer.
+        unsafe { UnsafeCell::raw_get(self.buf.as_ptr()).add(offset) }
+    }
+}
+
+/// A ring of `capacity` bytes, which must be a power of two.
+pub fn byte_ring(capacity: usize) -> (RingProducer, RingConsumer) {
+    assert!(
+        capacity.is_power_of_two(),
+        "ring capacity must be a power of two"
+    );
+    let shared = Arc::new(RingShared {
+        buf: (0..capacity).map(|_| UnsafeCell::new(0)).collect(),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+    });
+
+    (
+        RingProducer {
+            shared: shared.clone(),
+            tail: 0,
+            head: 0,
+        },
+        RingConsumer {
+            shared,
+            head: 0,
+            tail: 0,
+        },
+    )
+}
+
+pub struct RingProducer {
+    shared: Arc<RingShared>,
+    tail: usize,
+    /// Last `head` loaded from the consumer.
+    head: usize,
+}
+
+impl RingProducer {
+    /// Number of bytes that can be pushed right now.
+    #[inline]
+    pub fn free(&mut self) -> usize {
+        self.free_for(self.shared.capacity())
+    }
+
+    /// Number of bytes that can be pushed right now, `head` is only loaded again when the cached one
+    /// leaves less than `wanted` bytes of room.
+    #[inline]
+    fn free_for(&mut self, wanted: usize) -> usize {
+        let capacity = self.shared.capacity();
+        if capacity - self.tail.wrapping_sub(self.head) < wanted {
+            self.head = self.shared.head.load(Ordering::Acquire);
+        }
+        capacity - self.tail.wrapping_sub(self.head)
+    }
+
+    #[inline]
+    pub fn is_full(&mut self) -> bool {
+        self.free_for(1) == 0
+    }
+
+    /// Returns `false`, leaving the ring untouched, if it is full.
+    #[inline]
+    pub fn push(&mut self, byte: u8) -> bool {
+        if self.is_full() {
+            return false;
+        }
+        // SAFETY: the slot is past `tail` and before `head + capacity`, the consumer won't read it.
+        unsafe { self.shared.ptr(self.tail).write(byte) };
+        self.tail = self.tail.wrapping_add(1);
+        self.shared.tail.store(self.tail, Ordering::Release);
+        true
+    }
+
+    /// Push as many leading bytes of `bytes` as there is room for, returns how many were pushed.
+    pub fn push_slice(&mut self, bytes: &[u8]) -> usize {
+        let len = bytes.len().min(self.free_for(bytes.len()));
+        let capacity = self.shared.capacity();
+        let start = self.tail & (capacity - 1);
+        let first = len.min(capacity - start);
+        // SAFETY: same as `push`, for the `len` slots from `tail`, which wrap at most once.
+        unsafe {
+            std::ptr::copy_nonoverlapping(bytes.as_ptr(), self.shared.ptr(start), first);
+            std::ptr::copy_nonoverlapping(bytes[first..].as_ptr(), self.shared.ptr(0), len - first);
+        }
+        self.tail = self.tail.wrapping_add(len);
+        self.shared.tail.store(self.tail, Ordering::Release);
+        len
+    }
+}
+
+/// Bytes pushed while the ring is full are dropped, as a hardware FIFO overrun would.
+impl ByteSink for RingProducer {
+    #[inline]
+    fn do_receive(&mut self, byte: u8) {
+        if !self.push(byte) {
+            log::warn!("byte ring overrun, byte 0x{:x} dropped", byte);
+        }
+    }
+
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        let pushed = self.push_slice(bytes);
+        if pushed < bytes.len() {
+            log::warn!("byte ring overrun, {} bytes dropped", bytes.len() - pushed);
+        }
+    }
+
+    fn before_receive(&mut self) {}
+    fn after_receive(&mut self, _received: bool) {}
+}
+
+pub struct RingConsumer {
+    shared: Arc<RingShared>,
+    head: usize,
+    /// Last `tail` loaded from the producer.
+    tail: usize,
+}
+
+impl RingConsumer {
+    /// Number of bytes that can be popped right now.
+    #[inline]
+    pub fn len(&mut self) -> usize {
+        if self.tail == self.head {
+            self.tail = self.shared.tail.load(Ordering::Acquire);
+        }
+        self.tail.wrapping_sub(self.head)
+    }
+
+    #[inline]
+    pub fn is_empty(&mut self) -> bool {
+        self.len() == 0
+    }
+
+    #[inline]
+    pub fn pop(&mut self) -> Option<u8> {
+        if self.is_empty() {
+            return None;
+        }
+        // SAFETY: the slot is in `head..tail`, the producer won't write it before `head` moves.
+        let byte = unsafe { self.shared.ptr(self.head).read() };
+        self.head = self.head.wrapping_add(1);
+        self.shared.head.store(self.head, Ordering::Release);
+        Some(byte)
+    }
+
+    /// Hand every byte in the ring to `f`, in at most two slices, then free them.
+    pub fn drain(&mut self, mut f: impl FnMut(&[u8])) -> usize {
+        self.tail = self.shared.tail.load(Ordering::Acquire);
+        let len = self.tail.wrapping_sub(self.head);
+        if len == 0 {
+            return 0;
+        }
+
+        let capacity = self.shared.capacity();
+        let start = self.head & (capacity - 1);
+        let first = len.min(capacity - start);
+        // SAFETY: `head..tail` is published by the producer, and only freed below.
+        unsafe {
+            f(std::slice::from_raw_parts(self.shared.ptr(start), first));
+            if first < len {
+                f(std::slice::from_raw_parts(self.shared.ptr(0), len - first));
+            }
+        }
+        self.head = self.tail;
+        self.shared.head.store(self.head, Ordering::Release);
+        len
+    }
+}
+
+impl ByteSource for RingConsumer {
+    fn drain_to(&mut self, target: &mut dyn ByteSink) -> bool {
+        let mut guard = target.receive_guard();
+        self.drain(|bytes| guard.receives(bytes));
+        guard.has_received
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_push_pop_wraps_around() {
+        let (mut producer, mut consumer) = byte_ring(4);
+
+        assert_eq!(producer.push_slice(b"abc"), 3);
+        assert_eq!(consumer.pop(), Some(b'a'));
+        assert_eq!(consumer.pop(), Some(b'b'));
+
+        // 'c', then 'd', 'e', 'f' wrapping past the end of the buffer.
+        assert_eq!(producer.push_slice(b"defg"), 3);
+        assert!(producer.is_full());
+        assert!(!producer.push(b'g'));
+
+        let mut drained = Vec::new();
+        assert_eq!(consumer.drain(|bytes| drained.push(bytes.to_vec())), 4);
+        assert_eq!(drained, [b"cd".to_vec(), b"ef".to_vec()]);
+        assert!(consumer.is_empty());
+        assert_eq!(consumer.pop(), None);
+        assert_eq!(producer.free(), 4);
+    }
+
+    #[test]
+    fn test_bytes_cross_threads_in_order() {
+        const COUNT: usize = 1 << 20;
+        let (mut producer, mut consumer) = byte_ring(64);
+
+        let writer = std::thread::spawn(move || {
+            let mut sent = 0;
+            while sent < COUNT {
+                let chunk: Vec<u8> = (sent..COUNT.min(sent + 29)).map(|i| i as u8).collect();
+                match producer.push_slice(&chunk) {
+                    0 => std::thread::yield_now(),
+                    pushed => sent += pushed,
+                }
+            }
+        });
+
+        let mut received = 0;
+        while received < COUNT {
+            let drained = consumer.drain(|bytes| {
+                for &byte in bytes {
+                    assert_eq!(byte, received as u8);
+                    received += 1;
+                }
+            });
+            if drained == 0 {
+                std::thread::yield_now();
+            }
+        }
+        writer.join().unwrap();
+        assert!(consumer.is_empty());
+    }
+}
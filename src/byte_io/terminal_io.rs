@@ -7,7 +7,7 @@ use crate::cli_coordinator::CliCoordinator;
 use crate::device::power_manager::{POWER_OFF_CODE, POWER_STATUS};
 use crossterm::event::{self, Event, KeyCode, KeyEvent, KeyModifiers};
 use std::sync::atomic::Ordering;
-use std::{io::Write, time::Duration};
+use std::{io::IsTerminal, time::Duration};
 
 /// Host-side terminal interface bridging stdin/stdout with the UART.
 ///
@@ -16,12 +16,14 @@ use std::{io::Write, time::Duration};
 pub struct TerminalIOContext {
     /// True after `Ctrl+A` has been seen, awaiting the command key.
     escape_pending: bool,
+    output: HostOutput,
 }
 
 impl TerminalIOContext {
-    pub fn new() -> Self {
+    pub fn new(output: HostOutput) -> Self {
         Self {
             escape_pending: false,
+            output,
         }
     }
 }
@@ -39,13 +41,53 @@ impl ByteSink for TerminalIOContext {
             byte,
             byte as char
         );
-        // do not use `print!` because we need to output the raw byte sequence.
-        std::io::stdout().write_all(&[byte]).unwrap();
+        self.output.write(&[byte]);
     }
 
     #[inline]
-    fn after_receive(&mut self, _received: bool) {
-        std::io::stdout().flush().unwrap();
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        log::trace!("[terminal] receive {} bytes", bytes.len());
+        self.output.write(bytes);
+    }
+
+    #[inline]
+    fn after_receive(&mut self, _received: bool) {}
+}
+
+/// Moves the bytes between a UART port and the terminal, one [`Self::poll`] per device poll round.
+///
+/// What the UART sent before the bridge is dropped, with the board, is still written out.
+pub struct StdioBridge<P: ByteSource + ByteSink> {
+    terminal: TerminalIOContext,
+    port: P,
+    input_term: bool,
+}
+
+impl<P: ByteSource + ByteSink> StdioBridge<P> {
+    pub fn new(terminal: TerminalIOContext, port: P) -> Self {
+        Self {
+            terminal,
+            port,
+            input_term: std::io::stdin().is_terminal(),
+        }
+    }
+
+    pub fn poll(&mut self) {
+        // stdin -> uart
+        if self.input_term {
+            self.terminal.drain_to(&mut self.port);
+        }
+
+        // uart -> stdout
+        self.port.drain_to(&mut self.terminal);
+        self.terminal.output.flush_if_due();
+    }
+}
+
+impl<P: ByteSource + ByteSink> Drop for StdioBridge<P> {
+    fn drop(&mut self) {
+        // Not through the terminal, which may be waiting for the debugger to resume.
+        self.port.drain_to(&mut self.terminal.output);
     }
 }
 
@@ -3,10 +3,15 @@ use std::{
     ops::{Index, IndexMut},
 };
 
-use crate::config::arch_config::{REG_NAME, REGFILE_CNT, WordType};
+use crate::{
+    config::arch_config::{REG_NAME, REGFILE_CNT, WordType},
+    trace,
+};
 
 pub struct RegFile {
     data: [WordType; REGFILE_CNT],
+    /// The register last written by [`Self::write`], only kept with the `trace` feature.
+    written: u8,
 }
 
 impl Index<usize> for RegFile {
@@ -61,9 +66,16 @@ impl RegFile {
     pub fn new() -> Self {
         Self {
             data: [0; REGFILE_CNT],
+            written: 0,
         }
     }
 
+    /// The registers in order, which the code compiled by the JIT reads and writes directly.
+    #[cfg(feature = "jit")]
+    pub(crate) fn as_mut_ptr(&mut self) -> *mut WordType {
+        self.data.as_mut_ptr()
+    }
+
     pub fn read(&self, id1: u8, id2: u8) -> (WordType, WordType) {
         (self.data[id1 as usize], self.data[id2 as usize])
     }
@@ -75,6 +87,22 @@ impl RegFile {
             return;
         }
 
+        if trace::ENABLED {
+            self.written = id;
+        }
         self.data[id as usize] = data
     }
+
+    /// Forget the register written, see [`Self::take_written`].
+    #[inline]
+    pub fn clear_written(&mut self) {
+        self.written = 0;
+    }
+
+    /// The register written since [`Self::clear_written`] and its value, with the `trace` feature.
+    #[inline]
+    pub fn take_written(&mut self) -> Option<(u8, WordType)> {
+        let id = std::mem::take(&mut self.written);
+        (id != 0).then(|| (id, self.data[id as usize]))
+    }
 }
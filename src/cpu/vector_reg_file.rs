@@ -1,6 +1,9 @@
 use std::{hint::unlikely, mem::align_of, slice::from_raw_parts};
 
-use crate::isa::riscv::{trap::Exception, vector::VLEN_BYTE};
+use crate::{
+    isa::riscv::{trap::Exception, vector::VLEN_BYTE},
+    snapshot::{Snapshot, SnapshotError, StateReader, StateWriter},
+};
 
 #[repr(align(8))]
 pub struct VectorRegFile {
@@ -102,6 +105,19 @@ impl VectorRegFile {
     }
 }
 
+impl Snapshot for VectorRegFile {
+    fn save(&self, out: &mut StateWriter) {
+        self.reg.iter().for_each(|reg| out.write_bytes(reg));
+    }
+
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        for reg in self.reg.iter_mut() {
+            reg.copy_from_slice(state.read_bytes(VLEN_BYTE)?);
+        }
+        Ok(())
+    }
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
@@ -1,4 +1,4 @@
-use std::{cell::UnsafeCell, rc::Rc};
+use std::sync::{Arc, Mutex};
 
 use crate::{
     board::virt::{IRQLine, RiscvIRQSource},
@@ -7,8 +7,9 @@ use crate::{
         DeviceTrait, MemError, MemMappedDeviceTrait,
         config::{CLINT_BASE, CLINT_SIZE},
     },
-    utils::{concat_to_u64, negative_of},
-    vclock::{Timer, VirtualClockRef},
+    snapshot::{SnapshotError, StateReader, StateWriter},
+    utils::concat_to_u64,
+    vclock::{OffsetClockRef, Timer, VirtualClockRef},
 };
 
 pub struct Clint {
@@ -16,14 +17,14 @@ pub struct Clint {
     msip_base: u64,
     time_base: u64,
     timecmp_base: u64,
-    time_offset: u64,
-    clock: VirtualClockRef,
-    timer: Rc<UnsafeCell<Timer>>,
+    mtime: OffsetClockRef,
+    timer: Arc<Mutex<Timer>>,
     msip: Vec<u32>,
     time_cmp: Vec<u64>,
-    timer_irq_line: Option<IRQLine>, // TODO: Current implementation only supports 1 hart.
-    software_irq_line: Option<IRQLine>,
-    timer_cb_id: u64,
+    /// Indexed by hart.
+    timer_irq_lines: Vec<Option<IRQLine>>,
+    software_irq_lines: Vec<Option<IRQLine>>,
+    timer_cb_ids: Vec<u64>,
 }
 
 impl Clint {
@@ -33,38 +34,48 @@ impl Clint {
         mtime_base: u64,
         mtimecmp_base: u64,
         clock: VirtualClockRef,
-        timer: Rc<UnsafeCell<Timer>>,
+        timer: Arc<Mutex<Timer>>,
     ) -> Self {
         Self {
             hart_num,
             msip_base,
             time_base: mtime_base,
             timecmp_base: mtimecmp_base,
-            time_offset: negative_of(clock.now()),
-            clock,
+            mtime: OffsetClockRef::new(clock),
             timer,
             msip: vec![0u32; hart_num as usize],
             time_cmp: vec![0u64; hart_num as usize],
-            timer_irq_line: None,
-            software_irq_line: None,
-            timer_cb_id: u64::MAX,
+            timer_irq_lines: (0..hart_num).map(|_| None).collect(),
+            software_irq_lines: (0..hart_num).map(|_| None).collect(),
+            timer_cb_ids: vec![u64::MAX; hart_num as usize],
         }
     }
 }
 
 impl Clint {
+    /// `mtime`, for the harts to read the `time` CSR without going through the registers.
+    pub fn mtime(&self) -> OffsetClockRef {
+        self.mtime.clone()
+    }
+
     fn get_time(&mut self) -> u64 {
-        self.clock.now().wrapping_add(self.time_offset)
+        self.mtime.now()
     }
 
     fn update_timer(&mut self, hartid: usize) {
-        if self.time_cmp[hartid] <= self.get_time() {
-            self.timer_irq_line.as_mut().unwrap().set_irq(true);
+        let due = self.time_cmp[hartid] <= self.get_time();
+        let Some(irq_line) = self.timer_irq_lines[hartid].as_mut() else {
+            return;
+        };
+
+        if due {
+            irq_line.set_irq(true);
+            self.timer.lock().unwrap().cancel(self.timer_cb_ids[hartid]);
         } else {
-            self.timer_irq_line.as_mut().unwrap().set_irq(false);
-            unsafe { self.timer.as_mut_unchecked() }.set_due(
-                self.timer_cb_id,
-                self.time_cmp[hartid].wrapping_sub(self.time_offset),
+            irq_line.set_irq(false);
+            self.timer.lock().unwrap().set_due(
+                self.timer_cb_ids[hartid],
+                self.mtime.clock_time_of(self.time_cmp[hartid]),
             );
         }
     }
@@ -119,7 +130,7 @@ impl Clint {
             let val: u32 = data.truncate_to();
             self.msip[hartid] = val;
 
-            if let Some(irq) = &mut self.software_irq_line {
+            if let Some(irq) = &mut self.software_irq_lines[hartid] {
                 irq.set_irq((val & 1) != 0);
             }
             Ok(())
@@ -145,7 +156,6 @@ impl Clint {
             Ok(())
         } else if addr == self.time_base || addr == self.time_base + 4 {
             // mtime
-            let curr_clocktime = self.clock.now();
             let prev_mtime = self.get_time();
 
             if addr == self.time_base {
@@ -156,15 +166,12 @@ impl Clint {
                 } else {
                     data.truncate_to()
                 };
-
-                // To make new `mtime` value == curr_clocktime + time_offset (mod 2^64)
-                self.time_offset = value.wrapping_sub(curr_clocktime);
+                self.mtime.set(value);
             } else {
                 // addr == self.time_base + 4, write to `mtime_hi`
                 let time_lo = (prev_mtime & 0xffff_ffff) as u32;
                 let time_hi: u32 = data.truncate_to();
-                let value = concat_to_u64(time_hi, time_lo);
-                self.time_offset = value.wrapping_sub(curr_clocktime);
+                self.mtime.set(concat_to_u64(time_hi, time_lo));
             }
 
             for i in 0..self.hart_num as usize {
@@ -177,18 +184,25 @@ impl Clint {
     }
 }
 
+/// Line `2 * hartid` is the timer interrupt of the hart, `2 * hartid + 1` the software interrupt.
 impl RiscvIRQSource for Clint {
     fn set_irq_line(&mut self, line: IRQLine, id: usize) {
-        if id == 0 {
-            self.timer_irq_line = Some(line);
-            self.timer_cb_id = unsafe { self.timer.as_mut_unchecked() }.register({
-                let irq_line_ptr = self.timer_irq_line.as_mut().unwrap() as *mut IRQLine;
-                move || {
-                    unsafe { &mut *irq_line_ptr }.set_irq(true);
-                }
-            });
-        } else if id == 1 {
-            self.software_irq_line = Some(line);
+        let hartid = id / 2;
+        if hartid >= self.hart_num as usize {
+            log::warn!("CLINT has no hart {}", hartid);
+            return;
+        }
+
+        if id % 2 == 0 {
+            let mut timer_line = line.clone();
+            self.timer_irq_lines[hartid] = Some(line);
+            self.timer_cb_ids[hartid] = self
+                .timer
+                .lock()
+                .unwrap()
+                .register(move || timer_line.set_irq(true));
+        } else {
+            self.software_irq_lines[hartid] = Some(line);
         }
     }
 }
@@ -202,6 +216,33 @@ impl DeviceTrait for Clint {
     fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
         None
     }
+
+    fn save_state(&self, out: &mut StateWriter) {
+        out.write_u64(self.hart_num as u64);
+        out.write_u64(self.mtime.offset());
+        for hartid in 0..self.hart_num as usize {
+            out.write_u32(self.msip[hartid]);
+            out.write_u64(self.time_cmp[hartid]);
+        }
+    }
+
+    /// The clock must be restored first, the timer deadlines are re-armed from it.
+    fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        state.expect_u64(self.hart_num as u64, "CLINT hart count")?;
+        self.mtime.set_offset(state.read_u64()?);
+        for hartid in 0..self.hart_num as usize {
+            self.msip[hartid] = state.read_u32()?;
+            self.time_cmp[hartid] = state.read_u64()?;
+        }
+
+        for hartid in 0..self.hart_num as usize {
+            if let Some(irq) = &mut self.software_irq_lines[hartid] {
+                irq.set_irq((self.msip[hartid] & 1) != 0);
+            }
+            self.update_timer(hartid);
+        }
+        Ok(())
+    }
 }
 
 impl MemMappedDeviceTrait for Clint {
@@ -215,51 +256,56 @@ impl MemMappedDeviceTrait for Clint {
 
 #[cfg(test)]
 mod tests {
+    use std::sync::atomic::{AtomicBool, Ordering};
+
     use super::*;
     use crate::board::virt::RiscvIRQHandler;
     use crate::isa::riscv::trap::Interrupt;
 
+    #[derive(Default)]
     struct MockIrqHandler {
-        triggered: bool,
-        level: bool,
+        triggered: AtomicBool,
+        level: AtomicBool,
+    }
+
+    impl MockIrqHandler {
+        fn triggered(&self) -> bool {
+            self.triggered.load(Ordering::Relaxed)
+        }
+
+        fn level(&self) -> bool {
+            self.level.load(Ordering::Relaxed)
+        }
     }
 
     impl RiscvIRQHandler for MockIrqHandler {
-        fn handle_irq(&mut self, _interrupt: Interrupt, level: bool) {
-            self.triggered = true;
-            self.level = level;
+        fn handle_irq(&self, _interrupt: Interrupt, level: bool) {
+            self.triggered.store(true, Ordering::Relaxed);
+            self.level.store(level, Ordering::Relaxed);
         }
     }
 
     fn create_test_clint() -> (
         Clint,
-        Rc<UnsafeCell<Timer>>,
-        Box<MockIrqHandler>,
-        Box<MockIrqHandler>,
+        Arc<Mutex<Timer>>,
+        Arc<MockIrqHandler>,
+        Arc<MockIrqHandler>,
     ) {
         let clock = VirtualClockRef::new();
-        let timer = Rc::new(UnsafeCell::new(Timer::new(clock.clone())));
+        let timer = Arc::new(Mutex::new(Timer::new(clock.clone())));
         let mut clint = Clint::new(1, 0x02000000, 0x0200bff8, 0x02004000, clock, timer.clone());
 
-        let mut time_handler = Box::new(MockIrqHandler {
-            triggered: false,
-            level: false,
-        });
-        let irq_line = IRQLine::new(
-            &mut *time_handler as *mut MockIrqHandler,
-            Interrupt::MachineTimer,
+        let time_handler = Arc::new(MockIrqHandler::default());
+        clint.set_irq_line(
+            IRQLine::new(time_handler.clone(), Interrupt::MachineTimer),
+            0,
         );
-        clint.set_irq_line(irq_line, 0);
-
-        let mut soft_handler = Box::new(MockIrqHandler {
-            triggered: false,
-            level: false,
-        });
-        let irq_line = IRQLine::new(
-            &mut *soft_handler as *mut MockIrqHandler,
-            Interrupt::MachineSoft,
+
+        let soft_handler = Arc::new(MockIrqHandler::default());
+        clint.set_irq_line(
+            IRQLine::new(soft_handler.clone(), Interrupt::MachineSoft),
+            1,
         );
-        clint.set_irq_line(irq_line, 1);
 
         (clint, timer, time_handler, soft_handler)
     }
@@ -283,6 +329,7 @@ mod tests {
 
         let full_time: u64 = clint.read_impl(0x0200bff8).unwrap();
         assert_eq!(full_time, 0x8765432112345678);
+        assert_eq!(clint.mtime().now(), full_time);
     }
 
     #[test]
@@ -318,7 +365,7 @@ mod tests {
 
     #[test]
     fn test_msip_read_write() {
-        let (mut clint, _timer, _time_handler, mut soft_handler) = create_test_clint();
+        let (mut clint, _timer, _time_handler, soft_handler) = create_test_clint();
 
         // Read MSIP (Hart 0)
         let initial_msip: u32 = clint.read_impl(0x02000000).unwrap();
@@ -328,20 +375,49 @@ mod tests {
         clint.write_impl::<u32>(0x02000000, 1).unwrap();
         let msip: u32 = clint.read_impl(0x02000000).unwrap();
         assert_eq!(msip, 1);
-        assert!(soft_handler.triggered);
-        assert!(soft_handler.level);
+        assert!(soft_handler.triggered());
+        assert!(soft_handler.level());
 
         // Clear MSIP (Hart 0)
-        soft_handler.triggered = false;
+        soft_handler.triggered.store(false, Ordering::Relaxed);
         clint.write_impl::<u32>(0x02000000, 0).unwrap();
         let msip: u32 = clint.read_impl(0x02000000).unwrap();
         assert_eq!(msip, 0);
-        assert!(soft_handler.triggered);
-        assert!(!soft_handler.level);
+        assert!(soft_handler.triggered());
+        assert!(!soft_handler.level());
 
         // Write MSIP (Hart 0) with other bits
         clint.write_impl::<u32>(0x02000000, 0x12345678).unwrap();
         let msip: u32 = clint.read_impl(0x02000000).unwrap();
         assert_eq!(msip, 0x12345678);
     }
+
+    #[test]
+    fn test_per_hart_lines() {
+        let clock = VirtualClockRef::new();
+        let timer = Arc::new(Mutex::new(Timer::new(clock.clone())));
+        let mut clint = Clint::new(2, 0x02000000, 0x0200bff8, 0x02004000, clock, timer);
+
+        let handlers: Vec<Arc<MockIrqHandler>> = (0..4)
+            .map(|_| Arc::new(MockIrqHandler::default()))
+            .collect();
+        for (id, handler) in handlers.iter().enumerate() {
+            let interrupt = if id % 2 == 0 {
+                Interrupt::MachineTimer
+            } else {
+                Interrupt::MachineSoft
+            };
+            clint.set_irq_line(IRQLine::new(handler.clone(), interrupt), id);
+        }
+
+        // msip of hart 1 only reaches hart 1.
+        clint.write_impl::<u32>(0x02000004, 1).unwrap();
+        assert!(!handlers[1].triggered());
+        assert!(handlers[3].triggered() && handlers[3].level());
+
+        // So does mtimecmp.
+        clint.write_impl::<u64>(0x02004008, 0).unwrap();
+        assert!(!handlers[0].triggered());
+        assert!(handlers[2].triggered() && handlers[2].level());
+    }
 }
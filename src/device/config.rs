@@ -10,6 +10,9 @@ pub const TEST_DEVICE_BASE: WordType = 0x10_1000;
 #[cfg(feature = "test-device")]
 pub const TEST_DEVICE_SIZE: WordType = 0x10;
 
+/// Every hart takes two PLIC contexts (M and S mode).
+pub const MAX_HART_CNT: usize = 8;
+
 pub const CLINT_NAME: &'static str = "clint";
 pub const CLINT_BASE: WordType = 0x200_0000;
 pub const CLINT_SIZE: WordType = 0x10000;
@@ -28,5 +31,7 @@ pub const UART_IRQ: u32 = 10;
 pub const VIRTIO_MMIO_NAME: &'static str = "virtio-mmio-device";
 pub const VIRTIO_MMIO_BASE: WordType = 0x1000_1000;
 pub const VIRTIO_MMIO_SIZE: WordType = 0x1000;
+/// PLIC interrupt source of the first VirtIO device, the next ones follow, as on QEMU `virt`.
+pub const VIRTIO_IRQ_BASE: u32 = 1;
 
 // pub const MMIO_FREQ_DIV: usize = 32;
@@ -2,18 +2,15 @@
 //! Some features are missing, and some behavior may be incorrect due to limited test coverage.
 
 use std::{
-    cell::RefCell,
     sync::{
-        Arc,
-        atomic::{AtomicBool, AtomicU8, Ordering},
+        Arc, Mutex,
+        atomic::{AtomicBool, AtomicU8, AtomicUsize, Ordering},
     },
     u8,
 };
 
-use crossbeam::channel::{Receiver, Sender};
-
 use crate::{
-    byte_io::{ByteSink, ByteSource, ChannelIOContext},
+    byte_io::{ByteSink, ByteSinkExt, ByteSource, RingConsumer, RingProducer, byte_ring},
     config::arch_config::WordType,
     device::{
         DeviceTrait, MemError, MemMappedDeviceTrait,
@@ -21,31 +18,93 @@ use crate::{
         plic::ExternalInterrupt,
     },
     device_poller::{PollingEventTrait, PollingFnWrapper},
+    snapshot::{SnapshotError, StateReader, StateWriter},
     utils::{clear_bit, read_bit, set_bit},
 };
 
 const UART_DATA_LENGTH: u8 = 8;
+/// Bytes in flight from the guest to the host, and from the host to the guest.
+const TX_RING_SIZE: usize = 64 * 1024;
+const RX_RING_SIZE: usize = 64 * 1024;
+/// Bytes kept behind a full output ring, the ones written past it are dropped.
+const TX_BACKLOG_LIMIT: usize = 64 * 1024;
+
+/// Bytes written to THR while the output ring was full, they come after every byte in the ring.
+///
+/// The UART appends to it, and the host end takes it once it has drained the ring, so that the
+/// bytes leave in every device poll round even if the guest writes no more. Both sides only lock it
+/// while `len` says it is not empty.
+#[derive(Default)]
+struct TxBacklog {
+    bytes: Mutex<Vec<u8>>,
+    len: AtomicUsize,
+}
+
+impl TxBacklog {
+    #[inline]
+    fn is_empty(&self) -> bool {
+        self.len.load(Ordering::Acquire) == 0
+    }
+
+    /// Move the leading bytes that fit into `ring`.
+    fn flush_to(&self, ring: &mut RingProducer) {
+        let mut bytes = self.bytes.lock().unwrap();
+        let pushed = ring.push_slice(&bytes);
+        bytes.drain(..pushed);
+        self.len.store(bytes.len(), Ordering::Release);
+    }
+
+    fn push(&self, byte: u8) {
+        let mut bytes = self.bytes.lock().unwrap();
+        if bytes.len() >= TX_BACKLOG_LIMIT {
+            log::warn!("uart output backlog overrun, byte 0x{:x} dropped", byte);
+            return;
+        }
+        bytes.push(byte);
+        self.len.store(bytes.len(), Ordering::Release);
+    }
 
+    /// Hand every byte of `ring`, then of the backlog, to `target`.
+    ///
+    /// The UART can't move the backlog into the ring while it is locked, so no byte overtakes another.
+    fn drain_after(&self, ring: &mut RingConsumer, target: &mut dyn ByteSink) -> bool {
+        let mut bytes = self.bytes.lock().unwrap();
+        let drained = ring.drain_to(target) || !bytes.is_empty();
+        target.receive_guard().receives(&bytes);
+        bytes.clear();
+        self.len.store(0, Ordering::Release);
+        drained
+    }
+}
+
+/// Host end of the UART.
+///
+/// The bytes go through lock-free rings, so the UART never waits for the host. The clones of a
+/// port share its end of the rings, they take turns with a lock.
 #[derive(Clone)]
 pub struct UartBytePort {
-    uart_io: ChannelIOContext,
+    input: Arc<Mutex<RingProducer>>,
+    output: Arc<Mutex<RingConsumer>>,
+    tx_backlog: Arc<TxBacklog>,
     ier: Arc<AtomicU8>,
     thre_pending: Arc<AtomicBool>,
     rx_pending: Arc<AtomicBool>,
 }
 
 impl ByteSink for UartBytePort {
-    fn before_receive(&mut self) {
-        self.uart_io.before_receive();
-    }
+    fn before_receive(&mut self) {}
 
     fn do_receive(&mut self, byte: u8) {
         log::trace!("[uart] receive byte 0x{:x} (char {:?})", byte, byte as char);
-        self.uart_io.do_receive(byte);
+        self.input.lock().unwrap().do_receive(byte);
+    }
+
+    fn do_receive_slice(&mut self, bytes: &[u8]) {
+        log::trace!("[uart] receive {} bytes", bytes.len());
+        self.input.lock().unwrap().do_receive_slice(bytes);
     }
 
     fn after_receive(&mut self, received: bool) {
-        self.uart_io.after_receive(received);
         if received {
             self.rx_pending.store(true, Ordering::Release);
         }
@@ -54,7 +113,12 @@ impl ByteSink for UartBytePort {
 
 impl ByteSource for UartBytePort {
     fn drain_to(&mut self, target: &mut dyn ByteSink) -> bool {
-        self.uart_io.drain_to(target)
+        let mut output = self.output.lock().unwrap();
+        if self.tx_backlog.is_empty() {
+            output.drain_to(target)
+        } else {
+            self.tx_backlog.drain_after(&mut output, target)
+        }
     }
 }
 
@@ -139,15 +203,83 @@ impl Uart16550Reg {
     }
 }
 
+impl Uart16550Reg {
+    /// The register read at `offset` with DLAB clear.
+    fn readable(&mut self, offset: usize) -> &mut u8 {
+        [
+            &mut self.RBR,
+            &mut self.IER,
+            &mut self.IIR,
+            &mut self.LCR,
+            &mut self.MCR,
+            &mut self.LSR,
+            &mut self.MSR,
+            &mut self.SCR,
+        ][offset]
+    }
+
+    /// The register written at `offset` with DLAB clear.
+    fn writable(&mut self, offset: usize) -> &mut u8 {
+        [
+            &mut self.THR,
+            &mut self.IER,
+            &mut self.FCR,
+            &mut self.LCR,
+            &mut self.MCR,
+            &mut self.LSR,
+            &mut self.MSR,
+            &mut self.SCR,
+        ][offset]
+    }
+
+    /// The register read and written at `offset` with DLAB set.
+    fn latched(&mut self, offset: usize) -> &mut u8 {
+        [
+            &mut self.DLL,
+            &mut self.DLM,
+            &mut self.FCR,
+            &mut self.LCR,
+            &mut self.MCR,
+            &mut self.LSR,
+            &mut self.MSR,
+            &mut self.SCR,
+        ][offset]
+    }
+
+    /// Every register, in the order of [`Self::fields`].
+    fn values(&self) -> [u8; 12] {
+        [
+            self.RBR, self.THR, self.IER, self.IIR, self.FCR, self.LCR, self.MCR, self.LSR,
+            self.MSR, self.SCR, self.DLL, self.DLM,
+        ]
+    }
+
+    fn fields(&mut self) -> [&mut u8; 12] {
+        [
+            &mut self.RBR,
+            &mut self.THR,
+            &mut self.IER,
+            &mut self.IIR,
+            &mut self.FCR,
+            &mut self.LCR,
+            &mut self.MCR,
+            &mut self.LSR,
+            &mut self.MSR,
+            &mut self.SCR,
+            &mut self.DLL,
+            &mut self.DLM,
+        ]
+    }
+}
+
 #[allow(non_snake_case)]
 pub struct FastUart16550 {
-    reg: Arc<RefCell<Uart16550Reg>>,
-    reg_ptr: [*const u8; 8],
-    reg_mut_ptr: [*mut u8; 8],
-    reg_lcr_ptr: [*mut u8; 8],
+    reg: Uart16550Reg,
 
-    input_rx: Receiver<u8>,
-    output_tx: Sender<u8>,
+    input: RingConsumer,
+    output: RingProducer,
+    /// A guest waiting for LSR.THRE never writes into the backlog, THRE is clear while it is not empty.
+    tx_backlog: Arc<TxBacklog>,
 
     /// Shared IER value for the polling thread to check interrupt conditions.
     ier_shared: Arc<AtomicU8>,
@@ -161,9 +293,11 @@ pub struct FastUart16550 {
 
 impl FastUart16550 {
     pub fn new() -> (Self, UartBytePort) {
-        let (channel1, channel2) = ChannelIOContext::new();
-        let uart = Self::from_channel(channel1.input_receiver, channel1.output_sender);
+        let (input_producer, input_consumer) = byte_ring(RX_RING_SIZE);
+        let (output_producer, output_consumer) = byte_ring(TX_RING_SIZE);
+        let uart = Self::from_rings(input_consumer, output_producer);
 
+        let tx_backlog = uart.tx_backlog.clone();
         let ier = uart.ier_shared.clone();
         let thre_pending = uart.thre_pending.clone();
         let rx_pending = uart.rx_pending.clone();
@@ -171,7 +305,9 @@ impl FastUart16550 {
         (
             uart,
             UartBytePort {
-                uart_io: channel2,
+                input: Arc::new(Mutex::new(input_producer)),
+                output: Arc::new(Mutex::new(output_consumer)),
+                tx_backlog,
                 ier,
                 thre_pending,
                 rx_pending,
@@ -179,52 +315,16 @@ impl FastUart16550 {
         )
     }
 
-    pub fn from_channel(input_rx: Receiver<u8>, output_tx: Sender<u8>) -> Self {
-        let reg = Arc::new(RefCell::new(Uart16550Reg::new()));
-        let mut reg_ref = reg.borrow_mut();
-        let reg_ptr = [
-            (&reg_ref.RBR) as *const u8,
-            (&reg_ref.IER) as *const u8,
-            (&reg_ref.IIR) as *const u8,
-            (&reg_ref.LCR) as *const u8,
-            (&reg_ref.MCR) as *const u8,
-            (&reg_ref.LSR) as *const u8,
-            (&reg_ref.MSR) as *const u8,
-            (&reg_ref.SCR) as *const u8,
-        ];
-        let reg_mut_ptr = [
-            (&mut reg_ref.THR) as *mut u8,
-            (&mut reg_ref.IER) as *mut u8,
-            (&mut reg_ref.FCR) as *mut u8,
-            (&mut reg_ref.LCR) as *mut u8,
-            (&mut reg_ref.MCR) as *mut u8,
-            (&mut reg_ref.LSR) as *mut u8,
-            (&mut reg_ref.MSR) as *mut u8,
-            (&mut reg_ref.SCR) as *mut u8,
-        ];
-        let reg_lcr_ptr = [
-            (&mut reg_ref.DLL) as *mut u8,
-            (&mut reg_ref.DLM) as *mut u8,
-            (&mut reg_ref.FCR) as *mut u8,
-            (&mut reg_ref.LCR) as *mut u8,
-            (&mut reg_ref.MCR) as *mut u8,
-            (&mut reg_ref.LSR) as *mut u8,
-            (&mut reg_ref.MSR) as *mut u8,
-            (&mut reg_ref.SCR) as *mut u8,
-        ];
-
+    pub fn from_rings(input: RingConsumer, output: RingProducer) -> Self {
         let ier_shared = Arc::new(AtomicU8::new(0));
         let thre_pending = Arc::new(AtomicBool::new(true)); // THR is initially empty.
         let rx_pending = Arc::new(AtomicBool::new(false)); // No RX data at reset.
 
-        drop(reg_ref);
         Self {
-            reg: reg.clone(),
-            reg_ptr,
-            reg_mut_ptr,
-            reg_lcr_ptr,
-            input_rx,
-            output_tx,
+            reg: Uart16550Reg::new(),
+            input,
+            output,
+            tx_backlog: Arc::new(TxBacklog::default()),
             ier_shared,
             thre_pending,
             rx_pending,
@@ -233,7 +333,7 @@ impl FastUart16550 {
 
     /// Compute a simplified IIR (Interrupt Identification Register) view based on current IER/LSR/FCR state.
     fn compute_iir(&mut self) -> u8 {
-        let reg = self.reg.borrow();
+        let reg = &self.reg;
         let ier = reg.IER;
         let lsr = reg.LSR;
         let fcr = reg.FCR;
@@ -297,9 +397,9 @@ impl FastUart16550 {
         T: crate::utils::UnsignedInteger,
     {
         // check terminal input.
-        if !read_bit(&mut self.reg.borrow_mut().LSR, 0) {
+        if !read_bit(&mut self.reg.LSR, 0) {
             // receive data ready.
-            if let Ok(data) = self.input_rx.try_recv() {
+            if let Some(data) = self.input.pop() {
                 self.write_RBR(data)
             }
         }
@@ -309,12 +409,10 @@ impl FastUart16550 {
         debug_assert!(inner_addr as usize + size <= 8);
 
         let mut data: T = 0u8.into();
-        if (self.reg.borrow().LCR & (1 << 7)) == (1 << 7) {
+        if (self.reg.LCR & (1 << 7)) == (1 << 7) {
             // LCR
             for i in inner_addr..8.min(inner_addr + size) {
-                data |= T::from(
-                    unsafe { self.reg_lcr_ptr[i].read_volatile() } << (8 * (i - inner_addr)),
-                )
+                data |= T::from(*self.reg.latched(i) << (8 * (i - inner_addr)))
             }
         } else {
             // Normal
@@ -324,10 +422,10 @@ impl FastUart16550 {
                 } else if i == 2 {
                     // IIR: compute dynamically instead of reading stale value
                     data |= T::from(self.compute_iir() << (8 * (i - inner_addr)));
+                } else if i == 5 {
+                    data |= T::from(self.read_LSR() << (8 * (i - inner_addr)));
                 } else {
-                    data |= T::from(
-                        unsafe { self.reg_ptr[i].read_volatile() } << (8 * (i - inner_addr)),
-                    );
+                    data |= T::from(*self.reg.readable(i) << (8 * (i - inner_addr)));
                 }
             }
         }
@@ -344,10 +442,10 @@ impl FastUart16550 {
         assert!(inner_addr as usize + size <= 8);
         let mut data: u64 = data.into();
 
-        if (self.reg.borrow().LCR & (1 << 7)) == (1 << 7) {
+        if (self.reg.LCR & (1 << 7)) == (1 << 7) {
             // LCR (Divisor Latch Access)
             for i in inner_addr..8.min(inner_addr + size) {
-                unsafe { self.reg_lcr_ptr[i].write_volatile((data & (0xff)) as u8) }
+                *self.reg.latched(i) = (data & (0xff)) as u8;
                 data >>= 8;
             }
         } else {
@@ -365,14 +463,14 @@ impl FastUart16550 {
                             '.'
                         }
                     );
-                    let _ = self.output_tx.send(byte);
+                    self.transmit(byte);
                     // In a real 16550, writing THR clears LSR[5] (THRE) momentarily,
                     // then sets it again when the shift register accepts the byte.
                     // Since fast_uart sends instantly, we just re-arm the THRE event.
                     self.thre_pending
                         .store(true, std::sync::atomic::Ordering::Release);
                 } else {
-                    unsafe { self.reg_mut_ptr[i].write_volatile((data & (0xff)) as u8) };
+                    *self.reg.writable(i) = (data & (0xff)) as u8;
                     if i == 1 {
                         let new_ier = (data & 0xff) as u8;
                         let old_ier = self
@@ -401,19 +499,48 @@ impl FastUart16550 {
 
     #[allow(non_snake_case)]
     fn read_RBR(&mut self) -> u8 {
-        clear_bit(&mut self.reg.borrow_mut().LSR, 0); // receive data ready.
+        clear_bit(&mut self.reg.LSR, 0); // receive data ready.
         // RDA must stay asserted while more bytes remain queued from the terminal,
         // and drop once the last one is consumed.
-        self.rx_pending
-            .store(!self.input_rx.is_empty(), Ordering::Release);
-        self.reg.borrow().RBR
+        let queued = !self.input.is_empty();
+        self.rx_pending.store(queued, Ordering::Release);
+        self.reg.RBR
+    }
+
+    /// THRE and TEMT tell whether the output ring has room, so that a guest waiting for THRE
+    /// writes no faster than the host drains.
+    #[allow(non_snake_case)]
+    fn read_LSR(&mut self) -> u8 {
+        self.flush_tx_backlog();
+        let room = self.tx_backlog.is_empty() && !self.output.is_full();
+
+        let reg = &mut self.reg;
+        if room {
+            reg.LSR |= 0x60;
+        } else {
+            reg.LSR &= !0x60;
+        }
+        reg.LSR
+    }
+
+    fn transmit(&mut self, byte: u8) {
+        self.flush_tx_backlog();
+        if !self.tx_backlog.is_empty() || !self.output.push(byte) {
+            self.tx_backlog.push(byte);
+        }
+    }
+
+    fn flush_tx_backlog(&mut self) {
+        if !self.tx_backlog.is_empty() {
+            self.tx_backlog.flush_to(&mut self.output);
+        }
     }
 
     #[allow(non_snake_case)]
     fn write_RBR(&mut self, data: u8) {
-        set_bit(&mut self.reg.borrow_mut().LSR, 0); // receive data ready.
+        set_bit(&mut self.reg.LSR, 0); // receive data ready.
         self.rx_pending.store(true, Ordering::Release);
-        self.reg.borrow_mut().RBR = data
+        self.reg.RBR = data
     }
 }
 
@@ -437,6 +564,28 @@ impl DeviceTrait for FastUart16550 {
             )
         })))
     }
+
+    fn save_state(&self, out: &mut StateWriter) {
+        for field in self.reg.values() {
+            out.write_u8(field);
+        }
+        out.write_bool(self.thre_pending.load(Ordering::Acquire));
+        out.write_bool(self.rx_pending.load(Ordering::Acquire));
+    }
+
+    /// Bytes still queued from the terminal are kept, they arrive after the restored ones.
+    fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        let reg = &mut self.reg;
+        for field in reg.fields() {
+            *field = state.read_u8()?;
+        }
+        self.ier_shared.store(reg.IER, Ordering::Release);
+        self.thre_pending
+            .store(state.read_bool()?, Ordering::Release);
+        let rx_pending = state.read_bool()? || !self.input.is_empty();
+        self.rx_pending.store(rx_pending, Ordering::Release);
+        Ok(())
+    }
 }
 
 impl MemMappedDeviceTrait for FastUart16550 {
@@ -483,6 +632,59 @@ mod test {
         assert_eq!(uart.read_impl::<u8>(5).unwrap() & 1u8, 0);
     }
 
+    /// LSR.THRE stays clear while the output ring is full, and bytes written anyway are kept
+    /// behind the ones already in the ring.
+    #[test]
+    fn full_output_ring_holds_back_transmitter() {
+        let (mut uart, mut port) = FastUart16550::new();
+        let lsr_thre = |uart: &mut FastUart16550| uart.read_impl::<u8>(5).unwrap() & 0x20 != 0;
+
+        for i in 0..TX_RING_SIZE {
+            uart.write_impl(0, i as u8).unwrap();
+        }
+        assert!(!lsr_thre(&mut uart));
+        uart.write_impl(0, b'!').unwrap();
+
+        let mut received = Vec::new();
+        port.drain_to(&mut received);
+        assert!(lsr_thre(&mut uart));
+        port.drain_to(&mut received);
+
+        assert_eq!(received.len(), TX_RING_SIZE + 1);
+        assert!(
+            received[..TX_RING_SIZE]
+                .iter()
+                .enumerate()
+                .all(|(i, &byte)| byte == i as u8)
+        );
+        assert_eq!(received[TX_RING_SIZE], b'!');
+    }
+
+    /// The host end takes the backlog on its own, and past its limit the bytes are dropped.
+    #[test]
+    fn output_backlog_drains_without_guest_and_is_bounded() {
+        let (mut uart, mut port) = FastUart16550::new();
+
+        for i in 0..TX_RING_SIZE + TX_BACKLOG_LIMIT + 16 {
+            uart.write_impl(0, i as u8).unwrap();
+        }
+
+        let mut received = Vec::new();
+        port.drain_to(&mut received);
+        assert_eq!(received.len(), TX_RING_SIZE + TX_BACKLOG_LIMIT);
+        assert!(
+            received
+                .iter()
+                .enumerate()
+                .all(|(i, &byte)| byte == i as u8)
+        );
+
+        uart.write_impl(0, b'!').unwrap();
+        received.clear();
+        port.drain_to(&mut received);
+        assert_eq!(received, [b'!']);
+    }
+
     // Interrupt evaluation is now driven by `poll_interrupt`, decoupled from the
     // byte-receive callbacks. These tests exercise it directly.
 
@@ -1,7 +1,7 @@
 use std::{
-    cell::{RefCell, UnsafeCell},
     cmp::Ordering,
-    rc::Rc,
+    hint::cold_path,
+    sync::{Arc, Mutex},
 };
 
 use crate::{
@@ -9,13 +9,17 @@ use crate::{
     device::{DeviceTrait, MemError},
     ram::Ram,
     ram_config,
-    utils::{TruncateTo, UnsignedInteger, check_align},
+    stats::{self, Counter},
+    utils::{TruncateFrom, UnsignedInteger, check_align},
 };
 
+#[derive(Clone)]
 pub struct MemoryMapItem {
     pub(crate) start: WordType,
     pub(crate) size: WordType,
-    pub(crate) device: Rc<RefCell<dyn DeviceTrait>>,
+    pub(crate) device: Arc<Mutex<dyn DeviceTrait>>,
+    /// Shown in the statistics.
+    pub(crate) name: &'static str,
 }
 
 impl PartialEq for MemoryMapItem {
@@ -39,14 +43,93 @@ impl MemoryMapItem {
     pub(crate) fn new(
         start: WordType,
         size: WordType,
-        device: Rc<RefCell<dyn DeviceTrait>>,
+        device: Arc<Mutex<dyn DeviceTrait>>,
     ) -> Self {
         Self {
             start,
             size,
             device,
+            name: "device",
         }
     }
+
+    pub(crate) fn named(mut self, name: &'static str) -> Self {
+        self.name = name;
+        self
+    }
+}
+
+/// Log2 of the granularity of [`DevicePages`].
+const DEVICE_PAGE_XLEN: u32 = 12;
+/// Log2 of the span of a leaf of [`DevicePages`].
+const DEVICE_LEAF_XLEN: u32 = 21;
+const DEVICE_LEAF_PAGE_CNT: usize = 1 << (DEVICE_LEAF_XLEN - DEVICE_PAGE_XLEN);
+const DEVICE_ROOT_CNT: usize = (ram_config::BASE_ADDR >> DEVICE_LEAF_XLEN) as usize;
+
+/// No device on the page.
+const NO_DEVICE: u8 = 0;
+/// Several devices on the page, the map has to be searched.
+const SHARED_PAGE: u8 = u8::MAX;
+
+/// The device on every page below RAM, as its index + 1 in the map.
+///
+/// The table has two levels, so that only the spans holding a device have a leaf: a few KiB for
+/// the `virt` board.
+struct DevicePages {
+    /// Index + 1 into `leaves` of every span, `0` if it holds no device.
+    roots: Box<[u16]>,
+    leaves: Vec<[u8; DEVICE_LEAF_PAGE_CNT]>,
+}
+
+impl DevicePages {
+    fn new(map: &[MemoryMapItem]) -> Self {
+        assert!(
+            map.len() < SHARED_PAGE as usize,
+            "At most {} devices can be mapped.",
+            SHARED_PAGE - 1
+        );
+
+        let mut roots = vec![0u16; DEVICE_ROOT_CNT].into_boxed_slice();
+        let mut leaves: Vec<[u8; DEVICE_LEAF_PAGE_CNT]> = Vec::new();
+        for (index, item) in map.iter().enumerate() {
+            if item.size == 0 || item.start >= ram_config::BASE_ADDR {
+                continue;
+            }
+
+            let end = item
+                .start
+                .saturating_add(item.size)
+                .min(ram_config::BASE_ADDR);
+            let first = item.start >> DEVICE_PAGE_XLEN;
+            let last = (end - 1) >> DEVICE_PAGE_XLEN;
+            for page in first..=last {
+                let root = &mut roots[(page >> (DEVICE_LEAF_XLEN - DEVICE_PAGE_XLEN)) as usize];
+                if *root == 0 {
+                    leaves.push([NO_DEVICE; DEVICE_LEAF_PAGE_CNT]);
+                    *root = leaves.len() as u16;
+                }
+
+                let slot = &mut leaves[*root as usize - 1][page as usize % DEVICE_LEAF_PAGE_CNT];
+                *slot = if *slot == NO_DEVICE {
+                    index as u8 + 1
+                } else {
+                    SHARED_PAGE
+                };
+            }
+        }
+
+        Self { roots, leaves }
+    }
+
+    /// `p_addr` must be below RAM.
+    #[inline(always)]
+    fn get(&self, p_addr: WordType) -> u8 {
+        let root = self.roots[(p_addr >> DEVICE_LEAF_XLEN) as usize];
+        if root == 0 {
+            return NO_DEVICE;
+        }
+        self.leaves[root as usize - 1][(p_addr >> DEVICE_PAGE_XLEN) as usize % DEVICE_LEAF_PAGE_CNT]
+    }
 }
 
 /// # mmio
@@ -59,9 +142,16 @@ impl MemoryMapItem {
 /// mmio.write::<u8>(UART1_ADDR + 0x06);
 /// mmio.write::<u32>(ram_config::BASE_ADDR + 0x03); // ILLIGAL! unaligned accesses
 /// ```
+///
+/// ## Sharing
+/// Every hart of a board has its own, over the same RAM and devices: a device is only reached with
+/// its lock held, so the harts running on their own threads access it one at a time.
 pub struct MemoryMapIO {
     map: Vec<MemoryMapItem>,
-    ram: Rc<UnsafeCell<Ram>>,
+    pages: DevicePages,
+    ram: Arc<Ram>,
+    /// Accesses to each device of `map`.
+    accesses: Vec<Counter>,
 }
 
 impl MemoryMapIO {
@@ -70,31 +160,15 @@ impl MemoryMapIO {
         T: crate::utils::UnsignedInteger,
     {
         if p_addr >= ram_config::BASE_ADDR {
-            return unsafe {
-                self.ram
-                    .as_mut_unchecked()
-                    .read(p_addr - ram_config::BASE_ADDR)
-            };
+            return self.ram.read(p_addr - ram_config::BASE_ADDR);
         }
 
-        match self.map.binary_search_by(|device| {
-            if p_addr < device.start {
-                Ordering::Greater
-            } else if p_addr > device.start {
-                Ordering::Less
-            } else {
-                Ordering::Equal
-            }
-        }) {
-            Ok(i) => self.read_from_device(i, p_addr),
-            Err(i) => {
-                if i == 0 {
-                    Err(MemError::LoadFault)
-                    // panic!("physical address: {} is not mapped to the device", p_addr);
-                } else {
-                    self.read_from_device(i - 1, p_addr)
-                }
+        match self.device_at(p_addr) {
+            Some(i) => {
+                self.count_access(i);
+                self.read_from_device(i, p_addr)
             }
+            None => Err(MemError::LoadFault),
         }
     }
 
@@ -102,68 +176,122 @@ impl MemoryMapIO {
     where
         T: crate::utils::UnsignedInteger,
     {
-        // let _guard = self.lock();
         if p_addr >= ram_config::BASE_ADDR {
-            return unsafe {
-                self.ram
-                    .as_mut_unchecked()
-                    .write(p_addr - ram_config::BASE_ADDR, data)
-            };
+            return self.ram.write(p_addr - ram_config::BASE_ADDR, data);
         }
-        match self.map.binary_search_by(|device| {
-            if p_addr < device.start {
-                Ordering::Greater
-            } else if p_addr > device.start {
-                Ordering::Less
-            } else {
-                Ordering::Equal
-            }
-        }) {
-            Ok(i) => self.write_to_device(i, p_addr, data),
-            Err(i) => {
-                if i == 0 {
-                    // panic!("physical address: {} is not mapped to the device", p_addr);
-                    Err(MemError::StoreFault)
-                } else {
-                    self.write_to_device(i - 1, p_addr, data)
-                }
+        match self.device_at(p_addr) {
+            Some(i) => {
+                self.count_access(i);
+                self.write_to_device(i, p_addr, data)
             }
+            None => Err(MemError::StoreFault),
         }
     }
 
-    pub fn load_reserved<T>(&mut self, p_addr: WordType) -> Result<T, MemError>
+    pub fn load_reserved<T>(&mut self, hart_id: usize, p_addr: WordType) -> Result<T, MemError>
     where
         T: crate::utils::UnsignedInteger,
     {
         if p_addr >= ram_config::BASE_ADDR {
-            return unsafe {
-                self.ram
-                    .as_mut_unchecked()
-                    .load_reserved(p_addr - ram_config::BASE_ADDR)
-            };
+            return self
+                .ram
+                .load_reserved(hart_id, p_addr - ram_config::BASE_ADDR);
         }
         // Fallback for MMIO: treat as normal read, no reservation
         self.read_by_type(p_addr)
     }
 
-    pub fn store_conditional<T>(&mut self, p_addr: WordType, data: T) -> Result<bool, MemError>
+    pub fn store_conditional<T>(
+        &mut self,
+        hart_id: usize,
+        p_addr: WordType,
+        data: T,
+    ) -> Result<bool, MemError>
     where
         T: crate::utils::UnsignedInteger,
     {
         if p_addr >= ram_config::BASE_ADDR {
-            return unsafe {
-                self.ram
-                    .as_mut_unchecked()
-                    .store_conditional(p_addr - ram_config::BASE_ADDR, data)
-            };
+            return self
+                .ram
+                .store_conditional(hart_id, p_addr - ram_config::BASE_ADDR, data);
         }
         // Fallback for MMIO: always fail SC
         Ok(false)
     }
 
-    pub fn from_mmio_items(ram: Rc<UnsafeCell<Ram>>, mut map: Vec<MemoryMapItem>) -> Self {
+    /// Copy `buf.len()` bytes of RAM from `p_addr`, in one go.
+    ///
+    /// It fails, with nothing read, if any of the bytes is outside RAM: the caller then falls back
+    /// to [`Self::read_by_type`], which also reaches the devices and tells which access faults.
+    pub fn read_ram_bytes(&mut self, p_addr: WordType, buf: &mut [u8]) -> Result<(), MemError> {
+        let Some(offset) = p_addr.checked_sub(ram_config::BASE_ADDR) else {
+            return Err(MemError::LoadFault);
+        };
+        self.ram.read_bytes(offset, buf)
+    }
+
+    /// Copy `data` to RAM at `p_addr`, in one go, see [`Self::read_ram_bytes`].
+    pub fn write_ram_bytes(&mut self, p_addr: WordType, data: &[u8]) -> Result<(), MemError> {
+        let Some(offset) = p_addr.checked_sub(ram_config::BASE_ADDR) else {
+            return Err(MemError::StoreFault);
+        };
+        self.ram.write_bytes(offset, data)
+    }
+
+    pub fn from_mmio_items(ram: Arc<Ram>, mut map: Vec<MemoryMapItem>) -> Self {
         map.sort();
-        Self { map, ram }
+        let pages = DevicePages::new(&map);
+        let accesses = vec![Counter::ZERO; map.len()];
+        Self {
+            map,
+            pages,
+            ram,
+            accesses,
+        }
+    }
+
+    /// The name, base address and access count of every device, in address order.
+    pub(crate) fn access_counts(&self) -> impl Iterator<Item = (&'static str, WordType, u64)> {
+        self.map
+            .iter()
+            .zip(self.accesses.iter())
+            .map(|(item, accesses)| (item.name, item.start, accesses.get()))
+    }
+
+    #[inline(always)]
+    fn count_access(&mut self, device_index: usize) {
+        if stats::ENABLED {
+            self.accesses[device_index].incr();
+        }
+    }
+
+    /// The index in `map` of the device that may hold `p_addr`, which is below RAM.
+    #[inline(always)]
+    fn device_at(&self, p_addr: WordType) -> Option<usize> {
+        match self.pages.get(p_addr) {
+            NO_DEVICE => None,
+            SHARED_PAGE => {
+                cold_path();
+                self.search_device(p_addr)
+            }
+            slot => Some(slot as usize - 1),
+        }
+    }
+
+    /// The last device starting at or below `p_addr`.
+    fn search_device(&self, p_addr: WordType) -> Option<usize> {
+        match self.map.binary_search_by(|device| {
+            if p_addr < device.start {
+                Ordering::Greater
+            } else if p_addr > device.start {
+                Ordering::Less
+            } else {
+                Ordering::Equal
+            }
+        }) {
+            Ok(i) => Some(i),
+            Err(i) => i.checked_sub(1),
+        }
     }
 
     fn read_from_device<T>(&mut self, device_index: usize, p_addr: WordType) -> Result<T, MemError>
@@ -178,11 +306,22 @@ impl MemoryMapIO {
         }
 
         let start = self.map[device_index].start;
-        let device = &mut self.map[device_index].device;
-        device
-            .borrow_mut()
-            .read(p_addr - start, size_of::<T>() as u32)
-            .map(|x| x.truncate_to())
+        let mut device = self.map[device_index].device.lock().unwrap();
+        let offset = p_addr - start;
+        match T::BITS {
+            8 => device
+                .read_u8(offset)
+                .map(<T as TruncateFrom<u8>>::truncate_from),
+            16 => device
+                .read_u16(offset)
+                .map(<T as TruncateFrom<u16>>::truncate_from),
+            32 => device
+                .read_u32(offset)
+                .map(<T as TruncateFrom<u32>>::truncate_from),
+            _ => device
+                .read_u64(offset)
+                .map(<T as TruncateFrom<u64>>::truncate_from),
+        }
     }
 
     // write data to specific device.
@@ -203,10 +342,14 @@ impl MemoryMapIO {
         }
 
         let start = self.map[device_index].start;
-        let device = &mut self.map[device_index].device;
-        device
-            .borrow_mut()
-            .write(p_addr - start, size_of::<T>() as u32, data.truncate_to())
+        let mut device = self.map[device_index].device.lock().unwrap();
+        let offset = p_addr - start;
+        match T::BITS {
+            8 => device.write_u8(offset, data.truncate_to()),
+            16 => device.write_u16(offset, data.truncate_to()),
+            32 => device.write_u32(offset, data.truncate_to()),
+            _ => device.write_u64(offset, data.truncate_to()),
+        }
     }
 
     fn can_access<T>(&self, device_index: usize, p_addr: WordType) -> bool {
@@ -224,9 +367,8 @@ impl DeviceTrait for MemoryMapIO {
     dispatch_read_write! { read_by_type, write_by_type }
 
     fn sync(&mut self) {
-        // let _guard = self.lock();
-        for item in self.map.iter_mut() {
-            item.device.borrow_mut().sync();
+        for item in self.map.iter() {
+            item.device.lock().unwrap().sync();
         }
     }
     fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
@@ -249,7 +391,7 @@ mod test {
 
     #[test]
     fn mmio_mem_test() {
-        let ram = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram = Arc::new(Ram::new());
 
         let (uart1, _port) = FastUart16550::new();
         let power_manager = PowerManager::new();
@@ -257,9 +399,9 @@ mod test {
             MemoryMapItem::new(
                 POWER_MANAGER_BASE,
                 POWER_MANAGER_SIZE,
-                Rc::new(RefCell::new(power_manager)),
+                Arc::new(Mutex::new(power_manager)),
             ),
-            MemoryMapItem::new(UART_BASE, UART_SIZE, Rc::new(RefCell::new(uart1))),
+            MemoryMapItem::new(UART_BASE, UART_SIZE, Arc::new(Mutex::new(uart1))),
         ];
 
         let mut mmio = MemoryMapIO::from_mmio_items(ram, table);
@@ -279,16 +421,16 @@ mod test {
 
     #[test]
     fn mmio_stdout_test() {
-        let ram = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram = Arc::new(Ram::new());
         let (uart1, mut port1) = FastUart16550::new();
         let power_manager = PowerManager::new();
         let table = vec![
             MemoryMapItem::new(
                 POWER_MANAGER_BASE,
                 POWER_MANAGER_SIZE,
-                Rc::new(RefCell::new(power_manager)),
+                Arc::new(Mutex::new(power_manager)),
             ),
-            MemoryMapItem::new(UART_BASE, UART_SIZE, Rc::new(RefCell::new(uart1))),
+            MemoryMapItem::new(UART_BASE, UART_SIZE, Arc::new(Mutex::new(uart1))),
         ];
 
         let mut mmio = MemoryMapIO::from_mmio_items(ram, table);
@@ -319,13 +461,60 @@ mod test {
         }
     }
 
+    /// Reads its value at any offset.
+    struct ValueDevice(u32);
+
+    impl DeviceTrait for ValueDevice {
+        fn read(&mut self, _addr: WordType, _len: u32) -> Result<u64, MemError> {
+            Ok(self.0 as u64)
+        }
+
+        fn write(&mut self, _addr: WordType, _len: u32, _data: u64) -> Result<(), MemError> {
+            Ok(())
+        }
+
+        fn sync(&mut self) {}
+
+        fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
+            None
+        }
+    }
+
+    #[test]
+    fn mmio_finds_devices_by_page() {
+        let ram = Arc::new(Ram::new());
+        let device =
+            |value| -> Arc<Mutex<dyn DeviceTrait>> { Arc::new(Mutex::new(ValueDevice(value))) };
+        let table = vec![
+            // Two devices on one page.
+            MemoryMapItem::new(0x1000, 4, device(1)),
+            MemoryMapItem::new(0x1008, 4, device(2)),
+            MemoryMapItem::new(0x3000, 0x2000, device(3)),
+            MemoryMapItem::new(0x0c00_0000, 0x400_0000, device(4)),
+        ];
+
+        let mut mmio = MemoryMapIO::from_mmio_items(ram, table);
+
+        assert_eq!(mmio.read_by_type::<u32>(0x1000), Ok(1));
+        assert_eq!(mmio.read_by_type::<u32>(0x1004), Err(MemError::LoadFault));
+        assert_eq!(mmio.read_by_type::<u32>(0x1008), Ok(2));
+        assert_eq!(mmio.read_by_type::<u32>(0x2000), Err(MemError::LoadFault));
+        assert_eq!(mmio.read_by_type::<u8>(0x4fff), Ok(3));
+        assert_eq!(mmio.read_by_type::<u32>(0x5000), Err(MemError::LoadFault));
+        assert_eq!(mmio.read_by_type::<u64>(0x0fff_fff8), Ok(4));
+        assert_eq!(
+            mmio.write_by_type::<u32>(0x1000_0000, 0),
+            Err(MemError::StoreFault)
+        );
+    }
+
     #[test]
     fn mmio_rejects_accesses_crossing_device_end() {
-        let ram = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram = Arc::new(Ram::new());
         let table = vec![MemoryMapItem::new(
             0x1000,
             4,
-            Rc::new(RefCell::new(MockDevice)),
+            Arc::new(Mutex::new(MockDevice)),
         )];
 
         let mut mmio = MemoryMapIO::from_mmio_items(ram, table);
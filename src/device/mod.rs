@@ -1,4 +1,8 @@
-use crate::{config::arch_config::WordType, device_poller::PollingEventTrait};
+use crate::{
+    config::arch_config::WordType,
+    device_poller::PollingEventTrait,
+    snapshot::{SnapshotError, StateReader, StateWriter},
+};
 
 macro_rules! dispatch_read_write {
     ($read_impl: ident, $write_impl: ident) => {
@@ -30,6 +34,30 @@ macro_rules! dispatch_read_write {
                 _ => unreachable!(),
             }
         }
+
+        dispatch_read_write!(@typed $read_impl, $write_impl, u8, u16, u32, u64);
+    };
+
+    // The typed accesses go straight to the implementation, without the `len` match and the `u64`.
+    (@typed $read_impl: ident, $write_impl: ident, $($ty: ident),*) => {
+        $(
+            #[inline]
+            fn ${concat(read_, $ty)}(
+                &mut self,
+                addr: crate::config::arch_config::WordType,
+            ) -> Result<$ty, MemError> {
+                self.$read_impl::<$ty>(addr)
+            }
+
+            #[inline]
+            fn ${concat(write_, $ty)}(
+                &mut self,
+                addr: crate::config::arch_config::WordType,
+                data: $ty,
+            ) -> Result<(), MemError> {
+                self.$write_impl::<$ty>(addr, data)
+            }
+        )*
     };
 
     () => {
@@ -80,7 +108,8 @@ macro_rules! impl_write_for_type {
 }
 
 // Check align requirement before device.read/write. Most of align requirement was checked in mmio.
-pub trait DeviceTrait {
+// `Send`: the harts reach the devices from their threads, each device behind its own lock.
+pub trait DeviceTrait: Send {
     fn read(&mut self, addr: WordType, len: u32) -> Result<u64, MemError>;
     fn write(&mut self, addr: WordType, len: u32, data: u64) -> Result<(), MemError>;
 
@@ -96,6 +125,13 @@ pub trait DeviceTrait {
 
     fn sync(&mut self);
     fn get_poll_event(&mut self) -> Option<Box<dyn PollingEventTrait>>;
+
+    /// Save the guest visible state into a snapshot, devices without any keep the default.
+    fn save_state(&self, _out: &mut StateWriter) {}
+    /// Restore what [`DeviceTrait::save_state`] saved.
+    fn restore_state(&mut self, _state: &mut StateReader) -> Result<(), SnapshotError> {
+        Ok(())
+    }
 }
 
 pub trait MemMappedDeviceTrait: DeviceTrait {
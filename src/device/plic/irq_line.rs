@@ -1,3 +1,5 @@
+use std::sync::{Arc, Mutex};
+
 use crate::device::plic::ExternalInterrupt;
 
 pub trait PlicIRQHandler {
@@ -8,17 +10,18 @@ pub trait PlicIRQSource {
     fn set_irq_line(&mut self, line: PlicIRQLine, id: usize);
 }
 
-/// NOTE: Only used in single-threaded contexts.
+/// Raises an interrupt of the PLIC whichever thread the source runs on, the PLIC being locked
+/// like when a hart reaches its registers.
 pub struct PlicIRQLine {
-    target: *mut dyn PlicIRQHandler,
+    target: Arc<Mutex<dyn PlicIRQHandler + Send>>,
 }
 
 impl PlicIRQLine {
-    pub fn new(target: *mut dyn PlicIRQHandler) -> Self {
+    pub fn new(target: Arc<Mutex<dyn PlicIRQHandler + Send>>) -> Self {
         Self { target }
     }
 
     pub fn set_irq(&mut self, interrupt: ExternalInterrupt, level: bool) {
-        unsafe { &mut *self.target }.handle_irq(interrupt, level);
+        self.target.lock().unwrap().handle_irq(interrupt, level);
     }
 }
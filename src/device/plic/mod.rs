@@ -12,6 +12,8 @@ use crate::{
     board::virt::RiscvIRQSource,
     config::arch_config::WordType,
     device::{DeviceTrait, MemError, config::PLIC_SIZE, plic::irq_line::PlicIRQHandler},
+    device_poller::Doorbell,
+    snapshot::{SnapshotError, StateReader, StateWriter},
 };
 
 const PLIC_MAX_INTERRUPTS: usize = 1024;
@@ -235,6 +237,8 @@ impl PLICLayout {
 pub struct PLIC {
     layout: PLICLayout,
     irq_line: [Option<crate::board::virt::IRQLine>; VIRT_MAX_CONTEXTS],
+    /// Rung when the arbitration result may have changed and [`Self::try_get_interrupt`] should run.
+    doorbell: Option<Doorbell>,
 }
 
 impl PLIC {
@@ -242,6 +246,18 @@ impl PLIC {
         PLIC {
             layout: PLICLayout::new(),
             irq_line: core::array::from_fn(|_| None),
+            doorbell: None,
+        }
+    }
+
+    pub fn set_doorbell(&mut self, doorbell: Doorbell) {
+        self.doorbell = Some(doorbell);
+    }
+
+    #[inline]
+    fn ring_doorbell(&self) {
+        if let Some(doorbell) = &self.doorbell {
+            doorbell.ring();
         }
     }
 
@@ -321,6 +337,7 @@ impl PLIC {
 
             self.layout
                 .set_priority(interrupt_id, unsafe { core::mem::transmute_copy(&data) });
+            self.ring_doorbell();
             Ok(())
         } else if inner_addr < CONTEXT_ENABLE_BIT_OFFSET {
             // pending is read-only
@@ -330,6 +347,7 @@ impl PLIC {
             if let Some((context_id, interrupt_id_div32)) = self.get_enable_word_index(inner_addr) {
                 self.layout.contexts[context_id].enable[interrupt_id_div32] =
                     unsafe { core::mem::transmute_copy(&data) };
+                self.ring_doorbell();
                 Ok(())
             } else {
                 Err(MemError::StoreFault)
@@ -342,6 +360,7 @@ impl PLIC {
                     // Priority Threshold
                     self.layout.contexts[context_id].priority_threshold =
                         unsafe { core::mem::transmute_copy(&data) };
+                    self.ring_doorbell();
                     Ok(())
                 } else if offset_in_context == 1 {
                     // Claim/Complete
@@ -353,10 +372,11 @@ impl PLIC {
                     *old_claim = 0;
                     // De-assert the interrupt line after completion.
                     // The next try_get_interrupt() call will re-assert if more
-                    // pending interrupts are waiting.
+                    // pending interrupts are waiting, the doorbell makes the board do it right away.
                     if let Some(irq_line) = &mut self.irq_line[context_id] {
                         irq_line.set_irq(false);
                     }
+                    self.ring_doorbell();
                     Ok(())
                 } else {
                     Err(MemError::StoreFault)
@@ -374,6 +394,7 @@ impl PLIC {
             return;
         }
         self.layout.pending.set_bit(interrupt_id);
+        self.ring_doorbell();
     }
 
     // pub fn clear_interrupt(&mut self, interrupt_id: usize) {
@@ -474,6 +495,60 @@ impl DeviceTrait for PLIC {
     fn sync(&mut self) {
         // nothing to do.
     }
+
+    fn save_state(&self, out: &mut StateWriter) {
+        let layout = &self.layout;
+        for interrupt_id in 1..VIRT_MAX_INTERRUPTS {
+            out.write_u32(layout.priority[interrupt_id]);
+        }
+        for bits in layout.pending.bits.iter() {
+            out.write_u32(bits.load(std::sync::atomic::Ordering::SeqCst));
+        }
+        for context in layout.contexts.iter() {
+            context
+                .enable
+                .iter()
+                .for_each(|&enable| out.write_u32(enable));
+            out.write_u32(context.priority_threshold);
+            out.write_u32(context.claim);
+        }
+        for interrupt_id in 0..VIRT_MAX_INTERRUPTS {
+            out.write_bool(layout.interrupt_sources_busy.contains(interrupt_id));
+        }
+    }
+
+    fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        for interrupt_id in 1..VIRT_MAX_INTERRUPTS {
+            let priority = state.read_u32()?;
+            self.layout
+                .set_priority(interrupt_id as ExternalInterrupt, priority);
+        }
+        for bits in self.layout.pending.bits.iter() {
+            bits.store(state.read_u32()?, std::sync::atomic::Ordering::SeqCst);
+        }
+        for context in self.layout.contexts.iter_mut() {
+            for enable in context.enable.iter_mut() {
+                *enable = state.read_u32()?;
+            }
+            context.priority_threshold = state.read_u32()?;
+            context.claim = state.read_u32()?;
+        }
+        self.layout.interrupt_sources_busy.clear();
+        for interrupt_id in 0..VIRT_MAX_INTERRUPTS {
+            if state.read_bool()? {
+                self.layout.interrupt_sources_busy.insert(interrupt_id);
+            }
+        }
+
+        // A claimed interrupt keeps its line asserted, the others are arbitrated again.
+        for (context, irq_line) in self.layout.contexts.iter().zip(self.irq_line.iter_mut()) {
+            if let Some(irq_line) = irq_line {
+                irq_line.set_irq(context.claim != 0);
+            }
+        }
+        self.ring_doorbell();
+        Ok(())
+    }
 }
 
 // Send the external interrupt resulting from the arbitration to the CPU through the IRQLine.
@@ -5,13 +5,20 @@ use crate::{
     },
     device_poller::PollingEventTrait,
 };
-use std::sync::atomic::AtomicU16;
+use std::sync::{
+    Arc,
+    atomic::{AtomicBool, AtomicU16, Ordering},
+};
 
 pub(crate) const POWER_OFF_CODE: u16 = 0x5555;
+/// Set to [`POWER_OFF_CODE`] by the host to power off the board, e.g. on `Ctrl+A x` at the terminal.
 pub static POWER_STATUS: AtomicU16 = AtomicU16::new(0);
 
 pub struct PowerManager {
     reg: u16,
+    /// Set when the guest powers off, so that boards running side by side don't stop each other.
+    /// It's atomic as the hart threads of the board watch it too.
+    powered_off: Arc<AtomicBool>,
 }
 
 impl PowerManager {
@@ -40,7 +47,7 @@ impl PowerManager {
         self.reg = data as u16;
 
         if self.reg == POWER_OFF_CODE {
-            POWER_STATUS.store(0x5555, std::sync::atomic::Ordering::Release);
+            self.powered_off.store(true, Ordering::Release);
         }
         Ok(())
     }
@@ -67,7 +74,15 @@ impl MemMappedDeviceTrait for PowerManager {
 
 impl PowerManager {
     pub fn new() -> Self {
-        POWER_STATUS.store(0, std::sync::atomic::Ordering::Release);
-        Self { reg: 0 }
+        POWER_STATUS.store(0, Ordering::Release);
+        Self {
+            reg: 0,
+            powered_off: Arc::new(AtomicBool::new(false)),
+        }
+    }
+
+    /// Whether the guest powered off, the board reads it between its steps.
+    pub(crate) fn powered_off(&self) -> Arc<AtomicBool> {
+        self.powered_off.clone()
     }
 }
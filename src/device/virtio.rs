@@ -1,6 +1,8 @@
 pub mod common;
 pub mod config;
 pub mod virtio_blk;
+mod virtio_blk_image;
+mod virtio_blk_io;
 pub mod virtio_device;
 pub mod virtio_mmio;
 pub mod virtio_queue;
@@ -2,3 +2,5 @@ pub const VIRT_MAGIC: u32 = 0x74726976; // virt
 pub const VIRT_VERSION: u32 = 0x2;
 pub const VIRT_VENDOR: u32 = 0x4A444E42; /* \'JDNB'/ */
 pub const VIRTQUEUE_MAX_SIZE: u32 = 1024;
+/// Queues a device can have behind one MMIO transport.
+pub const VIRTIO_MAX_QUEUES: usize = 8;
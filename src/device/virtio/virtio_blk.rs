@@ -1,19 +1,39 @@
 use core::slice;
 use std::{
     fs::{File, OpenOptions},
-    io::{Read, Seek, SeekFrom, Write},
-    sync::atomic::AtomicU8,
+    path::Path,
+    sync::{
+        Arc,
+        atomic::{AtomicU8, Ordering},
+    },
 };
 
 use log::error;
 use num_enum::TryFromPrimitive;
 
-use crate::device::virtio::{
-    virtio_device::{DEVICE_ID_ALLOCTOR, VirtIODeviceTrait},
-    virtio_mmio::VirtIODeviceStatus,
-    virtio_queue::{VirtQueue, VirtQueueDesc},
+use crate::{
+    device::{
+        plic::ExternalInterrupt,
+        virtio::{
+            config::VIRTIO_MAX_QUEUES,
+            virtio_blk_image::{BlkDisk, CowImage},
+            virtio_blk_io::{
+                BlkCompletions, BlkIoBackend, BlkJob, BlkOp, BlkRequest, GuestBuf, GuestRam,
+            },
+            virtio_device::{DEVICE_ID_ALLOCTOR, VirtIODeviceTrait},
+            virtio_mmio::VirtIODeviceStatus,
+            virtio_queue::{VirtQueue, VirtQueueAvailFlag},
+        },
+    },
+    device_poller::{PollingEventTrait, PollingFnWrapper},
+    ram::Ram,
+    snapshot::{SnapshotError, StateReader, StateWriter},
+    stats::BlkStats,
 };
 
+#[cfg(test)]
+use crate::device::virtio::virtio_blk_io::{read_at, write_all_at};
+
 pub(super) const SECTOR_SIZE: usize = 512;
 
 #[repr(u32)]
@@ -142,16 +162,6 @@ impl VirtioBlkReq {
     }
 }
 
-struct VirtIOBlkData {
-    data0: u8,
-    // data1, data2, ..., dataN
-}
-impl VirtIOBlkData {
-    fn as_mut_slice(&mut self, len: usize) -> &mut [u8] {
-        unsafe { slice::from_raw_parts_mut(&mut self.data0 as *mut u8, len) }
-    }
-}
-
 #[repr(u8)]
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub(crate) enum VirtIOBlkReqStatus {
@@ -164,20 +174,19 @@ pub(crate) enum VirtIOBlkReqStatus {
 pub(super) struct VirtioBlkStatus {
     pub(super) status: u8,
 }
-impl VirtioBlkStatus {
-    fn write_status(&mut self, status: VirtIOBlkReqStatus) {
-        self.status = status as u8;
-    }
-}
 
 // ======================================
 //          Virtio Block Device
 // ======================================
+/// Requests are parsed on the CPU thread, and run by a [`BlkIoBackend`] in the background.
+/// See [`virtio_blk_io`](super::virtio_blk_io).
 pub(crate) struct VirtIOBlkDevice {
     pub(crate) name: &'static str,
     pub(crate) status: u8,
-    pub(crate) isr: AtomicU8,
+    pub(crate) isr: Arc<AtomicU8>,
     pub(crate) device_id: u16,
+    /// The PLIC source raised while a used buffer notification is pending.
+    irq: Option<ExternalInterrupt>,
 
     host_feature: u64,
     guest_feature: u64,
@@ -185,10 +194,14 @@ pub(crate) struct VirtIOBlkDevice {
     pub(crate) generation: u32,
     ram_base_raw: usize,
 
-    file: File, // the file that is bound to this device
+    disk: Arc<BlkDisk>, // the image that is bound to this device
 
-    queue: VirtQueue,
+    queues: Vec<VirtQueue>,
+    queue_sel: usize,
+    io: BlkIoBackend,
+    completions: Arc<BlkCompletions>,
     pub(super) config_region: VirtioBlkConfig,
+    stats: Arc<BlkStats>,
 }
 
 impl VirtIOBlkDevice {
@@ -198,7 +211,7 @@ impl VirtIOBlkDevice {
         device_id: u16,
         file_path: String,
     ) -> Self {
-        let mut file;
+        let file;
         if let Ok(file_result) = OpenOptions::new()
             .read(true)
             .write(true)
@@ -210,14 +223,44 @@ impl VirtIOBlkDevice {
         } else {
             panic!("Can not find file: {}.", file_path);
         }
-        let size = file.seek(SeekFrom::End(0)).unwrap();
+
+        Self::with_disk(name, ram_base_raw, device_id, BlkDisk::Raw(file))
+    }
+
+    /// A device on the read-only image `image_path`, writing to the overlay `overlay_path`.
+    pub(crate) fn new_cow(
+        name: &'static str,
+        ram_base_raw: *mut u8,
+        device_id: u16,
+        image_path: &Path,
+        overlay_path: &Path,
+    ) -> Self {
+        let image = CowImage::open(image_path, overlay_path).unwrap_or_else(|err| {
+            panic!(
+                "Can not open image {} with overlay {}: {}.",
+                image_path.display(),
+                overlay_path.display(),
+                err
+            )
+        });
+
+        Self::with_disk(name, ram_base_raw, device_id, BlkDisk::Cow(image))
+    }
+
+    fn with_disk(name: &'static str, ram_base_raw: *mut u8, device_id: u16, disk: BlkDisk) -> Self {
+        let size = disk.size().unwrap();
+        let disk = Arc::new(disk);
+
+        let isr = Arc::new(AtomicU8::new(0));
+        let completions = Arc::new(BlkCompletions::new(isr.clone()));
 
         Self {
             name,
             status: 0,
             device_id,
+            irq: None,
 
-            isr: AtomicU8::new(0),
+            isr,
 
             host_feature: 0,
             guest_feature: 0,
@@ -225,51 +268,145 @@ impl VirtIOBlkDevice {
             generation: 0,
             ram_base_raw: ram_base_raw as usize,
 
-            file,
+            io: BlkIoBackend::new(&disk, 1, completions.clone()),
+            completions,
+            disk,
 
-            queue: VirtQueue::new(ram_base_raw, 0), // will be set later
+            queues: vec![VirtQueue::new(ram_base_raw, 0)], // will be set later
+            queue_sel: 0,
             config_region: VirtioBlkConfig::new(size.div_ceil(SECTOR_SIZE as u64)),
+            stats: Arc::new(BlkStats::default()),
         }
     }
 
+    /// The request counters, shared with the board for its statistics.
+    pub(crate) fn stats(&self) -> Arc<BlkStats> {
+        self.stats.clone()
+    }
+
     pub(crate) fn bound_file(&mut self, file: File) {
-        self.file = file;
+        self.completions.wait_idle();
+        self.disk = Arc::new(BlkDisk::Raw(file));
+        self.io = BlkIoBackend::new(&self.disk, self.queues.len(), self.completions.clone());
+    }
+
+    /// Offer `cnt` request queues, with `VIRTIO_BLK_F_MQ` when there are several.
+    fn set_queue_cnt(&mut self, cnt: usize) {
+        assert!(
+            (1..=VIRTIO_MAX_QUEUES).contains(&cnt),
+            "virtio-blk supports 1..={} queues",
+            VIRTIO_MAX_QUEUES
+        );
+
+        self.completions.wait_idle();
+        let ram_base_raw = self.ram_base_raw as *mut u8;
+        self.queues = (0..cnt).map(|_| VirtQueue::new(ram_base_raw, 0)).collect();
+        self.queue_sel = 0;
+        self.io = BlkIoBackend::new(&self.disk, cnt, self.completions.clone());
+
+        self.config_region.num_queues = cnt as u16;
+        if cnt > 1 {
+            self.host_feature |= VirtIOBlockFeature::Multiqueue as u64;
+        } else {
+            self.host_feature &= !(VirtIOBlockFeature::Multiqueue as u64);
+        }
     }
     pub fn add_host_feature(mut self, new_feature: VirtIOBlockFeature) -> Self {
         self.host_feature |= new_feature as u64;
         self
     }
 
-    fn write_blk(file: &mut File, buf: &[u8], offset: u64) -> u32 {
-        file.seek(std::io::SeekFrom::Start(offset)).unwrap();
-        match file.write_all(buf) {
+    #[cfg(test)]
+    fn write_blk(file: &File, buf: &[u8], offset: u64) -> u32 {
+        match write_all_at(file, buf, offset) {
             Ok(_) => buf.len() as u32,
             Err(_) => 0,
         }
     }
 
-    fn read_blk(file: &mut File, buf: &mut [u8], offset: u64) -> u32 {
-        file.seek(std::io::SeekFrom::Start(offset)).unwrap();
-        match file.read(buf) {
+    #[cfg(test)]
+    fn read_blk(file: &File, buf: &mut [u8], offset: u64) -> u32 {
+        match read_at(file, buf, offset) {
             Ok(len) => len as u32,
-            #[cfg(not(test))]
-            Err(_) => 0,
-            #[cfg(test)]
             Err(mes) => panic!("{}", mes),
         }
     }
 
-    fn manage_request_header(ram_base_raw: usize, desc: &VirtQueueDesc) -> (VirtioBlkReqType, u64) {
-        let req = unsafe {
-            desc.get_request_package::<VirtioBlkReq>(ram_base_raw)
-                .as_mut()
-                .unwrap()
+    /// Take the next request of queue `queue_idx`, as a job of its own.
+    ///
+    /// A request is a header, the data buffers, and a status byte, each in its own descriptors.
+    fn take_request(&mut self, queue_idx: usize) -> Option<BlkJob> {
+        let queue = &mut self.queues[queue_idx];
+        let (head, bufs) = queue.pop_chain()?;
+        let mut request = BlkRequest {
+            used: queue.used_ring_ref(),
+            head,
+            len: 0,
+            status: None,
+            interrupt: queue.get_avail_flag() == VirtQueueAvailFlag::Default,
+            written: Vec::new(),
         };
 
-        VirtioBlkReqType::try_from(req.request_type)
-            .map_or((VirtioBlkReqType::Unsupported, 0u64), |req_type| {
-                (req_type, req.sector)
-            })
+        let [header, data @ .., status] = &bufs[..] else {
+            error!("illigal virtio request: {} descriptors", bufs.len());
+            return Some(BlkJob::new(BlkOp::Nop, 0, Vec::new(), request));
+        };
+        request.status = Some(status.addr);
+
+        if header.len < size_of::<VirtioBlkReq>() {
+            error!("illigal virtio request: header of {} bytes", header.len);
+            return Some(BlkJob::new(BlkOp::Nop, 0, Vec::new(), request));
+        }
+        let header = unsafe { (header.addr as *const VirtioBlkReq).read_unaligned() };
+        let req_type = VirtioBlkReqType::try_from(header.request_type)
+            .unwrap_or(VirtioBlkReqType::Unsupported);
+
+        let op = match req_type {
+            VirtioBlkReqType::In => BlkOp::Read,
+            VirtioBlkReqType::Out => BlkOp::Write,
+            VirtioBlkReqType::Flush => BlkOp::Flush,
+            _ => {
+                error!("virtio unsupport request: {:#?}", req_type);
+                BlkOp::Nop
+            }
+        };
+
+        let data: Vec<GuestBuf> = match op {
+            BlkOp::Read | BlkOp::Write => data
+                .iter()
+                .map(|buf| GuestBuf {
+                    addr: buf.addr,
+                    len: buf.len,
+                })
+                .collect(),
+            _ => Vec::new(),
+        };
+        request.len = data.iter().map(|buf| buf.len as u32).sum();
+
+        match op {
+            BlkOp::Read => {
+                self.stats.reads.incr();
+                self.stats.bytes_read.add(request.len as u64);
+            }
+            BlkOp::Write => {
+                self.stats.writes.incr();
+                self.stats.bytes_written.add(request.len as u64);
+            }
+            BlkOp::Flush => self.stats.flushes.incr(),
+            BlkOp::Nop => {}
+        }
+
+        // Reported once the request is used, see BlkCompletions::drain.
+        if op == BlkOp::Read {
+            request.written = data.clone();
+        }
+
+        Some(BlkJob::new(
+            op,
+            header.sector * SECTOR_SIZE as u64,
+            data,
+            request,
+        ))
     }
 }
 
@@ -284,8 +421,8 @@ impl VirtIODeviceTrait for VirtIOBlkDevice {
         self.generation
     }
 
-    fn isr(&mut self) -> &mut AtomicU8 {
-        &mut self.isr
+    fn isr(&self) -> &AtomicU8 {
+        &self.isr
     }
     fn update_irq(&mut self) {}
 
@@ -301,112 +438,62 @@ impl VirtIODeviceTrait for VirtIOBlkDevice {
     }
 
     fn set_queue_num(&mut self, num: u32) {
-        self.queue.set_queue_num(num);
+        self.queues[self.queue_sel].set_queue_num(num);
     }
-    fn queue_select(&self, _idx: u32) {
-        // ONLY ONE QUEUE.
+    fn queue_select(&mut self, idx: u32) {
+        if (idx as usize) < self.queues.len() {
+            self.queue_sel = idx as usize;
+        } else {
+            error!("virtio-blk has no queue {}", idx);
+        }
     }
 
     fn set_desc(&mut self, addr: u64) {
-        self.queue.set_desc(addr);
+        self.queues[self.queue_sel].set_desc(addr);
     }
     fn set_avail(&mut self, addr: u64) {
-        self.queue.set_avail(addr);
+        self.queues[self.queue_sel].set_avail(addr);
     }
     fn set_used(&mut self, addr: u64) {
-        self.queue.set_used(addr);
+        self.queues[self.queue_sel].set_used(addr);
     }
 
+    /// Run one request of the selected queue, and wait until it is used.
     fn manage_one_request(&mut self) -> bool {
-        let mut req_type = VirtioBlkReqType::Unsupported;
-        let mut sector: u64 = 0;
-        let res = self
-            .queue
-            .manage_one_request(|desc: &VirtQueueDesc, idx: usize| match idx {
-                0 => {
-                    let t = Self::manage_request_header(self.ram_base_raw, desc);
-                    req_type = t.0;
-                    sector = t.1;
-                    0
-                }
-
-                1 => {
-                    let buf = unsafe {
-                        slice::from_raw_parts_mut(
-                            desc.get_request_package::<u8>(self.ram_base_raw),
-                            desc.len as usize,
-                        )
-                    };
-
-                    match req_type {
-                        VirtioBlkReqType::In => {
-                            Self::read_blk(&mut self.file, buf, sector * SECTOR_SIZE as u64)
-                        }
-                        VirtioBlkReqType::Out => {
-                            Self::write_blk(&mut self.file, buf, sector * SECTOR_SIZE as u64)
-                        }
-                        VirtioBlkReqType::Flush => {
-                            self.file.flush().unwrap();
-                            0
-                        }
-                        _ => {
-                            error!("virtio unsupport request: {:#?}", req_type);
-                            let status_bit = unsafe {
-                                desc.get_request_package::<VirtioBlkStatus>(self.ram_base_raw)
-                                    .as_mut()
-                                    .unwrap()
-                            };
-                            status_bit.write_status(VirtIOBlkReqStatus::Ok);
-                            0
-                        }
-                    }
-                }
-
-                2 => {
-                    let status_bit = unsafe {
-                        desc.get_request_package::<VirtioBlkStatus>(self.ram_base_raw)
-                            .as_mut()
-                            .unwrap()
-                    };
-                    status_bit.write_status(VirtIOBlkReqStatus::Ok);
-                    0
-                }
-
-                _ => {
-                    error!(
-                        "illigal virtio request: {:#?}. More than 3 description table",
-                        req_type
-                    );
-                    0
-                }
-            });
-        res
-    }
-
-    fn notify(&mut self, _idx: u32) {
-        let mut used = false;
-        loop {
-            if !self.manage_one_request() {
-                break;
-            }
-            used = true;
+        let Some(job) = self.take_request(self.queue_sel) else {
+            return false;
+        };
+        self.io.submit(self.queue_sel, vec![job]);
+        self.completions.wait_idle();
+        true
+    }
+
+    /// Submit every available request of the queue, without waiting for the disk.
+    /// The requests are used, and the interrupt raised, as their I/O completes.
+    fn notify(&mut self, idx: u32) {
+        let idx = idx as usize;
+        let mut jobs: Vec<BlkJob> = Vec::new();
+
+        while let Some(job) = self.take_request(idx) {
+            let job = match jobs.last_mut() {
+                Some(last) => match last.try_merge(job) {
+                    Ok(()) => continue,
+                    Err(job) => job,
+                },
+                None => job,
+            };
+            jobs.push(job);
         }
 
-        if used
-            && self.queue.get_avail_flag()
-                == crate::device::virtio::virtio_queue::VirtQueueAvailFlag::Default
-        {
-            self.isr.fetch_or(1, std::sync::atomic::Ordering::Release);
-            self.update_irq();
-        }
+        self.io.submit(idx, jobs);
     }
 
     fn queue_ready(&self) -> bool {
-        self.queue.ready()
+        self.queues[self.queue_sel].ready()
     }
 
     fn get_num_of_queue(&self) -> u32 {
-        1
+        self.queues.len() as u32
     }
 
     fn read_config(&mut self, idx: u64) -> u32 {
@@ -417,19 +504,66 @@ impl VirtIODeviceTrait for VirtIOBlkDevice {
         self.config_region.into_slice_mut()[idx as usize] = data
     }
 
-    fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
-        None
+    /// Push the completed requests to the used rings, and raise the interrupt while one is pending.
+    fn get_poll_event(&mut self) -> Option<Box<dyn PollingEventTrait>> {
+        let completions = self.completions.clone();
+        let irq = self.irq;
+        Some(Box::new(PollingFnWrapper::new(move || {
+            completions.drain();
+            irq.filter(|_| completions.pending_interrupt())
+        })))
+    }
+
+    /// Requests in flight are finished first, so that they are in the used rings of the snapshot.
+    fn save_state(&self, out: &mut StateWriter) {
+        self.completions.wait_idle();
+
+        out.write_u64(self.host_feature);
+        out.write_u8(self.status);
+        out.write_u8(self.isr.load(Ordering::Acquire));
+        out.write_u64(self.guest_feature);
+        out.write_u32(self.generation);
+        self.config_region
+            .into_slice()
+            .iter()
+            .for_each(|&word| out.write_u32(word));
+        out.write_u64(self.queues.len() as u64);
+        out.write_u64(self.queue_sel as u64);
+        self.queues.iter().for_each(|queue| queue.save_state(out));
+    }
+
+    fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        self.completions.wait_idle();
+
+        state.expect_u64(self.host_feature, "virtio-blk features")?;
+        self.status = state.read_u8()?;
+        self.isr.store(state.read_u8()?, Ordering::Release);
+        self.guest_feature = state.read_u64()?;
+        self.generation = state.read_u32()?;
+        for word in self.config_region.into_slice_mut() {
+            *word = state.read_u32()?;
+        }
+        state.expect_u64(self.queues.len() as u64, "virtio-blk queue count")?;
+        self.queue_sel = state.read_u64()? as usize;
+        if self.queue_sel >= self.queues.len() {
+            return Err(SnapshotError::BadFormat);
+        }
+        for queue in self.queues.iter_mut() {
+            queue.restore_state(state)?;
+        }
+        Ok(())
     }
 }
 
 #[cfg(test)]
 impl VirtIOBlkDevice {
     pub(crate) fn flush(&mut self) {
-        self.file.flush().unwrap();
+        self.completions.wait_idle();
+        self.disk.sync_data().unwrap();
     }
 
     pub(crate) fn queue(&mut self) -> &mut VirtQueue {
-        &mut self.queue
+        &mut self.queues[self.queue_sel]
     }
 }
 
@@ -450,6 +584,22 @@ impl VirtIOBlkDeviceBuilder {
         }
     }
 
+    /// A device on the read-only image `image`, keeping the guest writes in `overlay`.
+    ///
+    /// Many emulators can share one image, each with an overlay of its own.
+    pub fn with_overlay(ram_base_raw: *mut u8, image: &Path, overlay: &Path) -> Self {
+        let device_id = DEVICE_ID_ALLOCTOR.lock().unwrap().alloc();
+        Self {
+            device: VirtIOBlkDevice::new_cow(
+                "Unnamed VirtIO Block Device",
+                ram_base_raw,
+                device_id,
+                image,
+                overlay,
+            ),
+        }
+    }
+
     pub fn name(mut self, name: &'static str) -> Self {
         self.device.name = name;
         self
@@ -465,6 +615,26 @@ impl VirtIOBlkDeviceBuilder {
         self
     }
 
+    /// Number of request queues, see [`VirtIOBlockFeature::Multiqueue`].
+    pub fn queues(mut self, cnt: usize) -> Self {
+        self.device.set_queue_cnt(cnt);
+        self
+    }
+
+    /// The PLIC interrupt source of the device.
+    pub fn irq(mut self, irq: ExternalInterrupt) -> Self {
+        self.device.irq = Some(irq);
+        self
+    }
+
+    /// Report DMA writes to `ram`, which must be the memory `ram_base_raw` points to, so that code
+    /// decoded from them is dropped.
+    pub fn ram(self, ram: Arc<Ram>) -> Self {
+        debug_assert_eq!(ram.host_ptr(0) as usize, self.device.ram_base_raw);
+        self.device.completions.report_writes_to(GuestRam::new(ram));
+        self
+    }
+
     pub fn get(self) -> VirtIOBlkDevice {
         self.device
     }
@@ -475,7 +645,7 @@ pub fn init_block_file<'a, F>(path: &str, blk_num: u64, mut f: F) -> File
 where
     F: FnMut(usize) -> &'a [u8],
 {
-    use std::{fs::create_dir_all, path::Path};
+    use std::{fs::create_dir_all, io::Write, path::Path};
     let parent_dir = Path::new(path).parent().unwrap();
     create_dir_all(parent_dir).unwrap();
 
@@ -498,9 +668,12 @@ where
 
 #[cfg(test)]
 mod test {
+    use std::io::{Read, Seek};
+
     use crate::{
         device::virtio::virtio_queue::{
-            VirtQueueAvail, VirtQueueAvailFlag, VirtQueueDescFlag, VirtQueueUsed, VirtQueueUsedFlag,
+            VirtQueueAvail, VirtQueueAvailFlag, VirtQueueDesc, VirtQueueDescFlag, VirtQueueUsed,
+            VirtQueueUsedFlag,
         },
         ram::Ram,
         ram_config,
@@ -542,8 +715,8 @@ mod test {
         let file_name = String::from("./tmp/test_blk_read.txt");
         let _ = init_block_file(&file_name, 1, |_| &buf);
 
-        let mut ram = Ram::new();
-        let ram_base = &mut ram[0] as *mut u8;
+        let ram = Ram::new();
+        let ram_base = ram.host_ptr(0);
         let mut virt_device = VirtIOBlkDevice::new("VirtIO Block 0", ram_base, 0, file_name);
         virt_device.set_queue_num(QUEUE_NUM as u32);
 
@@ -557,22 +730,22 @@ mod test {
         // Description Table.
         let virt_queue_desc = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(virtq_desc_base - ram_config::BASE_ADDR) as usize] as *mut u8
+                ram.host_ptr((virtq_desc_base - ram_config::BASE_ADDR) as usize)
                     as *mut VirtQueueDesc,
                 DESC_NUM,
             )
         };
 
         // Available Ring.
-        let virtq_avail = &mut ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize] as *mut u8
+        let virtq_avail = ram.host_ptr((virtq_avail_base - ram_config::BASE_ADDR) as usize)
             as *mut VirtQueueAvail;
         let virtq_avail = unsafe { virtq_avail.as_mut().unwrap() };
         virtq_avail.init(VirtQueueAvailFlag::Default);
         let avail_ring = VirtQueueAvail::mut_ring(virtq_avail as *mut _ as u64, QUEUE_NUM as u32);
 
         // Used Ring.
-        let virtq_used = &mut ram[(virtq_used_base - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtQueueUsed;
+        let virtq_used =
+            ram.host_ptr((virtq_used_base - ram_config::BASE_ADDR) as usize) as *mut VirtQueueUsed;
         let virtq_used = unsafe { virtq_used.as_mut().unwrap() };
         virtq_used.init(VirtQueueUsedFlag::Default);
         let _used_ring = virtq_used.ring(QUEUE_NUM as u32);
@@ -590,8 +763,8 @@ mod test {
             VirtQueueDescFlag::VIRTQ_DESC_F_NEXT,
             1,
         );
-        let req = &mut ram[(desc0_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtioBlkReq;
+        let req =
+            ram.host_ptr((desc0_buf_addr - ram_config::BASE_ADDR) as usize) as *mut VirtioBlkReq;
         let req = unsafe { req.as_mut().unwrap() };
         req.request_type = VirtioBlkReqType::In as u32;
         req.reserved = 0;
@@ -602,7 +775,7 @@ mod test {
         desc1.init(0x8000_2400, 0x200, VirtQueueDescFlag::VIRTQ_DESC_F_NEXT, 2);
         let desc_buf = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(desc1_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8,
+                ram.host_ptr((desc1_buf_addr - ram_config::BASE_ADDR) as usize),
                 0x200,
             )
         };
@@ -616,7 +789,7 @@ mod test {
             0,
         );
         let desc_status = unsafe {
-            (&mut ram[(desc2_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
+            (ram.host_ptr((desc2_buf_addr - ram_config::BASE_ADDR) as usize)
                 as *mut VirtioBlkStatus)
                 .as_mut()
                 .unwrap()
@@ -629,7 +802,7 @@ mod test {
         assert_eq!(desc_status.status, VirtIOBlkReqStatus::Ok as u8);
         assert_eq!(desc_buf[0], 0);
 
-        let used_ring = virt_device.queue.get_used_ring();
+        let used_ring = virt_device.queue().get_used_ring();
         let used_index = used_ring.get_index();
         assert_eq!(used_index, 1);
         // used_ring.index_add(1);
@@ -647,8 +820,8 @@ mod test {
         let file_name = String::from("./tmp/test_blk_write.txt");
         let mut file = init_block_file(file_name.as_str(), 1, |_| &buf);
 
-        let mut ram = Ram::new();
-        let ram_base = &mut ram[0] as *mut u8;
+        let ram = Ram::new();
+        let ram_base = ram.host_ptr(0);
         let mut virt_device = VirtIOBlkDevice::new("VirtIO Block 0", ram_base, 0, file_name);
         virt_device.set_queue_num(QUEUE_NUM as u32);
 
@@ -662,22 +835,22 @@ mod test {
         // Description Table.
         let virt_queue_desc = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(virtq_desc_base - ram_config::BASE_ADDR) as usize] as *mut u8
+                ram.host_ptr((virtq_desc_base - ram_config::BASE_ADDR) as usize)
                     as *mut VirtQueueDesc,
                 DESC_NUM,
             )
         };
 
         // Available Ring.
-        let virtq_avail = &mut ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize] as *mut u8
+        let virtq_avail = ram.host_ptr((virtq_avail_base - ram_config::BASE_ADDR) as usize)
             as *mut VirtQueueAvail;
         let virtq_avail = unsafe { virtq_avail.as_mut().unwrap() };
         virtq_avail.init(VirtQueueAvailFlag::Default);
         let avail_ring = VirtQueueAvail::mut_ring(virtq_avail as *mut _ as u64, QUEUE_NUM as u32);
 
         // Used Ring.
-        let virtq_used = &mut ram[(virtq_used_base - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtQueueUsed;
+        let virtq_used =
+            ram.host_ptr((virtq_used_base - ram_config::BASE_ADDR) as usize) as *mut VirtQueueUsed;
         let virtq_used = unsafe { virtq_used.as_mut().unwrap() };
         virtq_used.init(VirtQueueUsedFlag::Default);
         let _used_ring = virtq_used.ring(QUEUE_NUM as u32);
@@ -695,8 +868,8 @@ mod test {
             VirtQueueDescFlag::VIRTQ_DESC_F_NEXT,
             1,
         );
-        let req = &mut ram[(desc0_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtioBlkReq;
+        let req =
+            ram.host_ptr((desc0_buf_addr - ram_config::BASE_ADDR) as usize) as *mut VirtioBlkReq;
         let req = unsafe { req.as_mut().unwrap() };
         req.request_type = VirtioBlkReqType::Out as u32;
         req.reserved = 0;
@@ -707,7 +880,7 @@ mod test {
         desc1.init(0x8000_2400, 0x200, VirtQueueDescFlag::VIRTQ_DESC_F_NEXT, 2);
         let desc_buf = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(desc1_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8,
+                ram.host_ptr((desc1_buf_addr - ram_config::BASE_ADDR) as usize),
                 0x200,
             )
         };
@@ -724,7 +897,7 @@ mod test {
             0,
         );
         let desc_status = unsafe {
-            (&mut ram[(desc2_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
+            (ram.host_ptr((desc2_buf_addr - ram_config::BASE_ADDR) as usize)
                 as *mut VirtioBlkStatus)
                 .as_mut()
                 .unwrap()
@@ -737,7 +910,7 @@ mod test {
         assert_eq!(desc_status.status, VirtIOBlkReqStatus::Ok as u8);
         assert_eq!(desc_buf[0], 0);
 
-        let used_ring = virt_device.queue.get_used_ring();
+        let used_ring = virt_device.queue().get_used_ring();
         let used_index = used_ring.get_index();
         assert_eq!(used_index, 1);
         // used_ring.index_add(1);
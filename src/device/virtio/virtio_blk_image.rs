@@ -0,0 +1,314 @@
+//! Backing stores of [`VirtIOBlkDevice`](super::virtio_blk::VirtIOBlkDevice).
+//!
+//! Either a raw image written in place, or a read-only base image with a copy-on-write overlay
+//! ([`CowImage`]). Several instances can boot the same base image, each with its own overlay, and
+//! they all read the base through the same host page cache.
+
+use std::{
+    fs::{File, OpenOptions},
+    io,
+    path::Path,
+    sync::Mutex,
+};
+
+use crate::{
+    device::virtio::virtio_blk_io::{read_at, write_all_at},
+    mmap::FileMapping,
+};
+
+/// The disk behind a block device, shared with its I/O workers.
+pub(super) enum BlkDisk {
+    Raw(File),
+    Cow(CowImage),
+}
+
+impl BlkDisk {
+    /// Size of the disk, in bytes.
+    pub(super) fn size(&self) -> io::Result<u64> {
+        match self {
+            BlkDisk::Raw(file) => Ok(file.metadata()?.len()),
+            BlkDisk::Cow(image) => Ok(image.size),
+        }
+    }
+
+    /// Read at `offset` until `buf` is full or the end of the disk, returns the number of bytes read.
+    pub(super) fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        match self {
+            BlkDisk::Raw(file) => read_at(file, buf, offset),
+            BlkDisk::Cow(image) => image.read_at(buf, offset),
+        }
+    }
+
+    pub(super) fn write_all_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        match self {
+            BlkDisk::Raw(file) => write_all_at(file, buf, offset),
+            BlkDisk::Cow(image) => image.write_all_at(buf, offset),
+        }
+    }
+
+    pub(super) fn sync_data(&self) -> io::Result<()> {
+        match self {
+            BlkDisk::Raw(file) => file.sync_data(),
+            BlkDisk::Cow(image) => image.overlay.sync_data(),
+        }
+    }
+}
+
+const OVERLAY_MAGIC: &[u8; 8] = b"RVBLKCOW";
+const OVERLAY_VERSION: u32 = 1;
+const CLUSTER_BITS: u32 = 16;
+const CLUSTER_SIZE: u64 = 1 << CLUSTER_BITS;
+/// The cluster table follows the header, one little endian `u64` per cluster of the image.
+const TABLE_OFFSET: u64 = 4096;
+
+/// Overlay header, at offset 0.
+///
+/// | offset | size | field                      |
+/// |--------|------|----------------------------|
+/// | 0      | 8    | magic, `RVBLKCOW`          |
+/// | 8      | 4    | version                    |
+/// | 12     | 4    | log2 of the cluster size   |
+/// | 16     | 8    | size of the image in bytes |
+struct OverlayHeader {
+    cluster_bits: u32,
+    size: u64,
+}
+
+impl OverlayHeader {
+    const LEN: usize = 24;
+
+    fn to_bytes(&self) -> [u8; Self::LEN] {
+        let mut bytes = [0; Self::LEN];
+        bytes[0..8].copy_from_slice(OVERLAY_MAGIC);
+        bytes[8..12].copy_from_slice(&OVERLAY_VERSION.to_le_bytes());
+        bytes[12..16].copy_from_slice(&self.cluster_bits.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.size.to_le_bytes());
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8; Self::LEN]) -> io::Result<Self> {
+        let version = u32::from_le_bytes(bytes[8..12].try_into().unwrap());
+        if &bytes[0..8] != OVERLAY_MAGIC || version != OVERLAY_VERSION {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "not a block overlay file",
+            ));
+        }
+
+        Ok(Self {
+            cluster_bits: u32::from_le_bytes(bytes[12..16].try_into().unwrap()),
+            size: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+        })
+    }
+}
+
+/// Clusters written by the guest, and where the next one goes.
+struct ClusterMap {
+    /// Overlay offset of each cluster, `0` while it still reads from the base image.
+    table: Vec<u64>,
+    /// End of the cluster data in the overlay.
+    end: u64,
+}
+
+/// A read-only base image with a sparse overlay holding every cluster the guest wrote.
+///
+/// Opening one reads the cluster table only, whatever the size of the image. The base image is
+/// mapped when the host allows it, so that reads are one copy out of the page cache.
+pub(super) struct CowImage {
+    base: File,
+    mapping: Option<FileMapping>,
+    overlay: File,
+    size: u64,
+    clusters: Mutex<ClusterMap>,
+}
+
+impl CowImage {
+    /// Open `base` read-only, with the overlay `overlay`, created if it does not exist.
+    pub(super) fn open(base: &Path, overlay: &Path) -> io::Result<Self> {
+        let base = File::open(base)?;
+        let size = base.metadata()?.len();
+        let mapping = FileMapping::new(&base)
+            .inspect_err(|err| log::warn!("Can not map the block image, reading it: {}", err))
+            .ok();
+
+        let overlay = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(overlay)?;
+        let cluster_cnt = size.div_ceil(CLUSTER_SIZE) as usize;
+        let data_start = (TABLE_OFFSET + cluster_cnt as u64 * 8).next_multiple_of(CLUSTER_SIZE);
+
+        let clusters = if overlay.metadata()?.len() == 0 {
+            let header = OverlayHeader {
+                cluster_bits: CLUSTER_BITS,
+                size,
+            };
+            write_all_at(&overlay, &header.to_bytes(), 0)?;
+            // The table is a hole of zeros until clusters are written.
+            overlay.set_len(data_start)?;
+            ClusterMap {
+                table: vec![0; cluster_cnt],
+                end: data_start,
+            }
+        } else {
+            let mut bytes = [0; OverlayHeader::LEN];
+            read_at(&overlay, &mut bytes, 0)?;
+            let header = OverlayHeader::from_bytes(&bytes)?;
+            if header.cluster_bits != CLUSTER_BITS || header.size != size {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "the overlay was made for another base image",
+                ));
+            }
+
+            let mut bytes = vec![0; cluster_cnt * 8];
+            read_at(&overlay, &mut bytes, TABLE_OFFSET)?;
+            ClusterMap {
+                table: bytes
+                    .chunks_exact(8)
+                    .map(|entry| u64::from_le_bytes(entry.try_into().unwrap()))
+                    .collect(),
+                end: overlay.metadata()?.len().next_multiple_of(CLUSTER_SIZE),
+            }
+        };
+
+        Ok(Self {
+            base,
+            mapping,
+            overlay,
+            size,
+            clusters: Mutex::new(clusters),
+        })
+    }
+
+    /// Split `[offset, offset + len)` into pieces within one cluster each, as
+    /// `(cluster index, offset in the cluster, offset in the buffer, length)`.
+    fn pieces(offset: u64, len: usize) -> impl Iterator<Item = (usize, u64, usize, usize)> {
+        let mut done = 0;
+        std::iter::from_fn(move || {
+            if done == len {
+                return None;
+            }
+            let pos = offset + done as u64;
+            let in_cluster = pos % CLUSTER_SIZE;
+            let piece = ((CLUSTER_SIZE - in_cluster) as usize).min(len - done);
+            let item = ((pos / CLUSTER_SIZE) as usize, in_cluster, done, piece);
+            done += piece;
+            Some(item)
+        })
+    }
+
+    fn read_base(&self, buf: &mut [u8], offset: u64) -> io::Result<()> {
+        match &self.mapping {
+            Some(mapping) => {
+                let start = offset as usize;
+                buf.copy_from_slice(&mapping.as_slice()[start..start + buf.len()]);
+            }
+            None => {
+                let len = read_at(&self.base, buf, offset)?;
+                buf[len..].fill(0);
+            }
+        }
+        Ok(())
+    }
+
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        let len = buf.len().min(self.size.saturating_sub(offset) as usize);
+
+        for (cluster, in_cluster, start, piece) in Self::pieces(offset, len) {
+            let data = &mut buf[start..start + piece];
+            let location = self.clusters.lock().unwrap().table[cluster];
+            if location == 0 {
+                self.read_base(data, offset + start as u64)?;
+            } else {
+                read_at(&self.overlay, data, location + in_cluster)?;
+            }
+        }
+        Ok(len)
+    }
+
+    fn write_all_at(&self, buf: &[u8], offset: u64) -> io::Result<()> {
+        if offset + buf.len() as u64 > self.size {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "write past the end of the image",
+            ));
+        }
+
+        for (cluster, in_cluster, start, piece) in Self::pieces(offset, buf.len()) {
+            let data = &buf[start..start + piece];
+
+            // Held across the copy so that a cluster is never allocated twice.
+            let mut clusters = self.clusters.lock().unwrap();
+            let location = clusters.table[cluster];
+            if location != 0 {
+                drop(clusters);
+                write_all_at(&self.overlay, data, location + in_cluster)?;
+                continue;
+            }
+
+            let cluster_start = cluster as u64 * CLUSTER_SIZE;
+            let mut copy = vec![0; (CLUSTER_SIZE.min(self.size - cluster_start)) as usize];
+            self.read_base(&mut copy, cluster_start)?;
+            copy[in_cluster as usize..in_cluster as usize + piece].copy_from_slice(data);
+
+            // The data goes first, so that the table never points at a cluster not written yet.
+            let location = clusters.end;
+            write_all_at(&self.overlay, &copy, location)?;
+            write_all_at(
+                &self.overlay,
+                &location.to_le_bytes(),
+                TABLE_OFFSET + cluster as u64 * 8,
+            )?;
+            clusters.table[cluster] = location;
+            clusters.end += CLUSTER_SIZE;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use super::*;
+
+    #[test]
+    fn test_cow_image() {
+        fs::create_dir_all("./tmp").unwrap();
+        let base_path = Path::new("./tmp/test_cow_image_base.img");
+        let overlay_path = Path::new("./tmp/test_cow_image_overlay.img");
+        let _ = fs::remove_file(overlay_path);
+
+        // Three clusters and a half.
+        let base: Vec<u8> = (0..CLUSTER_SIZE * 7 / 2).map(|i| (i % 251) as u8).collect();
+        fs::write(base_path, &base).unwrap();
+
+        let mut expected = base.clone();
+        {
+            let image = CowImage::open(base_path, overlay_path).unwrap();
+
+            // Across the first two clusters, and in the last partial one.
+            let offset = CLUSTER_SIZE as usize - 512;
+            expected[offset..offset + 1024].fill(0xaa);
+            image.write_all_at(&[0xaa; 1024], offset as u64).unwrap();
+            let offset = base.len() - 512;
+            expected[offset..].fill(0xbb);
+            image.write_all_at(&[0xbb; 512], offset as u64).unwrap();
+            assert!(image.write_all_at(&[0; 512], base.len() as u64).is_err());
+
+            let mut read = vec![0; base.len() + 512];
+            assert_eq!(image.read_at(&mut read, 0).unwrap(), base.len());
+            assert_eq!(&read[..base.len()], &expected[..]);
+        }
+
+        // The base image is untouched, and the overlay is kept.
+        assert_eq!(fs::read(base_path).unwrap(), base);
+        let image = CowImage::open(base_path, overlay_path).unwrap();
+        let mut read = vec![0; base.len()];
+        image.read_at(&mut read, 0).unwrap();
+        assert_eq!(read, expected);
+    }
+}
@@ -0,0 +1,536 @@
+//! Disk I/O of [`VirtIOBlkDevice`](super::virtio_blk::VirtIOBlkDevice), off the CPU thread.
+//!
+//! A queue notification turns the available descriptor chains into [`BlkJob`]s, merging requests on
+//! adjacent sectors into one access, and submits them to a [`BlkIoBackend`]:
+//! - With `multithreading` on Linux, a raw image goes through io_uring, see [`uring`]. The jobs of
+//!   every queue are submitted at once, and run in parallel but for flushes.
+//! - Elsewhere with `multithreading`, or for a copy-on-write image or a host without io_uring,
+//!   every queue has its own I/O worker thread. Queues run in parallel, and the jobs of one queue
+//!   run in order.
+//! - Without it, the jobs run inline on submission.
+//!
+//! The workers write the data and the request status into guest memory, but the used rings are
+//! only written by [`BlkCompletions::drain`], which the device poll event runs on the background
+//! executor. That is also where the writes into guest memory are reported to the [`Ram`], once the
+//! data is there.
+
+use std::{
+    fs::File,
+    io,
+    sync::{
+        Arc, Mutex, OnceLock,
+        atomic::{AtomicU8, AtomicUsize, Ordering},
+    },
+};
+
+use crossbeam::channel::{self, Receiver, Sender};
+
+use crate::{
+    device::virtio::{
+        virtio_blk::VirtIOBlkReqStatus, virtio_blk_image::BlkDisk, virtio_queue::UsedRingRef,
+    },
+    ram::Ram,
+};
+
+#[cfg(all(target_os = "linux", feature = "multithreading"))]
+mod uring;
+
+/// Largest access built by merging requests, in bytes.
+const MAX_MERGE_SIZE: usize = 256 * 1024;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(super) enum BlkOp {
+    Read,
+    Write,
+    Flush,
+    /// Completed without touching the disk.
+    Nop,
+}
+
+/// A buffer in guest RAM, by its host address.
+#[derive(Clone, Copy)]
+pub(super) struct GuestBuf {
+    pub(super) addr: usize,
+    pub(super) len: usize,
+}
+
+impl GuestBuf {
+    /// # Safety
+    /// The buffer must be in guest RAM, and not accessed by the device anywhere else meanwhile.
+    unsafe fn as_mut_slice(&self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.addr as *mut u8, self.len) }
+    }
+}
+
+/// The guest RAM, told about the buffers written by the device so that code decoded from them is
+/// dropped.
+#[derive(Clone)]
+pub(super) struct GuestRam {
+    ram: Arc<Ram>,
+    /// Host address of the first byte of guest RAM.
+    base: usize,
+}
+
+impl GuestRam {
+    pub(super) fn new(ram: Arc<Ram>) -> Self {
+        let base = ram.host_ptr(0) as usize;
+        Self { ram, base }
+    }
+
+    fn report_write(&self, addr: usize, len: usize) {
+        // Ram::report_write only takes `&self`, the harts run meanwhile.
+        self.ram.report_write(addr - self.base, len);
+    }
+}
+
+/// A request to complete once its job is done.
+pub(super) struct BlkRequest {
+    pub(super) used: UsedRingRef,
+    /// Head of the descriptor chain.
+    pub(super) head: u32,
+    /// Bytes moved to or from the guest.
+    pub(super) len: u32,
+    /// Host address of the status byte, if the chain has one.
+    pub(super) status: Option<usize>,
+    /// Whether the driver wants an interrupt when the request is used.
+    pub(super) interrupt: bool,
+    /// The buffers the job writes into, the status byte aside.
+    pub(super) written: Vec<GuestBuf>,
+}
+
+/// One disk access, covering one or several requests on contiguous sectors.
+pub(super) struct BlkJob {
+    op: BlkOp,
+    offset: u64,
+    len: usize,
+    bufs: Vec<GuestBuf>,
+    requests: Vec<BlkRequest>,
+}
+
+impl BlkJob {
+    pub(super) fn new(op: BlkOp, offset: u64, bufs: Vec<GuestBuf>, request: BlkRequest) -> Self {
+        Self {
+            op,
+            offset,
+            len: bufs.iter().map(|buf| buf.len).sum(),
+            bufs,
+            requests: vec![request],
+        }
+    }
+
+    /// Append `next` if it is the same kind of access and starts where this one ends,
+    /// otherwise give it back.
+    pub(super) fn try_merge(&mut self, next: BlkJob) -> Result<(), BlkJob> {
+        let mergeable = matches!(self.op, BlkOp::Read | BlkOp::Write)
+            && self.op == next.op
+            && self.offset + self.len as u64 == next.offset
+            && self.len + next.len <= MAX_MERGE_SIZE;
+        if !mergeable {
+            return Err(next);
+        }
+
+        self.len += next.len;
+        self.bufs.extend(next.bufs);
+        self.requests.extend(next.requests);
+        Ok(())
+    }
+
+    /// Do the access, with a single system call even when several requests were merged.
+    fn run(&self, disk: &BlkDisk) -> io::Result<()> {
+        match self.op {
+            BlkOp::Read => {
+                if let [buf] = self.bufs[..] {
+                    let data = unsafe { buf.as_mut_slice() };
+                    let len = disk.read_at(data, self.offset)?;
+                    data[len..].fill(0);
+                    return Ok(());
+                }
+
+                let mut bounce = vec![0; self.len];
+                disk.read_at(&mut bounce, self.offset)?;
+                let mut rest = &bounce[..];
+                for buf in self.bufs.iter() {
+                    let (data, tail) = rest.split_at(buf.len);
+                    unsafe { buf.as_mut_slice() }.copy_from_slice(data);
+                    rest = tail;
+                }
+                Ok(())
+            }
+            BlkOp::Write => {
+                if let [buf] = self.bufs[..] {
+                    return disk.write_all_at(unsafe { buf.as_mut_slice() }, self.offset);
+                }
+
+                let mut bounce = Vec::with_capacity(self.len);
+                for buf in self.bufs.iter() {
+                    bounce.extend_from_slice(unsafe { buf.as_mut_slice() });
+                }
+                disk.write_all_at(&bounce, self.offset)
+            }
+            BlkOp::Flush => disk.sync_data(),
+            BlkOp::Nop => Ok(()),
+        }
+    }
+
+    /// Run the job and hand its requests to `done`.
+    fn complete(self, disk: &BlkDisk, done: &Sender<BlkRequest>) {
+        let rst = self.run(disk);
+        self.finish(rst, done);
+    }
+
+    /// Write the status of the requests of the job, which ran with `rst`, and hand them to `done`.
+    fn finish(self, rst: io::Result<()>, done: &Sender<BlkRequest>) {
+        let status = match rst {
+            Ok(()) => VirtIOBlkReqStatus::Ok,
+            Err(err) => {
+                log::error!(
+                    "virtio-blk {:?} at {:#x} failed: {}",
+                    self.op,
+                    self.offset,
+                    err
+                );
+                VirtIOBlkReqStatus::IoErr
+            }
+        };
+
+        for request in self.requests {
+            if let Some(addr) = request.status {
+                unsafe { (addr as *mut u8).write(status as u8) };
+            }
+            let _ = done.send(request);
+        }
+    }
+}
+
+/// The finished requests, pushed to the used rings by whoever drains them.
+pub(super) struct BlkCompletions {
+    sender: Sender<BlkRequest>,
+    receiver: Mutex<Receiver<BlkRequest>>,
+    isr: Arc<AtomicU8>,
+    inflight: AtomicUsize,
+    ram: OnceLock<GuestRam>,
+}
+
+impl BlkCompletions {
+    pub(super) fn new(isr: Arc<AtomicU8>) -> Self {
+        let (sender, receiver) = channel::unbounded();
+        Self {
+            sender,
+            receiver: Mutex::new(receiver),
+            isr,
+            inflight: AtomicUsize::new(0),
+            ram: OnceLock::new(),
+        }
+    }
+
+    /// Report the writes of the finished requests to `ram` from now on.
+    pub(super) fn report_writes_to(&self, ram: GuestRam) {
+        let _ = self.ram.set(ram);
+    }
+
+    /// Mark the finished requests used, and raise the used buffer notification if the driver asked
+    /// for one. Returns whether any request completed.
+    ///
+    /// The writes of a request are reported to the RAM before it is used: the guest may run the
+    /// code it loaded right after, and the data is only there once the job is done.
+    pub(super) fn drain(&self) -> bool {
+        let receiver = self.receiver.lock().unwrap();
+        let mut completed = false;
+        let mut interrupt = false;
+
+        while let Ok(request) = receiver.try_recv() {
+            if let Some(ram) = self.ram.get() {
+                for buf in request.written.iter() {
+                    ram.report_write(buf.addr, buf.len);
+                }
+                if let Some(addr) = request.status {
+                    ram.report_write(addr, 1);
+                }
+            }
+
+            // Only one thread drains at a time, thanks to the lock.
+            unsafe { request.used.push(request.head, request.len) };
+            interrupt |= request.interrupt;
+            completed = true;
+            self.inflight.fetch_sub(1, Ordering::AcqRel);
+        }
+
+        if interrupt {
+            self.isr.fetch_or(1, Ordering::Release);
+        }
+        completed
+    }
+
+    /// Block until every submitted request is used.
+    pub(super) fn wait_idle(&self) {
+        while self.inflight.load(Ordering::Acquire) != 0 {
+            if !self.drain() {
+                std::thread::yield_now();
+            }
+        }
+    }
+
+    pub(super) fn pending_interrupt(&self) -> bool {
+        self.isr.load(Ordering::Acquire) & 1 != 0
+    }
+}
+
+/// Runs the [`BlkJob`]s of every queue of one device.
+pub(super) struct BlkIoBackend {
+    completions: Arc<BlkCompletions>,
+
+    #[cfg(feature = "multithreading")]
+    engine: IoEngine,
+    #[cfg(not(feature = "multithreading"))]
+    disk: Arc<BlkDisk>,
+}
+
+#[cfg(feature = "multithreading")]
+enum IoEngine {
+    #[cfg(target_os = "linux")]
+    Uring(uring::BlkUring),
+    Workers(Vec<worker::IoWorker>),
+}
+
+#[cfg(feature = "multithreading")]
+impl IoEngine {
+    fn new(disk: &Arc<BlkDisk>, queue_cnt: usize, done: &Sender<BlkRequest>) -> Self {
+        #[cfg(target_os = "linux")]
+        match uring::BlkUring::new(disk.clone(), done.clone()) {
+            Ok(uring) => return Self::Uring(uring),
+            Err(err) => log::debug!("virtio-blk runs on I/O threads, without io_uring: {}", err),
+        }
+
+        Self::Workers(
+            (0..queue_cnt)
+                .map(|_| worker::IoWorker::spawn(disk.clone(), done.clone()))
+                .collect(),
+        )
+    }
+}
+
+impl BlkIoBackend {
+    pub(super) fn new(
+        disk: &Arc<BlkDisk>,
+        queue_cnt: usize,
+        completions: Arc<BlkCompletions>,
+    ) -> Self {
+        Self {
+            #[cfg(feature = "multithreading")]
+            engine: IoEngine::new(disk, queue_cnt, &completions.sender),
+            #[cfg(not(feature = "multithreading"))]
+            disk: {
+                let _ = queue_cnt;
+                disk.clone()
+            },
+
+            completions,
+        }
+    }
+
+    pub(super) fn submit(&self, queue_idx: usize, jobs: Vec<BlkJob>) {
+        let requests = jobs.iter().map(|job| job.requests.len()).sum();
+        self.completions
+            .inflight
+            .fetch_add(requests, Ordering::AcqRel);
+
+        #[cfg(feature = "multithreading")]
+        match &self.engine {
+            #[cfg(target_os = "linux")]
+            IoEngine::Uring(uring) => uring.submit(jobs),
+            IoEngine::Workers(workers) => {
+                for job in jobs {
+                    workers[queue_idx].submit(job);
+                }
+            }
+        }
+
+        #[cfg(not(feature = "multithreading"))]
+        {
+            let _ = queue_idx;
+            for job in jobs {
+                job.complete(&self.disk, &self.completions.sender);
+            }
+        }
+    }
+}
+
+#[cfg(feature = "multithreading")]
+mod worker {
+    use std::{sync::Arc, thread};
+
+    use crossbeam::channel::{self, Sender};
+
+    use super::{BlkDisk, BlkJob, BlkRequest};
+
+    /// A thread running the jobs of one queue in order.
+    pub(super) struct IoWorker {
+        jobs: Option<Sender<BlkJob>>,
+        thread: Option<thread::JoinHandle<()>>,
+    }
+
+    impl IoWorker {
+        pub(super) fn spawn(disk: Arc<BlkDisk>, done: Sender<BlkRequest>) -> Self {
+            let (jobs, receiver) = channel::unbounded::<BlkJob>();
+            let thread = thread::spawn(move || {
+                for job in receiver.iter() {
+                    job.complete(&disk, &done);
+                }
+            });
+
+            Self {
+                jobs: Some(jobs),
+                thread: Some(thread),
+            }
+        }
+
+        pub(super) fn submit(&self, job: BlkJob) {
+            let _ = self.jobs.as_ref().unwrap().send(job);
+        }
+    }
+
+    impl Drop for IoWorker {
+        fn drop(&mut self) {
+            // Closing the channel lets the thread finish the queued jobs and exit.
+            drop(self.jobs.take());
+            if let Some(thread) = self.thread.take() {
+                let _ = thread.join();
+            }
+        }
+    }
+}
+
+#[cfg(unix)]
+fn read_once_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    std::os::unix::fs::FileExt::read_at(file, buf, offset)
+}
+
+#[cfg(unix)]
+fn write_once_at(file: &File, buf: &[u8], offset: u64) -> io::Result<usize> {
+    std::os::unix::fs::FileExt::write_at(file, buf, offset)
+}
+
+#[cfg(windows)]
+fn read_once_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    std::os::windows::fs::FileExt::seek_read(file, buf, offset)
+}
+
+#[cfg(windows)]
+fn write_once_at(file: &File, buf: &[u8], offset: u64) -> io::Result<usize> {
+    std::os::windows::fs::FileExt::seek_write(file, buf, offset)
+}
+
+/// No positional I/O, but no threads to share the file cursor with either.
+#[cfg(not(any(unix, windows)))]
+fn read_once_at(mut file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    use std::io::{Read, Seek, SeekFrom};
+    file.seek(SeekFrom::Start(offset))?;
+    file.read(buf)
+}
+
+#[cfg(not(any(unix, windows)))]
+fn write_once_at(mut file: &File, buf: &[u8], offset: u64) -> io::Result<usize> {
+    use std::io::{Seek, SeekFrom, Write};
+    file.seek(SeekFrom::Start(offset))?;
+    file.write(buf)
+}
+
+/// Read at `offset` until `buf` is full or the end of the file, returns the number of bytes read.
+pub(super) fn read_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+    let mut done = 0;
+    while done < buf.len() {
+        match read_once_at(file, &mut buf[done..], offset + done as u64) {
+            Ok(0) => break,
+            Ok(len) => done += len,
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => {}
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(done)
+}
+
+pub(super) fn write_all_at(file: &File, buf: &[u8], offset: u64) -> io::Result<()> {
+    let mut done = 0;
+    while done < buf.len() {
+        match write_once_at(file, &buf[done..], offset + done as u64) {
+            Ok(0) => return Err(io::ErrorKind::WriteZero.into()),
+            Ok(len) => done += len,
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => {}
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{device::virtio::virtio_queue::VirtQueue, ram_config};
+
+    fn job(op: BlkOp, offset: u64, len: usize) -> BlkJob {
+        let request = BlkRequest {
+            used: VirtQueue::new(std::ptr::null_mut(), 0).used_ring_ref(),
+            head: 0,
+            len: len as u32,
+            status: None,
+            interrupt: false,
+            written: Vec::new(),
+        };
+        BlkJob::new(op, offset, vec![GuestBuf { addr: 0, len }], request)
+    }
+
+    #[test]
+    fn test_merge_adjacent_requests() {
+        let mut first = job(BlkOp::Read, 0, 512);
+        assert!(first.try_merge(job(BlkOp::Read, 512, 1024)).is_ok());
+        assert_eq!(
+            (first.len, first.bufs.len(), first.requests.len()),
+            (1536, 2, 2)
+        );
+
+        // Not adjacent, another kind, or too large.
+        assert!(first.try_merge(job(BlkOp::Read, 4096, 512)).is_err());
+        assert!(first.try_merge(job(BlkOp::Write, 1536, 512)).is_err());
+        assert!(
+            first
+                .try_merge(job(BlkOp::Read, 1536, MAX_MERGE_SIZE))
+                .is_err()
+        );
+
+        let mut flush = job(BlkOp::Flush, 0, 0);
+        assert!(flush.try_merge(job(BlkOp::Flush, 0, 0)).is_err());
+    }
+
+    #[test]
+    fn test_writes_reported_once_drained() {
+        let ram = Arc::new(Ram::new());
+        let ram_base = ram.host_ptr(0);
+        let mut queue = VirtQueue::new(ram_base, 8);
+        queue.set_used(ram_config::BASE_ADDR + 0x100);
+
+        let completions = BlkCompletions::new(Arc::new(AtomicU8::new(0)));
+        completions.report_writes_to(GuestRam::new(ram.clone()));
+        ram.mark_code_page(0x1000);
+
+        let buf = GuestBuf {
+            addr: ram_base as usize + 0x1000,
+            len: 512,
+        };
+        let request = BlkRequest {
+            used: queue.used_ring_ref(),
+            head: 0,
+            len: 512,
+            status: None,
+            interrupt: false,
+            written: vec![buf],
+        };
+        completions.inflight.fetch_add(1, Ordering::AcqRel);
+        completions.sender.send(request).unwrap();
+
+        // Done on the worker, but not used yet.
+        assert!(!ram.has_written_code_pages(0));
+        assert!(completions.drain());
+        assert!(ram.has_written_code_pages(0));
+        assert_eq!(ram.take_written_code_pages(0), vec![0x1000]);
+    }
+}
@@ -5,12 +5,15 @@ use std::sync::{
 
 use lazy_static::lazy_static;
 
-pub(crate) trait VirtIODeviceTrait {
+use crate::snapshot::{SnapshotError, StateReader, StateWriter};
+
+/// `Send` like [`DeviceTrait`](crate::device::DeviceTrait), as the transport in front of it.
+pub(crate) trait VirtIODeviceTrait: Send {
     fn get_device_id(&self) -> u16;
     fn status(&mut self) -> &mut u8;
     fn get_generation(&self) -> u32;
 
-    fn isr(&mut self) -> &mut AtomicU8;
+    fn isr(&self) -> &AtomicU8;
     fn update_irq(&mut self);
 
     fn get_host_feature(&self) -> u64;
@@ -18,7 +21,7 @@ pub(crate) trait VirtIODeviceTrait {
 
     fn set_queue_num(&mut self, num: u32);
     fn queue_ready(&self) -> bool;
-    fn queue_select(&self, idx: u32);
+    fn queue_select(&mut self, idx: u32);
     fn get_num_of_queue(&self) -> u32; // device may have queue more than one.
 
     fn set_desc(&mut self, addr: u64);
@@ -34,6 +37,12 @@ pub(crate) trait VirtIODeviceTrait {
     fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
         None
     }
+
+    /// Save the device specific state, see [`DeviceTrait::save_state`](crate::device::DeviceTrait::save_state).
+    fn save_state(&self, _out: &mut StateWriter) {}
+    fn restore_state(&mut self, _state: &mut StateReader) -> Result<(), SnapshotError> {
+        Ok(())
+    }
 }
 
 pub(super) struct DeviceIDAllocator(AtomicU16);
@@ -1,5 +1,3 @@
-use std::cell::UnsafeCell;
-
 use bitflags::bitflags;
 use log::error;
 use num_enum::TryFromPrimitive;
@@ -10,6 +8,7 @@ use crate::{
         config::{VIRTIO_MMIO_BASE, VIRTIO_MMIO_SIZE},
         virtio::{config::*, virtio_device::VirtIODeviceTrait},
     },
+    snapshot::{SnapshotError, StateReader, StateWriter},
     utils::{BIT_ONES_ARRAY, check_align},
 };
 
@@ -111,18 +110,18 @@ impl Default for VirtIOMMIOQueueStatus {
 }
 
 pub(crate) struct VirtIOMMIO {
-    device: Box<UnsafeCell<dyn VirtIODeviceTrait>>,
+    device: Box<dyn VirtIODeviceTrait>,
     host_features_sel: u32,
     host_features: u64,
     guest_features_sel: u32,
     guest_features: u64,
 
-    queues: [VirtIOMMIOQueueStatus; 8],
+    queues: [VirtIOMMIOQueueStatus; VIRTIO_MAX_QUEUES],
     queue_select: u64,
 }
 
 impl VirtIOMMIO {
-    pub fn new(device: Box<UnsafeCell<dyn VirtIODeviceTrait>>) -> Self {
+    pub fn new(device: Box<dyn VirtIODeviceTrait>) -> Self {
         Self {
             device,
             host_features_sel: 0,
@@ -130,13 +129,13 @@ impl VirtIOMMIO {
             guest_features_sel: 0,
             guest_features: 0,
 
-            queues: [VirtIOMMIOQueueStatus::default(); 8],
+            queues: [VirtIOMMIOQueueStatus::default(); VIRTIO_MAX_QUEUES],
             queue_select: 0,
         }
     }
 
-    fn read_u32_impl(&self, offset: u64) -> u32 {
-        let vdev = unsafe { self.device.as_mut_unchecked() };
+    fn read_u32_impl(&mut self, offset: u64) -> u32 {
+        let vdev = &mut self.device;
 
         if !check_align::<u32>(offset) {
             // will be checked in mmio.
@@ -206,7 +205,7 @@ impl VirtIOMMIO {
     }
 
     fn write_u32_impl(&mut self, offset: u64, value: u32) {
-        let vdev = unsafe { self.device.as_mut_unchecked() };
+        let vdev = &mut self.device;
 
         if !check_align::<u32>(offset) {
             // will be checked in mmio.
@@ -232,7 +231,12 @@ impl VirtIOMMIO {
                 }
                 // VirtIO_MMIO_Offset::GUEST_PAGE_SIZE => {}, // legacy
                 VirtIO_MMIO_Offset::QueueSelect => {
-                    vdev.set_queue_num(value);
+                    if (value as usize) < VIRTIO_MAX_QUEUES {
+                        self.queue_select = value as u64;
+                        vdev.queue_select(value);
+                    } else {
+                        error!("VirtIO: select of queue {} out of range", value);
+                    }
                 }
                 VirtIO_MMIO_Offset::QueueNum => {
                     vdev.set_queue_num(value);
@@ -357,7 +361,37 @@ impl DeviceTrait for VirtIOMMIO {
 
     fn sync(&mut self) {}
     fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
-        self.device.get_mut().get_poll_event()
+        self.device.get_poll_event()
+    }
+
+    fn save_state(&self, out: &mut StateWriter) {
+        out.write_u32(self.host_features_sel);
+        out.write_u64(self.host_features);
+        out.write_u32(self.guest_features_sel);
+        out.write_u64(self.guest_features);
+        out.write_u64(self.queue_select);
+        for queue in self.queues.iter() {
+            out.write_u64(queue.desc);
+            out.write_u64(queue.avail);
+            out.write_u64(queue.used);
+            out.write_bool(queue.enable);
+        }
+        out.write_section(|out| self.device.save_state(out));
+    }
+
+    fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        self.host_features_sel = state.read_u32()?;
+        self.host_features = state.read_u64()?;
+        self.guest_features_sel = state.read_u32()?;
+        self.guest_features = state.read_u64()?;
+        self.queue_select = state.read_u64()?;
+        for queue in self.queues.iter_mut() {
+            queue.desc = state.read_u64()?;
+            queue.avail = state.read_u64()?;
+            queue.used = state.read_u64()?;
+            queue.enable = state.read_bool()?;
+        }
+        state.read_section(|state| self.device.restore_state(state))
     }
 }
 
@@ -445,7 +479,10 @@ impl GuestFeatureBuilder {
 #[cfg(test)]
 mod test {
     use core::slice;
-    use std::io::{Read, Seek};
+    use std::{
+        io::{Read, Seek},
+        time::{Duration, Instant},
+    };
 
     use super::*;
     use crate::{
@@ -465,6 +502,7 @@ mod test {
 
     const QUEUE_NUM: usize = 8;
     const DESC_NUM: usize = 16;
+    const BLK_IRQ: u32 = 1;
 
     #[test]
     fn test_mmio_blk_device() {
@@ -473,16 +511,18 @@ mod test {
         buf[0xff] = 0x55;
         let mut file = init_block_file(&file_name, 1, |_| &buf);
 
-        let mut ram = Ram::new();
-        let ram_base = &mut ram[0] as *mut u8;
+        let ram = Ram::new();
+        let ram_base = ram.host_ptr(0);
         let virt_device = VirtIOBlkDeviceBuilder::new(ram_base, file_name)
             .name("VirtIO Block 0")
             .generation(0)
             .host_feature(VirtIOBlockFeature::BlockSize)
             .host_feature(VirtIOBlockFeature::Flush)
+            .irq(BLK_IRQ)
             .get();
 
-        let mut virtio_mmio_device = VirtIOMMIO::new(Box::new(UnsafeCell::new(virt_device)));
+        let mut virtio_mmio_device = VirtIOMMIO::new(Box::new(virt_device));
+        let mut poll_event = virtio_mmio_device.get_poll_event().unwrap();
         virtio_mmio_device.write_status(VirtIODeviceStatus::ACKNOWLEDGE);
         virtio_mmio_device.write_status(VirtIODeviceStatus::DRIVER);
 
@@ -511,14 +551,14 @@ mod test {
         // Description Table.
         let virt_queue_desc = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(virtq_desc_base - ram_config::BASE_ADDR) as usize] as *mut u8
+                ram.host_ptr((virtq_desc_base - ram_config::BASE_ADDR) as usize)
                     as *mut VirtQueueDesc,
                 DESC_NUM,
             )
         };
 
         // Available Ring.
-        let virtq_avail = &mut ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize] as *mut u8
+        let virtq_avail = ram.host_ptr((virtq_avail_base - ram_config::BASE_ADDR) as usize)
             as *mut VirtQueueAvail;
         let virtq_avail = unsafe { virtq_avail.as_mut().unwrap() };
         virtq_avail.init(VirtQueueAvailFlag::Default);
@@ -526,8 +566,8 @@ mod test {
         let avail_ring = VirtQueueAvail::mut_ring(virtq_avail as *mut _ as u64, QUEUE_NUM as u32);
 
         // Used Ring.
-        let virtq_used = &mut ram[(virtq_used_base - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtQueueUsed;
+        let virtq_used =
+            ram.host_ptr((virtq_used_base - ram_config::BASE_ADDR) as usize) as *mut VirtQueueUsed;
         let virtq_used = unsafe { virtq_used.as_mut().unwrap() };
         virtq_used.init(VirtQueueUsedFlag::Default);
         let _used_ring = virtq_used.ring(QUEUE_NUM as u32);
@@ -544,8 +584,8 @@ mod test {
             VirtQueueDescFlag::VIRTQ_DESC_F_NEXT,
             1,
         );
-        let req = &mut ram[(desc0_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtioBlkReq;
+        let req =
+            ram.host_ptr((desc0_buf_addr - ram_config::BASE_ADDR) as usize) as *mut VirtioBlkReq;
         let req = unsafe { req.as_mut().unwrap() };
         *req = VirtioBlkReq::new(VirtioBlkReqType::Out, 0);
 
@@ -555,7 +595,7 @@ mod test {
         desc1.init(0x8000_2400, 0x200, VirtQueueDescFlag::VIRTQ_DESC_F_NEXT, 2);
         let desc_buf = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(desc1_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8,
+                ram.host_ptr((desc1_buf_addr - ram_config::BASE_ADDR) as usize),
                 0x200,
             )
         };
@@ -573,15 +613,24 @@ mod test {
             0,
         );
         let desc_status = unsafe {
-            (&mut ram[(desc2_buf_addr - ram_config::BASE_ADDR) as usize] as *mut u8
+            (ram.host_ptr((desc2_buf_addr - ram_config::BASE_ADDR) as usize)
                 as *mut VirtioBlkStatus)
                 .as_mut()
                 .unwrap()
         };
 
-        // manage request.
+        // manage request, it completes in the background and the poll event raises the interrupt.
         virtio_mmio_device.write_u32_impl(VirtIO_MMIO_Offset::QueueNotify as u64, 0x00);
 
+        let deadline = Instant::now() + Duration::from_secs(5);
+        while poll_event.poll_nonblocking() != Some(BLK_IRQ) {
+            assert!(
+                Instant::now() < deadline,
+                "virtio-blk request never completed"
+            );
+            std::thread::yield_now();
+        }
+
         let interrupt_status =
             virtio_mmio_device.read_u32_impl(VirtIO_MMIO_Offset::InterruptStatus as u64);
         assert_eq!(interrupt_status, 1);
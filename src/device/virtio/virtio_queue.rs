@@ -1,10 +1,13 @@
 use core::slice;
-use std::{ptr::null_mut, sync::atomic::AtomicU16};
+use std::sync::atomic::AtomicU16;
 
 use bitflags::bitflags;
 use log::error;
 
-use crate::ram_config;
+use crate::{
+    ram_config,
+    snapshot::{SnapshotError, StateReader, StateWriter},
+};
 
 // =====================================
 //           VirtQueueDesc
@@ -156,13 +159,9 @@ impl VirtQueueAvail {
             return None;
         }
 
-        *last_avail_idx = (old_idx + 1) % queue_num as u16;
-
-        if (old_idx as u32) < queue_num {
-            Some(self.ring(queue_num)[old_idx as usize])
-        } else {
-            None
-        }
+        // Both indices run freely and wrap at 2^16, the ring slot is the index modulo its size.
+        *last_avail_idx = old_idx.wrapping_add(1);
+        Some(self.ring(queue_num)[(old_idx as u32 % queue_num) as usize])
     }
 }
 
@@ -232,14 +231,12 @@ impl VirtQueueUsed {
         }
     }
 
+    /// The element is written before the index is published, so the driver never sees a stale one.
     fn insert_used(&mut self, queue_num: u32, elem: VirtQueueUsedElem) {
-        let mut idx = self.idx.load(std::sync::atomic::Ordering::Relaxed);
-        let old_idx = idx;
-        idx += 1;
-        idx %= queue_num as u16;
-        self.idx.store(idx, std::sync::atomic::Ordering::Relaxed);
-
-        self.ring(queue_num)[old_idx as usize] = elem;
+        let idx = self.idx.load(std::sync::atomic::Ordering::Relaxed);
+        self.ring(queue_num)[(idx as u32 % queue_num) as usize] = elem;
+        self.idx
+            .store(idx.wrapping_add(1), std::sync::atomic::Ordering::Release);
     }
 
     fn index_add(&self, val: u16) {
@@ -259,19 +256,47 @@ impl VirtQueueUsed {
     }
 }
 
+/// The used ring of a queue by its host address, so that requests can be completed from another thread.
+#[derive(Clone, Copy)]
+pub(crate) struct UsedRingRef {
+    used: usize,
+    queue_num: u32,
+}
+
+impl UsedRingRef {
+    /// Mark the descriptor chain starting at `id` as used, with `len` bytes written into it.
+    ///
+    /// # Safety
+    /// The ring must not have moved since this was taken, which the driver guarantees while requests
+    /// are in flight, and only one thread may push to it at a time.
+    pub(crate) unsafe fn push(&self, id: u32, len: u32) {
+        let used = unsafe { (self.used as *mut VirtQueueUsed).as_mut().unwrap() };
+        used.insert_used(self.queue_num, VirtQueueUsedElem { id, len });
+    }
+}
+
+/// A buffer of a descriptor chain, by its host address.
+#[derive(Clone, Copy)]
+pub(crate) struct DescBuf {
+    pub(crate) addr: usize,
+    pub(crate) len: usize,
+}
+
 /// Needs to be wrapped in a Mutex.
+///
+/// The RAM and the rings are held by their host addresses, like [`UsedRingRef`], 0 until set up.
 pub(crate) struct VirtQueue {
     queue_num: u32,
-    ram_base_raw: *mut u8,
+    ram_base: usize,
 
     last_avail_idx: u16,
 
     desc_paddr: u64,
-    desc: *mut VirtQueueDesc,
+    desc: usize,
     avail_paddr: u64,
-    avail: *mut VirtQueueAvail,
+    avail: usize,
     used_paddr: u64,
-    used: *mut VirtQueueUsed,
+    used: usize,
 }
 
 /* Get location of event indices (only with VIRTIO_F_EVENT_IDX) */
@@ -279,16 +304,16 @@ impl VirtQueue {
     pub(crate) fn new(ram_base_raw: *mut u8, queue_num: u32) -> Self {
         Self {
             queue_num,
-            ram_base_raw,
+            ram_base: ram_base_raw as usize,
 
             last_avail_idx: 0,
 
             desc_paddr: 0,
-            desc: null_mut::<VirtQueueDesc>(),
+            desc: 0,
             avail_paddr: 0,
-            avail: null_mut::<VirtQueueAvail>(),
+            avail: 0,
             used_paddr: 0,
-            used: null_mut::<VirtQueueUsed>(),
+            used: 0,
         }
     }
     pub(crate) fn set_desc(&mut self, addr: u64) {
@@ -313,31 +338,22 @@ impl VirtQueue {
 
     fn update_avail_base(&mut self, paddr: u64) {
         if paddr >= ram_config::BASE_ADDR {
-            self.avail = unsafe {
-                self.ram_base_raw
-                    .add((paddr - ram_config::BASE_ADDR) as usize)
-            } as *mut VirtQueueAvail;
+            self.avail = self.ram_base + (paddr - ram_config::BASE_ADDR) as usize;
         }
     }
     fn update_desc_base(&mut self, paddr: u64) {
         if paddr >= ram_config::BASE_ADDR {
-            self.desc = unsafe {
-                self.ram_base_raw
-                    .add((paddr - ram_config::BASE_ADDR) as usize)
-            } as *mut VirtQueueDesc;
+            self.desc = self.ram_base + (paddr - ram_config::BASE_ADDR) as usize;
         }
     }
     fn update_used_base(&mut self, paddr: u64) {
         if paddr >= ram_config::BASE_ADDR {
-            self.used = unsafe {
-                self.ram_base_raw
-                    .add((paddr - ram_config::BASE_ADDR) as usize)
-            } as *mut VirtQueueUsed;
+            self.used = self.ram_base + (paddr - ram_config::BASE_ADDR) as usize;
         }
     }
 
     pub(super) fn get_used_ring(&self) -> &mut VirtQueueUsed {
-        unsafe { self.used.as_mut().unwrap() }
+        unsafe { (self.used as *mut VirtQueueUsed).as_mut().unwrap() }
     }
 
     // unsafe fn get_desc<'a>(
@@ -352,13 +368,13 @@ impl VirtQueue {
 
     // will add `last_avail_idx`
     fn try_get_desc(&mut self) -> Option<VirtQueueDescHandle<'_>> {
-        let virt_queue_avail = unsafe { self.avail.as_ref().unwrap() };
+        let virt_queue_avail = unsafe { (self.avail as *const VirtQueueAvail).as_ref().unwrap() };
         virt_queue_avail
             .try_get_desc_idx(self.queue_num, &mut self.last_avail_idx)
             .map(|idx| {
                 VirtQueueDescHandle::new(
-                    self.desc,
-                    self.ram_base_raw as usize,
+                    self.desc as *const VirtQueueDesc,
+                    self.ram_base,
                     self.queue_num,
                     idx as usize,
                 )
@@ -366,7 +382,7 @@ impl VirtQueue {
     }
 
     fn insert_used(&mut self, elem: VirtQueueUsedElem) {
-        let virt_queue_used = unsafe { self.used.as_mut().unwrap() };
+        let virt_queue_used = unsafe { (self.used as *mut VirtQueueUsed).as_mut().unwrap() };
         virt_queue_used.insert_used(self.queue_num, elem);
     }
 
@@ -379,11 +395,7 @@ impl VirtQueue {
     where
         F: FnMut(&VirtQueueDesc, usize) -> u32,
     {
-        if (self.queue_num == 0)
-            || (self.desc.is_null())
-            || (self.avail.is_null())
-            || (self.used.is_null())
-        {
+        if !self.is_set_up() {
             error!("VirtQueue not ready to manage requests.");
             return false;
         }
@@ -410,12 +422,52 @@ impl VirtQueue {
         }
     }
 
+    /// Take the next available descriptor chain without marking it used,
+    /// returns the index of its head and its buffers.
+    ///
+    /// The chain is marked used later on, through [`Self::used_ring_ref`].
+    pub(crate) fn pop_chain(&mut self) -> Option<(u32, Vec<DescBuf>)> {
+        if !self.is_set_up() {
+            error!("VirtQueue not ready to manage requests.");
+            return None;
+        }
+
+        let ram_base = self.ram_base;
+        let mut handle = self.try_get_desc()?;
+        let head = handle.get_entry_idx();
+
+        let mut bufs = Vec::new();
+        while let Some(desc) = handle.try_get() {
+            bufs.push(DescBuf {
+                addr: desc.get_request_package::<u8>(ram_base) as usize,
+                len: desc.len as usize,
+            });
+        }
+        Some((head, bufs))
+    }
+
+    pub(crate) fn used_ring_ref(&self) -> UsedRingRef {
+        UsedRingRef {
+            used: self.used,
+            queue_num: self.queue_num,
+        }
+    }
+
+    fn is_set_up(&self) -> bool {
+        self.queue_num != 0 && self.desc != 0 && self.avail != 0 && self.used != 0
+    }
+
     pub(crate) fn set_used_ring_flag(&mut self, flag: VirtQueueUsedFlag) {
         self.get_used_ring().flags = flag;
     }
 
     pub(crate) fn get_avail_flag(&self) -> VirtQueueAvailFlag {
-        unsafe { self.avail.as_ref().unwrap().flags }
+        unsafe {
+            (self.avail as *const VirtQueueAvail)
+                .as_ref()
+                .unwrap()
+                .flags
+        }
     }
 
     pub(super) fn set_queue_num(&mut self, num: u32) {
@@ -426,6 +478,24 @@ impl VirtQueue {
         // Always ready for request.
         true
     }
+
+    pub(super) fn save_state(&self, out: &mut StateWriter) {
+        out.write_u32(self.queue_num);
+        out.write_u16(self.last_avail_idx);
+        out.write_u64(self.desc_paddr);
+        out.write_u64(self.avail_paddr);
+        out.write_u64(self.used_paddr);
+    }
+
+    /// The rings are found again from their guest addresses.
+    pub(super) fn restore_state(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        *self = Self::new(self.ram_base as *mut u8, state.read_u32()?);
+        self.last_avail_idx = state.read_u16()?;
+        self.set_desc(state.read_u64()?);
+        self.set_avail(state.read_u64()?);
+        self.set_used(state.read_u64()?);
+        Ok(())
+    }
 }
 
 #[cfg(test)]
@@ -437,8 +507,8 @@ mod tests {
     fn test_virt_queue_avail_ring() {
         const QUEUE_NUM: usize = 8;
         const DESC_NUM: usize = 8;
-        let mut ram = ram::Ram::new();
-        let ram_base = &mut ram[0] as *mut u8;
+        let ram = ram::Ram::new();
+        let ram_base = ram.host_ptr(0);
         let mut virt_queue = VirtQueue::new(ram_base, QUEUE_NUM as u32);
 
         let virtq_desc_base = 0x8000_2000 as u64;
@@ -451,14 +521,14 @@ mod tests {
         // Description Table.
         let virt_queue_desc = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(virtq_desc_base - ram_config::BASE_ADDR) as usize] as *mut u8
+                ram.host_ptr((virtq_desc_base - ram_config::BASE_ADDR) as usize)
                     as *mut VirtQueueDesc,
                 DESC_NUM,
             )
         };
 
         // Available Ring.
-        let virtq_avail = &mut ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize] as *mut u8
+        let virtq_avail = ram.host_ptr((virtq_avail_base - ram_config::BASE_ADDR) as usize)
             as *mut VirtQueueAvail;
         let virtq_avail = unsafe { virtq_avail.as_mut().unwrap() };
         virtq_avail
@@ -467,8 +537,8 @@ mod tests {
         let avail_ring = VirtQueueAvail::mut_ring(virtq_avail as *mut _ as u64, QUEUE_NUM as u32);
 
         // Used Ring.
-        let virtq_used = &mut ram[(virtq_used_base - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtQueueUsed;
+        let virtq_used =
+            ram.host_ptr((virtq_used_base - ram_config::BASE_ADDR) as usize) as *mut VirtQueueUsed;
         let virtq_used = unsafe { virtq_used.as_mut().unwrap() };
         virtq_used
             .idx
@@ -479,7 +549,8 @@ mod tests {
         // test Less-End.
         virtq_avail.flags = VirtQueueAvailFlag::NoInterrupt;
         assert_eq!(
-            ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize],
+            ram.read::<u8>(virtq_avail_base - ram_config::BASE_ADDR)
+                .unwrap(),
             0x1
         );
 
@@ -491,7 +562,7 @@ mod tests {
         desc0.len = 0x10;
         desc0.flags = VirtQueueDescFlag::VIRTQ_DESC_F_NEXT;
         desc0.next = 1;
-        ram.write(desc0.paddr - ram_config::BASE_ADDR, 114514usize)
+        ram.write(desc0.paddr - ram_config::BASE_ADDR, 114514u64)
             .unwrap();
 
         let desc1 = &mut virt_queue_desc[1];
@@ -499,7 +570,7 @@ mod tests {
         desc1.len = 0x10;
         desc1.flags = VirtQueueDescFlag::VIRTQ_DESC_F_NEXT;
         desc1.next = 2;
-        ram.write(desc1.paddr - ram_config::BASE_ADDR, 0721usize)
+        ram.write(desc1.paddr - ram_config::BASE_ADDR, 0721u64)
             .unwrap();
 
         let desc2 = &mut virt_queue_desc[2];
@@ -507,7 +578,7 @@ mod tests {
         desc2.len = 0x10;
         desc2.flags = VirtQueueDescFlag::empty();
         desc2.next = 3;
-        ram.write(desc2.paddr - ram_config::BASE_ADDR, 998244353usize)
+        ram.write(desc2.paddr - ram_config::BASE_ADDR, 998244353u64)
             .unwrap();
 
         // Test getting descriptors.
@@ -567,8 +638,8 @@ mod tests {
     fn test_virt_queue_used_ring() {
         const QUEUE_NUM: usize = 8;
         const DESC_NUM: usize = 8;
-        let mut ram = ram::Ram::new();
-        let ram_base = &mut ram[0] as *mut u8;
+        let ram = ram::Ram::new();
+        let ram_base = ram.host_ptr(0);
         let mut virt_queue = VirtQueue::new(ram_base, QUEUE_NUM as u32);
 
         let virtq_desc_base = 0x8000_2000 as u64;
@@ -584,14 +655,14 @@ mod tests {
         // Description Table.
         let virt_queue_desc = unsafe {
             slice::from_raw_parts_mut(
-                &mut ram[(virtq_desc_base - ram_config::BASE_ADDR) as usize] as *mut u8
+                ram.host_ptr((virtq_desc_base - ram_config::BASE_ADDR) as usize)
                     as *mut VirtQueueDesc,
                 DESC_NUM,
             )
         };
 
         // Available Ring.
-        let virtq_avail = &mut ram[(virtq_avail_base - ram_config::BASE_ADDR) as usize] as *mut u8
+        let virtq_avail = ram.host_ptr((virtq_avail_base - ram_config::BASE_ADDR) as usize)
             as *mut VirtQueueAvail;
         let virtq_avail = unsafe { virtq_avail.as_mut().unwrap() };
         virtq_avail
@@ -600,8 +671,8 @@ mod tests {
         let avail_ring = VirtQueueAvail::mut_ring(virtq_avail as *mut _ as u64, QUEUE_NUM as u32);
 
         // Used Ring.
-        let virtq_used = &mut ram[(virtq_used_base - ram_config::BASE_ADDR) as usize] as *mut u8
-            as *mut VirtQueueUsed;
+        let virtq_used =
+            ram.host_ptr((virtq_used_base - ram_config::BASE_ADDR) as usize) as *mut VirtQueueUsed;
         let virtq_used = unsafe { virtq_used.as_mut().unwrap() };
         virtq_used
             .idx
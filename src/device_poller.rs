@@ -1,10 +1,16 @@
-use crate::device::plic::ExternalInterrupt;
+use crate::{device::plic::ExternalInterrupt, stats::PollStats};
 use crossbeam::channel::{Receiver, Sender};
 
 #[cfg(feature = "riscv64")]
 use crate::device::plic::irq_line::{PlicIRQLine, PlicIRQSource};
 
-use std::sync::{Arc, Mutex};
+use std::{
+    sync::{
+        Arc, Condvar, Mutex,
+        atomic::{AtomicBool, Ordering},
+    },
+    time::Duration,
+};
 
 pub trait PollingEventTrait: Send {
     /// Poll once without blocking the caller thread.
@@ -34,6 +40,67 @@ impl<F: PollingFn + Send> PollingEventTrait for PollingFnWrapper<F> {
     }
 }
 
+/// Rung whenever the interrupt controllers may have something new to deliver.
+///
+/// The board only looks at the PLIC when the doorbell is rung, instead of polling it every few
+/// instructions. It can be rung from any thread: by the polling task when it forwards interrupts, and
+/// by the PLIC itself when a register write changes which interrupt a context should take.
+///
+/// A board with every hart waiting for an interrupt sleeps in [`Self::wait`] until it is rung.
+#[derive(Clone, Default)]
+pub struct Doorbell(Arc<DoorbellState>);
+
+#[derive(Default)]
+struct DoorbellState {
+    rung: AtomicBool,
+    /// Set while a thread is in [`Doorbell::wait`], so that ringing only locks when it has to.
+    sleeping: AtomicBool,
+    lock: Mutex<()>,
+    wake: Condvar,
+}
+
+impl Doorbell {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    #[inline]
+    pub fn ring(&self) {
+        // Sequentially consistent with `wait`: either the ringer sees the sleeper, or the sleeper
+        // sees the doorbell rung.
+        self.0.rung.store(true, Ordering::SeqCst);
+        if self.0.sleeping.load(Ordering::SeqCst) {
+            let _guard = self.0.lock.lock().unwrap();
+            self.0.wake.notify_all();
+        }
+    }
+
+    #[inline]
+    pub fn is_rung(&self) -> bool {
+        self.0.rung.load(Ordering::Relaxed)
+    }
+
+    /// Clear the doorbell, returns whether it was rung.
+    #[inline]
+    pub fn take(&self) -> bool {
+        self.is_rung() && self.0.rung.swap(false, Ordering::Acquire)
+    }
+
+    /// Block until the doorbell is rung or `timeout` elapsed, returns whether it is rung.
+    /// The doorbell is left rung, for [`Self::take`].
+    pub fn wait(&self, timeout: Duration) -> bool {
+        let guard = self.0.lock.lock().unwrap();
+        self.0.sleeping.store(true, Ordering::SeqCst);
+        let _guard = self
+            .0
+            .wake
+            .wait_timeout_while(guard, timeout, |_| !self.0.rung.load(Ordering::SeqCst))
+            .unwrap();
+        self.0.sleeping.store(false, Ordering::Relaxed);
+        self.is_rung()
+    }
+}
+
 struct PollerCore {
     events: Arc<Mutex<Vec<Box<dyn PollingEventTrait>>>>,
 
@@ -98,6 +165,11 @@ pub struct DevicePoller {
     /// Sent from the polling task (any thread), received on the main thread.
     irq_sender: Sender<ExternalInterrupt>,
     irq_receiver: Receiver<ExternalInterrupt>,
+
+    /// Rung by the polling task after it sent interrupts.
+    doorbell: Doorbell,
+
+    stats: Arc<PollStats>,
 }
 
 impl DevicePoller {
@@ -109,9 +181,21 @@ impl DevicePoller {
             core: PollerCore::new(),
             irq_sender: plic_irq_tx,
             irq_receiver: plic_irq_rx,
+            doorbell: Doorbell::new(),
+            stats: Arc::new(PollStats::default()),
         }
     }
 
+    /// Rounds of the polling task, see [`Self::poll_task`].
+    pub fn stats(&self) -> &PollStats {
+        &self.stats
+    }
+
+    /// The doorbell rung when interrupts are waiting in [`Self::trigger_external_interrupt`].
+    pub fn doorbell(&self) -> &Doorbell {
+        &self.doorbell
+    }
+
     pub fn add_event(&mut self, event: Box<dyn PollingEventTrait>) {
         self.core.add_event(event);
     }
@@ -120,15 +204,27 @@ impl DevicePoller {
     /// [`BackgroundExecutor`](crate::background::BackgroundExecutor). It polls every registered
     /// event once and forwards any produced interrupts to the main thread, returning `true` when at
     /// least one fired so the executor keeps its loop hot.
+    ///
+    /// The doorbell is rung after the interrupts are sent, so they can be drained once it is seen.
     pub fn poll_task(&self) -> impl FnMut() -> bool + Send + 'static {
         let events = self.core.events.clone();
         let sender = self.irq_sender.clone();
+        let doorbell = self.doorbell.clone();
+        let stats = self.stats.clone();
         move || {
             let pending = PollerCore::poll_once_collect(&events);
             let triggered = !pending.is_empty();
+            stats.rounds.incr();
+            if triggered {
+                stats.busy_rounds.incr();
+                stats.interrupts.add(pending.len() as u64);
+            }
             for id in pending {
                 let _ = sender.send(id);
             }
+            if triggered {
+                doorbell.ring();
+            }
             triggered
         }
     }
@@ -150,3 +246,30 @@ impl PlicIRQSource for DevicePoller {
         self.core.set_irq_line(line);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::{thread, time::Instant};
+
+    use super::*;
+
+    #[test]
+    fn test_doorbell_wakes_waiter() {
+        let doorbell = Doorbell::new();
+        assert!(!doorbell.wait(Duration::from_millis(1)));
+
+        let ringer = doorbell.clone();
+        let start = Instant::now();
+        let handle = thread::spawn(move || {
+            thread::sleep(Duration::from_millis(10));
+            ringer.ring();
+        });
+        assert!(doorbell.wait(Duration::from_secs(60)));
+        assert!(start.elapsed() < Duration::from_secs(60));
+        handle.join().unwrap();
+
+        // Left rung for the board to take.
+        assert!(doorbell.take());
+        assert!(!doorbell.is_rung());
+    }
+}
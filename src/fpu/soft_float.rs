@@ -9,6 +9,7 @@ use rustc_apfloat::Round as APFloatRound;
 
 use crate::{
     fpu::{Classification, Round},
+    snapshot::{Snapshot, SnapshotError, StateReader, StateWriter},
     utils::{
         BinaryOp, CmpOp, FloatPoint, InFloat, SignedInteger, TruncateFrom, WordTrait, make_mask,
     },
@@ -141,10 +142,107 @@ pub trait UnaryOpWithRound<F> {
 
 pub trait BinaryOpWithRound<F> {
     fn apply(a: F, b: F, round: Round) -> StatusAnd<F>;
+
+    /// The result rounded to nearest even on the host, and whether it is inexact, see [`HostFloat`].
+    fn apply_host<H: FloatPoint>(_a: H, _b: H) -> Option<(H, bool)> {
+        None
+    }
 }
 
 pub trait TernaryOpWithRound<F> {
     fn apply(a: F, b: F, c: F, round: Round) -> StatusAnd<F>;
+
+    fn apply_host<H: FloatPoint>(_a: H, _b: H, _c: H) -> Option<(H, bool)> {
+        None
+    }
+}
+
+/// Host floats, for the round to nearest even fast path of [`SoftFPU`].
+///
+/// The host rounds to nearest even as RISC-V does, and only differs on NaNs and on the flags. So
+/// the fast path only takes finite operands and results far enough from the subnormals that the
+/// rounding error of a sum, a product or a quotient is itself a float: the result then raises no
+/// flag but inexact, which is told by computing that error. Everything else, and anything the
+/// fast path can not tell, goes through `rustc_apfloat`.
+pub trait HostFloat {
+    /// Finite and of magnitude at least `2^(emin + p)`, `p` being the precision.
+    fn is_fast(self) -> bool;
+}
+
+impl HostFloat for f32 {
+    #[inline]
+    fn is_fast(self) -> bool {
+        // 2^-102
+        const FAST_MIN: f32 = f32::from_bits(25 << 23);
+        let abs = self.abs();
+        abs >= FAST_MIN && abs <= f32::MAX
+    }
+}
+
+impl HostFloat for f64 {
+    #[inline]
+    fn is_fast(self) -> bool {
+        // 2^-969
+        const FAST_MIN: f64 = f64::from_bits(54 << 52);
+        let abs = self.abs();
+        abs >= FAST_MIN && abs <= f64::MAX
+    }
+}
+
+/// `a + b` and the rounding error of it, exactly (Knuth's TwoSum).
+#[inline]
+fn two_sum<H: FloatPoint>(a: H, b: H) -> (H, H) {
+    let sum = a + b;
+    let b_virtual = sum - a;
+    let a_virtual = sum - b_virtual;
+    (sum, (a - a_virtual) + (b - b_virtual))
+}
+
+#[inline]
+fn is_zero<H: FloatPoint>(f: H) -> bool {
+    f == H::from(0.0)
+}
+
+#[inline]
+fn host_add<H: FloatPoint>(a: H, b: H) -> Option<(H, bool)> {
+    let (sum, err) = two_sum(a, b);
+    (a.is_fast() && b.is_fast() && sum.is_fast()).then(|| (sum, !is_zero(err)))
+}
+
+#[inline]
+fn host_mul<H: FloatPoint>(a: H, b: H) -> Option<(H, bool)> {
+    let product = a * b;
+    (a.is_fast() && b.is_fast() && product.is_fast())
+        .then(|| (product, !is_zero(a.mul_add(b, -product))))
+}
+
+#[inline]
+fn host_div<H: FloatPoint>(a: H, b: H) -> Option<(H, bool)> {
+    let quotient = a / b;
+    // The remainder `a - quotient * b` is a float, zero iff the quotient is exact.
+    (a.is_fast() && b.is_fast() && quotient.is_fast())
+        .then(|| (quotient, !is_zero((-quotient).mul_add(b, a))))
+}
+
+/// `a * b + c`, when it is a sum of two floats: the exact value is `ph + pl + c`, with `ph + pl`
+/// the product, and it is rewritten as `h + g` without error. This holds unless the two rounding
+/// errors `pl` and `t1` below do not add up exactly, which is left to the soft path.
+#[inline]
+fn host_fma<H: FloatPoint>(a: H, b: H, c: H) -> Option<(H, bool)> {
+    let result = a.mul_add(b, c);
+    let ph = a * b;
+    if !(a.is_fast() && b.is_fast() && c.is_fast() && ph.is_fast() && result.is_fast()) {
+        return None;
+    }
+
+    let pl = a.mul_add(b, -ph);
+    let (h, t1) = two_sum(ph, c);
+    let (g, t3) = two_sum(t1, pl);
+    if !is_zero(t3) {
+        return None;
+    }
+    let (_, err) = two_sum(h, g);
+    Some((result, !is_zero(err)))
 }
 
 // Implementation of operations:
@@ -161,28 +259,37 @@ macro_rules! define_binary_op {
 }
 
 macro_rules! define_binary_op_r {
-    ($struct_name:ident, $method_name:ident) => {
+    ($struct_name:ident, $method_name:ident, |$a:ident, $b:ident| $host:expr) => {
         pub struct $struct_name;
         impl<F: Float> BinaryOpWithRound<F> for $struct_name {
             fn apply(a: F, b: F, round: Round) -> StatusAnd<F> {
                 a.$method_name(b, round.into())
             }
+
+            #[inline]
+            fn apply_host<H: FloatPoint>($a: H, $b: H) -> Option<(H, bool)> {
+                $host
+            }
         }
     };
 }
 
 // Arithmetic
 
-define_binary_op_r!(AddOp, add_r);
-define_binary_op_r!(SubOp, sub_r);
-define_binary_op_r!(MulOp, mul_r);
-define_binary_op_r!(DivOp, div_r);
+define_binary_op_r!(AddOp, add_r, |a, b| host_add(a, b));
+define_binary_op_r!(SubOp, sub_r, |a, b| host_add(a, -b));
+define_binary_op_r!(MulOp, mul_r, |a, b| host_mul(a, b));
+define_binary_op_r!(DivOp, div_r, |a, b| host_div(a, b));
 
 pub struct MulAddOp;
 impl<F: Float> TernaryOpWithRound<F> for MulAddOp {
     fn apply(a: F, b: F, c: F, round: Round) -> StatusAnd<F> {
         a.mul_add_r(b, c, round.into())
     }
+
+    fn apply_host<H: FloatPoint>(a: H, b: H, c: H) -> Option<(H, bool)> {
+        host_fma(a, b, c)
+    }
 }
 
 pub struct MulSubOp;
@@ -190,6 +297,10 @@ impl<F: Float> TernaryOpWithRound<F> for MulSubOp {
     fn apply(a: F, b: F, c: F, round: Round) -> StatusAnd<F> {
         a.mul_add_r(b, -c, round.into())
     }
+
+    fn apply_host<H: FloatPoint>(a: H, b: H, c: H) -> Option<(H, bool)> {
+        host_fma(a, b, -c)
+    }
 }
 
 pub struct NegMulAddOp;
@@ -197,6 +308,10 @@ impl<F: Float> TernaryOpWithRound<F> for NegMulAddOp {
     fn apply(a: F, b: F, c: F, round: Round) -> StatusAnd<F> {
         (-a).mul_add_r(b, -c, round.into())
     }
+
+    fn apply_host<H: FloatPoint>(a: H, b: H, c: H) -> Option<(H, bool)> {
+        host_fma(-a, b, -c)
+    }
 }
 
 pub struct NegMulSubOp;
@@ -204,6 +319,10 @@ impl<F: Float> TernaryOpWithRound<F> for NegMulSubOp {
     fn apply(a: F, b: F, c: F, round: Round) -> StatusAnd<F> {
         (-a).mul_add_r(b, c, round.into())
     }
+
+    fn apply_host<H: FloatPoint>(a: H, b: H, c: H) -> Option<(H, bool)> {
+        host_fma(-a, b, c)
+    }
 }
 
 // Sign injection
@@ -317,6 +436,32 @@ pub struct SoftFPU {
     last_status: std::cell::Cell<Status>,
     reg_file: [APFloat; 32],
     pub unify_cnan: bool,
+    /// Compute everything with `rustc_apfloat`, without the host fast path, see [`HostFloat`].
+    pub strict: bool,
+}
+
+/// Each register keeps the format it was written in, so that NaN-boxing reads back the same.
+impl Snapshot for SoftFPU {
+    fn save(&self, out: &mut StateWriter) {
+        for reg in self.reg_file.iter() {
+            out.write_bool(matches!(reg, APFloat::Double(_)));
+            out.write_u64(reg.to_bits() as u64);
+        }
+    }
+
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        for reg in self.reg_file.iter_mut() {
+            let is_double = state.read_bool()?;
+            let bits = state.read_u64()? as u128;
+            *reg = if is_double {
+                APFloat::Double(Double::from_bits(bits))
+            } else {
+                APFloat::Single(Single::from_bits(bits))
+            };
+        }
+        self.last_status.set(Status::OK);
+        Ok(())
+    }
 }
 
 impl SoftFPU {
@@ -329,6 +474,7 @@ impl SoftFPU {
             last_status: std::cell::Cell::new(Status::OK),
             reg_file: [APFloat::Single(Single::from_bits(0)); 32],
             unify_cnan: unify_cnan,
+            strict: false,
         }
     }
 
@@ -354,6 +500,18 @@ impl SoftFPU {
         F::from_bits(F::BitsType::truncate_from(f.to_bits()))
     }
 
+    #[inline]
+    fn host_fast_path(&self, round: Round) -> bool {
+        round == Round::NearestTiesToEven && !self.strict
+    }
+
+    #[inline]
+    fn save_host_result<T: FloatPoint>(&mut self, rd: u8, (res, inexact): (T, bool)) {
+        self.last_status
+            .set(if inexact { Status::INEXACT } else { Status::OK });
+        self.reg_file[rd as usize] = res.into();
+    }
+
     pub fn store<F: Into<APFloat>>(&mut self, index: u8, value: F) {
         self.reg_file[index as usize] = value.into();
     }
@@ -547,6 +705,13 @@ impl SoftFPU {
     where
         Op: BinaryOpWithRound<<T as APFloatOf>::Float>,
     {
+        if self.host_fast_path(round) {
+            if let Some(res) = Op::apply_host(self.load::<T>(rs1), self.load::<T>(rs2)) {
+                self.save_host_result(rd, res);
+                return;
+            }
+        }
+
         let a: T::Float = self.reg_file[rs1 as usize].into();
         let b: T::Float = self.reg_file[rs2 as usize].into();
         let mut res = self.save_and_unwrap(Op::apply(a, b, round));
@@ -566,6 +731,18 @@ impl SoftFPU {
     ) where
         Op: TernaryOpWithRound<T::Float>,
     {
+        if self.host_fast_path(round) {
+            let (a, b, c) = (
+                self.load::<T>(rs1),
+                self.load::<T>(rs2),
+                self.load::<T>(rs3),
+            );
+            if let Some(res) = Op::apply_host(a, b, c) {
+                self.save_host_result(rd, res);
+                return;
+            }
+        }
+
         let a: T::Float = self.reg_file[rs1 as usize].into();
         let b: T::Float = self.reg_file[rs2 as usize].into();
         let c: T::Float = self.reg_file[rs3 as usize].into();
@@ -914,4 +1091,86 @@ mod tests {
         assert_eq!(r, 0.0);
         assert!(r.is_sign_positive());
     }
+
+    fn xorshift(state: &mut u64) -> u64 {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        *state
+    }
+
+    /// Any float, a small integer, or a float around 1 or around the bound of the fast path.
+    fn operand<T: FloatPoint>(state: &mut u64, mantissa_bits: u32, exp_bits: u32) -> T {
+        let mask = |bits: u32| (1u64 << bits) - 1;
+        let bias = mask(exp_bits - 1);
+
+        let r = xorshift(state);
+        let mut mantissa = (r >> 16) & mask(mantissa_bits);
+        let exp = match r % 5 {
+            0 => {
+                let bits = r & mask(1 + exp_bits + mantissa_bits);
+                return T::from_bits(T::BitsType::truncate_from(bits as u128));
+            }
+            1 => return T::from((r >> 8) as u8 as i8 as f32 / 4.0),
+            2 | 3 => bias - 16 + (r >> 8) % 32,
+            _ => (r >> 8) % 64,
+        };
+        // Few mantissa bits make exact results.
+        if r & (1 << 14) != 0 {
+            mantissa &= !mask(mantissa_bits - 4);
+        }
+        let sign = (r >> 15) & 1;
+        let bits = sign << (exp_bits + mantissa_bits) | exp << mantissa_bits | mantissa;
+        T::from_bits(T::BitsType::truncate_from(bits as u128))
+    }
+
+    fn assert_host_path_matches<T: FloatPoint>(mantissa_bits: u32, exp_bits: u32) {
+        let mut fast = SoftFPU::from(true);
+        let mut strict = SoftFPU::from(true);
+        strict.strict = true;
+
+        let mut state = 0x9e37_79b9_7f4a_7c15;
+        for _ in 0..20000 {
+            let a: T = operand(&mut state, mantissa_bits, exp_bits);
+            let b: T = operand(&mut state, mantissa_bits, exp_bits);
+            let c: T = operand(&mut state, mantissa_bits, exp_bits);
+            for fpu in [&mut fast, &mut strict] {
+                fpu.store(1, a);
+                fpu.store(2, b);
+                fpu.store(3, c);
+            }
+
+            let ops: [fn(&mut SoftFPU); 8] = [
+                |fpu| fpu.exec_binary_r::<AddOp, T>(1, 2, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_binary_r::<SubOp, T>(1, 2, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_binary_r::<MulOp, T>(1, 2, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_binary_r::<DivOp, T>(1, 2, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_ternary_r::<MulAddOp, T>(1, 2, 3, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_ternary_r::<MulSubOp, T>(1, 2, 3, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_ternary_r::<NegMulAddOp, T>(1, 2, 3, 4, Round::NearestTiesToEven),
+                |fpu| fpu.exec_ternary_r::<NegMulSubOp, T>(1, 2, 3, 4, Round::NearestTiesToEven),
+            ];
+            for (idx, op) in ops.iter().enumerate() {
+                op(&mut fast);
+                op(&mut strict);
+                let fast_bits: u64 = fast.load::<T>(4).to_bits().into();
+                let strict_bits: u64 = strict.load::<T>(4).to_bits().into();
+                assert_eq!(
+                    (fast_bits, fast.last_status()),
+                    (strict_bits, strict.last_status()),
+                    "op {} of {} {} {}",
+                    idx,
+                    a,
+                    b,
+                    c
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn test_host_path_matches_soft_float() {
+        assert_host_path_matches::<f32>(23, 8);
+        assert_host_path_matches::<f64>(52, 11);
+    }
 }
@@ -1,3 +1,6 @@
+use gdbstub::target::ext::breakpoints::WatchKind;
+
+use crate::isa::riscv::debug_points;
 use crate::isa::riscv::debugger::Address;
 
 use super::*;
@@ -7,6 +10,11 @@ impl<'a, B: Board> ext::breakpoints::Breakpoints for GdbDebugger<'a, B> {
     fn support_sw_breakpoint(&mut self) -> Option<ext::breakpoints::SwBreakpointOps<'_, Self>> {
         Some(self)
     }
+
+    #[inline(always)]
+    fn support_hw_watchpoint(&mut self) -> Option<ext::breakpoints::HwWatchpointOps<'_, Self>> {
+        Some(self)
+    }
 }
 
 impl<'a, B: Board> ext::breakpoints::SwBreakpoint for GdbDebugger<'a, B> {
@@ -32,3 +40,40 @@ impl<'a, B: Board> ext::breakpoints::SwBreakpoint for GdbDebugger<'a, B> {
         }
     }
 }
+
+fn watch_kind(kind: WatchKind) -> debug_points::WatchKind {
+    match kind {
+        WatchKind::Write => debug_points::WatchKind::Write,
+        WatchKind::Read => debug_points::WatchKind::Read,
+        WatchKind::ReadWrite => debug_points::WatchKind::ReadWrite,
+    }
+}
+
+pub(super) fn gdb_watch_kind(kind: debug_points::WatchKind) -> WatchKind {
+    match kind {
+        debug_points::WatchKind::Write => WatchKind::Write,
+        debug_points::WatchKind::Read => WatchKind::Read,
+        debug_points::WatchKind::ReadWrite => WatchKind::ReadWrite,
+    }
+}
+
+impl<'a, B: Board> ext::breakpoints::HwWatchpoint for GdbDebugger<'a, B> {
+    fn add_hw_watchpoint(
+        &mut self,
+        addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
+        len: <Self::Arch as gdbstub::arch::Arch>::Usize,
+        kind: WatchKind,
+    ) -> gdbstub::target::TargetResult<bool, Self> {
+        self.dbg.set_watchpoint(addr, len, watch_kind(kind));
+        Ok(true)
+    }
+
+    fn remove_hw_watchpoint(
+        &mut self,
+        addr: <Self::Arch as gdbstub::arch::Arch>::Usize,
+        len: <Self::Arch as gdbstub::arch::Arch>::Usize,
+        kind: WatchKind,
+    ) -> gdbstub::target::TargetResult<bool, Self> {
+        Ok(self.dbg.clear_watchpoint(addr, len, watch_kind(kind)))
+    }
+}
@@ -48,13 +48,7 @@ impl<'a, B: Board> run_blocking::BlockingEventLoop for EmuGdbEventLoop<'a, B> {
             <Self::Connection as Connection>::Error,
         >,
     > {
-        let has_input = |dbg: &mut Debugger<'a, B>| {
-            if dbg.cycle() % 1024 == 0 {
-                conn.peek().map(|b| b.is_some()).unwrap_or(true)
-            } else {
-                false
-            }
-        };
+        let has_input = |_: &mut Debugger<'a, B>| conn.peek().map(|b| b.is_some()).unwrap_or(true);
 
         let dbg_event = target.run_by_mode_until(has_input);
 
@@ -72,6 +66,11 @@ impl<'a, B: Board> run_blocking::BlockingEventLoop for EmuGdbEventLoop<'a, B> {
                     DebugEvent::StepCompleted => SingleThreadStopReason::DoneStep,
                     DebugEvent::BoardHalted => SingleThreadStopReason::Terminated(Signal::SIGSTOP),
                     DebugEvent::BreakpointHit => SingleThreadStopReason::SwBreak(()),
+                    DebugEvent::WatchpointHit { kind, addr } => SingleThreadStopReason::Watch {
+                        tid: (),
+                        kind: breakpoints::gdb_watch_kind(kind),
+                        addr,
+                    },
                 };
 
                 run_blocking::Event::TargetStopped(stop_reason)
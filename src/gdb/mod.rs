@@ -12,6 +12,9 @@ mod eventloop;
 
 pub use eventloop::*;
 
+/// How often a `continue` looks for incoming data, in cycles.
+const POLL_CYCLES: u64 = 1 << 16;
+
 enum ExecMode {
     Continue,
     Step,
@@ -41,7 +44,7 @@ impl<'a, B: Board> GdbDebugger<'a, B> {
     ) -> RunEvent {
         match self.exec_mode {
             ExecMode::Step => RunEvent::StopReason(self.dbg.step().unwrap()),
-            ExecMode::Continue => match self.dbg.continue_until(condition).unwrap() {
+            ExecMode::Continue => match self.dbg.continue_fast(POLL_CYCLES, condition).unwrap() {
                 Some(event) => RunEvent::StopReason(event),
                 None => RunEvent::IncomingData,
             },
@@ -1,3 +1,5 @@
+use std::ops::Range;
+
 use crate::config::arch_config::WordType;
 
 pub trait Cacheable: Clone + Copy {
@@ -13,16 +15,51 @@ pub trait Cacheable: Clone + Copy {
     }
 }
 
+/// Counters of one cache instance, used to size the caches for a workload.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct CacheStats {
+    pub hits: u64,
+    pub misses: u64,
+    /// Valid entries replaced by a new one, invalidations are not counted.
+    pub evictions: u64,
+}
+
+impl CacheStats {
+    pub fn hit_rate(&self) -> f64 {
+        let total = self.hits + self.misses;
+        if total == 0 {
+            0.0
+        } else {
+            self.hits as f64 / total as f64
+        }
+    }
+
+    #[inline(always)]
+    pub(crate) fn record(&mut self, hit: bool) {
+        if hit {
+            self.hits += 1;
+        } else {
+            self.misses += 1;
+        }
+    }
+}
+
 pub(super) trait Cache<T: Cacheable> {
     fn new() -> Self;
-    fn get(&self, addr: WordType) -> Option<T>;
+    /// Takes `&mut self` since a hit updates the replacement state and the counters.
+    fn get(&mut self, addr: WordType) -> Option<T>;
     fn put(&mut self, addr: WordType, data: T);
     fn invalidate(&mut self, addr: WordType);
+    /// Drop every entry whose address is in `range`, visits the whole cache.
+    fn invalidate_range(&mut self, range: Range<WordType>);
     fn clear(&mut self);
+    fn stats(&self) -> CacheStats;
 }
 
+/// Direct-mapped cache, every address has only one slot so there is no replacement policy to choose.
 pub(super) struct DirectCache<T, const N: usize> {
     cache: [(WordType, Option<T>); N],
+    stats: CacheStats,
 }
 
 impl<T: Cacheable, const N: usize> DirectCache<T, N> {
@@ -37,18 +74,25 @@ impl<T: Cacheable, const N: usize> Cache<T> for DirectCache<T, N> {
         debug_assert!(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
         Self {
             cache: [(0, None); N],
+            stats: CacheStats::default(),
         }
     }
 
     #[inline]
-    fn get(&self, addr: WordType) -> Option<T> {
+    fn get(&mut self, addr: WordType) -> Option<T> {
         let (tag, data) = &self.cache[Self::get_id(addr)];
-        if *tag == addr { data.clone() } else { None }
+        let rst = if *tag == addr { data.clone() } else { None };
+        self.stats.record(rst.is_some());
+        rst
     }
 
     #[inline]
     fn put(&mut self, addr: WordType, data: T) {
-        self.cache[Self::get_id(addr)] = (addr, Some(data));
+        let slot = &mut self.cache[Self::get_id(addr)];
+        if slot.1.is_some() && slot.0 != addr {
+            self.stats.evictions += 1;
+        }
+        *slot = (addr, Some(data));
     }
 
     #[inline]
@@ -56,90 +100,266 @@ impl<T: Cacheable, const N: usize> Cache<T> for DirectCache<T, N> {
         self.cache[Self::get_id(addr)] = (0, None);
     }
 
+    fn invalidate_range(&mut self, range: Range<WordType>) {
+        for entry in self.cache.iter_mut() {
+            if entry.1.is_some() && range.contains(&entry.0) {
+                *entry = (0, None);
+            }
+        }
+    }
+
     #[inline]
     fn clear(&mut self) {
         self.cache.fill((0, None));
     }
+
+    fn stats(&self) -> CacheStats {
+        self.stats
+    }
+}
+
+/// Chooses which way of a full set with `W` ways is replaced.
+///
+/// Each set owns one policy state, so it has to stay small. `W` is at most 64.
+pub(crate) trait ReplacePolicy<const W: usize> {
+    fn new() -> Self;
+    /// `way` has just been hit or filled.
+    fn touch(&mut self, way: usize);
+    /// The way to evict, only asked when every way is valid.
+    fn victim(&mut self) -> usize;
+}
+
+/// Evicts in filling order, ignoring hits.
+pub(crate) struct Fifo {
+    next: usize,
+}
+
+impl<const W: usize> ReplacePolicy<W> for Fifo {
+    fn new() -> Self {
+        Self { next: 0 }
+    }
+
+    #[inline]
+    fn touch(&mut self, _way: usize) {}
+
+    #[inline]
+    fn victim(&mut self) -> usize {
+        let way = self.next;
+        self.next = (self.next + 1) % W;
+        way
+    }
+}
+
+/// Tree pseudo-LRU, one bit per inner node of a binary tree over the ways pointing away from the last access.
+///
+/// `W` must be a power of two.
+pub(crate) struct TreePlru {
+    /// Node `i` has children `2i` and `2i + 1`, the root is `1`.
+    bits: u64,
+}
+
+impl<const W: usize> ReplacePolicy<W> for TreePlru {
+    fn new() -> Self {
+        debug_assert!(
+            W <= 64 && W.is_power_of_two(),
+            "W must be a power of two up to 64."
+        );
+        Self { bits: 0 }
+    }
+
+    #[inline]
+    fn touch(&mut self, way: usize) {
+        let mut node = 1;
+        for level in (0..W.trailing_zeros()).rev() {
+            let right = (way >> level) & 1;
+            // Point to the other half.
+            if right == 1 {
+                self.bits &= !(1 << node);
+            } else {
+                self.bits |= 1 << node;
+            }
+            node = node * 2 + right;
+        }
+    }
+
+    #[inline]
+    fn victim(&mut self) -> usize {
+        let mut node = 1;
+        let mut way = 0;
+        for _ in 0..W.trailing_zeros() {
+            let right = ((self.bits >> node) & 1) as usize;
+            way = way * 2 + right;
+            node = node * 2 + right;
+        }
+        way
+    }
+}
+
+/// Second chance: a referenced way is skipped once by the clock hand.
+pub(crate) struct Clock {
+    referenced: u64,
+    hand: usize,
+}
+
+impl<const W: usize> ReplacePolicy<W> for Clock {
+    fn new() -> Self {
+        debug_assert!(W <= 64, "W must be at most 64.");
+        Self {
+            referenced: 0,
+            hand: 0,
+        }
+    }
+
+    #[inline]
+    fn touch(&mut self, way: usize) {
+        self.referenced |= 1 << way;
+    }
+
+    #[inline]
+    fn victim(&mut self) -> usize {
+        loop {
+            let way = self.hand;
+            self.hand = (self.hand + 1) % W;
+
+            if self.referenced & (1 << way) == 0 {
+                return way;
+            }
+            self.referenced &= !(1 << way);
+        }
+    }
+}
+
+/// Evicts a pseudo-random way, seeded with a constant so that runs are reproducible.
+pub(crate) struct Random {
+    state: u32,
+}
+
+impl<const W: usize> ReplacePolicy<W> for Random {
+    fn new() -> Self {
+        Self { state: 0x9e37_79b9 }
+    }
+
+    #[inline]
+    fn touch(&mut self, _way: usize) {}
+
+    #[inline]
+    fn victim(&mut self) -> usize {
+        // xorshift32
+        self.state ^= self.state << 13;
+        self.state ^= self.state >> 17;
+        self.state ^= self.state << 5;
+        self.state as usize % W
+    }
 }
 
 /// Helper struct for set-associative cache, representing one set with W ways.
-struct CacheSet<T: Cacheable, const W: usize> {
-    replace_idx: usize,
+struct CacheSet<T: Cacheable, const W: usize, P: ReplacePolicy<W>> {
+    policy: P,
     source_addr: [WordType; W],
     data: [Option<T>; W],
 }
 
-impl<T: Cacheable, const W: usize> CacheSet<T, W> {
-    const fn new() -> Self {
+impl<T: Cacheable, const W: usize, P: ReplacePolicy<W>> CacheSet<T, W, P> {
+    fn new() -> Self {
         Self {
-            replace_idx: 0,
+            policy: P::new(),
             source_addr: [0; W],
             data: [None; W],
         }
     }
 
     #[inline]
-    fn insert(&mut self, addr: WordType, data: T) {
-        self.source_addr[self.replace_idx] = addr;
-        self.data[self.replace_idx] = Some(data);
+    fn position(&self, addr: WordType) -> Option<usize> {
+        (0..W).find(|&way| self.data[way].is_some() && self.source_addr[way] == addr)
+    }
 
-        self.replace_idx += 1;
-        if self.replace_idx == W {
-            self.replace_idx = 0;
-        }
+    #[inline]
+    fn get(&mut self, addr: WordType) -> Option<T> {
+        let way = self.position(addr)?;
+        self.policy.touch(way);
+        self.data[way]
+    }
+
+    /// Returns whether a valid entry has been evicted.
+    #[inline]
+    fn insert(&mut self, addr: WordType, data: T) -> bool {
+        let (way, evicted) = match self.position(addr) {
+            Some(way) => (way, false),
+            None => match self.data.iter().position(Option::is_none) {
+                Some(way) => (way, false),
+                None => (self.policy.victim(), true),
+            },
+        };
+
+        self.source_addr[way] = addr;
+        self.data[way] = Some(data);
+        self.policy.touch(way);
+        evicted
     }
 
     #[inline]
     fn invalidate(&mut self, addr: WordType) {
-        if let Some(index) = self.source_addr.iter().position(|&item| item == addr) {
-            self.source_addr[index] = 0;
-            self.data[index] = None;
+        if let Some(way) = self.position(addr) {
+            self.source_addr[way] = 0;
+            self.data[way] = None;
+        }
+    }
+
+    fn invalidate_range(&mut self, range: &Range<WordType>) {
+        for index in 0..W {
+            if self.data[index].is_some() && range.contains(&self.source_addr[index]) {
+                self.source_addr[index] = 0;
+                self.data[index] = None;
+            }
         }
     }
 }
 
-/// Set-associative cache with S sets and W ways per set.
-///
-/// TODO: Current replacement policy is FIFO, which is not optimal.
+/// Set-associative cache with S sets, W ways per set and the replacement policy P.
 ///
 /// Example:
 /// ```
-/// SetCache<DecodeInstr, 4, 2> // 4 sets, 2 ways per set
+/// SetCache<DecodeInstr, 4, 2> // 4 sets, 2 ways per set, FIFO
+/// SetCache<DecodeInstr, 4, 2, TreePlru> // 4 sets, 2 ways per set, pseudo-LRU
 /// ```
-pub(super) struct SetCache<I: Cacheable, const S: usize, const W: usize> {
-    cache: [CacheSet<I, W>; S],
+pub(super) struct SetCache<I: Cacheable, const S: usize, const W: usize, P: ReplacePolicy<W> = Fifo>
+{
+    cache: [CacheSet<I, W, P>; S],
+    stats: CacheStats,
 }
 
-impl<T: Cacheable, const S: usize, const W: usize> SetCache<T, S, W> {
+impl<T: Cacheable, const S: usize, const W: usize, P: ReplacePolicy<W>> SetCache<T, S, W, P> {
     #[inline]
     fn set_index_of(addr: WordType) -> usize {
         (T::index_of(addr)) & (S - 1)
     }
 }
 
-impl<T: Cacheable, const S: usize, const W: usize> Cache<T> for SetCache<T, S, W> {
+impl<T: Cacheable, const S: usize, const W: usize, P: ReplacePolicy<W>> Cache<T>
+    for SetCache<T, S, W, P>
+{
     fn new() -> Self {
         debug_assert!(S > 0 && (S & (S - 1)) == 0, "S must be a power of two.");
         debug_assert!(W > 0 && (W & (W - 1)) == 0, "W must be a power of two.");
 
         Self {
             cache: std::array::from_fn(|_| CacheSet::new()),
+            stats: CacheStats::default(),
         }
     }
 
     #[inline]
-    fn get(&self, addr: WordType) -> Option<T> {
-        let set = &self.cache[Self::set_index_of(addr)];
-
-        set.source_addr
-            .iter()
-            .position(|&item| item == addr)
-            .and_then(|index| set.data[index].clone())
+    fn get(&mut self, addr: WordType) -> Option<T> {
+        let rst = self.cache[Self::set_index_of(addr)].get(addr);
+        self.stats.record(rst.is_some());
+        rst
     }
 
     #[inline]
     fn put(&mut self, addr: WordType, data: T) {
-        self.cache[Self::set_index_of(addr)].insert(addr, data);
+        if self.cache[Self::set_index_of(addr)].insert(addr, data) {
+            self.stats.evictions += 1;
+        }
     }
 
     #[inline]
@@ -147,25 +367,38 @@ impl<T: Cacheable, const S: usize, const W: usize> Cache<T> for SetCache<T, S, W
         self.cache[Self::set_index_of(addr)].invalidate(addr);
     }
 
+    fn invalidate_range(&mut self, range: Range<WordType>) {
+        for set in self.cache.iter_mut() {
+            set.invalidate_range(&range);
+        }
+    }
+
     #[inline]
     fn clear(&mut self) {
         self.cache = std::array::from_fn(|_| CacheSet::new());
     }
+
+    fn stats(&self) -> CacheStats {
+        self.stats
+    }
 }
 
 /// Used to test the performance of other cache implementations.
 pub(super) struct NullCache<T: Cacheable> {
+    stats: CacheStats,
     _phantom: std::marker::PhantomData<T>,
 }
 
 impl<T: Cacheable> Cache<T> for NullCache<T> {
     fn new() -> Self {
         Self {
+            stats: CacheStats::default(),
             _phantom: std::marker::PhantomData,
         }
     }
 
-    fn get(&self, _addr: WordType) -> Option<T> {
+    fn get(&mut self, _addr: WordType) -> Option<T> {
+        self.stats.misses += 1;
         None
     }
 
@@ -173,7 +406,13 @@ impl<T: Cacheable> Cache<T> for NullCache<T> {
 
     fn invalidate(&mut self, _addr: WordType) {}
 
+    fn invalidate_range(&mut self, _range: Range<WordType>) {}
+
     fn clear(&mut self) {}
+
+    fn stats(&self) -> CacheStats {
+        self.stats
+    }
 }
 
 #[cfg(test)]
@@ -206,15 +445,26 @@ mod tests {
         cache.invalidate(1);
         assert_eq!(cache.get(1), None);
 
+        cache.put(3, MockCacheable(300));
+        cache.invalidate_range(2..3);
+        assert_eq!(cache.get(2), None);
+        assert_eq!(cache.get(3), Some(MockCacheable(300)));
+
         cache.clear();
         assert_eq!(cache.get(1), None);
         assert_eq!(cache.get(2), None);
+
+        assert_eq!(cache.stats().hits, 4);
+        assert_eq!(cache.stats().misses, 6);
     }
 
     #[test]
     fn common_cache_tests() {
         test_cache_common::<DirectCache<MockCacheable, 8>>();
         test_cache_common::<SetCache<MockCacheable, 4, 2>>();
+        test_cache_common::<SetCache<MockCacheable, 4, 2, TreePlru>>();
+        test_cache_common::<SetCache<MockCacheable, 4, 2, Clock>>();
+        test_cache_common::<SetCache<MockCacheable, 4, 2, Random>>();
     }
 
     #[test]
@@ -232,5 +482,35 @@ mod tests {
         }
 
         assert_eq!(cache.get(8), Some(MockCacheable(8)));
+        assert_eq!(cache.stats().evictions, 0);
+
+        // Set 0 is full, FIFO evicts the oldest entry.
+        cache.put(16, MockCacheable(16));
+        assert_eq!(cache.get(0), None);
+        assert_eq!(cache.get(8), Some(MockCacheable(8)));
+        assert_eq!(cache.stats().evictions, 1);
+    }
+
+    #[test]
+    fn replace_policy_test() {
+        // Pseudo-LRU evicts the way that is not recently used.
+        let mut plru = <TreePlru as ReplacePolicy<4>>::new();
+        for way in [0, 1, 2, 3, 0, 2] {
+            ReplacePolicy::<4>::touch(&mut plru, way);
+        }
+        assert_eq!(ReplacePolicy::<4>::victim(&mut plru), 1);
+
+        // CLOCK gives referenced ways a second chance.
+        let mut clock = <Clock as ReplacePolicy<4>>::new();
+        ReplacePolicy::<4>::touch(&mut clock, 0);
+        ReplacePolicy::<4>::touch(&mut clock, 1);
+        assert_eq!(ReplacePolicy::<4>::victim(&mut clock), 2);
+        assert_eq!(ReplacePolicy::<4>::victim(&mut clock), 3);
+        assert_eq!(ReplacePolicy::<4>::victim(&mut clock), 0);
+
+        let mut random = <Random as ReplacePolicy<4>>::new();
+        for _ in 0..16 {
+            assert!(ReplacePolicy::<4>::victim(&mut random) < 4);
+        }
     }
 }
@@ -0,0 +1,585 @@
+use std::sync::Arc;
+
+#[cfg(feature = "jit")]
+use crate::isa::riscv::jit;
+use crate::{
+    config::arch_config::WordType,
+    isa::{
+        cache::{Cache, CacheStats, Cacheable, SetCache},
+        riscv::{
+            executor::RVCPU,
+            instruction::{RVInstrInfo, exec_mapping::get_exec_func, instr_table::RiscvInstr},
+            predecode::{DecodedBlock, HotCounter},
+            trap::Exception,
+        },
+    },
+};
+
+/// Maximum number of instructions in one translated block.
+pub(super) const MAX_BLOCK_LEN: usize = 64;
+
+/// Maximum number of blocks kept alive before the whole cache is dropped.
+const MAX_BLOCK_CNT: usize = 4096;
+
+/// Number of successors a block remembers, enough for both sides of a conditional branch.
+const LINK_CNT: usize = 2;
+
+/// Depth of the return-address stack.
+const RAS_DEPTH: usize = 16;
+
+pub(super) type ExecFn = fn(RVInstrInfo, &mut RVCPU) -> Result<(), Exception>;
+
+/// A decoded instruction with its execution function already resolved.
+#[derive(Clone, Copy)]
+pub(super) struct BlockInstr {
+    pub(super) instr: RiscvInstr,
+    pub(super) info: RVInstrInfo,
+    pub(super) exec: ExecFn,
+    pub(super) len: u8,
+}
+
+impl BlockInstr {
+    pub(super) fn new(instr: RiscvInstr, info: RVInstrInfo, len: WordType) -> Self {
+        Self {
+            instr,
+            info,
+            exec: get_exec_func(instr),
+            len: len as u8,
+        }
+    }
+}
+
+/// How a block is left, used to predict the next block.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BlockExit {
+    Plain,
+    /// Ends with a jump that writes the link register, pushes the return address.
+    Call,
+    /// Ends with an indirect jump through the link register, pops the return address.
+    Return,
+}
+
+/// `x1` and `x5` are the link registers by the calling convention.
+#[inline]
+fn is_link_reg(reg: u8) -> bool {
+    reg == 1 || reg == 5
+}
+
+impl BlockExit {
+    fn of(last: Option<&BlockInstr>) -> Self {
+        let Some(last) = last else {
+            return Self::Plain;
+        };
+
+        match (last.instr, last.info) {
+            (RiscvInstr::JAL, RVInstrInfo::J { rd, .. }) if is_link_reg(rd) => Self::Call,
+            (RiscvInstr::JALR, RVInstrInfo::I { rd, .. }) if is_link_reg(rd) => Self::Call,
+            (RiscvInstr::JALR, RVInstrInfo::I { rs1, .. }) if is_link_reg(rs1) => Self::Return,
+            (RiscvInstr::C_JAL | RiscvInstr::C_JALR, _) => Self::Call,
+            (RiscvInstr::C_JR, RVInstrInfo::CR { rd_rs1, .. }) if is_link_reg(rd_rs1) => {
+                Self::Return
+            }
+            _ => Self::Plain,
+        }
+    }
+}
+
+/// A direct link to a successor block, valid only while the epoch matches.
+#[derive(Clone, Copy)]
+struct BlockLink {
+    pc: WordType,
+    epoch: u32,
+    block: BlockId,
+}
+
+/// A straight-line run of instructions, executed back to back.
+///
+/// An empty block marks a pc whose first instruction must go through [`RVCPU::step`],
+/// so we don't try to translate it again on every visit.
+///
+/// A block never changes once translated, what the cache learns about it is kept in its
+/// [`BlockSlot`], so that it is sent along with its hart to another thread.
+pub(super) struct BasicBlock {
+    pub(super) instrs: Box<[BlockInstr]>,
+    start_pc: WordType,
+    /// Physical address of the first instruction, the whole block is in its page.
+    phys_pc: WordType,
+    /// Address right after the last instruction, where a call returns to.
+    end_pc: WordType,
+    exit: BlockExit,
+    /// Its slot in the arena of the cache, as long as the cache is not cleared.
+    id: BlockId,
+
+    hot: HotCounter,
+}
+
+pub(super) type BlockRef = Arc<BasicBlock>;
+
+impl BasicBlock {
+    fn new(
+        instrs: Vec<BlockInstr>,
+        start_pc: WordType,
+        phys_pc: WordType,
+        end_pc: WordType,
+        id: BlockId,
+    ) -> Self {
+        Self {
+            exit: BlockExit::of(instrs.last()),
+            instrs: instrs.into_boxed_slice(),
+            start_pc,
+            phys_pc,
+            end_pc,
+            id,
+
+            hot: HotCounter::new(),
+        }
+    }
+
+    /// Count one run of the block, returns its pre-decoded ops once it is hot.
+    #[inline]
+    pub(super) fn decoded(&self) -> Option<&DecodedBlock> {
+        self.hot
+            .decoded_for(self.start_pc, self.end_pc, &self.instrs)
+    }
+
+    /// Count one run of the block, returns its compiled code once it is hot.
+    #[cfg(feature = "jit")]
+    #[inline]
+    pub(super) fn compiled(&self) -> Option<&jit::CompiledBlock> {
+        self.hot
+            .compiled_for(self.start_pc, self.end_pc, &self.instrs)
+    }
+}
+
+/// A block in the arena of the cache, with its links to the blocks seen to follow it.
+struct BlockSlot {
+    block: BlockRef,
+    /// Cleared once its page is written, a running block still finishes.
+    valid: bool,
+    links: [Option<BlockLink>; LINK_CNT],
+    next_link: usize,
+}
+
+impl BlockSlot {
+    fn new(block: BlockRef) -> Self {
+        Self {
+            block,
+            valid: true,
+            links: [None; LINK_CNT],
+            next_link: 0,
+        }
+    }
+
+    /// Whether the block is still the code at `phys_pc`.
+    #[inline]
+    fn is_at(&self, phys_pc: WordType) -> bool {
+        self.block.phys_pc == phys_pc && self.valid
+    }
+
+    #[inline]
+    fn linked(&self, pc: WordType, epoch: u32) -> Option<BlockId> {
+        self.links.iter().find_map(|link| match link {
+            Some(link) if link.pc == pc && link.epoch == epoch => Some(link.block),
+            _ => None,
+        })
+    }
+
+    fn link(&mut self, pc: WordType, epoch: u32, block: BlockId) {
+        // Prefer a free or stale slot, otherwise replace the links in turn.
+        let idx = self
+            .links
+            .iter()
+            .position(|link| link.is_none_or(|link| link.epoch != epoch))
+            .unwrap_or_else(|| {
+                let idx = self.next_link;
+                self.next_link = (idx + 1) % LINK_CNT;
+                idx
+            });
+
+        self.links[idx] = Some(BlockLink { pc, epoch, block });
+    }
+}
+
+/// Return-address stack, predicts the block a `Return` block goes back to.
+///
+/// It keeps the calling block instead of the returned-to block,
+/// the latter is then found through the caller's links.
+struct ReturnStack {
+    entries: [Option<(WordType, BlockId)>; RAS_DEPTH],
+    top: usize,
+}
+
+impl ReturnStack {
+    fn new() -> Self {
+        Self {
+            entries: [None; RAS_DEPTH],
+            top: 0,
+        }
+    }
+
+    fn push(&mut self, ret_pc: WordType, caller: BlockId) {
+        // Overflow silently overwrites the oldest entry.
+        self.top = (self.top + 1) % RAS_DEPTH;
+        self.entries[self.top] = Some((ret_pc, caller));
+    }
+
+    /// Pop the top entry, returns the caller if it predicts a return to `pc`.
+    fn pop_for(&mut self, pc: WordType) -> Option<BlockId> {
+        let entry = self.entries[self.top].take();
+        self.top = (self.top + RAS_DEPTH - 1) % RAS_DEPTH;
+
+        entry
+            .filter(|(ret_pc, _)| *ret_pc == pc)
+            .map(|(_, caller)| caller)
+    }
+
+    fn clear(&mut self) {
+        self.entries = [None; RAS_DEPTH];
+    }
+}
+
+/// How an instruction takes part in a translated block.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(super) enum BlockRole {
+    /// Falls through to the next instruction, the block goes on.
+    Straight,
+    /// May redirect the pc, the block ends after it.
+    Terminator,
+    /// Touches CSRs, privilege or translation state, never put in a block.
+    Standalone,
+}
+
+pub(super) fn block_role(instr: RiscvInstr) -> BlockRole {
+    match instr {
+        RiscvInstr::BEQ
+        | RiscvInstr::BNE
+        | RiscvInstr::BLT
+        | RiscvInstr::BGE
+        | RiscvInstr::BLTU
+        | RiscvInstr::BGEU
+        | RiscvInstr::JAL
+        | RiscvInstr::JALR
+        | RiscvInstr::C_BEQZ
+        | RiscvInstr::C_BNEZ
+        | RiscvInstr::C_J
+        | RiscvInstr::C_JAL
+        | RiscvInstr::C_JR
+        | RiscvInstr::C_JALR => BlockRole::Terminator,
+
+        RiscvInstr::CSRRW
+        | RiscvInstr::CSRRS
+        | RiscvInstr::CSRRC
+        | RiscvInstr::CSRRWI
+        | RiscvInstr::CSRRSI
+        | RiscvInstr::CSRRCI
+        | RiscvInstr::ECALL
+        | RiscvInstr::EBREAK
+        | RiscvInstr::C_EBREAK
+        | RiscvInstr::MRET
+        | RiscvInstr::SRET
+        | RiscvInstr::WFI
+        | RiscvInstr::FENCE_I
+        | RiscvInstr::SFENCE_VMA
+        | RiscvInstr::ILLEGAL => BlockRole::Standalone,
+
+        #[cfg(feature = "custom-instr")]
+        RiscvInstr::MY_INSTR0_R | RiscvInstr::MY_INSTR1_DISPLAY => BlockRole::Standalone,
+
+        _ => BlockRole::Straight,
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct BlockId(u32);
+
+impl Cacheable for BlockId {
+    const ADDR_SHIFT_BITS: usize = 1;
+}
+
+/// Translated blocks, indexed by the virtual address of their first instruction.
+///
+/// Blocks live in an arena and the [`SetCache`] only keeps their indices,
+/// so an evicted block stays in the arena until the next [`BlockCache::clear`].
+///
+/// Every block also remembers the physical address it was translated from,
+/// a block is only used if the pc still translates there, whatever the address space,
+/// and it is dropped by [`BlockCache::invalidate_page`] once its page is written.
+///
+/// A block links to the blocks it was seen to be followed by,
+/// so hot loops and call/return pairs don't probe the [`SetCache`] at all.
+/// Links are checked against the target pc, a wrong prediction only costs a normal lookup.
+pub(super) struct BlockCache {
+    index: SetCache<BlockId, 256, 8>,
+    slots: Vec<BlockSlot>,
+
+    /// Bumped by [`BlockCache::unlink`], links from an older epoch are ignored.
+    epoch: u32,
+    /// The block that has just been run, its links are tried first.
+    last: Option<BlockId>,
+    /// The block to link from if the lookup at this pc misses and a new block gets translated.
+    link_from: Option<(WordType, BlockId)>,
+    ras: ReturnStack,
+}
+
+impl BlockCache {
+    pub(super) fn new() -> Self {
+        Self {
+            index: SetCache::new(),
+            slots: Vec::new(),
+            epoch: 0,
+            last: None,
+            link_from: None,
+            ras: ReturnStack::new(),
+        }
+    }
+
+    #[inline]
+    fn slot(&self, BlockId(id): BlockId) -> &BlockSlot {
+        &self.slots[id as usize]
+    }
+
+    /// The slot of `block`, `None` if the cache was cleared since it was translated.
+    #[inline]
+    fn id_of(&self, block: &BlockRef) -> Option<BlockId> {
+        self.slots
+            .get(block.id.0 as usize)
+            .is_some_and(|slot| Arc::ptr_eq(&slot.block, block))
+            .then_some(block.id)
+    }
+
+    /// Find the block at `pc`, which translates to `phys_pc`,
+    /// following the links of the last run block when possible.
+    #[inline]
+    pub(super) fn get(&mut self, pc: WordType, phys_pc: WordType) -> Option<BlockRef> {
+        self.link_from = None;
+
+        let from = self
+            .last
+            .take()
+            .map(|last| match self.slot(last).block.exit {
+                BlockExit::Return => self.ras.pop_for(pc).unwrap_or(last),
+                _ => last,
+            });
+
+        if let Some(from) = from {
+            if let Some(block) = self.slot(from).linked(pc, self.epoch) {
+                let slot = self.slot(block);
+                if slot.is_at(phys_pc) {
+                    return Some(slot.block.clone());
+                }
+            }
+        }
+
+        let block = self
+            .index
+            .get(pc)
+            .filter(|&block| self.slot(block).is_at(phys_pc));
+
+        match (from, block) {
+            (Some(from), Some(block)) => self.slots[from.0 as usize].link(pc, self.epoch, block),
+            (Some(from), None) => self.link_from = Some((pc, from)),
+            (None, _) => {}
+        }
+
+        block.map(|block| self.slot(block).block.clone())
+    }
+
+    pub(super) fn insert(
+        &mut self,
+        pc: WordType,
+        phys_pc: WordType,
+        end_pc: WordType,
+        instrs: Vec<BlockInstr>,
+    ) -> BlockRef {
+        if self.slots.len() >= MAX_BLOCK_CNT {
+            self.clear();
+        }
+
+        let id = BlockId(self.slots.len() as u32);
+        let block = Arc::new(BasicBlock::new(instrs, pc, phys_pc, end_pc, id));
+        // The pc may be indexed already, by a block of another address space or a written page.
+        self.index.invalidate(pc);
+        self.index.put(pc, id);
+        self.slots.push(BlockSlot::new(block.clone()));
+
+        if let Some((from_pc, from)) = self.link_from.take() {
+            if from_pc == pc {
+                self.slots[from.0 as usize].link(pc, self.epoch, id);
+            }
+        }
+
+        block
+    }
+
+    /// Record that `block` has been run to its end.
+    #[inline]
+    pub(super) fn enter(&mut self, block: BlockRef) {
+        // A block dropped by a clear while it ran starts no chain.
+        self.last = self.id_of(&block);
+        if let Some(id) = self.last {
+            if block.exit == BlockExit::Call {
+                self.ras.push(block.end_pc, id);
+            }
+        }
+    }
+
+    /// Forget the last run block, e.g. when a trap is taken in the middle of it.
+    #[inline]
+    pub(super) fn break_chain(&mut self) {
+        self.last = None;
+        self.link_from = None;
+    }
+
+    /// Cut all links between blocks and drop the return-address predictions,
+    /// but keep the translated blocks.
+    pub(super) fn unlink(&mut self) {
+        self.epoch = self.epoch.wrapping_add(1);
+        self.ras.clear();
+        self.break_chain();
+    }
+
+    /// Drop the blocks translated from the physical page at `page`.
+    pub(super) fn invalidate_page(&mut self, page: WordType, page_size: WordType) {
+        for slot in self.slots.iter_mut() {
+            if slot.valid && slot.block.phys_pc & !(page_size - 1) == page {
+                slot.valid = false;
+                self.index.invalidate(slot.block.start_pc);
+            }
+        }
+    }
+
+    /// Counters of the pc index, lookups served by a link are not counted.
+    pub(super) fn index_stats(&self) -> CacheStats {
+        self.index.stats()
+    }
+
+    pub(super) fn clear(&mut self) {
+        self.index.clear();
+        self.slots.clear();
+        self.unlink();
+    }
+
+    /// The block `block` is linked to at `pc`.
+    #[cfg(test)]
+    fn linked(&self, block: &BlockRef, pc: WordType) -> Option<BlockRef> {
+        let id = self.id_of(block)?;
+        let linked = self.slot(id).linked(pc, self.epoch)?;
+        Some(self.slot(linked).block.clone())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn nop() -> BlockInstr {
+        BlockInstr::new(
+            RiscvInstr::ADDI,
+            RVInstrInfo::I {
+                rd: 0,
+                rs1: 0,
+                imm: 0,
+            },
+            4,
+        )
+    }
+
+    #[test]
+    fn test_block_role() {
+        assert_eq!(block_role(RiscvInstr::ADDI), BlockRole::Straight);
+        assert_eq!(block_role(RiscvInstr::LD), BlockRole::Straight);
+        assert_eq!(block_role(RiscvInstr::BNE), BlockRole::Terminator);
+        assert_eq!(block_role(RiscvInstr::C_JR), BlockRole::Terminator);
+        assert_eq!(block_role(RiscvInstr::CSRRW), BlockRole::Standalone);
+        assert_eq!(block_role(RiscvInstr::SFENCE_VMA), BlockRole::Standalone);
+    }
+
+    #[test]
+    fn test_block_cache() {
+        let mut cache = BlockCache::new();
+        assert!(cache.get(0x8000_0000, 0x8000_0000).is_none());
+
+        cache.insert(0x8000_0000, 0x8000_0000, 0x8000_0008, vec![nop(), nop()]);
+        cache.insert(0x8000_0010, 0x8000_0010, 0x8000_0010, vec![]);
+        assert_eq!(cache.get(0x8000_0000, 0x8000_0000).unwrap().instrs.len(), 2);
+        assert_eq!(cache.get(0x8000_0010, 0x8000_0010).unwrap().instrs.len(), 0);
+
+        // A block being executed must survive a flush.
+        let running = cache.get(0x8000_0000, 0x8000_0000).unwrap();
+        cache.clear();
+        assert!(cache.get(0x8000_0000, 0x8000_0000).is_none());
+        assert_eq!(running.instrs.len(), 2);
+    }
+
+    #[test]
+    fn test_block_phys_tag() {
+        let mut cache = BlockCache::new();
+        cache.insert(0x1000, 0x8000_0000, 0x1008, vec![nop(), nop()]);
+
+        // The same pc in another address space.
+        assert!(cache.get(0x1000, 0x8000_2000).is_none());
+        assert!(cache.get(0x1000, 0x8000_0000).is_some());
+
+        cache.invalidate_page(0x8000_1000, 0x1000);
+        assert!(cache.get(0x1000, 0x8000_0000).is_some());
+        cache.invalidate_page(0x8000_0000, 0x1000);
+        assert!(cache.get(0x1000, 0x8000_0000).is_none());
+    }
+
+    #[test]
+    fn test_block_link() {
+        let mut cache = BlockCache::new();
+        let a = cache.insert(0x8000_0000, 0x8000_0000, 0x8000_0008, vec![nop(), nop()]);
+        let b = cache.insert(0x8000_0100, 0x8000_0100, 0x8000_0104, vec![nop()]);
+
+        // The first transition from `a` to `b` goes through the index and creates the link.
+        cache.enter(a.clone());
+        assert!(Arc::ptr_eq(
+            &cache.get(0x8000_0100, 0x8000_0100).unwrap(),
+            &b
+        ));
+        assert!(Arc::ptr_eq(&cache.linked(&a, 0x8000_0100).unwrap(), &b));
+        assert!(cache.linked(&a, 0x8000_0200).is_none());
+
+        // Links are cut without dropping the blocks.
+        cache.unlink();
+        assert!(cache.linked(&a, 0x8000_0100).is_none());
+        assert!(Arc::ptr_eq(
+            &cache.get(0x8000_0100, 0x8000_0100).unwrap(),
+            &b
+        ));
+    }
+
+    #[test]
+    fn test_return_stack() {
+        let jal_ra = BlockInstr::new(RiscvInstr::JAL, RVInstrInfo::J { rd: 1, imm: 0x100 }, 4);
+        let ret = BlockInstr::new(
+            RiscvInstr::JALR,
+            RVInstrInfo::I {
+                rd: 0,
+                rs1: 1,
+                imm: 0,
+            },
+            4,
+        );
+
+        let mut cache = BlockCache::new();
+        let caller = cache.insert(0x8000_0000, 0x8000_0000, 0x8000_0004, vec![jal_ra]);
+        let callee = cache.insert(0x8000_0100, 0x8000_0100, 0x8000_0104, vec![ret]);
+        let ret_site = cache.insert(0x8000_0004, 0x8000_0004, 0x8000_0008, vec![nop()]);
+        assert_eq!(caller.exit, BlockExit::Call);
+        assert_eq!(callee.exit, BlockExit::Return);
+
+        cache.enter(caller.clone());
+        cache.get(0x8000_0100, 0x8000_0100).unwrap();
+        cache.enter(callee.clone());
+        cache.get(0x8000_0004, 0x8000_0004).unwrap();
+
+        // The return site is linked to the caller rather than to the callee.
+        assert!(Arc::ptr_eq(
+            &cache.linked(&caller, 0x8000_0004).unwrap(),
+            &ret_site
+        ));
+        assert!(cache.linked(&callee, 0x8000_0004).is_none());
+    }
+}
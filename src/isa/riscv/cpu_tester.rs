@@ -1,5 +1,5 @@
 #![cfg(test)]
-use std::{cell::UnsafeCell, fmt::Debug, rc::Rc};
+use std::{fmt::Debug, sync::Arc};
 
 use rand::{Rng, SeedableRng};
 use rand_chacha::ChaCha12Rng;
@@ -30,7 +30,7 @@ pub(super) struct TestCPUBuilder {
 impl TestCPUBuilder {
     /// Build a RISC-V CPU, only has RAM, don't have other devices.
     pub(super) fn new() -> Self {
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
         cpu.csr.get_by_type_existing::<Mstatus>().set_fs(1); // Enable FPU by default for convienience
@@ -221,6 +221,7 @@ impl<'a> CPUChecker<'a> {
     }
 
     pub(super) fn csr(self, addr: WordType, value: WordType) -> Self {
+        self.cpu.sync_counters();
         assert_eq!(
             self.cpu.csr.read_uncheck_privilege(addr).unwrap(),
             value,
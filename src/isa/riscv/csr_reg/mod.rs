@@ -11,7 +11,10 @@ use self::{
     read_validator::ReadValidator,
     write_validator::WriteValidator,
 };
-use crate::config::arch_config::WordType;
+use crate::{
+    config::arch_config::WordType,
+    snapshot::{Snapshot, SnapshotError, StateReader, StateWriter},
+};
 use std::cmp::Ordering;
 
 /// Constants in this module are not complete. Use `get_index` static method for each CSR type, like [`Mstatus::get_index`].
@@ -466,6 +469,41 @@ impl CsrRegFile {
     }
 }
 
+/// The value of every CSR implemented, the context comes from the ISA of the board.
+impl Snapshot for CsrRegFile {
+    fn save(&self, out: &mut StateWriter) {
+        out.write_u8(self.cpl as u8);
+        let regs: Vec<(usize, &CsrReg)> = self
+            .table
+            .iter()
+            .enumerate()
+            .filter_map(|(addr, reg)| reg.as_ref().map(|reg| (addr, reg)))
+            .collect();
+        out.write_u64(regs.len() as u64);
+        for (addr, reg) in regs {
+            out.write_u16(addr as u16);
+            out.write_u64(reg.value() as u64);
+        }
+    }
+
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        self.cpl =
+            PrivilegeLevel::try_from(state.read_u8()?).map_err(|_| SnapshotError::BadFormat)?;
+        let cnt = state.read_u64()?;
+        for _ in 0..cnt {
+            let addr = state.read_u16()? as WordType;
+            let value = state.read_u64()? as WordType;
+            if !self.write_directly(addr, value) {
+                return Err(SnapshotError::Mismatch(format!(
+                    "CSR {:#x} is not implemented",
+                    addr
+                )));
+            }
+        }
+        Ok(())
+    }
+}
+
 #[cfg(test)]
 mod test {
     use crate::isa::riscv::csr_reg::{
@@ -8,7 +8,7 @@ use crate::{
 
 impl Minstret {
     pub fn wrapping_add(&self, rhs: WordType) {
-        let v = self.get_minstret() + rhs;
+        let v = self.get_minstret().wrapping_add(rhs);
         self.set_minstret(v);
     }
 }
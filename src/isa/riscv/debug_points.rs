@@ -0,0 +1,262 @@
+//! Breakpoints and watchpoints checked by the hart itself, so that a debugged run goes through
+//! the translated blocks instead of stepping every instruction.
+//!
+//! Both are filtered per page first. A breakpoint is only looked at on block entry: blocks never
+//! cross a page, so the code of the pages without breakpoints runs as usual, and the pages with
+//! one are stepped an instruction at a time. Watched pages are kept out of the host TLB, so only
+//! their accesses take the slow path, where the watchpoints are checked.
+
+use std::collections::HashSet;
+
+use crate::{config::arch_config::WordType, isa::riscv::mmu::config::PAGE_SIZE_XLEN};
+
+fn page_of(addr: u64) -> u64 {
+    addr >> PAGE_SIZE_XLEN
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum WatchKind {
+    Write,
+    Read,
+    ReadWrite,
+}
+
+impl WatchKind {
+    fn matches(self, read: bool, write: bool) -> bool {
+        match self {
+            WatchKind::Write => write,
+            WatchKind::Read => read,
+            WatchKind::ReadWrite => read || write,
+        }
+    }
+}
+
+/// Why the hart stopped running on its own.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DebugStop {
+    /// The pc reached a breakpoint, the instruction there is not run yet.
+    Breakpoint,
+    /// An access to `addr` hit a watchpoint of `kind`, the instruction accessing it has retired.
+    Watchpoint { kind: WatchKind, addr: WordType },
+}
+
+/// The breakpoints of a hart, by virtual pc and by physical address.
+#[derive(Default)]
+pub(crate) struct Breakpoints {
+    virt: HashSet<WordType>,
+    phys: HashSet<u64>,
+    virt_pages: HashSet<u64>,
+    phys_pages: HashSet<u64>,
+    /// The pc the hart resumes at, its breakpoint is run over once.
+    resume_pc: Option<WordType>,
+    hit: bool,
+}
+
+/// What to do with the block at the pc.
+pub(crate) enum BlockCheck {
+    /// No breakpoint in its page, run it.
+    Run,
+    /// A breakpoint in its page, step the instruction at the pc only.
+    Step,
+    /// At a breakpoint, stop.
+    Stop,
+}
+
+impl Breakpoints {
+    /// Replace the breakpoints with `virt` and `phys`.
+    pub(crate) fn set(
+        &mut self,
+        virt: impl IntoIterator<Item = WordType>,
+        phys: impl IntoIterator<Item = u64>,
+    ) {
+        self.virt = virt.into_iter().collect();
+        self.phys = phys.into_iter().collect();
+        self.virt_pages = self.virt.iter().map(|&pc| page_of(pc as u64)).collect();
+        self.phys_pages = self.phys.iter().map(|&paddr| page_of(paddr)).collect();
+    }
+
+    #[inline(always)]
+    pub(crate) fn is_empty(&self) -> bool {
+        self.virt.is_empty() && self.phys.is_empty()
+    }
+
+    pub(crate) fn resume_at(&mut self, pc: WordType) {
+        self.resume_pc = Some(pc);
+    }
+
+    /// Check the block at `pc`, whose physical address is `paddr` if it can be fetched.
+    pub(crate) fn check(&mut self, pc: WordType, paddr: Option<u64>) -> BlockCheck {
+        // Run over the breakpoint resumed at only if it's the first block, an interrupt taken in
+        // between may come back to it.
+        let resuming = self.resume_pc.take() == Some(pc);
+
+        let in_page = self.virt_pages.contains(&page_of(pc as u64))
+            || paddr.is_some_and(|paddr| self.phys_pages.contains(&page_of(paddr)));
+        if !in_page {
+            return BlockCheck::Run;
+        }
+
+        if self.contains(pc, paddr) && !resuming {
+            self.hit = true;
+            BlockCheck::Stop
+        } else {
+            BlockCheck::Step
+        }
+    }
+
+    pub(crate) fn contains(&self, pc: WordType, paddr: Option<u64>) -> bool {
+        self.virt.contains(&pc) || paddr.is_some_and(|paddr| self.phys.contains(&paddr))
+    }
+
+    #[inline(always)]
+    pub(crate) fn hit(&self) -> bool {
+        self.hit
+    }
+
+    pub(crate) fn take_hit(&mut self) -> bool {
+        std::mem::take(&mut self.hit)
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+struct Watchpoint {
+    addr: WordType,
+    len: WordType,
+    kind: WatchKind,
+}
+
+/// The watchpoints of a hart, by virtual address.
+#[derive(Default)]
+pub(crate) struct Watchpoints {
+    points: Vec<Watchpoint>,
+    pages: HashSet<u64>,
+    hit: Option<DebugStop>,
+}
+
+impl Watchpoints {
+    /// Returns true if the watchpoint is added, otherwise it already exists.
+    pub(crate) fn add(&mut self, addr: WordType, len: WordType, kind: WatchKind) -> bool {
+        let point = Watchpoint {
+            addr,
+            len: len.max(1),
+            kind,
+        };
+        if self.points.contains(&point) {
+            return false;
+        }
+        self.points.push(point);
+        self.collect_pages();
+        true
+    }
+
+    /// Returns true if the watchpoint is removed.
+    pub(crate) fn remove(&mut self, addr: WordType, len: WordType, kind: WatchKind) -> bool {
+        let original_len = self.points.len();
+        self.points
+            .retain(|p| (p.addr, p.len, p.kind) != (addr, len.max(1), kind));
+        self.collect_pages();
+        self.points.len() != original_len
+    }
+
+    fn collect_pages(&mut self) {
+        self.pages = self
+            .points
+            .iter()
+            .flat_map(|p| {
+                let first = page_of(p.addr as u64);
+                let last = page_of(p.addr.saturating_add(p.len - 1) as u64);
+                first..=last
+            })
+            .collect();
+    }
+
+    #[inline(always)]
+    pub(crate) fn is_empty(&self) -> bool {
+        self.points.is_empty()
+    }
+
+    /// Whether the page of `addr` is watched, it must bypass the host TLB then.
+    #[inline(always)]
+    pub(crate) fn watches_page(&self, addr: WordType) -> bool {
+        !self.pages.is_empty() && self.pages.contains(&page_of(addr as u64))
+    }
+
+    /// Record a hit if an access of `size` bytes at `addr` overlaps a watchpoint of its kind.
+    #[cold]
+    pub(crate) fn check(&mut self, addr: WordType, size: usize, read: bool, write: bool) {
+        let end = addr.saturating_add(size as WordType);
+        let hit = self.points.iter().find(|p| {
+            p.kind.matches(read, write) && addr < p.addr.saturating_add(p.len) && p.addr < end
+        });
+        if let Some(p) = hit
+            && self.hit.is_none()
+        {
+            self.hit = Some(DebugStop::Watchpoint { kind: p.kind, addr });
+        }
+    }
+
+    #[inline(always)]
+    pub(crate) fn hit(&self) -> bool {
+        self.hit.is_some()
+    }
+
+    pub(crate) fn take_hit(&mut self) -> Option<DebugStop> {
+        self.hit.take()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_breakpoint_check() {
+        let mut bps = Breakpoints::default();
+        bps.set([0x8000_0010], [0x8000_3000]);
+
+        assert!(matches!(bps.check(0x8000_1000, None), BlockCheck::Run));
+        assert!(matches!(bps.check(0x8000_0000, None), BlockCheck::Step));
+        assert!(!bps.hit());
+        assert!(matches!(bps.check(0x8000_0010, None), BlockCheck::Stop));
+        assert!(bps.take_hit());
+
+        // By physical address, whatever the pc.
+        assert!(matches!(
+            bps.check(0x1000, Some(0x8000_3000)),
+            BlockCheck::Stop
+        ));
+        assert!(bps.take_hit());
+
+        // Run over once when resumed at.
+        bps.resume_at(0x8000_0010);
+        assert!(matches!(bps.check(0x8000_0010, None), BlockCheck::Step));
+        assert!(matches!(bps.check(0x8000_0010, None), BlockCheck::Stop));
+    }
+
+    #[test]
+    fn test_watchpoint_check() {
+        let mut wps = Watchpoints::default();
+        assert!(!wps.watches_page(0x8000_0000));
+
+        assert!(wps.add(0x8000_0ffc, 8, WatchKind::Write));
+        assert!(!wps.add(0x8000_0ffc, 8, WatchKind::Write));
+        assert!(wps.watches_page(0x8000_0000) && wps.watches_page(0x8000_1000));
+        assert!(!wps.watches_page(0x8000_2000));
+
+        wps.check(0x8000_0ff8, 4, true, false);
+        wps.check(0x8000_0ff8, 4, false, true);
+        assert!(!wps.hit());
+
+        wps.check(0x8000_1000, 1, true, true);
+        assert_eq!(
+            wps.take_hit(),
+            Some(DebugStop::Watchpoint {
+                kind: WatchKind::Write,
+                addr: 0x8000_1000
+            })
+        );
+
+        assert!(wps.remove(0x8000_0ffc, 8, WatchKind::Write));
+        assert!(wps.is_empty() && !wps.watches_page(0x8000_0000));
+    }
+}
@@ -2,6 +2,7 @@ use std::{
     collections::{BTreeMap, VecDeque},
     fmt::Debug,
     ops::Add,
+    path::Path,
     u64,
 };
 
@@ -14,6 +15,7 @@ use crate::{
         riscv::{
             RawInstr, RiscvTypes,
             csr_reg::{NamedCsrReg, PrivilegeLevel, csr_macro::Mcycle},
+            debug_points::{DebugStop, WatchKind},
             decoder::DecodeInstr,
             executor::{ExcuteInstrInfo, RVCPU},
             instruction::{RVInstrInfo, instr_table::RiscvInstr},
@@ -22,6 +24,8 @@ use crate::{
         },
     },
     load::SymTab,
+    snapshot::SnapshotError,
+    stats::StatsReport,
     utils::UnsignedInteger,
 };
 
@@ -29,9 +33,19 @@ use crate::{
 pub enum DebugEvent {
     StepCompleted,
     BreakpointHit,
+    WatchpointHit { kind: WatchKind, addr: WordType },
     BoardHalted,
 }
 
+impl From<DebugStop> for DebugEvent {
+    fn from(stop: DebugStop) -> Self {
+        match stop {
+            DebugStop::Breakpoint => DebugEvent::BreakpointHit,
+            DebugStop::Watchpoint { kind, addr } => DebugEvent::WatchpointHit { kind, addr },
+        }
+    }
+}
+
 #[derive(thiserror::Error, Debug)]
 pub enum DebugError {
     #[error("target exception: {0:?}")]
@@ -48,6 +62,9 @@ pub enum DebugError {
 
     #[error("symbol table not available")]
     NoSymbolTable,
+
+    #[error("{0}")]
+    Snapshot(#[from] SnapshotError),
 }
 
 impl From<MemError> for DebugError {
@@ -130,6 +147,8 @@ impl DebugTarget<RiscvTypes> for RVCPU {
     ///     None => `Read Only`,
     /// }
     fn debug_csr(&mut self, addr: WordType, new_value: Option<WordType>) -> Option<WordType> {
+        self.sync_counters();
+        self.sync_irq_pins();
         self.csr.debug(addr, new_value)
     }
 
@@ -480,6 +499,7 @@ impl<'a, B: Board> Debugger<'a, B> {
             addr,
         };
         self.breakpoints.push(breakpoint);
+        self.sync_breakpoints();
 
         Ok(true)
     }
@@ -488,20 +508,52 @@ impl<'a, B: Board> Debugger<'a, B> {
     pub fn clear_breakpoint(&mut self, addr: Address) -> Result<bool, DebugError> {
         let original_len = self.breakpoints.len();
         self.breakpoints.retain(|bp| bp.addr != addr);
+        self.sync_breakpoints();
         Ok(self.breakpoints.len() != original_len)
     }
 
+    /// Hand the breakpoints to the hart, which checks them itself, see [`debug_points`].
+    ///
+    /// [`debug_points`]: crate::isa::riscv::debug_points
+    fn sync_breakpoints(&mut self) {
+        let virt = self.breakpoints.iter().filter_map(|bp| match bp.addr {
+            Address::Virt(vaddr) => Some(vaddr),
+            Address::Phys(_) => None,
+        });
+        let phys = self.breakpoints.iter().filter_map(|bp| match bp.addr {
+            Address::Phys(paddr) => Some(paddr),
+            Address::Virt(_) => None,
+        });
+        self.board.cpu_mut().breakpoints.set(virt, phys);
+    }
+
+    /// Whether the pc is at a breakpoint, a virtual one by its address or a physical one by the
+    /// address the pc translates to.
     pub fn on_breakpoint(&mut self) -> bool {
-        let pc = self.read_pc();
-        if let Ok(pc_paddr) = self.board.cpu_mut().debug_vaddr_to_paddr(pc) {
-            // TOOD: Totally useless clone to bypass the borrow checker, because `unify_to_phys_addr` needs a mutable reference now
-            self.breakpoints
-                .clone()
-                .iter()
-                .find(|bp| self.unify_to_phys_addr(bp.addr) == Some(pc_paddr))
-                .is_some()
-        } else {
-            false
+        let cpu = self.board.cpu_mut();
+        let pc = cpu.read_pc();
+        let paddr = cpu.debug_vaddr_to_paddr(pc).ok();
+        cpu.breakpoints.contains(pc, paddr)
+    }
+
+    /// Returns true if a new watchpoint is added on the `len` bytes from the virtual `addr`.
+    pub fn set_watchpoint(&mut self, addr: WordType, len: WordType, kind: WatchKind) -> bool {
+        self.board.cpu_mut().memory.add_watchpoint(addr, len, kind)
+    }
+
+    /// Returns true if the watchpoint is removed.
+    pub fn clear_watchpoint(&mut self, addr: WordType, len: WordType, kind: WatchKind) -> bool {
+        self.board
+            .cpu_mut()
+            .memory
+            .remove_watchpoint(addr, len, kind)
+    }
+
+    /// The event stopping a run after a step, if any.
+    fn stop_event(&mut self) -> Option<DebugEvent> {
+        match self.board.cpu_mut().take_debug_stop() {
+            Some(stop) => Some(stop.into()),
+            None => self.on_breakpoint().then_some(DebugEvent::BreakpointHit),
         }
     }
 
@@ -509,6 +561,25 @@ impl<'a, B: Board> Debugger<'a, B> {
         self.continue_until_step(1).map(|(event, _steps)| event)
     }
 
+    /// The statistics counters of the board, see [`Board::stats`].
+    pub fn stats(&self) -> Option<StatsReport> {
+        self.board.stats()
+    }
+
+    pub fn save_snapshot(&mut self, path: &Path) -> Result<(), DebugError> {
+        Ok(self.board.save_snapshot_file(path)?)
+    }
+
+    /// The PC history and the function trace are of the run before, they are cleared.
+    pub fn restore_snapshot(&mut self, path: &Path) -> Result<(), DebugError> {
+        self.board.restore_snapshot_file(path)?;
+        self.board.cpu_mut().debug = true;
+        self.history.clear();
+        self.ftrace.queue.clear();
+        self.ftrace.stats.clear();
+        Ok(())
+    }
+
     fn cpu_step_internal(&mut self) -> Result<(), DebugError> {
         self.push_history();
 
@@ -542,12 +613,50 @@ impl<'a, B: Board> Debugger<'a, B> {
 
             self.cpu_step_internal()?;
 
-            if self.on_breakpoint() {
-                return Ok(Some(DebugEvent::BreakpointHit));
+            if let Some(event) = self.stop_event() {
+                return Ok(Some(event));
             }
         }
     }
 
+    /// Same as [`Self::continue_until`], but the board runs at full speed, see
+    /// [`Board::run_until_stop`], and `cond` is checked every `poll_cycles` cycles or so.
+    ///
+    /// The hart checks the breakpoints and the watchpoints itself, the PC history and the
+    /// function trace are not recorded.
+    pub fn continue_fast(
+        &mut self,
+        poll_cycles: u64,
+        mut cond: impl FnMut(&mut Self) -> bool,
+    ) -> Result<Option<DebugEvent>, DebugError> {
+        // Like a step, run over the breakpoint at the pc.
+        let cpu = self.board.cpu_mut();
+        let pc = cpu.read_pc();
+        cpu.breakpoints.resume_at(pc);
+        cpu.debug = false;
+
+        let rst = loop {
+            if self.board.status() == crate::board::BoardStatus::Halt {
+                break Ok(Some(DebugEvent::BoardHalted));
+            }
+
+            if let Some(stop) = self.board.cpu_mut().take_debug_stop() {
+                break Ok(Some(stop.into()));
+            }
+
+            if cond(self) {
+                break Ok(None);
+            }
+
+            if let Err(e) = self.board.run_until_stop(poll_cycles) {
+                break Err(DebugError::TargetException(e));
+            }
+        };
+
+        self.board.cpu_mut().debug = true;
+        rst
+    }
+
     /// Continue running until a breakpoint is hit, `max_steps` steps are executed or the board is halted.
     /// Returns the event that caused the stop and the actual steps executed.
     pub fn continue_until_step(&mut self, max_steps: u64) -> Result<(DebugEvent, u64), DebugError> {
@@ -566,8 +675,8 @@ impl<'a, B: Board> Debugger<'a, B> {
 
             remain -= 1;
 
-            if self.on_breakpoint() {
-                return Ok((DebugEvent::BreakpointHit, max_steps - remain));
+            if let Some(event) = self.stop_event() {
+                return Ok((event, max_steps - remain));
             }
         }
     }
@@ -673,11 +782,9 @@ impl<'a, B: Board> Debugger<'a, B> {
     }
 
     pub fn cycle(&mut self) -> WordType {
-        self.board
-            .cpu_mut()
-            .csr
-            .get_by_type_existing::<Mcycle>()
-            .data()
+        let cpu = self.board.cpu_mut();
+        cpu.sync_counters();
+        cpu.csr.get_by_type_existing::<Mcycle>().data()
     }
 }
 
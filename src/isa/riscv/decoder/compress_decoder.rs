@@ -1,25 +1,25 @@
 use crate::{
     config::arch_config::WordType,
     debug_unreachable,
-    isa::{
-        riscv::{
-            RawInstr,
-            decoder::DecodeInstr,
-            instruction::{
-                InstrFormat, RVInstrInfo,
-                instr_table::{
-                    RVInstrDesc,
-                    RiscvInstr::{self, *},
-                },
+    isa::riscv::{
+        RawInstr,
+        decoder::{DecodeInstr, submasks},
+        instruction::{
+            InstrFormat, RVInstrInfo,
+            instr_table::{
+                RVInstrDesc,
+                RiscvInstr::{self, *},
             },
         },
-        utils::DecodeMask,
     },
     utils::UnsignedInteger,
 };
 
+/// Decoder of the 16 bit instructions, in one lookup of a table with every halfword.
 pub(super) struct CompressedDecoder {
-    masks: Vec<(DecodeMask, RiscvInstr, InstrFormat)>,
+    /// Index + 1 into `instrs` of every halfword, `0` if it is no instruction.
+    table: Box<[u8]>,
+    instrs: Vec<(RiscvInstr, InstrFormat)>,
 }
 
 macro_rules! extract_field {
@@ -169,37 +169,42 @@ fn decode_compressed_info(raw: u32, instr: RiscvInstr, fmt: InstrFormat) -> RVIn
 
 impl CompressedDecoder {
     pub fn decode(&self, raw: RawInstr) -> Option<DecodeInstr> {
-        for (mask, instr, fmt) in self.masks.iter() {
-            if mask.matches(raw.val) {
-                return Some(DecodeInstr {
-                    instr: *instr,
-                    info: decode_compressed_info(raw.val, *instr, *fmt),
-                    len: 2,
-                });
-            }
+        let idx = self.table[raw.val as u16 as usize];
+        if idx == 0 {
+            return None;
         }
+        let (instr, fmt) = self.instrs[idx as usize - 1];
 
-        None
+        Some(DecodeInstr {
+            instr,
+            info: decode_compressed_info(raw.val, instr, fmt),
+            len: 2,
+        })
     }
 
     pub fn from_isa(instrs: impl Iterator<Item = RVInstrDesc>) -> Self {
-        let mut masks = vec![];
-        for desc in instrs {
-            masks.push((
-                DecodeMask {
-                    mask: desc.mask,
-                    key: desc.key,
-                },
-                desc.instr,
-                desc.format,
-            ));
-        }
-
+        let mut descs: Vec<RVInstrDesc> = instrs.collect();
         // sort by desending popcount(mask), so that overlapped mask can work fine.
-        masks.sort_by_key(|(mask, _, _)| mask.mask.count_zeros());
+        descs.sort_by_key(|desc| desc.mask.count_zeros());
+
+        let mut table = vec![0u8; 1 << 16].into_boxed_slice();
+        let mut table_instrs = Vec::with_capacity(descs.len());
+        for desc in descs.iter() {
+            table_instrs.push((desc.instr, desc.format));
+            let idx = u8::try_from(table_instrs.len()).expect("too many compressed instructions");
+            for bits in submasks(!desc.mask & 0xffff) {
+                let entry = &mut table[(desc.key | bits) as usize];
+                if *entry == 0 {
+                    *entry = idx;
+                }
+            }
+        }
 
-        log::info!("Compressed decoder loads {} instructions", masks.len());
+        log::info!("Compressed decoder loads {} instructions", descs.len());
 
-        Self { masks }
+        Self {
+            table,
+            instrs: table_instrs,
+        }
     }
 }
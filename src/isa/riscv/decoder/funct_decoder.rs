@@ -1,301 +1,168 @@
-use std::hint::likely;
-
-use smallvec::SmallVec;
-
 use crate::isa::{
     InstrLen,
     riscv::{
         RawInstr,
-        decoder::{DecodeInstr, decode_info},
+        decoder::{DecodeInstr, decode_info, submasks},
         instruction::{
+            InstrFormat,
             instr_table::{RVInstrDesc, RiscvInstr},
-            *,
         },
     },
 };
 
-#[derive(Debug, Clone)]
-enum PartialDecode {
-    Unknown,
-    Complete,
-    RequireF3,
-    RequireF7,
+/// Opcode (bits 6:0) and funct3 (bits 14:12), which index the first table.
+const SLOT_FIELDS: u32 = 0x0000_707f;
+const SLOT_CNT: usize = 1 << 10;
+/// Bits 31:25, which index the row of a slot.
+const FUNCT7_FIELD: u32 = 0xfe00_0000;
+const FUNCT7_CNT: usize = 1 << 7;
+/// `lumop` and `sumop` (bits 24:20) of the unit-stride vector loads and stores.
+const UNIT_STRIDE_OP_FIELD: u32 = 0x01f0_0000;
+
+#[inline(always)]
+fn slot_index(raw: u32) -> usize {
+    ((raw & 0x7f) | ((raw >> 5) & 0x380)) as usize
 }
 
-const MAP_LENGTH: usize = 8;
-
-#[derive(Debug, Clone)]
-struct SmallMap<K, V> {
-    data: SmallVec<[(K, V); MAP_LENGTH]>,
+#[derive(Debug, Clone, Copy)]
+struct Candidate {
+    mask: u32,
+    key: u32,
+    instr: RiscvInstr,
+    format: InstrFormat,
 }
 
-#[allow(unused)]
-impl<K: Ord + Copy, V> SmallMap<K, V> {
-    fn new() -> Self {
-        SmallMap {
-            data: SmallVec::new(),
-        }
-    }
-
-    fn insert(&mut self, key: K, value: V) {
-        self.data.push((key, value));
-    }
-
-    fn get(&self, key: &K) -> Option<&V> {
-        self.data.iter().find(|(k, _)| k == key).map(|(_, v)| v)
-    }
-
-    fn iter(&self) -> impl Iterator<Item = &(K, V)> {
-        self.data.iter()
-    }
-
-    fn len(&self) -> usize {
-        self.data.len()
-    }
-
-    fn is_empty(&self) -> bool {
-        self.data.is_empty()
-    }
+/// `len` candidates from `start`.
+#[derive(Debug, Clone, Copy, Default)]
+struct Span {
+    start: u32,
+    len: u32,
 }
 
-fn fix_vector_instr_decode(vector_instr: RiscvInstr, raw_vec_instr: u32) -> Option<RiscvInstr> {
-    let vm = ((raw_vec_instr >> 25) & 1) != 0;
-    let rs1 = (raw_vec_instr >> 15) & 0b11111;
-    let rs2 = (raw_vec_instr >> 20) & 0b11111;
+/// Decoder of the 32 bit instructions, in two table lookups and the scan of a few candidates.
+///
+/// Opcode and funct3 select a row, and funct7 the candidates of the row: the instructions whose
+/// masks agree with these three fields, most specific mask first. The scan only tells apart the
+/// instructions that differ by other fields, such as the `vm`, `vs1` or `vs2` selectors of RVV.
+pub(super) struct Decoder {
+    /// Index + 1 into `rows` of every opcode and funct3, `0` if no instruction has them.
+    slots: Box<[u16; SLOT_CNT]>,
+    rows: Vec<[Span; FUNCT7_CNT]>,
+    candidates: Vec<Candidate>,
+}
 
-    let instr = match vector_instr {
-        // The funct decoder keys vector arithmetic instructions by
-        // opcode/funct3/funct6/vm.  Several RVV encodings use vm, rs1 or rs2 as
-        // secondary opcode bits, so fix those aliases before decode_info is
-        // built and execution is dispatched.
-        RiscvInstr::VMADC_VV | RiscvInstr::VMADC_VVM => {
-            if vm {
-                RiscvInstr::VMADC_VV
-            } else {
-                RiscvInstr::VMADC_VVM
-            }
-        }
-        RiscvInstr::VMSBC_VV | RiscvInstr::VMSBC_VVM => {
-            if vm {
-                RiscvInstr::VMSBC_VV
-            } else {
-                RiscvInstr::VMSBC_VVM
-            }
-        }
-        RiscvInstr::VMADC_VX | RiscvInstr::VMADC_VXM => {
-            if vm {
-                RiscvInstr::VMADC_VX
-            } else {
-                RiscvInstr::VMADC_VXM
-            }
-        }
-        RiscvInstr::VMSBC_VX | RiscvInstr::VMSBC_VXM => {
-            if vm {
-                RiscvInstr::VMSBC_VX
-            } else {
-                RiscvInstr::VMSBC_VXM
-            }
-        }
-        RiscvInstr::VMADC_VI | RiscvInstr::VMADC_VIM => {
-            if vm {
-                RiscvInstr::VMADC_VI
-            } else {
-                RiscvInstr::VMADC_VIM
+impl Decoder {
+    pub fn from_isa(instrs: impl Iterator<Item = RVInstrDesc>) -> Self {
+        let mut descs: Vec<RVInstrDesc> = instrs.collect();
+        for desc in descs.iter_mut() {
+            // The whole register and mask loads and stores have no instruction of their own, the
+            // unit-stride ones take every `lumop`/`sumop` and their executors tell them apart.
+            if matches!(
+                desc.instr,
+                RiscvInstr::VLE8_V
+                    | RiscvInstr::VLE16_V
+                    | RiscvInstr::VLE32_V
+                    | RiscvInstr::VLE64_V
+                    | RiscvInstr::VSE8_V
+                    | RiscvInstr::VSE16_V
+                    | RiscvInstr::VSE32_V
+                    | RiscvInstr::VSE64_V
+            ) {
+                desc.mask &= !UNIT_STRIDE_OP_FIELD;
             }
         }
+        // An encoding matching several masks is the most specific instruction.
+        descs.sort_by_key(|desc| desc.mask.count_zeros());
 
-        RiscvInstr::VMERGE_VVM | RiscvInstr::VMV_V_V => {
-            if vm {
-                if rs2 != 0 {
-                    return None;
-                }
-                RiscvInstr::VMV_V_V
-            } else {
-                RiscvInstr::VMERGE_VVM
-            }
-        }
-        RiscvInstr::VMERGE_VXM | RiscvInstr::VMV_V_X => {
-            if vm {
-                if rs2 != 0 {
-                    return None;
-                }
-                RiscvInstr::VMV_V_X
-            } else {
-                RiscvInstr::VMERGE_VXM
-            }
-        }
-        RiscvInstr::VMERGE_VIM | RiscvInstr::VMV_V_I => {
-            if vm {
-                if rs2 != 0 {
-                    return None;
-                }
-                RiscvInstr::VMV_V_I
-            } else {
-                RiscvInstr::VMERGE_VIM
+        let mut slot_descs: Vec<Vec<usize>> = vec![Vec::new(); SLOT_CNT];
+        for (idx, desc) in descs.iter().enumerate() {
+            for bits in submasks(!desc.mask & SLOT_FIELDS) {
+                slot_descs[slot_index(desc.key | bits)].push(idx);
             }
         }
 
-        RiscvInstr::VMV1R_V | RiscvInstr::VMV2R_V | RiscvInstr::VMV4R_V | RiscvInstr::VMV8R_V => {
-            if !vm {
-                return None;
-            }
-            match rs1 {
-                0 => RiscvInstr::VMV1R_V,
-                1 => RiscvInstr::VMV2R_V,
-                3 => RiscvInstr::VMV4R_V,
-                7 => RiscvInstr::VMV8R_V,
-                _ => return None,
+        let mut slots = Box::new([0; SLOT_CNT]);
+        let mut rows = Vec::new();
+        let mut candidates: Vec<Candidate> = Vec::new();
+        let mut row_candidates = Vec::new();
+        for (slot, indices) in slot_descs.iter().enumerate() {
+            if indices.is_empty() {
+                continue;
             }
-        }
-
-        RiscvInstr::VZEXT_VF2
-        | RiscvInstr::VZEXT_VF4
-        | RiscvInstr::VZEXT_VF8
-        | RiscvInstr::VSEXT_VF2
-        | RiscvInstr::VSEXT_VF4
-        | RiscvInstr::VSEXT_VF8 => match rs1 {
-            2 => RiscvInstr::VZEXT_VF8,
-            3 => RiscvInstr::VSEXT_VF8,
-            4 => RiscvInstr::VZEXT_VF4,
-            5 => RiscvInstr::VSEXT_VF4,
-            6 => RiscvInstr::VZEXT_VF2,
-            7 => RiscvInstr::VSEXT_VF2,
-            _ => return None,
-        },
-
-        RiscvInstr::VCPOP_M | RiscvInstr::VFIRST_M | RiscvInstr::VMV_X_S => match rs1 {
-            0 if vm => RiscvInstr::VMV_X_S,
-            16 => RiscvInstr::VCPOP_M,
-            17 => RiscvInstr::VFIRST_M,
-            _ => return None,
-        },
-        RiscvInstr::VMSBF_M
-        | RiscvInstr::VMSIF_M
-        | RiscvInstr::VMSOF_M
-        | RiscvInstr::VIOTA_M
-        | RiscvInstr::VID_V => match rs1 {
-            1 => RiscvInstr::VMSBF_M,
-            2 => RiscvInstr::VMSOF_M,
-            3 => RiscvInstr::VMSIF_M,
-            16 => RiscvInstr::VIOTA_M,
-            17 if rs2 == 0 => RiscvInstr::VID_V,
-            _ => return None,
-        },
-
-        RiscvInstr::VADC_VVM | RiscvInstr::VADC_VXM | RiscvInstr::VADC_VIM if vm => return None,
-        RiscvInstr::VSBC_VVM | RiscvInstr::VSBC_VXM if vm => return None,
-        RiscvInstr::VCOMPRESS_VM if !vm => return None,
-        RiscvInstr::VMV_S_X if !vm || rs2 != 0 => return None,
-        RiscvInstr::VMAND_MM
-        | RiscvInstr::VMNAND_MM
-        | RiscvInstr::VMANDN_MM
-        | RiscvInstr::VMXOR_MM
-        | RiscvInstr::VMOR_MM
-        | RiscvInstr::VMNOR_MM
-        | RiscvInstr::VMORN_MM
-        | RiscvInstr::VMXNOR_MM
-            if !vm =>
-        {
-            return None;
-        }
-
-        _ => vector_instr,
-    };
-
-    Some(instr)
-}
-
-pub(super) struct Decoder {
-    decode_table: Vec<(
-        PartialDecode,
-        SmallMap<(u8, u8, u8), (RiscvInstr, InstrFormat)>,
-    )>,
-}
 
-impl Decoder {
-    pub fn from_isa(instrs: impl Iterator<Item = RVInstrDesc>) -> Self {
-        let mut decode_table = vec![(PartialDecode::Unknown, SmallMap::new()); 1 << 7];
-
-        for desc in instrs {
-            let RVInstrDesc {
-                opcode,
-                funct3,
-                funct7,
-                instr,
-                format,
-                ..
-            } = desc.clone();
-
-            match format {
-                InstrFormat::R => {
-                    let (partial, map) = &mut decode_table[opcode as usize];
-                    *partial = PartialDecode::RequireF7;
-                    map.insert((opcode, funct3, funct7), (instr, format));
-                }
-                InstrFormat::A => {
-                    let (partial, map) = &mut decode_table[opcode as usize];
-                    *partial = PartialDecode::RequireF7;
-                    // rv_a instructions have only 5bits in funct7, the lower 2 bits are aq and rl.
-                    // nomatter what the aq and rl bits are, the instruction is the same.
-                    for i in 0..=3 {
-                        let funct7_a = funct7 | i;
-                        map.insert((opcode, funct3, funct7_a), (instr, format));
+            let mut row = [Span::default(); FUNCT7_CNT];
+            for funct7 in 0..FUNCT7_CNT {
+                let bits = (funct7 as u32) << 25;
+                row_candidates.clear();
+                row_candidates.extend(
+                    indices
+                        .iter()
+                        .map(|&idx| &descs[idx])
+                        .filter(|desc| (bits ^ desc.key) & desc.mask & FUNCT7_FIELD == 0)
+                        .map(|desc| Candidate {
+                            mask: desc.mask,
+                            key: desc.key,
+                            instr: desc.instr,
+                            format: desc.format,
+                        }),
+                );
+
+                // Most instructions ignore some bits of funct7, and share one span for all of them.
+                if funct7 != 0 {
+                    let prev = row[funct7 - 1];
+                    let prev_candidates =
+                        &candidates[prev.start as usize..(prev.start + prev.len) as usize];
+                    if prev_candidates
+                        .iter()
+                        .map(|candidate| candidate.instr)
+                        .eq(row_candidates.iter().map(|candidate| candidate.instr))
+                    {
+                        row[funct7] = prev;
+                        continue;
                     }
                 }
-                InstrFormat::V => {
-                    let (partial, map) = &mut decode_table[opcode as usize];
-                    *partial = PartialDecode::RequireF7;
-                    let funct6_vm = funct7 | 0b01;
-                    map.insert((opcode, funct3, funct6_vm), (instr, format));
-                    map.insert((opcode, funct3, funct6_vm & !0b01), (instr, format));
-                }
-                InstrFormat::I | InstrFormat::S | InstrFormat::B => {
-                    let (partial, map) = &mut decode_table[opcode as usize];
-                    *partial = PartialDecode::RequireF3;
-                    map.insert((opcode, funct3, 0), (instr, format));
-                }
 
-                _ => {
-                    let (partial, map) = &mut decode_table[opcode as usize];
-                    *partial = PartialDecode::Complete;
-                    map.insert((opcode, funct3, funct7), (instr, format));
-                }
+                row[funct7] = Span {
+                    start: candidates.len() as u32,
+                    len: row_candidates.len() as u32,
+                };
+                candidates.extend_from_slice(&row_candidates);
             }
+
+            rows.push(row);
+            slots[slot] = rows.len() as u16;
         }
 
-        log::info!("funct_decoder has {} instructions.", decode_table.len());
+        log::info!(
+            "funct_decoder has {} instructions in {} rows.",
+            descs.len(),
+            rows.len()
+        );
 
-        Decoder { decode_table }
+        Decoder {
+            slots,
+            rows,
+            candidates,
+        }
     }
 
     pub fn decode(&self, instr: RawInstr) -> Option<DecodeInstr> {
         let len = instr.len();
-        let instr = instr.val;
-
-        let opcode = (instr & 0b1111111) as u8;
-        let funct3 = ((instr >> 12) & 0b111) as u8;
-        let funct7 = (instr >> 25) as u8;
-
-        let (partial, map) = &self.decode_table[opcode as usize];
+        let raw = instr.val;
 
-        let (instr_kind, fmt) = match partial {
-            PartialDecode::Complete => map.data.get(0).unwrap().1.clone(),
-            PartialDecode::RequireF3 => map.get(&(opcode, funct3, 0))?.clone(),
-            PartialDecode::RequireF7 => map.get(&(opcode, funct3, funct7))?.clone(),
-            PartialDecode::Unknown => {
-                return None;
-            }
-        };
-        let instr_kind = if likely(fmt != InstrFormat::V) {
-            instr_kind
-        } else {
-            fix_vector_instr_decode(instr_kind, instr)?
-        };
-
-        return Some(DecodeInstr {
-            instr: instr_kind,
-            info: decode_info(instr, instr_kind, fmt),
+        let row = self.slots[slot_index(raw)];
+        if row == 0 {
+            return None;
+        }
+        let span = self.rows[row as usize - 1][(raw >> 25) as usize];
+        let candidate = self.candidates[span.start as usize..(span.start + span.len) as usize]
+            .iter()
+            .find(|candidate| raw & candidate.mask == candidate.key)?;
+
+        Some(DecodeInstr {
+            instr: candidate.instr,
+            info: decode_info(raw, candidate.instr, candidate.format),
             len,
-        });
+        })
     }
 }
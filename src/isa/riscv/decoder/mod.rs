@@ -18,7 +18,6 @@ use crate::{
 
 mod compress_decoder;
 mod funct_decoder;
-mod mask_decoder;
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub struct DecodeInstr {
@@ -37,9 +36,10 @@ impl Display for DecodeInstr {
     }
 }
 
+/// Every instruction decodes in a bounded number of table lookups, the tables are built once for the
+/// ISA of the decoder.
 pub struct Decoder {
-    funct3_decoder: funct_decoder::Decoder,
-    mask_decoder: mask_decoder::MaskDecoder,
+    funct_decoder: funct_decoder::Decoder,
     compress_decoder: compress_decoder::CompressedDecoder,
     /// `misa` extension bitmap of the ISA this decoder was built for.
     extension_bits: WordType,
@@ -98,17 +98,8 @@ impl Decoder {
             compress_decoder: CompressedDecoder::from_isa(
                 instrs.iter().filter(|d| is_compressed(d)).cloned(),
             ),
-            mask_decoder: mask_decoder::MaskDecoder::from_isa(
-                instrs
-                    .iter()
-                    .filter(|d| !is_compressed(d) && d.use_mask)
-                    .cloned(),
-            ),
-            funct3_decoder: funct_decoder::Decoder::from_isa(
-                instrs
-                    .iter()
-                    .filter(|d| !is_compressed(d) && !d.use_mask)
-                    .cloned(),
+            funct_decoder: funct_decoder::Decoder::from_isa(
+                instrs.iter().filter(|d| !is_compressed(d)).cloned(),
             ),
             // Unknown when building from a raw instruction list; the
             // builder-aware constructors set this via `from_builder`.
@@ -120,12 +111,21 @@ impl Decoder {
         if instr.len() == 2 {
             self.compress_decoder.decode(instr)
         } else {
-            None.or_else(|| self.mask_decoder.decode(instr))
-                .or_else(|| self.funct3_decoder.decode(instr))
+            self.funct_decoder.decode(instr)
         }
     }
 }
 
+/// Every value with only bits of `bits` set, `0` and `bits` included.
+fn submasks(bits: u32) -> impl Iterator<Item = u32> {
+    let mut next = Some(bits);
+    std::iter::from_fn(move || {
+        let value = next?;
+        next = (value != 0).then(|| (value - 1) & bits);
+        Some(value)
+    })
+}
+
 /// This function doesn't handle compressed instruction.
 fn decode_info(raw_instr: u32, instr: RiscvInstr, fmt: InstrFormat) -> RVInstrInfo {
     let rd = ((raw_instr >> 7) & 0b11111) as u8;
@@ -938,4 +938,52 @@ mod tests {
         // 0x9002 also matches C_JALR; must decode as C_EBREAK.
         checker.check(0x9002, RiscvInstr::C_EBREAK, RVInstrInfo::None);
     }
+
+    // Custom instructions are added by `Decoder::new` only.
+    #[cfg(not(feature = "custom-instr"))]
+    #[test]
+    fn test_decoder_tables_match_masks() {
+        let mut isa = ISABuilder::new()
+            .add(Extension::M)
+            .add(Extension::A)
+            .add(Extension::D)
+            .add(Extension::C)
+            .add(Extension::V)
+            .add(Extension::Zifencei)
+            .build();
+        // The reference: the first matching mask, most specific first.
+        isa.sort_by_key(|desc| desc.mask.count_zeros());
+        let decoder = Decoder::new();
+
+        let mut seed = 0x2545_f491_4f6c_dd1du64;
+        for desc in isa.iter() {
+            for _ in 0..64 {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                let raw = desc.key | (seed as u32 & !desc.mask);
+                let raw = if is_compressed(desc) {
+                    raw & 0xffff
+                } else {
+                    raw
+                };
+
+                let expected = isa
+                    .iter()
+                    .filter(|d| is_compressed(d) == is_compressed(desc))
+                    .find(|d| raw & d.mask == d.key)
+                    .map(|d| d.instr);
+                let decoded = decoder.decode(raw.into()).map(|d| d.instr);
+                assert_eq!(decoded, expected, "{raw:#010x}");
+            }
+        }
+    }
+
+    #[test]
+    fn test_submasks() {
+        let mut values: Vec<u32> = submasks(0b1010).collect();
+        values.sort();
+        assert_eq!(values, [0b0000, 0b0010, 0b1000, 0b1010]);
+        assert_eq!(submasks(0).collect::<Vec<_>>(), [0]);
+    }
 }
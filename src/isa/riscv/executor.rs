@@ -1,26 +1,44 @@
-use std::hint::cold_path;
+use std::{
+    hint::cold_path,
+    sync::{
+        Arc,
+        atomic::{AtomicU64, Ordering},
+    },
+};
 
+#[cfg(feature = "jit")]
+use crate::isa::riscv::jit::{self, JitExit};
 use crate::{
     board::virt::RiscvIRQHandler,
-    config::arch_config::WordType,
+    config::arch_config::{REGFILE_CNT, WordType},
     cpu::RegFile,
     device::MemError,
     fpu::soft_float::SoftFPU,
     isa::{
         InstrLen,
-        cache::{Cache, SetCache},
+        cache::{Cache, CacheStats, SetCache},
         riscv::{
             RawInstr,
+            block_cache::{
+                BasicBlock, BlockCache, BlockInstr, BlockRef, BlockRole, ExecFn, MAX_BLOCK_LEN,
+                block_role,
+            },
             csr_reg::{CsrRegFile, NamedCsrReg, PrivilegeLevel, csr_macro::*},
+            debug_points::{BlockCheck, Breakpoints, DebugStop},
             decoder::{DecodeInstr, Decoder},
             instruction::{RVInstrInfo, exec_mapping::get_exec_func, instr_table::RiscvInstr},
-            mmu::VirtAddrManager,
+            mmu::{Asid, TlbKind, VirtAddrManager, config::PAGE_SIZE},
+            predecode,
             trap::{Exception, Interrupt, Trap, trap_controller::TrapController},
             vector::Vector,
         },
     },
     ram_config::DEFAULT_PC_VALUE,
+    snapshot::{Snapshot, SnapshotError, StateReader, StateWriter},
+    stats::{HartStats, WalkStats},
+    trace::{self, HartTracer},
     utils::make_mask,
+    vclock::OffsetClockRef,
 };
 
 #[derive(Clone)]
@@ -62,14 +80,40 @@ pub struct RVCPU {
     pub(super) decoder: Decoder,
     pub(super) csr: CsrRegFile,
     pub(super) icache: SetCache<DecodeInstr, 256, 8>,
+    pub(super) blocks: BlockCache,
     pub(super) fpu: SoftFPU,
     pub(super) vector: Vector,
 
-    /// The address of the memory-mapped `mtime` CSR.
-    pub(crate) time_addr: Option<WordType>,
+    /// `mtime` of the CLINT, which the `time` CSR reads.
+    pub(crate) time: Option<OffsetClockRef>,
+
+    /// Driven by the CLINT and the PLIC, copied into `mip` by [`Self::sync_irq_pins`].
+    pub(crate) irq_pins: Arc<InterruptPins>,
 
     /// The trap value pending to be written to `mtval`/`stval`.
     pub(super) pending_tval: Option<WordType>,
+
+    /// Stalled at a `WFI` until an interrupt is pending.
+    waiting: bool,
+
+    /// Run the hot blocks through [`predecode`], see [`Self::set_predecode_hot_blocks`].
+    predecode_hot_blocks: bool,
+    /// Run the hot blocks compiled, see [`Self::set_jit_hot_blocks`].
+    #[cfg(feature = "jit")]
+    jit_hot_blocks: bool,
+
+    /// Cycles and instructions retired not added to `mcycle` and `minstret` yet, see
+    /// [`Self::sync_counters`].
+    unsynced_cycles: u64,
+    unsynced_instrs: u64,
+
+    pub(crate) stats: HartStats,
+
+    /// Records the instructions retired, with the `trace` feature, see [`trace`].
+    pub(crate) tracer: Option<Box<HartTracer>>,
+
+    /// Checked on block entry, see [`crate::isa::riscv::debug_points`].
+    pub(super) breakpoints: Breakpoints,
 }
 
 impl RVCPU {
@@ -115,12 +159,56 @@ impl RVCPU {
             csr: csr,
             vector: Vector::new(),
             icache: SetCache::new(),
+            blocks: BlockCache::new(),
             fpu,
-            time_addr: None,
+            time: None,
+            irq_pins: Arc::default(),
             pending_tval: None,
+            waiting: false,
+            predecode_hot_blocks: false,
+            #[cfg(feature = "jit")]
+            jit_hot_blocks: false,
+            unsynced_cycles: 0,
+            unsynced_instrs: 0,
+            stats: HartStats::new(),
+            tracer: None,
+            breakpoints: Breakpoints::default(),
         }
     }
 
+    /// Make this CPU the hart `hart_id` of the board, it's `0` by default.
+    pub(crate) fn set_hart_id(&mut self, hart_id: usize) {
+        self.csr
+            .write_directly(Mhartid::get_index(), hart_id as WordType);
+        self.memory.set_hart_id(hart_id);
+    }
+
+    pub(crate) fn hart_id(&self) -> usize {
+        self.memory.hart_id()
+    }
+
+    /// Round every F/D result with `rustc_apfloat`, instead of the host when rounding to nearest.
+    pub(crate) fn set_strict_float(&mut self, strict: bool) {
+        self.fpu.strict = strict;
+    }
+
+    pub(crate) fn strict_float(&self) -> bool {
+        self.fpu.strict
+    }
+
+    /// Run the blocks run often enough as pre-decoded ops, see [`predecode`]. Off by default, the
+    /// interpreter runs every block.
+    pub(crate) fn set_predecode_hot_blocks(&mut self, enable: bool) {
+        self.predecode_hot_blocks = enable;
+    }
+
+    /// Run the blocks run often enough as host code, see [`jit`]. Off by default, the blocks that
+    /// don't compile are still pre-decoded if [`Self::set_predecode_hot_blocks`] is on.
+    #[cfg(feature = "jit")]
+    pub(crate) fn set_jit_hot_blocks(&mut self, enable: bool) {
+        self.jit_hot_blocks = enable;
+    }
+
     pub(in super::super) fn execute(
         &mut self,
         instr: RiscvInstr,
@@ -129,7 +217,18 @@ impl RVCPU {
         // Replacing function-pointer dispatch in `get_exec_func` with immediate call to the execution function,
         // makes the program 10%-20% slower on my machine.
         // This is likely because it hurts jump-table dispatch and pulls some cold paths into the hot path.
-        let rst = get_exec_func(instr)(info, self);
+        self.execute_by(get_exec_func(instr), instr, info)
+    }
+
+    /// Same as [`Self::execute`], with the execution function already resolved.
+    #[inline(always)]
+    fn execute_by(
+        &mut self,
+        exec: ExecFn,
+        instr: RiscvInstr,
+        info: RVInstrInfo,
+    ) -> Result<(), Exception> {
+        let rst = exec(info, self);
         self.reg_file[0] = 0;
 
         if let Err(ex) = rst {
@@ -148,13 +247,60 @@ impl RVCPU {
         rst
     }
 
+    #[inline(always)]
+    fn tracing(&self) -> bool {
+        trace::ENABLED && self.tracer.is_some()
+    }
+
+    /// Same as [`Self::execute_by`], handing the instruction to the tracer if there is one.
+    #[inline(always)]
+    fn execute_traced(
+        &mut self,
+        exec: ExecFn,
+        instr: RiscvInstr,
+        info: RVInstrInfo,
+    ) -> Result<(), Exception> {
+        if self.tracing() {
+            cold_path();
+            return self.trace_execute(exec, instr, info);
+        }
+        self.execute_by(exec, instr, info)
+    }
+
+    /// Execute an instruction and record it if it retires.
+    #[inline(never)]
+    fn trace_execute(
+        &mut self,
+        exec: ExecFn,
+        instr: RiscvInstr,
+        info: RVInstrInfo,
+    ) -> Result<(), Exception> {
+        let pc = self.pc;
+        // Neither the i-cache nor the blocks keep the raw instruction, it was just fetched from
+        // the same mapping.
+        let raw = self.ifetch(pc).expect("ifetch should not fail here");
+
+        self.reg_file.clear_written();
+        self.memory.begin_access_log();
+        let rst = self.execute_by(exec, instr, info);
+        let accesses = self.memory.end_access_log();
+
+        if rst.is_ok() {
+            let int_rd = self.reg_file.take_written();
+            let tracer = self.tracer.as_mut().unwrap();
+            tracer.retire(pc, raw, instr, info, int_rd, &self.fpu, accesses);
+        }
+
+        rst
+    }
+
     pub fn read_csr(&mut self, addr: WordType) -> Result<WordType, Exception> {
+        self.sync_counters();
+        self.sync_irq_pins();
         if addr == 0xc01 {
             // time CSR
-            if let Some(time_addr) = self.time_addr {
-                if let Ok(time) = self.memory.read_by_paddr::<u64>(time_addr) {
-                    return Ok(time as WordType);
-                }
+            if let Some(time) = &self.time {
+                return Ok(time.now() as WordType);
             }
         } else if let Some(data) = self.csr.read(addr) {
             // Normal CSR read
@@ -170,6 +316,11 @@ impl RVCPU {
     ///
     /// You may need [`CsrRegFile::write_directly`] in some cases.
     pub fn write_csr(&mut self, addr: WordType, data: WordType) -> Result<(), Exception> {
+        let old_satp =
+            (addr == Satp::get_index()).then(|| self.csr.get_by_type_existing::<Satp>().data());
+
+        self.sync_counters();
+        self.sync_irq_pins();
         if !self.csr.write(addr, data) {
             log::warn!("Failed to write CSR {:#x} with data {:#x}", addr, data);
             return Err(Exception::IllegalInstruction);
@@ -177,10 +328,17 @@ impl RVCPU {
 
         // Changing satp.MODE from Bare to other modes and vice versa also takes effect immediately,
         // without the need to execute an SFENCE.VMA instruction.
-        if addr == Satp::get_index() {
+        if let Some(old_satp) = old_satp {
             let satp = self.csr.get_by_type_existing::<Satp>();
-            self.memory.set_mode(satp.get_mode() as u8);
-            self.memory.set_root_ppn(satp.get_ppn() as u64);
+            if satp.data() != old_satp {
+                self.memory.set_mode(satp.get_mode() as u8);
+                self.memory.set_root_ppn(satp.get_ppn() as u64);
+                self.memory.set_asid(satp.get_asid() as Asid);
+
+                // Decoded code is tagged with its physical address and kept,
+                // but chaining across address spaces is not.
+                self.blocks.unlink();
+            }
         }
 
         Ok(())
@@ -192,18 +350,231 @@ impl RVCPU {
         }
 
         let rst = self.step_impl();
+        self.advance_mcycle(1);
 
-        let mcycle = self.csr.get_by_type_existing::<Mcycle>();
-        mcycle.set_mcycle_directly(mcycle.data().wrapping_add(1));
+        debug_assert!(self.pending_tval.is_none());
+
+        rst
+    }
+
+    /// Run the translated block at the current pc.
+    ///
+    /// Returns the number of instructions stepped, including the one that trapped.
+    /// Interrupts are only checked on block entry.
+    /// In debug mode this falls back to [`Self::step`], so the debugger still sees every instruction.
+    pub fn step_block(&mut self) -> Result<u64, Exception> {
+        if self.debug {
+            cold_path();
+            return self.step().map(|_| 1);
+        }
+
+        let privilege = self.csr.privelege_level();
+        let rst = self.run_block();
+
+        self.advance_mcycle(*rst.as_ref().unwrap_or(&1));
+
+        if self.csr.privelege_level() != privilege {
+            cold_path();
+            self.blocks.unlink();
+        }
 
         debug_assert!(self.pending_tval.is_none());
 
         rst
     }
 
-    fn ifetch(&mut self) -> Result<RawInstr, MemError> {
-        let mut bytes: RawInstr =
-            (self.memory.ifetch::<u16>(self.pc, &mut self.csr)? as u32).into();
+    fn run_block(&mut self) -> Result<u64, Exception> {
+        if self.is_waiting() {
+            return Ok(0);
+        }
+        self.sync_code_pages();
+
+        if self.take_interrupt() {
+            self.blocks.break_chain();
+            return Ok(1);
+        }
+
+        if !self.breakpoints.is_empty() {
+            cold_path();
+            match self.check_breakpoints() {
+                BlockCheck::Run => {}
+                BlockCheck::Step => {
+                    self.blocks.break_chain();
+                    return self.step_instr().map(|_| 1);
+                }
+                BlockCheck::Stop => {
+                    self.blocks.break_chain();
+                    return Ok(0);
+                }
+            }
+        }
+
+        let block = self
+            .memory
+            .translate_ifetch(self.pc, &mut self.csr)
+            .ok()
+            .and_then(|paddr| {
+                self.blocks
+                    .get(self.pc, paddr)
+                    .or_else(|| self.translate_block(paddr))
+            });
+        let Some(block) = block else {
+            // The first instruction cannot be fetched or decoded, let `step_instr` raise the trap.
+            self.blocks.break_chain();
+            return self.step_instr().map(|_| 1);
+        };
+
+        if block.instrs.is_empty() {
+            // A standalone instruction, stepped on its own.
+            self.step_instr()?;
+            self.blocks.enter(block);
+            return Ok(1);
+        }
+
+        // The compiled code and the pre-decoded ops run no hook, traced and watched harts interpret
+        // every block.
+        let watching = self.memory.watching();
+        let hot = (!self.tracing() && !watching)
+            .then(|| self.run_hot_block(&block))
+            .flatten();
+        let (steps, rst) = match hot {
+            Some(run) => run,
+            None if watching => self.interpret_block::<true>(&block.instrs),
+            None => self.interpret_block::<false>(&block.instrs),
+        };
+
+        self.icache_cnt += steps as usize;
+        self.retire(steps - rst.is_err() as u64);
+
+        match rst {
+            // Stopped by a watchpoint, maybe in the middle of the block.
+            Ok(()) if watching && self.memory.watch_hit() => self.blocks.break_chain(),
+            Ok(()) => self.blocks.enter(block),
+            Err(ex) => {
+                cold_path();
+                self.handle_exec_exception(ex);
+                self.blocks.break_chain();
+            }
+        }
+
+        Ok(steps)
+    }
+
+    /// Run a hot block compiled or pre-decoded, whichever is enabled and available, returns `None`
+    /// for the interpreter to run it.
+    #[inline]
+    fn run_hot_block(&mut self, block: &BasicBlock) -> Option<(u64, Result<(), Exception>)> {
+        #[cfg(feature = "jit")]
+        if self.jit_hot_blocks
+            && let Some(compiled) = block.compiled()
+        {
+            return Some(match jit::run(self, compiled) {
+                JitExit::Ran(steps, rst) => {
+                    self.stats.record_compiled_instrs(steps);
+                    (steps, rst)
+                }
+                JitExit::Interpret(index) => {
+                    self.stats.record_compiled_instrs(index as u64);
+                    let (steps, rst) = self.interpret_block::<false>(&block.instrs[index..]);
+                    (index as u64 + steps, rst)
+                }
+            });
+        }
+
+        if !self.predecode_hot_blocks {
+            return None;
+        }
+        let decoded = block.decoded()?;
+        let (steps, rst) = predecode::run(self, decoded);
+        self.stats.record_predecoded_instrs(steps);
+        Some((steps, rst))
+    }
+
+    /// Run `instrs` of a block one by one,
+    /// returns the number of instructions stepped and the exception raised, if any.
+    ///
+    /// `WATCHED` stops after the instruction hitting a watchpoint.
+    #[inline]
+    fn interpret_block<const WATCHED: bool>(
+        &mut self,
+        instrs: &[BlockInstr],
+    ) -> (u64, Result<(), Exception>) {
+        let mut steps = 0;
+        for &BlockInstr {
+            instr, info, exec, ..
+        } in instrs
+        {
+            steps += 1;
+            self.stats.record_instr(instr);
+            if let Err(ex) = self.execute_traced(exec, instr, info) {
+                return (steps, Err(ex));
+            }
+            if WATCHED && self.memory.watch_hit() {
+                break;
+            }
+        }
+
+        (steps, Ok(()))
+    }
+
+    fn check_breakpoints(&mut self) -> BlockCheck {
+        let paddr = self.memory.translate_ifetch(self.pc, &mut self.csr).ok();
+        self.breakpoints
+            .check(self.pc, paddr.map(|paddr| paddr as u64))
+    }
+
+    /// Check the breakpoints at the pc like on block entry, returns true if stopped at one.
+    pub(crate) fn at_breakpoint(&mut self) -> bool {
+        !self.breakpoints.is_empty() && matches!(self.check_breakpoints(), BlockCheck::Stop)
+    }
+
+    /// Whether a breakpoint or a watchpoint stopped the hart, see [`Self::take_debug_stop`].
+    #[inline]
+    pub(crate) fn debug_stopped(&self) -> bool {
+        self.breakpoints.hit() || self.memory.watch_hit()
+    }
+
+    /// Take what stopped the hart, the watchpoint hit first as its instruction ran before.
+    pub(crate) fn take_debug_stop(&mut self) -> Option<DebugStop> {
+        let breakpoint = self.breakpoints.take_hit();
+        self.memory
+            .take_watch_hit()
+            .or(breakpoint.then_some(DebugStop::Breakpoint))
+    }
+
+    #[inline]
+    fn advance_mcycle(&mut self, cycles: u64) {
+        self.unsynced_cycles = self.unsynced_cycles.wrapping_add(cycles);
+    }
+
+    #[inline]
+    fn retire(&mut self, instrs: u64) {
+        self.unsynced_instrs = self.unsynced_instrs.wrapping_add(instrs);
+    }
+
+    /// Don't count the instruction running, its write to `minstret` takes the place of the count.
+    #[inline]
+    pub(super) fn uncount_instr(&mut self) {
+        self.unsynced_instrs = self.unsynced_instrs.wrapping_sub(1);
+    }
+
+    /// Add the cycles and instructions counted since the last call to `mcycle` and `minstret`.
+    ///
+    /// They are counted in plain fields, as the CSRs are only read by the CSR instructions, the
+    /// debugger and the snapshots, which call this first.
+    pub(crate) fn sync_counters(&mut self) {
+        let cycles = std::mem::take(&mut self.unsynced_cycles);
+        let mcycle = self.csr.get_by_type_existing::<Mcycle>();
+        mcycle.set_mcycle_directly(mcycle.data().wrapping_add(cycles as WordType));
+
+        let instrs = std::mem::take(&mut self.unsynced_instrs);
+        self.csr
+            .get_by_type_existing::<Minstret>()
+            .wrapping_add(instrs as WordType);
+    }
+
+    fn ifetch(&mut self, addr: WordType) -> Result<RawInstr, MemError> {
+        let mut bytes: RawInstr = (self.memory.ifetch::<u16>(addr, &mut self.csr)? as u32).into();
 
         if bytes.len() == 4 {
             // 32-bit instr.
@@ -212,10 +583,10 @@ impl RVCPU {
             // with the latter now able to start on any 16-bit boundary."
 
             // but the next half may sit on the next page, causing a page fault.
-            let next_half = match self.memory.ifetch::<u16>(self.pc + 2, &mut self.csr) {
+            let next_half = match self.memory.ifetch::<u16>(addr + 2, &mut self.csr) {
                 Ok(half) => half as u32,
                 Err(err) => {
-                    self.pending_tval = Some(self.pc + 2);
+                    self.pending_tval = Some(addr + 2);
                     return Err(err);
                 }
             };
@@ -225,36 +596,161 @@ impl RVCPU {
         Ok(bytes)
     }
 
+    /// Translate the straight-line code at the current pc, which translates to `phys_pc`, into a new block.
+    ///
+    /// Returns `None` if the first instruction cannot be fetched or decoded,
+    /// the trap is then raised by [`Self::step_instr`].
+    fn translate_block(&mut self, phys_pc: WordType) -> Option<BlockRef> {
+        let start = self.pc;
+        let page = start & !(PAGE_SIZE - 1);
+
+        let mut instrs = Vec::new();
+        let mut pc = start;
+        let mut failed = false;
+
+        // A block never leaves the page it starts in, so it is fetched through a single mapping.
+        while instrs.len() < MAX_BLOCK_LEN && (pc & !(PAGE_SIZE - 1)) == page {
+            if crosses_page(pc) {
+                // Its second half is in another page, which the block doesn't track.
+                failed = true;
+                break;
+            }
+
+            let Ok(raw_instr) = self.ifetch(pc) else {
+                // The fault belongs to an instruction we have not reached yet,
+                // it will be raised again once we get there.
+                self.pending_tval = None;
+                failed = true;
+                break;
+            };
+
+            if is_c_nop_workaround(raw_instr) {
+                break;
+            }
+
+            let Some(DecodeInstr { instr, info, len }) = self.decoder.decode(raw_instr) else {
+                failed = true;
+                break;
+            };
+
+            let role = block_role(instr);
+            if role == BlockRole::Standalone {
+                break;
+            }
+
+            instrs.push(BlockInstr::new(instr, info, len));
+            pc = pc.wrapping_add(len);
+
+            if role == BlockRole::Terminator {
+                break;
+            }
+        }
+
+        if failed && instrs.is_empty() {
+            return None;
+        }
+
+        self.memory.mark_code_page(phys_pc);
+        Some(self.blocks.insert(start, phys_pc, pc, instrs))
+    }
+
     fn step_impl(&mut self) -> Result<(), Exception> {
+        self.sync_code_pages();
+
+        if self.take_interrupt() {
+            return Ok(());
+        }
+
+        self.step_instr()
+    }
+
+    /// Stall the hart after a `WFI` until an interrupt is pending, see [`Self::is_waiting`].
+    ///
+    /// The debugger steps over it as over a nop.
+    pub(super) fn wait_for_interrupt(&mut self) {
+        self.waiting = !self.debug && !self.interrupt_pending();
+    }
+
+    /// Whether the hart is stalled at a `WFI`, it then runs no instruction in [`Self::step_block`].
+    ///
+    /// It resumes once an interrupt is pending in `mip` and enabled in `mie`, whether or not the
+    /// interrupts are globally enabled.
+    pub(crate) fn is_waiting(&mut self) -> bool {
+        if self.waiting && self.interrupt_pending() {
+            self.waiting = false;
+        }
+        self.waiting
+    }
+
+    /// Count the cycles the board skipped while the hart was stalled at a `WFI`.
+    pub(crate) fn skip_waiting_cycles(&mut self, cycles: u64) {
+        self.advance_mcycle(cycles);
+    }
+
+    #[inline]
+    fn interrupt_pending(&mut self) -> bool {
+        self.sync_irq_pins();
+        let mip = self.csr.get_by_type_existing::<Mip>().data();
+        mip & self.csr.get_by_type_existing::<Mie>().data() != 0
+    }
+
+    /// Copy the levels the devices drove on [`Self::irq_pins`] since the last call into `mip`.
+    #[inline(always)]
+    pub(crate) fn sync_irq_pins(&mut self) {
+        if let Some((changed, levels)) = self.irq_pins.take_changes() {
+            cold_path();
+            let mip = self.csr.get_by_type_existing::<Mip>().data();
+            self.csr
+                .write_directly(Mip::get_index(), (mip & !changed) | (levels & changed));
+        }
+    }
+
+    /// Take the pending interrupt if there is one, returns whether the trap is taken.
+    #[inline]
+    fn take_interrupt(&mut self) -> bool {
+        self.sync_irq_pins();
         if let Some(interrupt) = TrapController::has_interrupt(self) {
-            if TrapController::try_send_trap_signal(self, Trap::Interrupt(interrupt), 0) {
+            return TrapController::try_send_trap_signal(self, Trap::Interrupt(interrupt), 0);
+        }
+
+        false
+    }
+
+    #[cold]
+    fn raise_fetch_fault(&mut self, err: MemError) {
+        TrapController::try_send_trap_signal(
+            self,
+            Trap::Exception(Exception::from_instr_fetch_err(err)),
+            self.pc,
+        );
+    }
+
+    /// Fetch, decode and execute one instruction, without checking interrupts.
+    fn step_instr(&mut self) -> Result<(), Exception> {
+        let paddr = match self.memory.translate_ifetch(self.pc, &mut self.csr) {
+            Ok(paddr) => paddr,
+            Err(err) => {
+                self.raise_fetch_fault(err);
                 return Ok(());
             }
-        }
+        };
 
-        let DecodeInstr { instr, info, len } = if let Some(decode_instr) = self.icache.get(self.pc)
-        {
+        let DecodeInstr { instr, info, len } = if let Some(decode_instr) = self.icache.get(paddr) {
             self.icache_cnt += 1;
             decode_instr
         } else {
-            let raw_instr = match self.ifetch() {
+            let raw_instr = match self.ifetch(self.pc) {
                 Ok(bytes) => bytes,
                 Err(err) => {
-                    TrapController::try_send_trap_signal(
-                        self,
-                        Trap::Exception(Exception::from_instr_fetch_err(err)),
-                        self.pc,
-                    );
+                    self.raise_fetch_fault(err);
                     return Ok(());
                 }
             };
 
             // ID
 
-            // TODO: We have to support C.nop for riscv-arch-test,
-            // while currently we don't support the C extension.
-            // So a temparary workaround is added here.
-            if (raw_instr.val & (make_mask(13, 15) | make_mask(7, 11) | 0b11) as u32) == 0x0001 {
+            // See `is_c_nop_workaround`.
+            if is_c_nop_workaround(raw_instr) {
                 self.pc = self.pc.wrapping_add(2);
                 return Ok(());
             }
@@ -274,7 +770,11 @@ impl RVCPU {
                 return Ok(());
             };
 
-            self.icache.put(self.pc, decode_instr.clone());
+            // The second half of an instruction crossing the page isn't tracked.
+            if !(decode_instr.len == 4 && crosses_page(self.pc)) {
+                self.icache.put(paddr, decode_instr.clone());
+                self.memory.mark_code_page(paddr);
+            }
             decode_instr
         };
 
@@ -290,71 +790,198 @@ impl RVCPU {
         }
 
         // EX && MEM && WB
-        let excute_result = self.execute(instr, info);
-        match excute_result {
+        self.stats.record_instr(instr);
+        match self.execute_traced(get_exec_func(instr), instr, info) {
+            Ok(()) => self.retire(1),
+            Err(ex) => self.handle_exec_exception(ex),
+        }
+
+        return Ok(());
+    }
+
+    /// Raise the trap for an exception returned by an execution function.
+    fn handle_exec_exception(&mut self, ex: Exception) {
+        match ex {
             // XXX: OpenSBI have semihosting test, and we don't implement breakpoint exception handling yet,
             // so we can't throw and panic here.
-            // Err(Exception::Breakpoint) => return excute_result,
-            Err(Exception::IllegalInstruction) => {
+            // Exception::Breakpoint => return Err(ex),
+            Exception::IllegalInstruction => {
                 cold_path();
 
                 // We cannot reuse the fetched raw instruction on the i-cache hit path,
                 // because the raw instruction bytes are not stored in the i-cache.
                 // This is acceptable because `illegal instruction` is a cold path.
-                let raw_instr = self.ifetch().expect("ifetch should not fail here");
+                let raw_instr = self.ifetch(self.pc).expect("ifetch should not fail here");
                 TrapController::try_send_trap_signal(
                     self,
                     Trap::Exception(Exception::IllegalInstruction),
                     raw_instr.val as WordType,
                 );
             }
-            Err(nr) => {
+            nr => {
                 TrapController::try_send_trap_signal(self, Trap::Exception(nr), 0);
             }
-            Ok(()) => {} // there is nothing to do.
         }
-
-        return Ok(());
     }
 
     pub fn flush_icache(&mut self) {
         self.icache.clear();
+        self.blocks.clear();
     }
 
     pub fn flush_tlb(&mut self) {
         self.memory.flush_tlb();
     }
 
+    /// Counters of the decode and translation caches, by name.
+    pub fn cache_stats(&self) -> [(&'static str, CacheStats); 4] {
+        [
+            ("iCache", self.icache.stats()),
+            ("Block index", self.blocks.index_stats()),
+            ("iTLB", self.memory.tlb_stats(TlbKind::Instr)),
+            ("dTLB", self.memory.tlb_stats(TlbKind::Data)),
+        ]
+    }
+
+    pub(crate) fn walk_stats(&self) -> &WalkStats {
+        self.memory.walk_stats()
+    }
+
+    /// The accesses of this hart to each device, as its name, base address and count.
+    pub(crate) fn mmio_accesses(&self) -> impl Iterator<Item = (&'static str, WordType, u64)> {
+        self.memory.mmio.access_counts()
+    }
+
+    /// `SFENCE.VMA rs1, rs2`, only the translations selected by the operands are dropped.
+    pub fn fence_vma(&mut self, rs1: u8, rs2: u8) {
+        let (vaddr, asid) = self.reg_file.read(rs1, rs2);
+        let vaddr = (rs1 != 0).then_some(vaddr);
+        let asid = (rs2 != 0).then_some(asid as Asid);
+
+        self.memory.fence_vma(vaddr, asid);
+    }
+
+    /// Drop what was decoded from the pages written since the last call.
+    ///
+    /// Stores only become visible to instruction fetches at the next block,
+    /// which is enough since the guest needs a `FENCE.I` (a standalone instruction) anyway.
+    #[inline]
+    fn sync_code_pages(&mut self) {
+        if self.memory.has_written_code_pages() {
+            cold_path();
+            for page in self.memory.take_written_code_pages() {
+                self.icache.invalidate_range(page..page + PAGE_SIZE);
+                self.blocks.invalidate_page(page, PAGE_SIZE);
+            }
+        }
+    }
+
     pub fn power_off(&mut self) -> Result<(), Exception> {
         self.memory.sync();
         Ok(())
     }
 }
 
-impl RiscvIRQHandler for RVCPU {
-    fn handle_irq(&mut self, interrupt: Interrupt, level: bool) {
-        let mip = self.csr.get_by_type_existing::<Mip>();
-        let level = level as WordType;
+/// Whether a 32-bit instruction at `pc` would have its second half in the next page.
+#[inline]
+fn crosses_page(pc: WordType) -> bool {
+    pc & (PAGE_SIZE - 1) == PAGE_SIZE - 2
+}
 
-        match interrupt {
-            Interrupt::MachineTimer => {
-                mip.set_mtip(level);
-            }
-            Interrupt::MachineExternal => {
-                mip.set_meip(level);
-            }
-            Interrupt::SupervisorExternal => {
-                mip.set_seip(level);
-            }
+// TODO: We have to support C.nop for riscv-arch-test,
+// while currently we don't support the C extension.
+// So a temparary workaround is added here.
+#[inline]
+fn is_c_nop_workaround(raw_instr: RawInstr) -> bool {
+    (raw_instr.val & (make_mask(13, 15) | make_mask(7, 11) | 0b11) as u32) == 0x0001
+}
 
-            Interrupt::MachineSoft => {
-                mip.set_msip(level);
-            }
+/// The architectural state of the hart, taken between two instructions.
+///
+/// Caches are not saved: they are dropped on restore, and the translation mode is reloaded from `satp`.
+impl Snapshot for RVCPU {
+    fn save(&self, out: &mut StateWriter) {
+        out.write_u64(self.pc as u64);
+        for index in 0..REGFILE_CNT {
+            out.write_u64(self.reg_file[index] as u64);
+        }
+        out.write_section(|out| self.csr.save(out));
+        out.write_section(|out| self.fpu.save(out));
+        out.write_section(|out| self.vector.save(out));
+    }
 
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        self.pc = state.read_u64()? as WordType;
+        for index in 0..REGFILE_CNT {
+            self.reg_file[index] = state.read_u64()? as WordType;
+        }
+        state.read_section(|state| self.csr.restore(state))?;
+        state.read_section(|state| self.fpu.restore(state))?;
+        state.read_section(|state| self.vector.restore(state))?;
+        self.pending_tval = None;
+        self.waiting = false;
+        // `mip` is restored, what the devices drove before is dropped.
+        self.irq_pins.take_changes();
+        self.unsynced_cycles = 0;
+        self.unsynced_instrs = 0;
+
+        let satp = self.csr.get_by_type_existing::<Satp>();
+        self.memory.set_mode(satp.get_mode() as u8);
+        self.memory.set_root_ppn(satp.get_ppn() as u64);
+        self.memory.set_asid(satp.get_asid() as Asid);
+        self.flush_tlb();
+        self.flush_icache();
+        Ok(())
+    }
+}
+
+/// The interrupt lines that the CLINT and the PLIC drive into a hart.
+///
+/// The devices run on the thread of the hart accessing them, so a line only records its level
+/// here, and the hart copies the lines that changed into `mip` whenever it looks at it: on block
+/// entry, at a `WFI` and on CSR accesses, see [`RVCPU::sync_irq_pins`].
+#[derive(Default)]
+pub(crate) struct InterruptPins {
+    /// The level of each line, at its bit in `mip`.
+    levels: AtomicU64,
+    /// The bits of the lines driven since the hart last copied them.
+    changed: AtomicU64,
+}
+
+impl InterruptPins {
+    /// The bits of `mip` driven since the last call and their levels, `None` if none was.
+    #[inline(always)]
+    fn take_changes(&self) -> Option<(WordType, WordType)> {
+        if self.changed.load(Ordering::Relaxed) == 0 {
+            return None;
+        }
+        let changed = self.changed.swap(0, Ordering::Acquire);
+        // A line driven meanwhile is marked again, and copied once more on the next call.
+        let levels = self.levels.load(Ordering::Acquire);
+        Some((changed as WordType, levels as WordType))
+    }
+}
+
+impl RiscvIRQHandler for InterruptPins {
+    fn handle_irq(&self, interrupt: Interrupt, level: bool) {
+        match interrupt {
+            Interrupt::MachineTimer
+            | Interrupt::MachineExternal
+            | Interrupt::SupervisorExternal
+            | Interrupt::MachineSoft => {}
             _ => {
                 todo!("IRQ handling not implemented yet.")
             }
         }
+
+        let code: WordType = interrupt.into();
+        let bit = 1u64 << code;
+        if level {
+            self.levels.fetch_or(bit, Ordering::Release);
+        } else {
+            self.levels.fetch_and(!bit, Ordering::Release);
+        }
+        self.changed.fetch_or(bit, Ordering::Release);
     }
 }
 
@@ -1076,6 +1703,61 @@ mod tests {
         assert_eq!(val, (CNT * 2) as u64);
     }
 
+    #[test]
+    fn test_step_block() {
+        let mut cpu = TestCPUBuilder::new()
+            .reg(3, 3)
+            .program(&[
+                0x00108093, // label: addi x1, x1, 1
+                0x00210113, // addi x2, x2, 2
+                0xfe309ce3, // bne x1, x3, label
+            ])
+            .build();
+
+        for _ in 0..3 {
+            assert_eq!(cpu.step_block().unwrap(), 3);
+        }
+
+        CPUChecker::new(&mut cpu)
+            .reg(1, 3)
+            .reg(2, 6)
+            .pc(ram_config::BASE_ADDR + 12)
+            .csr(Mcycle::get_index(), 9)
+            .csr(Minstret::get_index(), 9);
+
+        // Translated blocks are dropped once their page is written, without `fence.i`.
+        cpu.memory
+            .write(ram_config::BASE_ADDR, 0x00508093u32, &mut cpu.csr) // addi x1, x1, 5
+            .unwrap();
+        cpu.pc = ram_config::BASE_ADDR;
+
+        assert_eq!(cpu.step_block().unwrap(), 3);
+        CPUChecker::new(&mut cpu)
+            .reg(1, 8)
+            .reg(2, 8)
+            .pc(ram_config::BASE_ADDR);
+    }
+
+    #[test]
+    fn test_minstret_write_replaces_count() {
+        let mut cpu = TestCPUBuilder::new()
+            .reg(5, 100)
+            .program(&[
+                0x00108093, // addi x1, x1, 1
+                0xb0229073, // csrw minstret, x5
+                0x00108093, // addi x1, x1, 1
+            ])
+            .build();
+
+        for _ in 0..3 {
+            cpu.step().unwrap();
+        }
+
+        CPUChecker::new(&mut cpu)
+            .csr(Mcycle::get_index(), 3)
+            .csr(Minstret::get_index(), 101);
+    }
+
     #[test]
     fn test_vector_config() {
         run_test_exec(
@@ -4,9 +4,7 @@ use std::sync::atomic::{self, Ordering};
 use crate::utils::WordTrait;
 use crate::{
     config::arch_config::WordType,
-    isa::riscv::{
-        csr_reg::csr_macro::Minstret, executor::RVCPU, instruction::RVInstrInfo, trap::Exception,
-    },
+    isa::riscv::{executor::RVCPU, instruction::RVInstrInfo, trap::Exception},
     utils::{TruncateFrom, UnsignedInteger},
 };
 
@@ -269,7 +267,6 @@ where
     cpu.reg_file.write(rd, res);
 
     cpu.pc = cpu.pc.wrapping_add(4);
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
 
     Ok(())
 }
@@ -308,7 +305,6 @@ where
 
     cpu.reg_file.write(rd, res);
     cpu.pc = cpu.pc.wrapping_add(4);
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -335,7 +331,6 @@ where
 
         cpu.reg_file.write(rd, if success { 0 } else { 1 });
         cpu.pc = cpu.pc.wrapping_add(4);
-        cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
         Ok(())
     } else {
         unreachable!()
@@ -5,7 +5,6 @@ use crate::{
     config::arch_config::WordType,
     debug_unreachable,
     isa::riscv::{
-        csr_reg::csr_macro::Minstret,
         executor::RVCPU,
         instruction::{
             RVInstrInfo,
@@ -56,7 +55,6 @@ where
         debug_unreachable!();
     }
 
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -73,7 +71,6 @@ pub(super) fn exec_compress_jump<const LINK: bool>(
     }
     cpu.pc = target;
 
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -97,7 +94,6 @@ pub(super) fn exec_compress_jump_reg<const LINK: bool>(
     if LINK {
         cpu.reg_file.write(1, t);
     }
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -5,7 +5,7 @@ use crate::{
 };
 
 #[inline(always)]
-pub(super) fn handle_load<T, const EXTEND: bool>(
+pub(in crate::isa::riscv) fn handle_load<T, const EXTEND: bool>(
     cpu: &mut RVCPU,
     rd: u8,
     addr: WordType,
@@ -53,7 +53,7 @@ where
 }
 
 #[inline(always)]
-pub(super) fn handle_store<T>(
+pub(in crate::isa::riscv) fn handle_store<T>(
     cpu: &mut RVCPU,
     addr: WordType,
     data: WordType,
@@ -91,7 +91,6 @@ where
         std::unreachable!();
     }
 
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -160,8 +159,8 @@ pub(super) fn exec_csrw<const UIMM: bool>(
 
         cpu.write_csr(imm, new_val)?;
 
-        if imm != Minstret::get_index() {
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
+        if imm == Minstret::get_index() {
+            cpu.uncount_instr();
         }
     }
 
@@ -203,8 +202,8 @@ pub(super) fn exec_csr_bit<const SET: bool, const UIMM: bool>(
         let data = if SET { value | rhs } else { value & !rhs };
         cpu.write_csr(imm, data)?;
 
-        if imm != Minstret::get_index() {
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
+        if imm == Minstret::get_index() {
+            cpu.uncount_instr();
         }
     }
 
@@ -4,14 +4,11 @@ use crate::{
     isa::{
         DebugTarget,
         riscv::{
-            csr_reg::{
-                PrivilegeLevel,
-                csr_macro::{Minstret, Mstatus},
-            },
+            csr_reg::{PrivilegeLevel, csr_macro::Mstatus},
             executor::RVCPU,
             instruction::{
                 RVInstrInfo, exec_atomic_function::*, exec_compress_function::*, exec_function::*,
-                exec_vector_function::*, instr_table::RiscvInstr,
+                exec_vector_function::*, instr_table::RiscvInstr, normal_exec,
             },
             trap::{Exception, trap_controller::TrapController},
             vector::arithmetic::*,
@@ -100,7 +97,6 @@ pub(in crate::isa::riscv) fn get_exec_func(
             } else {
                 std::unreachable!();
             }
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
@@ -118,7 +114,6 @@ pub(in crate::isa::riscv) fn get_exec_func(
                 std::unreachable!();
             }
 
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
@@ -126,7 +121,6 @@ pub(in crate::isa::riscv) fn get_exec_func(
             if let RVInstrInfo::U { rd, imm } = inst_info {
                 cpu.reg_file.write(rd, cpu.pc.wrapping_add(imm)); // imm has been sign_extended
                 cpu.pc = cpu.pc.wrapping_add(4);
-                cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
                 Ok(())
             } else {
                 std::unreachable!();
@@ -137,7 +131,6 @@ pub(in crate::isa::riscv) fn get_exec_func(
             if let RVInstrInfo::U { rd, imm } = inst_info {
                 cpu.reg_file.write(rd, imm); // imm has been sign_extended
                 cpu.pc = cpu.pc.wrapping_add(4);
-                cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
                 Ok(())
             } else {
                 std::unreachable!();
@@ -155,11 +148,10 @@ pub(in crate::isa::riscv) fn get_exec_func(
         // We are executing in order, so don't need to do anything.
         RiscvInstr::FENCE => exec_nop,
 
+        // Writes to decoded code are tracked by RAM, and picked up before the next instruction,
+        // since `FENCE.I` always ends a block.
         RiscvInstr::FENCE_I => |_info, cpu| {
-            cpu.flush_icache();
-            cpu.flush_tlb();
             cpu.pc = cpu.pc.wrapping_add(4);
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
@@ -176,10 +168,14 @@ pub(in crate::isa::riscv) fn get_exec_func(
             }
             TrapController::mret(cpu);
 
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
-        RiscvInstr::WFI => exec_nop,
+        RiscvInstr::WFI => |_info, cpu| {
+            normal_exec(cpu, |cpu| {
+                cpu.wait_for_interrupt();
+                Ok(())
+            })
+        },
 
         //---------------------------------------
         // RV_F
@@ -320,7 +316,6 @@ pub(in crate::isa::riscv) fn get_exec_func(
             }
 
             cpu.pc = cpu.pc.wrapping_add(4);
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
@@ -338,11 +333,10 @@ pub(in crate::isa::riscv) fn get_exec_func(
             }
 
             TrapController::sret(cpu);
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
-        RiscvInstr::SFENCE_VMA => |_info, cpu| {
+        RiscvInstr::SFENCE_VMA => |info, cpu| {
             if cpu.get_current_privilege() < PrivilegeLevel::S {
                 return Err(Exception::IllegalInstruction);
             }
@@ -352,11 +346,12 @@ pub(in crate::isa::riscv) fn get_exec_func(
                 return Err(Exception::IllegalInstruction);
             }
 
-            cpu.memory.flush_tlb();
-            cpu.flush_icache();
+            let RVInstrInfo::R { rs1, rs2, .. } = info else {
+                unreachable!()
+            };
+            cpu.fence_vma(rs1, rs2);
 
             cpu.write_pc(cpu.pc.wrapping_add(4));
-            cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
             Ok(())
         },
 
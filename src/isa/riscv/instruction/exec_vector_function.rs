@@ -215,7 +215,7 @@ fn do_vector_unit_stride_load<const EEW: u8>(
                     !vm,
                     vstart,
                     base_addr,
-                    &mut cpu.memory.mmio,
+                    &mut cpu.memory.vector_memory(),
                 );
             }
             // unit-stride, whole register load
@@ -223,14 +223,20 @@ fn do_vector_unit_stride_load<const EEW: u8>(
                 if (mop, vm) != (0b00, true) {
                     return Err(Exception::IllegalInstruction);
                 }
-                res = vector.load_whole_register(vd, nf, vstart, base_addr, &mut cpu.memory.mmio);
+                res = vector.load_whole_register(
+                    vd,
+                    nf,
+                    vstart,
+                    base_addr,
+                    &mut cpu.memory.vector_memory(),
+                );
             }
             // unit-stride, mask load, EEW=8
             0b01011 => {
                 if EEW != 0 || (nf, mew, mop, vm) != (0, 0, 0b00, true) {
                     return Err(Exception::IllegalInstruction);
                 }
-                res = vector.mask_load(vd, vstart, base_addr, &mut cpu.memory.mmio);
+                res = vector.mask_load(vd, vstart, base_addr, &mut cpu.memory.vector_memory());
             }
             // unit-stride fault-only-first
             0b10000 => unimplemented!(),
@@ -277,7 +283,7 @@ fn do_vector_constant_stride_load<const EEW: u8>(
             !vm,
             vstart,
             base_addr,
-            &mut cpu.memory.mmio,
+            &mut cpu.memory.vector_memory(),
         );
 
         finish_vector_memory_access(cpu, res)
@@ -312,7 +318,7 @@ fn do_vector_indexed_ordered_load<const EEW: u8>(
             !vm,
             vstart,
             base_addr,
-            &mut cpu.memory.mmio,
+            &mut cpu.memory.vector_memory(),
         );
 
         finish_vector_memory_access(cpu, res)
@@ -370,7 +376,7 @@ fn do_vector_unit_stride_store<const EEW: u8>(
                     !vm,
                     vstart,
                     base_addr,
-                    &mut cpu.memory.mmio,
+                    &mut cpu.memory.vector_memory(),
                 );
             }
             // unit-stride, whole register store
@@ -378,14 +384,20 @@ fn do_vector_unit_stride_store<const EEW: u8>(
                 if (mew, mop, vm) != (0, 0b00, true) {
                     return Err(Exception::IllegalInstruction);
                 }
-                res = vector.store_whole_register(vs3, nf, vstart, base_addr, &mut cpu.memory.mmio);
+                res = vector.store_whole_register(
+                    vs3,
+                    nf,
+                    vstart,
+                    base_addr,
+                    &mut cpu.memory.vector_memory(),
+                );
             }
             // unit-stride, mask store, EEW=8
             0b01011 => {
                 if EEW != 0 || (nf, mew, mop, vm) != (0, 0, 0b00, true) {
                     return Err(Exception::IllegalInstruction);
                 }
-                res = vector.mask_store(vs3, vstart, base_addr, &mut cpu.memory.mmio);
+                res = vector.mask_store(vs3, vstart, base_addr, &mut cpu.memory.vector_memory());
             }
             _ => return Err(Exception::IllegalInstruction),
         }
@@ -430,7 +442,7 @@ fn do_vector_constant_stride_store<const EEW: u8>(
             !vm,
             vstart,
             base_addr,
-            &mut cpu.memory.mmio,
+            &mut cpu.memory.vector_memory(),
         );
 
         finish_vector_memory_access(cpu, res)
@@ -465,7 +477,7 @@ fn do_vector_indexed_ordered_store<const EEW: u8>(
             !vm,
             vstart,
             base_addr,
-            &mut cpu.memory.mmio,
+            &mut cpu.memory.vector_memory(),
         );
 
         finish_vector_memory_access(cpu, res)
@@ -1464,7 +1476,7 @@ pub(super) fn vec_integer_spec_op<const VINSTR: usize>(
 
 #[cfg(test)]
 mod test {
-    use std::{cell::UnsafeCell, rc::Rc};
+    use std::sync::Arc;
 
     use crate::{
         device::mmio::MemoryMapIO,
@@ -1676,15 +1688,10 @@ mod test {
         const TEST_VSEW: Vsew = Vsew::E32;
         const TEST_VLMUL: Vlmul = Vlmul::M8;
         type ElemType = u32;
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         for i in 0..TOTAL_DATA_LEN {
             let addr = TEST_DATA_ADDR_OFFSET + i * size_of::<ElemType>() as WordType;
-            unsafe {
-                ram_ref
-                    .as_mut_unchecked()
-                    .write(addr, i as ElemType + 1)
-                    .unwrap();
-            }
+            ram_ref.write(addr, i as ElemType + 1).unwrap();
         }
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
@@ -1744,17 +1751,14 @@ mod test {
     fn mask_load_uses_ceil_vl_over_8_bytes_and_restores_config() {
         let base_addr = TEST_DATA_BASE + 0x500;
         let initial = vec![0xffu8; VLEN_BYTE * Vlmul::M4.get_lmul() as usize];
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         for (i, value) in [0b1010_0101u8, 0b0001_0011u8, 0xeeu8]
             .into_iter()
             .enumerate()
         {
-            unsafe {
-                ram_ref
-                    .as_mut_unchecked()
-                    .write(TEST_DATA_ADDR_OFFSET + 0x500 + i as WordType, value)
-                    .unwrap();
-            }
+            ram_ref
+                .write(TEST_DATA_ADDR_OFFSET + 0x500 + i as WordType, value)
+                .unwrap();
         }
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
@@ -1766,7 +1770,7 @@ mod test {
             .write_as_type::<u8>(Vlmul::M4.get_lmul(), 8, &initial);
 
         cpu.vector
-            .mask_load(8, 0, base_addr, &mut cpu.memory.mmio)
+            .mask_load(8, 0, base_addr, &mut cpu.memory.vector_memory())
             .unwrap();
 
         let got = cpu.vector.read_as_type::<u8>(8).unwrap();
@@ -1858,15 +1862,10 @@ mod test {
         const TEST_VLMUL: Vlmul = Vlmul::M8;
         const STRIDE: WordType = (size_of::<u32>() as WordType) * 2;
         type ElemType = u32;
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         for i in 0..TOTAL_DATA_LEN {
             let addr = TEST_DATA_ADDR_OFFSET + i * STRIDE;
-            unsafe {
-                ram_ref
-                    .as_mut_unchecked()
-                    .write(addr, i as ElemType + 1)
-                    .unwrap();
-            }
+            ram_ref.write(addr, i as ElemType + 1).unwrap();
         }
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
@@ -1907,7 +1906,7 @@ mod test {
         const TEST_SEG: usize = 2;
         type ElemType = u32;
 
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         let index_base = TEST_DATA_BASE;
         let data_base = TEST_DATA_BASE + 0x4000;
 
@@ -1977,7 +1976,7 @@ mod test {
         const TEST_VSEW: Vsew = Vsew::E32;
         const TEST_VLMUL: Vlmul = Vlmul::M8;
         type ElemType = u32;
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
         cpu.csr.get_by_type_existing::<Mstatus>().set_fs(1);
@@ -2044,14 +2043,11 @@ mod test {
     #[test]
     fn mask_store_uses_ceil_vl_over_8_bytes_and_restores_config() {
         let base_addr = TEST_DATA_BASE + 0x700;
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         for i in 0..3 {
-            unsafe {
-                ram_ref
-                    .as_mut_unchecked()
-                    .write(TEST_DATA_ADDR_OFFSET + 0x700 + i as WordType, 0xeeu8)
-                    .unwrap();
-            }
+            ram_ref
+                .write(TEST_DATA_ADDR_OFFSET + 0x700 + i as WordType, 0xeeu8)
+                .unwrap();
         }
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
@@ -2065,7 +2061,7 @@ mod test {
             .write_as_type::<u8>(Vlmul::M4.get_lmul(), 8, &source);
 
         cpu.vector
-            .mask_store(8, 0, base_addr, &mut cpu.memory.mmio)
+            .mask_store(8, 0, base_addr, &mut cpu.memory.vector_memory())
             .unwrap();
 
         assert_eq!(
@@ -2132,7 +2128,7 @@ mod test {
         const TEST_VLMUL: Vlmul = Vlmul::M8;
         const STRIDE: WordType = (size_of::<u32>() as WordType) * 2;
         type ElemType = u32;
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         let mmio = MemoryMapIO::from_mmio_items(ram_ref.clone(), vec![]);
         let mut cpu = RVCPU::from_vaddr_manager(VirtAddrManager::from_ram_and_mmio(ram_ref, mmio));
         cpu.csr.get_by_type_existing::<Mstatus>().set_fs(1);
@@ -2175,7 +2171,7 @@ mod test {
         const TEST_VLMUL: Vlmul = Vlmul::M1;
         type ElemType = u32;
 
-        let ram_ref = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram_ref = Arc::new(Ram::new());
         let index_base = TEST_DATA_BASE;
         let data_base = TEST_DATA_BASE + 0x1000;
 
@@ -1,6 +1,6 @@
 mod exec_atomic_function;
 mod exec_compress_function;
-mod exec_core;
+pub(super) mod exec_core;
 mod exec_float_function;
 mod exec_vector_function;
 
@@ -14,7 +14,7 @@ use crate::{
         self,
         csr_reg::{
             NamedCsrReg,
-            csr_macro::{Minstret, Misa, Mstatus, Vstart},
+            csr_macro::{Misa, Mstatus, Vstart},
         },
         executor::RVCPU,
         instruction::exec_function::save_fflags_to_cpu,
@@ -33,7 +33,7 @@ pub(super) fn check_jump_alignment(cpu: &mut RVCPU, target: WordType) -> Result<
 /// A helper function for normal instruction execution.
 ///
 /// It takes a closure `f` that performs the actual instruction logic.
-/// If `f` executes successfully, it will increase PC by 4 and increase the Minstret CSR by 1.
+/// If `f` executes successfully, it will increase PC by 4.
 ///
 /// Don't use this for C extension.
 #[inline(always)]
@@ -43,7 +43,6 @@ where
 {
     f(cpu)?;
     cpu.pc = cpu.pc.wrapping_add(4);
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -55,7 +54,6 @@ where
 {
     f(cpu)?;
     cpu.pc = cpu.pc.wrapping_add(2);
-    cpu.csr.get_by_type_existing::<Minstret>().wrapping_add(1);
     Ok(())
 }
 
@@ -0,0 +1,512 @@
+//! The few x86-64 instructions the JIT emits, encoded by hand.
+//!
+//! Every instruction takes its operands as [`Reg`]s and [`Mem`]s and picks the shortest encoding
+//! of them, jumps go to [`Label`]s patched by [`Assembler::finish`].
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub(super) enum Reg {
+    Rax = 0,
+    Rcx,
+    Rdx,
+    Rbx,
+    Rsp,
+    Rbp,
+    Rsi,
+    Rdi,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+}
+
+impl Reg {
+    #[inline]
+    fn low(self) -> u8 {
+        self as u8 & 0b111
+    }
+
+    #[inline]
+    fn is_extended(self) -> bool {
+        self as u8 >= 8
+    }
+}
+
+/// `[base + index * scale + disp]`
+#[derive(Debug, Clone, Copy)]
+pub(super) struct Mem {
+    base: Reg,
+    index: Option<(Reg, u8)>,
+    disp: i32,
+}
+
+impl Mem {
+    pub(super) fn base(base: Reg, disp: i32) -> Self {
+        Self {
+            base,
+            index: None,
+            disp,
+        }
+    }
+
+    pub(super) fn indexed(base: Reg, index: Reg, scale: u8, disp: i32) -> Self {
+        debug_assert!(index != Reg::Rsp && matches!(scale, 1 | 2 | 4 | 8));
+        Self {
+            base,
+            index: Some((index, scale)),
+            disp,
+        }
+    }
+}
+
+#[derive(Clone, Copy)]
+enum Rm {
+    Reg(Reg),
+    Mem(Mem),
+}
+
+/// The condition codes used, with their `Jcc`/`SETcc`/`CMOVcc` encoding.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub(super) enum Cond {
+    /// Unsigned less than, also the carry flag set.
+    B = 0x2,
+    /// Unsigned greater or equal.
+    AE = 0x3,
+    E = 0x4,
+    NE = 0x5,
+    L = 0xc,
+    GE = 0xd,
+}
+
+/// The binary ALU ops, by their `r/m, r` opcode, the `r/m, imm` one takes `opcode >> 3` as `/digit`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub(super) enum Alu {
+    Add = 0x01,
+    Or = 0x09,
+    And = 0x21,
+    Sub = 0x29,
+    Xor = 0x31,
+    Cmp = 0x39,
+}
+
+/// The shifts, by their `/digit`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub(super) enum Shift {
+    Shl = 4,
+    Shr = 5,
+    Sar = 7,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(super) struct Label(usize);
+
+pub(super) struct Assembler {
+    code: Vec<u8>,
+    /// Where each label is bound.
+    labels: Vec<Option<usize>>,
+    /// The `rel32` fields to patch, with the label they point to.
+    fixups: Vec<(usize, Label)>,
+}
+
+impl Assembler {
+    pub(super) fn new() -> Self {
+        Self {
+            code: Vec::new(),
+            labels: Vec::new(),
+            fixups: Vec::new(),
+        }
+    }
+
+    pub(super) fn new_label(&mut self) -> Label {
+        self.labels.push(None);
+        Label(self.labels.len() - 1)
+    }
+
+    pub(super) fn bind(&mut self, label: Label) {
+        debug_assert!(self.labels[label.0].is_none(), "label bound twice");
+        self.labels[label.0] = Some(self.code.len());
+    }
+
+    /// The machine code, with every jump patched to its label.
+    pub(super) fn finish(mut self) -> Vec<u8> {
+        for (at, label) in std::mem::take(&mut self.fixups) {
+            let target = self.labels[label.0].expect("jump to an unbound label");
+            let rel = target as i64 - (at as i64 + 4);
+            self.code[at..at + 4].copy_from_slice(&(rel as i32).to_le_bytes());
+        }
+        self.code
+    }
+
+    /// An instruction with a ModRM byte, `reg` being a register or an opcode extension.
+    fn emit_modrm(&mut self, prefix_66: bool, wide: bool, opcode: &[u8], reg: u8, rm: Rm) {
+        if prefix_66 {
+            self.code.push(0x66);
+        }
+
+        let (b, x) = match rm {
+            Rm::Reg(rm) => (rm.is_extended(), false),
+            Rm::Mem(mem) => (
+                mem.base.is_extended(),
+                mem.index.is_some_and(|(index, _)| index.is_extended()),
+            ),
+        };
+        let rex = 0x40 | (wide as u8) << 3 | ((reg >= 8) as u8) << 2 | (x as u8) << 1 | b as u8;
+        if rex != 0x40 {
+            self.code.push(rex);
+        }
+        self.code.extend_from_slice(opcode);
+
+        let reg = (reg & 0b111) << 3;
+        let mem = match rm {
+            Rm::Reg(rm) => {
+                self.code.push(0b11 << 6 | reg | rm.low());
+                return;
+            }
+            Rm::Mem(mem) => mem,
+        };
+
+        // `rbp` and `r13` as a base always take a displacement.
+        let mode = if mem.disp == 0 && mem.base.low() != Reg::Rbp.low() {
+            0b00
+        } else if i8::try_from(mem.disp).is_ok() {
+            0b01
+        } else {
+            0b10
+        };
+
+        // `rsp` and `r12` as a base, or an index, take a SIB byte.
+        match mem.index {
+            None if mem.base.low() != Reg::Rsp.low() => {
+                self.code.push(mode << 6 | reg | mem.base.low());
+            }
+            index => {
+                self.code.push(mode << 6 | reg | 0b100);
+                let (index, scale) =
+                    index.map_or((0b100, 1), |(index, scale)| (index.low(), scale));
+                self.code
+                    .push((scale.trailing_zeros() as u8) << 6 | index << 3 | mem.base.low());
+            }
+        }
+
+        match mode {
+            0b01 => self.code.push(mem.disp as i8 as u8),
+            0b10 => self.code.extend_from_slice(&mem.disp.to_le_bytes()),
+            _ => {}
+        }
+    }
+
+    fn emit_imm32(&mut self, imm: i32) {
+        self.code.extend_from_slice(&imm.to_le_bytes());
+    }
+
+    /// An instruction with the register in the opcode byte, like `push` and `mov r, imm`.
+    fn emit_plus_reg(&mut self, wide: bool, opcode: u8, reg: Reg) {
+        let rex = 0x40 | (wide as u8) << 3 | reg.is_extended() as u8;
+        if rex != 0x40 {
+            self.code.push(rex);
+        }
+        self.code.push(opcode + reg.low());
+    }
+
+    pub(super) fn push(&mut self, reg: Reg) {
+        self.emit_plus_reg(false, 0x50, reg);
+    }
+
+    pub(super) fn pop(&mut self, reg: Reg) {
+        self.emit_plus_reg(false, 0x58, reg);
+    }
+
+    pub(super) fn ret(&mut self) {
+        self.code.push(0xc3);
+    }
+
+    pub(super) fn call(&mut self, target: Reg) {
+        self.emit_modrm(false, false, &[0xff], 2, Rm::Reg(target));
+    }
+
+    pub(super) fn jmp(&mut self, label: Label) {
+        self.code.push(0xe9);
+        self.fixups.push((self.code.len(), label));
+        self.emit_imm32(0);
+    }
+
+    pub(super) fn jcc(&mut self, cond: Cond, label: Label) {
+        self.code.extend_from_slice(&[0x0f, 0x80 | cond as u8]);
+        self.fixups.push((self.code.len(), label));
+        self.emit_imm32(0);
+    }
+
+    pub(super) fn mov(&mut self, dst: Reg, src: Reg) {
+        self.emit_modrm(false, true, &[0x89], src as u8, Rm::Reg(dst));
+    }
+
+    /// `dst = imm`, in the shortest of the zero-extended, sign-extended and full encodings.
+    ///
+    /// Unlike `xor dst, dst`, it leaves the flags alone.
+    pub(super) fn mov_imm(&mut self, dst: Reg, imm: u64) {
+        if let Ok(imm) = u32::try_from(imm) {
+            self.emit_plus_reg(false, 0xb8, dst);
+            self.code.extend_from_slice(&imm.to_le_bytes());
+        } else if let Ok(imm) = i32::try_from(imm as i64) {
+            self.emit_modrm(false, true, &[0xc7], 0, Rm::Reg(dst));
+            self.emit_imm32(imm);
+        } else {
+            self.emit_plus_reg(true, 0xb8, dst);
+            self.code.extend_from_slice(&imm.to_le_bytes());
+        }
+    }
+
+    /// A 64-bit load.
+    pub(super) fn load(&mut self, dst: Reg, src: Mem) {
+        self.emit_modrm(false, true, &[0x8b], dst as u8, Rm::Mem(src));
+    }
+
+    /// A 64-bit store.
+    pub(super) fn store(&mut self, dst: Mem, src: Reg) {
+        self.emit_modrm(false, true, &[0x89], src as u8, Rm::Mem(dst));
+    }
+
+    /// Load `size` bytes into the whole of `dst`, sign or zero-extended.
+    pub(super) fn load_extend(&mut self, dst: Reg, src: Mem, size: usize, signed: bool) {
+        let (wide, opcode): (bool, &[u8]) = match (size, signed) {
+            (1, true) => (true, &[0x0f, 0xbe]),
+            (1, false) => (false, &[0x0f, 0xb6]),
+            (2, true) => (true, &[0x0f, 0xbf]),
+            (2, false) => (false, &[0x0f, 0xb7]),
+            (4, true) => (true, &[0x63]),
+            (4, false) => (false, &[0x8b]),
+            (8, _) => (true, &[0x8b]),
+            _ => unreachable!("no load of {} bytes", size),
+        };
+        self.emit_modrm(false, wide, opcode, dst as u8, Rm::Mem(src));
+    }
+
+    /// Store the low `size` bytes of `src`.
+    pub(super) fn store_truncate(&mut self, dst: Mem, src: Reg, size: usize) {
+        // Only `al`, `cl`, `dl` and `bl` are stored as bytes, the others would need a REX prefix.
+        debug_assert!(size != 1 || (src as u8) < 4);
+        let (prefix_66, wide, opcode) = match size {
+            1 => (false, false, 0x88),
+            2 => (true, false, 0x89),
+            4 => (false, false, 0x89),
+            8 => (false, true, 0x89),
+            _ => unreachable!("no store of {} bytes", size),
+        };
+        self.emit_modrm(prefix_66, wide, &[opcode], src as u8, Rm::Mem(dst));
+    }
+
+    /// `dst = dst op src` on 64 bits, or 32 bits zero-extended if not `wide`.
+    pub(super) fn alu(&mut self, op: Alu, wide: bool, dst: Reg, src: Reg) {
+        self.emit_modrm(false, wide, &[op as u8], src as u8, Rm::Reg(dst));
+    }
+
+    /// `dst = dst op imm` on 64 bits with `imm` sign-extended, or 32 bits if not `wide`.
+    pub(super) fn alu_imm(&mut self, op: Alu, wide: bool, dst: Reg, imm: i32) {
+        if let Ok(imm) = i8::try_from(imm) {
+            self.emit_modrm(false, wide, &[0x83], op as u8 >> 3, Rm::Reg(dst));
+            self.code.push(imm as u8);
+        } else {
+            self.emit_modrm(false, wide, &[0x81], op as u8 >> 3, Rm::Reg(dst));
+            self.emit_imm32(imm);
+        }
+    }
+
+    /// Compare the 64 bits at `lhs` with `rhs`.
+    pub(super) fn cmp_mem(&mut self, lhs: Mem, rhs: Reg) {
+        self.emit_modrm(false, true, &[Alu::Cmp as u8], rhs as u8, Rm::Mem(lhs));
+    }
+
+    /// Compare the 32 bits at `lhs` with `imm`.
+    pub(super) fn cmp_mem32_imm8(&mut self, lhs: Mem, imm: i8) {
+        self.emit_modrm(false, false, &[0x83], Alu::Cmp as u8 >> 3, Rm::Mem(lhs));
+        self.code.push(imm as u8);
+    }
+
+    /// Set the flags from the byte at `lhs` and `imm`.
+    pub(super) fn test_mem8_imm(&mut self, lhs: Mem, imm: u8) {
+        self.emit_modrm(false, false, &[0xf6], 0, Rm::Mem(lhs));
+        self.code.push(imm);
+    }
+
+    /// Set the flags from the low 32 bits of `lhs` and `imm`.
+    pub(super) fn test_imm32(&mut self, lhs: Reg, imm: u32) {
+        self.emit_modrm(false, false, &[0xf7], 0, Rm::Reg(lhs));
+        self.code.extend_from_slice(&imm.to_le_bytes());
+    }
+
+    /// Shift `dst` by `cl`, masked to 6 bits when `wide`, to 5 bits otherwise.
+    pub(super) fn shift_cl(&mut self, shift: Shift, wide: bool, dst: Reg) {
+        self.emit_modrm(false, wide, &[0xd3], shift as u8, Rm::Reg(dst));
+    }
+
+    pub(super) fn shift_imm(&mut self, shift: Shift, wide: bool, dst: Reg, amount: u8) {
+        self.emit_modrm(false, wide, &[0xc1], shift as u8, Rm::Reg(dst));
+        self.code.push(amount);
+    }
+
+    /// `dst = dst * src`, the low bits.
+    pub(super) fn imul(&mut self, wide: bool, dst: Reg, src: Reg) {
+        self.emit_modrm(false, wide, &[0x0f, 0xaf], dst as u8, Rm::Reg(src));
+    }
+
+    /// `dst = src * imm` on 32 bits.
+    pub(super) fn imul_imm8(&mut self, dst: Reg, src: Reg, imm: i8) {
+        self.emit_modrm(false, false, &[0x6b], dst as u8, Rm::Reg(src));
+        self.code.push(imm as u8);
+    }
+
+    /// `rdx:rax = rax * src`, signed or not.
+    pub(super) fn mul_wide(&mut self, signed: bool, src: Reg) {
+        self.emit_modrm(
+            false,
+            true,
+            &[0xf7],
+            if signed { 5 } else { 4 },
+            Rm::Reg(src),
+        );
+    }
+
+    /// `dst = sign-extended low 32 bits of src`
+    pub(super) fn movsxd(&mut self, dst: Reg, src: Reg) {
+        self.emit_modrm(false, true, &[0x63], dst as u8, Rm::Reg(src));
+    }
+
+    /// `dst = cond as u64`, `dst` being one of `rax`, `rcx`, `rdx` and `rbx`.
+    pub(super) fn set(&mut self, cond: Cond, dst: Reg) {
+        debug_assert!((dst as u8) < 4);
+        self.emit_modrm(false, false, &[0x0f, 0x90 | cond as u8], 0, Rm::Reg(dst));
+        // movzx dst, dst8
+        self.emit_modrm(false, false, &[0x0f, 0xb6], dst as u8, Rm::Reg(dst));
+    }
+
+    pub(super) fn cmov(&mut self, cond: Cond, dst: Reg, src: Reg) {
+        self.emit_modrm(
+            false,
+            true,
+            &[0x0f, 0x40 | cond as u8],
+            dst as u8,
+            Rm::Reg(src),
+        );
+    }
+
+    /// Copy the bit `bit % 64` of `bits` into the carry flag.
+    pub(super) fn bt(&mut self, bits: Reg, bit: Reg) {
+        self.emit_modrm(false, true, &[0x0f, 0xa3], bit as u8, Rm::Reg(bits));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn encode(f: impl FnOnce(&mut Assembler)) -> Vec<u8> {
+        let mut asm = Assembler::new();
+        f(&mut asm);
+        asm.finish()
+    }
+
+    #[test]
+    fn test_encode_memory_operands() {
+        // mov rax, [rbx + 8]
+        assert_eq!(
+            encode(|asm| asm.load(Reg::Rax, Mem::base(Reg::Rbx, 8))),
+            [0x48, 0x8b, 0x43, 0x08]
+        );
+        // mov [rbx + 0x100], rcx
+        assert_eq!(
+            encode(|asm| asm.store(Mem::base(Reg::Rbx, 0x100), Reg::Rcx)),
+            [0x48, 0x89, 0x8b, 0x00, 0x01, 0x00, 0x00]
+        );
+        // mov rbx, [r12]: a SIB byte for r12.
+        assert_eq!(
+            encode(|asm| asm.load(Reg::Rbx, Mem::base(Reg::R12, 0))),
+            [0x49, 0x8b, 0x1c, 0x24]
+        );
+        // cmp dword [rbp], 0: a displacement for rbp.
+        assert_eq!(
+            encode(|asm| asm.cmp_mem32_imm8(Mem::base(Reg::Rbp, 0), 0)),
+            [0x83, 0x7d, 0x00, 0x00]
+        );
+        // movzx eax, word [r14 + rax]
+        assert_eq!(
+            encode(|asm| asm.load_extend(
+                Reg::Rax,
+                Mem::indexed(Reg::R14, Reg::Rax, 1, 0),
+                2,
+                false
+            )),
+            [0x41, 0x0f, 0xb7, 0x04, 0x06]
+        );
+        // mov rdx, [r15 + rdx * 8]
+        assert_eq!(
+            encode(|asm| asm.load(Reg::Rdx, Mem::indexed(Reg::R15, Reg::Rdx, 8, 0))),
+            [0x49, 0x8b, 0x14, 0xd7]
+        );
+        // mov [r14 + rax], dx
+        assert_eq!(
+            encode(|asm| asm.store_truncate(Mem::indexed(Reg::R14, Reg::Rax, 1, 0), Reg::Rdx, 2)),
+            [0x66, 0x41, 0x89, 0x14, 0x06]
+        );
+        // test byte [r13 + rcx + 16], 2: r13 as a SIB base takes a displacement too.
+        assert_eq!(
+            encode(|asm| asm.test_mem8_imm(Mem::indexed(Reg::R13, Reg::Rcx, 1, 16), 2)),
+            [0x41, 0xf6, 0x44, 0x0d, 0x10, 0x02]
+        );
+    }
+
+    #[test]
+    fn test_encode_immediates() {
+        // mov eax, 1
+        assert_eq!(
+            encode(|asm| asm.mov_imm(Reg::Rax, 1)),
+            [0xb8, 0x01, 0x00, 0x00, 0x00]
+        );
+        // mov r9, -1
+        assert_eq!(
+            encode(|asm| asm.mov_imm(Reg::R9, u64::MAX)),
+            [0x49, 0xc7, 0xc1, 0xff, 0xff, 0xff, 0xff]
+        );
+        // mov rax, 0x1_0000_0000
+        assert_eq!(
+            encode(|asm| asm.mov_imm(Reg::Rax, 1 << 32)),
+            [0x48, 0xb8, 0, 0, 0, 0, 1, 0, 0, 0]
+        );
+        // add rsi, -8 and add rsi, 0x800
+        assert_eq!(
+            encode(|asm| asm.alu_imm(Alu::Add, true, Reg::Rsi, -8)),
+            [0x48, 0x83, 0xc6, 0xf8]
+        );
+        assert_eq!(
+            encode(|asm| asm.alu_imm(Alu::Add, true, Reg::Rsi, 0x800)),
+            [0x48, 0x81, 0xc6, 0x00, 0x08, 0x00, 0x00]
+        );
+    }
+
+    #[test]
+    fn test_encode_jumps() {
+        let code = encode(|asm| {
+            let back = asm.new_label();
+            let forward = asm.new_label();
+            asm.bind(back);
+            asm.jcc(Cond::NE, forward);
+            asm.jmp(back);
+            asm.bind(forward);
+            asm.ret();
+        });
+        assert_eq!(
+            code,
+            [
+                0x0f, 0x85, 0x05, 0x00, 0x00, 0x00, // jne forward
+                0xe9, 0xf5, 0xff, 0xff, 0xff, // jmp back
+                0xc3,
+            ]
+        );
+    }
+}
@@ -0,0 +1,419 @@
+//! Emits the [`JitOp`]s of a block as one x86-64 function, `extern "sysv64" fn(*mut JitFrame)`.
+//!
+//! The function pins what it works on to callee-saved registers, see [`REGS`] and the others, and
+//! computes in `rax`, `rcx`, `rdx` and `rsi`. The guest registers are read and written in the
+//! register file around every instruction, `x0` is never written.
+//!
+//! The slow paths of the loads and stores are emitted after the epilogue, out of the straight
+//! line, and jump back once done.
+
+use super::{
+    AluOp, BranchCond, EXIT_END, EXIT_EXCEPTION, EXIT_INTERPRET, JitFrame, JitOp, Operand,
+    asm::{Alu, Assembler, Cond, Label, Mem, Reg, Shift},
+    exit_code, load_slow, store_slow,
+};
+use crate::{
+    config::arch_config::WordType,
+    isa::riscv::mmu::{HostTlbLayout, config::PAGE_SIZE_XLEN},
+    ram::CODE_PAGE_XLEN,
+};
+
+/// The guest registers, see [`JitFrame::regs`].
+const REGS: Reg = Reg::Rbx;
+const FRAME: Reg = Reg::R12;
+const TLB: Reg = Reg::R13;
+const RAM: Reg = Reg::R14;
+const CODE_PAGES: Reg = Reg::R15;
+const RESERVED_MASK: Reg = Reg::Rbp;
+
+/// Saved by the prologue, in order.
+const SAVED: [Reg; 6] = [REGS, RESERVED_MASK, FRAME, TLB, RAM, CODE_PAGES];
+
+const PAGE_OFFSET_MASK: i32 = (1 << PAGE_SIZE_XLEN) - 1;
+
+/// A load or a store that missed the inline fast path, the address being in `rsi`.
+struct SlowPath {
+    entry: Label,
+    resume: Label,
+    /// Of the instruction, for its exception.
+    index: usize,
+    access: SlowAccess,
+}
+
+enum SlowAccess {
+    Load { size: usize, signed: bool, rd: u8 },
+    Store { size: usize, rs2: u8 },
+}
+
+struct Emitter {
+    asm: Assembler,
+    epilogue: Label,
+    slow_paths: Vec<SlowPath>,
+}
+
+/// The machine code of a block whose `ops` end with a jump, an [`JitOp::Interpret`], or fall
+/// through to `end_pc`.
+pub(super) fn emit(ops: &[JitOp], end_pc: WordType) -> Vec<u8> {
+    let mut asm = Assembler::new();
+    let epilogue = asm.new_label();
+    let mut emitter = Emitter {
+        asm,
+        epilogue,
+        slow_paths: Vec::new(),
+    };
+
+    emitter.prologue();
+    let mut ended = false;
+    for (index, &op) in ops.iter().enumerate() {
+        ended = emitter.op(index, op);
+        if ended {
+            break;
+        }
+    }
+    if !ended {
+        emitter.set_next_pc(end_pc);
+        emitter.exit(exit_code(EXIT_END, ops.len()));
+    }
+
+    emitter.epilogue();
+    for slow_path in std::mem::take(&mut emitter.slow_paths) {
+        emitter.slow_path(slow_path);
+    }
+    emitter.asm.finish()
+}
+
+fn reg_mem(reg: u8) -> Mem {
+    Mem::base(REGS, reg as i32 * size_of::<WordType>() as i32)
+}
+
+impl Emitter {
+    fn prologue(&mut self) {
+        for reg in SAVED {
+            self.asm.push(reg);
+        }
+        // Six registers and the return address pushed, the calls need the stack 16-byte aligned.
+        self.asm.alu_imm(Alu::Sub, true, Reg::Rsp, 8);
+
+        // The frame comes in `rdi`.
+        self.asm.mov(FRAME, Reg::Rdi);
+        self.asm.load(REGS, Mem::base(FRAME, JitFrame::REGS));
+        self.asm.load(TLB, Mem::base(FRAME, JitFrame::TLB));
+        self.asm.load(RAM, Mem::base(FRAME, JitFrame::RAM));
+        self.asm
+            .load(CODE_PAGES, Mem::base(FRAME, JitFrame::CODE_PAGES));
+        self.asm
+            .load(RESERVED_MASK, Mem::base(FRAME, JitFrame::RESERVED_MASK));
+    }
+
+    fn epilogue(&mut self) {
+        self.asm.bind(self.epilogue);
+        self.asm.alu_imm(Alu::Add, true, Reg::Rsp, 8);
+        for reg in SAVED.into_iter().rev() {
+            self.asm.pop(reg);
+        }
+        self.asm.ret();
+    }
+
+    /// Return `code`.
+    fn exit(&mut self, code: u32) {
+        self.asm.mov_imm(Reg::Rax, code as u64);
+        self.asm.jmp(self.epilogue);
+    }
+
+    fn set_next_pc(&mut self, pc: WordType) {
+        self.asm.mov_imm(Reg::Rax, pc);
+        self.asm
+            .store(Mem::base(FRAME, JitFrame::NEXT_PC), Reg::Rax);
+    }
+
+    fn read_reg(&mut self, dst: Reg, reg: u8) {
+        if reg == 0 {
+            self.asm.alu(Alu::Xor, false, dst, dst);
+        } else {
+            self.asm.load(dst, reg_mem(reg));
+        }
+    }
+
+    fn write_reg(&mut self, reg: u8, src: Reg) {
+        if reg != 0 {
+            self.asm.store(reg_mem(reg), src);
+        }
+    }
+
+    /// `dst += imm`
+    fn add_imm(&mut self, dst: Reg, imm: WordType) {
+        match i32::try_from(imm as i64) {
+            Ok(0) => {}
+            Ok(imm) => self.asm.alu_imm(Alu::Add, true, dst, imm),
+            Err(_) => {
+                self.asm.mov_imm(Reg::Rcx, imm);
+                self.asm.alu(Alu::Add, true, dst, Reg::Rcx);
+            }
+        }
+    }
+
+    /// Emit the instruction `index`, returns true if it ends the code.
+    fn op(&mut self, index: usize, op: JitOp) -> bool {
+        match op {
+            JitOp::Alu { op, rd, rs1, src2 } => self.alu(op, rd, rs1, src2),
+            JitOp::Const { rd, value } => {
+                if rd != 0 {
+                    self.asm.mov_imm(Reg::Rax, value);
+                    self.write_reg(rd, Reg::Rax);
+                }
+            }
+            JitOp::Load {
+                size,
+                signed,
+                rd,
+                rs1,
+                imm,
+            } => self.load(index, size, signed, rd, rs1, imm),
+            JitOp::Store {
+                size,
+                rs1,
+                rs2,
+                imm,
+            } => self.store(index, size, rs1, rs2, imm),
+            JitOp::Nop => {}
+
+            JitOp::Branch {
+                cond,
+                rs1,
+                rs2,
+                taken,
+                not_taken,
+            } => {
+                self.read_reg(Reg::Rax, rs1);
+                self.read_reg(Reg::Rcx, rs2);
+                self.asm.mov_imm(Reg::Rdx, not_taken);
+                self.asm.mov_imm(Reg::Rsi, taken);
+                self.asm.alu(Alu::Cmp, true, Reg::Rax, Reg::Rcx);
+                let cond = match cond {
+                    BranchCond::Eq => Cond::E,
+                    BranchCond::Ne => Cond::NE,
+                    BranchCond::Lt => Cond::L,
+                    BranchCond::Ge => Cond::GE,
+                    BranchCond::Ltu => Cond::B,
+                    BranchCond::Geu => Cond::AE,
+                };
+                self.asm.cmov(cond, Reg::Rdx, Reg::Rsi);
+                self.asm
+                    .store(Mem::base(FRAME, JitFrame::NEXT_PC), Reg::Rdx);
+                self.exit(exit_code(EXIT_END, index + 1));
+                return true;
+            }
+            JitOp::Jump { rd, link, target } => {
+                if rd != 0 {
+                    self.asm.mov_imm(Reg::Rax, link);
+                    self.write_reg(rd, Reg::Rax);
+                }
+                self.set_next_pc(target);
+                self.exit(exit_code(EXIT_END, index + 1));
+                return true;
+            }
+            JitOp::JumpReg { rd, rs1, link } => {
+                // The target is read before the link is written, `rs1` may be `rd`.
+                self.read_reg(Reg::Rax, rs1);
+                self.asm.alu_imm(Alu::And, true, Reg::Rax, !1);
+                self.asm
+                    .store(Mem::base(FRAME, JitFrame::NEXT_PC), Reg::Rax);
+                if rd != 0 {
+                    self.asm.mov_imm(Reg::Rcx, link);
+                    self.write_reg(rd, Reg::Rcx);
+                }
+                self.exit(exit_code(EXIT_END, index + 1));
+                return true;
+            }
+            JitOp::Interpret => {
+                self.exit(exit_code(EXIT_INTERPRET, index));
+                return true;
+            }
+        }
+        false
+    }
+
+    fn alu(&mut self, op: AluOp, rd: u8, rs1: u8, src2: Operand) {
+        // No op here traps, one writing `x0` does nothing.
+        if rd == 0 {
+            return;
+        }
+
+        self.read_reg(Reg::Rax, rs1);
+        match src2 {
+            Operand::Reg(rs2) => self.read_reg(Reg::Rcx, rs2),
+            Operand::Imm(imm) => self.asm.mov_imm(Reg::Rcx, imm),
+        }
+
+        let (rax, rcx) = (Reg::Rax, Reg::Rcx);
+        match op {
+            AluOp::Add => self.asm.alu(Alu::Add, true, rax, rcx),
+            AluOp::Sub => self.asm.alu(Alu::Sub, true, rax, rcx),
+            AluOp::And => self.asm.alu(Alu::And, true, rax, rcx),
+            AluOp::Or => self.asm.alu(Alu::Or, true, rax, rcx),
+            AluOp::Xor => self.asm.alu(Alu::Xor, true, rax, rcx),
+            // The host masks the shift amount like RISC-V does.
+            AluOp::Sll => self.asm.shift_cl(Shift::Shl, true, rax),
+            AluOp::Srl => self.asm.shift_cl(Shift::Shr, true, rax),
+            AluOp::Sra => self.asm.shift_cl(Shift::Sar, true, rax),
+            AluOp::Slt | AluOp::Sltu => {
+                self.asm.alu(Alu::Cmp, true, rax, rcx);
+                let cond = if matches!(op, AluOp::Slt) {
+                    Cond::L
+                } else {
+                    Cond::B
+                };
+                self.asm.set(cond, rax);
+            }
+            AluOp::Mul => self.asm.imul(true, rax, rcx),
+            AluOp::Mulh | AluOp::Mulhu => {
+                self.asm.mul_wide(matches!(op, AluOp::Mulh), rcx);
+                self.asm.mov(rax, Reg::Rdx);
+            }
+
+            AluOp::Addw | AluOp::Subw | AluOp::Sllw | AluOp::Srlw | AluOp::Sraw | AluOp::Mulw => {
+                match op {
+                    AluOp::Addw => self.asm.alu(Alu::Add, false, rax, rcx),
+                    AluOp::Subw => self.asm.alu(Alu::Sub, false, rax, rcx),
+                    AluOp::Sllw => self.asm.shift_cl(Shift::Shl, false, rax),
+                    AluOp::Srlw => self.asm.shift_cl(Shift::Shr, false, rax),
+                    AluOp::Sraw => self.asm.shift_cl(Shift::Sar, false, rax),
+                    _ => self.asm.imul(false, rax, rcx),
+                }
+                self.asm.movsxd(rax, rax);
+            }
+
+            AluOp::Call(f) => {
+                self.asm.mov(Reg::Rdi, rax);
+                self.asm.mov(Reg::Rsi, rcx);
+                self.asm.mov_imm(rax, f as usize as u64);
+                self.asm.call(rax);
+            }
+        }
+
+        self.write_reg(rd, rax);
+    }
+
+    /// Compute the address `rs1 + imm` into `rsi`, and its RAM offset into `rax` if the host TLB
+    /// has it with `perm`, jump to `miss` otherwise.
+    fn translate(&mut self, rs1: u8, imm: WordType, size: usize, perm: u8, miss: Label) {
+        self.read_reg(Reg::Rsi, rs1);
+        self.add_imm(Reg::Rsi, imm);
+
+        // rcx = the offset of the entry of the page, rax = the page
+        self.asm.mov(Reg::Rax, Reg::Rsi);
+        self.asm
+            .shift_imm(Shift::Shr, true, Reg::Rax, PAGE_SIZE_XLEN as u8);
+        self.asm.mov(Reg::Rcx, Reg::Rax);
+        self.asm.alu_imm(
+            Alu::And,
+            false,
+            Reg::Rcx,
+            HostTlbLayout::ENTRY_CNT as i32 - 1,
+        );
+        self.asm
+            .imul_imm8(Reg::Rcx, Reg::Rcx, HostTlbLayout::ENTRY_SIZE as i8);
+
+        let entry = |field: usize| Mem::indexed(TLB, Reg::Rcx, 1, field as i32);
+        self.asm.cmp_mem(entry(HostTlbLayout::TAG), Reg::Rax);
+        self.asm.jcc(Cond::NE, miss);
+        self.asm.test_mem8_imm(entry(HostTlbLayout::PERMS), perm);
+        self.asm.jcc(Cond::E, miss);
+        // Misaligned accesses take the slow path, so they never cross the page.
+        if size > 1 {
+            self.asm.test_imm32(Reg::Rsi, size as u32 - 1);
+            self.asm.jcc(Cond::NE, miss);
+        }
+
+        self.asm.load(Reg::Rax, entry(HostTlbLayout::RAM_PAGE));
+        self.asm.mov(Reg::Rdx, Reg::Rsi);
+        self.asm
+            .alu_imm(Alu::And, false, Reg::Rdx, PAGE_OFFSET_MASK);
+        self.asm.alu(Alu::Add, true, Reg::Rax, Reg::Rdx);
+    }
+
+    fn load(&mut self, index: usize, size: usize, signed: bool, rd: u8, rs1: u8, imm: WordType) {
+        let (entry, resume) = (self.asm.new_label(), self.asm.new_label());
+        self.translate(rs1, imm, size, HostTlbLayout::READ, entry);
+
+        // An aligned access, which the host does at once, like the interpreter's atomic loads.
+        let ram = Mem::indexed(RAM, Reg::Rax, 1, 0);
+        self.asm.load_extend(Reg::Rax, ram, size, signed);
+        self.write_reg(rd, Reg::Rax);
+        self.asm.bind(resume);
+
+        self.slow_paths.push(SlowPath {
+            entry,
+            resume,
+            index,
+            access: SlowAccess::Load { size, signed, rd },
+        });
+    }
+
+    fn store(&mut self, index: usize, size: usize, rs1: u8, rs2: u8, imm: WordType) {
+        let (entry, resume) = (self.asm.new_label(), self.asm.new_label());
+        self.translate(rs1, imm, size, HostTlbLayout::WRITE, entry);
+
+        // A reservation to break, or code to drop, is left to `Ram::write_unchecked`.
+        self.asm.cmp_mem32_imm8(Mem::base(RESERVED_MASK, 0), 0);
+        self.asm.jcc(Cond::NE, entry);
+        self.asm.mov(Reg::Rcx, Reg::Rax);
+        self.asm
+            .shift_imm(Shift::Shr, true, Reg::Rcx, CODE_PAGE_XLEN as u8);
+        self.asm.mov(Reg::Rdx, Reg::Rcx);
+        self.asm.shift_imm(Shift::Shr, true, Reg::Rdx, 6);
+        self.asm
+            .load(Reg::Rdx, Mem::indexed(CODE_PAGES, Reg::Rdx, 8, 0));
+        self.asm.bt(Reg::Rdx, Reg::Rcx);
+        self.asm.jcc(Cond::B, entry);
+
+        self.read_reg(Reg::Rdx, rs2);
+        let ram = Mem::indexed(RAM, Reg::Rax, 1, 0);
+        self.asm.store_truncate(ram, Reg::Rdx, size);
+        self.asm.bind(resume);
+
+        self.slow_paths.push(SlowPath {
+            entry,
+            resume,
+            index,
+            access: SlowAccess::Store { size, rs2 },
+        });
+    }
+
+    /// Call [`load_slow`] or [`store_slow`], and return its exception if any.
+    fn slow_path(&mut self, slow_path: SlowPath) {
+        self.asm.bind(slow_path.entry);
+
+        let helper = match slow_path.access {
+            SlowAccess::Load { size, signed, rd } => {
+                self.asm.mov(Reg::Rdx, Reg::Rsi);
+                self.asm.mov_imm(Reg::Rsi, rd as u64);
+                match (size, signed) {
+                    (1, true) => load_slow::<u8, true> as usize,
+                    (1, false) => load_slow::<u8, false> as usize,
+                    (2, true) => load_slow::<u16, true> as usize,
+                    (2, false) => load_slow::<u16, false> as usize,
+                    (4, true) => load_slow::<u32, true> as usize,
+                    (4, false) => load_slow::<u32, false> as usize,
+                    _ => load_slow::<u64, false> as usize,
+                }
+            }
+            SlowAccess::Store { size, rs2 } => {
+                self.read_reg(Reg::Rdx, rs2);
+                match size {
+                    1 => store_slow::<u8> as usize,
+                    2 => store_slow::<u16> as usize,
+                    4 => store_slow::<u32> as usize,
+                    _ => store_slow::<u64> as usize,
+                }
+            }
+        };
+        self.asm.mov(Reg::Rdi, FRAME);
+        self.asm.mov_imm(Reg::Rax, helper as u64);
+        self.asm.call(Reg::Rax);
+
+        self.asm.alu(Alu::Or, false, Reg::Rax, Reg::Rax);
+        self.asm.jcc(Cond::E, slow_path.resume);
+        self.exit(exit_code(EXIT_EXCEPTION, slow_path.index));
+    }
+}
@@ -0,0 +1,737 @@
+//! Compiles the hot blocks to x86-64 code, with the `jit` feature, see
+//! [`RVCPU::set_jit_hot_blocks`].
+//!
+//! Once a block ran [`HOT_THRESHOLD`](super::predecode::HOT_THRESHOLD) times, its RV64I/M integer
+//! instructions, loads, stores, branches and direct jumps, compressed or not, are lowered to
+//! [`JitOp`]s and emitted as one host function, see [`emit`]. The guest registers stay in the
+//! register file, which the code reads and writes directly, and the pc is only written back when
+//! the code returns.
+//!
+//! Loads and stores look the host TLB up inline: a hit in the right context with the permission,
+//! aligned, is a single host access to the RAM. Stores also check inline that no hart holds a
+//! reservation and that the page holds no decoded code. Anything else calls the same
+//! [`handle_load`]/[`handle_store`] as the interpreter, whose exception ends the block.
+//!
+//! The first instruction with no [`JitOp`] (CSR, floating point, vector, atomics, `JALR` ...) ends
+//! the compiled code: it returns with the pc at that instruction, and the interpreter runs the rest
+//! of the block, see [`JitExit::Interpret`].
+
+mod asm;
+mod emit;
+
+use std::{
+    mem::offset_of,
+    sync::atomic::{AtomicU32, AtomicU64},
+};
+
+use crate::{
+    config::arch_config::WordType,
+    isa::riscv::{
+        block_cache::BlockInstr,
+        executor::RVCPU,
+        instruction::{
+            RVInstrInfo,
+            exec_core::{handle_load, handle_store},
+            exec_function::*,
+            instr_table::RiscvInstr,
+        },
+        trap::Exception,
+    },
+    mmap::CodeMapping,
+    utils::UnsignedInteger,
+};
+
+/// The integer ops compiled to host instructions, `W` ones work on and sign-extend 32 bits.
+#[derive(Debug, Clone, Copy)]
+enum AluOp {
+    Add,
+    Sub,
+    Sll,
+    Srl,
+    Sra,
+    Slt,
+    Sltu,
+    And,
+    Or,
+    Xor,
+    Mul,
+    Mulh,
+    Mulhu,
+    Addw,
+    Subw,
+    Sllw,
+    Srlw,
+    Sraw,
+    Mulw,
+    /// Computed by the interpreter's [`ExecTrait`], for the divisions and their edge cases.
+    Call(AluFn),
+}
+
+type AluFn = extern "sysv64" fn(WordType, WordType) -> WordType;
+
+extern "sysv64" fn alu_call<F: ExecTrait<Result<WordType, Exception>>>(
+    a: WordType,
+    b: WordType,
+) -> WordType {
+    F::exec(a, b).expect("integer ops do not trap")
+}
+
+impl AluOp {
+    fn of(instr: RiscvInstr) -> Option<Self> {
+        use RiscvInstr as I;
+
+        Some(match instr {
+            I::ADD | I::ADDI | I::C_ADD | I::C_ADDI | I::C_ADDI16SP => Self::Add,
+            I::SUB | I::C_SUB => Self::Sub,
+            I::SLL | I::SLLI | I::C_SLLI => Self::Sll,
+            I::SRL | I::SRLI | I::C_SRLI => Self::Srl,
+            I::SRA | I::SRAI | I::C_SRAI => Self::Sra,
+            I::SLT | I::SLTI => Self::Slt,
+            I::SLTU | I::SLTIU => Self::Sltu,
+            I::AND | I::ANDI | I::C_AND | I::C_ANDI => Self::And,
+            I::OR | I::ORI | I::C_OR => Self::Or,
+            I::XOR | I::XORI | I::C_XOR => Self::Xor,
+            I::MUL => Self::Mul,
+            I::MULH => Self::Mulh,
+            I::MULHU => Self::Mulhu,
+            I::ADDW | I::ADDIW | I::C_ADDW | I::C_ADDIW => Self::Addw,
+            I::SUBW | I::C_SUBW => Self::Subw,
+            I::SLLW | I::SLLIW => Self::Sllw,
+            I::SRLW | I::SRLIW => Self::Srlw,
+            I::SRAW | I::SRAIW => Self::Sraw,
+            I::MULW => Self::Mulw,
+
+            I::MULHSU => Self::Call(alu_call::<ExecMulHighSignedUnsigned>),
+            I::DIV => Self::Call(alu_call::<ExecDivSigned>),
+            I::DIVU => Self::Call(alu_call::<ExecDivUnsigned>),
+            I::REM => Self::Call(alu_call::<ExecRemSigned>),
+            I::REMU => Self::Call(alu_call::<ExecRemUnsigned>),
+            I::DIVW => Self::Call(alu_call::<ExecDivw>),
+            I::DIVUW => Self::Call(alu_call::<ExecDivuw>),
+            I::REMW => Self::Call(alu_call::<ExecRemw>),
+            I::REMUW => Self::Call(alu_call::<ExecRemuw>),
+
+            _ => return None,
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Operand {
+    Reg(u8),
+    Imm(WordType),
+}
+
+/// The conditions of the branches, `rs2` being `x0` for the compressed ones.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BranchCond {
+    Eq,
+    Ne,
+    Lt,
+    Ge,
+    Ltu,
+    Geu,
+}
+
+/// One guest instruction, as compiled, with every pc it depends on resolved.
+#[derive(Debug, Clone, Copy)]
+enum JitOp {
+    /// `rd = op(rs1, src2)`
+    Alu {
+        op: AluOp,
+        rd: u8,
+        rs1: u8,
+        src2: Operand,
+    },
+    /// `rd = value`, for `LUI`, `AUIPC`, `C.LI` and `C.LUI`.
+    Const {
+        rd: u8,
+        value: WordType,
+    },
+    /// `rd = [rs1 + imm]`, `size` bytes, sign-extended if `signed`.
+    Load {
+        size: usize,
+        signed: bool,
+        rd: u8,
+        rs1: u8,
+        imm: WordType,
+    },
+    /// `[rs1 + imm] = rs2`, `size` bytes.
+    Store {
+        size: usize,
+        rs1: u8,
+        rs2: u8,
+        imm: WordType,
+    },
+    Nop,
+    /// Ends the block, at `taken` if `cond(rs1, rs2)`, `not_taken` otherwise.
+    Branch {
+        cond: BranchCond,
+        rs1: u8,
+        rs2: u8,
+        taken: WordType,
+        not_taken: WordType,
+    },
+    /// Ends the block at `target`, `rd = link`.
+    Jump {
+        rd: u8,
+        link: WordType,
+        target: WordType,
+    },
+    /// Ends the block at `rs1 & !1`, `rd = link`, for `C.JR` and `C.JALR`.
+    JumpReg {
+        rd: u8,
+        rs1: u8,
+        link: WordType,
+    },
+    /// Ends the compiled code, the interpreter runs this instruction and the rest of the block.
+    Interpret,
+}
+
+fn lower_load(size: usize, signed: bool, rd: u8, rs1: u8, imm: WordType) -> JitOp {
+    JitOp::Load {
+        size,
+        signed,
+        rd,
+        rs1,
+        imm,
+    }
+}
+
+fn lower_store(size: usize, rs1: u8, rs2: u8, imm: WordType) -> JitOp {
+    JitOp::Store {
+        size,
+        rs1,
+        rs2,
+        imm,
+    }
+}
+
+fn lower(block_instr: BlockInstr, pc: WordType) -> JitOp {
+    use RiscvInstr as I;
+
+    let instr = block_instr.instr;
+    let next_pc = pc.wrapping_add(block_instr.len as WordType);
+
+    if let Some(op) = AluOp::of(instr) {
+        let (rd, rs1, src2) = match block_instr.info {
+            RVInstrInfo::R { rs1, rs2, rd } => (rd, rs1, Operand::Reg(rs2)),
+            RVInstrInfo::I { rs1, rd, imm } => (rd, rs1, Operand::Imm(imm)),
+            RVInstrInfo::CR { rd_rs1, rs2 } | RVInstrInfo::CA { rd_rs1, rs2 } => {
+                (rd_rs1, rd_rs1, Operand::Reg(rs2))
+            }
+            RVInstrInfo::CI { rd_rs1, imm } | RVInstrInfo::CB { rd_rs1, imm } => {
+                (rd_rs1, rd_rs1, Operand::Imm(imm))
+            }
+            _ => return JitOp::Interpret,
+        };
+        return JitOp::Alu { op, rd, rs1, src2 };
+    }
+
+    match (instr, block_instr.info) {
+        (I::LUI, RVInstrInfo::U { rd, imm }) => JitOp::Const { rd, value: imm },
+        (I::AUIPC, RVInstrInfo::U { rd, imm }) => JitOp::Const {
+            rd,
+            value: pc.wrapping_add(imm),
+        },
+        (I::C_LI | I::C_LUI, RVInstrInfo::CI { rd_rs1, imm }) => JitOp::Const {
+            rd: rd_rs1,
+            value: imm,
+        },
+        (I::C_MV, RVInstrInfo::CR { rd_rs1, rs2 }) => JitOp::Alu {
+            op: AluOp::Add,
+            rd: rd_rs1,
+            rs1: 0,
+            src2: Operand::Reg(rs2),
+        },
+        (I::C_ADDI4SPN, RVInstrInfo::CIW { rd, imm }) => JitOp::Alu {
+            op: AluOp::Add,
+            rd,
+            rs1: 2,
+            src2: Operand::Imm(imm),
+        },
+        (I::C_NOP, _) => JitOp::Nop,
+
+        (I::LB, RVInstrInfo::I { rs1, rd, imm }) => lower_load(1, true, rd, rs1, imm),
+        (I::LBU, RVInstrInfo::I { rs1, rd, imm }) => lower_load(1, false, rd, rs1, imm),
+        (I::LH, RVInstrInfo::I { rs1, rd, imm }) => lower_load(2, true, rd, rs1, imm),
+        (I::LHU, RVInstrInfo::I { rs1, rd, imm }) => lower_load(2, false, rd, rs1, imm),
+        (I::LW, RVInstrInfo::I { rs1, rd, imm }) => lower_load(4, true, rd, rs1, imm),
+        (I::LWU, RVInstrInfo::I { rs1, rd, imm }) => lower_load(4, false, rd, rs1, imm),
+        (I::LD, RVInstrInfo::I { rs1, rd, imm }) => lower_load(8, false, rd, rs1, imm),
+        (I::C_LW, RVInstrInfo::CL { rd, rs1, imm }) => lower_load(4, true, rd, rs1, imm),
+        (I::C_LD, RVInstrInfo::CL { rd, rs1, imm }) => lower_load(8, false, rd, rs1, imm),
+        (I::C_LWSP, RVInstrInfo::CI { rd_rs1, imm }) => lower_load(4, true, rd_rs1, 2, imm),
+        (I::C_LDSP, RVInstrInfo::CI { rd_rs1, imm }) => lower_load(8, false, rd_rs1, 2, imm),
+
+        (I::SB, RVInstrInfo::S { rs1, rs2, imm }) => lower_store(1, rs1, rs2, imm),
+        (I::SH, RVInstrInfo::S { rs1, rs2, imm }) => lower_store(2, rs1, rs2, imm),
+        (I::SW, RVInstrInfo::S { rs1, rs2, imm }) => lower_store(4, rs1, rs2, imm),
+        (I::SD, RVInstrInfo::S { rs1, rs2, imm }) => lower_store(8, rs1, rs2, imm),
+        (I::C_SW, RVInstrInfo::CS { rs1, rs2, imm }) => lower_store(4, rs1, rs2, imm),
+        (I::C_SD, RVInstrInfo::CS { rs1, rs2, imm }) => lower_store(8, rs1, rs2, imm),
+        (I::C_SWSP, RVInstrInfo::CSS { rs2, imm }) => lower_store(4, 2, rs2, imm),
+        (I::C_SDSP, RVInstrInfo::CSS { rs2, imm }) => lower_store(8, 2, rs2, imm),
+
+        // A target that is not 4-byte aligned traps without the C extension, which the
+        // interpreter checks.
+        (
+            I::BEQ | I::BNE | I::BLT | I::BGE | I::BLTU | I::BGEU,
+            RVInstrInfo::B { rs1, rs2, imm },
+        ) if pc.wrapping_add(imm) & 0b11 == 0 => JitOp::Branch {
+            cond: match instr {
+                I::BEQ => BranchCond::Eq,
+                I::BNE => BranchCond::Ne,
+                I::BLT => BranchCond::Lt,
+                I::BGE => BranchCond::Ge,
+                I::BLTU => BranchCond::Ltu,
+                _ => BranchCond::Geu,
+            },
+            rs1,
+            rs2,
+            taken: pc.wrapping_add(imm),
+            not_taken: next_pc,
+        },
+        (I::C_BEQZ | I::C_BNEZ, RVInstrInfo::CB { rd_rs1, imm }) => JitOp::Branch {
+            cond: if instr == I::C_BEQZ {
+                BranchCond::Eq
+            } else {
+                BranchCond::Ne
+            },
+            rs1: rd_rs1,
+            rs2: 0,
+            taken: pc.wrapping_add(imm),
+            not_taken: next_pc,
+        },
+        (I::JAL, RVInstrInfo::J { rd, imm }) if pc.wrapping_add(imm) & 0b11 == 0 => JitOp::Jump {
+            rd,
+            link: next_pc,
+            target: pc.wrapping_add(imm),
+        },
+        (I::C_J | I::C_JAL, RVInstrInfo::CJ { target }) => JitOp::Jump {
+            rd: (instr == I::C_JAL) as u8,
+            link: next_pc,
+            target: pc.wrapping_add(target),
+        },
+        (I::C_JR | I::C_JALR, RVInstrInfo::CR { rd_rs1, .. }) => JitOp::JumpReg {
+            rd: (instr == I::C_JALR) as u8,
+            rs1: rd_rs1,
+            link: next_pc,
+        },
+
+        _ => JitOp::Interpret,
+    }
+}
+
+/// What the compiled code works on, it's given a pointer to it.
+#[repr(C)]
+struct JitFrame {
+    regs: *mut WordType,
+    /// The host TLB entries, see [`VirtAddrManager::host_tlb_entries`].
+    ///
+    /// [`VirtAddrManager::host_tlb_entries`]: crate::isa::riscv::mmu::VirtAddrManager::host_tlb_entries
+    tlb: *const u8,
+    ram: *mut u8,
+    code_pages: *const AtomicU64,
+    reserved_mask: *const AtomicU32,
+    /// Handed to the slow paths.
+    cpu: *mut RVCPU,
+    /// Where the block went, written by the code when it runs to the end.
+    next_pc: WordType,
+    /// Raised by a slow path.
+    exception: Option<Exception>,
+}
+
+impl JitFrame {
+    const REGS: i32 = offset_of!(JitFrame, regs) as i32;
+    const TLB: i32 = offset_of!(JitFrame, tlb) as i32;
+    const RAM: i32 = offset_of!(JitFrame, ram) as i32;
+    const CODE_PAGES: i32 = offset_of!(JitFrame, code_pages) as i32;
+    const RESERVED_MASK: i32 = offset_of!(JitFrame, reserved_mask) as i32;
+    const NEXT_PC: i32 = offset_of!(JitFrame, next_pc) as i32;
+}
+
+/// The compiled code returns `index << EXIT_KIND_BITS | kind`, `index` being the number of
+/// instructions it ran to the end.
+const EXIT_KIND_BITS: u32 = 2;
+/// Ran the whole block, the frame holds the next pc.
+const EXIT_END: u32 = 0;
+/// Stopped before an instruction lowered to [`JitOp::Interpret`].
+const EXIT_INTERPRET: u32 = 1;
+/// The instruction after the ones that ran raised the exception held by the frame.
+const EXIT_EXCEPTION: u32 = 2;
+
+fn exit_code(kind: u32, index: usize) -> u32 {
+    (index as u32) << EXIT_KIND_BITS | kind
+}
+
+type Entry = unsafe extern "sysv64" fn(*mut JitFrame) -> u64;
+
+/// A block compiled to host code.
+pub(super) struct CompiledBlock {
+    code: CodeMapping,
+    /// The pc of every instruction, to stop at any of them.
+    pcs: Box<[WordType]>,
+}
+
+/// How a compiled block ended, see [`run`].
+pub(super) enum JitExit {
+    /// Ran that many instructions, the last one raising the exception if any, as
+    /// [`RVCPU::step_block`] counts them.
+    Ran(u64, Result<(), Exception>),
+    /// Ran the instructions before this index, the pc is at it, for the interpreter to run it
+    /// and the rest of the block.
+    Interpret(usize),
+}
+
+/// Compile the `instrs` of a block starting at `start_pc` and ending at `end_pc`, returns `None`
+/// if the first one isn't compiled, or the host can't map code.
+pub(super) fn compile(
+    start_pc: WordType,
+    end_pc: WordType,
+    instrs: &[BlockInstr],
+) -> Option<CompiledBlock> {
+    let mut pcs = Vec::with_capacity(instrs.len());
+    let mut ops = Vec::with_capacity(instrs.len());
+    let mut pc = start_pc;
+    for &instr in instrs {
+        let op = lower(instr, pc);
+        pcs.push(pc);
+        ops.push(op);
+        pc = pc.wrapping_add(instr.len as WordType);
+
+        if matches!(op, JitOp::Interpret) {
+            break;
+        }
+    }
+
+    if ops.first().is_none_or(|op| matches!(op, JitOp::Interpret)) {
+        return None;
+    }
+
+    let code = CodeMapping::new(&emit::emit(&ops, end_pc))
+        .inspect_err(|err| log::warn!("Can not map the code compiled by the JIT: {}", err))
+        .ok()?;
+    Some(CompiledBlock {
+        code,
+        pcs: pcs.into_boxed_slice(),
+    })
+}
+
+/// Run a compiled block.
+///
+/// On an exception the pc is left at the faulting instruction, as the interpreter does.
+pub(super) fn run(cpu: &mut RVCPU, block: &CompiledBlock) -> JitExit {
+    let ram = cpu.memory.ram();
+    let mut frame = JitFrame {
+        regs: cpu.reg_file.as_mut_ptr(),
+        tlb: cpu.memory.host_tlb_entries(&mut cpu.csr),
+        ram: ram.host_ptr(0),
+        code_pages: ram.code_page_bits().as_ptr(),
+        reserved_mask: ram.reserved_mask(),
+        cpu: std::ptr::null_mut(),
+        next_pc: 0,
+        exception: None,
+    };
+    frame.cpu = cpu;
+
+    let exit = unsafe {
+        let entry: Entry = std::mem::transmute(block.code.as_ptr());
+        entry(&mut frame) as u32
+    };
+
+    let index = (exit >> EXIT_KIND_BITS) as usize;
+    match exit & ((1 << EXIT_KIND_BITS) - 1) {
+        EXIT_END => {
+            cpu.pc = frame.next_pc;
+            JitExit::Ran(index as u64, Ok(()))
+        }
+        EXIT_EXCEPTION => {
+            std::hint::cold_path();
+            cpu.pc = block.pcs[index];
+            let ex = frame.exception.take().expect("no exception raised");
+            JitExit::Ran(index as u64 + 1, Err(ex))
+        }
+        kind => {
+            debug_assert_eq!(kind, EXIT_INTERPRET);
+            cpu.pc = block.pcs[index];
+            JitExit::Interpret(index)
+        }
+    }
+}
+
+/// The slow path of a compiled load, returns non-zero on an exception, left in the frame.
+extern "sysv64" fn load_slow<T: UnsignedInteger, const EXTEND: bool>(
+    frame: &mut JitFrame,
+    rd: u64,
+    addr: WordType,
+) -> u64 {
+    let cpu = unsafe { &mut *frame.cpu };
+    match handle_load::<T, EXTEND>(cpu, rd as u8, addr) {
+        Ok(()) => 0,
+        Err(ex) => {
+            frame.exception = Some(ex);
+            1
+        }
+    }
+}
+
+/// The slow path of a compiled store, see [`load_slow`].
+extern "sysv64" fn store_slow<T: UnsignedInteger>(
+    frame: &mut JitFrame,
+    addr: WordType,
+    data: WordType,
+) -> u64 {
+    let cpu = unsafe { &mut *frame.cpu };
+    match handle_store::<T>(cpu, addr, data) {
+        Ok(()) => 0,
+        Err(ex) => {
+            frame.exception = Some(ex);
+            1
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        isa::riscv::{
+            cpu_tester::*,
+            mmu::{HostTlbLayout, config::PAGE_SIZE_XLEN},
+            predecode::HOT_THRESHOLD,
+        },
+        ram_config,
+    };
+
+    const RUNS: WordType = HOT_THRESHOLD as WordType * 2;
+
+    /// Run the block at the pc `RUNS` times, the last ones compiled, back at its start every time.
+    fn run_hot(cpu: &mut RVCPU, steps: u64) {
+        cpu.set_jit_hot_blocks(true);
+        for _ in 0..RUNS {
+            cpu.pc = ram_config::BASE_ADDR;
+            assert_eq!(cpu.step_block().unwrap(), steps);
+        }
+    }
+
+    #[test]
+    fn test_run_hot_loop() {
+        let mut cpu = TestCPUBuilder::new()
+            .reg(3, RUNS)
+            .program(&[
+                0x00108093, // label: addi x1, x1, 1
+                0x00210113, // addi x2, x2, 2
+                0xfe309ce3, // bne x1, x3, label
+            ])
+            .build();
+        cpu.set_jit_hot_blocks(true);
+
+        for _ in 0..RUNS {
+            assert_eq!(cpu.step_block().unwrap(), 3);
+        }
+
+        CPUChecker::new(&mut cpu)
+            .reg(1, RUNS)
+            .reg(2, RUNS * 2)
+            .pc(ram_config::BASE_ADDR + 12);
+    }
+
+    #[test]
+    fn test_run_alu_ops() {
+        let mut cpu = TestCPUBuilder::new()
+            .program(&[
+                0xfff00093, // addi x1, x0, -1
+                0x00100113, // addi x2, x0, 1
+                0x002081b3, // add x3, x1, x2
+                0x0010d213, // srli x4, x1, 1
+                0x4010d293, // srai x5, x1, 1
+                0x0020a333, // slt x6, x1, x2
+                0x0020b3b3, // sltu x7, x1, x2
+                0x0220b433, // mulhu x8, x1, x2
+                0x0220c4b3, // div x9, x1, x2
+                0x0200c533, // div x10, x1, x0
+                0x01f1159b, // slliw x11, x2, 31
+                0x4020863b, // subw x12, x1, x2
+                0x800006b7, // lui x13, 0x80000
+                0x00000717, // auipc x14, 0
+                0x00000013, // nop
+            ])
+            .build();
+        run_hot(&mut cpu, 15);
+
+        CPUChecker::new(&mut cpu)
+            .reg(1, WordType::MAX)
+            .reg(3, 0)
+            .reg(4, WordType::MAX >> 1)
+            .reg(5, WordType::MAX)
+            .reg(6, 1)
+            .reg(7, 0)
+            .reg(8, 0)
+            .reg(9, WordType::MAX)
+            .reg(10, WordType::MAX)
+            .reg(11, 0xffff_ffff_8000_0000)
+            .reg(12, 0xffff_ffff_ffff_fffe)
+            .reg(13, 0xffff_ffff_8000_0000)
+            .reg(14, ram_config::BASE_ADDR + 13 * 4)
+            .reg(0, 0)
+            .pc(ram_config::BASE_ADDR + 15 * 4);
+    }
+
+    #[test]
+    fn test_run_loads_and_stores() {
+        const DATA: WordType = ram_config::BASE_ADDR + 0x1000;
+
+        let mut cpu = TestCPUBuilder::new()
+            .program(&[
+                0x00008093, // addi x1, x1, 0
+                0x0020b023, // sd x2, 0(x1)
+                0x00208423, // sb x2, 8(x1)
+                0x0000b183, // ld x3, 0(x1)
+                0x00808203, // lb x4, 8(x1)
+                0x0080c283, // lbu x5, 8(x1)
+                0x0040a303, // lw x6, 4(x1)
+                0x0030d073, // csrrwi x0, 0x003, 1: ends the block before it
+            ])
+            .reg(1, DATA)
+            .reg(2, 0x8765_4321_0000_00ff)
+            .build();
+        run_hot(&mut cpu, 7);
+
+        CPUChecker::new(&mut cpu)
+            .reg(3, 0x8765_4321_0000_00ff)
+            .reg(4, WordType::MAX)
+            .reg(5, 0xff)
+            .reg(6, 0xffff_ffff_8765_4321)
+            .mem::<u64>(DATA, 0x8765_4321_0000_00ff)
+            .mem::<u8>(DATA + 8, 0xff)
+            .pc(ram_config::BASE_ADDR + 7 * 4);
+    }
+
+    #[test]
+    fn test_run_host_tlb_misses() {
+        const DATA: WordType = ram_config::BASE_ADDR + 0x1000;
+        // In the same host TLB entry as `DATA`, every access misses.
+        const ALIAS: WordType = DATA + (HostTlbLayout::ENTRY_CNT << PAGE_SIZE_XLEN) as WordType;
+
+        let mut cpu = TestCPUBuilder::new()
+            .program(&[
+                0x00313023, // sd x3, 0(x2)
+                0x0030b023, // sd x3, 0(x1)
+                0x00013203, // ld x4, 0(x2)
+                0x0000b283, // ld x5, 0(x1)
+                0x0030d073, // csrrwi x0, 0x003, 1: ends the block before it
+            ])
+            .reg(1, DATA)
+            .reg(2, ALIAS)
+            .reg(3, 0x1234_5678_9abc_def0)
+            .build();
+        run_hot(&mut cpu, 4);
+
+        CPUChecker::new(&mut cpu)
+            .reg(4, 0x1234_5678_9abc_def0)
+            .reg(5, 0x1234_5678_9abc_def0)
+            .mem::<u64>(DATA, 0x1234_5678_9abc_def0)
+            .mem::<u64>(ALIAS, 0x1234_5678_9abc_def0);
+    }
+
+    #[test]
+    fn test_run_compressed() {
+        let mut cpu = TestCPUBuilder::new()
+            .program(&[
+                0x4505_0085, // c.addi x1, 1; c.li x10, 1
+                0x0509_852a, // c.mv x10, x10; c.addi x10, 2
+                0x8082_e40a, // c.sdsp x2, 8(sp); c.jr x1
+            ])
+            .reg(2, ram_config::BASE_ADDR + 0x1000)
+            .build();
+        cpu.set_jit_hot_blocks(true);
+        for _ in 0..RUNS {
+            cpu.pc = ram_config::BASE_ADDR;
+            cpu.reg_file.write(1, ram_config::BASE_ADDR + 0x20);
+            assert_eq!(cpu.step_block().unwrap(), 6);
+        }
+
+        CPUChecker::new(&mut cpu)
+            .reg(1, ram_config::BASE_ADDR + 0x21)
+            .reg(10, 3)
+            .mem::<u64>(
+                ram_config::BASE_ADDR + 0x1008,
+                ram_config::BASE_ADDR + 0x1000,
+            )
+            .pc(ram_config::BASE_ADDR + 0x20);
+    }
+
+    #[test]
+    fn test_fault_in_block() {
+        let mut cpu = TestCPUBuilder::new()
+            .program(&[
+                0x00108093, // addi x1, x1, 1
+                0x00013183, // ld x3, 0(x2): x2 is not in RAM
+                0x00108093, // addi x1, x1, 1
+            ])
+            .build();
+        cpu.set_jit_hot_blocks(true);
+
+        for run in 1..=RUNS {
+            cpu.pc = ram_config::BASE_ADDR;
+            assert_eq!(cpu.step_block().unwrap(), 2);
+            assert_eq!(cpu.reg_file[1], run);
+        }
+    }
+
+    #[test]
+    fn test_lower() {
+        let addi = BlockInstr::new(
+            RiscvInstr::ADDI,
+            RVInstrInfo::I {
+                rd: 1,
+                rs1: 2,
+                imm: 3,
+            },
+            4,
+        );
+        assert!(matches!(
+            lower(addi, 0),
+            JitOp::Alu {
+                op: AluOp::Add,
+                rd: 1,
+                rs1: 2,
+                src2: Operand::Imm(3),
+            }
+        ));
+
+        let c_j = BlockInstr::new(RiscvInstr::C_J, RVInstrInfo::CJ { target: 0x10 }, 2);
+        assert!(matches!(
+            lower(c_j, 0x8000_0000),
+            JitOp::Jump {
+                rd: 0,
+                link: 0x8000_0002,
+                target: 0x8000_0010,
+            }
+        ));
+
+        // Only 2-byte aligned, the interpreter checks it.
+        let beq = BlockInstr::new(
+            RiscvInstr::BEQ,
+            RVInstrInfo::B {
+                rs1: 1,
+                rs2: 2,
+                imm: 6,
+            },
+            4,
+        );
+        assert!(matches!(lower(beq, 0x8000_0000), JitOp::Interpret));
+
+        let jalr = BlockInstr::new(
+            RiscvInstr::JALR,
+            RVInstrInfo::I {
+                rd: 1,
+                rs1: 2,
+                imm: 0,
+            },
+            4,
+        );
+        assert!(matches!(lower(jalr, 0), JitOp::Interpret));
+    }
+}
@@ -0,0 +1,237 @@
+use crate::{
+    config::arch_config::WordType,
+    isa::riscv::{
+        csr_reg::{CsrRegFile, NamedCsrReg, csr_macro::Mstatus},
+        mmu::{config::PAGE_SIZE_XLEN, page_table::PTEFlags},
+    },
+    ram_config,
+};
+
+const HOST_TLB_SIZE: usize = 256;
+
+const PAGE_OFFSET_MASK: WordType = (1 << PAGE_SIZE_XLEN) - 1;
+
+/// `mstatus` bits that change how data accesses are translated: MPP, MPRV, SUM and MXR.
+const MSTATUS_CTX_MASK: WordType = (0b11 << 11) | (1 << 17) | (1 << 18) | (1 << 19);
+
+/// The tag of an invalid entry, no virtual page number can be equal to it.
+const INVALID_TAG: WordType = WordType::MAX;
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct HostTlbEntry {
+    /// Virtual page number.
+    tag: WordType,
+    /// Offset of the page in RAM.
+    ram_page: usize,
+    /// Accesses known to succeed without a page walk, only `R`, `W` and `X` are used.
+    perms: PTEFlags,
+}
+
+impl HostTlbEntry {
+    const fn invalid() -> Self {
+        Self {
+            tag: INVALID_TAG,
+            ram_page: 0,
+            perms: PTEFlags::empty(),
+        }
+    }
+}
+
+/// Where the fields of an entry are, for the lookups the JIT compiles inline, see
+/// [`HostTlb::entries_for`].
+#[cfg(feature = "jit")]
+pub(crate) struct HostTlbLayout;
+
+#[cfg(feature = "jit")]
+impl HostTlbLayout {
+    pub(crate) const ENTRY_CNT: usize = HOST_TLB_SIZE;
+    pub(crate) const ENTRY_SIZE: usize = size_of::<HostTlbEntry>();
+    pub(crate) const TAG: usize = std::mem::offset_of!(HostTlbEntry, tag);
+    pub(crate) const RAM_PAGE: usize = std::mem::offset_of!(HostTlbEntry, ram_page);
+    pub(crate) const PERMS: usize = std::mem::offset_of!(HostTlbEntry, perms);
+
+    pub(crate) const READ: u8 = PTEFlags::R.bits();
+    pub(crate) const WRITE: u8 = PTEFlags::W.bits();
+}
+
+/// Entries that every lookup misses.
+#[cfg(feature = "jit")]
+static INVALID_ENTRIES: [HostTlbEntry; HOST_TLB_SIZE] = [HostTlbEntry::invalid(); HOST_TLB_SIZE];
+
+/// A direct-mapped cache from virtual pages to RAM offsets, in front of the page table walker.
+///
+/// An entry is only filled after an access to RAM succeeded through the slow path,
+/// so it already went through the permission check and the A/D update.
+/// MMIO pages are never filled, and always take the slow path.
+///
+/// All entries are bound to the translation context (privilege level and the related `mstatus` bits)
+/// they were filled in, and the whole cache is dropped when that context changes.
+pub(super) struct HostTlb {
+    entries: [HostTlbEntry; HOST_TLB_SIZE],
+    ctx: WordType,
+}
+
+impl HostTlb {
+    pub(super) fn new() -> Self {
+        Self {
+            entries: [HostTlbEntry::invalid(); HOST_TLB_SIZE],
+            ctx: 0,
+        }
+    }
+
+    #[inline]
+    pub(super) fn context_of(csr: &mut CsrRegFile) -> WordType {
+        let mstatus = csr.get_by_type_existing::<Mstatus>().data();
+        (mstatus & MSTATUS_CTX_MASK) | csr.privelege_level() as WordType
+    }
+
+    #[inline]
+    fn index_of(vpn: WordType) -> usize {
+        (vpn as usize) & (HOST_TLB_SIZE - 1)
+    }
+
+    /// Returns the RAM offset of `vaddr` if an access of `size` bytes with `perm` can take the fast path.
+    ///
+    /// Misaligned accesses always take the slow path, so the access never crosses the page.
+    #[inline(always)]
+    pub(super) fn lookup(
+        &self,
+        vaddr: WordType,
+        size: usize,
+        ctx: WordType,
+        perm: PTEFlags,
+    ) -> Option<usize> {
+        let vpn = vaddr >> PAGE_SIZE_XLEN;
+        let entry = &self.entries[Self::index_of(vpn)];
+
+        if entry.tag != vpn
+            || self.ctx != ctx
+            || !entry.perms.contains(perm)
+            || vaddr & (size as WordType - 1) != 0
+        {
+            return None;
+        }
+
+        Some(entry.ram_page | (vaddr & PAGE_OFFSET_MASK) as usize)
+    }
+
+    /// Record that an access with `perm` from `vaddr` to `paddr` succeeded.
+    pub(super) fn fill(&mut self, vaddr: WordType, paddr: WordType, ctx: WordType, perm: PTEFlags) {
+        if !(ram_config::BASE_ADDR..ram_config::BASE_ADDR + ram_config::SIZE as WordType)
+            .contains(&paddr)
+        {
+            return;
+        }
+
+        if self.ctx != ctx {
+            self.clear();
+            self.ctx = ctx;
+        }
+
+        let vpn = vaddr >> PAGE_SIZE_XLEN;
+        let ram_page = ((paddr - ram_config::BASE_ADDR) & !PAGE_OFFSET_MASK) as usize;
+        let entry = &mut self.entries[Self::index_of(vpn)];
+
+        if entry.tag == vpn && entry.ram_page == ram_page {
+            entry.perms |= perm;
+        } else {
+            *entry = HostTlbEntry {
+                tag: vpn,
+                ram_page,
+                perms: perm,
+            };
+        }
+    }
+
+    /// The entries filled in `ctx`, or as many invalid ones if that is not the current context.
+    ///
+    /// The JIT looks them up inline, see [`HostTlbLayout`].
+    #[cfg(feature = "jit")]
+    pub(super) fn entries_for(&self, ctx: WordType) -> *const u8 {
+        if self.ctx == ctx {
+            self.entries.as_ptr().cast()
+        } else {
+            INVALID_ENTRIES.as_ptr().cast()
+        }
+    }
+
+    pub(super) fn clear(&mut self) {
+        self.entries.fill(HostTlbEntry::invalid());
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const CTX: WordType = 1;
+
+    #[test]
+    fn test_host_tlb() {
+        let mut tlb = HostTlb::new();
+        let vaddr = 0x1234_5678;
+        let paddr = ram_config::BASE_ADDR + 0x4000 + 0x678;
+
+        assert_eq!(tlb.lookup(vaddr, 4, CTX, PTEFlags::R), None);
+
+        tlb.fill(vaddr, paddr, CTX, PTEFlags::R);
+        assert_eq!(tlb.lookup(vaddr, 4, CTX, PTEFlags::R), Some(0x4678));
+        assert_eq!(tlb.lookup(vaddr + 8, 8, CTX, PTEFlags::R), Some(0x4680));
+
+        // Not granted, misaligned, or filled in another context.
+        assert_eq!(tlb.lookup(vaddr, 4, CTX, PTEFlags::W), None);
+        assert_eq!(tlb.lookup(vaddr + 1, 4, CTX, PTEFlags::R), None);
+        assert_eq!(tlb.lookup(vaddr, 4, CTX + 1, PTEFlags::R), None);
+
+        tlb.fill(vaddr, paddr, CTX, PTEFlags::W);
+        assert_eq!(
+            tlb.lookup(vaddr, 4, CTX, PTEFlags::R | PTEFlags::W),
+            Some(0x4678)
+        );
+
+        tlb.clear();
+        assert_eq!(tlb.lookup(vaddr, 4, CTX, PTEFlags::R), None);
+    }
+
+    #[cfg(feature = "jit")]
+    #[test]
+    fn test_host_tlb_entries_for() {
+        let mut tlb = HostTlb::new();
+        tlb.fill(
+            0x1234_5678,
+            ram_config::BASE_ADDR + 0x4678,
+            CTX,
+            PTEFlags::R,
+        );
+
+        let entry = HostTlb::index_of(0x1234_5678 >> PAGE_SIZE_XLEN) * HostTlbLayout::ENTRY_SIZE;
+        let entries = tlb.entries_for(CTX);
+        unsafe {
+            assert_eq!(
+                *entries.add(entry + HostTlbLayout::TAG).cast::<WordType>(),
+                0x12345
+            );
+            assert_eq!(
+                *entries.add(entry + HostTlbLayout::RAM_PAGE).cast::<usize>(),
+                0x4000
+            );
+            assert_eq!(
+                *entries.add(entry + HostTlbLayout::PERMS),
+                HostTlbLayout::READ
+            );
+        }
+
+        // Another context sees no valid entry.
+        let entries = tlb.entries_for(CTX + 1);
+        let tag = unsafe { *entries.add(entry + HostTlbLayout::TAG).cast::<WordType>() };
+        assert_eq!(tag, INVALID_TAG);
+    }
+
+    #[test]
+    fn test_host_tlb_skips_mmio() {
+        let mut tlb = HostTlb::new();
+        tlb.fill(0x1000_0000, 0x1000_0000, CTX, PTEFlags::R);
+        assert_eq!(tlb.lookup(0x1000_0000, 1, CTX, PTEFlags::R), None);
+    }
+}
@@ -1,27 +1,38 @@
 pub mod address;
 pub mod config;
+mod host_tlb;
 mod page_table;
 
-pub use page_table::PageTableError;
+pub use page_table::{Asid, PageTableError, TlbKind};
 
-use std::{cell::UnsafeCell, rc::Rc};
+use std::sync::Arc;
 
 use self::config::*;
+use self::host_tlb::HostTlb;
+#[cfg(feature = "jit")]
+pub(crate) use self::host_tlb::HostTlbLayout;
 use self::page_table::*;
 
 use crate::{
     config::arch_config::WordType,
     device::{DeviceTrait, MemError, mmio::MemoryMapIO},
-    isa::riscv::{
-        csr_reg::{
-            CsrRegFile, PrivilegeLevel,
-            csr_macro::{Mstatus, Sstatus},
+    isa::{
+        cache::CacheStats,
+        riscv::{
+            csr_reg::{
+                CsrRegFile, PrivilegeLevel,
+                csr_macro::{Mstatus, Sstatus},
+            },
+            debug_points::{DebugStop, WatchKind, Watchpoints},
+            debugger::Address,
+            trap::Exception,
+            vector::VectorMemory,
         },
-        debugger::Address,
-        trap::Exception,
     },
     ram::Ram,
     ram_config,
+    stats::WalkStats,
+    trace::{self, MemAccess, MemAccessKind},
     utils::UnsignedInteger,
 };
 
@@ -40,6 +51,7 @@ enum AccessPolicy {
         check: PermissionCheck,
         effect: AccessEffect,
         fault: MemError,
+        tlb: TlbKind,
     },
 }
 
@@ -100,7 +112,14 @@ fn determine_data_access_privilege(csr: &mut CsrRegFile) -> AccessPrivilege {
 pub(crate) struct VirtAddrManager {
     pub(crate) mmio: MemoryMapIO,
     page_table: PageTableWalker,
-    ram: Rc<UnsafeCell<Ram>>,
+    host_tlb: HostTlb,
+    ram: Arc<Ram>,
+    /// The hart this belongs to, selects its LR/SC reservation and its queue of written code pages.
+    hart_id: usize,
+    /// The data accesses since [`Self::begin_access_log`], while the hart is traced.
+    access_log: Vec<MemAccess>,
+    log_accesses: bool,
+    watchpoints: Watchpoints,
 }
 
 /// The main struct for determining how to access memory and performing address translation,
@@ -108,14 +127,113 @@ pub(crate) struct VirtAddrManager {
 ///
 /// The logic of TLB and walking page tables is implemented in the [`PageTable`] struct.
 impl VirtAddrManager {
-    pub(crate) fn from_ram_and_mmio(ram_ref: Rc<UnsafeCell<Ram>>, mmio: MemoryMapIO) -> Self {
+    pub(crate) fn from_ram_and_mmio(ram_ref: Arc<Ram>, mmio: MemoryMapIO) -> Self {
         Self {
             mmio: mmio,
             page_table: PageTableWalker::new(0, config::VirtualMemoryMode::None),
+            host_tlb: HostTlb::new(),
             ram: ram_ref,
+            hart_id: 0,
+            access_log: Vec::new(),
+            log_accesses: false,
+            watchpoints: Watchpoints::default(),
+        }
+    }
+
+    pub(crate) fn hart_id(&self) -> usize {
+        self.hart_id
+    }
+
+    pub(crate) fn set_hart_id(&mut self, hart_id: usize) {
+        self.hart_id = hart_id;
+    }
+
+    /// Log the data accesses from now on, until [`Self::end_access_log`].
+    pub(crate) fn begin_access_log(&mut self) {
+        self.access_log.clear();
+        self.log_accesses = true;
+    }
+
+    /// Stop logging, returns the accesses logged since [`Self::begin_access_log`].
+    pub(crate) fn end_access_log(&mut self) -> &[MemAccess] {
+        self.log_accesses = false;
+        &self.access_log
+    }
+
+    #[inline(always)]
+    fn log_access<T: UnsignedInteger>(&mut self, kind: MemAccessKind, addr: WordType, data: T) {
+        self.log_access_of_len(kind, addr, size_of::<T>() as u32, data.into());
+    }
+
+    #[inline(always)]
+    fn log_access_of_len(&mut self, kind: MemAccessKind, addr: WordType, len: u32, data: u64) {
+        if trace::ENABLED && self.log_accesses {
+            self.access_log.push(MemAccess {
+                kind,
+                addr: addr as u64,
+                size: len as u8,
+                data,
+            });
         }
     }
 
+    /// The memory of the vector loads and stores.
+    #[inline(always)]
+    pub(crate) fn vector_memory(&mut self) -> VectorMemIO<'_> {
+        VectorMemIO(self)
+    }
+
+    /// Returns true if the watchpoint is added, see [`Watchpoints`].
+    pub(crate) fn add_watchpoint(
+        &mut self,
+        addr: WordType,
+        len: WordType,
+        kind: WatchKind,
+    ) -> bool {
+        // Its pages may be cached, and must take the slow path from now on.
+        self.host_tlb.clear();
+        self.watchpoints.add(addr, len, kind)
+    }
+
+    pub(crate) fn remove_watchpoint(
+        &mut self,
+        addr: WordType,
+        len: WordType,
+        kind: WatchKind,
+    ) -> bool {
+        self.watchpoints.remove(addr, len, kind)
+    }
+
+    #[inline(always)]
+    pub(crate) fn watching(&self) -> bool {
+        !self.watchpoints.is_empty()
+    }
+
+    #[inline(always)]
+    pub(crate) fn watch_hit(&self) -> bool {
+        self.watchpoints.hit()
+    }
+
+    pub(crate) fn take_watch_hit(&mut self) -> Option<DebugStop> {
+        self.watchpoints.take_hit()
+    }
+
+    /// Check the access against the watchpoints, returns whether its page is watched, which is
+    /// then left out of the host TLB.
+    #[inline(always)]
+    fn watch_access<T>(&mut self, addr: WordType, read: bool, write: bool) -> bool {
+        self.watch_access_of_len(addr, size_of::<T>(), read, write)
+    }
+
+    #[inline(always)]
+    fn watch_access_of_len(&mut self, addr: WordType, len: usize, read: bool, write: bool) -> bool {
+        if !self.watchpoints.watches_page(addr) {
+            return false;
+        }
+        self.watchpoints.check(addr, len, read, write);
+        true
+    }
+
     /// NOTE: This function only resolves data access, for ifetch, please use `resolve_ifetch_policy`.
     #[inline]
     fn resolve_data_policy(
@@ -154,6 +272,7 @@ impl VirtAddrManager {
                 },
                 effect,
                 fault,
+                tlb: TlbKind::Data,
             };
         }
 
@@ -171,6 +290,7 @@ impl VirtAddrManager {
             },
             effect,
             fault,
+            tlb: TlbKind::Data,
         }
     }
 
@@ -192,6 +312,7 @@ impl VirtAddrManager {
                 },
                 effect,
                 fault: MemError::LoadPageFault,
+                tlb: TlbKind::Instr,
             },
             PrivilegeLevel::U => AccessPolicy::Translated {
                 check: PermissionCheck {
@@ -201,6 +322,7 @@ impl VirtAddrManager {
                 },
                 effect,
                 fault: MemError::LoadPageFault,
+                tlb: TlbKind::Instr,
             },
             PrivilegeLevel::V => unreachable!(), // Doesn't have V-mode.
         }
@@ -217,8 +339,9 @@ impl VirtAddrManager {
                 check,
                 effect,
                 fault,
+                tlb,
             } => self
-                .translate_vaddr(vaddr, check, effect)
+                .translate_vaddr(vaddr, check, effect, tlb)
                 .map_err(|_| fault),
         }
     }
@@ -230,10 +353,22 @@ impl VirtAddrManager {
         // Don't check alignment here since some devices may allow unaligned access.
         // Only check alignment in device's implementations.
 
+        let ctx = HostTlb::context_of(csr);
+        if let Some(offset) = self.host_tlb.lookup(addr, size_of::<T>(), ctx, PTEFlags::R) {
+            let data = unsafe { self.ram.read_unchecked(offset) };
+            self.log_access(MemAccessKind::Read, addr, data);
+            return Ok(data);
+        }
+
         let policy = Self::resolve_data_policy(csr, AccessType::Read, true);
         let paddr = self.translate_with_policy(addr, policy)?;
 
-        self.mmio.read_by_type(paddr)
+        let data = self.mmio.read_by_type(paddr)?;
+        if !self.watch_access::<T>(addr, true, false) {
+            self.host_tlb.fill(addr, paddr, ctx, PTEFlags::R);
+        }
+        self.log_access(MemAccessKind::Read, addr, data);
+        Ok(data)
     }
 
     pub(crate) fn write<T>(
@@ -245,10 +380,24 @@ impl VirtAddrManager {
     where
         T: UnsignedInteger,
     {
+        let ctx = HostTlb::context_of(csr);
+        if let Some(offset) = self.host_tlb.lookup(addr, size_of::<T>(), ctx, PTEFlags::W) {
+            unsafe { self.ram.write_unchecked(offset, data) };
+            self.log_access(MemAccessKind::Write, addr, data);
+            return Ok(());
+        }
+
         let policy = Self::resolve_data_policy(csr, AccessType::Write, true);
         let paddr = self.translate_with_policy(addr, policy)?;
 
-        self.mmio.write_by_type(paddr, data)
+        self.mmio.write_by_type(paddr, data)?;
+        if !self.watch_access::<T>(addr, false, true) {
+            // W without R is reserved, so the page is readable as well.
+            self.host_tlb
+                .fill(addr, paddr, ctx, PTEFlags::R | PTEFlags::W);
+        }
+        self.log_access(MemAccessKind::Write, addr, data);
+        Ok(())
     }
 
     pub(crate) fn load_reserved<T>(
@@ -266,7 +415,10 @@ impl VirtAddrManager {
         let policy = Self::resolve_data_policy(csr, AccessType::Read, true);
         let paddr = self.translate_with_policy(addr, policy)?;
 
-        self.mmio.load_reserved(paddr)
+        let data = self.mmio.load_reserved(self.hart_id, paddr)?;
+        self.watch_access::<T>(addr, true, false);
+        self.log_access(MemAccessKind::Read, addr, data);
+        Ok(data)
     }
 
     pub(crate) fn store_conditional<T>(
@@ -285,16 +437,72 @@ impl VirtAddrManager {
         let policy = Self::resolve_data_policy(csr, AccessType::Write, true);
         let paddr = self.translate_with_policy(addr, policy)?;
 
-        self.mmio.store_conditional(paddr, data)
+        let stored = self.mmio.store_conditional(self.hart_id, paddr, data)?;
+        if stored {
+            self.watch_access::<T>(addr, false, true);
+            self.log_access(MemAccessKind::Write, addr, data);
+        }
+        Ok(stored)
     }
 
     pub(crate) fn ifetch<T>(&mut self, addr: WordType, csr: &mut CsrRegFile) -> Result<T, MemError>
     where
         T: UnsignedInteger,
     {
+        let ctx = HostTlb::context_of(csr);
+        if let Some(offset) = self.host_tlb.lookup(addr, size_of::<T>(), ctx, PTEFlags::X) {
+            return Ok(unsafe { self.ram.read_unchecked(offset) });
+        }
+
         let policy = Self::resolve_ifetch_policy(csr, true);
         let paddr = self.translate_with_policy(addr, policy)?;
-        self.mmio.read_by_type(paddr)
+
+        let data = self.mmio.read_by_type(paddr)?;
+        self.host_tlb.fill(addr, paddr, ctx, PTEFlags::X);
+        Ok(data)
+    }
+
+    /// Translate the address of an instruction fetch, as [`Self::ifetch`] would.
+    #[inline]
+    pub(crate) fn translate_ifetch(
+        &mut self,
+        addr: WordType,
+        csr: &mut CsrRegFile,
+    ) -> Result<WordType, MemError> {
+        let ctx = HostTlb::context_of(csr);
+        if let Some(offset) = self.host_tlb.lookup(addr, 2, ctx, PTEFlags::X) {
+            return Ok(ram_config::BASE_ADDR + offset as WordType);
+        }
+
+        let policy = Self::resolve_ifetch_policy(csr, true);
+        let paddr = self.translate_with_policy(addr, policy)?;
+        self.host_tlb.fill(addr, paddr, ctx, PTEFlags::X);
+        Ok(paddr)
+    }
+
+    /// Record that instructions were decoded from `paddr`, so that writes to its page are reported.
+    #[inline]
+    pub(crate) fn mark_code_page(&mut self, paddr: WordType) {
+        if (ram_config::BASE_ADDR..ram_config::BASE_ADDR + ram_config::SIZE as WordType)
+            .contains(&paddr)
+        {
+            let ram = &self.ram;
+            ram.mark_code_page((paddr - ram_config::BASE_ADDR) as usize);
+        }
+    }
+
+    #[inline(always)]
+    pub(crate) fn has_written_code_pages(&self) -> bool {
+        self.ram.has_written_code_pages(self.hart_id)
+    }
+
+    /// Take the physical addresses of the code pages written since the last call.
+    pub(crate) fn take_written_code_pages(&mut self) -> Vec<WordType> {
+        let ram = &self.ram;
+        ram.take_written_code_pages(self.hart_id)
+            .into_iter()
+            .map(|offset| ram_config::BASE_ADDR + offset as WordType)
+            .collect()
     }
 
     /// Fetch instruction without side-effect, respecting the privilege mode.
@@ -344,11 +552,15 @@ impl VirtAddrManager {
 
         paddr -= ram_config::BASE_ADDR;
 
-        let ram = unsafe { &mut *self.ram.get() };
-        let ptr = &mut ram[paddr as usize] as *mut u8 as *mut T::AtomicType;
+        let ram = &self.ram;
+        ram.report_write(paddr as usize, size_of::<T>());
+        let ptr = ram.host_ptr(paddr as usize) as *mut T::AtomicType;
         let lhs = unsafe { &*ptr };
 
-        f(lhs, rhs_val)
+        let old = f(lhs, rhs_val)?;
+        self.watch_access::<T>(addr, true, true);
+        self.log_access(MemAccessKind::Amo, addr, old);
+        Ok(old)
     }
 
     pub(crate) fn read_by_paddr<T>(&mut self, paddr: WordType) -> Result<T, MemError>
@@ -365,9 +577,21 @@ impl VirtAddrManager {
         self.mmio.write_by_type(paddr.into(), data)
     }
 
+    #[cfg(feature = "jit")]
+    pub(crate) fn ram(&self) -> &Ram {
+        &self.ram
+    }
+
+    /// The host TLB entries the JIT looks up inline, valid in the translation context of `csr`
+    /// only, see [`HostTlbLayout`].
+    #[cfg(feature = "jit")]
+    pub(crate) fn host_tlb_entries(&self, csr: &mut CsrRegFile) -> *const u8 {
+        self.host_tlb.entries_for(HostTlb::context_of(csr))
+    }
+
     #[cfg(test)]
     pub(crate) fn get_raw_ptr(&self) -> *mut u8 {
-        unsafe { &mut *self.ram.get() }.get_raw_ptr()
+        self.ram.host_ptr(0)
     }
 
     // TODO: These debug functions (and their ability) are chaotic.
@@ -388,7 +612,9 @@ impl VirtAddrManager {
                     exact_flags: PTEFlags::empty(),
                 };
 
-                if let Ok(paddr) = self.translate_vaddr(addr, check, AccessEffect::None) {
+                if let Ok(paddr) =
+                    self.translate_vaddr(addr, check, AccessEffect::None, TlbKind::Data)
+                {
                     self.mmio.read_by_type(paddr)
                 } else {
                     Err(MemError::LoadPageFault)
@@ -411,7 +637,9 @@ impl VirtAddrManager {
                     exact_flags: PTEFlags::empty(),
                 };
 
-                if let Ok(paddr) = self.translate_vaddr(addr, check, AccessEffect::None) {
+                if let Ok(paddr) =
+                    self.translate_vaddr(addr, check, AccessEffect::None, TlbKind::Data)
+                {
                     self.mmio.write_by_type(paddr, data)
                 } else {
                     Err(MemError::StorePageFault)
@@ -425,14 +653,10 @@ impl VirtAddrManager {
         vaddr: WordType,
         check: PermissionCheck,
         effect: AccessEffect,
+        tlb: TlbKind,
     ) -> Result<u64, PageTableError> {
         self.page_table
-            .translate_vaddr(
-                unsafe { self.ram.as_mut_unchecked() },
-                vaddr.into(),
-                check,
-                effect,
-            )
+            .translate_vaddr(&self.ram, vaddr.into(), check, effect, tlb)
             .map(|addr| addr.into())
     }
 
@@ -448,6 +672,7 @@ impl VirtAddrManager {
                 exact_flags: PTEFlags::empty(),
             },
             AccessEffect::None,
+            TlbKind::Data,
         )
     }
 
@@ -467,17 +692,28 @@ impl VirtAddrManager {
                 check,
                 effect,
                 fault: _fault,
-            } => self.translate_vaddr(addr, check, effect),
+                tlb,
+            } => self.translate_vaddr(addr, check, effect, tlb),
         }
     }
 
     /// Set the virtual memory mode.
     pub fn set_mode(&mut self, mode: u8) {
         self.page_table.set_mode(mode);
+        self.host_tlb.clear();
     }
 
     pub fn set_root_ppn(&mut self, ppn: u64) {
         self.page_table.set_root_addr(ppn << PAGE_SIZE_XLEN);
+        self.host_tlb.clear();
+    }
+
+    /// Switch the address space, entries of other ASIDs are kept in the TLB.
+    pub fn set_asid(&mut self, asid: Asid) {
+        if self.page_table.asid() != asid {
+            self.page_table.set_asid(asid);
+            self.host_tlb.clear();
+        }
     }
 
     pub fn set_ad_update_policy(&mut self, policy: AdUpdatePolicy) {
@@ -491,5 +727,80 @@ impl VirtAddrManager {
 
     pub fn flush_tlb(&mut self) {
         self.page_table.flush_tlb();
+        self.host_tlb.clear();
+    }
+
+    pub fn tlb_stats(&self, kind: TlbKind) -> CacheStats {
+        self.page_table.tlb_stats(kind)
+    }
+
+    pub(crate) fn walk_stats(&self) -> &WalkStats {
+        self.page_table.walk_stats()
+    }
+
+    /// `SFENCE.VMA`, `None` stands for the `x0` operands.
+    pub fn fence_vma(&mut self, vaddr: Option<WordType>, asid: Option<Asid>) {
+        self.page_table.fence(vaddr, asid);
+
+        // The host TLB only holds the current address space and isn't tagged with the G bit.
+        if asid.is_none_or(|asid| asid == self.page_table.asid()) {
+            self.host_tlb.clear();
+        }
+    }
+}
+
+/// The memory of the vector loads and stores of a hart, see [`VirtAddrManager::vector_memory`].
+///
+/// The elements are checked against the watchpoints and logged for the trace like the scalar
+/// accesses. While a hart is traced or watched, the copies of whole ranges of RAM are refused, so
+/// that the vector unit falls back to the elements.
+pub(crate) struct VectorMemIO<'a>(&'a mut VirtAddrManager);
+
+impl VectorMemIO<'_> {
+    #[inline(always)]
+    fn by_element(&self) -> bool {
+        (trace::ENABLED && self.0.log_accesses) || self.0.watching()
+    }
+}
+
+impl DeviceTrait for VectorMemIO<'_> {
+    fn read(&mut self, addr: WordType, len: u32) -> Result<u64, MemError> {
+        let data = self.0.mmio.read(addr, len)?;
+        self.0.watch_access_of_len(addr, len as usize, true, false);
+        self.0
+            .log_access_of_len(MemAccessKind::Read, addr, len, data);
+        Ok(data)
+    }
+
+    fn write(&mut self, addr: WordType, len: u32, data: u64) -> Result<(), MemError> {
+        self.0.mmio.write(addr, len, data)?;
+        self.0.watch_access_of_len(addr, len as usize, false, true);
+        self.0
+            .log_access_of_len(MemAccessKind::Write, addr, len, data);
+        Ok(())
+    }
+
+    fn sync(&mut self) {
+        self.0.mmio.sync();
+    }
+
+    fn get_poll_event(&mut self) -> Option<Box<dyn crate::device_poller::PollingEventTrait>> {
+        None
+    }
+}
+
+impl VectorMemory for VectorMemIO<'_> {
+    fn read_ram_bytes(&mut self, p_addr: WordType, buf: &mut [u8]) -> Result<(), MemError> {
+        if self.by_element() {
+            return Err(MemError::LoadFault);
+        }
+        self.0.mmio.read_ram_bytes(p_addr, buf)
+    }
+
+    fn write_ram_bytes(&mut self, p_addr: WordType, data: &[u8]) -> Result<(), MemError> {
+        if self.by_element() {
+            return Err(MemError::StoreFault);
+        }
+        self.0.mmio.write_ram_bytes(p_addr, data)
     }
 }
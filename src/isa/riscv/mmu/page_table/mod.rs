@@ -3,6 +3,9 @@ pub mod riscv64;
 #[cfg(feature = "riscv64")]
 pub use riscv64::*;
 
+mod tlb;
+pub use tlb::Asid;
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum PageTableError {
     AlignFault,
@@ -1,12 +1,12 @@
 use bitflags::bitflags;
 use core::panic;
 
-use super::*;
+use super::{tlb::Tlb, *};
 
 use crate::{
     config::arch_config::WordType,
     isa::{
-        cache::*,
+        cache::CacheStats,
         riscv::mmu::{
             address::{PhysicalAddr, PhysicalPageNum, VirtualAddr, VirtualPageNum},
             config::*,
@@ -14,6 +14,7 @@ use crate::{
     },
     ram::Ram,
     ram_config,
+    stats::WalkStats,
 };
 
 bitflags! {
@@ -139,31 +140,78 @@ struct WalkInfo {
     leaf_flags: PTEFlags,
     leaf_pte_addr: u64,
     leaf_ppn: PhysicalPageNum,
+    /// The G bit is set in the leaf or any PTE above it.
+    global: bool,
 }
 
-impl Cacheable for WalkInfo {
-    const ADDR_SHIFT_BITS: usize = PAGE_SIZE_XLEN;
+/// Which TLB a translation goes through, instruction fetches and data accesses don't evict each other.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TlbKind {
+    Instr,
+    Data,
 }
 
+type WalkTlb = Tlb<WalkInfo, 64, 8>;
+
 pub struct PageTableWalker {
-    tlb: SetCache<WalkInfo, 64, 8>,
+    itlb: WalkTlb,
+    dtlb: WalkTlb,
     root_address: WordType,
+    asid: Asid,
     mode: VirtualMemoryMode,
     ad_update_policy: AdUpdatePolicy,
+    stats: WalkStats,
 }
 
 impl PageTableWalker {
     pub fn new(root_address: WordType, mode: VirtualMemoryMode) -> Self {
         Self {
-            tlb: SetCache::new(),
+            itlb: Tlb::new(),
+            dtlb: Tlb::new(),
             root_address,
+            asid: 0,
             mode,
             ad_update_policy: AdUpdatePolicy::FaultOnClear,
+            stats: WalkStats::default(),
         }
     }
 
     pub fn flush_tlb(&mut self) {
-        self.tlb.clear();
+        self.itlb.clear();
+        self.dtlb.clear();
+    }
+
+    /// Invalidate as `SFENCE.VMA` does, see [`Tlb::fence`].
+    pub fn fence(&mut self, vaddr: Option<WordType>, asid: Option<Asid>) {
+        let vaddr = vaddr.map(|vaddr| VirtualAddr::from(vaddr).vpn().address);
+        self.itlb.fence(vaddr, asid);
+        self.dtlb.fence(vaddr, asid);
+    }
+
+    pub fn asid(&self) -> Asid {
+        self.asid
+    }
+
+    pub fn set_asid(&mut self, asid: Asid) {
+        self.asid = asid;
+    }
+
+    pub fn tlb_stats(&self, kind: TlbKind) -> CacheStats {
+        match kind {
+            TlbKind::Instr => self.itlb.stats(),
+            TlbKind::Data => self.dtlb.stats(),
+        }
+    }
+
+    pub(crate) fn walk_stats(&self) -> &WalkStats {
+        &self.stats
+    }
+
+    fn tlb_mut(&mut self, kind: TlbKind) -> &mut WalkTlb {
+        match kind {
+            TlbKind::Instr => &mut self.itlb,
+            TlbKind::Data => &mut self.dtlb,
+        }
     }
 
     pub fn set_ad_update_policy(&mut self, ad_update_policy: AdUpdatePolicy) {
@@ -171,6 +219,7 @@ impl PageTableWalker {
     }
 
     pub fn set_mode(&mut self, mode: u8) {
+        let old_mode = self.mode;
         self.mode = match mode {
             0 => VirtualMemoryMode::None,
             1 => VirtualMemoryMode::Page32bit,
@@ -183,6 +232,11 @@ impl PageTableWalker {
                 log::error!("MMU receive unsupported virtual memory mode: {}.", mode);
                 panic!()
             }
+        };
+
+        // Entries of different modes must not be mixed, as their VPN is split differently.
+        if self.mode != old_mode {
+            self.flush_tlb();
         }
     }
 
@@ -192,10 +246,11 @@ impl PageTableWalker {
 
     pub fn translate_vaddr(
         &mut self,
-        mem: &mut Ram,
+        mem: &Ram,
         vaddr: VirtualAddr,
         check: PermissionCheck,
         effect: AccessEffect,
+        kind: TlbKind,
     ) -> Result<PhysicalAddr, PageTableError> {
         if self.mode == VirtualMemoryMode::None {
             return Ok(vaddr.0.into());
@@ -204,14 +259,45 @@ impl PageTableWalker {
             return Err(PageTableError::PageFault);
         }
 
-        let walk_info = if let Some(info) = self.tlb.get(vaddr.vpn().address) {
-            info
-        } else {
-            let info = self.walk_pte(mem, vaddr.vpn())?;
-            // self.tlb.put(vaddr.vpn().address, info);
-            info
+        let vpn = vaddr.vpn().address;
+        let asid = self.asid;
+        let (mut walk_info, cached) = match self.tlb_mut(kind).get(vpn, asid) {
+            Some(info) => (info, true),
+            None => {
+                let walk = self.walk_pte(mem, vaddr.vpn());
+                let levels = self.levels();
+                self.stats
+                    .record(walk.as_ref().ok().map(|info| levels - info.leaf_level));
+                (walk?, false)
+            }
         };
 
+        let old_flags = walk_info.leaf_flags;
+        let rst = Self::check_permission(&walk_info, &check)
+            .and_then(|()| self.apply_ad_policy(mem, &mut walk_info, effect));
+
+        let tlb = self.tlb_mut(kind);
+        if let Err(err) = rst {
+            // The guest fixes the PTE in its fault handler, don't let a stale entry fault again.
+            if cached {
+                tlb.invalidate(vpn, asid);
+            }
+            return Err(err);
+        }
+        if !cached || walk_info.leaf_flags != old_flags {
+            tlb.put(vpn, asid, walk_info.global, walk_info.leaf_level, walk_info);
+        }
+
+        let page_shift = PAGE_SIZE_XLEN + walk_info.leaf_level * SUB_VPN_XLEN;
+        let page_offset_mask = (1 << page_shift) - 1;
+        let paddr = walk_info.leaf_ppn.address | (vaddr.0 & page_offset_mask);
+        Ok(paddr.into())
+    }
+
+    fn check_permission(
+        walk_info: &WalkInfo,
+        check: &PermissionCheck,
+    ) -> Result<(), PageTableError> {
         if (walk_info.leaf_flags & check.exact_mask) != check.exact_flags
             || (check.any_of.is_empty() == false
                 && (walk_info.leaf_flags & check.any_of) == PTEFlags::empty())
@@ -235,18 +321,14 @@ impl PageTableWalker {
             return Err(PageTableError::PrivilegeFault);
         }
 
-        self.apply_ad_policy(mem, &walk_info, effect)?;
-
-        let page_shift = PAGE_SIZE_XLEN + walk_info.leaf_level * SUB_VPN_XLEN;
-        let page_offset_mask = (1 << page_shift) - 1;
-        let paddr = walk_info.leaf_ppn.address | (vaddr.0 & page_offset_mask);
-        Ok(paddr.into())
+        Ok(())
     }
 
+    /// Update the A/D bits of the leaf PTE, and of `walk_info` so that the cached copy stays in sync.
     fn apply_ad_policy(
         &self,
-        mem: &mut Ram,
-        walk_info: &WalkInfo,
+        mem: &Ram,
+        walk_info: &mut WalkInfo,
         effect: AccessEffect,
     ) -> Result<(), PageTableError> {
         let (need_accessed, need_dirty) = match effect {
@@ -264,23 +346,29 @@ impl PageTableWalker {
 
         match self.ad_update_policy {
             AdUpdatePolicy::AutoSet => {
-                let pte = Self::pte_at(mem, walk_info.leaf_pte_addr);
+                let mut flags = PTEFlags::empty();
                 if need_accessed {
-                    pte.set_accessed();
+                    flags |= PTEFlags::A;
                 }
                 if need_dirty {
-                    pte.set_dirty();
+                    flags |= PTEFlags::D;
                 }
+                // The other harts walk the same tables, the bits are set with one atomic OR.
+                mem.fetch_or_u64(
+                    walk_info.leaf_pte_addr - ram_config::BASE_ADDR,
+                    flags.bits() as u64,
+                )
+                .or(Err(PageTableError::PageFault))?;
+                walk_info.leaf_flags |= flags;
                 Ok(())
             }
             AdUpdatePolicy::FaultOnClear => Err(PageTableError::PageFault),
         }
     }
 
-    fn pte_at(mem: &mut Ram, pte_addr: u64) -> &mut PageTableEntry {
-        let offset = (pte_addr - ram_config::BASE_ADDR) as usize;
-        let ptr = &mut mem[offset] as *mut u8 as *mut PageTableEntry;
-        unsafe { &mut *ptr }
+    #[cfg(test)]
+    fn pte_at(mem: &Ram, pte_addr: u64) -> PageTableEntry {
+        PageTableEntry::new(mem.read(pte_addr - ram_config::BASE_ADDR).unwrap())
     }
 
     fn is_canonical_vaddr(&self, vaddr: VirtualAddr) -> bool {
@@ -292,7 +380,17 @@ impl PageTableWalker {
         }
     }
 
-    fn walk_pte(&self, mem: &mut Ram, vpn: VirtualPageNum) -> Result<WalkInfo, PageTableError> {
+    /// Levels of the page table, a walk reads at most that many PTEs.
+    fn levels(&self) -> usize {
+        match self.mode {
+            VirtualMemoryMode::Page39bit => Sv39::LEVELS,
+            VirtualMemoryMode::Page48bit => Sv48::LEVELS,
+            VirtualMemoryMode::Page57bit => Sv57::LEVELS,
+            _ => 0,
+        }
+    }
+
+    fn walk_pte(&self, mem: &Ram, vpn: VirtualPageNum) -> Result<WalkInfo, PageTableError> {
         match self.mode {
             VirtualMemoryMode::Page39bit => self.walk_pte_with_mode::<Sv39>(mem, vpn),
             VirtualMemoryMode::Page48bit => self.walk_pte_with_mode::<Sv48>(mem, vpn),
@@ -303,10 +401,11 @@ impl PageTableWalker {
 
     fn walk_pte_with_mode<M: SvMode>(
         &self,
-        mem: &mut Ram,
+        mem: &Ram,
         vpn: VirtualPageNum,
     ) -> Result<WalkInfo, PageTableError> {
         let mut entry = PhysicalPageNum::from_paddr(self.root_address);
+        let mut global = false;
 
         for i in (0..M::LEVELS).rev() {
             let sub_vpn = M::vpn_index(vpn.address, i);
@@ -323,6 +422,7 @@ impl PageTableWalker {
             if pte.is_invalid_encoding() {
                 return Err(PageTableError::PageFault);
             }
+            global |= pte.is_global();
 
             if pte.is_leaf() {
                 // A leaf PTE has been reached. If i>0 and pte.ppn[i-1:0] ≠ 0  this is a misaligned superpage;
@@ -336,6 +436,7 @@ impl PageTableWalker {
                         leaf_flags: pte.flags(),
                         leaf_pte_addr: pte_addr,
                         leaf_ppn: pte.ppn(),
+                        global,
                     });
                 }
             }
@@ -401,6 +502,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::R,
                 },
                 AccessEffect::Accessed,
+                TlbKind::Data,
             )
             .unwrap();
         assert_eq!(paddr.0, DATA_PAGE | 0x123);
@@ -413,6 +515,63 @@ mod test_sv39 {
         assert_eq!(leaf_pte.flags(), leaf_flags | PTEFlags::A);
     }
 
+    #[test]
+    fn tlb_asid_test() {
+        const CHECK_R: PermissionCheck = PermissionCheck {
+            any_of: PTEFlags::empty(),
+            exact_mask: PTEFlags::R,
+            exact_flags: PTEFlags::R,
+        };
+
+        let mut ram: Ram = Ram::new();
+        let leaf_flags = PTEFlags::A | PTEFlags::V | PTEFlags::R;
+        setup_3level_leaf(&mut ram, DATA_PAGE, leaf_flags);
+
+        let mut page_table = PageTableWalker::new(PT0.into(), VirtualMemoryMode::Page39bit);
+        page_table.set_asid(1);
+        let translate = |page_table: &mut PageTableWalker, ram: &mut Ram| {
+            page_table
+                .translate_vaddr(
+                    ram,
+                    0x0000_0123.into(),
+                    CHECK_R,
+                    AccessEffect::Accessed,
+                    TlbKind::Data,
+                )
+                .map(|paddr| paddr.0)
+        };
+        assert_eq!(translate(&mut page_table, &mut ram), Ok(DATA_PAGE | 0x123));
+
+        // The cached translation is used until it's fenced.
+        setup_pte(&mut ram, PT2, DATA_PAGE + 0x1000, leaf_flags);
+        assert_eq!(translate(&mut page_table, &mut ram), Ok(DATA_PAGE | 0x123));
+
+        // Another address space doesn't see it, and fencing it leaves ASID 1 untouched.
+        page_table.set_asid(2);
+        assert_eq!(
+            translate(&mut page_table, &mut ram),
+            Ok((DATA_PAGE + 0x1000) | 0x123)
+        );
+        page_table.fence(None, Some(2));
+        page_table.set_asid(1);
+        assert_eq!(translate(&mut page_table, &mut ram), Ok(DATA_PAGE | 0x123));
+
+        page_table.fence(Some(0x0000_0456), None);
+        assert_eq!(
+            translate(&mut page_table, &mut ram),
+            Ok((DATA_PAGE + 0x1000) | 0x123)
+        );
+
+        // Global mappings are shared by every ASID.
+        setup_pte(&mut ram, PT2, DATA_PAGE, leaf_flags | PTEFlags::G);
+        page_table.fence(None, None);
+        assert_eq!(translate(&mut page_table, &mut ram), Ok(DATA_PAGE | 0x123));
+        setup_pte(&mut ram, PT2, DATA_PAGE + 0x1000, leaf_flags);
+        page_table.set_asid(3);
+        page_table.fence(None, Some(3));
+        assert_eq!(translate(&mut page_table, &mut ram), Ok(DATA_PAGE | 0x123));
+    }
+
     #[test]
     fn big_page_test() {
         // 2MB Page.
@@ -443,6 +602,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::W,
                 },
                 AccessEffect::Accessed,
+                TlbKind::Data,
             )
             .unwrap();
         assert_eq!(paddr.0, 0x8111_4514);
@@ -468,6 +628,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::X,
                 },
                 AccessEffect::Accessed,
+                TlbKind::Data,
             )
             .unwrap_err();
         assert_eq!(err, PageTableError::PrivilegeFault);
@@ -493,6 +654,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::R,
                 },
                 AccessEffect::Accessed,
+                TlbKind::Data,
             )
             .unwrap_err();
 
@@ -517,6 +679,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::R,
                 },
                 AccessEffect::None,
+                TlbKind::Data,
             )
             .unwrap();
         assert_eq!(paddr.0, DATA_PAGE | 0x123);
@@ -548,6 +711,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::R,
                 },
                 AccessEffect::Accessed,
+                TlbKind::Data,
             )
             .unwrap_err();
 
@@ -574,6 +738,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::R,
                 },
                 AccessEffect::None,
+                TlbKind::Data,
             )
             .unwrap();
 
@@ -600,6 +765,7 @@ mod test_sv39 {
                     exact_flags: PTEFlags::W,
                 },
                 AccessEffect::AccessedDirty,
+                TlbKind::Data,
             )
             .unwrap();
 
@@ -0,0 +1,248 @@
+use crate::{
+    config::arch_config::WordType,
+    isa::{
+        cache::{CacheStats, Fifo, ReplacePolicy},
+        riscv::mmu::config::{PAGE_SIZE_XLEN, SUB_VPN_XLEN},
+    },
+};
+
+/// The ASID field of `satp` is 16 bits wide in RV64.
+pub type Asid = u16;
+
+#[derive(Clone, Copy)]
+struct TlbEntry<T> {
+    /// Page aligned virtual address.
+    vpn: WordType,
+    asid: Asid,
+    /// Global mappings match every ASID.
+    global: bool,
+    /// Level of the leaf PTE, `0` for a 4KiB page.
+    level: u8,
+    data: T,
+}
+
+impl<T> TlbEntry<T> {
+    #[inline]
+    fn matches(&self, vpn: WordType, asid: Asid) -> bool {
+        self.vpn == vpn && (self.global || self.asid == asid)
+    }
+
+    /// Whether `vaddr` is inside the (super)page this entry translates.
+    #[inline]
+    fn covers(&self, vaddr: WordType) -> bool {
+        let shift = PAGE_SIZE_XLEN + self.level as usize * SUB_VPN_XLEN;
+        (self.vpn ^ vaddr) >> shift == 0
+    }
+}
+
+/// Set-associative TLB with S sets, W ways per set and the replacement policy P, tagged with the ASID.
+///
+/// Superpages are cached once per 4KiB page touched, so an invalidation by address
+/// has to look at every set once a superpage has been cached.
+pub struct Tlb<T: Copy, const S: usize, const W: usize, P: ReplacePolicy<W> = Fifo> {
+    sets: [[Option<TlbEntry<T>>; W]; S],
+    policies: [P; S],
+    has_superpage: bool,
+    stats: CacheStats,
+}
+
+impl<T: Copy, const S: usize, const W: usize, P: ReplacePolicy<W>> Tlb<T, S, W, P> {
+    pub fn new() -> Self {
+        debug_assert!(S > 0 && (S & (S - 1)) == 0, "S must be a power of two.");
+
+        Self {
+            sets: [[None; W]; S],
+            policies: std::array::from_fn(|_| P::new()),
+            has_superpage: false,
+            stats: CacheStats::default(),
+        }
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        self.stats
+    }
+
+    #[inline]
+    fn set_index_of(vpn: WordType) -> usize {
+        ((vpn >> PAGE_SIZE_XLEN) as usize) & (S - 1)
+    }
+
+    #[inline]
+    pub fn get(&mut self, vpn: WordType, asid: Asid) -> Option<T> {
+        let idx = Self::set_index_of(vpn);
+        let way = self.sets[idx]
+            .iter()
+            .position(|slot| slot.as_ref().is_some_and(|entry| entry.matches(vpn, asid)));
+        self.stats.record(way.is_some());
+
+        let way = way?;
+        self.policies[idx].touch(way);
+        self.sets[idx][way].map(|entry| entry.data)
+    }
+
+    pub fn put(&mut self, vpn: WordType, asid: Asid, global: bool, level: usize, data: T) {
+        let idx = Self::set_index_of(vpn);
+        let set = &mut self.sets[idx];
+        let entry = TlbEntry {
+            vpn,
+            asid,
+            global,
+            level: level as u8,
+            data,
+        };
+
+        self.has_superpage |= level > 0;
+
+        let way = match set
+            .iter()
+            .position(|slot| slot.as_ref().is_some_and(|old| old.matches(vpn, asid)))
+        {
+            Some(way) => way,
+            None => match set.iter().position(Option::is_none) {
+                Some(way) => way,
+                None => {
+                    self.stats.evictions += 1;
+                    self.policies[idx].victim()
+                }
+            },
+        };
+
+        set[way] = Some(entry);
+        self.policies[idx].touch(way);
+    }
+
+    /// Drop the entry of `vpn` visible from `asid`.
+    #[inline]
+    pub fn invalidate(&mut self, vpn: WordType, asid: Asid) {
+        for slot in self.sets[Self::set_index_of(vpn)].iter_mut() {
+            if slot.as_ref().is_some_and(|entry| entry.matches(vpn, asid)) {
+                *slot = None;
+            }
+        }
+    }
+
+    /// Drop the entries selected by an `SFENCE.VMA`.
+    ///
+    /// - `vaddr`: only the entries translating it, otherwise all of them.
+    /// - `asid`: only the non-global entries of this address space, otherwise global ones included.
+    pub fn fence(&mut self, vaddr: Option<WordType>, asid: Option<Asid>) {
+        if vaddr.is_none() && asid.is_none() {
+            self.clear();
+            return;
+        }
+
+        let selected = |entry: &TlbEntry<T>| {
+            vaddr.is_none_or(|vaddr| entry.covers(vaddr))
+                && asid.is_none_or(|asid| !entry.global && entry.asid == asid)
+        };
+
+        let sets = match vaddr {
+            Some(vaddr) if !self.has_superpage => {
+                let idx = Self::set_index_of(vaddr);
+                &mut self.sets[idx..idx + 1]
+            }
+            _ => &mut self.sets[..],
+        };
+
+        for slot in sets.iter_mut().flatten() {
+            if slot.as_ref().is_some_and(selected) {
+                *slot = None;
+            }
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.sets = [[None; W]; S];
+        self.has_superpage = false;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    type TestTlb = Tlb<u32, 4, 2>;
+
+    const PAGE: WordType = 1 << PAGE_SIZE_XLEN;
+
+    #[test]
+    fn test_tlb_asid() {
+        let mut tlb = TestTlb::new();
+
+        tlb.put(PAGE, 1, false, 0, 10);
+        tlb.put(PAGE, 2, false, 0, 20);
+        tlb.put(2 * PAGE, 1, true, 0, 30);
+
+        assert_eq!(tlb.get(PAGE, 1), Some(10));
+        assert_eq!(tlb.get(PAGE, 2), Some(20));
+        assert_eq!(tlb.get(PAGE, 3), None);
+        assert_eq!(tlb.get(2 * PAGE, 3), Some(30));
+
+        tlb.invalidate(PAGE, 1);
+        assert_eq!(tlb.get(PAGE, 1), None);
+        assert_eq!(tlb.get(PAGE, 2), Some(20));
+    }
+
+    #[test]
+    fn test_tlb_fence() {
+        let mut tlb = TestTlb::new();
+        let fill = |tlb: &mut TestTlb| {
+            tlb.put(PAGE, 1, false, 0, 10);
+            tlb.put(PAGE, 2, false, 0, 20);
+            tlb.put(2 * PAGE, 1, true, 0, 30);
+        };
+
+        // By ASID, global mappings are kept.
+        fill(&mut tlb);
+        tlb.fence(None, Some(1));
+        assert_eq!(tlb.get(PAGE, 1), None);
+        assert_eq!(tlb.get(PAGE, 2), Some(20));
+        assert_eq!(tlb.get(2 * PAGE, 1), Some(30));
+
+        // By address, every ASID.
+        fill(&mut tlb);
+        tlb.fence(Some(PAGE + 0x123), None);
+        assert_eq!(tlb.get(PAGE, 1), None);
+        assert_eq!(tlb.get(PAGE, 2), None);
+        assert_eq!(tlb.get(2 * PAGE, 1), Some(30));
+
+        // By address and ASID.
+        fill(&mut tlb);
+        tlb.fence(Some(PAGE), Some(2));
+        assert_eq!(tlb.get(PAGE, 1), Some(10));
+        assert_eq!(tlb.get(PAGE, 2), None);
+
+        tlb.fence(None, None);
+        assert_eq!(tlb.get(PAGE, 1), None);
+        assert_eq!(tlb.get(2 * PAGE, 1), None);
+    }
+
+    #[test]
+    fn test_tlb_fence_superpage() {
+        let mut tlb = TestTlb::new();
+        let mega_page = 1 << (PAGE_SIZE_XLEN + SUB_VPN_XLEN);
+
+        // Two 4KiB pages of the same 2MiB page, in different sets.
+        tlb.put(mega_page, 1, false, 1, 10);
+        tlb.put(mega_page + PAGE, 1, false, 1, 10);
+
+        tlb.fence(Some(mega_page + 0x1000 * 100), Some(1));
+        assert_eq!(tlb.get(mega_page, 1), None);
+        assert_eq!(tlb.get(mega_page + PAGE, 1), None);
+    }
+
+    #[test]
+    fn test_tlb_stats() {
+        let mut tlb = TestTlb::new();
+
+        // Three pages of set 0, FIFO evicts the first one.
+        for i in 0..3 {
+            tlb.put(i * 4 * PAGE, 1, false, 0, i as u32);
+        }
+        assert_eq!(tlb.get(0, 1), None);
+        assert_eq!(tlb.get(8 * PAGE, 1), Some(2));
+
+        let stats = tlb.stats();
+        assert_eq!((stats.hits, stats.misses, stats.evictions), (1, 1, 1));
+    }
+}
@@ -6,14 +6,19 @@ use crate::{
     },
 };
 
+mod block_cache;
 mod cpu_tester;
 pub mod csr_reg;
+pub mod debug_points;
 pub mod debugger;
 pub mod decoder;
 pub mod executor;
 pub mod instruction;
 pub mod isa_builder;
+#[cfg(feature = "jit")]
+mod jit;
 pub mod mmu;
+mod predecode;
 pub mod trap;
 pub mod vector;
 
@@ -0,0 +1,402 @@
+//! Pre-decoded dispatch tier for hot blocks, see [`RVCPU::set_predecode_hot_blocks`].
+//!
+//! The interpreter counts how many times every block is run, once a block reaches [`HOT_THRESHOLD`]
+//! its RV64I/M integer instructions are turned into [`DecodedOp`]s with their operands and their
+//! execution function already picked, and the pc is only written back when it can be observed:
+//! before a fallback instruction, on a trap and at the end of the block.
+//!
+//! This is no code generator: the ops are still dispatched one by one, by a single `match`, the
+//! gain is the instruction info match and the pc updates saved on every instruction. Everything
+//! that is not a plain integer operation (CSR, floating point, vector, atomics, jumps ...) falls
+//! back to its interpreter execution function. The `dispatch` group of `benches/bench_cpu.rs`
+//! times both tiers on the same kernels.
+
+use std::sync::{
+    OnceLock,
+    atomic::{AtomicU32, Ordering},
+};
+
+#[cfg(feature = "jit")]
+use crate::isa::riscv::jit;
+use crate::{
+    config::arch_config::WordType,
+    isa::riscv::{
+        block_cache::BlockInstr,
+        executor::RVCPU,
+        instruction::{
+            RVInstrInfo,
+            exec_core::{handle_load, handle_store},
+            exec_function::*,
+            instr_table::RiscvInstr,
+        },
+        trap::Exception,
+    },
+    utils::{UnsignedInteger, wrapping_add_as_signed},
+};
+
+/// Number of interpreted runs before a block gets pre-decoded.
+pub(super) const HOT_THRESHOLD: u32 = 256;
+
+type AluFn = fn(WordType, WordType) -> Result<WordType, Exception>;
+type LoadFn = fn(&mut RVCPU, u8, WordType) -> Result<(), Exception>;
+type StoreFn = fn(&mut RVCPU, WordType, WordType) -> Result<(), Exception>;
+
+#[derive(Clone, Copy)]
+enum DecodedOp {
+    /// `rd = op(rs1, rs2)`
+    AluReg { op: AluFn, rd: u8, rs1: u8, rs2: u8 },
+    /// `rd = op(rs1, imm)`
+    AluImm {
+        op: AluFn,
+        rd: u8,
+        rs1: u8,
+        imm: WordType,
+    },
+    /// `rd = value`, for `LUI` and `AUIPC` whose pc is known when the block is pre-decoded.
+    LoadConst { rd: u8, value: WordType },
+    Load {
+        load: LoadFn,
+        rd: u8,
+        rs1: u8,
+        imm: WordType,
+    },
+    Store {
+        store: StoreFn,
+        rs1: u8,
+        rs2: u8,
+        imm: WordType,
+    },
+    /// Run through the interpreter, which also moves the pc.
+    Fallback(BlockInstr),
+}
+
+#[derive(Clone, Copy)]
+struct DecodedInstr {
+    op: DecodedOp,
+    pc: WordType,
+}
+
+/// A pre-decoded block.
+pub(super) struct DecodedBlock {
+    instrs: Box<[DecodedInstr]>,
+    /// The pc after the block when it doesn't end with a fallback instruction.
+    end_pc: WordType,
+}
+
+/// Execution count, pre-decoded ops and compiled code of one block.
+///
+/// Only its hart runs a block, the count is atomic for the block to be sent along with the hart.
+pub(super) struct HotCounter {
+    count: AtomicU32,
+    decoded: OnceLock<DecodedBlock>,
+    /// `None` if the block is not compiled, see [`jit::compile`].
+    #[cfg(feature = "jit")]
+    compiled: OnceLock<Option<jit::CompiledBlock>>,
+}
+
+impl HotCounter {
+    pub(super) fn new() -> Self {
+        Self {
+            count: AtomicU32::new(0),
+            decoded: OnceLock::new(),
+            #[cfg(feature = "jit")]
+            compiled: OnceLock::new(),
+        }
+    }
+
+    /// Count one run of the block, returns true once it is hot.
+    #[inline]
+    fn count_run(&self) -> bool {
+        let count = self.count.load(Ordering::Relaxed);
+        if count >= HOT_THRESHOLD {
+            return true;
+        }
+
+        self.count.store(count + 1, Ordering::Relaxed);
+        count + 1 >= HOT_THRESHOLD
+    }
+
+    /// Count one run of the block, and return its pre-decoded ops once it is hot.
+    #[inline]
+    pub(super) fn decoded_for(
+        &self,
+        start_pc: WordType,
+        end_pc: WordType,
+        instrs: &[BlockInstr],
+    ) -> Option<&DecodedBlock> {
+        if let Some(decoded) = self.decoded.get() {
+            return Some(decoded);
+        }
+        if !self.count_run() {
+            return None;
+        }
+
+        Some(
+            self.decoded
+                .get_or_init(|| predecode(start_pc, end_pc, instrs)),
+        )
+    }
+
+    /// Count one run of the block, and return its compiled code once it is hot, if it compiles.
+    #[cfg(feature = "jit")]
+    #[inline]
+    pub(super) fn compiled_for(
+        &self,
+        start_pc: WordType,
+        end_pc: WordType,
+        instrs: &[BlockInstr],
+    ) -> Option<&jit::CompiledBlock> {
+        if let Some(compiled) = self.compiled.get() {
+            return compiled.as_ref();
+        }
+        if !self.count_run() {
+            return None;
+        }
+
+        self.compiled
+            .get_or_init(|| jit::compile(start_pc, end_pc, instrs))
+            .as_ref()
+    }
+}
+
+fn alu<F: ExecTrait<Result<WordType, Exception>>>() -> AluFn {
+    F::exec
+}
+
+fn load<T: UnsignedInteger, const EXTEND: bool>() -> LoadFn {
+    handle_load::<T, EXTEND>
+}
+
+fn store<T: UnsignedInteger>() -> StoreFn {
+    handle_store::<T>
+}
+
+fn alu_of(instr: RiscvInstr) -> Option<AluFn> {
+    Some(match instr {
+        RiscvInstr::ADD | RiscvInstr::ADDI => alu::<ExecAdd>(),
+        RiscvInstr::ADDW | RiscvInstr::ADDIW => alu::<ExecAddw>(),
+        RiscvInstr::SUB => alu::<ExecSub>(),
+        RiscvInstr::SUBW => alu::<ExecSubw>(),
+        RiscvInstr::MUL => alu::<ExecMulLow>(),
+        RiscvInstr::MULW => alu::<ExecMulw>(),
+
+        RiscvInstr::SLL | RiscvInstr::SLLI => alu::<ExecSLL>(),
+        RiscvInstr::SRL | RiscvInstr::SRLI => alu::<ExecSRL>(),
+        RiscvInstr::SRA | RiscvInstr::SRAI => alu::<ExecSRA>(),
+        RiscvInstr::SLLW | RiscvInstr::SLLIW => alu::<ExecSLLW>(),
+        RiscvInstr::SRLW | RiscvInstr::SRLIW => alu::<ExecSRLW>(),
+        RiscvInstr::SRAW | RiscvInstr::SRAIW => alu::<ExecSRAW>(),
+
+        RiscvInstr::SLT | RiscvInstr::SLTI => alu::<ExecSignedLess>(),
+        RiscvInstr::SLTU | RiscvInstr::SLTIU => alu::<ExecUnsignedLess>(),
+
+        RiscvInstr::AND | RiscvInstr::ANDI => alu::<ExecAnd>(),
+        RiscvInstr::OR | RiscvInstr::ORI => alu::<ExecOr>(),
+        RiscvInstr::XOR | RiscvInstr::XORI => alu::<ExecXor>(),
+
+        _ => return None,
+    })
+}
+
+fn load_of(instr: RiscvInstr) -> Option<LoadFn> {
+    Some(match instr {
+        RiscvInstr::LB => load::<u8, true>(),
+        RiscvInstr::LBU => load::<u8, false>(),
+        RiscvInstr::LH => load::<u16, true>(),
+        RiscvInstr::LHU => load::<u16, false>(),
+        RiscvInstr::LW => load::<u32, true>(),
+        RiscvInstr::LWU => load::<u32, false>(),
+        RiscvInstr::LD => load::<u64, false>(),
+        _ => return None,
+    })
+}
+
+fn store_of(instr: RiscvInstr) -> Option<StoreFn> {
+    Some(match instr {
+        RiscvInstr::SB => store::<u8>(),
+        RiscvInstr::SH => store::<u16>(),
+        RiscvInstr::SW => store::<u32>(),
+        RiscvInstr::SD => store::<u64>(),
+        _ => return None,
+    })
+}
+
+fn predecode_instr(block_instr: BlockInstr, pc: WordType) -> DecodedOp {
+    let instr = block_instr.instr;
+
+    match block_instr.info {
+        RVInstrInfo::R { rs1, rs2, rd } => {
+            if let Some(op) = alu_of(instr) {
+                return DecodedOp::AluReg { op, rd, rs1, rs2 };
+            }
+        }
+        RVInstrInfo::I { rs1, rd, imm } => {
+            if let Some(op) = alu_of(instr) {
+                return DecodedOp::AluImm { op, rd, rs1, imm };
+            }
+            if let Some(load) = load_of(instr) {
+                return DecodedOp::Load { load, rd, rs1, imm };
+            }
+        }
+        RVInstrInfo::S { rs1, rs2, imm } => {
+            if let Some(store) = store_of(instr) {
+                return DecodedOp::Store {
+                    store,
+                    rs1,
+                    rs2,
+                    imm,
+                };
+            }
+        }
+        RVInstrInfo::U { rd, imm } => match instr {
+            RiscvInstr::LUI => return DecodedOp::LoadConst { rd, value: imm },
+            RiscvInstr::AUIPC => {
+                return DecodedOp::LoadConst {
+                    rd,
+                    value: pc.wrapping_add(imm),
+                };
+            }
+            _ => {}
+        },
+        _ => {}
+    }
+
+    DecodedOp::Fallback(block_instr)
+}
+
+fn predecode(start_pc: WordType, end_pc: WordType, instrs: &[BlockInstr]) -> DecodedBlock {
+    let mut pc = start_pc;
+    let instrs = instrs
+        .iter()
+        .map(|&instr| {
+            let decoded = DecodedInstr {
+                op: predecode_instr(instr, pc),
+                pc,
+            };
+            pc = pc.wrapping_add(instr.len as WordType);
+            decoded
+        })
+        .collect();
+
+    DecodedBlock { instrs, end_pc }
+}
+
+/// Run a pre-decoded block, returns the number of instructions stepped and the exception raised, if any.
+///
+/// On an exception the pc is left at the faulting instruction, as the interpreter does.
+pub(super) fn run(cpu: &mut RVCPU, block: &DecodedBlock) -> (u64, Result<(), Exception>) {
+    let mut pc_synced = true;
+
+    for (idx, &DecodedInstr { op, pc }) in block.instrs.iter().enumerate() {
+        let rst = match op {
+            DecodedOp::AluReg { op, rd, rs1, rs2 } => {
+                let (val1, val2) = cpu.reg_file.read(rs1, rs2);
+                op(val1, val2).map(|val| cpu.reg_file.write(rd, val))
+            }
+            DecodedOp::AluImm { op, rd, rs1, imm } => {
+                let val1 = cpu.reg_file.read(rs1, 0).0;
+                op(val1, imm).map(|val| cpu.reg_file.write(rd, val))
+            }
+            DecodedOp::LoadConst { rd, value } => {
+                cpu.reg_file.write(rd, value);
+                Ok(())
+            }
+            DecodedOp::Load { load, rd, rs1, imm } => {
+                let addr = wrapping_add_as_signed(cpu.reg_file.read(rs1, 0).0, imm);
+                load(cpu, rd, addr)
+            }
+            DecodedOp::Store {
+                store,
+                rs1,
+                rs2,
+                imm,
+            } => {
+                let (val1, val2) = cpu.reg_file.read(rs1, rs2);
+                store(cpu, wrapping_add_as_signed(val1, imm), val2)
+            }
+            DecodedOp::Fallback(BlockInstr { info, exec, .. }) => {
+                cpu.pc = pc;
+                exec(info, cpu)
+            }
+        };
+        cpu.reg_file[0] = 0;
+
+        if let Err(ex) = rst {
+            std::hint::cold_path();
+            cpu.pc = pc;
+            return (idx as u64 + 1, Err(ex));
+        }
+
+        pc_synced = matches!(op, DecodedOp::Fallback(_));
+    }
+
+    if !pc_synced {
+        cpu.pc = block.end_pc;
+    }
+
+    (block.instrs.len() as u64, Ok(()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{isa::riscv::cpu_tester::*, ram_config};
+
+    #[test]
+    fn test_run_hot_block() {
+        const RUNS: WordType = HOT_THRESHOLD as WordType * 2;
+
+        let mut cpu = TestCPUBuilder::new()
+            .reg(3, RUNS)
+            .program(&[
+                0x00108093, // label: addi x1, x1, 1
+                0x00210113, // addi x2, x2, 2
+                0xfe309ce3, // bne x1, x3, label
+            ])
+            .build();
+        cpu.set_predecode_hot_blocks(true);
+
+        for _ in 0..RUNS {
+            assert_eq!(cpu.step_block().unwrap(), 3);
+        }
+
+        CPUChecker::new(&mut cpu)
+            .reg(1, RUNS)
+            .reg(2, RUNS * 2)
+            .pc(ram_config::BASE_ADDR + 12);
+    }
+
+    #[test]
+    fn test_predecode_instr() {
+        let addi = BlockInstr::new(
+            RiscvInstr::ADDI,
+            RVInstrInfo::I {
+                rd: 1,
+                rs1: 2,
+                imm: 3,
+            },
+            4,
+        );
+        assert!(matches!(
+            predecode_instr(addi, 0),
+            DecodedOp::AluImm {
+                rd: 1,
+                rs1: 2,
+                imm: 3,
+                ..
+            }
+        ));
+
+        let auipc = BlockInstr::new(RiscvInstr::AUIPC, RVInstrInfo::U { rd: 1, imm: 0x1000 }, 4);
+        assert!(matches!(
+            predecode_instr(auipc, 0x8000_0000),
+            DecodedOp::LoadConst {
+                rd: 1,
+                value: 0x8000_1000
+            }
+        ));
+
+        let jal = BlockInstr::new(RiscvInstr::JAL, RVInstrInfo::J { rd: 1, imm: 8 }, 4);
+        assert!(matches!(predecode_instr(jal, 0), DecodedOp::Fallback(_)));
+    }
+}
@@ -50,6 +50,7 @@ impl TrapController {
         if cpu.debug {
             cpu.debug_info.last_instr.trap = true;
         }
+        cpu.stats.record_trap(cause);
 
         cpu.csr
             .get_by_type_existing::<Mstatus>()
@@ -100,6 +101,7 @@ impl TrapController {
         if cpu.debug {
             cpu.debug_info.last_instr.trap = true;
         }
+        cpu.stats.record_trap(cause);
 
         cpu.csr
             .get_by_type_existing::<Sstatus>()
@@ -6,7 +6,11 @@ use crate::{
         trap::Exception,
         vector::{
             VecOpMask, Vector,
-            arithmetic::{narrowing_source_lmul, vector_register_group_overlaps},
+            arithmetic::{
+                narrowing_source_lmul,
+                simd_impl::{HostVector, SimdLane, Splat, dense_map_saturating},
+                vector_register_group_overlaps,
+            },
             types::{FixedPointRoundingMode, VGFRef, VGFRefMut, Vsew},
         },
     },
@@ -611,8 +615,10 @@ macro_rules! dispatch_fixed_point_narrowing_sew {
     };
 }
 
+/// The `simd` kernel, if any, computes `$exec_ty` on host vectors, and returns the lanes that
+/// saturated as bits.
 macro_rules! impl_fixed_point_vv_binary {
-    ($op_ty:ty, $exec_ty:ty) => {
+    ($op_ty:ty, $exec_ty:ty $(, simd: |$a:ident, $b:ident, $round:ident| $kernel:expr)?) => {
         impl VectorOpFixedPointVV for $op_ty {
             fn exec(
                 vs1: &VGFRef,
@@ -626,12 +632,24 @@ macro_rules! impl_fixed_point_vv_binary {
                 dispatch_fixed_point_sew!(vd.sew, |T| {
                     let vs1 = vs1.as_slice::<T>();
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            let $round = round;
+                            let vd = vd.as_mut_slice::<T>();
+                            let saturated =
+                                dense_map_saturating(vs2, vs1, vd, body, |$a: V, $b: V| $kernel);
+                            mask.fill_tail(vd);
+                            return Ok(saturated);
+                        }
+                    )?
                     for (index, element) in vd.iter_mut().enumerate() {
                         let (value, element_saturated) =
                             <$exec_ty as FixedPointBinaryExec<T>>::exec(
                                 vs2[index], vs1[index], round,
                             );
-                        saturated |= element_saturated;
+                        // Only the elements written with `value` can raise `vxsat`.
+                        saturated |= element_saturated && mask.should_access(index);
                         mask.element_load(element, value, index);
                     }
                 });
@@ -642,7 +660,7 @@ macro_rules! impl_fixed_point_vv_binary {
 }
 
 macro_rules! impl_fixed_point_vx_binary {
-    ($op_ty:ty, $exec_ty:ty) => {
+    ($op_ty:ty, $exec_ty:ty $(, simd: |$a:ident, $b:ident, $round:ident| $kernel:expr)?) => {
         impl VectorOpFixedPointVX for $op_ty {
             fn exec(
                 x1: WordType,
@@ -656,10 +674,22 @@ macro_rules! impl_fixed_point_vx_binary {
                 dispatch_fixed_point_sew!(vd.sew, |T| {
                     let scalar = T::truncate_from(x1);
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            let $round = round;
+                            let vd = vd.as_mut_slice::<T>();
+                            let scalar = Splat(V::splat(scalar));
+                            let saturated =
+                                dense_map_saturating(vs2, scalar, vd, body, |$a: V, $b: V| $kernel);
+                            mask.fill_tail(vd);
+                            return Ok(saturated);
+                        }
+                    )?
                     for (index, element) in vd.iter_mut().enumerate() {
                         let (value, element_saturated) =
                             <$exec_ty as FixedPointBinaryExec<T>>::exec(vs2[index], scalar, round);
-                        saturated |= element_saturated;
+                        saturated |= element_saturated && mask.should_access(index);
                         mask.element_load(element, value, index);
                     }
                 });
@@ -670,9 +700,9 @@ macro_rules! impl_fixed_point_vx_binary {
 }
 
 macro_rules! impl_fixed_point_binary {
-    ($op_ty:ty, $exec_ty:ty) => {
-        impl_fixed_point_vv_binary!($op_ty, $exec_ty);
-        impl_fixed_point_vx_binary!($op_ty, $exec_ty);
+    ($op_ty:ty, $exec_ty:ty $(, simd: |$a:ident, $b:ident, $round:ident| $kernel:expr)?) => {
+        impl_fixed_point_vv_binary!($op_ty, $exec_ty $(, simd: |$a, $b, $round| $kernel)?);
+        impl_fixed_point_vx_binary!($op_ty, $exec_ty $(, simd: |$a, $b, $round| $kernel)?);
     };
 }
 
@@ -757,14 +787,14 @@ pub(in crate::isa::riscv) struct VectorOpSsra;
 pub(in crate::isa::riscv) struct VectorOpNclipu;
 pub(in crate::isa::riscv) struct VectorOpNclip;
 
-impl_fixed_point_binary!(VectorOpSaddu, ExecSaturatingAddUnsigned);
-impl_fixed_point_binary!(VectorOpSadd, ExecSaturatingAddSigned);
-impl_fixed_point_binary!(VectorOpSsubu, ExecSaturatingSubUnsigned);
-impl_fixed_point_binary!(VectorOpSsub, ExecSaturatingSubSigned);
-impl_fixed_point_binary!(VectorOpAaddu, ExecAveragingAddUnsigned);
-impl_fixed_point_binary!(VectorOpAadd, ExecAveragingAddSigned);
-impl_fixed_point_binary!(VectorOpAsubu, ExecAveragingSubUnsigned);
-impl_fixed_point_binary!(VectorOpAsub, ExecAveragingSubSigned);
+impl_fixed_point_binary!(VectorOpSaddu, ExecSaturatingAddUnsigned, simd: |a, b, _round| a.saturating_add(b, false));
+impl_fixed_point_binary!(VectorOpSadd, ExecSaturatingAddSigned, simd: |a, b, _round| a.saturating_add(b, true));
+impl_fixed_point_binary!(VectorOpSsubu, ExecSaturatingSubUnsigned, simd: |a, b, _round| a.saturating_sub(b, false));
+impl_fixed_point_binary!(VectorOpSsub, ExecSaturatingSubSigned, simd: |a, b, _round| a.saturating_sub(b, true));
+impl_fixed_point_binary!(VectorOpAaddu, ExecAveragingAddUnsigned, simd: |a, b, round| (a.averaging(b, false, false, round), 0));
+impl_fixed_point_binary!(VectorOpAadd, ExecAveragingAddSigned, simd: |a, b, round| (a.averaging(b, false, true, round), 0));
+impl_fixed_point_binary!(VectorOpAsubu, ExecAveragingSubUnsigned, simd: |a, b, round| (a.averaging(b, true, false, round), 0));
+impl_fixed_point_binary!(VectorOpAsub, ExecAveragingSubSigned, simd: |a, b, round| (a.averaging(b, true, true, round), 0));
 impl_fixed_point_binary!(VectorOpSmul, ExecSaturatingFractionalMul);
 impl_fixed_point_binary!(VectorOpSsrl, ExecScalingShiftRightLogical);
 impl_fixed_point_binary!(VectorOpSsra, ExecScalingShiftRightArithmetic);
@@ -1,5 +1,6 @@
 use super::*;
 use crate::isa::riscv::vector::{
+    VLEN_BYTE,
     tester::{VectorBuilder, VectorChecker},
     types::{FixedPointRoundingMode, Vlmul, Vsew},
 };
@@ -342,3 +343,91 @@ fn test_vector_op_nclipu_fractional_lmul_overlap_check() {
         },
     );
 }
+
+/// Register group 24 (`M2`) and `vxsat` after `exec` runs unmasked, then masked with every `v0`
+/// bit set: the first run takes the whole-register kernels, the second the element loop.
+fn run_dense_and_masked<F>(
+    vsew: Vsew,
+    vl: u16,
+    tail_agnostic: bool,
+    round: FixedPointRoundingMode,
+    exec: F,
+) -> [(Vec<u8>, bool); 2]
+where
+    F: Fn(&mut Vector, bool) -> bool,
+{
+    let pattern = |seed: u8| -> Vec<u8> {
+        (0..2 * VLEN_BYTE)
+            .map(|i| (i as u8).wrapping_mul(0x9d).wrapping_add(seed) ^ (i as u8 >> 3))
+            .collect()
+    };
+
+    [false, true].map(|enable_mask| {
+        let (mut vector, _mmio) = VectorBuilder::new()
+            .config(Vlmul::M2, vsew, false, tail_agnostic, vl)
+            .reg(1, 0, &[0xffu8; VLEN_BYTE])
+            .reg(2, 8, &pattern(0x11))
+            .reg(2, 16, &pattern(0x5a))
+            .reg(2, 24, &pattern(0xc3))
+            .build();
+        vector.set_fixed_point_rounding_mode(round);
+        let saturated = exec(&mut vector, enable_mask);
+        (vector.read_as_type::<u8>(24).unwrap().to_vec(), saturated)
+    })
+}
+
+fn run_vv<Op: VectorOpFixedPointVV>(vector: &mut Vector, enable_mask: bool) -> bool {
+    let param = TestOpParameter::new_vv(8, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap()
+}
+
+fn run_vx<Op: VectorOpFixedPointVX>(vector: &mut Vector, enable_mask: bool) -> bool {
+    let param = TestOpParameter::new_vx(0x7f, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap()
+}
+
+#[test]
+fn test_dense_kernels_match_element_loop() {
+    let ops: &[(&str, fn(&mut Vector, bool) -> bool)] = &[
+        ("vsaddu.vv", run_vv::<VectorOpSaddu>),
+        ("vsadd.vv", run_vv::<VectorOpSadd>),
+        ("vssubu.vv", run_vv::<VectorOpSsubu>),
+        ("vssub.vv", run_vv::<VectorOpSsub>),
+        ("vaaddu.vv", run_vv::<VectorOpAaddu>),
+        ("vaadd.vv", run_vv::<VectorOpAadd>),
+        ("vasubu.vv", run_vv::<VectorOpAsubu>),
+        ("vasub.vv", run_vv::<VectorOpAsub>),
+        ("vsadd.vx", run_vx::<VectorOpSadd>),
+        ("vssubu.vx", run_vx::<VectorOpSsubu>),
+        ("vaadd.vx", run_vx::<VectorOpAadd>),
+        ("vasubu.vx", run_vx::<VectorOpAsubu>),
+    ];
+    let rounds = [
+        FixedPointRoundingMode::RoundToNearestUp,
+        FixedPointRoundingMode::RoundToNearestEven,
+        FixedPointRoundingMode::RoundDown,
+        FixedPointRoundingMode::RoundToOdd,
+    ];
+
+    for (vsew, vlmax) in [
+        (Vsew::E8, 32),
+        (Vsew::E16, 16),
+        (Vsew::E32, 8),
+        (Vsew::E64, 4),
+    ] {
+        for vl in [vlmax, vlmax - 3] {
+            for tail_agnostic in [false, true] {
+                for round in rounds {
+                    for (name, exec) in ops {
+                        let [dense, masked] =
+                            run_dense_and_masked(vsew, vl, tail_agnostic, round, exec);
+                        assert_eq!(
+                            dense, masked,
+                            "{name} differs for {vsew:?}, vl {vl}, tail agnostic {tail_agnostic}, {round:?}"
+                        );
+                    }
+                }
+            }
+        }
+    }
+}
@@ -1,3 +1,5 @@
+use std::simd::cmp::{SimdOrd, SimdPartialEq, SimdPartialOrd};
+
 #[cfg(test)]
 use crate::isa::riscv::vector::{Vector, tester::TestOpParameter};
 use crate::{
@@ -14,6 +16,9 @@ use crate::{
         trap::Exception,
         vector::{
             VLEN_BYTE, VecOpMask,
+            arithmetic::simd_impl::{
+                HostVector, SimdLane, Splat, dense_compare, dense_map, dense_merge,
+            },
             types::{VGFRef, VGFRefMut},
         },
     },
@@ -978,8 +983,9 @@ pub(in crate::isa::riscv) trait VectorOpCompress {
     }
 }
 
+/// The `simd` kernel, if any, computes `$exec_ty` on host vectors, see [`super::simd_impl`].
 macro_rules! impl_vector_op_integer_vv_binary {
-    ($op_ty:ty, $exec_ty:ident) => {
+    ($op_ty:ty, $exec_ty:ident $(, simd: |$a:ident, $b:ident| $kernel:expr)?) => {
         impl VectorOpIntegerVV for $op_ty {
             fn exec(
                 vs1: &VGFRef,
@@ -993,6 +999,15 @@ macro_rules! impl_vector_op_integer_vv_binary {
                 dispatch_integer_sew!(sew, |T| {
                     let vs1 = vs1.as_slice::<T>();
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            let vd = vd.as_mut_slice::<T>();
+                            dense_map(vs2, vs1, vd, body, |$a: V, $b: V| $kernel);
+                            mask.fill_tail(vd);
+                            return Ok(());
+                        }
+                    )?
                     for (index, element) in vd.iter_mut().enumerate() {
                         mask.element_load(
                             element,
@@ -1058,7 +1073,7 @@ macro_rules! impl_vector_op_bit_vv_binary {
 }
 
 macro_rules! impl_vector_op_integer_vx_binary {
-    ($op_ty:ty, $exec_ty:ident) => {
+    ($op_ty:ty, $exec_ty:ident $(, simd: |$a:ident, $b:ident| $kernel:expr)?) => {
         impl VectorOpIntegerVX for $op_ty {
             fn exec(
                 x1: WordType,
@@ -1072,6 +1087,15 @@ macro_rules! impl_vector_op_integer_vx_binary {
                 dispatch_integer_sew!(sew, |T| {
                     let scalar = x1 as T;
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            let vd = vd.as_mut_slice::<T>();
+                            dense_map(vs2, Splat(V::splat(scalar)), vd, body, |$a: V, $b: V| $kernel);
+                            mask.fill_tail(vd);
+                            return Ok(());
+                        }
+                    )?
                     for (index, element) in vd.iter_mut().enumerate() {
                         mask.element_load(element, $exec_ty::<T>::exec(vs2[index], scalar)?, index);
                     }
@@ -1368,7 +1392,7 @@ fn vector_op_merge_vvm<T>(
     mask: &VecOpMask,
 ) -> Result<(), Exception>
 where
-    T: Copy + Default,
+    T: SimdLane,
 {
     let merge_mask = v0.as_slice::<u8>();
     let vs1 = vs1.as_slice::<T>();
@@ -1376,6 +1400,12 @@ where
     let len = vd.as_slice::<T>().len();
     debug_assert_eq!(vs1.len(), len);
     debug_assert_eq!(vs2.len(), len);
+    if let Some(body) = mask.dense_body(len) {
+        let vd = vd.as_mut_slice::<T>();
+        dense_merge::<T::Vector>(vs1, vs2, merge_mask, vd, body);
+        mask.fill_tail(vd);
+        return Ok(());
+    }
     for (index, element) in vd.iter_mut().enumerate() {
         let value = if read_mask_bit(merge_mask, index) {
             vs1[index]
@@ -1395,12 +1425,19 @@ fn vector_op_merge_vxm<T>(
     mask: &VecOpMask,
 ) -> Result<(), Exception>
 where
-    T: Copy + Default,
+    T: SimdLane,
 {
     let merge_mask = v0.as_slice::<u8>();
     let vs2 = vs2.as_slice::<T>();
     let len = vd.as_slice::<T>().len();
     debug_assert_eq!(vs2.len(), len);
+    if let Some(body) = mask.dense_body(len) {
+        let vd = vd.as_mut_slice::<T>();
+        let scalar = Splat(T::Vector::splat(scalar));
+        dense_merge::<T::Vector>(scalar, vs2, merge_mask, vd, body);
+        mask.fill_tail(vd);
+        return Ok(());
+    }
     for (index, element) in vd.iter_mut().enumerate() {
         let value = if read_mask_bit(merge_mask, index) {
             scalar
@@ -2040,8 +2077,9 @@ macro_rules! impl_vector_op_integer_vxm_binary {
     };
 }
 
+/// The `simd` kernel, if any, returns the bits of the lanes where `$exec_ty` is true.
 macro_rules! impl_vector_op_integer_mask_vv_binary {
-    ($op_ty:ty, $exec_ty:ident) => {
+    ($op_ty:ty, $exec_ty:ident $(, simd: |$a:ident, $b:ident| $kernel:expr)?) => {
         impl VectorOpIntegerMaskVV for $op_ty {
             fn exec(
                 vs1: &VGFRef,
@@ -2054,6 +2092,14 @@ macro_rules! impl_vector_op_integer_mask_vv_binary {
                 dispatch_integer_sew!(vs2.sew, |T| {
                     let vs1 = vs1.as_slice::<T>();
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = op_mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            dense_compare(vs2, vs1, mask, body, |$a: V, $b: V| $kernel);
+                            op_mask.fill_tail_bits(mask, vs2.len());
+                            return Ok(());
+                        }
+                    )?
                     for index in 0..vs2.len() {
                         op_mask.mask_bit_load(mask, index, $exec_ty::exec(vs2[index], vs1[index]));
                     }
@@ -2065,7 +2111,7 @@ macro_rules! impl_vector_op_integer_mask_vv_binary {
 }
 
 macro_rules! impl_vector_op_integer_mask_vx_binary {
-    ($op_ty:ty, $exec_ty:ident) => {
+    ($op_ty:ty, $exec_ty:ident $(, simd: |$a:ident, $b:ident| $kernel:expr)?) => {
         impl VectorOpIntegerMaskVX for $op_ty {
             fn exec(
                 x1: WordType,
@@ -2077,6 +2123,15 @@ macro_rules! impl_vector_op_integer_mask_vx_binary {
                 dispatch_integer_sew!(vs2.sew, |T| {
                     let scalar = x1 as T;
                     let vs2 = vs2.as_slice::<T>();
+                    $(
+                        if let Some(body) = op_mask.dense_body(vs2.len()) {
+                            type V = <T as SimdLane>::Vector;
+                            let scalar = Splat(V::splat(scalar));
+                            dense_compare(vs2, scalar, mask, body, |$a: V, $b: V| $kernel);
+                            op_mask.fill_tail_bits(mask, vs2.len());
+                            return Ok(());
+                        }
+                    )?
                     for index in 0..vs2.len() {
                         op_mask.mask_bit_load(mask, index, $exec_ty::exec(vs2[index], scalar));
                     }
@@ -2225,20 +2280,20 @@ pub(in crate::isa::riscv) struct VectorOpIotaM;
 pub(in crate::isa::riscv) struct VectorOpIdV;
 pub(in crate::isa::riscv) struct VectorOpCompressVm;
 
-impl_vector_op_integer_vv_binary!(VectorOpAdd, ExecAdd);
-impl_vector_op_integer_vv_binary!(VectorOpAddu, ExecAddu);
-impl_vector_op_integer_vv_binary!(VectorOpSub, ExecSub);
-impl_vector_op_integer_vv_binary!(VectorOpSubu, ExecSubu);
-impl_vector_op_integer_vv_binary!(VectorOpAnd, ExecAnd);
-impl_vector_op_integer_vv_binary!(VectorOpOr, ExecOr);
-impl_vector_op_integer_vv_binary!(VectorOpXor, ExecXor);
-impl_vector_op_integer_vv_binary!(VectorOpSll, ExecSLL);
-impl_vector_op_integer_vv_binary!(VectorOpSrl, ExecSRL);
-impl_vector_op_integer_vv_binary!(VectorOpSra, ExecSRA);
-impl_vector_op_integer_vv_binary!(VectorOpMax, ExecMax);
-impl_vector_op_integer_vv_binary!(VectorOpMaxu, ExecMaxu);
-impl_vector_op_integer_vv_binary!(VectorOpMin, ExecMin);
-impl_vector_op_integer_vv_binary!(VectorOpMinu, ExecMinu);
+impl_vector_op_integer_vv_binary!(VectorOpAdd, ExecAdd, simd: |a, b| a + b);
+impl_vector_op_integer_vv_binary!(VectorOpAddu, ExecAddu, simd: |a, b| a + b);
+impl_vector_op_integer_vv_binary!(VectorOpSub, ExecSub, simd: |a, b| a - b);
+impl_vector_op_integer_vv_binary!(VectorOpSubu, ExecSubu, simd: |a, b| a - b);
+impl_vector_op_integer_vv_binary!(VectorOpAnd, ExecAnd, simd: |a, b| a & b);
+impl_vector_op_integer_vv_binary!(VectorOpOr, ExecOr, simd: |a, b| a | b);
+impl_vector_op_integer_vv_binary!(VectorOpXor, ExecXor, simd: |a, b| a ^ b);
+impl_vector_op_integer_vv_binary!(VectorOpSll, ExecSLL, simd: |a, b| a << b);
+impl_vector_op_integer_vv_binary!(VectorOpSrl, ExecSRL, simd: |a, b| a >> b);
+impl_vector_op_integer_vv_binary!(VectorOpSra, ExecSRA, simd: |a, b| V::from_signed(a.to_signed() >> b.to_signed()));
+impl_vector_op_integer_vv_binary!(VectorOpMax, ExecMax, simd: |a, b| V::from_signed(a.to_signed().simd_max(b.to_signed())));
+impl_vector_op_integer_vv_binary!(VectorOpMaxu, ExecMaxu, simd: |a, b| a.simd_max(b));
+impl_vector_op_integer_vv_binary!(VectorOpMin, ExecMin, simd: |a, b| V::from_signed(a.to_signed().simd_min(b.to_signed())));
+impl_vector_op_integer_vv_binary!(VectorOpMinu, ExecMinu, simd: |a, b| a.simd_min(b));
 impl_vector_op_integer_vv_binary!(VectorOpMul, ExecMulLow);
 impl_vector_op_integer_vv_binary!(VectorOpMulh, ExecMulHighSigned);
 impl_vector_op_integer_vv_binary!(VectorOpMulhu, ExecMulHighUnsigned);
@@ -2260,21 +2315,21 @@ impl_vector_op_integer_vvv_ternary!(VectorOpNmsac, ExecNmsac);
 impl_vector_op_integer_vvv_ternary!(VectorOpMadd, ExecMadd);
 impl_vector_op_integer_vvv_ternary!(VectorOpNmsub, ExecNmsub);
 
-impl_vector_op_integer_vx_binary!(VectorOpAdd, ExecAdd);
-impl_vector_op_integer_vx_binary!(VectorOpAddu, ExecAddu);
-impl_vector_op_integer_vx_binary!(VectorOpSub, ExecSub);
-impl_vector_op_integer_vx_binary!(VectorOpSubu, ExecSubu);
-impl_vector_op_integer_vx_binary!(VectorOpRevSub, ExecRevSub);
-impl_vector_op_integer_vx_binary!(VectorOpAnd, ExecAnd);
-impl_vector_op_integer_vx_binary!(VectorOpOr, ExecOr);
-impl_vector_op_integer_vx_binary!(VectorOpXor, ExecXor);
-impl_vector_op_integer_vx_binary!(VectorOpSll, ExecSLL);
-impl_vector_op_integer_vx_binary!(VectorOpSrl, ExecSRL);
-impl_vector_op_integer_vx_binary!(VectorOpSra, ExecSRA);
-impl_vector_op_integer_vx_binary!(VectorOpMax, ExecMax);
-impl_vector_op_integer_vx_binary!(VectorOpMaxu, ExecMaxu);
-impl_vector_op_integer_vx_binary!(VectorOpMin, ExecMin);
-impl_vector_op_integer_vx_binary!(VectorOpMinu, ExecMinu);
+impl_vector_op_integer_vx_binary!(VectorOpAdd, ExecAdd, simd: |a, b| a + b);
+impl_vector_op_integer_vx_binary!(VectorOpAddu, ExecAddu, simd: |a, b| a + b);
+impl_vector_op_integer_vx_binary!(VectorOpSub, ExecSub, simd: |a, b| a - b);
+impl_vector_op_integer_vx_binary!(VectorOpSubu, ExecSubu, simd: |a, b| a - b);
+impl_vector_op_integer_vx_binary!(VectorOpRevSub, ExecRevSub, simd: |a, b| b - a);
+impl_vector_op_integer_vx_binary!(VectorOpAnd, ExecAnd, simd: |a, b| a & b);
+impl_vector_op_integer_vx_binary!(VectorOpOr, ExecOr, simd: |a, b| a | b);
+impl_vector_op_integer_vx_binary!(VectorOpXor, ExecXor, simd: |a, b| a ^ b);
+impl_vector_op_integer_vx_binary!(VectorOpSll, ExecSLL, simd: |a, b| a << b);
+impl_vector_op_integer_vx_binary!(VectorOpSrl, ExecSRL, simd: |a, b| a >> b);
+impl_vector_op_integer_vx_binary!(VectorOpSra, ExecSRA, simd: |a, b| V::from_signed(a.to_signed() >> b.to_signed()));
+impl_vector_op_integer_vx_binary!(VectorOpMax, ExecMax, simd: |a, b| V::from_signed(a.to_signed().simd_max(b.to_signed())));
+impl_vector_op_integer_vx_binary!(VectorOpMaxu, ExecMaxu, simd: |a, b| a.simd_max(b));
+impl_vector_op_integer_vx_binary!(VectorOpMin, ExecMin, simd: |a, b| V::from_signed(a.to_signed().simd_min(b.to_signed())));
+impl_vector_op_integer_vx_binary!(VectorOpMinu, ExecMinu, simd: |a, b| a.simd_min(b));
 impl_vector_op_integer_vx_binary!(VectorOpMul, ExecMulLow);
 impl_vector_op_integer_vx_binary!(VectorOpMulh, ExecMulHighSigned);
 impl_vector_op_integer_vx_binary!(VectorOpMulhu, ExecMulHighUnsigned);
@@ -2361,20 +2416,20 @@ impl_vector_op_integer_mask_vx_binary!(VectorOpMsbc, ExecSbcBorrowNoBorrow);
 impl_vector_op_integer_mask_vvm_binary!(VectorOpMsbc, ExecSbcBorrow);
 impl_vector_op_integer_mask_vxm_binary!(VectorOpMsbc, ExecSbcBorrow);
 
-impl_vector_op_integer_mask_vv_binary!(VectorOpMseq, ExecEqual);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMseq, ExecEqual);
-impl_vector_op_integer_mask_vv_binary!(VectorOpMsne, ExecNotEqual);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsne, ExecNotEqual);
-impl_vector_op_integer_mask_vv_binary!(VectorOpMsltu, ExecUnsignedLess);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsltu, ExecUnsignedLess);
-impl_vector_op_integer_mask_vv_binary!(VectorOpMslt, ExecSignedLess);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMslt, ExecSignedLess);
-impl_vector_op_integer_mask_vv_binary!(VectorOpMsleu, ExecUnsignedLessEqual);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsleu, ExecUnsignedLessEqual);
-impl_vector_op_integer_mask_vv_binary!(VectorOpMsle, ExecSignedLessEqual);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsle, ExecSignedLessEqual);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsgtu, ExecUnsignedGreaterX);
-impl_vector_op_integer_mask_vx_binary!(VectorOpMsgt, ExecSignedGreaterX);
+impl_vector_op_integer_mask_vv_binary!(VectorOpMseq, ExecEqual, simd: |a, b| a.simd_eq(b).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMseq, ExecEqual, simd: |a, b| a.simd_eq(b).to_bitmask());
+impl_vector_op_integer_mask_vv_binary!(VectorOpMsne, ExecNotEqual, simd: |a, b| a.simd_ne(b).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsne, ExecNotEqual, simd: |a, b| a.simd_ne(b).to_bitmask());
+impl_vector_op_integer_mask_vv_binary!(VectorOpMsltu, ExecUnsignedLess, simd: |a, b| a.simd_lt(b).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsltu, ExecUnsignedLess, simd: |a, b| a.simd_lt(b).to_bitmask());
+impl_vector_op_integer_mask_vv_binary!(VectorOpMslt, ExecSignedLess, simd: |a, b| a.to_signed().simd_lt(b.to_signed()).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMslt, ExecSignedLess, simd: |a, b| a.to_signed().simd_lt(b.to_signed()).to_bitmask());
+impl_vector_op_integer_mask_vv_binary!(VectorOpMsleu, ExecUnsignedLessEqual, simd: |a, b| a.simd_le(b).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsleu, ExecUnsignedLessEqual, simd: |a, b| a.simd_le(b).to_bitmask());
+impl_vector_op_integer_mask_vv_binary!(VectorOpMsle, ExecSignedLessEqual, simd: |a, b| a.to_signed().simd_le(b.to_signed()).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsle, ExecSignedLessEqual, simd: |a, b| a.to_signed().simd_le(b.to_signed()).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsgtu, ExecUnsignedGreaterX, simd: |a, b| b.simd_gt(a).to_bitmask());
+impl_vector_op_integer_mask_vx_binary!(VectorOpMsgt, ExecSignedGreaterX, simd: |a, b| b.to_signed().simd_gt(a.to_signed()).to_bitmask());
 
 impl_vector_op_integer_v_unary_ext!(
     VectorOpZextVf2,
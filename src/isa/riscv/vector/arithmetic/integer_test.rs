@@ -2448,3 +2448,106 @@ fn test_vector_op_zext_vf2() {
         |checker| checker.reg(LMUL.get_lmul(), param.vd(), &expected),
     );
 }
+
+/// Register group 24 (`M2`) after `exec` runs unmasked, then masked with every `v0` bit set: the
+/// first run takes the whole-register kernels, the second the element loop.
+fn run_dense_and_masked<F>(vsew: Vsew, vl: u16, tail_agnostic: bool, exec: F) -> [Vec<u8>; 2]
+where
+    F: Fn(&mut Vector, bool),
+{
+    let pattern = |seed: u8| -> Vec<u8> {
+        (0..2 * VLEN_BYTE)
+            .map(|i| (i as u8).wrapping_mul(0x9d).wrapping_add(seed) ^ (i as u8 >> 3))
+            .collect()
+    };
+    let vs2 = pattern(0x5a);
+    // Some equal elements, for the comparisons.
+    let vs1: Vec<u8> = pattern(0x11)
+        .iter()
+        .zip(&vs2)
+        .enumerate()
+        .map(|(i, (vs1, vs2))| if i % 12 < 4 { *vs2 } else { *vs1 })
+        .collect();
+
+    [false, true].map(|enable_mask| {
+        let (mut vector, _mmio) = VectorBuilder::new()
+            .config(Vlmul::M2, vsew, false, tail_agnostic, vl)
+            .reg(1, 0, &[0xffu8; VLEN_BYTE])
+            .reg(2, 8, &vs1)
+            .reg(2, 16, &vs2)
+            .reg(2, 24, &pattern(0xc3))
+            .build();
+        exec(&mut vector, enable_mask);
+        vector.read_as_type::<u8>(24).unwrap().to_vec()
+    })
+}
+
+fn run_vv<Op: VectorOpIntegerVV>(vector: &mut Vector, enable_mask: bool) {
+    let param = TestOpParameter::new_vv(8, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap();
+}
+
+fn run_vx<Op: VectorOpIntegerVX>(vector: &mut Vector, enable_mask: bool) {
+    let param = TestOpParameter::new_vx(0x85, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap();
+}
+
+fn run_mask_vv<Op: VectorOpIntegerMaskVV>(vector: &mut Vector, enable_mask: bool) {
+    let param = TestOpParameter::new_vv(8, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap();
+}
+
+fn run_mask_vx<Op: VectorOpIntegerMaskVX>(vector: &mut Vector, enable_mask: bool) {
+    let param = TestOpParameter::new_vx(0x85, 16, 24).with_enable_mask(enable_mask);
+    Op::test(vector, param).unwrap();
+}
+
+#[test]
+fn test_dense_kernels_match_element_loop() {
+    let ops: &[(&str, fn(&mut Vector, bool))] = &[
+        ("vadd.vv", run_vv::<VectorOpAdd>),
+        ("vsub.vv", run_vv::<VectorOpSub>),
+        ("vand.vv", run_vv::<VectorOpAnd>),
+        ("vor.vv", run_vv::<VectorOpOr>),
+        ("vxor.vv", run_vv::<VectorOpXor>),
+        ("vsll.vv", run_vv::<VectorOpSll>),
+        ("vsrl.vv", run_vv::<VectorOpSrl>),
+        ("vsra.vv", run_vv::<VectorOpSra>),
+        ("vmax.vv", run_vv::<VectorOpMax>),
+        ("vmaxu.vv", run_vv::<VectorOpMaxu>),
+        ("vmin.vv", run_vv::<VectorOpMin>),
+        ("vminu.vv", run_vv::<VectorOpMinu>),
+        ("vadd.vx", run_vx::<VectorOpAdd>),
+        ("vrsub.vx", run_vx::<VectorOpRevSub>),
+        ("vsra.vx", run_vx::<VectorOpSra>),
+        ("vmin.vx", run_vx::<VectorOpMin>),
+        ("vmseq.vv", run_mask_vv::<VectorOpMseq>),
+        ("vmsne.vv", run_mask_vv::<VectorOpMsne>),
+        ("vmsltu.vv", run_mask_vv::<VectorOpMsltu>),
+        ("vmslt.vv", run_mask_vv::<VectorOpMslt>),
+        ("vmsleu.vv", run_mask_vv::<VectorOpMsleu>),
+        ("vmsle.vv", run_mask_vv::<VectorOpMsle>),
+        ("vmsle.vx", run_mask_vx::<VectorOpMsle>),
+        ("vmsgtu.vx", run_mask_vx::<VectorOpMsgtu>),
+        ("vmsgt.vx", run_mask_vx::<VectorOpMsgt>),
+    ];
+
+    for (vsew, vlmax) in [
+        (Vsew::E8, 32),
+        (Vsew::E16, 16),
+        (Vsew::E32, 8),
+        (Vsew::E64, 4),
+    ] {
+        for vl in [vlmax, vlmax - 3] {
+            for tail_agnostic in [false, true] {
+                for (name, exec) in ops {
+                    let [dense, masked] = run_dense_and_masked(vsew, vl, tail_agnostic, exec);
+                    assert_eq!(
+                        dense, masked,
+                        "{name} differs for {vsew:?}, vl {vl}, tail agnostic {tail_agnostic}"
+                    );
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,317 @@
+//! Whole-register kernels on host vectors, for the operations where every body element is active.
+//!
+//! `VLEN` is 128, so a vector register is one 128-bit host vector (SSE2, NEON, simd128) of
+//! `16 / SEW` lanes, and a register group is `LMUL` of them. The element loops take these kernels
+//! when [`VecOpMask::dense_body`] allows it, that is unmasked and from element 0, so that no
+//! element needs its own mask, `vstart` or tail test. The last register may be partly past `vl`:
+//! its lanes past `vl` are computed on zeros and dropped.
+//!
+//! [`VecOpMask::dense_body`]: crate::isa::riscv::vector::VecOpMask::dense_body
+
+use std::simd::{
+    Mask, Simd,
+    cmp::SimdPartialEq,
+    num::{SimdInt, SimdUint},
+};
+
+use crate::isa::riscv::vector::{VLEN_BYTE, types::FixedPointRoundingMode};
+
+/// The host vector of one vector register of `Self` elements.
+pub(super) trait SimdLane: Copy + Default {
+    type Vector: HostVector<Elem = Self>;
+}
+
+pub(super) trait HostVector: Copy {
+    type Elem: Copy + Default;
+    /// The same lanes, as signed integers.
+    type Signed: Copy;
+    const LANES: usize;
+
+    fn splat(value: Self::Elem) -> Self;
+    fn load(lanes: &[Self::Elem]) -> Self;
+    fn lanes(&self) -> &[Self::Elem];
+    fn to_signed(self) -> Self::Signed;
+    fn from_signed(value: Self::Signed) -> Self;
+
+    /// Lane `i` of `if_set` where bit `i` of `bits` is set, of `if_clear` otherwise.
+    fn select(bits: u64, if_set: Self, if_clear: Self) -> Self;
+
+    /// Saturating `self + other`, and the lanes that saturated as bits.
+    fn saturating_add(self, other: Self, signed: bool) -> (Self, u64);
+    /// Saturating `self - other`, and the lanes that saturated as bits.
+    fn saturating_sub(self, other: Self, signed: bool) -> (Self, u64);
+    /// `(self + other) >> 1` or `(self - other) >> 1` without intermediate overflow, rounded as
+    /// `vxrm` says.
+    fn averaging(
+        self,
+        other: Self,
+        subtract: bool,
+        signed: bool,
+        round: FixedPointRoundingMode,
+    ) -> Self;
+}
+
+macro_rules! impl_host_vector {
+    ($(($elem:ty, $signed:ty)),*) => {
+        $(
+            impl SimdLane for $elem {
+                type Vector = Simd<$elem, { VLEN_BYTE / size_of::<$elem>() }>;
+            }
+
+            impl HostVector for Simd<$elem, { VLEN_BYTE / size_of::<$elem>() }> {
+                type Elem = $elem;
+                type Signed = Simd<$signed, { VLEN_BYTE / size_of::<$elem>() }>;
+                const LANES: usize = VLEN_BYTE / size_of::<$elem>();
+
+                #[inline(always)]
+                fn splat(value: $elem) -> Self {
+                    Simd::splat(value)
+                }
+
+                #[inline(always)]
+                fn load(lanes: &[$elem]) -> Self {
+                    Simd::from_slice(lanes)
+                }
+
+                #[inline(always)]
+                fn lanes(&self) -> &[$elem] {
+                    self.as_array()
+                }
+
+                #[inline(always)]
+                fn to_signed(self) -> Self::Signed {
+                    self.cast()
+                }
+
+                #[inline(always)]
+                fn from_signed(value: Self::Signed) -> Self {
+                    value.cast()
+                }
+
+                #[inline(always)]
+                fn select(bits: u64, if_set: Self, if_clear: Self) -> Self {
+                    Mask::<$signed, { VLEN_BYTE / size_of::<$elem>() }>::from_bitmask(bits).select(if_set, if_clear)
+                }
+
+                #[inline(always)]
+                fn saturating_add(self, other: Self, signed: bool) -> (Self, u64) {
+                    let result = if signed {
+                        Self::from_signed(self.to_signed().saturating_add(other.to_signed()))
+                    } else {
+                        SimdUint::saturating_add(self, other)
+                    };
+                    (result, result.simd_ne(self + other).to_bitmask())
+                }
+
+                #[inline(always)]
+                fn saturating_sub(self, other: Self, signed: bool) -> (Self, u64) {
+                    let result = if signed {
+                        Self::from_signed(self.to_signed().saturating_sub(other.to_signed()))
+                    } else {
+                        SimdUint::saturating_sub(self, other)
+                    };
+                    (result, result.simd_ne(self - other).to_bitmask())
+                }
+
+                #[inline(always)]
+                fn averaging(
+                    self,
+                    other: Self,
+                    subtract: bool,
+                    signed: bool,
+                    round: FixedPointRoundingMode,
+                ) -> Self {
+                    // With `x = 2 * (x >> 1) + (x & 1)`, the halves can not overflow, and the low
+                    // bits add a carry or a borrow, and the discarded bit.
+                    let one = Self::splat(1);
+                    let (half, other_half) = if signed {
+                        let one = <<Self as HostVector>::Signed>::splat(1);
+                        (
+                            Self::from_signed(self.to_signed() >> one),
+                            Self::from_signed(other.to_signed() >> one),
+                        )
+                    } else {
+                        (self >> one, other >> one)
+                    };
+                    let floor = if subtract {
+                        half - other_half - (!self & other & one)
+                    } else {
+                        half + other_half + (self & other & one)
+                    };
+
+                    let discarded = (self ^ other) & one;
+                    let increment = match round {
+                        FixedPointRoundingMode::RoundToNearestUp => discarded,
+                        FixedPointRoundingMode::RoundToNearestEven => discarded & floor,
+                        FixedPointRoundingMode::RoundDown => Self::splat(0),
+                        FixedPointRoundingMode::RoundToOdd => discarded & !floor,
+                    };
+                    floor + increment
+                }
+            }
+        )*
+    };
+}
+
+impl_host_vector!((u8, i8), (u16, i16), (u32, i32), (u64, i64));
+
+/// A kernel source: a register group, or a scalar in every lane.
+pub(super) trait Operand<V: HostVector> {
+    fn chunk(&self, start: usize, len: usize) -> V;
+}
+
+impl<V: HostVector> Operand<V> for &[V::Elem] {
+    #[inline(always)]
+    fn chunk(&self, start: usize, len: usize) -> V {
+        let lanes = &self[start..start + len];
+        if len == V::LANES {
+            V::load(lanes)
+        } else {
+            let mut padded = [<V::Elem as Default>::default(); VLEN_BYTE];
+            padded[..len].copy_from_slice(lanes);
+            V::load(&padded[..V::LANES])
+        }
+    }
+}
+
+pub(super) struct Splat<V>(pub(super) V);
+
+impl<V: HostVector> Operand<V> for Splat<V> {
+    #[inline(always)]
+    fn chunk(&self, _start: usize, _len: usize) -> V {
+        self.0
+    }
+}
+
+/// Start and length of the host vectors covering `..len`.
+#[inline(always)]
+fn chunks<V: HostVector>(len: usize) -> impl Iterator<Item = (usize, usize)> {
+    (0..len)
+        .step_by(V::LANES)
+        .map(move |start| (start, V::LANES.min(len - start)))
+}
+
+#[inline(always)]
+fn lane_mask(len: usize) -> u64 {
+    u64::MAX >> (u64::BITS as usize - len)
+}
+
+/// Bits `start..start + len` of a mask register, `len` being at most [`VLEN_BYTE`].
+#[inline(always)]
+fn load_mask_bits(mask: &[u8], start: usize, len: usize) -> u64 {
+    let bytes = &mask[start / 8..(start + len).div_ceil(8)];
+    let bits = bytes
+        .iter()
+        .rev()
+        .fold(0u64, |bits, byte| bits << 8 | *byte as u64);
+    (bits >> (start % 8)) & lane_mask(len)
+}
+
+/// Write the low `len` bits of `bits` to the bits `start..start + len` of a mask register.
+#[inline(always)]
+pub(super) fn store_mask_bits(mask: &mut [u8], start: usize, len: usize, bits: u64) {
+    let mut done = 0;
+    while done < len {
+        let index = start + done;
+        let shift = index % 8;
+        let count = (8 - shift).min(len - done);
+        let field = (((1u16 << count) - 1) as u8) << shift;
+        let byte = &mut mask[index / 8];
+        *byte = (*byte & !field) | (((bits >> done) as u8) << shift & field);
+        done += count;
+    }
+}
+
+/// `vd[i] = op(vs2[i], vs1[i])` over the body `..len`.
+#[inline(always)]
+pub(super) fn dense_map<V: HostVector>(
+    vs2: impl Operand<V>,
+    vs1: impl Operand<V>,
+    vd: &mut [V::Elem],
+    len: usize,
+    op: impl Fn(V, V) -> V,
+) {
+    for (start, n) in chunks::<V>(len) {
+        let value = op(vs2.chunk(start, n), vs1.chunk(start, n));
+        vd[start..start + n].copy_from_slice(&value.lanes()[..n]);
+    }
+}
+
+/// Same as [`dense_map`] for the saturating operations, returns whether any element saturated.
+#[inline(always)]
+pub(super) fn dense_map_saturating<V: HostVector>(
+    vs2: impl Operand<V>,
+    vs1: impl Operand<V>,
+    vd: &mut [V::Elem],
+    len: usize,
+    op: impl Fn(V, V) -> (V, u64),
+) -> bool {
+    let mut saturated = 0;
+    for (start, n) in chunks::<V>(len) {
+        let (value, lanes_saturated) = op(vs2.chunk(start, n), vs1.chunk(start, n));
+        vd[start..start + n].copy_from_slice(&value.lanes()[..n]);
+        saturated |= lanes_saturated & lane_mask(n);
+    }
+    saturated != 0
+}
+
+/// Bit `i` of the mask register `vd` is bit `i` of `op(vs2, vs1)` over the body `..len`.
+#[inline(always)]
+pub(super) fn dense_compare<V: HostVector>(
+    vs2: impl Operand<V>,
+    vs1: impl Operand<V>,
+    vd: &mut [u8],
+    len: usize,
+    op: impl Fn(V, V) -> u64,
+) {
+    for (start, n) in chunks::<V>(len) {
+        store_mask_bits(vd, start, n, op(vs2.chunk(start, n), vs1.chunk(start, n)));
+    }
+}
+
+/// `vd[i] = v0[i] ? vs1[i] : vs2[i]` over the body `..len`.
+#[inline(always)]
+pub(super) fn dense_merge<V: HostVector>(
+    vs1: impl Operand<V>,
+    vs2: impl Operand<V>,
+    v0: &[u8],
+    vd: &mut [V::Elem],
+    len: usize,
+) {
+    for (start, n) in chunks::<V>(len) {
+        let bits = load_mask_bits(v0, start, n);
+        let value = V::select(bits, vs1.chunk(start, n), vs2.chunk(start, n));
+        vd[start..start + n].copy_from_slice(&value.lanes()[..n]);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_mask_bits() {
+        let mut mask = [0u8; VLEN_BYTE];
+        store_mask_bits(&mut mask, 3, 9, 0x1ff);
+        assert_eq!(mask[..3], [0xf8, 0x0f, 0x00]);
+        assert_eq!(load_mask_bits(&mask, 3, 9), 0x1ff);
+        assert_eq!(load_mask_bits(&mask, 0, 16), 0x0ff8);
+
+        store_mask_bits(&mut mask, 4, 2, 0b01);
+        assert_eq!(mask[0], 0xd8);
+        store_mask_bits(&mut mask, 112, 16, 0xa5a5);
+        assert_eq!(mask[14..], [0xa5, 0xa5]);
+        assert_eq!(load_mask_bits(&mask, 112, 16), 0xa5a5);
+    }
+
+    #[test]
+    fn test_averaging() {
+        type V = <u8 as SimdLane>::Vector;
+        let round = FixedPointRoundingMode::RoundToNearestUp;
+        let (a, b) = (V::splat(0xff), V::splat(0x01));
+        assert_eq!(a.averaging(b, false, false, round).lanes()[0], 0x80);
+        assert_eq!(a.averaging(b, false, true, round).lanes()[0], 0x00);
+        assert_eq!(b.averaging(a, true, false, round).lanes()[0], 0x81);
+        assert_eq!(b.averaging(a, true, true, round).lanes()[0], 0x01);
+    }
+}
@@ -1,11 +1,14 @@
+use std::ops::Range;
+
 use crate::{
     config::arch_config::WordType,
     cpu::VectorRegFile,
     device::{DeviceTrait, MemError, mmio::MemoryMapIO},
     isa::riscv::{
         trap::Exception,
-        vector::types::{VGFRef, VGFRefMut, VectorConfig, Vlmul, Vsew},
+        vector::types::{FixedPointRoundingMode, VGFRef, VGFRefMut, VectorConfig, Vlmul, Vsew},
     },
+    snapshot::{Snapshot, SnapshotError, StateReader, StateWriter},
 };
 
 pub mod arithmetic;
@@ -15,6 +18,29 @@ pub mod types;
 pub const VLEN: usize = 128;
 pub const VLEN_BYTE: usize = VLEN >> 3;
 
+/// The memory of the vector loads and stores, at physical addresses.
+///
+/// A hart reaches it through [`VectorMemIO`], which also has the accesses traced and checked
+/// against the watchpoints.
+///
+/// [`VectorMemIO`]: crate::isa::riscv::mmu::VectorMemIO
+pub(crate) trait VectorMemory: DeviceTrait {
+    /// See [`MemoryMapIO::read_ram_bytes`], the vector unit falls back to the elements when it fails.
+    fn read_ram_bytes(&mut self, p_addr: WordType, buf: &mut [u8]) -> Result<(), MemError>;
+    /// See [`MemoryMapIO::write_ram_bytes`].
+    fn write_ram_bytes(&mut self, p_addr: WordType, data: &[u8]) -> Result<(), MemError>;
+}
+
+impl VectorMemory for MemoryMapIO {
+    fn read_ram_bytes(&mut self, p_addr: WordType, buf: &mut [u8]) -> Result<(), MemError> {
+        MemoryMapIO::read_ram_bytes(self, p_addr, buf)
+    }
+
+    fn write_ram_bytes(&mut self, p_addr: WordType, data: &[u8]) -> Result<(), MemError> {
+        MemoryMapIO::write_ram_bytes(self, p_addr, data)
+    }
+}
+
 /// Core structure of the RISC-V vector extension, managing vector configuration and the vector register file.
 ///
 /// Provides execution capabilities for vector load/store instructions (stride, indexed, masked, etc.),
@@ -24,6 +50,42 @@ pub(super) struct Vector {
     vector_regfile: VectorRegFile,
 }
 
+impl Snapshot for Vector {
+    fn save(&self, out: &mut StateWriter) {
+        let config = &self.config;
+        out.write_u8(config.vlmul as u8);
+        out.write_u8(config.vsew as u8);
+        out.write_bool(config.tail_agnostic);
+        out.write_bool(config.mask_agnostic);
+        out.write_bool(config.fixed_point_accrued_saturation_flag);
+        out.write_u8(config.fixed_point_rounding_mode as u8);
+        out.write_u16(config.vl);
+        self.vector_regfile.save(out);
+    }
+
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError> {
+        let vlmul = state.read_u8()?;
+        let vsew = state.read_u8()?;
+        if vlmul == 4 || vlmul > 7 || vsew > 3 {
+            return Err(SnapshotError::BadFormat);
+        }
+        self.config.vlmul = Vlmul::from(vlmul);
+        self.config.vsew = Vsew::from(vsew);
+        self.config.tail_agnostic = state.read_bool()?;
+        self.config.mask_agnostic = state.read_bool()?;
+        self.config.fixed_point_accrued_saturation_flag = state.read_bool()?;
+        self.config.fixed_point_rounding_mode = match state.read_u8()? {
+            0 => FixedPointRoundingMode::RoundToNearestUp,
+            1 => FixedPointRoundingMode::RoundToNearestEven,
+            2 => FixedPointRoundingMode::RoundDown,
+            3 => FixedPointRoundingMode::RoundToOdd,
+            _ => return Err(SnapshotError::BadFormat),
+        };
+        self.config.vl = state.read_u16()?;
+        self.vector_regfile.restore(state)
+    }
+}
+
 // ============= Address Calculator =============
 
 /// Stride address calculator for vector stride load/store instruction address generation.
@@ -66,6 +128,27 @@ impl VectorIndexedAddrCal {
     }
 }
 
+/// The bytes of the elements `vstart..vl` of a unit-stride transfer of `width` bytes elements from
+/// `base_addr`, out of the `capacity` bytes of the register group, and the address of the first.
+///
+/// `None` if the transfer can't be one copy: a misaligned element must fault on its own.
+#[inline]
+fn unit_stride_span(
+    base_addr: WordType,
+    width: usize,
+    vstart: usize,
+    vl: usize,
+    capacity: usize,
+) -> Option<(Range<usize>, WordType)> {
+    if base_addr % width as WordType != 0 {
+        return None;
+    }
+
+    let end = (vl * width).min(capacity);
+    let start = (vstart * width).min(end);
+    Some((start..end, base_addr.wrapping_add(start as WordType)))
+}
+
 /// Error returned by vector memory helpers.
 ///
 /// Memory faults need to carry the element index that caused the trap so the
@@ -209,6 +292,43 @@ impl VecOpMask {
         index < self.length as usize
     }
 
+    /// The number of body elements out of `capacity` when all of them are active: the operation is
+    /// unmasked and starts at element 0. The caller then writes the body without testing each
+    /// element, and the tail with [`Self::fill_tail`] or [`Self::fill_tail_bits`].
+    #[inline(always)]
+    pub fn dense_body(&self, capacity: usize) -> Option<usize> {
+        (self.mask_bit.is_none() && self.start == 0).then(|| (self.length as usize).min(capacity))
+    }
+
+    /// The tail of a destination written through [`Self::dense_body`], as [`Self::mask_value`]
+    /// would leave it.
+    #[inline]
+    pub fn fill_tail<T>(&self, elements: &mut [T])
+    where
+        T: Copy + Default,
+    {
+        if self.tail_agnostic {
+            let body = (self.length as usize).min(elements.len());
+            elements[body..].fill(T::default());
+        }
+    }
+
+    /// Same as [`Self::fill_tail`], for a mask destination of `capacity` bits.
+    #[inline]
+    pub fn fill_tail_bits(&self, mask: &mut [u8], capacity: usize) {
+        if !self.tail_agnostic {
+            return;
+        }
+
+        let mut index = (self.length as usize).min(capacity);
+        while index < capacity {
+            let shift = index % 8;
+            let count = (8 - shift).min(capacity - index);
+            mask[index / 8] &= !((((1u16 << count) - 1) as u8) << shift);
+            index += count;
+        }
+    }
+
     #[inline(always)]
     pub fn mask_value<T>(&self, value: T, index: usize) -> Option<T>
     where
@@ -372,13 +492,35 @@ impl Vector {
         enable_mask: bool,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let f = VectorStrideAddrCal {
             base: base_addr,
             stride: stride.unwrap_or(eew.into_byte_width() as WordType),
         };
         let lmul = self.config.vlmul.get_lmul();
+
+        // An unmasked unit-stride load of one field is a copy from RAM to the register bytes. The
+        // element loop below is only needed to tell which element faults, or to reach a device.
+        let width = eew.into_byte_width() as usize;
+        if seg == 1 && !enable_mask && f.stride == width as WordType {
+            let regs = self.vector_regfile.get_mut::<u8>(lmul, vd, 1)?;
+            let vl = self.config.vl as usize;
+            // No element is updated from `vstart >= vl` on, the tail included.
+            if vstart >= vl {
+                return Ok(());
+            }
+            if let Some((bytes, addr)) = unit_stride_span(base_addr, width, vstart, vl, regs.len())
+            {
+                if mem.read_ram_bytes(addr, &mut regs[bytes.clone()]).is_ok() {
+                    if self.config.tail_agnostic {
+                        regs[bytes.end..].fill(0);
+                    }
+                    return Ok(());
+                }
+            }
+        }
+
         let mask = VecOpMask::new(
             &self.vector_regfile,
             self.config.vl * seg as u16,
@@ -443,7 +585,7 @@ impl Vector {
         vd: u8,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let saved_config = self.config;
         self.config.vlmul = Vlmul::M1;
@@ -471,7 +613,7 @@ impl Vector {
         nf: u8,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let eew = Vsew::E64;
         let f = VectorStrideAddrCal {
@@ -480,6 +622,18 @@ impl Vector {
         };
         let lmul = decode_whole_register_count(nf)?;
 
+        let regs = self.vector_regfile.get_mut::<u8>(lmul, vd, 1)?;
+        let width = eew.into_byte_width() as usize;
+        let len = regs.len() / width;
+        if vstart >= len {
+            return Ok(());
+        }
+        if let Some((bytes, addr)) = unit_stride_span(base_addr, width, vstart, len, regs.len()) {
+            if mem.read_ram_bytes(addr, &mut regs[bytes]).is_ok() {
+                return Ok(());
+            }
+        }
+
         let mut vd_ref = VGFRefMut::new(
             self.vector_regfile.get_mut(lmul, vd, 1)?,
             eew.into_byte_width(),
@@ -512,7 +666,7 @@ impl Vector {
         enable_mask: bool,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let f = VectorIndexedAddrCal {
             base: base_addr,
@@ -580,13 +734,27 @@ impl Vector {
         enable_mask: bool,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let f = VectorStrideAddrCal {
             base: base_addr,
             stride: stride.unwrap_or(eew.into_byte_width() as WordType),
         };
         let lmul = self.config.vlmul.get_lmul();
+
+        // Same as in `stride_load`, the RAM range is checked before anything is written.
+        let width = eew.into_byte_width() as usize;
+        if seg == 1 && !enable_mask && f.stride == width as WordType {
+            let regs = self.vector_regfile.get_ref(lmul, 1, vs)?;
+            let vl = self.config.vl as usize;
+            if let Some((bytes, addr)) = unit_stride_span(base_addr, width, vstart, vl, regs.len())
+            {
+                if mem.write_ram_bytes(addr, &regs[bytes]).is_ok() {
+                    return Ok(());
+                }
+            }
+        }
+
         let vd_ref = VGFRef::new(
             self.vector_regfile.get_ref(lmul, seg, vs)?,
             eew.into_byte_width(),
@@ -642,7 +810,7 @@ impl Vector {
         vs: u8,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let saved_config = self.config;
         self.config.vlmul = Vlmul::M1;
@@ -663,7 +831,7 @@ impl Vector {
         enable_mask: bool,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let f = VectorIndexedAddrCal {
             base: base_addr,
@@ -733,7 +901,7 @@ impl Vector {
         nf: u8,
         vstart: usize,
         base_addr: WordType,
-        mem: &mut MemoryMapIO,
+        mem: &mut impl VectorMemory,
     ) -> Result<(), VectorMemException> {
         let eew = Vsew::E64;
         let f = VectorStrideAddrCal {
@@ -741,6 +909,16 @@ impl Vector {
             stride: eew.into_byte_width() as WordType,
         };
         let lmul = decode_whole_register_count(nf)?;
+
+        let regs = self.vector_regfile.get_ref(lmul, 1, vs)?;
+        let width = eew.into_byte_width() as usize;
+        let len = regs.len() / width;
+        if let Some((bytes, addr)) = unit_stride_span(base_addr, width, vstart, len, regs.len()) {
+            if mem.write_ram_bytes(addr, &regs[bytes]).is_ok() {
+                return Ok(());
+            }
+        }
+
         let vs_ref = VGFRef::new(
             self.vector_regfile.get_ref(lmul, 1, vs)?,
             eew.into_byte_width(),
@@ -767,7 +945,7 @@ impl Vector {
 #[cfg(test)]
 mod test {
     use super::*;
-    use crate::ram_config::BASE_ADDR;
+    use crate::{ram_config, ram_config::BASE_ADDR};
     use tester::{VectorBuilder, VectorChecker};
 
     #[test]
@@ -1155,6 +1333,75 @@ mod test {
         });
     }
 
+    #[test]
+    fn test_unit_stride_load_resumes_at_vstart() {
+        let base_addr = BASE_ADDR + 0x3000;
+        let init = [0xDEAD_BEEF_u32; VLEN_BYTE / 2];
+        let (mut vector, mut mmio) = VectorBuilder::new()
+            .config(Vlmul::M2, Vsew::E32, false, true, 6)
+            .mem_range(0..8, |i| (base_addr + 4 * i as WordType, i as u32 + 100))
+            .reg(Vlmul::M2.get_lmul(), 8, &init)
+            .build();
+
+        vector
+            .stride_load(8, Vsew::E32, 1, None, false, 3, base_addr, &mut mmio)
+            .unwrap();
+
+        let expected = [
+            0xDEAD_BEEF_u32,
+            0xDEAD_BEEF,
+            0xDEAD_BEEF,
+            103,
+            104,
+            105,
+            0,
+            0,
+        ];
+        VectorChecker::new(&mut vector, &mut mmio).reg(Vlmul::M2.get_lmul(), 8, &expected);
+    }
+
+    #[test]
+    fn test_unit_stride_load_from_vl_updates_nothing() {
+        let base_addr = BASE_ADDR + 0x3000;
+        let init = [0xDEAD_BEEF_u32; VLEN_BYTE / 2];
+        let (mut vector, mut mmio) = VectorBuilder::new()
+            .config(Vlmul::M2, Vsew::E32, false, true, 6)
+            .mem_range(0..8, |i| (base_addr + 4 * i as WordType, i as u32 + 100))
+            .reg(Vlmul::M2.get_lmul(), 8, &init)
+            .build();
+
+        vector
+            .stride_load(8, Vsew::E32, 1, None, false, 6, base_addr, &mut mmio)
+            .unwrap();
+        VectorChecker::new(&mut vector, &mut mmio).reg(Vlmul::M2.get_lmul(), 8, &init);
+    }
+
+    #[test]
+    fn test_unit_stride_access_faults_at_ram_end() {
+        // The last 3 elements of 8 are past the end of RAM.
+        let base_addr = BASE_ADDR + (ram_config::SIZE - 5 * 4) as WordType;
+        let values: Vec<u32> = (0..VLEN_BYTE as u32 / 2).map(|i| i + 1).collect();
+        let (mut vector, mut mmio) = VectorBuilder::new()
+            .config(Vlmul::M2, Vsew::E32, false, false, 8)
+            .reg(Vlmul::M2.get_lmul(), 8, &values)
+            .build();
+
+        let err = vector
+            .stride_store(8, Vsew::E32, 1, None, false, 0, base_addr, &mut mmio)
+            .unwrap_err();
+        assert_eq!(err.fault_index(), Some(5));
+        for i in 0..5 {
+            assert_eq!(mmio.read_u32(base_addr + 4 * i).unwrap(), i as u32 + 1);
+        }
+
+        let err = vector
+            .stride_load(16, Vsew::E32, 1, None, false, 0, base_addr, &mut mmio)
+            .unwrap_err();
+        assert_eq!(err.fault_index(), Some(5));
+        let loaded = vector.read_as_type::<u32>(16).unwrap();
+        assert_eq!(loaded[..5], values[..5]);
+    }
+
     #[test]
     fn test_load_whole_register() {
         let base_addr = BASE_ADDR + 0x3000;
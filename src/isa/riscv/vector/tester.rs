@@ -1,6 +1,6 @@
 #![cfg(test)]
 
-use std::{cell::UnsafeCell, fmt::Debug, rc::Rc};
+use std::{fmt::Debug, sync::Arc};
 
 use crate::{
     config::arch_config::WordType, device::mmio::MemoryMapIO, ram::Ram, utils::UnsignedInteger,
@@ -18,7 +18,7 @@ pub(super) struct VectorBuilder {
 
 impl VectorBuilder {
     pub(super) fn new() -> Self {
-        let ram = Rc::new(UnsafeCell::new(Ram::new()));
+        let ram = Arc::new(Ram::new());
         let mmio = MemoryMapIO::from_mmio_items(ram, vec![]);
         Self {
             vector: Vector::new(),
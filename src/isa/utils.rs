@@ -8,6 +8,10 @@ macro_rules! define_instr_enum {
         }
 
         impl $isa_name {
+            /// Every variant, in declaration order: `Self::ALL[x as usize] == x`.
+            pub const ALL: &'static [Self] = &[$($isa_name::$name),*];
+            pub const COUNT: usize = Self::ALL.len();
+
             pub fn name(&self) -> &'static str {
                 match self {
                     $($isa_name::$name => stringify!($name)),*
@@ -7,6 +7,7 @@
 #![feature(macro_metavar_expr_concat)]
 #![feature(likely_unlikely)]
 #![feature(unsafe_cell_access)]
+#![feature(portable_simd)]
 
 #[cfg(all(feature = "native-cli", target_arch = "wasm32"))]
 compile_error!("feature 'native-cli' is not supported on wasm32 targets");
@@ -17,11 +18,20 @@ compile_error!("feature 'multithreading' is not compatible with 'web'");
 #[cfg(all(feature = "web", not(target_arch = "wasm32")))]
 compile_error!("feature 'web' requires wasm32 target");
 
+#[cfg(all(feature = "trace", feature = "web"))]
+compile_error!("feature 'trace' is not compatible with 'web'");
+
+#[cfg(all(feature = "jit", not(all(target_arch = "x86_64", feature = "riscv64"))))]
+compile_error!("feature 'jit' requires an x86-64 host and 'riscv64'");
+
 mod cpu;
 mod fpu;
+mod mmap;
 mod utils;
 mod vclock;
 
+#[cfg(feature = "native-cli")]
+pub mod batch;
 #[cfg(feature = "native-cli")]
 pub mod gdb;
 
@@ -35,6 +45,9 @@ pub mod device_poller;
 pub mod isa;
 pub mod load;
 pub mod ram;
+pub mod snapshot;
+pub mod stats;
+pub mod trace;
 
 #[cfg(feature = "web")]
 pub mod wasm_api;
@@ -43,12 +56,19 @@ pub use config::ram_config;
 use lazy_static::lazy_static;
 
 use crate::{
-    board::{Board, BoardStatus, virt::VirtBoard},
+    board::{
+        Board, BoardStatus,
+        virt::{BoardTemplate, VirtBoard},
+    },
+    byte_io::UartOutput,
     device::virtio::virtio_mmio::VirtIODeviceID,
     isa::riscv::trap::Exception,
+    ram::HugePages,
+    snapshot::SnapshotError,
+    stats::StatsReport,
 };
 use std::{
-    path::PathBuf,
+    path::{Path, PathBuf},
     str::FromStr,
     sync::{Mutex, MutexGuard},
 };
@@ -57,6 +77,8 @@ use std::{
 pub struct DeviceConfig {
     pub dev_type: VirtIODeviceID,
     pub path: PathBuf,
+    /// Copy-on-write overlay, `path` is then only read.
+    pub overlay: Option<PathBuf>,
 }
 
 impl FromStr for DeviceConfig {
@@ -71,16 +93,37 @@ impl FromStr for DeviceConfig {
             None => return Err("Invalid device arguments.".into()),
         };
         let path = PathBuf::from(parts.next().ok_or("Need input a device path.")?);
-        Ok(DeviceConfig { dev_type, path })
+        let overlay = parts.next().map(PathBuf::from);
+        Ok(DeviceConfig {
+            dev_type,
+            path,
+            overlay,
+        })
     }
 }
 
 pub struct EmulatorConfig {
     pub(crate) devices: Vec<DeviceConfig>,
+    pub(crate) hart_cnt: usize,
+    pub(crate) huge_pages: HugePages,
+    pub(crate) strict_float: bool,
+    pub(crate) predecode_hot_blocks: bool,
+    #[cfg(feature = "jit")]
+    pub(crate) jit_hot_blocks: bool,
+    pub(crate) uart_output: UartOutput,
 }
 impl EmulatorConfig {
     pub fn new() -> Self {
-        Self { devices: vec![] }
+        Self {
+            devices: vec![],
+            hart_cnt: 1,
+            huge_pages: HugePages::Off,
+            strict_float: false,
+            predecode_hot_blocks: false,
+            #[cfg(feature = "jit")]
+            jit_hot_blocks: false,
+            uart_output: UartOutput::default(),
+        }
     }
 }
 
@@ -103,6 +146,36 @@ impl<'a> EmulatorConfigurator<'a> {
         self.lock.devices.push(device);
         self
     }
+    pub fn hart_cnt(mut self, hart_cnt: usize) -> Self {
+        self.lock.hart_cnt = hart_cnt;
+        self
+    }
+    /// Host pages backing the RAM of the boards built from now on.
+    pub fn huge_pages(mut self, huge_pages: HugePages) -> Self {
+        self.lock.huge_pages = huge_pages;
+        self
+    }
+    /// Round every F/D result in software, instead of on the host when rounding to nearest even.
+    pub fn strict_float(mut self, strict: bool) -> Self {
+        self.lock.strict_float = strict;
+        self
+    }
+    /// Run the hot blocks of the boards as pre-decoded ops, instead of interpreting every block.
+    pub fn predecode_hot_blocks(mut self, enable: bool) -> Self {
+        self.lock.predecode_hot_blocks = enable;
+        self
+    }
+    /// Run the hot blocks of the boards compiled to host code, with the `jit` feature.
+    #[cfg(feature = "jit")]
+    pub fn jit_hot_blocks(mut self, enable: bool) -> Self {
+        self.lock.jit_hot_blocks = enable;
+        self
+    }
+    /// Where the UART output of the boards on the standard I/O goes.
+    pub fn uart_output(mut self, output: UartOutput) -> Self {
+        self.lock.uart_output = output;
+        self
+    }
 }
 
 pub struct Emulator {
@@ -126,9 +199,16 @@ impl Emulator {
         Self { board }
     }
 
+    /// A new emulator in the state of `template`, see [`VirtBoard::to_template`].
+    pub fn fork(template: &BoardTemplate) -> Result<Self, SnapshotError> {
+        Ok(Self {
+            board: template.fork()?,
+        })
+    }
+
     pub fn run(&mut self) -> Result<(), Exception> {
         while self.board.status() != BoardStatus::Halt {
-            self.board.step()?;
+            self.board.run_slice(u64::MAX)?;
         }
 
         Ok(())
@@ -141,11 +221,16 @@ impl Emulator {
         Ok(())
     }
 
+    /// Run at least `max_steps` instructions unless the board halts,
+    /// returns the number of instructions actually run.
+    ///
+    /// A board step runs a whole block, so this may overshoot by less than one block.
     pub fn run_steps(&mut self, max_steps: u64) -> Result<u64, Exception> {
+        let start = self.board.clock.now();
         let mut steps = 0;
         while self.board.status() != BoardStatus::Halt && steps < max_steps {
-            self.board.step()?;
-            steps += 1;
+            self.board.run_slice(max_steps - steps)?;
+            steps = self.board.clock.now() - start;
         }
         Ok(steps)
     }
@@ -165,4 +250,33 @@ impl Emulator {
     pub fn take_uart_output_bytes(&mut self) -> Vec<u8> {
         self.board.take_uart_output()
     }
+
+    /// The whole machine as a snapshot, see [`VirtBoard::save_snapshot`].
+    pub fn snapshot_bytes(&mut self) -> Result<Vec<u8>, SnapshotError> {
+        let mut bytes = Vec::new();
+        self.board.save_snapshot(&mut bytes)?;
+        Ok(bytes)
+    }
+
+    pub fn restore_bytes(&mut self, bytes: &[u8]) -> Result<(), SnapshotError> {
+        self.board.restore_snapshot(bytes)
+    }
+
+    pub fn save_snapshot(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        self.board.save_snapshot_file(path)
+    }
+
+    pub fn restore_snapshot(&mut self, path: &Path) -> Result<(), SnapshotError> {
+        self.board.restore_snapshot_file(path)
+    }
+
+    /// The statistics counters, `None` without the `stats` feature.
+    pub fn stats(&self) -> Option<StatsReport> {
+        self.board.stats()
+    }
+
+    /// Freeze this emulator into a template that copies of it are forked from, on any thread.
+    pub fn to_template(&mut self) -> Result<BoardTemplate, SnapshotError> {
+        self.board.to_template()
+    }
 }
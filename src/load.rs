@@ -38,6 +38,7 @@ impl SymTab {
     }
 }
 
+#[derive(Clone)]
 pub struct ELFLoader {
     elf_data: Vec<u8>,
 }
@@ -54,7 +55,7 @@ impl ELFLoader {
         xmas_elf::ElfFile::new(&self.elf_data).unwrap()
     }
 
-    pub fn load_to_ram(&self, ram: &mut Ram) {
+    pub fn load_to_ram(&self, ram: &Ram) {
         let elf = self.elf();
         for ph in elf.program_iter() {
             if ph.get_type().unwrap() == xmas_elf::program::Type::Load {
@@ -121,6 +122,6 @@ impl ELFLoader {
     }
 }
 
-pub fn load_bin(ram: &mut Ram, raw_data: &[u8]) {
+pub fn load_bin(ram: &Ram, raw_data: &[u8]) {
     ram.insert_section(raw_data, 0);
 }
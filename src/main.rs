@@ -7,14 +7,17 @@ mod rvdb;
 mod welcome;
 
 use std::fs;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 
 use clap::Parser;
 use lazy_static::lazy_static;
+use riscv_emulator::batch::{self, BatchOutcome};
 use riscv_emulator::board::Board;
+use riscv_emulator::byte_io::UartOutput;
 use riscv_emulator::gdb;
-use riscv_emulator::isa::DebugTarget;
-use riscv_emulator::isa::riscv::debugger::Address;
+use riscv_emulator::ram::HugePages;
+use riscv_emulator::stats;
+use riscv_emulator::trace::{self, TraceFilter};
 use riscv_emulator::{DeviceConfig, EmulatorConfigurator, board::virt::VirtBoard};
 
 use crate::{logging::LogLevel, rvdb::DebugREPL, welcome::display_welcome_message};
@@ -30,6 +33,25 @@ enum TargetFormat {
     Bin,
 }
 
+#[derive(Debug, Copy, Clone, PartialEq, Eq, clap::ValueEnum)]
+enum HugePagesArg {
+    Off,
+    /// Transparent huge pages.
+    Thp,
+    /// Huge pages reserved on the host (hugetlbfs).
+    Hugetlb,
+}
+
+impl HugePagesArg {
+    fn to_huge_pages(self) -> HugePages {
+        match self {
+            HugePagesArg::Off => HugePages::Off,
+            HugePagesArg::Thp => HugePages::Transparent,
+            HugePagesArg::Hugetlb => HugePages::Reserved,
+        }
+    }
+}
+
 fn display_device_list(devices: &Vec<DeviceConfig>) {
     println!("\x1b[{}mdevice list:", 34);
     for device in devices {
@@ -41,9 +63,18 @@ fn display_device_list(devices: &Vec<DeviceConfig>) {
 #[derive(Parser, Debug)]
 #[command(version, about, long_about = None)]
 struct Args {
-    /// Path of the target executable file (elf/bin).
+    /// Path of the target executable file (elf/bin), or of the test list with `--batch`.
     path: std::path::PathBuf,
 
+    /// Run the tests listed in the file of `PATH` side by side, one `<ELF> [<SIGNATURE>]` per
+    /// line. `--max-cycles` and `--signature-granularity` apply to each test.
+    #[arg(long = "batch", default_value_t = false)]
+    batch: bool,
+
+    /// Threads running the tests of `--batch`, 0 for one per host CPU.
+    #[arg(long = "jobs", default_value_t = 0, requires = "batch")]
+    jobs: usize,
+
     /// Specify target executable file format.
     #[arg(value_enum, short, long, default_value_t = TargetFormat::Auto)]
     format: TargetFormat,
@@ -69,9 +100,46 @@ struct Args {
     log_level: LogLevel,
 
     /// Add devices to emulator. Example: --device=virtio-block:./tmp/img_blk
+    ///
+    /// A block device can keep its writes in a copy-on-write overlay, leaving the image untouched:
+    /// --device=virtio-block:./tmp/img_blk:./tmp/img_blk.overlay
     #[arg(long = "device", action = clap::ArgAction::Append)]
     devices: Vec<DeviceConfig>,
 
+    /// Number of harts, all of them start at the reset vector.
+    #[arg(long = "smp", default_value_t = 1)]
+    smp: usize,
+
+    /// Host pages backing the guest RAM.
+    #[arg(value_enum, long = "huge-pages", default_value_t = HugePagesArg::Off)]
+    huge_pages: HugePagesArg,
+
+    /// Compute all floating point in software. By default, the arithmetic rounding to nearest even
+    /// runs on the host FPU where its result is known to be the same.
+    #[arg(long = "strict-float", default_value_t = false)]
+    strict_float: bool,
+
+    /// Run the blocks executed often as pre-decoded integer ops, instead of interpreting every
+    /// block.
+    #[arg(long = "predecode-hot-blocks", default_value_t = false)]
+    predecode_hot_blocks: bool,
+
+    /// Compile the blocks executed often to host code, with the `jit` feature. The blocks, or
+    /// the rest of them, that do not compile still run pre-decoded or interpreted.
+    #[cfg(feature = "jit")]
+    #[arg(long = "jit-hot-blocks", default_value_t = false)]
+    jit_hot_blocks: bool,
+
+    /// Write the UART output into this file instead of the terminal, the input still comes from
+    /// the terminal.
+    #[arg(long = "uart-output")]
+    uart_output: Option<std::path::PathBuf>,
+
+    /// Longest time the UART output waits in a buffer before it is written to the terminal, in
+    /// milliseconds.
+    #[arg(long = "uart-flush-ms", default_value_t = 10)]
+    uart_flush_ms: u64,
+
     /// Dump RISC-V arch-test signature into this file on exit.
     #[arg(long = "signature")]
     signature: Option<std::path::PathBuf>,
@@ -80,89 +148,132 @@ struct Args {
     #[arg(long = "signature-granularity", default_value_t = 4)]
     signature_granularity: u32,
 
+    /// Sample the guest pc while it runs, and write the samples by symbol into this file on exit,
+    /// as folded stacks for `flamegraph.pl` or `inferno-flamegraph`.
+    #[arg(long = "profile")]
+    profile: Option<std::path::PathBuf>,
+
+    /// Cycles between two samples of `--profile`.
+    #[arg(
+        long = "profile-interval",
+        default_value_t = 1000,
+        requires = "profile"
+    )]
+    profile_interval: u64,
+
+    /// Show the statistics counters on exit, they are only kept when built with `--features stats`.
+    #[arg(long = "stats", default_value_t = false)]
+    stats: bool,
+
+    /// Trace the instructions retired into this file, `<FILE>.hart<N>` for each hart with `--smp`,
+    /// only when built with `--features trace`. See `src/trace.rs` for the format.
+    #[arg(long = "trace")]
+    trace: Option<std::path::PathBuf>,
+
+    /// Only trace the instructions at a pc in `start..end`, e.g. `0x8020_0000..0x8040_0000`.
+    #[arg(long = "trace-pc", value_parser = trace::parse_range, requires = "trace")]
+    trace_pc: Option<std::ops::Range<u64>>,
+
+    /// Only trace the instructions retired in `from..to`, counted from the start of the run.
+    #[arg(long = "trace-window", value_parser = trace::parse_range, requires = "trace")]
+    trace_window: Option<std::ops::Range<u64>>,
+
     /// Maximum cycles to execute before aborting (0 means no limit).
     #[arg(long = "max-cycles", default_value_t = 0)]
     max_cycles: u64,
-}
 
-/// Used for riscv-arch-test.
-fn dump_signature(
-    board: &mut VirtBoard,
-    out_path: &std::path::Path,
-    granularity: u32,
-) -> Result<(), String> {
-    let loader = board
-        .loader()
-        .ok_or_else(|| "ELF loader not available; cannot resolve signature symbols".to_string())?;
-
-    let symtab = loader.get_symbol_table().ok_or_else(|| {
-        "No .symtab found in ELF; cannot resolve begin_signature/end_signature".to_string()
-    })?;
-
-    let begin = symtab
-        .func_addr_by_name("begin_signature")
-        .ok_or_else(|| "Symbol begin_signature not found".to_string())?;
-    let end = symtab
-        .func_addr_by_name("end_signature")
-        .ok_or_else(|| "Symbol end_signature not found".to_string())?;
-
-    if end <= begin {
-        return Err(format!(
-            "Invalid signature range: begin=0x{:x}, end=0x{:x}",
-            begin, end
-        ));
-    }
+    /// Start from a snapshot instead of the reset vector, the board must be configured the same way
+    /// as the one that saved it.
+    #[arg(long = "restore")]
+    restore: Option<std::path::PathBuf>,
 
-    let size = end - begin;
-    let step = match granularity {
-        4 => 4u64,
-        8 => 8u64,
-        other => return Err(format!("Unsupported signature granularity: {}", other)),
-    };
+    /// Save a snapshot of the whole machine into this file, at `--snapshot-at` or when the run ends.
+    #[arg(long = "snapshot")]
+    snapshot: Option<std::path::PathBuf>,
 
-    if size % step != 0 {
-        return Err(format!(
-            "Signature size 0x{:x} not aligned to granularity {}",
-            size, step
-        ));
-    }
+    /// Cycle at which `--snapshot` is saved, the guest keeps running afterwards.
+    #[arg(long = "snapshot-at", requires = "snapshot")]
+    snapshot_at: Option<u64>,
+}
 
-    let file = std::fs::File::create(out_path).map_err(|e| {
-        format!(
-            "Failed to create signature file {}: {}",
-            out_path.display(),
-            e
-        )
-    })?;
+/// Write the folded stacks of `--profile`, and show the most sampled symbols.
+fn write_profile(board: &VirtBoard, path: &std::path::Path) -> Result<(), String> {
+    let report = board
+        .profile_report()
+        .ok_or_else(|| "The profiler was not started".to_string())?;
+
+    let file = std::fs::File::create(path)
+        .map_err(|e| format!("Failed to create profile file {}: {}", path.display(), e))?;
     let mut w = std::io::BufWriter::new(file);
+    report
+        .write_folded(&mut w)
+        .map_err(|e| format!("Failed to write profile: {}", e))?;
 
-    let mut addr = begin;
-    while addr < end {
-        match step {
-            4 => {
-                let v = board
-                    .cpu
-                    .read_memory::<u32>(Address::Phys(addr))
-                    .map_err(|e| format!("Failed to read signature @0x{:x}: {:?}", addr, e))?;
-                use std::io::Write;
-                writeln!(w, "{:08x}", v)
-                    .map_err(|e| format!("Failed to write signature: {}", e))?;
-            }
-            8 => {
-                let v = board
-                    .cpu
-                    .read_memory::<u64>(Address::Phys(addr))
-                    .map_err(|e| format!("Failed to read signature @0x{:x}: {:?}", addr, e))?;
-                use std::io::Write;
-                writeln!(w, "{:016x}", v)
-                    .map_err(|e| format!("Failed to write signature: {}", e))?;
-            }
-            _ => unreachable!(),
-        }
-        addr += step;
+    report
+        .write_table(&mut std::io::stdout(), 20)
+        .map_err(|e| format!("Failed to show profile: {}", e))?;
+    Ok(())
+}
+
+fn save_snapshot(board: &mut VirtBoard, path: &std::path::Path) {
+    match board.save_snapshot_file(path) {
+        Ok(()) => log::info!(
+            "Snapshot saved to {} at cycle {}",
+            path.display(),
+            board.clock.now()
+        ),
+        Err(e) => log::error!("Failed to save snapshot {}: {}", path.display(), e),
     }
+}
 
-    Ok(())
+/// Run the tests listed in the file of `PATH` with `--batch`, returns the exit code of the process.
+fn run_batch_list(list_path: &std::path::Path) -> i32 {
+    let list = match fs::read_to_string(list_path) {
+        Ok(list) => list,
+        Err(e) => {
+            log::error!("Failed to read test list {}: {}", list_path.display(), e);
+            return 2;
+        }
+    };
+    let jobs = match batch::parse_job_list(&list, cli_args.max_cycles) {
+        Ok(jobs) => jobs,
+        Err(e) => {
+            log::error!("Invalid test list {}: {}", list_path.display(), e);
+            return 2;
+        }
+    };
+
+    let config = batch::BatchConfig {
+        threads: cli_args.jobs,
+        signature_granularity: cli_args.signature_granularity,
+        strict_float: cli_args.strict_float,
+    };
+    let now = Instant::now();
+    let results = batch::run_batch(jobs, &config, |result| {
+        let status = match &result.outcome {
+            _ if result.passed() => "passed".to_string(),
+            BatchOutcome::ToHost(code) => format!("failed with tohost {:#x}", code),
+            BatchOutcome::MaxCycles => "timed out".to_string(),
+            BatchOutcome::Error(e) => format!("error: {}", e),
+            BatchOutcome::Halted => "halted without passing".to_string(),
+        };
+        println!(
+            "{}: {} ({} cycles, {:.3}s)",
+            result.elf.display(),
+            status,
+            result.cycles,
+            result.host_time.as_secs_f32()
+        );
+    });
+
+    let failed = results.iter().filter(|result| !result.passed()).count();
+    println!(
+        "{}/{} tests passed in {}s",
+        results.len() - failed,
+        results.len(),
+        now.elapsed().as_secs_f32()
+    );
+    (failed != 0) as i32
 }
 
 fn main() {
@@ -182,7 +293,21 @@ fn main() {
     }
 
     // Init emulator configuration by cli_args.
-    let mut emu_cfg = EmulatorConfigurator::new();
+    let mut emu_cfg = EmulatorConfigurator::new()
+        .hart_cnt(cli_args.smp)
+        .huge_pages(cli_args.huge_pages.to_huge_pages())
+        .strict_float(cli_args.strict_float)
+        .predecode_hot_blocks(cli_args.predecode_hot_blocks)
+        .uart_output(match &cli_args.uart_output {
+            Some(path) => UartOutput::File(path.clone()),
+            None => UartOutput::Stdout {
+                flush_interval: Duration::from_millis(cli_args.uart_flush_ms),
+            },
+        });
+    #[cfg(feature = "jit")]
+    {
+        emu_cfg = emu_cfg.jit_hot_blocks(cli_args.jit_hot_blocks);
+    }
     for device in cli_args.devices.iter() {
         emu_cfg = emu_cfg.append_device(device.clone())
     }
@@ -190,6 +315,12 @@ fn main() {
 
     let _logger_handle = logging::init(cli_args.log_level);
 
+    if cli_args.batch {
+        let code = run_batch_list(&cli_args.path);
+        drop(_logger_handle);
+        std::process::exit(code);
+    }
+
     let ext = cli_args
         .path
         .extension()
@@ -219,6 +350,13 @@ fn main() {
         }
     };
 
+    if let Some(path) = &cli_args.restore {
+        if let Err(e) = board.restore_snapshot_file(path) {
+            log::error!("Failed to restore snapshot {}: {}", path.display(), e);
+            panic!();
+        }
+    }
+
     if cli_args.debug {
         let mut repl = DebugREPL::new(&mut board);
         if let Some(script) = &cli_args.script {
@@ -238,19 +376,58 @@ fn main() {
             fs::File::create(sig_path).expect("Failed to create signature file");
         }
 
+        if cli_args.profile.is_some() {
+            board.start_profiler(cli_args.profile_interval);
+        }
+
+        if let Some(path) = &cli_args.trace {
+            let filter = TraceFilter {
+                pc: cli_args.trace_pc.clone(),
+                window: cli_args.trace_window.clone(),
+            };
+            if !trace::ENABLED {
+                log::warn!(
+                    "--trace needs the emulator built with `--features trace`, nothing is traced."
+                );
+            } else if let Err(e) = board.start_trace(path, filter) {
+                log::error!("Failed to start the trace {}: {}", path.display(), e);
+                panic!();
+            }
+        }
+
+        if cli_args.stats && !stats::ENABLED {
+            log::warn!(
+                "--stats needs the emulator built with `--features stats`, no counter is kept."
+            );
+        }
+
         crossterm::terminal::enable_raw_mode().unwrap();
 
         let now = Instant::now();
+        let mut snapshot_at = cli_args.snapshot.as_ref().and(cli_args.snapshot_at);
         loop {
             if board.status() == riscv_emulator::board::BoardStatus::Halt {
                 break;
             }
 
-            if let Err(e) = board.step() {
+            let budget = match cli_args.max_cycles {
+                0 => u64::MAX,
+                max_cycles => max_cycles.saturating_sub(board.clock.now()),
+            };
+            let budget = match snapshot_at {
+                Some(cycle) => budget.min(cycle.saturating_sub(board.clock.now()).max(1)),
+                None => budget,
+            };
+            if let Err(e) = board.run_slice(budget) {
                 log::error!("Error occurred while running emulator: {:?}\r", e);
                 break;
             }
 
+            if snapshot_at.is_some_and(|cycle| board.clock.now() >= cycle) {
+                snapshot_at = None;
+                save_snapshot(&mut board, cli_args.snapshot.as_ref().unwrap());
+            }
+
             if cli_args.max_cycles != 0 && board.clock.now() >= cli_args.max_cycles {
                 log::error!("Max cycles reached: {}", cli_args.max_cycles);
                 break;
@@ -258,8 +435,14 @@ fn main() {
         }
         crossterm::terminal::disable_raw_mode().unwrap();
 
+        if cli_args.snapshot_at.is_none() {
+            if let Some(path) = &cli_args.snapshot {
+                save_snapshot(&mut board, path);
+            }
+        }
+
         if let Some(sig_path) = &cli_args.signature {
-            if let Err(e) = dump_signature(
+            if let Err(e) = batch::write_signature(
                 &mut board,
                 sig_path.as_path(),
                 cli_args.signature_granularity,
@@ -268,6 +451,22 @@ fn main() {
             }
         }
 
+        if let Some(path) = &cli_args.profile {
+            if let Err(e) = write_profile(&board, path) {
+                log::error!("Failed to dump profile: {}", e);
+            }
+        }
+
+        if let Err(e) = board.finish_trace() {
+            log::error!("Failed to write the trace: {}", e);
+        }
+
+        if cli_args.stats {
+            if let Some(report) = board.stats() {
+                println!("{}", report.with_host_time(now.elapsed()));
+            }
+        }
+
         drop(board);
 
         println!("Used time: {}s", now.elapsed().as_secs_f32());
@@ -0,0 +1,529 @@
+//! Host memory mappings, for guest memory and images too large to copy.
+//!
+//! Only Linux and macOS map anything. Elsewhere [`FileMapping::new`] fails with
+//! [`io::ErrorKind::Unsupported`] and callers fall back to plain reads, and [`AnonMapping`] is a
+//! zeroed heap allocation.
+
+use std::{
+    alloc::{self, Layout},
+    fs::File,
+    io,
+    ops::{Deref, DerefMut},
+    ptr::NonNull,
+};
+
+use crate::ram::HugePages;
+
+const PAGE_SIZE: usize = 4096;
+const HUGE_PAGE_SIZE: usize = 2 * 1024 * 1024;
+
+/// A read-only view of a whole file, shared with the page cache of the host.
+///
+/// Every process mapping the same file reads the same host pages.
+pub(crate) struct FileMapping {
+    ptr: *const u8,
+    len: usize,
+}
+
+// The mapping is read-only and lives as long as the struct.
+unsafe impl Send for FileMapping {}
+unsafe impl Sync for FileMapping {}
+
+impl FileMapping {
+    pub(crate) fn new(file: &File) -> io::Result<Self> {
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Ok(Self {
+                ptr: std::ptr::NonNull::dangling().as_ptr(),
+                len,
+            });
+        }
+
+        let ptr = sys::map_file(file, len)?;
+        Ok(Self { ptr, len })
+    }
+
+    pub(crate) fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for FileMapping {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            unsafe { sys::unmap(self.ptr as *mut u8, self.len) };
+        }
+    }
+}
+
+/// An anonymous file living in host memory, to map the same pages into several mappings.
+///
+/// Only Linux has them, elsewhere this fails with [`io::ErrorKind::Unsupported`].
+pub(crate) fn memory_file(name: &str) -> io::Result<File> {
+    sys::memory_file(name)
+}
+
+/// Zeroed, page aligned and writable memory, only committed by the host when first touched.
+pub(crate) struct AnonMapping {
+    ptr: NonNull<u8>,
+    len: usize,
+    /// Bytes mapped from `ptr`, `0` for a heap allocation.
+    mapped_len: usize,
+    backing: Backing,
+}
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum Backing {
+    Heap,
+    Pages,
+    TransparentHugePages,
+    ReservedHugePages,
+}
+
+// The memory is owned like a `Box<[u8]>`.
+unsafe impl Send for AnonMapping {}
+unsafe impl Sync for AnonMapping {}
+
+impl AnonMapping {
+    pub(crate) fn new(len: usize, huge_pages: HugePages) -> io::Result<Self> {
+        if len == 0 {
+            return Ok(Self {
+                ptr: NonNull::dangling(),
+                len,
+                mapped_len: 0,
+                backing: Backing::Heap,
+            });
+        }
+
+        let map_pages = || sys::map_anon(len, false).map(|ptr| (ptr, len, Backing::Pages));
+        let mapped = match huge_pages {
+            HugePages::Reserved => {
+                let mapped_len = len.next_multiple_of(HUGE_PAGE_SIZE);
+                sys::map_anon(mapped_len, true)
+                    .map(|ptr| (ptr, mapped_len, Backing::ReservedHugePages))
+                    .or_else(|err| {
+                        log::warn!("No huge pages reserved for RAM, using 4KiB pages: {}", err);
+                        map_pages()
+                    })
+            }
+            HugePages::Transparent => sys::map_anon_thp(len)
+                .map(|(ptr, mapped_len)| (ptr, mapped_len, Backing::TransparentHugePages)),
+            HugePages::Off => map_pages(),
+        };
+
+        match mapped {
+            Ok((ptr, mapped_len, backing)) => Ok(Self {
+                ptr: NonNull::new(ptr).unwrap(),
+                len,
+                mapped_len,
+                backing,
+            }),
+            Err(err) if err.kind() == io::ErrorKind::Unsupported => {
+                let ptr = unsafe { alloc::alloc_zeroed(Self::heap_layout(len)) };
+                NonNull::new(ptr)
+                    .map(|ptr| Self {
+                        ptr,
+                        len,
+                        mapped_len: 0,
+                        backing: Backing::Heap,
+                    })
+                    .ok_or_else(|| io::ErrorKind::OutOfMemory.into())
+            }
+            Err(err) => Err(err),
+        }
+    }
+
+    /// Give the pages back to the host, which reads them as zeroes again.
+    ///
+    /// Returns `false`, with the memory left as is, for the backings that can not: the caller
+    /// zeroes it then.
+    pub(crate) fn discard(&self) -> bool {
+        let remapped = match self.backing {
+            Backing::Pages | Backing::TransparentHugePages => {
+                sys::map_anon_fixed(self.ptr.as_ptr(), self.mapped_len)
+                    .inspect_err(|err| log::warn!("Can not remap RAM, zeroing it: {}", err))
+                    .is_ok()
+            }
+            Backing::Heap | Backing::ReservedHugePages => false,
+        };
+
+        if remapped && self.backing == Backing::TransparentHugePages {
+            sys::advise_huge_pages(self.ptr.as_ptr(), self.mapped_len);
+        }
+        remapped
+    }
+
+    /// Map `len` bytes of `file` from `file_offset` at `offset` copy-on-write, which leaves them to
+    /// be read when first touched. `offset` and `file_offset` are page aligned.
+    ///
+    /// Returns `false`, with the memory left as is, when the host can't: the caller reads the file
+    /// then.
+    pub(crate) fn map_file(
+        &self,
+        offset: usize,
+        file: &File,
+        file_offset: u64,
+        len: usize,
+    ) -> bool {
+        assert!(offset + len <= self.len, "load past the end of the mapping");
+        debug_assert!(offset % PAGE_SIZE == 0 && file_offset % PAGE_SIZE as u64 == 0);
+
+        if !matches!(self.backing, Backing::Pages | Backing::TransparentHugePages) {
+            return false;
+        }
+        let ptr = unsafe { self.ptr.as_ptr().add(offset) };
+        sys::map_file_fixed(ptr, len, file, file_offset)
+            .inspect_err(|err| log::warn!("Can not map the file into RAM, reading it: {}", err))
+            .is_ok()
+    }
+
+    /// The start of the memory, for the threads sharing it to read and write through.
+    ///
+    /// It's not derived from a reference, so writing through it only takes `&self`.
+    #[inline(always)]
+    pub(crate) fn as_shared_ptr(&self) -> *mut u8 {
+        self.ptr.as_ptr()
+    }
+
+    fn heap_layout(len: usize) -> Layout {
+        Layout::from_size_align(len, PAGE_SIZE).unwrap()
+    }
+}
+
+impl Deref for AnonMapping {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl DerefMut for AnonMapping {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for AnonMapping {
+    fn drop(&mut self) {
+        if self.mapped_len != 0 {
+            unsafe { sys::unmap(self.ptr.as_ptr(), self.mapped_len) };
+        } else if self.len != 0 {
+            unsafe { alloc::dealloc(self.ptr.as_ptr(), Self::heap_layout(self.len)) };
+        }
+    }
+}
+
+/// Host code, written once then only run, see [`crate::isa::riscv::jit`].
+#[cfg(feature = "jit")]
+pub(crate) struct CodeMapping {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// The code is never written again once mapped.
+#[cfg(feature = "jit")]
+unsafe impl Send for CodeMapping {}
+#[cfg(feature = "jit")]
+unsafe impl Sync for CodeMapping {}
+
+#[cfg(feature = "jit")]
+impl CodeMapping {
+    /// Map a copy of `code`, readable and executable only.
+    pub(crate) fn new(code: &[u8]) -> io::Result<Self> {
+        let len = code.len().max(1).next_multiple_of(PAGE_SIZE);
+        let ptr = sys::map_anon(len, false)?;
+        unsafe { std::ptr::copy_nonoverlapping(code.as_ptr(), ptr, code.len()) };
+
+        if let Err(err) = sys::protect_exec(ptr, len) {
+            unsafe { sys::unmap(ptr, len) };
+            return Err(err);
+        }
+        Ok(Self {
+            ptr: NonNull::new(ptr).unwrap(),
+            len,
+        })
+    }
+
+    pub(crate) fn as_ptr(&self) -> *const u8 {
+        self.ptr.as_ptr()
+    }
+}
+
+#[cfg(feature = "jit")]
+impl Drop for CodeMapping {
+    fn drop(&mut self) {
+        unsafe { sys::unmap(self.ptr.as_ptr(), self.len) };
+    }
+}
+
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+mod sys {
+    use std::{
+        ffi::{c_int, c_void},
+        fs::File,
+        io,
+        os::fd::{AsRawFd, RawFd},
+    };
+
+    use super::HUGE_PAGE_SIZE;
+
+    const PROT_READ: c_int = 0x1;
+    const PROT_WRITE: c_int = 0x2;
+    #[cfg(feature = "jit")]
+    const PROT_EXEC: c_int = 0x4;
+    const MAP_SHARED: c_int = 0x1;
+    const MAP_PRIVATE: c_int = 0x2;
+    const MAP_FIXED: c_int = 0x10;
+    const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+
+    #[cfg(target_os = "linux")]
+    const MAP_ANONYMOUS: c_int = 0x20;
+    #[cfg(target_os = "macos")]
+    const MAP_ANONYMOUS: c_int = 0x1000;
+    /// Do not reserve swap for the whole mapping, only touched pages count.
+    #[cfg(target_os = "linux")]
+    const MAP_NORESERVE: c_int = 0x4000;
+    #[cfg(target_os = "macos")]
+    const MAP_NORESERVE: c_int = 0x40;
+    #[cfg(target_os = "linux")]
+    const MAP_HUGETLB: c_int = 0x40000;
+    #[cfg(target_os = "linux")]
+    const MADV_HUGEPAGE: c_int = 14;
+    #[cfg(target_os = "linux")]
+    const MFD_CLOEXEC: std::ffi::c_uint = 0x1;
+
+    const ANON: c_int = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+
+    unsafe extern "C" {
+        fn mmap(
+            addr: *mut c_void,
+            len: usize,
+            prot: c_int,
+            flags: c_int,
+            fd: c_int,
+            offset: i64,
+        ) -> *mut c_void;
+        fn munmap(addr: *mut c_void, len: usize) -> c_int;
+        #[cfg(feature = "jit")]
+        fn mprotect(addr: *mut c_void, len: usize, prot: c_int) -> c_int;
+        #[cfg(target_os = "linux")]
+        fn madvise(addr: *mut c_void, len: usize, advice: c_int) -> c_int;
+        #[cfg(target_os = "linux")]
+        fn memfd_create(name: *const std::ffi::c_char, flags: std::ffi::c_uint) -> c_int;
+    }
+
+    fn map(
+        addr: *mut u8,
+        len: usize,
+        prot: c_int,
+        flags: c_int,
+        fd: RawFd,
+        offset: u64,
+    ) -> io::Result<*mut u8> {
+        let ptr = unsafe { mmap(addr as *mut c_void, len, prot, flags, fd, offset as i64) };
+        if ptr == MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(ptr as *mut u8)
+    }
+
+    pub(super) fn map_file(file: &File, len: usize) -> io::Result<*const u8> {
+        map(
+            std::ptr::null_mut(),
+            len,
+            PROT_READ,
+            MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+        .map(|ptr| ptr as *const u8)
+    }
+
+    /// Map `len` bytes of `file` from `offset` copy-on-write over the mapping at `ptr`.
+    pub(super) fn map_file_fixed(
+        ptr: *mut u8,
+        len: usize,
+        file: &File,
+        offset: u64,
+    ) -> io::Result<()> {
+        map(
+            ptr,
+            len,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED,
+            file.as_raw_fd(),
+            offset,
+        )
+        .map(|_| ())
+    }
+
+    /// Map `len` zeroed bytes, from the reserved huge pages of the host if `huge`.
+    ///
+    /// The huge pages are reserved for the whole mapping up front, without `MAP_NORESERVE` the
+    /// mapping fails when the host has too few of them, instead of faulting once touched.
+    pub(super) fn map_anon(len: usize, huge: bool) -> io::Result<*mut u8> {
+        #[cfg(target_os = "linux")]
+        let flags = if huge {
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+        } else {
+            ANON
+        };
+        #[cfg(target_os = "macos")]
+        let flags = if huge {
+            return Err(io::ErrorKind::Unsupported.into());
+        } else {
+            ANON
+        };
+
+        map(
+            std::ptr::null_mut(),
+            len,
+            PROT_READ | PROT_WRITE,
+            flags,
+            -1,
+            0,
+        )
+    }
+
+    /// Replace the mapping at `ptr` with zeroed pages.
+    pub(super) fn map_anon_fixed(ptr: *mut u8, len: usize) -> io::Result<()> {
+        map(ptr, len, PROT_READ | PROT_WRITE, ANON | MAP_FIXED, -1, 0).map(|_| ())
+    }
+
+    /// Map `len` zeroed bytes aligned to a huge page, that the kernel backs with transparent huge
+    /// pages when it can. Returns the mapping and its length.
+    #[cfg(target_os = "linux")]
+    pub(super) fn map_anon_thp(len: usize) -> io::Result<(*mut u8, usize)> {
+        // Over-allocate by a huge page, then trim both ends to the aligned part.
+        let len = len.next_multiple_of(HUGE_PAGE_SIZE);
+        let raw = map_anon(len + HUGE_PAGE_SIZE, false)?;
+        let head = raw.align_offset(HUGE_PAGE_SIZE);
+        let ptr = unsafe { raw.add(head) };
+        unsafe {
+            if head != 0 {
+                unmap(raw, head);
+            }
+            if head != HUGE_PAGE_SIZE {
+                unmap(ptr.add(len), HUGE_PAGE_SIZE - head);
+            }
+        }
+
+        advise_huge_pages(ptr, len);
+        Ok((ptr, len))
+    }
+
+    #[cfg(target_os = "macos")]
+    pub(super) fn map_anon_thp(len: usize) -> io::Result<(*mut u8, usize)> {
+        // The kernel picks the page size by itself.
+        let _ = HUGE_PAGE_SIZE;
+        map_anon(len, false).map(|ptr| (ptr, len))
+    }
+
+    #[cfg(target_os = "linux")]
+    pub(super) fn advise_huge_pages(ptr: *mut u8, len: usize) {
+        if unsafe { madvise(ptr as *mut c_void, len, MADV_HUGEPAGE) } != 0 {
+            log::warn!(
+                "Transparent huge pages are not available for RAM: {}",
+                io::Error::last_os_error()
+            );
+        }
+    }
+
+    #[cfg(target_os = "macos")]
+    pub(super) fn advise_huge_pages(_ptr: *mut u8, _len: usize) {}
+
+    #[cfg(target_os = "linux")]
+    pub(super) fn memory_file(name: &str) -> io::Result<File> {
+        use std::os::fd::FromRawFd;
+
+        let name = std::ffi::CString::new(name).map_err(|_| io::ErrorKind::InvalidInput)?;
+        let fd = unsafe { memfd_create(name.as_ptr(), MFD_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(unsafe { File::from_raw_fd(fd) })
+    }
+
+    #[cfg(target_os = "macos")]
+    pub(super) fn memory_file(_name: &str) -> io::Result<File> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    /// Make the mapping at `ptr` readable and executable, and no longer writable.
+    #[cfg(feature = "jit")]
+    pub(super) fn protect_exec(ptr: *mut u8, len: usize) -> io::Result<()> {
+        if unsafe { mprotect(ptr as *mut c_void, len, PROT_READ | PROT_EXEC) } != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    pub(super) unsafe fn unmap(ptr: *mut u8, len: usize) {
+        unsafe { munmap(ptr as *mut c_void, len) };
+    }
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "macos")))]
+mod sys {
+    use std::{fs::File, io};
+
+    pub(super) fn map_file(_file: &File, _len: usize) -> io::Result<*const u8> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) fn map_anon(_len: usize, _huge: bool) -> io::Result<*mut u8> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) fn map_anon_thp(_len: usize) -> io::Result<(*mut u8, usize)> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) fn map_anon_fixed(_ptr: *mut u8, _len: usize) -> io::Result<()> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) fn map_file_fixed(
+        _ptr: *mut u8,
+        _len: usize,
+        _file: &File,
+        _offset: u64,
+    ) -> io::Result<()> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) fn advise_huge_pages(_ptr: *mut u8, _len: usize) {}
+
+    pub(super) fn memory_file(_name: &str) -> io::Result<File> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    #[cfg(feature = "jit")]
+    pub(super) fn protect_exec(_ptr: *mut u8, _len: usize) -> io::Result<()> {
+        Err(io::ErrorKind::Unsupported.into())
+    }
+
+    pub(super) unsafe fn unmap(_ptr: *mut u8, _len: usize) {}
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_anon_mapping() {
+        for huge_pages in [HugePages::Off, HugePages::Transparent, HugePages::Reserved] {
+            let len = 3 * HUGE_PAGE_SIZE + PAGE_SIZE;
+            let mut mem = AnonMapping::new(len, huge_pages).unwrap();
+            assert_eq!(mem.len(), len);
+            assert_eq!(mem.as_ptr() as usize % PAGE_SIZE, 0);
+
+            // Zeroed, and writable up to the last byte.
+            assert!(mem.iter().step_by(PAGE_SIZE).all(|&byte| byte == 0));
+            mem[0] = 1;
+            mem[len - 1] = 2;
+            assert_eq!((mem[0], mem[len - 1]), (1, 2));
+        }
+    }
+}
@@ -1,63 +1,309 @@
 use core::panic;
-use std::ops::{Index, IndexMut};
+use std::{
+    fs::File,
+    io,
+    ops::Range,
+    sync::{
+        Mutex,
+        atomic::{AtomicU8, AtomicU16, AtomicU32, AtomicU64, Ordering},
+    },
+};
 
 use crate::{
     config::arch_config::WordType,
-    device::MemError,
+    device::{MemError, config::MAX_HART_CNT},
+    mmap::AnonMapping,
     ram_config,
-    utils::{read_raw_ptr, write_raw_ptr},
+    snapshot::SNAPSHOT_PAGE_SIZE,
+    utils::{UnsignedInteger, check_align},
 };
 
-#[derive(Debug, Clone, Copy)]
+/// Log2 of the granularity at which writes to code are tracked.
+pub(crate) const CODE_PAGE_XLEN: usize = 12;
+const CODE_PAGE_CNT: usize = ram_config::SIZE >> CODE_PAGE_XLEN;
+
+/// One bit per page of RAM that instructions were decoded from.
+///
+/// The first write to such a page clears its bit and queues the page for every hart,
+/// each hart then drops what it decoded from it. Later writes cost a bit test only.
+///
+/// The harts of a board run on their own threads, so the bits are atomic: the one write clearing
+/// a bit queues the page, whichever hart it comes from.
+struct CodePages {
+    bits: Box<[AtomicU64]>,
+    /// One queue per hart.
+    written: Vec<Mutex<Vec<usize>>>,
+    /// Bit `i` is set while the queue of hart `i` may hold pages, so that it's checked without locking.
+    queued: AtomicU32,
+}
+
+impl CodePages {
+    fn new() -> Self {
+        Self {
+            bits: (0..CODE_PAGE_CNT.div_ceil(64))
+                .map(|_| AtomicU64::new(0))
+                .collect(),
+            written: vec![Mutex::new(Vec::new())],
+            queued: AtomicU32::new(0),
+        }
+    }
+
+    #[inline]
+    fn mark(&self, addr: usize) {
+        let page = addr >> CODE_PAGE_XLEN;
+        let mask = 1 << (page % 64);
+        let bits = &self.bits[page / 64];
+        if bits.load(Ordering::Relaxed) & mask == 0 {
+            bits.fetch_or(mask, Ordering::Relaxed);
+        }
+    }
+
+    #[inline(always)]
+    fn note_write(&self, addr: usize) {
+        let page = addr >> CODE_PAGE_XLEN;
+        let mask = 1 << (page % 64);
+        let bits = &self.bits[page / 64];
+        if bits.load(Ordering::Relaxed) & mask != 0
+            && bits.fetch_and(!mask, Ordering::Relaxed) & mask != 0
+        {
+            std::hint::cold_path();
+            self.queue(page << CODE_PAGE_XLEN);
+        }
+    }
+
+    #[cold]
+    fn queue(&self, page_addr: usize) {
+        for written in self.written.iter() {
+            written.lock().unwrap().push(page_addr);
+        }
+        let all_harts = u32::MAX >> (u32::BITS as usize - self.written.len());
+        self.queued.fetch_or(all_harts, Ordering::Release);
+    }
+
+    #[inline(always)]
+    fn has_queued(&self, hart_id: usize) -> bool {
+        self.queued.load(Ordering::Relaxed) & (1 << hart_id) != 0
+    }
+
+    fn take(&self, hart_id: usize) -> Vec<usize> {
+        // Cleared first, a page queued meanwhile sets it again.
+        self.queued.fetch_and(!(1 << hart_id), Ordering::Acquire);
+        std::mem::take(&mut *self.written[hart_id].lock().unwrap())
+    }
+
+    fn clear(&self) {
+        self.bits
+            .iter()
+            .for_each(|bits| bits.store(0, Ordering::Relaxed));
+        for written in self.written.iter() {
+            written.lock().unwrap().clear();
+        }
+        self.queued.store(0, Ordering::Relaxed);
+    }
+}
+
+/// Reservations cover the aligned 8-byte granule of the `LR` address.
+const GRANULE_MASK: WordType = !0x7;
+
+/// Set in [`Reservation::addr`] while the reservation is held, granule addresses have it clear.
+const RESERVED: u64 = 1;
+
+/// The `LR` reservation of a hart, with the value of its granule when it was loaded.
+///
+/// The `SC` commits with a compare-and-swap of the granule against `value`,
+/// so a write that was not reported to [`Ram`], or that raced with the `LR`, still makes it fail
+/// instead of being lost.
+///
+/// Only the hart itself takes a reservation and reads `value`, the stores of every hart clear `addr`.
+#[derive(Default)]
 struct Reservation {
-    addr: WordType,
+    /// The granule address with [`RESERVED`] set, or `0`.
+    addr: AtomicU64,
+    value: AtomicU64,
 }
 
 impl Reservation {
-    fn new(addr: WordType) -> Self {
-        Self { addr: addr & !0x7 }
+    fn tag(addr: WordType) -> u64 {
+        (addr & GRANULE_MASK) as u64 | RESERVED
     }
+}
 
-    fn is_match(&self, addr: WordType) -> bool {
-        self.addr == (addr & !0x7)
-    }
+/// Host pages backing the guest RAM.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub enum HugePages {
+    /// Pages of the host default size.
+    #[default]
+    Off,
+    /// Ask the kernel for transparent huge pages, which it may or may not give.
+    Transparent,
+    /// Huge pages reserved by the host administrator (`MAP_HUGETLB`), committed all at once.
+    /// Falls back to [`HugePages::Off`] when none are available.
+    Reserved,
 }
 
+/// Guest RAM, reserved up front and only committed by the host on the first touch of each page,
+/// so that an instance costs what its guest uses.
+///
+/// The harts and the devices of a board share it from their threads through `&Ram`: every access
+/// to the guest memory is atomic, see [`atomic_load`], and so are the reservations and the code
+/// pages.
 pub struct Ram {
-    // TODO: 4KB align the inner box ptr for better performance.
-    data: Box<[u8]>,
-    reserved: Option<Reservation>,
+    data: AnonMapping,
+    /// The LR/SC reservation of each hart.
+    reserved: [Reservation; MAX_HART_CNT],
+    /// Bit `i` is set while hart `i` may hold a reservation, so that stores skip the scan when none
+    /// is held. Only the hart clears its bit, on its next `SC`.
+    reserved_mask: AtomicU32,
+    code_pages: CodePages,
+}
+
+/// A relaxed atomic load of the `T` at `ptr`.
+///
+/// The guest memory is only reached through these, which compile to plain moves: the harts race on
+/// it like the hardware they emulate, and the guest orders its accesses with its own fences.
+///
+/// # Safety
+/// `ptr` must be inside the RAM and aligned for `T`.
+#[inline(always)]
+unsafe fn atomic_load<T: UnsignedInteger>(ptr: *mut u8) -> T {
+    unsafe {
+        match size_of::<T>() {
+            1 => T::truncate_from(AtomicU8::from_ptr(ptr).load(Ordering::Relaxed)),
+            2 => T::truncate_from(AtomicU16::from_ptr(ptr.cast()).load(Ordering::Relaxed)),
+            4 => T::truncate_from(AtomicU32::from_ptr(ptr.cast()).load(Ordering::Relaxed)),
+            _ => T::truncate_from(AtomicU64::from_ptr(ptr.cast()).load(Ordering::Relaxed)),
+        }
+    }
+}
+
+/// A relaxed atomic store of `data` at `ptr`, see [`atomic_load`].
+///
+/// # Safety
+/// See [`atomic_load`].
+#[inline(always)]
+unsafe fn atomic_store<T: UnsignedInteger>(ptr: *mut u8, data: T) {
+    unsafe {
+        match size_of::<T>() {
+            1 => AtomicU8::from_ptr(ptr).store(data.truncate_to(), Ordering::Relaxed),
+            2 => AtomicU16::from_ptr(ptr.cast()).store(data.truncate_to(), Ordering::Relaxed),
+            4 => AtomicU32::from_ptr(ptr.cast()).store(data.truncate_to(), Ordering::Relaxed),
+            _ => AtomicU64::from_ptr(ptr.cast()).store(data.truncate_to(), Ordering::Relaxed),
+        }
+    }
+}
+
+/// [`atomic_load`] with any alignment, an unaligned access is split in bytes as it isn't atomic on
+/// RISC-V either.
+///
+/// # Safety
+/// The `T` at `ptr` must be inside the RAM.
+#[inline(always)]
+unsafe fn load_unaligned<T: UnsignedInteger>(ptr: *mut u8) -> T {
+    if ptr.cast::<T>().is_aligned() {
+        return unsafe { atomic_load(ptr) };
+    }
+
+    std::hint::cold_path();
+    let mut value = 0u64;
+    for i in (0..size_of::<T>()).rev() {
+        value = value << 8 | unsafe { atomic_load::<u8>(ptr.add(i)) } as u64;
+    }
+    T::truncate_from(value)
 }
 
-impl Index<usize> for Ram {
-    type Output = u8;
-    fn index(&self, index: usize) -> &Self::Output {
-        &(self.data[index])
+/// [`atomic_store`] with any alignment, see [`load_unaligned`].
+///
+/// # Safety
+/// See [`load_unaligned`].
+#[inline(always)]
+unsafe fn store_unaligned<T: UnsignedInteger>(ptr: *mut u8, data: T) {
+    if ptr.cast::<T>().is_aligned() {
+        return unsafe { atomic_store(ptr, data) };
+    }
+
+    std::hint::cold_path();
+    let data: u64 = data.truncate_to();
+    for i in 0..size_of::<T>() {
+        unsafe { atomic_store(ptr.add(i), (data >> (8 * i)) as u8) };
     }
 }
 
-impl IndexMut<usize> for Ram {
-    fn index_mut(&mut self, index: usize) -> &mut Self::Output {
-        &mut (self.data[index])
+/// Copy the `buf.len()` bytes from `src` with atomic loads, a word at a time once `src` is aligned.
+///
+/// # Safety
+/// The bytes must be inside the RAM.
+unsafe fn load_bytes(src: *mut u8, buf: &mut [u8]) {
+    let head = src.align_offset(8).min(buf.len());
+    let (head_buf, rest) = buf.split_at_mut(head);
+    for (i, byte) in head_buf.iter_mut().enumerate() {
+        *byte = unsafe { atomic_load(src.add(i)) };
+    }
+
+    let mut src = unsafe { src.add(head) };
+    let mut words = rest.chunks_exact_mut(8);
+    for word in &mut words {
+        word.copy_from_slice(&unsafe { atomic_load::<u64>(src) }.to_ne_bytes());
+        src = unsafe { src.add(8) };
+    }
+    for (i, byte) in words.into_remainder().iter_mut().enumerate() {
+        *byte = unsafe { atomic_load(src.add(i)) };
+    }
+}
+
+/// Copy `data` to `dst` with atomic stores, see [`load_bytes`].
+///
+/// # Safety
+/// See [`load_bytes`].
+unsafe fn store_bytes(dst: *mut u8, data: &[u8]) {
+    let head = dst.align_offset(8).min(data.len());
+    let (head_data, rest) = data.split_at(head);
+    for (i, &byte) in head_data.iter().enumerate() {
+        unsafe { atomic_store(dst.add(i), byte) };
+    }
+
+    let mut dst = unsafe { dst.add(head) };
+    let mut words = rest.chunks_exact(8);
+    for word in &mut words {
+        unsafe { atomic_store(dst, u64::from_ne_bytes(word.try_into().unwrap())) };
+        dst = unsafe { dst.add(8) };
+    }
+    for (i, &byte) in words.remainder().iter().enumerate() {
+        unsafe { atomic_store(dst.add(i), byte) };
     }
 }
 
 impl Ram {
     pub fn new() -> Self {
+        Self::with_huge_pages(HugePages::Off)
+    }
+
+    pub fn with_huge_pages(huge_pages: HugePages) -> Self {
+        let data = AnonMapping::new(ram_config::SIZE, huge_pages).unwrap_or_else(|err| {
+            panic!(
+                "Can not allocate {} bytes of RAM: {}",
+                ram_config::SIZE,
+                err
+            )
+        });
+
         Self {
-            data: vec![0u8; ram_config::SIZE].into_boxed_slice(),
-            reserved: None,
+            data,
+            reserved: std::array::from_fn(|_| Reservation::default()),
+            reserved_mask: AtomicU32::new(0),
+            code_pages: CodePages::new(),
         }
     }
 
+    /// Every byte is written, so the whole RAM is committed unless `byte` is zero.
     pub fn with_init(byte: u8) -> Self {
-        Self {
-            data: vec![byte; ram_config::SIZE].into_boxed_slice(),
-            reserved: None,
+        let mut ram = Self::new();
+        if byte != 0 {
+            ram.data.fill(byte);
         }
+        ram
     }
 
-    pub fn with_data(mut data: Vec<u8>) -> Self {
+    pub fn with_data(data: Vec<u8>) -> Self {
         if data.len() > ram_config::SIZE {
             log::error!(
                 "ram::with_data data size {} exceeds RAM size {}",
@@ -66,14 +312,12 @@ impl Ram {
             );
             panic!();
         }
-        data.resize(ram_config::SIZE, 0);
-        Self {
-            data: data.into_boxed_slice(),
-            reserved: None,
-        }
+        let mut ram = Self::new();
+        ram.data[..data.len()].copy_from_slice(&data);
+        ram
     }
 
-    pub fn insert_section(&mut self, elf_section_data: &[u8], start_addr: WordType) {
+    pub fn insert_section(&self, elf_section_data: &[u8], start_addr: WordType) {
         let Some(end_addr) = (start_addr as usize).checked_add(elf_section_data.len()) else {
             log::error!(
                 "ram::insert_section address overflow! start_addr = {}, len = {}",
@@ -92,59 +336,311 @@ impl Ram {
         }
 
         let start_addr = start_addr as usize;
-        elf_section_data.iter().enumerate().for_each(|(index, v)| {
-            self.data[start_addr + index] = *v;
-        });
+        self.report_write(start_addr, elf_section_data.len());
+        unsafe { store_bytes(self.host_ptr(start_addr), elf_section_data) };
     }
 
-    pub fn read<T>(&self, addr: WordType) -> Result<T, MemError> {
+    pub fn read<T: UnsignedInteger>(&self, addr: WordType) -> Result<T, MemError> {
         if !Self::contains_access::<T>(addr) {
             return Err(MemError::LoadFault);
         }
 
-        let data = unsafe { read_raw_ptr::<T>(self.data.as_ptr().add(addr as usize)) };
-        if let Some(data) = data {
-            Ok(data)
-        } else {
-            Err(MemError::LoadMisaligned)
+        if !check_align::<T>(addr) {
+            return Err(MemError::LoadMisaligned);
+        }
+        Ok(unsafe { atomic_load(self.host_ptr(addr as usize)) })
+    }
+
+    /// Set the number of harts sharing this RAM, each one gets its own queue of written code pages.
+    pub(crate) fn set_hart_cnt(&mut self, hart_cnt: usize) {
+        assert!(
+            (1..=MAX_HART_CNT).contains(&hart_cnt),
+            "At most {} harts are supported.",
+            MAX_HART_CNT
+        );
+        self.code_pages
+            .written
+            .resize_with(hart_cnt, Mutex::default);
+    }
+
+    pub fn load_reserved<T>(&self, hart_id: usize, addr: WordType) -> Result<T, MemError>
+    where
+        T: UnsignedInteger,
+    {
+        // Bounds and alignment check.
+        self.read::<T>(addr)?;
+
+        let granule_addr = addr & GRANULE_MASK;
+        let value = unsafe { self.granule(granule_addr) }.load(Ordering::Acquire);
+        let reservation = &self.reserved[hart_id];
+        reservation.value.store(value, Ordering::Relaxed);
+        reservation
+            .addr
+            .store(Reservation::tag(granule_addr), Ordering::Release);
+        self.reserved_mask.fetch_or(1 << hart_id, Ordering::AcqRel);
+
+        Ok(T::truncate_from(value >> ((addr - granule_addr) * 8)))
+    }
+
+    /// A store from any hart to the reserved granule makes the SC fail.
+    pub fn store_conditional<T>(
+        &self,
+        hart_id: usize,
+        addr: WordType,
+        data: T,
+    ) -> Result<bool, MemError>
+    where
+        T: UnsignedInteger,
+    {
+        let reservation = &self.reserved[hart_id];
+        let reserved = reservation.addr.swap(0, Ordering::AcqRel);
+        self.reserved_mask
+            .fetch_and(!(1 << hart_id), Ordering::Relaxed);
+
+        if reserved != Reservation::tag(addr) {
+            return Ok(false);
+        }
+        if addr % size_of::<T>() as WordType != 0 {
+            return Err(MemError::StoreMisaligned);
+        }
+
+        let granule_addr = addr & GRANULE_MASK;
+        let value = reservation.value.load(Ordering::Relaxed);
+        let shift = (addr - granule_addr) * 8;
+        let mask = u64::MAX >> (64 - T::BITS);
+        let data: u64 = data.truncate_to();
+        let new_value = (value & !(mask << shift)) | (data << shift);
+
+        let committed = unsafe { self.granule(granule_addr) }
+            .compare_exchange(value, new_value, Ordering::AcqRel, Ordering::Relaxed)
+            .is_ok();
+        if committed {
+            self.report_write(addr as usize, size_of::<T>());
+        }
+        Ok(committed)
+    }
+
+    /// The granule at `addr` as a host atomic.
+    ///
+    /// # Safety
+    /// `addr` must be 8-byte aligned and inside RAM.
+    #[inline]
+    unsafe fn granule(&self, addr: WordType) -> &AtomicU64 {
+        let ptr = self.host_ptr(addr as usize) as *mut u64;
+        debug_assert!(ptr.is_aligned());
+        unsafe { AtomicU64::from_ptr(ptr) }
+    }
+
+    /// Set `bits` in the 8-byte word at `addr` with one atomic OR, like an `AMOOR.D`.
+    ///
+    /// It's how the A/D bits of a PTE are set, as another hart may be setting them at once.
+    pub(crate) fn fetch_or_u64(&self, addr: WordType, bits: u64) -> Result<u64, MemError> {
+        if !Self::contains_access::<u64>(addr) {
+            return Err(MemError::StoreFault);
         }
+        if addr % size_of::<u64>() as WordType != 0 {
+            return Err(MemError::StoreMisaligned);
+        }
+
+        self.report_write(addr as usize, size_of::<u64>());
+        Ok(unsafe { self.granule(addr) }.fetch_or(bits, Ordering::AcqRel))
     }
 
-    pub fn load_reserved<T>(&mut self, addr: WordType) -> Result<T, MemError> {
-        let data = self.read::<T>(addr)?;
-        self.reserved = Some(Reservation::new(addr));
-        Ok(data)
+    /// The host address of the byte at `offset`, the harts read and write the guest memory through it.
+    #[inline(always)]
+    pub(crate) fn host_ptr(&self, offset: usize) -> *mut u8 {
+        self.data.as_shared_ptr().wrapping_add(offset)
     }
 
-    pub fn store_conditional<T>(&mut self, addr: WordType, data: T) -> Result<bool, MemError> {
-        if let Some(res) = self.reserved {
-            if res.is_match(addr) {
-                self.write(addr, data)?;
-                self.reserved = None;
-                return Ok(true);
+    /// Drop the reservations on the granules of `addr..addr + len`, whichever hart holds them.
+    #[inline(always)]
+    fn break_reservations(&self, addr: WordType, len: usize) {
+        let mut harts = self.reserved_mask.load(Ordering::Relaxed);
+        if harts == 0 {
+            return;
+        }
+
+        let range = (addr & GRANULE_MASK) as u64..addr as u64 + len as u64;
+        while harts != 0 {
+            let hart_id = harts.trailing_zeros() as usize;
+            harts &= harts - 1;
+
+            let reserved = &self.reserved[hart_id].addr;
+            let tag = reserved.load(Ordering::Relaxed);
+            if tag & RESERVED != 0 && range.contains(&(tag & !RESERVED)) {
+                // Fails if the hart took another reservation meanwhile, which is kept.
+                let _ = reserved.compare_exchange(tag, 0, Ordering::AcqRel, Ordering::Relaxed);
             }
         }
-        self.reserved = None;
-        Ok(false)
     }
 
-    pub fn write<T>(&mut self, addr: WordType, data: T) -> Result<(), MemError> {
+    pub fn write<T: UnsignedInteger>(&self, addr: WordType, data: T) -> Result<(), MemError> {
         if !Self::contains_access::<T>(addr) {
             return Err(MemError::StoreFault);
         }
+        // A faulting store changes nothing, so no reservation is broken before it's checked.
+        if !check_align::<T>(addr) {
+            return Err(MemError::StoreMisaligned);
+        }
+
+        self.break_reservations(addr, size_of::<T>());
+        self.code_pages.note_write(addr as usize);
+
+        unsafe { atomic_store(self.host_ptr(addr as usize), data) };
+        Ok(())
+    }
+
+    /// Copy the `buf.len()` bytes from `addr` to `buf`, with no alignment requirement.
+    pub(crate) fn read_bytes(&self, addr: WordType, buf: &mut [u8]) -> Result<(), MemError> {
+        let range = Self::byte_range(addr, buf.len()).ok_or(MemError::LoadFault)?;
+        unsafe { load_bytes(self.host_ptr(range.start), buf) };
+        Ok(())
+    }
+
+    /// Copy `data` to `addr` with the bookkeeping of as many stores, see [`Ram::report_write`].
+    pub(crate) fn write_bytes(&self, addr: WordType, data: &[u8]) -> Result<(), MemError> {
+        let range = Self::byte_range(addr, data.len()).ok_or(MemError::StoreFault)?;
+        self.report_write(range.start, data.len());
+        unsafe { store_bytes(self.host_ptr(range.start), data) };
+        Ok(())
+    }
+
+    /// Read without bounds or alignment checks.
+    ///
+    /// # Safety
+    /// `addr` must be checked by the caller, it's used by the host TLB which only holds RAM pages.
+    #[inline(always)]
+    pub(crate) unsafe fn read_unchecked<T: UnsignedInteger>(&self, addr: usize) -> T {
+        unsafe { load_unaligned(self.host_ptr(addr)) }
+    }
+
+    /// Write without bounds or alignment checks, still breaking the matching reservations.
+    ///
+    /// # Safety
+    /// See [`Ram::read_unchecked`].
+    #[inline(always)]
+    pub(crate) unsafe fn write_unchecked<T: UnsignedInteger>(&self, addr: usize, data: T) {
+        self.break_reservations(addr as WordType, size_of::<T>());
+        self.code_pages.note_write(addr);
+
+        unsafe { store_unaligned(self.host_ptr(addr), data) }
+    }
+
+    /// Record that instructions were decoded from the page of `addr`.
+    #[inline]
+    pub(crate) fn mark_code_page(&self, addr: usize) {
+        self.code_pages.mark(addr);
+    }
+
+    /// Report a write to `addr..addr + len` that didn't go through [`Ram::write`], e.g. DMA or an AMO.
+    ///
+    /// It breaks the reservations and drops the code decoded from the written pages like a store does.
+    pub(crate) fn report_write(&self, addr: usize, len: usize) {
+        if len == 0 {
+            return;
+        }
+
+        self.break_reservations(addr as WordType, len);
+
+        let first = addr >> CODE_PAGE_XLEN;
+        let last = (addr + len - 1) >> CODE_PAGE_XLEN;
+        for page in first..=last.min(CODE_PAGE_CNT - 1) {
+            self.code_pages.note_write(page << CODE_PAGE_XLEN);
+        }
+    }
+
+    /// Non-zero while some hart may hold a reservation, the stores the JIT compiles take the call
+    /// to [`Ram::write_unchecked`] then.
+    #[cfg(feature = "jit")]
+    pub(crate) fn reserved_mask(&self) -> &AtomicU32 {
+        &self.reserved_mask
+    }
+
+    /// One bit per page of [`CODE_PAGE_XLEN`] bits instructions were decoded from, the stores the
+    /// JIT compiles take the call to [`Ram::write_unchecked`] when it's set.
+    #[cfg(feature = "jit")]
+    pub(crate) fn code_page_bits(&self) -> &[AtomicU64] {
+        &self.code_pages.bits
+    }
+
+    #[inline(always)]
+    pub(crate) fn has_written_code_pages(&self, hart_id: usize) -> bool {
+        self.code_pages.has_queued(hart_id)
+    }
+
+    /// Take the offsets of the code pages written since the last call by `hart_id`.
+    pub(crate) fn take_written_code_pages(&self, hart_id: usize) -> Vec<usize> {
+        self.code_pages.take(hart_id)
+    }
 
-        if let Some(res) = self.reserved {
-            if res.is_match(addr) {
-                self.reserved = None;
+    pub(crate) fn size(&self) -> usize {
+        self.data.len()
+    }
+
+    /// Indices of the snapshot pages holding a non-zero byte.
+    pub(crate) fn non_zero_pages(&self) -> impl Iterator<Item = usize> + '_ {
+        (0..self.size() / SNAPSHOT_PAGE_SIZE).filter(|&index| {
+            (0..SNAPSHOT_PAGE_SIZE).step_by(8).any(|offset| {
+                let word = self.host_ptr(index * SNAPSHOT_PAGE_SIZE + offset);
+                unsafe { atomic_load::<u64>(word) != 0 }
+            })
+        })
+    }
+
+    /// Zero the whole RAM, drop the reservations and forget which pages held code.
+    ///
+    /// The harts must flush what they decoded on their own.
+    pub(crate) fn reset(&self) {
+        if !self.data.discard() {
+            const ZEROS: [u8; SNAPSHOT_PAGE_SIZE] = [0; SNAPSHOT_PAGE_SIZE];
+            for offset in (0..self.size()).step_by(SNAPSHOT_PAGE_SIZE) {
+                unsafe { store_bytes(self.host_ptr(offset), &ZEROS) };
             }
         }
+        for reservation in self.reserved.iter() {
+            reservation.addr.store(0, Ordering::Relaxed);
+        }
+        self.reserved_mask.store(0, Ordering::Relaxed);
+        self.code_pages.clear();
+    }
 
-        let ret = unsafe { write_raw_ptr(self.data.as_mut_ptr().add(addr as usize), data) };
-        if let Some(()) = ret {
-            Ok(())
-        } else {
-            Err(MemError::StoreMisaligned)
+    /// Copy `data` to `offset`, with none of the bookkeeping of a store, see [`Ram::reset`].
+    pub(crate) fn load(&self, offset: usize, data: &[u8]) {
+        assert!(
+            offset + data.len() <= self.size(),
+            "load past the end of RAM"
+        );
+        unsafe { store_bytes(self.host_ptr(offset), data) };
+    }
+
+    /// Put `len` bytes of `file` from `file_offset` at `offset`, see [`AnonMapping::map_file`].
+    ///
+    /// It's read when it can't be mapped, a chunk at a time.
+    pub(crate) fn load_file(
+        &self,
+        offset: usize,
+        file: &File,
+        file_offset: u64,
+        len: usize,
+    ) -> io::Result<()> {
+        if self.data.map_file(offset, file, file_offset, len) {
+            return Ok(());
         }
+
+        const CHUNK_LEN: usize = 1 << 20;
+        let mut chunk = vec![0; CHUNK_LEN.min(len)];
+        for start in (0..len).step_by(CHUNK_LEN) {
+            let chunk = &mut chunk[..CHUNK_LEN.min(len - start)];
+            read_exact_at(file, chunk, file_offset + start as u64)?;
+            self.load(offset + start, chunk);
+        }
+        Ok(())
+    }
+
+    fn byte_range(addr: WordType, len: usize) -> Option<Range<usize>> {
+        let start = usize::try_from(addr).ok()?;
+        let end = start.checked_add(len)?;
+        (end <= ram_config::SIZE).then_some(start..end)
     }
 
     fn contains_access<T>(addr: WordType) -> bool {
@@ -161,6 +657,23 @@ impl Ram {
     }
 }
 
+/// Positioned reads where there are some, the file may be read by other threads at once.
+fn read_exact_at(file: &File, buf: &mut [u8], offset: u64) -> io::Result<()> {
+    #[cfg(unix)]
+    {
+        use std::os::unix::fs::FileExt;
+        file.read_exact_at(buf, offset)
+    }
+    #[cfg(not(unix))]
+    {
+        use std::io::{Read, Seek, SeekFrom};
+
+        let mut file = file;
+        file.seek(SeekFrom::Start(offset))?;
+        file.read_exact(buf)
+    }
+}
+
 // // there is nothing to do.
 // impl DeviceTrait for Ram {
 //     fn sync(&mut self) {}
@@ -172,7 +685,7 @@ mod tests {
 
     #[test]
     fn test_insert_section_and_read() {
-        let mut r = Ram::new();
+        let r = Ram::new();
 
         // 插入一段数据，地址从 ram_config::BASE_ADDR 开始
         let base = 0x00;
@@ -216,8 +729,89 @@ mod tests {
     }
 
     #[test]
-    fn test_write_byte() {
+    fn test_code_page_write() {
         let mut ram = Ram::new();
+        ram.mark_code_page(0x1234);
+
+        // Other pages are not reported.
+        ram.write::<u32>(0x2000, 1).unwrap();
+        assert!(!ram.has_written_code_pages(0));
+
+        ram.write::<u32>(0x1ffc, 1).unwrap();
+        ram.write::<u32>(0x1000, 1).unwrap();
+        assert_eq!(ram.take_written_code_pages(0), vec![0x1000]);
+        assert!(!ram.has_written_code_pages(0));
+
+        ram.mark_code_page(0x3000);
+        ram.report_write(0x2ff0, 0x20);
+        assert_eq!(ram.take_written_code_pages(0), vec![0x3000]);
+
+        // Every hart is told.
+        ram.set_hart_cnt(2);
+        ram.mark_code_page(0x1000);
+        ram.write::<u8>(0x1000, 1).unwrap();
+        assert_eq!(ram.take_written_code_pages(0), vec![0x1000]);
+        assert_eq!(ram.take_written_code_pages(1), vec![0x1000]);
+    }
+
+    #[test]
+    fn test_reservation_across_harts() {
+        let ram = Ram::new();
+
+        ram.load_reserved::<u64>(0, 0x100).unwrap();
+        ram.load_reserved::<u64>(1, 0x100).unwrap();
+
+        // The first SC wins, its store breaks the reservation of the other hart.
+        assert_eq!(ram.store_conditional::<u64>(1, 0x100, 1), Ok(true));
+        assert_eq!(ram.store_conditional::<u64>(0, 0x100, 2), Ok(false));
+        assert_eq!(ram.read::<u64>(0x100), Ok(1));
+
+        // A plain store from anywhere breaks it as well.
+        ram.load_reserved::<u64>(0, 0x100).unwrap();
+        ram.write::<u32>(0x104, 3).unwrap();
+        assert_eq!(ram.store_conditional::<u64>(0, 0x100, 4), Ok(false));
+
+        // Reservations of other granules are kept.
+        ram.load_reserved::<u64>(0, 0x100).unwrap();
+        ram.write::<u64>(0x108, 5).unwrap();
+        assert_eq!(ram.store_conditional::<u64>(0, 0x100, 6), Ok(true));
+
+        // So are they on a faulting store.
+        ram.load_reserved::<u64>(0, 0x100).unwrap();
+        ram.mark_code_page(0x0);
+        assert_eq!(ram.write::<u32>(0x102, 5), Err(MemError::StoreMisaligned));
+        assert!(!ram.has_written_code_pages(0));
+        assert_eq!(ram.store_conditional::<u64>(0, 0x100, 6), Ok(true));
+
+        // Reported writes, e.g. an AMO of another hart.
+        ram.load_reserved::<u32>(0, 0x100).unwrap();
+        ram.report_write(0x100, 4);
+        assert_eq!(ram.store_conditional::<u32>(0, 0x100, 7), Ok(false));
+    }
+
+    #[test]
+    fn test_sc_commits_atomically() {
+        let mut ram = Ram::new();
+        ram.write::<u64>(0x100, 0x1111_2222_3333_4444).unwrap();
+
+        // A word SC only replaces its half of the granule.
+        assert_eq!(ram.load_reserved::<u32>(0, 0x104), Ok(0x1111_2222));
+        assert_eq!(
+            ram.store_conditional::<u32>(0, 0x104, 0xaaaa_bbbb),
+            Ok(true)
+        );
+        assert_eq!(ram.read::<u64>(0x100), Ok(0xaaaa_bbbb_3333_4444));
+
+        // A write the RAM wasn't told about still makes the SC fail.
+        ram.load_reserved::<u64>(0, 0x100).unwrap();
+        ram.data[0x100] = 0;
+        assert_eq!(ram.store_conditional::<u64>(0, 0x100, 1), Ok(false));
+        assert_eq!(ram.read::<u8>(0x100), Ok(0));
+    }
+
+    #[test]
+    fn test_write_byte() {
+        let ram = Ram::new();
         ram.write::<u8>(0x00, 0xAB).unwrap();
         assert_eq!(ram.data[0], 0xAB);
 
@@ -244,7 +838,7 @@ mod tests {
 
     #[test]
     fn test_read_write_reject_end_and_crossing_accesses() {
-        let mut ram = Ram::new();
+        let ram = Ram::new();
         let last_word = ram_config::SIZE as WordType - size_of::<u64>() as WordType;
 
         ram.write::<u64>(last_word, 0x1122_3344_5566_7788).unwrap();
@@ -271,7 +865,7 @@ mod tests {
     #[test]
     #[should_panic]
     fn test_insert_section_rejects_crossing_end() {
-        let mut ram = Ram::new();
+        let ram = Ram::new();
         ram.insert_section(&[1, 2], ram_config::SIZE as WordType - 1);
     }
 }
@@ -1,4 +1,4 @@
-use std::fs;
+use std::{fs, path::Path};
 
 use super::*;
 
@@ -50,6 +50,10 @@ impl<'a, B: Board> Handler<'a, B> {
                 virt,
             } => self.handle_breakpoint(delete, symbol, virt),
             Cli::Info(cmd) => self.handle_info(cmd),
+            Cli::Snapshot(cmd) => self.handle_snapshot(cmd),
+            Cli::Stats => self.dbg.stats().map(CommandOutput::Stats).ok_or_else(|| {
+                "Statistics are only kept when built with `--features stats`".to_string()
+            }),
             Cli::Quit => Ok(CommandOutput::Exit),
             Cli::SymbolFile { path } => self.handle_symbol_file(path),
         }
@@ -82,6 +86,15 @@ impl<'a, B: Board> Handler<'a, B> {
         }
     }
 
+    fn handle_snapshot(&mut self, cmd: SnapshotCmd) -> Result<CommandOutput, String> {
+        match cmd {
+            SnapshotCmd::Save { path } => self.dbg.save_snapshot(Path::new(&path)),
+            SnapshotCmd::Restore { path } => self.dbg.restore_snapshot(Path::new(&path)),
+        }
+        .map_err(|e| e.to_string())?;
+        Ok(CommandOutput::None)
+    }
+
     fn handle_ftrace(&mut self, cmd: FTraceCmd) -> Result<CommandOutput, String> {
         match cmd {
             FTraceCmd::Start => {
@@ -10,6 +10,7 @@ use riscv_emulator::isa::riscv::csr_reg::PrivilegeLevel;
 use riscv_emulator::isa::riscv::debugger;
 use riscv_emulator::isa::riscv::mmu::AccessType;
 use riscv_emulator::isa::riscv::{debugger::Address, decoder::DecodeInstr};
+use riscv_emulator::stats::StatsReport;
 
 pub use repl::DebugREPL;
 
@@ -109,6 +110,13 @@ enum Cli {
     #[command(subcommand)]
     Info(InfoCmd),
 
+    /// Save or restore the whole machine.
+    #[command(subcommand)]
+    Snapshot(SnapshotCmd),
+
+    /// Show the statistics counters, kept when built with the `stats` feature.
+    Stats,
+
     /// Quit the debugger
     #[command(name = "quit", aliases = ["q", "exit"]) ]
     Quit,
@@ -159,6 +167,12 @@ pub enum InfoCmd {
     Symbols,
 }
 
+#[derive(Debug, Subcommand)]
+pub enum SnapshotCmd {
+    Save { path: String },
+    Restore { path: String },
+}
+
 #[derive(Debug, Subcommand)]
 pub enum FTraceCmd {
     Start,
@@ -236,6 +250,7 @@ pub enum CommandOutput {
     FTraceStatus {
         enabled: bool,
     },
+    Stats(StatsReport),
 
     ContinueDone {
         instr: DbgInstrLine,
@@ -233,6 +233,9 @@ impl Printer {
             CommandOutput::FTraceStatus { enabled } => {
                 println!("ftrace {}", if *enabled { "started" } else { "stopped" });
             }
+            CommandOutput::Stats(report) => {
+                println!("{}", report);
+            }
 
             CommandOutput::ContinueDone {
                 instr,
@@ -251,6 +254,15 @@ impl Printer {
                             format_instr(instr)
                         );
                     }
+                    debugger::DebugEvent::WatchpointHit { kind, addr } => {
+                        println!(
+                            "Watchpoint ({:?}) hit at {:#x} after {} steps: {}",
+                            kind,
+                            addr,
+                            steps,
+                            format_instr(instr)
+                        );
+                    }
                     debugger::DebugEvent::BoardHalted => {
                         if *steps == 0 {
                             println!("Board already halted");
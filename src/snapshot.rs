@@ -0,0 +1,500 @@
+//! Save states of a whole [`VirtBoard`](crate::board::virt::VirtBoard).
+//!
+//! A snapshot is laid out as:
+//!
+//! | offset         | content                                                   |
+//! |----------------|-----------------------------------------------------------|
+//! | 0              | header, see [`SnapshotHeader`]                            |
+//! | 64             | machine state, as written by the [`Snapshot`] impls       |
+//! |                | index of every RAM page saved, one little endian `u32` each |
+//! | `pages_offset` | the saved RAM pages, in index order                       |
+//!
+//! Only the pages holding a non-zero byte are saved. They start page aligned, so that a snapshot
+//! file is restored by mapping its pages copy-on-write into RAM rather than reading them.
+//!
+//! Disk images are not part of a snapshot, give the block devices the disk they had when it was taken.
+
+use std::{
+    borrow::Cow,
+    fs::File,
+    io::{self, Read, Seek, SeekFrom, Write},
+};
+
+use crate::{config::arch_config::WordType, mmap, ram::Ram};
+
+const SNAPSHOT_MAGIC: &[u8; 8] = b"RVSNAPSH";
+const SNAPSHOT_VERSION: u32 = 1;
+const HEADER_LEN: usize = 64;
+pub(crate) const SNAPSHOT_PAGE_SIZE: usize = 4096;
+
+#[derive(thiserror::Error, Debug)]
+pub enum SnapshotError {
+    #[error("snapshot I/O failed: {0}")]
+    Io(#[from] io::Error),
+    #[error("not a snapshot, or of another version")]
+    BadFormat,
+    #[error("the snapshot ends too early")]
+    Truncated,
+    #[error("the snapshot was taken on another machine: {0}")]
+    Mismatch(String),
+    #[error("this board does not support snapshots")]
+    Unsupported,
+}
+
+/// Something the board saves into snapshots.
+pub(crate) trait Snapshot {
+    fn save(&self, out: &mut StateWriter);
+    fn restore(&mut self, state: &mut StateReader) -> Result<(), SnapshotError>;
+}
+
+/// Builds the machine state, every value in little endian.
+pub struct StateWriter {
+    buf: Vec<u8>,
+}
+
+impl StateWriter {
+    pub(crate) fn new() -> Self {
+        Self { buf: Vec::new() }
+    }
+
+    pub(crate) fn write_u8(&mut self, value: u8) {
+        self.buf.push(value);
+    }
+
+    pub(crate) fn write_bool(&mut self, value: bool) {
+        self.buf.push(value as u8);
+    }
+
+    pub(crate) fn write_u16(&mut self, value: u16) {
+        self.buf.extend_from_slice(&value.to_le_bytes());
+    }
+
+    pub(crate) fn write_u32(&mut self, value: u32) {
+        self.buf.extend_from_slice(&value.to_le_bytes());
+    }
+
+    pub(crate) fn write_u64(&mut self, value: u64) {
+        self.buf.extend_from_slice(&value.to_le_bytes());
+    }
+
+    pub(crate) fn write_bytes(&mut self, bytes: &[u8]) {
+        self.buf.extend_from_slice(bytes);
+    }
+
+    /// Write what `f` writes with its length first, so that the reader can check it reads it all.
+    pub(crate) fn write_section(&mut self, f: impl FnOnce(&mut Self)) {
+        let len_pos = self.buf.len();
+        self.write_u64(0);
+        f(self);
+        let len = (self.buf.len() - len_pos - 8) as u64;
+        self.buf[len_pos..len_pos + 8].copy_from_slice(&len.to_le_bytes());
+    }
+
+    pub(crate) fn into_bytes(self) -> Vec<u8> {
+        self.buf
+    }
+}
+
+/// Reads back what a [`StateWriter`] wrote.
+pub struct StateReader<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> StateReader<'a> {
+    pub(crate) fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+
+    pub(crate) fn read_bytes(&mut self, len: usize) -> Result<&'a [u8], SnapshotError> {
+        if self.data.len() < len {
+            return Err(SnapshotError::Truncated);
+        }
+        let (bytes, rest) = self.data.split_at(len);
+        self.data = rest;
+        Ok(bytes)
+    }
+
+    fn read_array<const N: usize>(&mut self) -> Result<[u8; N], SnapshotError> {
+        Ok(self.read_bytes(N)?.try_into().unwrap())
+    }
+
+    pub(crate) fn read_u8(&mut self) -> Result<u8, SnapshotError> {
+        Ok(self.read_array::<1>()?[0])
+    }
+
+    pub(crate) fn read_bool(&mut self) -> Result<bool, SnapshotError> {
+        match self.read_u8()? {
+            0 => Ok(false),
+            1 => Ok(true),
+            _ => Err(SnapshotError::BadFormat),
+        }
+    }
+
+    pub(crate) fn read_u16(&mut self) -> Result<u16, SnapshotError> {
+        Ok(u16::from_le_bytes(self.read_array()?))
+    }
+
+    pub(crate) fn read_u32(&mut self) -> Result<u32, SnapshotError> {
+        Ok(u32::from_le_bytes(self.read_array()?))
+    }
+
+    pub(crate) fn read_u64(&mut self) -> Result<u64, SnapshotError> {
+        Ok(u64::from_le_bytes(self.read_array()?))
+    }
+
+    /// Read a `u64` that must be `expected` on this machine, `what` names it in the error.
+    pub(crate) fn expect_u64(&mut self, expected: u64, what: &str) -> Result<(), SnapshotError> {
+        let value = self.read_u64()?;
+        if value != expected {
+            return Err(SnapshotError::Mismatch(format!(
+                "{} is {}, expected {}",
+                what, value, expected
+            )));
+        }
+        Ok(())
+    }
+
+    /// Read a section written by [`StateWriter::write_section`] with `f`, which must read all of it.
+    pub(crate) fn read_section<T>(
+        &mut self,
+        f: impl FnOnce(&mut StateReader<'a>) -> Result<T, SnapshotError>,
+    ) -> Result<T, SnapshotError> {
+        let len = self.read_u64()? as usize;
+        let mut section = StateReader::new(self.read_bytes(len)?);
+        let value = f(&mut section)?;
+        if !section.data.is_empty() {
+            return Err(SnapshotError::BadFormat);
+        }
+        Ok(value)
+    }
+}
+
+/// | offset | size | field                            |
+/// |--------|------|----------------------------------|
+/// | 0      | 8    | magic, `RVSNAPSH`                |
+/// | 8      | 4    | version                          |
+/// | 16     | 8    | length of the machine state      |
+/// | 24     | 8    | number of RAM pages saved        |
+/// | 32     | 8    | offset of the first RAM page     |
+/// | 40     | 8    | size of RAM                      |
+#[derive(Clone)]
+struct SnapshotHeader {
+    state_len: u64,
+    page_cnt: u64,
+    pages_offset: u64,
+    ram_size: u64,
+}
+
+impl SnapshotHeader {
+    fn to_bytes(&self) -> [u8; HEADER_LEN] {
+        let mut bytes = [0; HEADER_LEN];
+        bytes[0..8].copy_from_slice(SNAPSHOT_MAGIC);
+        bytes[8..12].copy_from_slice(&SNAPSHOT_VERSION.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.state_len.to_le_bytes());
+        bytes[24..32].copy_from_slice(&self.page_cnt.to_le_bytes());
+        bytes[32..40].copy_from_slice(&self.pages_offset.to_le_bytes());
+        bytes[40..48].copy_from_slice(&self.ram_size.to_le_bytes());
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8]) -> Result<Self, SnapshotError> {
+        if bytes.len() < HEADER_LEN {
+            return Err(SnapshotError::Truncated);
+        }
+        let field = |start: usize| u64::from_le_bytes(bytes[start..start + 8].try_into().unwrap());
+        let version = u32::from_le_bytes(bytes[8..12].try_into().unwrap());
+        if &bytes[0..8] != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION {
+            return Err(SnapshotError::BadFormat);
+        }
+
+        Ok(Self {
+            state_len: field(16),
+            page_cnt: field(24),
+            pages_offset: field(32),
+            ram_size: field(40),
+        })
+    }
+
+    /// Length of the header, the state and the page index, i.e. everything but the pages.
+    fn meta_len(&self) -> usize {
+        HEADER_LEN + self.state_len as usize + self.page_cnt as usize * 4
+    }
+
+    /// Length of the whole snapshot, up to the end of the last page.
+    fn total_len(&self) -> Result<u64, SnapshotError> {
+        let pages_len = self.page_cnt.checked_mul(SNAPSHOT_PAGE_SIZE as u64);
+        let total_len = pages_len.and_then(|len| len.checked_add(self.pages_offset));
+        match total_len {
+            Some(len) if self.pages_offset >= self.meta_len() as u64 => Ok(len),
+            _ => Err(SnapshotError::BadFormat),
+        }
+    }
+
+    /// Check that a snapshot of `len` bytes holds everything the header says it does.
+    fn check_len(&self, len: u64) -> Result<(), SnapshotError> {
+        if len < self.total_len()? {
+            return Err(SnapshotError::Truncated);
+        }
+        Ok(())
+    }
+}
+
+/// Write a snapshot made of the machine `state` and the RAM `ram`.
+pub(crate) fn write_snapshot(
+    out: &mut dyn Write,
+    state: &[u8],
+    ram: &Ram,
+) -> Result<(), SnapshotError> {
+    let pages: Vec<u32> = ram.non_zero_pages().map(|page| page as u32).collect();
+
+    let mut header = SnapshotHeader {
+        state_len: state.len() as u64,
+        page_cnt: pages.len() as u64,
+        pages_offset: 0,
+        ram_size: ram.size() as u64,
+    };
+    header.pages_offset = header.meta_len().next_multiple_of(SNAPSHOT_PAGE_SIZE) as u64;
+
+    let mut meta = Vec::with_capacity(header.pages_offset as usize);
+    meta.extend_from_slice(&header.to_bytes());
+    meta.extend_from_slice(state);
+    for page in pages.iter() {
+        meta.extend_from_slice(&page.to_le_bytes());
+    }
+    meta.resize(header.pages_offset as usize, 0);
+    out.write_all(&meta)?;
+
+    let mut bytes = vec![0; SNAPSHOT_PAGE_SIZE];
+    for &page in pages.iter() {
+        ram.read_bytes((page as usize * SNAPSHOT_PAGE_SIZE) as WordType, &mut bytes)
+            .expect("a page of RAM is in RAM");
+        out.write_all(&bytes)?;
+    }
+    out.flush()?;
+    Ok(())
+}
+
+/// A snapshot being restored, the machine state is read and the RAM pages stay where they are.
+pub(crate) struct SnapshotImage<'a> {
+    header: SnapshotHeader,
+    meta: Cow<'a, [u8]>,
+    pages: PageSource<'a>,
+}
+
+enum PageSource<'a> {
+    Bytes(&'a [u8]),
+    File(&'a File),
+}
+
+impl<'a> SnapshotImage<'a> {
+    pub(crate) fn from_bytes(bytes: &'a [u8]) -> Result<Self, SnapshotError> {
+        let header = SnapshotHeader::from_bytes(bytes)?;
+        header.check_len(bytes.len() as u64)?;
+        let meta_len = header.meta_len();
+
+        Ok(Self {
+            meta: Cow::Borrowed(&bytes[..meta_len]),
+            header,
+            pages: PageSource::Bytes(bytes),
+        })
+    }
+
+    pub(crate) fn from_file(mut file: &'a File) -> Result<Self, SnapshotError> {
+        let mut bytes = [0; HEADER_LEN];
+        file.seek(SeekFrom::Start(0))?;
+        file.read_exact(&mut bytes)?;
+        let header = SnapshotHeader::from_bytes(&bytes)?;
+        // The pages are mapped from the file, a page past its end would fault on first touch.
+        header.check_len(file.metadata()?.len())?;
+
+        let mut meta = vec![0; header.meta_len()];
+        meta[..HEADER_LEN].copy_from_slice(&bytes);
+        file.read_exact(&mut meta[HEADER_LEN..])?;
+
+        Ok(Self {
+            header,
+            meta: Cow::Owned(meta),
+            pages: PageSource::File(file),
+        })
+    }
+
+    pub(crate) fn state(&self) -> StateReader<'_> {
+        let start = HEADER_LEN;
+        StateReader::new(&self.meta[start..start + self.header.state_len as usize])
+    }
+
+    fn page_index(&self) -> impl Iterator<Item = usize> + '_ {
+        self.meta[HEADER_LEN + self.header.state_len as usize..]
+            .chunks_exact(4)
+            .map(|bytes| u32::from_le_bytes(bytes.try_into().unwrap()) as usize)
+    }
+
+    /// Replace the whole content of `ram` with the saved pages.
+    ///
+    /// Runs of consecutive pages of a file are mapped with one call each when the host allows it.
+    pub(crate) fn restore_ram(&self, ram: &Ram) -> Result<(), SnapshotError> {
+        if self.header.ram_size != ram.size() as u64 {
+            return Err(SnapshotError::Mismatch(format!(
+                "RAM size is {}, expected {}",
+                self.header.ram_size,
+                ram.size()
+            )));
+        }
+        let page_cnt = ram.size() / SNAPSHOT_PAGE_SIZE;
+        if self.page_index().any(|page| page >= page_cnt) {
+            return Err(SnapshotError::BadFormat);
+        }
+
+        ram.reset();
+
+        // Runs of `(first page in RAM, first page in the snapshot, page count)`.
+        let mut runs: Vec<(usize, usize, usize)> = Vec::new();
+        for (slot, page) in self.page_index().enumerate() {
+            if runs
+                .last()
+                .is_some_and(|&(first, _, cnt)| first + cnt == page)
+            {
+                runs.last_mut().unwrap().2 += 1;
+            } else {
+                runs.push((page, slot, 1));
+            }
+        }
+
+        let pages_offset = self.header.pages_offset as usize;
+        for (first, slot, cnt) in runs {
+            let offset = pages_offset + slot * SNAPSHOT_PAGE_SIZE;
+            let len = cnt * SNAPSHOT_PAGE_SIZE;
+            let ram_offset = first * SNAPSHOT_PAGE_SIZE;
+            match self.pages {
+                PageSource::Bytes(bytes) => {
+                    let data = bytes
+                        .get(offset..offset + len)
+                        .ok_or(SnapshotError::Truncated)?;
+                    ram.load(ram_offset, data);
+                }
+                PageSource::File(file) => ram.load_file(ram_offset, file, offset as u64, len)?,
+            }
+        }
+        Ok(())
+    }
+}
+
+/// A snapshot kept by the process, that boards on every thread restore from at once.
+///
+/// Where the host has memory files, the snapshot is one: the RAM of every board restored from it
+/// maps the saved pages copy-on-write, so the pages no board writes are in host memory once.
+pub struct SharedSnapshot {
+    header: SnapshotHeader,
+    meta: Vec<u8>,
+    pages: SharedPages,
+}
+
+enum SharedPages {
+    File(File),
+    Bytes(Vec<u8>),
+}
+
+impl SharedSnapshot {
+    /// Keep a snapshot made by [`write_snapshot`].
+    pub(crate) fn new(bytes: Vec<u8>) -> Result<Self, SnapshotError> {
+        let (header, meta) = {
+            let image = SnapshotImage::from_bytes(&bytes)?;
+            (image.header, image.meta.into_owned())
+        };
+
+        let pages = match Self::to_memory_file(&bytes) {
+            Ok(file) => SharedPages::File(file),
+            Err(err) => {
+                log::debug!("Snapshot kept on the heap, without memory files: {}", err);
+                SharedPages::Bytes(bytes)
+            }
+        };
+
+        Ok(Self {
+            header,
+            meta,
+            pages,
+        })
+    }
+
+    fn to_memory_file(bytes: &[u8]) -> io::Result<File> {
+        let mut file = mmap::memory_file("snapshot")?;
+        file.write_all(bytes)?;
+        Ok(file)
+    }
+
+    pub(crate) fn image(&self) -> SnapshotImage<'_> {
+        SnapshotImage {
+            header: self.header.clone(),
+            meta: Cow::Borrowed(&self.meta),
+            pages: match &self.pages {
+                SharedPages::File(file) => PageSource::File(file),
+                SharedPages::Bytes(bytes) => PageSource::Bytes(bytes),
+            },
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_state_sections() {
+        let mut out = StateWriter::new();
+        out.write_u8(1);
+        out.write_section(|out| {
+            out.write_u16(0x1234);
+            out.write_bool(true);
+        });
+        out.write_u64(u64::MAX);
+        let bytes = out.into_bytes();
+
+        let mut state = StateReader::new(&bytes);
+        assert_eq!(state.read_u8().unwrap(), 1);
+        let section = state.read_section(|state| Ok((state.read_u16()?, state.read_bool()?)));
+        assert_eq!(section.unwrap(), (0x1234, true));
+        assert!(state.expect_u64(0, "value").is_err());
+        assert!(matches!(state.read_u8(), Err(SnapshotError::Truncated)));
+
+        // A section not read to its end.
+        let mut state = StateReader::new(&bytes[1..]);
+        assert!(matches!(
+            state.read_section(|state| state.read_u16()),
+            Err(SnapshotError::BadFormat)
+        ));
+    }
+
+    #[test]
+    fn test_truncated_snapshot() {
+        let header = SnapshotHeader {
+            state_len: 0,
+            page_cnt: 2,
+            pages_offset: SNAPSHOT_PAGE_SIZE as u64,
+            ram_size: 4 * SNAPSHOT_PAGE_SIZE as u64,
+        };
+        let mut bytes = header.to_bytes().to_vec();
+        bytes.extend_from_slice(&[0, 0, 0, 0, 1, 0, 0, 0]);
+        bytes.resize(2 * SNAPSHOT_PAGE_SIZE, 0);
+
+        // One page of the two.
+        assert!(matches!(
+            SnapshotImage::from_bytes(&bytes),
+            Err(SnapshotError::Truncated)
+        ));
+
+        let path = std::env::temp_dir().join(format!("rvemu-snapshot-{}", std::process::id()));
+        std::fs::write(&path, &bytes).unwrap();
+        let file = File::open(&path).unwrap();
+        assert!(matches!(
+            SnapshotImage::from_file(&file),
+            Err(SnapshotError::Truncated)
+        ));
+
+        bytes.resize(3 * SNAPSHOT_PAGE_SIZE, 0);
+        std::fs::write(&path, &bytes).unwrap();
+        let file = File::open(&path).unwrap();
+        assert!(SnapshotImage::from_file(&file).is_ok());
+        std::fs::remove_file(&path).unwrap();
+    }
+}
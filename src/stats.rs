@@ -0,0 +1,496 @@
+//! Counters of what the emulator does, kept with the `stats` feature.
+//!
+//! The counters live next to what they count: the harts, their page table walker and MMIO map,
+//! the disks and the device poller. Without the feature a [`Counter`] is zero-sized and its
+//! methods do nothing, so the counting compiles away and the structures keep their size.
+//!
+//! [`StatsReport`] gathers them for a board, see
+//! [`VirtBoard::stats`](crate::board::virt::VirtBoard::stats).
+
+use std::{fmt, time::Duration};
+
+use crate::{
+    config::arch_config::WordType,
+    isa::{
+        cache::CacheStats,
+        riscv::{
+            executor::RVCPU,
+            instruction::instr_table::RiscvInstr,
+            trap::{Exception, Interrupt, Trap},
+        },
+    },
+};
+
+pub use counter::{Counter, SharedCounter};
+
+/// Whether the counters are kept, that is the `stats` feature.
+pub const ENABLED: bool = cfg!(feature = "stats");
+
+#[cfg(feature = "stats")]
+mod counter {
+    use std::sync::atomic::{AtomicU64, Ordering};
+
+    #[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+    pub struct Counter(u64);
+
+    impl Counter {
+        pub const ZERO: Self = Self(0);
+
+        #[inline(always)]
+        pub fn add(&mut self, n: u64) {
+            self.0 += n;
+        }
+
+        #[inline(always)]
+        pub fn incr(&mut self) {
+            self.0 += 1;
+        }
+
+        #[inline(always)]
+        pub fn get(&self) -> u64 {
+            self.0
+        }
+    }
+
+    /// A [`Counter`] bumped from any thread.
+    #[derive(Debug, Default)]
+    pub struct SharedCounter(AtomicU64);
+
+    impl SharedCounter {
+        #[inline(always)]
+        pub fn add(&self, n: u64) {
+            self.0.fetch_add(n, Ordering::Relaxed);
+        }
+
+        #[inline(always)]
+        pub fn incr(&self) {
+            self.add(1);
+        }
+
+        #[inline(always)]
+        pub fn get(&self) -> u64 {
+            self.0.load(Ordering::Relaxed)
+        }
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+mod counter {
+    #[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+    pub struct Counter;
+
+    impl Counter {
+        pub const ZERO: Self = Self;
+
+        #[inline(always)]
+        pub fn add(&mut self, _n: u64) {}
+
+        #[inline(always)]
+        pub fn incr(&mut self) {}
+
+        #[inline(always)]
+        pub fn get(&self) -> u64 {
+            0
+        }
+    }
+
+    #[derive(Debug, Default)]
+    pub struct SharedCounter;
+
+    impl SharedCounter {
+        #[inline(always)]
+        pub fn add(&self, _n: u64) {}
+
+        #[inline(always)]
+        pub fn incr(&self) {}
+
+        #[inline(always)]
+        pub fn get(&self) -> u64 {
+            0
+        }
+    }
+}
+
+/// Trap causes are below 16 for both exceptions and interrupts.
+const TRAP_CAUSE_CNT: usize = 16;
+
+/// Counters of one hart.
+pub(crate) struct HartStats {
+    /// Instructions run by the interpreter, by [`RiscvInstr`].
+    instrs: Box<[Counter; RiscvInstr::COUNT]>,
+    /// Instructions run as pre-decoded ops, which do not tell them apart.
+    predecoded_instrs: Counter,
+    /// Instructions run as code compiled by the JIT, which does not tell them apart either.
+    compiled_instrs: Counter,
+    /// Traps taken, by cause.
+    exceptions: [Counter; TRAP_CAUSE_CNT],
+    interrupts: [Counter; TRAP_CAUSE_CNT],
+}
+
+impl HartStats {
+    pub(crate) fn new() -> Self {
+        Self {
+            instrs: Box::new([Counter::ZERO; RiscvInstr::COUNT]),
+            predecoded_instrs: Counter::ZERO,
+            compiled_instrs: Counter::ZERO,
+            exceptions: [Counter::ZERO; TRAP_CAUSE_CNT],
+            interrupts: [Counter::ZERO; TRAP_CAUSE_CNT],
+        }
+    }
+
+    #[inline(always)]
+    pub(crate) fn record_instr(&mut self, instr: RiscvInstr) {
+        if ENABLED {
+            self.instrs[instr as usize].incr();
+        }
+    }
+
+    #[inline(always)]
+    pub(crate) fn record_predecoded_instrs(&mut self, steps: u64) {
+        self.predecoded_instrs.add(steps);
+    }
+
+    #[inline(always)]
+    pub(crate) fn record_compiled_instrs(&mut self, steps: u64) {
+        self.compiled_instrs.add(steps);
+    }
+
+    #[inline]
+    pub(crate) fn record_trap(&mut self, cause: Trap) {
+        if !ENABLED {
+            return;
+        }
+        // Only the interrupts with a code are taken, `into` panics on the others.
+        match cause {
+            Trap::Exception(exception) => self.exceptions[exception as usize].incr(),
+            Trap::Interrupt(interrupt) => {
+                let code: WordType = interrupt.into();
+                self.interrupts[code as usize].incr();
+            }
+        }
+    }
+}
+
+/// Counters of a page table walker, the TLB hits and misses are in its [`CacheStats`].
+#[derive(Default)]
+pub(crate) struct WalkStats {
+    walks: Counter,
+    /// Walks that ended on a fault, without a leaf.
+    faults: Counter,
+    /// PTEs read by the walks that reached a leaf.
+    ptes: Counter,
+}
+
+impl WalkStats {
+    /// A walk on a TLB miss, which read `ptes` entries to reach the leaf, or faulted.
+    #[inline(always)]
+    pub(crate) fn record(&mut self, ptes: Option<usize>) {
+        self.walks.incr();
+        match ptes {
+            Some(ptes) => self.ptes.add(ptes as u64),
+            None => self.faults.incr(),
+        }
+    }
+}
+
+/// Requests of a virtio block device, counted when the guest submits them.
+#[derive(Debug, Default)]
+pub struct BlkStats {
+    pub(crate) reads: SharedCounter,
+    pub(crate) writes: SharedCounter,
+    pub(crate) flushes: SharedCounter,
+    pub(crate) bytes_read: SharedCounter,
+    pub(crate) bytes_written: SharedCounter,
+}
+
+/// Rounds of the device poll task.
+#[derive(Debug, Default)]
+pub struct PollStats {
+    pub(crate) rounds: SharedCounter,
+    /// Rounds that forwarded interrupts.
+    pub(crate) busy_rounds: SharedCounter,
+    pub(crate) interrupts: SharedCounter,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DiskCounts {
+    pub reads: u64,
+    pub writes: u64,
+    pub flushes: u64,
+    pub bytes_read: u64,
+    pub bytes_written: u64,
+}
+
+impl From<&BlkStats> for DiskCounts {
+    fn from(stats: &BlkStats) -> Self {
+        Self {
+            reads: stats.reads.get(),
+            writes: stats.writes.get(),
+            flushes: stats.flushes.get(),
+            bytes_read: stats.bytes_read.get(),
+            bytes_written: stats.bytes_written.get(),
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct MmioCounts {
+    pub device: &'static str,
+    pub base: WordType,
+    pub accesses: u64,
+}
+
+/// The counters of a board, summed over its harts.
+#[derive(Debug, Clone, PartialEq)]
+pub struct StatsReport {
+    /// Board cycles, a cycle being one instruction per hart.
+    pub cycles: u64,
+    /// Instructions run, over all harts.
+    pub instructions: u64,
+    /// Host time of the run, for [`Self::mips`].
+    pub host_time: Option<Duration>,
+    pub caches: Vec<(&'static str, CacheStats)>,
+    pub page_walks: u64,
+    pub page_walk_faults: u64,
+    pub page_walk_ptes: u64,
+    /// Traps taken, the most taken first.
+    pub traps: Vec<(Trap, u64)>,
+    /// Instructions run by ISA extension (see [`RiscvInstr::isa_name`]), the most run first.
+    pub instr_classes: Vec<(&'static str, u64)>,
+    /// Instructions run by the interpreter, the most run first.
+    pub instrs: Vec<(RiscvInstr, u64)>,
+    /// Device accesses, in address order.
+    pub mmio: Vec<MmioCounts>,
+    pub disks: Vec<DiskCounts>,
+    pub poll_rounds: u64,
+    pub poll_busy_rounds: u64,
+    pub poll_interrupts: u64,
+}
+
+impl StatsReport {
+    /// Class of the instructions run as pre-decoded ops.
+    const PREDECODED_CLASS: &'static str = "(predecoded)";
+    /// Class of the instructions run as compiled code.
+    const COMPILED_CLASS: &'static str = "(compiled)";
+    /// Instructions shown by the [`fmt::Display`] implementation.
+    const SHOWN_INSTRS: usize = 10;
+
+    pub(crate) fn from_harts<'a>(cycles: u64, harts: impl Iterator<Item = &'a RVCPU>) -> Self {
+        let mut report = Self {
+            cycles,
+            instructions: 0,
+            host_time: None,
+            caches: Vec::new(),
+            page_walks: 0,
+            page_walk_faults: 0,
+            page_walk_ptes: 0,
+            traps: Vec::new(),
+            instr_classes: Vec::new(),
+            instrs: Vec::new(),
+            mmio: Vec::new(),
+            disks: Vec::new(),
+            poll_rounds: 0,
+            poll_busy_rounds: 0,
+            poll_interrupts: 0,
+        };
+
+        let mut instrs = vec![0u64; RiscvInstr::COUNT];
+        let mut predecoded_instrs = 0;
+        let mut compiled_instrs = 0;
+        let mut exceptions = [0u64; TRAP_CAUSE_CNT];
+        let mut interrupts = [0u64; TRAP_CAUSE_CNT];
+        for hart in harts {
+            for (index, (name, stats)) in hart.cache_stats().into_iter().enumerate() {
+                match report.caches.get_mut(index) {
+                    Some((_, total)) => {
+                        total.hits += stats.hits;
+                        total.misses += stats.misses;
+                        total.evictions += stats.evictions;
+                    }
+                    None => report.caches.push((name, stats)),
+                }
+            }
+
+            let walks = hart.walk_stats();
+            report.page_walks += walks.walks.get();
+            report.page_walk_faults += walks.faults.get();
+            report.page_walk_ptes += walks.ptes.get();
+
+            // Every hart has the same devices, in the same order.
+            for (index, (device, base, accesses)) in hart.mmio_accesses().enumerate() {
+                match report.mmio.get_mut(index) {
+                    Some(total) => total.accesses += accesses,
+                    None => report.mmio.push(MmioCounts {
+                        device,
+                        base,
+                        accesses,
+                    }),
+                }
+            }
+
+            let stats = &hart.stats;
+            for (total, counter) in instrs.iter_mut().zip(stats.instrs.iter()) {
+                *total += counter.get();
+            }
+            predecoded_instrs += stats.predecoded_instrs.get();
+            compiled_instrs += stats.compiled_instrs.get();
+            for code in 0..TRAP_CAUSE_CNT {
+                exceptions[code] += stats.exceptions[code].get();
+                interrupts[code] += stats.interrupts[code].get();
+            }
+        }
+
+        for (&instr, &count) in RiscvInstr::ALL.iter().zip(instrs.iter()) {
+            if count == 0 {
+                continue;
+            }
+            report.instrs.push((instr, count));
+            match report
+                .instr_classes
+                .iter_mut()
+                .find(|(class, _)| *class == instr.isa_name())
+            {
+                Some((_, total)) => *total += count,
+                None => report.instr_classes.push((instr.isa_name(), count)),
+            }
+        }
+        if predecoded_instrs != 0 {
+            report
+                .instr_classes
+                .push((Self::PREDECODED_CLASS, predecoded_instrs));
+        }
+        if compiled_instrs != 0 {
+            report
+                .instr_classes
+                .push((Self::COMPILED_CLASS, compiled_instrs));
+        }
+        report.instructions = report.instr_classes.iter().map(|(_, count)| count).sum();
+        report.instrs.sort_by(|a, b| b.1.cmp(&a.1));
+        report.instr_classes.sort_by(|a, b| b.1.cmp(&a.1));
+
+        for code in 0..TRAP_CAUSE_CNT {
+            if exceptions[code] != 0 {
+                let cause = Trap::Exception(Exception::from(code));
+                report.traps.push((cause, exceptions[code]));
+            }
+            if interrupts[code] != 0 {
+                let cause = Trap::Interrupt(Interrupt::from(code));
+                report.traps.push((cause, interrupts[code]));
+            }
+        }
+        report.traps.sort_by(|a, b| b.1.cmp(&a.1));
+
+        report
+    }
+
+    /// The report of a run that took `host_time`.
+    pub fn with_host_time(mut self, host_time: Duration) -> Self {
+        self.host_time = Some(host_time);
+        self
+    }
+
+    /// Millions of guest instructions run per host second.
+    pub fn mips(&self) -> Option<f64> {
+        let seconds = self.host_time?.as_secs_f64();
+        (seconds > 0.0).then(|| self.instructions as f64 / seconds / 1e6)
+    }
+
+    /// Average PTEs read by the page walks that reached a leaf.
+    pub fn walk_depth(&self) -> f64 {
+        let walks = self.page_walks - self.page_walk_faults;
+        if walks == 0 {
+            0.0
+        } else {
+            self.page_walk_ptes as f64 / walks as f64
+        }
+    }
+
+    fn share(&self, count: u64) -> f64 {
+        100.0 * count as f64 / self.instructions.max(1) as f64
+    }
+}
+
+impl fmt::Display for StatsReport {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{} instructions in {} cycles",
+            self.instructions, self.cycles
+        )?;
+        if let Some(mips) = self.mips() {
+            write!(f, ", {:.2} MIPS", mips)?;
+        }
+        writeln!(f)?;
+
+        writeln!(f, "caches:")?;
+        for (name, stats) in self.caches.iter() {
+            writeln!(
+                f,
+                "  {:<12} {:>12} hits {:>10} misses {:>10} evictions, hit rate {:.4}",
+                name,
+                stats.hits,
+                stats.misses,
+                stats.evictions,
+                stats.hit_rate()
+            )?;
+        }
+        writeln!(
+            f,
+            "page walks: {}, {} faulted, {:.2} PTEs per walk",
+            self.page_walks,
+            self.page_walk_faults,
+            self.walk_depth()
+        )?;
+
+        writeln!(f, "instructions by class:")?;
+        for (class, count) in self.instr_classes.iter() {
+            writeln!(
+                f,
+                "  {:<12} {:>14} {:>6.2}%",
+                class,
+                count,
+                self.share(*count)
+            )?;
+        }
+        writeln!(f, "most run instructions:")?;
+        for (instr, count) in self.instrs.iter().take(Self::SHOWN_INSTRS) {
+            writeln!(
+                f,
+                "  {:<12} {:>14} {:>6.2}%",
+                instr.name(),
+                count,
+                self.share(*count)
+            )?;
+        }
+
+        writeln!(f, "traps:")?;
+        for (cause, count) in self.traps.iter() {
+            let cause = match cause {
+                Trap::Exception(exception) => format!("{:?}", exception),
+                Trap::Interrupt(interrupt) => format!("{:?}", interrupt),
+            };
+            writeln!(f, "  {:<24} {:>10}", cause, count)?;
+        }
+
+        writeln!(f, "mmio accesses:")?;
+        for device in self.mmio.iter() {
+            writeln!(
+                f,
+                "  {:<16} {:#010x} {:>12}",
+                device.device, device.base, device.accesses
+            )?;
+        }
+        for (index, disk) in self.disks.iter().enumerate() {
+            writeln!(
+                f,
+                "virtio-blk{}: {} reads of {} bytes, {} writes of {} bytes, {} flushes",
+                index, disk.reads, disk.bytes_read, disk.writes, disk.bytes_written, disk.flushes
+            )?;
+        }
+        write!(
+            f,
+            "device poll: {} rounds, {} with interrupts, {} interrupts",
+            self.poll_rounds, self.poll_busy_rounds, self.poll_interrupts
+        )
+    }
+}
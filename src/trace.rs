@@ -0,0 +1,852 @@
+//! Binary trace of the instructions the harts retire, kept with the `trace` feature.
+//!
+//! Each hart traced writes its own file, see [`hart_trace_path`]. The records are encoded on the
+//! hart, in a buffer pushed into a [`byte_ring`] once large enough, and a writer thread drains the
+//! ring into the file. A full ring stalls the hart until the writer catches up, so no record is ever
+//! dropped. Without the feature nothing is traced, and the hooks in the hart compile away.
+//!
+//! # Format
+//!
+//! The file starts with [`MAGIC`], the version ([`VERSION`]), the XLEN as a byte and the hart id as
+//! a varint. Varints are LEB128, signed values are zigzag encoded first. Every record is then one
+//! retired instruction, starting with a byte of [`flags`]:
+//!
+//! - [`flags::SKIPPED`]: a varint of the instructions retired but not selected since the last
+//!   record, so that the index of each record in the run is known.
+//! - [`flags::JUMP`]: the pc is not the one right after the last record, a signed varint of the
+//!   difference follows.
+//! - The raw instruction, 2 bytes with [`flags::COMPRESSED`], 4 otherwise, little-endian.
+//! - [`flags::INT_RD`]: the integer register written, a byte, and its new value as a varint.
+//! - [`flags::FLOAT_RD`]: the float register written, a byte, and its new bits, 8 bytes.
+//! - [`flags::MEM`]: a varint of the accesses, each a byte of [`MemAccessKind`] (high nibble) and
+//!   log2 of the size (low nibble), the virtual address as a signed varint of the difference with
+//!   the last access, and the data as a varint.
+//!
+//! An instruction raising an exception is not recorded, the pc of the trap handler is a jump.
+//! Vector registers are not traced, only the memory accesses of the vector loads and stores, one
+//! per element.
+//!
+//! # Compression
+//!
+//! With the `trace-zstd` feature, the writer thread compresses the file in chunks of
+//! [`CHUNK_LEN`] bytes, each an independent zstd frame, so that a trace cut short by a crash is
+//! still readable up to its last chunk. The frames concatenated are a valid zstd stream, `zstd -d`
+//! gives back the format above.
+//!
+//! [`TraceReader`] reads the records back, [`TraceReader::open`] recognizes a compressed file.
+
+use std::{
+    fs::File,
+    io::{self, BufRead, BufReader, BufWriter, Read, Write},
+    ops::Range,
+    path::{Path, PathBuf},
+    sync::{
+        Arc,
+        atomic::{AtomicBool, Ordering},
+    },
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+use crate::{
+    byte_io::{RingConsumer, RingProducer, byte_ring},
+    config::arch_config::{WordType, XLEN},
+    fpu::soft_float::SoftFPU,
+    isa::{
+        InstrLen,
+        riscv::{
+            RawInstr,
+            instruction::{RVInstrInfo, instr_table::RiscvInstr},
+        },
+    },
+};
+
+/// Whether the harts can be traced, that is the `trace` feature.
+pub const ENABLED: bool = cfg!(feature = "trace");
+/// Whether the traces are compressed, that is the `trace-zstd` feature.
+pub const COMPRESSED: bool = cfg!(feature = "trace-zstd");
+
+pub const MAGIC: &[u8; 8] = b"RVTRACE\0";
+pub const VERSION: u8 = 1;
+
+/// Bits of the byte starting a record.
+pub mod flags {
+    pub const JUMP: u8 = 1 << 0;
+    pub const COMPRESSED: u8 = 1 << 1;
+    pub const INT_RD: u8 = 1 << 2;
+    pub const FLOAT_RD: u8 = 1 << 3;
+    pub const MEM: u8 = 1 << 4;
+    pub const SKIPPED: u8 = 1 << 5;
+}
+
+/// Bytes of the ring between a hart and its writer.
+const RING_CAPACITY: usize = 1 << 20;
+/// Records buffered on the hart before they are pushed into the ring.
+const PUSH_THRESHOLD: usize = 16 * 1024;
+/// How long the writer sleeps when the ring is empty.
+const WRITER_IDLE: Duration = Duration::from_micros(200);
+/// Bytes of records compressed into one zstd frame, with `trace-zstd`.
+pub const CHUNK_LEN: usize = 1 << 20;
+/// zstd level of the chunks, fast enough for the writer to keep up with a hart.
+#[cfg(feature = "trace-zstd")]
+const ZSTD_LEVEL: i32 = 3;
+/// The first bytes of a zstd frame.
+const ZSTD_MAGIC: [u8; 4] = [0x28, 0xb5, 0x2f, 0xfd];
+
+/// The file of the trace of `hart`: `path` itself on a board of one hart, `path.hart<N>` otherwise.
+pub fn hart_trace_path(path: &Path, hart: usize, hart_cnt: usize) -> PathBuf {
+    if hart_cnt == 1 {
+        return path.to_path_buf();
+    }
+    let mut name = path.as_os_str().to_os_string();
+    name.push(format!(".hart{}", hart));
+    PathBuf::from(name)
+}
+
+/// Parse `start..end`, each bound in decimal or in hexadecimal with `0x`, `_` separating digits.
+pub fn parse_range(s: &str) -> Result<Range<u64>, String> {
+    let parse = |bound: &str| {
+        let digits = bound.trim().replace('_', "");
+        match digits.strip_prefix("0x") {
+            Some(hex) => u64::from_str_radix(hex, 16),
+            None => digits.parse(),
+        }
+        .map_err(|e| format!("Invalid bound `{}`: {}", bound, e))
+    };
+    let (start, end) = s
+        .split_once("..")
+        .ok_or_else(|| format!("Expected `start..end`, got `{}`", s))?;
+    let range = parse(start)?..parse(end)?;
+    if range.is_empty() {
+        return Err(format!("Empty range `{}`", s));
+    }
+    Ok(range)
+}
+
+/// The instructions recorded, all of them by default.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct TraceFilter {
+    /// Only the instructions at a pc in this range.
+    pub pc: Option<Range<u64>>,
+    /// Only the instructions retired in this range, counted from 0 when the trace starts.
+    pub window: Option<Range<u64>>,
+}
+
+impl TraceFilter {
+    #[inline]
+    fn selects(&self, index: u64, pc: u64) -> bool {
+        self.window.as_ref().is_none_or(|w| w.contains(&index))
+            && self.pc.as_ref().is_none_or(|r| r.contains(&pc))
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MemAccessKind {
+    Read = 0,
+    Write = 1,
+    /// An AMO, with the value read.
+    Amo = 2,
+}
+
+/// A data access of an instruction, logged by the MMU while the instruction runs.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct MemAccess {
+    pub kind: MemAccessKind,
+    pub addr: u64,
+    /// In bytes.
+    pub size: u8,
+    pub data: u64,
+}
+
+/// The tracer of a hart, see the [module](self) documentation.
+pub struct HartTracer {
+    filter: TraceFilter,
+    /// Float instructions writing their `rd` in the float registers, by [`RiscvInstr`].
+    float_rd: Box<[bool]>,
+
+    /// Instructions retired since the trace started.
+    retired: u64,
+    /// Instructions retired but not selected since the last record.
+    skipped: u64,
+    /// The pc right after the last record.
+    next_pc: WordType,
+    /// Address of the last memory access recorded.
+    last_addr: u64,
+
+    buf: Vec<u8>,
+    producer: RingProducer,
+    closed: Arc<AtomicBool>,
+    writer: Option<JoinHandle<io::Result<()>>>,
+}
+
+impl HartTracer {
+    /// Trace the hart `hart_id` into a new file at `path`.
+    pub fn create(path: &Path, hart_id: usize, filter: TraceFilter) -> io::Result<Self> {
+        Ok(Self::new(Box::new(File::create(path)?), hart_id, filter))
+    }
+
+    pub fn new(out: Box<dyn Write + Send>, hart_id: usize, filter: TraceFilter) -> Self {
+        let (producer, consumer) = byte_ring(RING_CAPACITY);
+        let closed = Arc::new(AtomicBool::new(false));
+        let writer = {
+            let closed = closed.clone();
+            thread::Builder::new()
+                .name(format!("trace-hart{}", hart_id))
+                .spawn(move || write_loop(consumer, out, &closed))
+                .expect("failed to spawn the trace writer")
+        };
+
+        let float_rd = RiscvInstr::ALL
+            .iter()
+            .map(|instr| writes_float_rd(*instr))
+            .collect();
+
+        let mut buf = Vec::with_capacity(2 * PUSH_THRESHOLD);
+        buf.extend_from_slice(MAGIC);
+        buf.push(VERSION);
+        buf.push(XLEN as u8);
+        put_varint(&mut buf, hart_id as u64);
+
+        Self {
+            filter,
+            float_rd,
+            retired: 0,
+            skipped: 0,
+            next_pc: 0,
+            last_addr: 0,
+            buf,
+            producer,
+            closed,
+            writer: Some(writer),
+        }
+    }
+
+    /// Record an instruction that retired, if the filter selects it.
+    ///
+    /// `int_rd` is the integer register it wrote and its new value, and `accesses` the memory
+    /// accesses it did.
+    pub(crate) fn retire(
+        &mut self,
+        pc: WordType,
+        raw: RawInstr,
+        instr: RiscvInstr,
+        info: RVInstrInfo,
+        int_rd: Option<(u8, WordType)>,
+        fpu: &SoftFPU,
+        accesses: &[MemAccess],
+    ) {
+        let index = self.retired;
+        self.retired += 1;
+        if !self.filter.selects(index, pc as u64) {
+            self.skipped += 1;
+            return;
+        }
+
+        let float_rd = match self.float_rd[instr as usize] {
+            true => float_rd_of(info).map(|rd| (rd, fpu.load_raw(rd))),
+            false => None,
+        };
+
+        let mut record_flags = 0;
+        if self.skipped != 0 {
+            record_flags |= flags::SKIPPED;
+        }
+        if pc != self.next_pc {
+            record_flags |= flags::JUMP;
+        }
+        if raw.len() == 2 {
+            record_flags |= flags::COMPRESSED;
+        }
+        if int_rd.is_some() {
+            record_flags |= flags::INT_RD;
+        }
+        if float_rd.is_some() {
+            record_flags |= flags::FLOAT_RD;
+        }
+        if !accesses.is_empty() {
+            record_flags |= flags::MEM;
+        }
+
+        let buf = &mut self.buf;
+        buf.push(record_flags);
+        if self.skipped != 0 {
+            put_varint(buf, self.skipped);
+            self.skipped = 0;
+        }
+        if pc != self.next_pc {
+            put_varint(
+                buf,
+                zigzag((pc as u64).wrapping_sub(self.next_pc as u64) as i64),
+            );
+        }
+        match raw.len() {
+            2 => buf.extend_from_slice(&(raw.val as u16).to_le_bytes()),
+            _ => buf.extend_from_slice(&raw.val.to_le_bytes()),
+        }
+        if let Some((rd, value)) = int_rd {
+            buf.push(rd);
+            put_varint(buf, value as u64);
+        }
+        if let Some((rd, bits)) = float_rd {
+            buf.push(rd);
+            buf.extend_from_slice(&bits.to_le_bytes());
+        }
+        if !accesses.is_empty() {
+            put_varint(buf, accesses.len() as u64);
+            for access in accesses {
+                buf.push((access.kind as u8) << 4 | access.size.trailing_zeros() as u8);
+                put_varint(buf, zigzag(access.addr.wrapping_sub(self.last_addr) as i64));
+                put_varint(buf, access.data);
+                self.last_addr = access.addr;
+            }
+        }
+        self.next_pc = pc.wrapping_add(raw.len());
+
+        if self.buf.len() >= PUSH_THRESHOLD {
+            self.push_records();
+        }
+    }
+
+    /// Move the buffered records into the ring, waiting for room if it is full.
+    fn push_records(&mut self) {
+        let mut bytes = &self.buf[..];
+        while !bytes.is_empty() {
+            let pushed = self.producer.push_slice(bytes);
+            bytes = &bytes[pushed..];
+            if pushed == 0 {
+                if self
+                    .writer
+                    .as_ref()
+                    .is_none_or(|writer| writer.is_finished())
+                {
+                    // The writer failed, the error is reported by `finish`.
+                    break;
+                }
+                thread::yield_now();
+            }
+        }
+        self.buf.clear();
+    }
+
+    /// Write out the records left and close the file.
+    pub fn finish(&mut self) -> io::Result<()> {
+        let Some(writer) = self.writer.as_ref() else {
+            return Ok(());
+        };
+        if !writer.is_finished() {
+            self.push_records();
+        }
+        self.closed.store(true, Ordering::Release);
+        match self.writer.take().unwrap().join() {
+            Ok(result) => result,
+            Err(_) => Err(io::Error::other("the trace writer panicked")),
+        }
+    }
+}
+
+impl Drop for HartTracer {
+    fn drop(&mut self) {
+        if let Err(e) = self.finish() {
+            log::error!("Failed to write the trace: {}", e);
+        }
+    }
+}
+
+fn write_loop(
+    mut consumer: RingConsumer,
+    out: Box<dyn Write + Send>,
+    closed: &AtomicBool,
+) -> io::Result<()> {
+    let mut out = TraceOutput::new(out);
+    loop {
+        // Loaded before draining, so the bytes pushed before the close are drained once more.
+        let done = closed.load(Ordering::Acquire);
+        let mut result = Ok(());
+        let drained = consumer.drain(|bytes| {
+            if result.is_ok() {
+                result = out.write(bytes);
+            }
+        });
+        result?;
+
+        if drained == 0 {
+            if done {
+                break;
+            }
+            thread::sleep(WRITER_IDLE);
+        }
+    }
+    out.finish()
+}
+
+/// The file of a trace on the writer thread, which compresses it with `trace-zstd`.
+struct TraceOutput {
+    out: BufWriter<Box<dyn Write + Send>>,
+    /// The bytes of the chunk not compressed yet.
+    chunk: Vec<u8>,
+}
+
+impl TraceOutput {
+    fn new(out: Box<dyn Write + Send>) -> Self {
+        Self {
+            out: BufWriter::with_capacity(4 * PUSH_THRESHOLD, out),
+            chunk: Vec::with_capacity(if COMPRESSED { CHUNK_LEN } else { 0 }),
+        }
+    }
+
+    fn write(&mut self, bytes: &[u8]) -> io::Result<()> {
+        if !COMPRESSED {
+            return self.out.write_all(bytes);
+        }
+        self.chunk.extend_from_slice(bytes);
+        if self.chunk.len() >= CHUNK_LEN {
+            self.write_chunk()?;
+        }
+        Ok(())
+    }
+
+    /// Compress the chunk into a frame of the file.
+    fn write_chunk(&mut self) -> io::Result<()> {
+        #[cfg(feature = "trace-zstd")]
+        if !self.chunk.is_empty() {
+            let frame = zstd::bulk::compress(&self.chunk, ZSTD_LEVEL)?;
+            self.out.write_all(&frame)?;
+            self.chunk.clear();
+        }
+        Ok(())
+    }
+
+    fn finish(mut self) -> io::Result<()> {
+        self.write_chunk()?;
+        self.out.flush()
+    }
+}
+
+/// Whether `instr` writes the float register named by its `rd`, rather than an integer one.
+fn writes_float_rd(instr: RiscvInstr) -> bool {
+    const INT_RESULT: [&str; 7] = ["FEQ", "FLT", "FLE", "FCLASS", "FMV_X", "FCVT_W", "FCVT_L"];
+
+    matches!(
+        instr.isa_name(),
+        "RV32F" | "RV64F" | "RV32D" | "RV64D" | "RV32C_F" | "RVC_D"
+    ) && !INT_RESULT
+        .iter()
+        .any(|prefix| instr.name().starts_with(prefix))
+}
+
+/// The `rd` of the formats of float instructions writing a float register.
+fn float_rd_of(info: RVInstrInfo) -> Option<u8> {
+    match info {
+        RVInstrInfo::R { rd, .. }
+        | RVInstrInfo::R_rm { rd, .. }
+        | RVInstrInfo::R4_rm { rd, .. }
+        | RVInstrInfo::I { rd, .. }
+        | RVInstrInfo::CL { rd, .. }
+        | RVInstrInfo::CI { rd_rs1: rd, .. } => Some(rd),
+        _ => None,
+    }
+}
+
+#[inline]
+fn put_varint(buf: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        buf.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    buf.push(value as u8);
+}
+
+#[inline]
+fn zigzag(value: i64) -> u64 {
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+fn unzigzag(value: u64) -> i64 {
+    (value >> 1) as i64 ^ -((value & 1) as i64)
+}
+
+/// A record of a trace, as read by [`TraceReader`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct TraceRecord {
+    /// Instructions retired before this one since the trace started.
+    pub index: u64,
+    pub pc: u64,
+    /// The raw instruction, its upper half is zero if compressed.
+    pub raw: u32,
+    pub compressed: bool,
+    pub int_rd: Option<(u8, u64)>,
+    /// The register and its bits.
+    pub float_rd: Option<(u8, u64)>,
+    pub accesses: Vec<MemAccess>,
+}
+
+/// Reads back the records written by a [`HartTracer`].
+pub struct TraceReader<R: Read> {
+    input: R,
+    xlen: u8,
+    hart_id: usize,
+    next_index: u64,
+    next_pc: u64,
+    last_addr: u64,
+}
+
+impl<R: Read> TraceReader<R> {
+    pub fn new(mut input: R) -> io::Result<Self> {
+        let mut header = [0; 10];
+        input.read_exact(&mut header)?;
+        if &header[..8] != MAGIC {
+            return Err(invalid("not a trace"));
+        }
+        if header[8] != VERSION {
+            return Err(invalid("unknown trace version"));
+        }
+        let xlen = header[9];
+        if xlen != 32 && xlen != 64 {
+            return Err(invalid("invalid XLEN"));
+        }
+
+        let mut reader = Self {
+            input,
+            xlen,
+            hart_id: 0,
+            next_index: 0,
+            next_pc: 0,
+            last_addr: 0,
+        };
+        reader.hart_id = reader.varint()? as usize;
+        Ok(reader)
+    }
+
+    pub fn xlen(&self) -> u8 {
+        self.xlen
+    }
+
+    pub fn hart_id(&self) -> usize {
+        self.hart_id
+    }
+
+    /// The next record, `None` at the end of the trace.
+    pub fn next_record(&mut self) -> io::Result<Option<TraceRecord>> {
+        let mut record_flags = [0];
+        if self.input.read(&mut record_flags)? == 0 {
+            return Ok(None);
+        }
+        let [record_flags] = record_flags;
+        let pc_mask = u64::MAX >> (64 - self.xlen);
+
+        if record_flags & flags::SKIPPED != 0 {
+            self.next_index += self.varint()?;
+        }
+        let index = self.next_index;
+        self.next_index += 1;
+
+        let mut pc = self.next_pc;
+        if record_flags & flags::JUMP != 0 {
+            pc = pc.wrapping_add(unzigzag(self.varint()?) as u64) & pc_mask;
+        }
+
+        let compressed = record_flags & flags::COMPRESSED != 0;
+        let raw = match compressed {
+            true => u16::from_le_bytes(self.bytes()?) as u32,
+            false => u32::from_le_bytes(self.bytes()?),
+        };
+        self.next_pc = pc.wrapping_add(if compressed { 2 } else { 4 }) & pc_mask;
+
+        let int_rd = match record_flags & flags::INT_RD != 0 {
+            true => Some((self.byte()?, self.varint()?)),
+            false => None,
+        };
+        let float_rd = match record_flags & flags::FLOAT_RD != 0 {
+            true => Some((self.byte()?, u64::from_le_bytes(self.bytes()?))),
+            false => None,
+        };
+
+        let mut accesses = Vec::new();
+        if record_flags & flags::MEM != 0 {
+            for _ in 0..self.varint()? {
+                let kind_size = self.byte()?;
+                let kind = match kind_size >> 4 {
+                    0 => MemAccessKind::Read,
+                    1 => MemAccessKind::Write,
+                    2 => MemAccessKind::Amo,
+                    _ => return Err(invalid("invalid memory access kind")),
+                };
+                let addr = self.last_addr.wrapping_add(unzigzag(self.varint()?) as u64);
+                self.last_addr = addr;
+                accesses.push(MemAccess {
+                    kind,
+                    addr,
+                    size: 1 << (kind_size & 0xf),
+                    data: self.varint()?,
+                });
+            }
+        }
+
+        Ok(Some(TraceRecord {
+            index,
+            pc,
+            raw,
+            compressed,
+            int_rd,
+            float_rd,
+            accesses,
+        }))
+    }
+
+    fn byte(&mut self) -> io::Result<u8> {
+        Ok(self.bytes::<1>()?[0])
+    }
+
+    fn bytes<const N: usize>(&mut self) -> io::Result<[u8; N]> {
+        let mut bytes = [0; N];
+        self.input.read_exact(&mut bytes)?;
+        Ok(bytes)
+    }
+
+    fn varint(&mut self) -> io::Result<u64> {
+        let mut value = 0;
+        for shift in (0..64).step_by(7) {
+            let byte = self.byte()?;
+            value |= ((byte & 0x7f) as u64) << shift;
+            if byte & 0x80 == 0 {
+                return Ok(value);
+            }
+        }
+        Err(invalid("varint too long"))
+    }
+}
+
+impl TraceReader<Box<dyn Read>> {
+    /// Read the trace of the file at `path`, compressed or not.
+    pub fn open(path: &Path) -> io::Result<Self> {
+        Self::decompress(BufReader::new(File::open(path)?))
+    }
+
+    /// Read the trace of `input`, decompressing it if it starts with a zstd frame.
+    pub fn decompress(mut input: impl BufRead + 'static) -> io::Result<Self> {
+        let compressed = input.fill_buf()?.starts_with(&ZSTD_MAGIC);
+        let input: Box<dyn Read> = match compressed {
+            #[cfg(feature = "trace-zstd")]
+            true => Box::new(zstd::stream::read::Decoder::with_buffer(input)?),
+            #[cfg(not(feature = "trace-zstd"))]
+            true => return Err(invalid("compressed trace, needs the `trace-zstd` feature")),
+            false => Box::new(input),
+        };
+        Self::new(input)
+    }
+}
+
+impl<R: Read> Iterator for TraceReader<R> {
+    type Item = io::Result<TraceRecord>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.next_record().transpose()
+    }
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use super::*;
+
+    /// A file in memory, still readable once the writer thread dropped it.
+    #[derive(Clone, Default)]
+    struct SharedBuf(Arc<Mutex<Vec<u8>>>);
+
+    impl Write for SharedBuf {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.0.lock().unwrap().extend_from_slice(buf);
+            Ok(buf.len())
+        }
+
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    fn read_all(buf: &SharedBuf) -> Vec<TraceRecord> {
+        let bytes = buf.0.lock().unwrap().clone();
+        let reader = TraceReader::decompress(io::Cursor::new(bytes)).unwrap();
+        assert_eq!(reader.hart_id(), 3);
+        assert_eq!(reader.xlen() as usize, XLEN);
+        reader.map(Result::unwrap).collect()
+    }
+
+    const ADDI: u32 = 0x00150513; // addi a0, a0, 1
+    const C_LI: u32 = 0x4505; // c.li a0, 1
+    const R_INFO: RVInstrInfo = RVInstrInfo::R {
+        rs1: 1,
+        rs2: 2,
+        rd: 10,
+    };
+
+    #[test]
+    fn test_records_round_trip() {
+        let out = SharedBuf::default();
+        let mut tracer = HartTracer::new(Box::new(out.clone()), 3, TraceFilter::default());
+        let mut fpu = SoftFPU::new();
+        fpu.store(10, 1.5f64);
+
+        tracer.retire(
+            0x8000_0000,
+            ADDI.into(),
+            RiscvInstr::ADDI,
+            R_INFO,
+            Some((10, 1)),
+            &fpu,
+            &[],
+        );
+        tracer.retire(
+            0x8000_0004,
+            C_LI.into(),
+            RiscvInstr::C_LI,
+            R_INFO,
+            Some((10, 1)),
+            &fpu,
+            &[],
+        );
+        let accesses = [
+            MemAccess {
+                kind: MemAccessKind::Read,
+                addr: 0x8000_1000,
+                size: 8,
+                data: u64::MAX,
+            },
+            MemAccess {
+                kind: MemAccessKind::Write,
+                addr: 0x8000_0ff8,
+                size: 4,
+                data: 7,
+            },
+        ];
+        tracer.retire(
+            0x8000_0006,
+            ADDI.into(),
+            RiscvInstr::FADD_D,
+            R_INFO,
+            None,
+            &fpu,
+            &accesses,
+        );
+        tracer.retire(
+            0x8000_0100,
+            ADDI.into(),
+            RiscvInstr::FEQ_D,
+            R_INFO,
+            Some((10, 0)),
+            &fpu,
+            &[],
+        );
+        tracer.finish().unwrap();
+
+        let records = read_all(&out);
+        assert_eq!(records.len(), 4);
+        assert_eq!(
+            records[0],
+            TraceRecord {
+                index: 0,
+                pc: 0x8000_0000,
+                raw: ADDI,
+                compressed: false,
+                int_rd: Some((10, 1)),
+                float_rd: None,
+                accesses: vec![],
+            }
+        );
+        assert_eq!((records[1].pc, records[1].raw), (0x8000_0004, C_LI));
+        assert!(records[1].compressed);
+        assert_eq!(records[2].pc, 0x8000_0006);
+        assert_eq!(records[2].float_rd, Some((10, 1.5f64.to_bits())));
+        assert_eq!(records[2].accesses, accesses);
+        // A float compare writes an integer register.
+        assert_eq!(records[3].pc, 0x8000_0100);
+        assert_eq!(
+            (records[3].int_rd, records[3].float_rd),
+            (Some((10, 0)), None)
+        );
+    }
+
+    #[test]
+    fn test_filter_selects_pc_range_and_window() {
+        let out = SharedBuf::default();
+        let filter = TraceFilter {
+            pc: Some(0x8000_0010..0x8000_0100),
+            window: Some(2..100),
+        };
+        let mut tracer = HartTracer::new(Box::new(out.clone()), 3, filter);
+        let fpu = SoftFPU::new();
+        for step in 0..200 {
+            let pc = 0x8000_0000 + 4 * (step % 0x80);
+            tracer.retire(pc, ADDI.into(), RiscvInstr::ADDI, R_INFO, None, &fpu, &[]);
+        }
+        tracer.finish().unwrap();
+
+        let records = read_all(&out);
+        let selected: Vec<_> = (2..100)
+            .filter(|step| (0x8000_0010..0x8000_0100).contains(&(0x8000_0000 + 4 * (step % 0x80))))
+            .collect();
+        assert_eq!(
+            records.iter().map(|r| r.index).collect::<Vec<_>>(),
+            selected
+        );
+        assert!(
+            records
+                .iter()
+                .all(|r| r.pc == 0x8000_0000 + 4 * (r.index % 0x80))
+        );
+    }
+
+    #[test]
+    fn test_chunks_round_trip() {
+        let out = SharedBuf::default();
+        let mut tracer = HartTracer::new(Box::new(out.clone()), 3, TraceFilter::default());
+        let fpu = SoftFPU::new();
+        // Several chunks of records, each 5 bytes or more.
+        let cnt = 3 * CHUNK_LEN / 5;
+        for step in 0..cnt {
+            let pc = 0x8000_0000 + 4 * (step % 0x400) as WordType;
+            tracer.retire(pc, ADDI.into(), RiscvInstr::ADDI, R_INFO, None, &fpu, &[]);
+        }
+        tracer.finish().unwrap();
+
+        let len = out.0.lock().unwrap().len();
+        assert_eq!(out.0.lock().unwrap().starts_with(&ZSTD_MAGIC), COMPRESSED);
+        if COMPRESSED {
+            assert!(len < CHUNK_LEN);
+        }
+        let records = read_all(&out);
+        assert_eq!(records.len(), cnt);
+        assert!(
+            records
+                .iter()
+                .zip(0..)
+                .all(|(r, index)| r.index == index && r.pc == 0x8000_0000 + 4 * (index % 0x400))
+        );
+    }
+
+    #[test]
+    fn test_parse_range() {
+        assert_eq!(
+            parse_range("0x8000_0000..0x8000_1000"),
+            Ok(0x8000_0000..0x8000_1000)
+        );
+        assert_eq!(parse_range("10..20"), Ok(10..20));
+        assert!(parse_range("20..10").is_err());
+        assert!(parse_range("10").is_err());
+    }
+
+    #[test]
+    fn test_hart_trace_path() {
+        let path = Path::new("/tmp/run.trace");
+        assert_eq!(hart_trace_path(path, 0, 1), path);
+        assert_eq!(
+            hart_trace_path(path, 1, 2),
+            Path::new("/tmp/run.trace.hart1")
+        );
+    }
+}
@@ -8,7 +8,7 @@ use rustc_apfloat::StatusAnd;
 
 use crate::{
     config::arch_config::{SignedWordType, WordType, XLEN},
-    fpu::soft_float::APFloatOf,
+    fpu::soft_float::{APFloatOf, HostFloat},
 };
 
 #[macro_export]
@@ -562,6 +562,7 @@ pub trait FloatPoint:
     + Display
     + InBits<Self::BitsType>
     + APFloatOf
+    + HostFloat
 {
     type BitsType: UnsignedInteger;
 
@@ -1,59 +1,127 @@
-use std::{cell::Cell, rc::Rc, u64};
+use std::{
+    sync::{
+        Arc,
+        atomic::{AtomicU64, Ordering},
+    },
+    u64,
+};
 
-/// Simple clock, clone by ref, cannot used in multi-threaded context.
+/// Simple clock, clone by ref.
+///
+/// The time is atomic, so that the hart threads of a board read it while the board owns it. Only
+/// the board sets or advances it, between the quanta of the harts, see
+/// [`VirtBoard::run_slice`](crate::board::virt::VirtBoard::run_slice).
 #[derive(Clone)]
 pub struct VirtualClockRef {
-    time: Rc<Cell<u64>>,
+    time: Arc<AtomicU64>,
 }
 
 impl VirtualClockRef {
     pub fn new() -> Self {
         Self {
-            time: Rc::new(Cell::new(0)),
+            time: Arc::new(AtomicU64::new(0)),
         }
     }
 
     pub fn set(&self, time: u64) {
-        self.time.set(time);
+        self.time.store(time, Ordering::Relaxed);
     }
 
+    /// Not an atomic add, as only one thread changes the time.
     pub fn advance(&self, delta: u64) {
-        let prev = self.time.get();
-        self.time.set(prev.wrapping_add(delta));
+        let prev = self.now();
+        self.set(prev.wrapping_add(delta));
     }
 
+    #[inline(always)]
     pub fn now(&self) -> u64 {
-        self.time.get()
+        self.time.load(Ordering::Relaxed)
     }
 }
 
+/// A time running with a [`VirtualClockRef`] from an offset that its owner sets, such as `mtime`.
+///
+/// Clones share the offset, so that whoever reads the time sees the writes of the owner.
+/// The offset is atomic, as the harts read the time from their threads while one of them may be
+/// writing `mtime`.
+#[derive(Clone)]
+pub struct OffsetClockRef {
+    clock: VirtualClockRef,
+    offset: Arc<AtomicU64>,
+}
+
+impl OffsetClockRef {
+    /// A time reading `0` now.
+    pub fn new(clock: VirtualClockRef) -> Self {
+        let offset = Arc::new(AtomicU64::new(clock.now().wrapping_neg()));
+        Self { clock, offset }
+    }
+
+    #[inline(always)]
+    pub fn now(&self) -> u64 {
+        self.clock.now().wrapping_add(self.offset())
+    }
+
+    /// Make the time read `value` now.
+    pub fn set(&self, value: u64) {
+        self.set_offset(value.wrapping_sub(self.clock.now()));
+    }
+
+    /// The time of the clock when this time reads `value`.
+    pub fn clock_time_of(&self, value: u64) -> u64 {
+        value.wrapping_sub(self.offset())
+    }
+
+    #[inline(always)]
+    pub fn offset(&self) -> u64 {
+        self.offset.load(Ordering::Relaxed)
+    }
+
+    pub fn set_offset(&self, offset: u64) {
+        self.offset.store(offset, Ordering::Relaxed);
+    }
+}
+
+/// Position in [`Timer::heap`] of a task without a due time.
+const NOT_SCHEDULED: usize = usize::MAX;
+
 struct ScheduledTask {
     due: u64,
-    seq: u64,
-    callback: Box<dyn FnMut()>,
+    /// Index in [`Timer::heap`], or [`NOT_SCHEDULED`].
+    heap_pos: usize,
+    callback: Box<dyn FnMut() + Send>,
 }
 
 impl ScheduledTask {
-    fn new<F: FnMut() + 'static>(seq: u64, callback: F) -> Self {
+    fn new<F: FnMut() + Send + 'static>(callback: F) -> Self {
         Self {
             due: u64::MAX,
-            seq: seq,
+            heap_pos: NOT_SCHEDULED,
             callback: Box::new(callback),
         }
     }
 }
 
+/// Runs callbacks at given times of a [`VirtualClockRef`].
+///
+/// Tasks are registered once and identified by the sequence ID [`Timer::register`] returns,
+/// which is also their index in `tasks`. The scheduled ones are kept in a binary min-heap indexed by
+/// due time, and every task remembers its position in it, so that:
+/// - [`Timer::next_due`] is O(1),
+/// - [`Timer::set_due`] and [`Timer::cancel`] are O(log n),
+/// - [`Timer::tick`] only touches the tasks that are due.
 pub struct Timer {
-    seq: u64,
     tasks: Vec<ScheduledTask>,
+    /// Indices in `tasks`, ordered by `(due, seq)`.
+    heap: Vec<usize>,
     vclock: VirtualClockRef,
 }
 
 impl Timer {
     pub fn new(vclock: VirtualClockRef) -> Self {
         Self {
-            seq: 0,
             tasks: Vec::new(),
+            heap: Vec::new(),
             vclock,
         }
     }
@@ -62,58 +130,130 @@ impl Timer {
     #[must_use]
     pub fn register<F>(&mut self, callback: F) -> u64
     where
-        F: FnMut() + 'static,
+        F: FnMut() + Send + 'static,
     {
-        let st = ScheduledTask::new(self.seq, callback);
-        self.seq += 1;
-        self.tasks.push(st);
-
-        self.seq - 1
-    }
-
-    pub fn build(&mut self) {
-        self.tasks.sort_unstable_by_key(|task| task.due);
+        self.tasks.push(ScheduledTask::new(callback));
+        self.tasks.len() as u64 - 1
     }
 
     /// Set the due time, use [`Timer::set_delay`] for a certain delay.
     ///
-    /// NOTE: If you want to change multiply tasks, use [`Timer::guard`] instead.
+    /// A due of `u64::MAX` never comes, and is the same as [`Timer::cancel`].
     pub fn set_due(&mut self, seq: u64, new_due: u64) {
-        self.guard().set_due(seq, new_due);
+        let Some(task) = self.tasks.get_mut(seq as usize) else {
+            log::warn!("set due of unknown timer task {}", seq);
+            return;
+        };
+
+        if new_due == u64::MAX {
+            self.cancel(seq);
+            return;
+        }
+
+        let old_due = std::mem::replace(&mut task.due, new_due);
+        let pos = task.heap_pos;
+        if pos == NOT_SCHEDULED {
+            self.heap.push(seq as usize);
+            self.tasks[seq as usize].heap_pos = self.heap.len() - 1;
+            self.sift_up(self.heap.len() - 1);
+        } else if new_due < old_due {
+            self.sift_up(pos);
+        } else {
+            self.sift_down(pos);
+        }
     }
 
     /// Set the due time to the current time + given delay.
-    ///
-    /// NOTE: If you want to change multiply tasks, use [`Timer::guard`] instead.
     pub fn set_delay(&mut self, seq: u64, delay: u64) {
         let now = self.vclock.now();
         self.set_due(seq, now.saturating_add(delay));
     }
 
-    /// Start a guard that allows batching multiple changes without rebuilding on each change.
-    /// When the returned `TimerGuard` is dropped, the timer will be rebuilt.
+    /// Unschedule a task, it stays registered and can be scheduled again.
+    pub fn cancel(&mut self, seq: u64) {
+        let Some(task) = self.tasks.get_mut(seq as usize) else {
+            return;
+        };
+        task.due = u64::MAX;
+        let pos = std::mem::replace(&mut task.heap_pos, NOT_SCHEDULED);
+        if pos == NOT_SCHEDULED {
+            return;
+        }
+
+        let last = self.heap.pop().unwrap();
+        if pos < self.heap.len() {
+            self.heap[pos] = last;
+            self.tasks[last].heap_pos = pos;
+            self.sift_down(pos);
+            self.sift_up(pos);
+        }
+    }
+
+    /// Start a guard that allows batching multiple changes.
+    ///
+    /// Every change already keeps the timer ordered, the guard only groups them.
     pub fn guard(&mut self) -> TimerGuard<'_> {
         TimerGuard { timer: self }
     }
 
-    /// Run all tasks whose due time is <= the timer's clock `now()`.
+    /// Run all tasks whose due time is <= the timer's clock `now()`, in due order.
+    ///
+    /// A task is unscheduled before its callback runs.
     pub fn tick(&mut self) {
         let now = self.vclock.now();
 
-        self.tasks
-            .iter_mut()
-            .take_while(|task| task.due <= now)
-            .for_each(|task| {
-                (task.callback)();
-                task.due = u64::MAX;
-            });
-
-        self.build();
+        while let Some(&idx) = self.heap.first() {
+            if self.tasks[idx].due > now {
+                break;
+            }
+            self.cancel(idx as u64);
+            (self.tasks[idx].callback)();
+        }
     }
 
     /// Peek the next scheduled due time, if any.
+    #[inline]
     pub fn next_due(&self) -> Option<u64> {
-        self.tasks.first().map(|s| s.due)
+        self.heap.first().map(|&idx| self.tasks[idx].due)
+    }
+
+    #[inline]
+    fn key(&self, heap_pos: usize) -> (u64, usize) {
+        let idx = self.heap[heap_pos];
+        (self.tasks[idx].due, idx)
+    }
+
+    fn swap(&mut self, a: usize, b: usize) {
+        self.heap.swap(a, b);
+        self.tasks[self.heap[a]].heap_pos = a;
+        self.tasks[self.heap[b]].heap_pos = b;
+    }
+
+    fn sift_up(&mut self, mut pos: usize) {
+        while pos > 0 {
+            let parent = (pos - 1) / 2;
+            if self.key(parent) <= self.key(pos) {
+                break;
+            }
+            self.swap(parent, pos);
+            pos = parent;
+        }
+    }
+
+    fn sift_down(&mut self, mut pos: usize) {
+        loop {
+            let mut min = pos;
+            for child in [2 * pos + 1, 2 * pos + 2] {
+                if child < self.heap.len() && self.key(child) < self.key(min) {
+                    min = child;
+                }
+            }
+            if min == pos {
+                break;
+            }
+            self.swap(min, pos);
+            pos = min;
+        }
     }
 }
 
@@ -126,29 +266,70 @@ impl<'a> TimerGuard<'a> {
     /// See [Timer::register].
     pub fn register<F>(&mut self, callback: F) -> u64
     where
-        F: FnMut() + 'static,
+        F: FnMut() + Send + 'static,
     {
         self.timer.register(callback)
     }
 
     /// See [`Timer::set_due`].
     pub fn set_due(&mut self, seq: u64, new_due: u64) {
-        self.timer
-            .tasks
-            .iter_mut()
-            .find(|task| task.seq == seq)
-            .map(|task| task.due = new_due);
+        self.timer.set_due(seq, new_due);
     }
 
     /// See [`Timer::set_delay`].
     pub fn set_delay(&mut self, seq: u64, delay: u64) {
-        let now = self.timer.vclock.now();
-        self.set_due(seq, now.saturating_add(delay));
+        self.timer.set_delay(seq, delay);
+    }
+
+    /// See [`Timer::cancel`].
+    pub fn cancel(&mut self, seq: u64) {
+        self.timer.cancel(seq);
     }
 }
 
-impl<'a> Drop for TimerGuard<'a> {
-    fn drop(&mut self) {
-        self.timer.build();
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use super::*;
+
+    #[test]
+    fn test_timer_order_and_cancel() {
+        let clock = VirtualClockRef::new();
+        let mut timer = Timer::new(clock.clone());
+        let fired = Arc::new(Mutex::new(Vec::new()));
+
+        let ids: Vec<u64> = (0..5)
+            .map(|i| {
+                let fired = fired.clone();
+                timer.register(move || fired.lock().unwrap().push(i))
+            })
+            .collect();
+        assert_eq!(timer.next_due(), None);
+
+        for (&id, due) in ids.iter().zip([50, 10, 40, 20, 30]) {
+            timer.set_due(id, due);
+        }
+        assert_eq!(timer.next_due(), Some(10));
+
+        // Reschedule both ways, and cancel one.
+        timer.set_due(ids[0], 5);
+        timer.set_due(ids[1], 35);
+        timer.cancel(ids[2]);
+        assert_eq!(timer.next_due(), Some(5));
+
+        clock.set(30);
+        timer.tick();
+        assert_eq!(*fired.lock().unwrap(), vec![0, 3, 4]);
+        assert_eq!(timer.next_due(), Some(35));
+
+        // Fired tasks are unscheduled.
+        clock.set(100);
+        timer.tick();
+        assert_eq!(*fired.lock().unwrap(), vec![0, 3, 4, 1]);
+        assert_eq!(timer.next_due(), None);
+
+        timer.set_delay(ids[2], 1);
+        assert_eq!(timer.next_due(), Some(101));
     }
 }
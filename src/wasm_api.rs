@@ -68,4 +68,22 @@ impl WasmEmulator {
     pub fn take_uart_output(&mut self) -> Vec<u8> {
         self.inner.take_uart_output_bytes()
     }
+
+    /// The statistics counters as text, `undefined` unless built with the `stats` feature.
+    pub fn stats(&self) -> Option<String> {
+        self.inner.stats().map(|report| report.to_string())
+    }
+
+    /// The whole machine, to be given back to [`Self::restore`] on an emulator built the same way.
+    pub fn snapshot(&mut self) -> Result<Vec<u8>, JsValue> {
+        self.inner
+            .snapshot_bytes()
+            .map_err(|e| JsValue::from_str(&format!("{e}")))
+    }
+
+    pub fn restore(&mut self, bytes: &[u8]) -> Result<(), JsValue> {
+        self.inner
+            .restore_bytes(bytes)
+            .map_err(|e| JsValue::from_str(&format!("{e}")))
+    }
 }
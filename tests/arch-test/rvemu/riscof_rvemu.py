@@ -206,6 +206,8 @@ class rvemu(pluginTemplate):
         # function earlier
         make.makeCommand = "make -k -j" + self.num_jobs
 
+        batch_list = []
+
         # we will iterate over each entry in the testList. Each entry node will be referred to by the
         # variable testname.
         for testname in testList:
@@ -227,7 +229,6 @@ class rvemu(pluginTemplate):
             # be named as DUT-<dut-name>.signature. The below variable creates an absolute path of
             # signature file.
             sig_file = os.path.join(test_dir, self.name[:-1] + ".signature")
-            log_file = os.path.join(test_dir, self.name[:-1] + ".log")
 
             # for each test there are specific compile macros that need to be enabled. The macros in
             # the testList node only contain the macros/values. For the gcc toolchain we need to
@@ -241,22 +242,12 @@ class rvemu(pluginTemplate):
                 self.isa.lower(), self.xlen, test, elf, compile_macros
             )
 
-            # if the user wants to disable running the tests and only compile the tests, then
-            # the "else" clause is executed below assigning the sim command to simple no action
-            # echo statement.
-            if self.target_run:
-                # set up the simulation command. Template is for spike. Please change.
-                # simcmd = self.dut_exe + ' --misaligned --isa={0} +signature={1} +signature-granularity=8 {2}'.format(self.isa, sig_file, elf)
-                # simcmd = simcmd + ';' + self.dut_exe + ' --isa={0} --log-commits -l my.elf 2> {1}'.format(self.isa, log_file)
-
-                simcmd = "{} {} --signature {} --signature-granularity 8 --max-cycles 1000000 --loglevel info > {} 2>&1".format(
-                    self.dut_exe, elf, sig_file, log_file
-                )
-            else:
-                simcmd = 'echo "NO RUN"'
+            # the tests are only compiled by make, they are all run at once by the batch mode of the
+            # emulator below, one line of the test list per test.
+            batch_list.append("{} {}".format(os.path.join(test_dir, elf), sig_file))
 
             # concatenate all commands that need to be executed within a make-target.
-            execute = "@cd {}; {}; {};".format(testentry["work_dir"], cmd, simcmd)
+            execute = "@cd {}; {};".format(testentry["work_dir"], cmd)
 
             # create a target. The makeutil will create a target with the name "TARGET<num>" where num
             # starts from 0 and increments automatically for each new target that is added
@@ -277,3 +268,29 @@ class rvemu(pluginTemplate):
         # the makefile targets.
         if not self.target_run:
             raise SystemExit(0)
+
+        # run all the compiled tests in one process, on as many threads as make has jobs. Failed
+        # tests are found by the signature check of RISCOF, so the exit code is not checked.
+        list_file = os.path.join(self.work_dir, self.name[:-1] + "-batch.list")
+        log_file = os.path.join(self.work_dir, self.name[:-1] + "-batch.log")
+        with open(list_file, "w") as f:
+            f.write("\n".join(batch_list) + "\n")
+        with open(log_file, "w") as log:
+            subprocess.run(
+                [
+                    self.dut_exe,
+                    list_file,
+                    "--batch",
+                    "--jobs",
+                    self.num_jobs,
+                    "--signature-granularity",
+                    "8",
+                    "--max-cycles",
+                    "1000000",
+                    "--loglevel",
+                    "info",
+                ],
+                stdout=log,
+                stderr=subprocess.STDOUT,
+                timeout=3600,
+            )
@@ -9,11 +9,10 @@ use std::fs;
 use std::path::{Path, PathBuf};
 
 use crossterm::style::Stylize;
-use riscv_emulator::board::virt::VirtBoard;
-use riscv_emulator::board::{Board, BoardStatus};
-use riscv_emulator::config::arch_config::WordType;
-use riscv_emulator::isa::DebugTarget;
-use riscv_emulator::isa::riscv::debugger::Address;
+use riscv_emulator::batch::{BatchConfig, BatchJob, BatchOutcome, BatchResult, run_batch};
+
+/// Cycles before a test times out.
+const MAX_CYCLES: u64 = 10_000_000;
 
 fn find_tests_exclude(prefix: &str, exclude_names: &[&str]) -> Vec<PathBuf> {
     let mut paths = Vec::new();
@@ -40,63 +39,28 @@ fn find_tests_exclude(prefix: &str, exclude_names: &[&str]) -> Vec<PathBuf> {
     paths
 }
 
+/// Print how a test went, returns whether it passed.
 #[must_use]
-fn run_test(elf_path: &Path) -> bool {
-    // Load the ELF file and run it
-    let result = std::panic::catch_unwind(|| {
-        let mut timeout = false;
-        let mut run_result = false;
-        let mut board = VirtBoard::from_elf(std::fs::read(elf_path).unwrap());
-        let tohost: WordType = board.loader().unwrap().get_section_addr(".tohost").unwrap();
-
-        while board.status() != BoardStatus::Halt {
-            board.step().unwrap();
-
-            // Handle tohost
-            let instr_cnt = board.clock.now();
-            if (instr_cnt & (0xFFF)) == 0 {
-                let msg = board.cpu.read_memory::<u64>(Address::Phys(tohost)).unwrap();
-
-                if msg != 0 {
-                    run_result = msg == 1;
-                    break;
-                }
-            }
-
-            if instr_cnt > 10_000_000 {
-                timeout = true;
-                break;
-            }
-        }
-
-        return (run_result, timeout);
-    });
-
+fn report(result: &BatchResult) -> bool {
     let width = 48;
+    let elf = result.elf.display();
 
-    match result {
-        Err(e) => {
-            eprintln!(
-                "Test {:<width$}{}: {:?}",
-                elf_path.display(),
-                "panicked".red(),
-                e
-            );
+    match &result.outcome {
+        _ if result.passed() => {
+            eprintln!("Test {:<width$}{}", elf, "passed".green());
+            true
+        }
+        BatchOutcome::Error(e) => {
+            eprintln!("Test {:<width$}{}: {}", elf, "error".red(), e);
             false
         }
-
-        Ok((false, timeout)) => {
-            if timeout {
-                eprintln!("Test {:<width$}{}", elf_path.display(), "timedout".red());
-            } else {
-                eprintln!("Test {:<width$}{}", elf_path.display(), "failed".red());
-            }
+        BatchOutcome::MaxCycles => {
+            eprintln!("Test {:<width$}{}", elf, "timedout".red());
             false
         }
-
-        Ok((true, _)) => {
-            eprintln!("Test {:<width$}{}", elf_path.display(), "passed".green());
-            true
+        BatchOutcome::ToHost(_) | BatchOutcome::Halted => {
+            eprintln!("Test {:<width$}{}", elf, "failed".red());
+            false
         }
     }
 }
@@ -115,9 +79,19 @@ fn run_test_group_exclude(name: &str, exclude_names: &[&str]) {
 
     let tot = tests.len();
 
+    let jobs = tests
+        .into_iter()
+        .map(|elf| BatchJob {
+            elf,
+            signature: None,
+            max_cycles: MAX_CYCLES,
+        })
+        .collect();
+    let results = run_batch(jobs, &BatchConfig::default(), |_| {});
+
     let mut fail_cnt = 0;
-    for elf in tests {
-        fail_cnt += !run_test(&elf) as u32;
+    for result in &results {
+        fail_cnt += !report(result) as u32;
     }
 
     if fail_cnt > 0 {